@@ -0,0 +1,1096 @@
+/**
+ * @file barcode.c
+ * @brief Barcode fast path.
+ * @note A frame is cut into BARCODE_CELL square cells and the absolute
+ * horizontal and vertical luma differences of each are summed, which is the
+ * only pass over every pixel and is selected at compile time (see SIMD in
+ * the Makefile): NEON on ARM, AVX2 on x86 (PSADBW sums the differences
+ * directly), scalar otherwise. Cells with strong edges in one direction only
+ * are bars; connected groups of them are read along a few scanlines as
+ * EAN-13. Cells with edges both ways are searched row by row for the
+ * 1:1:3:1:1 run pattern of a QR finder, and three finders forming a right
+ * angle are reported as a QR code. Decoding a QR symbol (sampling the grid, unmasking,
+ * Reed-Solomon) is left to whoever reads the socket, with the region given.
+ */
+
+#include "barcode.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+/**
+ * @brief Mean absolute difference per pixel, both directions added, above
+ * which a cell has edges.
+ */
+#define BARCODE_EDGE_MIN 12
+
+/**
+ * @brief A cell is bars when the differences across them are this many
+ * times those along them.
+ */
+#define BARCODE_DIRECTION_RATIO 3
+
+/**
+ * @brief Smallest group of bar cells read, and its smallest extent along
+ * the scanlines, in cells.
+ */
+#define BARCODE_MIN_REGION_CELLS 4
+#define BARCODE_MIN_REGION_LENGTH 4
+
+/**
+ * @brief Scanlines tried across a bar region.
+ */
+#define BARCODE_SCANLINES 5
+
+/**
+ * @brief Smallest luma swing along a scanline worth binarizing.
+ */
+#define BARCODE_MIN_CONTRAST 32
+
+/**
+ * @brief Runs of an EAN-13 symbol: 3 guard, 6 x 4 digit, 5 guard, 6 x 4
+ * digit, 3 guard; and its width in modules.
+ */
+#define BARCODE_EAN13_RUNS 59
+#define BARCODE_EAN13_MODULES 95
+
+/**
+ * @brief Rows of a cell row searched for finder patterns: every other one.
+ */
+#define BARCODE_FINDER_ROW_STEP 2
+
+/**
+ * @brief Cells each side of a textured cell searched with it, so a finder
+ * whose centre is larger than a cell is still crossed whole.
+ */
+#define BARCODE_FINDER_SPREAD 2
+
+/**
+ * @brief What a cell looks like.
+ */
+enum {
+  /** Too few edges to be part of a code. */
+  CELL_FLAT,
+  /** Vertical bars, read left to right. */
+  CELL_BARS_X,
+  /** Horizontal bars, read top to bottom. */
+  CELL_BARS_Y,
+  /** Edges both ways: text, texture, or a 2D code. */
+  CELL_TEXTURE,
+};
+
+/**
+ * @brief Digit patterns as widths of (space, bar, space, bar) in modules:
+ * the L set first, then the G set, which is L mirrored. The R set is L
+ * with bars and spaces swapped, so the same widths read from a bar.
+ */
+static const uint8_t ean_patterns[20][4] = {
+    {3, 2, 1, 1}, {2, 2, 2, 1}, {2, 1, 2, 2}, {1, 4, 1, 1}, {1, 1, 3, 2},
+    {1, 2, 3, 1}, {1, 1, 1, 4}, {1, 3, 1, 2}, {1, 2, 1, 3}, {3, 1, 1, 2},
+    {1, 1, 2, 3}, {1, 2, 2, 2}, {2, 2, 1, 2}, {1, 1, 4, 1}, {2, 3, 1, 1},
+    {1, 3, 2, 1}, {4, 1, 1, 1}, {2, 1, 3, 1}, {3, 1, 2, 1}, {2, 1, 1, 3},
+};
+
+/**
+ * @brief L/G parities of the six left digits (G set, first digit in the
+ * top bit) by leading digit.
+ */
+static const uint8_t ean_parities[10] = {0x00, 0x0b, 0x0d, 0x0e, 0x13,
+                                         0x19, 0x1c, 0x15, 0x16, 0x1a};
+
+int barcode_supports(__u32 pixelformat) {
+  return pixelformat == V4L2_PIX_FMT_GREY || pixelformat == V4L2_PIX_FMT_YUYV;
+}
+
+/**
+ * @brief Current CLOCK_MONOTONIC time in nanoseconds.
+ */
+static long long monotonic_ns(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+#if defined(__ARM_NEON)
+
+/**
+ * @brief Edge and level sums of one cell: stats[0] is the sum of absolute
+ * differences between horizontal neighbours, stats[1] between vertical
+ * neighbours, stats[2] the sum of the pixels. Reads one column right of
+ * and one row below the cell. A 16-bit lane collects at most 32 bytes.
+ */
+static void cell_stats(const uint8_t *p, size_t stride, uint32_t stats[3]) {
+  uint16x8_t gx = vdupq_n_u16(0);
+  uint16x8_t gy = vdupq_n_u16(0);
+  uint16x8_t sum = vdupq_n_u16(0);
+  int y;
+
+  for (y = 0; y < BARCODE_CELL; y++) {
+    const uint8_t *row = p + y * stride;
+    uint8x16_t a = vld1q_u8(row);
+
+    gx = vpadalq_u8(gx, vabdq_u8(a, vld1q_u8(row + 1)));
+    gy = vpadalq_u8(gy, vabdq_u8(a, vld1q_u8(row + stride)));
+    sum = vpadalq_u8(sum, a);
+  }
+  stats[0] = (uint32_t)vaddvq_u32(vpaddlq_u16(gx));
+  stats[1] = (uint32_t)vaddvq_u32(vpaddlq_u16(gy));
+  stats[2] = (uint32_t)vaddvq_u32(vpaddlq_u16(sum));
+}
+
+#elif defined(__AVX2__)
+
+/**
+ * @brief Add up the four 64-bit lanes PSADBW leaves.
+ */
+static uint32_t sad_total(__m256i v) {
+  __m128i s = _mm_add_epi64(_mm256_castsi256_si128(v),
+                            _mm256_extracti128_si256(v, 1));
+
+  return (uint32_t)(_mm_cvtsi128_si64(s) + _mm_extract_epi64(s, 1));
+}
+
+/**
+ * @brief Edge and level sums of one cell: stats[0] is the sum of absolute
+ * differences between horizontal neighbours, stats[1] between vertical
+ * neighbours, stats[2] the sum of the pixels. Reads one column right of
+ * and one row below the cell. Two rows per 256-bit register.
+ */
+static void cell_stats(const uint8_t *p, size_t stride, uint32_t stats[3]) {
+  const __m256i zero = _mm256_setzero_si256();
+  __m256i gx = zero;
+  __m256i gy = zero;
+  __m256i sum = zero;
+  int y;
+
+  for (y = 0; y < BARCODE_CELL; y += 2) {
+    const uint8_t *row = p + y * stride;
+    __m256i a = _mm256_loadu2_m128i((const __m128i *)(row + stride),
+                                    (const __m128i *)row);
+    __m256i right = _mm256_loadu2_m128i((const __m128i *)(row + stride + 1),
+                                        (const __m128i *)(row + 1));
+    __m256i below = _mm256_loadu2_m128i((const __m128i *)(row + 2 * stride),
+                                        (const __m128i *)(row + stride));
+
+    gx = _mm256_add_epi64(gx, _mm256_sad_epu8(a, right));
+    gy = _mm256_add_epi64(gy, _mm256_sad_epu8(a, below));
+    sum = _mm256_add_epi64(sum, _mm256_sad_epu8(a, zero));
+  }
+  stats[0] = sad_total(gx);
+  stats[1] = sad_total(gy);
+  stats[2] = sad_total(sum);
+}
+
+#else
+
+/**
+ * @brief Edge and level sums of one cell: stats[0] is the sum of absolute
+ * differences between horizontal neighbours, stats[1] between vertical
+ * neighbours, stats[2] the sum of the pixels. Reads one column right of
+ * and one row below the cell.
+ */
+static void cell_stats(const uint8_t *p, size_t stride, uint32_t stats[3]) {
+  uint32_t gx = 0;
+  uint32_t gy = 0;
+  uint32_t sum = 0;
+  int x;
+  int y;
+
+  for (y = 0; y < BARCODE_CELL; y++) {
+    const uint8_t *row = p + y * stride;
+
+    for (x = 0; x < BARCODE_CELL; x++) {
+      gx += (uint32_t)abs(row[x] - row[x + 1]);
+      gy += (uint32_t)abs(row[x] - row[x + stride]);
+      sum += row[x];
+    }
+  }
+  stats[0] = gx;
+  stats[1] = gy;
+  stats[2] = sum;
+}
+
+#endif
+
+int barcode_detector_init(struct barcode_detector_t *detector,
+                          const struct v4l2_pix_format *format) {
+  size_t bpp = format->pixelformat == V4L2_PIX_FMT_YUYV ? 2 : 1;
+  size_t cells;
+  size_t longest;
+
+  memset(detector, 0, sizeof(*detector));
+  if (!barcode_supports(format->pixelformat) ||
+      format->width < 3 * BARCODE_CELL || format->height < 3 * BARCODE_CELL ||
+      format->bytesperline < format->width * bpp) {
+    errno = EINVAL;
+    return -1;
+  }
+  detector->format = *format;
+  detector->cells_x = format->width / BARCODE_CELL;
+  detector->cells_y = format->height / BARCODE_CELL;
+  cells = (size_t)detector->cells_x * detector->cells_y;
+  /* Component labels are 16 bits. */
+  if (cells > UINT16_MAX) {
+    errno = EINVAL;
+    return -1;
+  }
+  longest = format->width > format->height ? format->width : format->height;
+
+  /* A padding row below and a vector's worth after it for the reads past
+   * the last cell. */
+  detector->luma = malloc((size_t)format->width * (format->height + 1) + 32);
+  detector->cell_class = malloc(cells);
+  detector->cell_mean = malloc(cells);
+  detector->cell_threshold = malloc(cells);
+  detector->cell_label = malloc(cells * sizeof(*detector->cell_label));
+  detector->cell_stack = malloc(cells * sizeof(*detector->cell_stack));
+  detector->line = malloc(longest);
+  detector->runs = malloc((longest + 2) * sizeof(*detector->runs));
+  if (detector->luma == NULL || detector->cell_class == NULL ||
+      detector->cell_mean == NULL || detector->cell_threshold == NULL ||
+      detector->cell_label == NULL || detector->cell_stack == NULL ||
+      detector->line == NULL || detector->runs == NULL) {
+    barcode_detector_destroy(detector);
+    errno = ENOMEM;
+    return -1;
+  }
+  memset(detector->luma + (size_t)format->width * (format->height + 1), 0,
+         32);
+  return 0;
+}
+
+/**
+ * @brief Copy the luma of a frame into the detector's plane and repeat its
+ * last row into the padding row.
+ */
+static void extract_luma(struct barcode_detector_t *detector,
+                         const uint8_t *frame) {
+  const struct v4l2_pix_format *format = &detector->format;
+  uint8_t *luma = detector->luma;
+  __u32 x;
+  __u32 y;
+
+  for (y = 0; y < format->height; y++) {
+    const uint8_t *src = frame + (size_t)y * format->bytesperline;
+    uint8_t *dst = luma + (size_t)y * format->width;
+
+    if (format->pixelformat == V4L2_PIX_FMT_GREY) {
+      memcpy(dst, src, format->width);
+    } else {
+      for (x = 0; x < format->width; x++) {
+        dst[x] = src[2 * x];
+      }
+    }
+  }
+  memcpy(luma + (size_t)format->height * format->width,
+         luma + (size_t)(format->height - 1) * format->width, format->width);
+}
+
+/**
+ * @brief Classify every cell and work out its mean and threshold.
+ */
+static void classify_cells(struct barcode_detector_t *detector) {
+  const size_t width = detector->format.width;
+  const uint32_t area = BARCODE_CELL * BARCODE_CELL;
+  uint32_t stats[3];
+  __u32 cx;
+  __u32 cy;
+
+  for (cy = 0; cy < detector->cells_y; cy++) {
+    for (cx = 0; cx < detector->cells_x; cx++) {
+      size_t cell = (size_t)cy * detector->cells_x + cx;
+      uint8_t kind = CELL_FLAT;
+
+      cell_stats(detector->luma + cy * BARCODE_CELL * width +
+                     cx * BARCODE_CELL,
+                 width, stats);
+      if (stats[0] + stats[1] >= BARCODE_EDGE_MIN * area) {
+        if (stats[0] >= BARCODE_DIRECTION_RATIO * stats[1]) {
+          kind = CELL_BARS_X;
+        } else if (stats[1] >= BARCODE_DIRECTION_RATIO * stats[0]) {
+          kind = CELL_BARS_Y;
+        } else {
+          kind = CELL_TEXTURE;
+        }
+      }
+      detector->cell_class[cell] = kind;
+      detector->cell_mean[cell] = (uint8_t)((stats[2] + area / 2) / area);
+    }
+  }
+
+  /* Threshold at the mean of the 3x3 neighbourhood, so a finder straddling
+   * cells is cut at one level across its width. */
+  for (cy = 0; cy < detector->cells_y; cy++) {
+    __u32 y0 = cy > 0 ? cy - 1 : 0;
+    __u32 y1 = cy + 1 < detector->cells_y ? cy + 1 : cy;
+
+    for (cx = 0; cx < detector->cells_x; cx++) {
+      __u32 x0 = cx > 0 ? cx - 1 : 0;
+      __u32 x1 = cx + 1 < detector->cells_x ? cx + 1 : cx;
+      unsigned int total = 0;
+      unsigned int n = 0;
+      __u32 i;
+      __u32 j;
+
+      for (j = y0; j <= y1; j++) {
+        for (i = x0; i <= x1; i++) {
+          total += detector->cell_mean[(size_t)j * detector->cells_x + i];
+          n++;
+        }
+      }
+      detector->cell_threshold[(size_t)cy * detector->cells_x + cx] =
+          (uint8_t)((total + n / 2) / n);
+    }
+  }
+}
+
+/**
+ * @brief How far the widths of four runs are from a digit pattern, as the
+ * sum of squared errors in modules.
+ */
+static float pattern_error(const unsigned int *runs, const uint8_t *pattern) {
+  float total = (float)(runs[0] + runs[1] + runs[2] + runs[3]);
+  float error = 0;
+  int i;
+
+  for (i = 0; i < 4; i++) {
+    float d = 7.0f * (float)runs[i] / total - (float)pattern[i];
+
+    error += d * d;
+  }
+  return error;
+}
+
+/**
+ * @brief Closest of the first count digit patterns to four runs.
+ * @return Its index, or -1 if none is close.
+ */
+static int match_digit(const unsigned int *runs, int count) {
+  float best_error = 1.2f;
+  int best = -1;
+  int p;
+
+  for (p = 0; p < count; p++) {
+    float error = pattern_error(runs, ean_patterns[p]);
+
+    if (error < best_error) {
+      best_error = error;
+      best = p;
+    }
+  }
+  return best;
+}
+
+/**
+ * @brief Tell whether each of count runs is about one module wide.
+ */
+static int guard_ok(const unsigned int *runs, int count, float module) {
+  int i;
+
+  for (i = 0; i < count; i++) {
+    if (fabsf((float)runs[i] - module) > 0.6f * module) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/**
+ * @brief Find an EAN-13 symbol in the runs of a scanline.
+ * @param runs Run lengths, light first, so bars sit at odd indices; the
+ * last run is light too.
+ * @param count Number of runs.
+ * @param digits Set to the 13 digits, NUL terminated.
+ * @return 1 if a symbol with a valid checksum was read, else 0.
+ */
+static int decode_ean13(const unsigned int *runs, unsigned int count,
+                        char *digits) {
+  unsigned int start;
+
+  for (start = 1; start + BARCODE_EAN13_RUNS < count; start += 2) {
+    const unsigned int *r = runs + start;
+    unsigned int width = 0;
+    unsigned int parity = 0;
+    unsigned int checksum = 0;
+    unsigned int i;
+    float module;
+
+    for (i = 0; i < BARCODE_EAN13_RUNS; i++) {
+      width += r[i];
+    }
+    module = (float)width / BARCODE_EAN13_MODULES;
+    if (!guard_ok(r, 3, module) || !guard_ok(r + 27, 5, module) ||
+        !guard_ok(r + 56, 3, module) ||
+        (float)runs[start - 1] < 3 * module ||
+        (float)r[BARCODE_EAN13_RUNS] < 3 * module) {
+      continue;
+    }
+
+    for (i = 0; i < 6; i++) {
+      int left = match_digit(r + 3 + 4 * i, 20);
+      int right = match_digit(r + 32 + 4 * i, 10);
+
+      if (left < 0 || right < 0) {
+        break;
+      }
+      parity = parity << 1 | (left >= 10);
+      digits[1 + i] = (char)('0' + left % 10);
+      digits[7 + i] = (char)('0' + right);
+    }
+    if (i < 6) {
+      continue;
+    }
+    for (i = 0; i < 10 && ean_parities[i] != parity; i++) {
+    }
+    if (i == 10) {
+      continue;
+    }
+    digits[0] = (char)('0' + i);
+    digits[13] = '\0';
+
+    for (i = 0; i < 12; i++) {
+      checksum += (unsigned int)(digits[i] - '0') * (i % 2 ? 3 : 1);
+    }
+    if ((10 - checksum % 10) % 10 == (unsigned int)(digits[12] - '0')) {
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Binarize a scanline at the middle of its range and split it into
+ * runs, light first and last.
+ * @return Number of runs, 0 if the line has too little contrast.
+ */
+static unsigned int scanline_runs(const uint8_t *line, unsigned int length,
+                                  unsigned int *runs) {
+  unsigned int lo = 255;
+  unsigned int hi = 0;
+  unsigned int count = 0;
+  unsigned int threshold;
+  unsigned int i;
+  int dark = 0;
+
+  for (i = 0; i < length; i++) {
+    lo = line[i] < lo ? line[i] : lo;
+    hi = line[i] > hi ? line[i] : hi;
+  }
+  if (hi - lo < BARCODE_MIN_CONTRAST) {
+    return 0;
+  }
+  threshold = (lo + hi) / 2;
+
+  runs[0] = 0;
+  for (i = 0; i < length; i++) {
+    int pixel_dark = line[i] < threshold;
+
+    if (pixel_dark != dark) {
+      dark = pixel_dark;
+      runs[++count] = 0;
+    }
+    runs[count]++;
+  }
+  if (dark) {
+    runs[++count] = 0;
+  }
+  return count + 1;
+}
+
+/**
+ * @brief Reverse runs in place, for a symbol upside down.
+ */
+static void reverse_runs(unsigned int *runs, unsigned int count) {
+  unsigned int i;
+
+  for (i = 0; i < count / 2; i++) {
+    unsigned int t = runs[i];
+
+    runs[i] = runs[count - 1 - i];
+    runs[count - 1 - i] = t;
+  }
+}
+
+/**
+ * @brief Read a group of bar cells along a few scanlines.
+ * @param box Cell bounds of the group: x0, y0, x1, y1 inclusive.
+ * @param across CELL_BARS_X to scan rows, CELL_BARS_Y to scan columns.
+ * @return 1 if a result was added, else 0.
+ */
+static int read_bars(struct barcode_detector_t *detector,
+                     const unsigned int box[4], int across,
+                     unsigned int *result_count) {
+  const __u32 width = detector->format.width;
+  const __u32 height = detector->format.height;
+  /* One cell more each side for the quiet zones. */
+  __u32 x0 = box[0] > 0 ? (box[0] - 1) * BARCODE_CELL : 0;
+  __u32 y0 = box[1] > 0 ? (box[1] - 1) * BARCODE_CELL : 0;
+  __u32 x1 = (box[2] + 2) * BARCODE_CELL;
+  __u32 y1 = (box[3] + 2) * BARCODE_CELL;
+  struct barcode_result_t *result = &detector->results[*result_count];
+  unsigned int line;
+
+  x1 = x1 < width ? x1 : width;
+  y1 = y1 < height ? y1 : height;
+  detector->regions++;
+
+  for (line = 1; line <= BARCODE_SCANLINES; line++) {
+    unsigned int length;
+    unsigned int count;
+    unsigned int i;
+
+    if (across == CELL_BARS_X) {
+      __u32 y = (box[1] * BARCODE_CELL) +
+                ((box[3] - box[1] + 1) * BARCODE_CELL) * line /
+                    (BARCODE_SCANLINES + 1);
+
+      length = x1 - x0;
+      memcpy(detector->line, detector->luma + (size_t)y * width + x0, length);
+    } else {
+      __u32 x = (box[0] * BARCODE_CELL) +
+                ((box[2] - box[0] + 1) * BARCODE_CELL) * line /
+                    (BARCODE_SCANLINES + 1);
+
+      length = y1 - y0;
+      for (i = 0; i < length; i++) {
+        detector->line[i] = detector->luma[(size_t)(y0 + i) * width + x];
+      }
+    }
+
+    count = scanline_runs(detector->line, length, detector->runs);
+    if (count < BARCODE_EAN13_RUNS + 2) {
+      continue;
+    }
+    if (decode_ean13(detector->runs, count, result->data) ||
+        (reverse_runs(detector->runs, count),
+         decode_ean13(detector->runs, count, result->data))) {
+      result->type = BARCODE_EAN13;
+      result->x = box[0] * BARCODE_CELL;
+      result->y = box[1] * BARCODE_CELL;
+      result->width = (box[2] - box[0] + 1) * BARCODE_CELL;
+      result->height = (box[3] - box[1] + 1) * BARCODE_CELL;
+      (*result_count)++;
+      detector->decoded++;
+      return 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Group 4-connected bar cells of the same direction and read each
+ * group large enough to hold a symbol.
+ */
+static void find_linear(struct barcode_detector_t *detector,
+                        unsigned int *result_count) {
+  const __u32 cells_x = detector->cells_x;
+  const size_t cells = (size_t)cells_x * detector->cells_y;
+  uint16_t label = 0;
+  size_t seed;
+
+  memset(detector->cell_label, 0, cells * sizeof(*detector->cell_label));
+  for (seed = 0; seed < cells && *result_count < BARCODE_MAX_RESULTS;
+       seed++) {
+    uint8_t kind = detector->cell_class[seed];
+    unsigned int box[4];
+    unsigned int size = 0;
+    size_t depth = 0;
+    unsigned int length;
+
+    if ((kind != CELL_BARS_X && kind != CELL_BARS_Y) ||
+        detector->cell_label[seed] != 0) {
+      continue;
+    }
+    label++;
+    box[0] = box[2] = (unsigned int)(seed % cells_x);
+    box[1] = box[3] = (unsigned int)(seed / cells_x);
+    detector->cell_label[seed] = label;
+    detector->cell_stack[depth++] = (uint32_t)seed;
+    while (depth > 0) {
+      uint32_t cell = detector->cell_stack[--depth];
+      unsigned int cx = cell % cells_x;
+      unsigned int cy = cell / cells_x;
+      uint32_t next[4];
+      int n = 0;
+      int i;
+
+      size++;
+      box[0] = cx < box[0] ? cx : box[0];
+      box[1] = cy < box[1] ? cy : box[1];
+      box[2] = cx > box[2] ? cx : box[2];
+      box[3] = cy > box[3] ? cy : box[3];
+      if (cx > 0) {
+        next[n++] = cell - 1;
+      }
+      if (cx + 1 < cells_x) {
+        next[n++] = cell + 1;
+      }
+      if (cy > 0) {
+        next[n++] = cell - cells_x;
+      }
+      if (cy + 1 < detector->cells_y) {
+        next[n++] = cell + cells_x;
+      }
+      for (i = 0; i < n; i++) {
+        if (detector->cell_class[next[i]] == kind &&
+            detector->cell_label[next[i]] == 0) {
+          detector->cell_label[next[i]] = label;
+          detector->cell_stack[depth++] = next[i];
+        }
+      }
+    }
+
+    length = kind == CELL_BARS_X ? box[2] - box[0] + 1 : box[3] - box[1] + 1;
+    if (size >= BARCODE_MIN_REGION_CELLS &&
+        length >= BARCODE_MIN_REGION_LENGTH) {
+      read_bars(detector, box, kind, result_count);
+    }
+  }
+}
+
+/**
+ * @brief Tell whether five runs are in the 1:1:3:1:1 ratio of a finder.
+ */
+static int finder_ratio(const unsigned int *runs) {
+  unsigned int total = runs[0] + runs[1] + runs[2] + runs[3] + runs[4];
+  float module;
+  float slack;
+
+  if (total < 7 || runs[0] == 0 || runs[1] == 0 || runs[2] == 0 ||
+      runs[3] == 0 || runs[4] == 0) {
+    return 0;
+  }
+  module = (float)total / 7.0f;
+  slack = module / 2.0f;
+  return fabsf(module - (float)runs[0]) < slack &&
+         fabsf(module - (float)runs[1]) < slack &&
+         fabsf(3.0f * module - (float)runs[2]) < 3.0f * slack &&
+         fabsf(module - (float)runs[3]) < slack &&
+         fabsf(module - (float)runs[4]) < slack;
+}
+
+/**
+ * @brief Tell whether a pixel is darker than its cell's threshold.
+ */
+static int is_dark(const struct barcode_detector_t *detector, __u32 x,
+                   __u32 y) {
+  __u32 cx = x / BARCODE_CELL;
+  __u32 cy = y / BARCODE_CELL;
+
+  cx = cx < detector->cells_x ? cx : detector->cells_x - 1;
+  cy = cy < detector->cells_y ? cy : detector->cells_y - 1;
+  return detector->luma[(size_t)y * detector->format.width + x] <
+         detector->cell_threshold[(size_t)cy * detector->cells_x + cx];
+}
+
+/**
+ * @brief Check a finder seen on a row along another line through it: its
+ * column, or a diagonal, which the ring of a finder shows in the same
+ * ratio and text or texture seldom does.
+ * @param x Column through the centre.
+ * @param y Row through the centre.
+ * @param dx Step across, 0 for the column or 1 for the diagonal.
+ * @param expected Width of the pattern on the row.
+ * @param centre Set to the offset of the centre from y, in steps.
+ * @param total Set to the length of the pattern, in steps.
+ * @return 1 if the line shows the pattern too, else 0.
+ */
+static int cross_check(const struct barcode_detector_t *detector, __u32 x,
+                       __u32 y, unsigned int dx, unsigned int expected,
+                       float *centre, unsigned int *total) {
+  long first = -(long)y;
+  long last = (long)detector->format.height - 1 - (long)y;
+  unsigned int runs[5] = {0, 0, 0, 0, 0};
+  unsigned int sum;
+  long i = 0;
+
+  /* Steps that stay inside the frame. */
+  if (dx > 0) {
+    first = first > -(long)x ? first : -(long)x;
+    last = last < (long)(detector->format.width - 1 - x)
+               ? last
+               : (long)(detector->format.width - 1 - x);
+  }
+
+  while (i >= first && is_dark(detector, x + i * dx, y + i)) {
+    runs[2]++;
+    i--;
+  }
+  while (i >= first && !is_dark(detector, x + i * dx, y + i) &&
+         runs[1] <= expected) {
+    runs[1]++;
+    i--;
+  }
+  while (i >= first && is_dark(detector, x + i * dx, y + i) &&
+         runs[0] <= expected) {
+    runs[0]++;
+    i--;
+  }
+  i = 1;
+  while (i <= last && is_dark(detector, x + i * dx, y + i)) {
+    runs[2]++;
+    i++;
+  }
+  while (i <= last && !is_dark(detector, x + i * dx, y + i) &&
+         runs[3] <= expected) {
+    runs[3]++;
+    i++;
+  }
+  while (i <= last && is_dark(detector, x + i * dx, y + i) &&
+         runs[4] <= expected) {
+    runs[4]++;
+    i++;
+  }
+
+  sum = runs[0] + runs[1] + runs[2] + runs[3] + runs[4];
+  /* Square, within perspective. */
+  if (5 * sum < 3 * expected || 3 * sum > 5 * expected ||
+      !finder_ratio(runs)) {
+    return 0;
+  }
+  *centre = (float)i - (float)runs[4] - (float)runs[3] - (float)runs[2] / 2;
+  *total = sum;
+  return 1;
+}
+
+/**
+ * @brief Merge a finder sighting into the list.
+ */
+static void add_finder(struct barcode_detector_t *detector, float x, float y,
+                       float module) {
+  unsigned int f;
+
+  for (f = 0; f < detector->finder_count; f++) {
+    struct barcode_finder_t *finder = &detector->finders[f];
+
+    if (fabsf(finder->x - x) <= 2 * finder->module &&
+        fabsf(finder->y - y) <= 2 * finder->module &&
+        fabsf(finder->module - module) <= finder->module / 2) {
+      float n = (float)finder->hits;
+
+      finder->x = (finder->x * n + x) / (n + 1);
+      finder->y = (finder->y * n + y) / (n + 1);
+      finder->module = (finder->module * n + module) / (n + 1);
+      finder->hits++;
+      return;
+    }
+  }
+  if (detector->finder_count < BARCODE_MAX_FINDERS) {
+    struct barcode_finder_t *finder =
+        &detector->finders[detector->finder_count++];
+
+    finder->x = x;
+    finder->y = y;
+    finder->module = module;
+    finder->hits = 1;
+  }
+}
+
+/**
+ * @brief Search one row between two columns for finder patterns.
+ */
+static void scan_finder_row(struct barcode_detector_t *detector, __u32 y,
+                            __u32 x0, __u32 x1) {
+  unsigned int *runs = detector->runs;
+  unsigned int count = 0;
+  unsigned int first_dark;
+  unsigned int start;
+  unsigned int position;
+  __u32 x;
+  int dark;
+
+  dark = is_dark(detector, x0, y);
+  first_dark = dark ? 0 : 1;
+  runs[0] = 0;
+  for (x = x0; x < x1; x++) {
+    int pixel_dark = is_dark(detector, x, y);
+
+    if (pixel_dark != dark) {
+      dark = pixel_dark;
+      runs[++count] = 0;
+    }
+    runs[count]++;
+  }
+  count++;
+
+  position = x0;
+  for (start = 0; start < first_dark; start++) {
+    position += runs[start];
+  }
+  for (start = first_dark; start + 4 < count; start += 2) {
+    if (finder_ratio(runs + start)) {
+      unsigned int width = runs[start] + runs[start + 1] + runs[start + 2] +
+                           runs[start + 3] + runs[start + 4];
+      float centre_x = (float)(position + runs[start] + runs[start + 1]) +
+                       (float)runs[start + 2] / 2;
+      float centre_y;
+      float offset;
+      unsigned int height;
+      unsigned int diagonal;
+
+      if (cross_check(detector, (__u32)centre_x, y, 0, width, &offset,
+                      &height)) {
+        centre_y = (float)y + offset;
+        if (cross_check(detector, (__u32)centre_x, (__u32)centre_y, 1, width,
+                        &offset, &diagonal)) {
+          add_finder(detector, centre_x, centre_y,
+                     (float)(width + height) / 14.0f);
+        }
+      }
+    }
+    position += runs[start] + runs[start + 1];
+  }
+}
+
+/**
+ * @brief Look for finder patterns around cells with edges and report every
+ * three of them that form the corners of a QR symbol.
+ */
+static void find_qr(struct barcode_detector_t *detector,
+                    unsigned int *result_count) {
+  const __u32 cells_x = detector->cells_x;
+  const float width = (float)detector->format.width;
+  const float height = (float)detector->format.height;
+  unsigned int i;
+  unsigned int j;
+  unsigned int k;
+  __u32 cy;
+
+  detector->finder_count = 0;
+  for (cy = 0; cy < detector->cells_y; cy++) {
+    const uint8_t *kind = detector->cell_class + (size_t)cy * cells_x;
+    __u32 cx = 0;
+
+    while (cx < cells_x) {
+      __u32 first;
+      __u32 last;
+      __u32 gap = 0;
+      __u32 y;
+
+      while (cx < cells_x && kind[cx] == CELL_FLAT) {
+        cx++;
+      }
+      if (cx == cells_x) {
+        break;
+      }
+      /* Span of cells with edges, bridging flat gaps a finder centre can
+       * leave, widened by the same on both sides. A finder's side cells
+       * look like bars, so those count too. */
+      first = cx > BARCODE_FINDER_SPREAD ? cx - BARCODE_FINDER_SPREAD : 0;
+      last = cx;
+      while (cx < cells_x && gap <= BARCODE_FINDER_SPREAD) {
+        if (kind[cx] != CELL_FLAT) {
+          last = cx;
+          gap = 0;
+        } else {
+          gap++;
+        }
+        cx++;
+      }
+      last = last + BARCODE_FINDER_SPREAD < cells_x
+                 ? last + BARCODE_FINDER_SPREAD
+                 : cells_x - 1;
+      for (y = cy * BARCODE_CELL; y < (cy + 1) * BARCODE_CELL;
+           y += BARCODE_FINDER_ROW_STEP) {
+        scan_finder_row(detector, y, first * BARCODE_CELL,
+                        (last + 1) * BARCODE_CELL);
+      }
+    }
+  }
+
+  /* Finders seen on one row only are more likely text. */
+  for (i = 0; i < detector->finder_count; i++) {
+    for (j = i + 1; j < detector->finder_count; j++) {
+      for (k = j + 1; k < detector->finder_count; k++) {
+        struct barcode_finder_t *f[3];
+        struct barcode_finder_t *corner;
+        struct barcode_finder_t *a;
+        struct barcode_finder_t *b;
+        float d[3];
+        float lo;
+        float hi;
+        float module;
+        float fourth[2];
+        float box[4];
+        int c;
+
+        f[0] = &detector->finders[i];
+        f[1] = &detector->finders[j];
+        f[2] = &detector->finders[k];
+        if (f[0]->hits < 2 || f[1]->hits < 2 || f[2]->hits < 2 ||
+            *result_count >= BARCODE_MAX_RESULTS) {
+          continue;
+        }
+        lo = fminf(fminf(f[0]->module, f[1]->module), f[2]->module);
+        hi = fmaxf(fmaxf(f[0]->module, f[1]->module), f[2]->module);
+        if (hi > 1.4f * lo) {
+          continue;
+        }
+        module = (f[0]->module + f[1]->module + f[2]->module) / 3;
+
+        /* d[c] is the squared side opposite f[c]. */
+        for (c = 0; c < 3; c++) {
+          const struct barcode_finder_t *p = f[(c + 1) % 3];
+          const struct barcode_finder_t *q = f[(c + 2) % 3];
+
+          d[c] = (p->x - q->x) * (p->x - q->x) + (p->y - q->y) * (p->y - q->y);
+        }
+        c = d[0] > d[1] ? (d[0] > d[2] ? 0 : 2) : (d[1] > d[2] ? 1 : 2);
+        corner = f[c];
+        a = f[(c + 1) % 3];
+        b = f[(c + 2) % 3];
+        {
+          float legs = d[(c + 1) % 3] + d[(c + 2) % 3];
+          float ratio = d[(c + 1) % 3] / d[(c + 2) % 3];
+
+          /* Equal legs at a right angle, and at least version 1 apart. */
+          if (ratio < 0.7f || ratio > 1.0f / 0.7f ||
+              fabsf(d[c] - legs) > 0.2f * legs ||
+              d[(c + 1) % 3] < 12 * 12 * module * module) {
+            continue;
+          }
+        }
+
+        fourth[0] = a->x + b->x - corner->x;
+        fourth[1] = a->y + b->y - corner->y;
+        box[0] = fminf(fminf(a->x, b->x), fminf(corner->x, fourth[0]));
+        box[1] = fminf(fminf(a->y, b->y), fminf(corner->y, fourth[1]));
+        box[2] = fmaxf(fmaxf(a->x, b->x), fmaxf(corner->x, fourth[0]));
+        box[3] = fmaxf(fmaxf(a->y, b->y), fmaxf(corner->y, fourth[1]));
+        box[0] = fmaxf(box[0] - 3.5f * module, 0);
+        box[1] = fmaxf(box[1] - 3.5f * module, 0);
+        box[2] = fminf(box[2] + 3.5f * module, width);
+        box[3] = fminf(box[3] + 3.5f * module, height);
+
+        {
+          struct barcode_result_t *result =
+              &detector->results[(*result_count)++];
+
+          result->type = BARCODE_QR;
+          result->x = (__u32)box[0];
+          result->y = (__u32)box[1];
+          result->width = (__u32)(box[2] - box[0] + 0.5f);
+          result->height = (__u32)(box[3] - box[1] + 0.5f);
+          result->data[0] = '\0';
+        }
+        detector->located++;
+        /* Each finder belongs to one symbol. */
+        corner->hits = 0;
+        a->hits = 0;
+        b->hits = 0;
+      }
+    }
+  }
+}
+
+int barcode_detect(struct barcode_detector_t *detector, const void *frame,
+                   size_t bytes, const struct barcode_result_t **results) {
+  const struct v4l2_pix_format *format = &detector->format;
+  unsigned int count = 0;
+  long long start;
+  long long elapsed;
+
+  if (bytes < (size_t)format->bytesperline * format->height) {
+    errno = EINVAL;
+    return -1;
+  }
+  start = monotonic_ns();
+
+  extract_luma(detector, frame);
+  classify_cells(detector);
+  find_linear(detector, &count);
+  find_qr(detector, &count);
+
+  elapsed = monotonic_ns() - start;
+  detector->detect_ns_avg = detector->frames == 0
+                                ? elapsed
+                                : detector->detect_ns_avg +
+                                      (elapsed - detector->detect_ns_avg) / 8;
+  if (elapsed > detector->detect_ns_max) {
+    detector->detect_ns_max = elapsed;
+  }
+  detector->frames++;
+  *results = detector->results;
+  return (int)count;
+}
+
+void barcode_detector_destroy(struct barcode_detector_t *detector) {
+  free(detector->luma);
+  detector->luma = NULL;
+  free(detector->cell_class);
+  detector->cell_class = NULL;
+  free(detector->cell_mean);
+  detector->cell_mean = NULL;
+  free(detector->cell_threshold);
+  detector->cell_threshold = NULL;
+  free(detector->cell_label);
+  detector->cell_label = NULL;
+  free(detector->cell_stack);
+  detector->cell_stack = NULL;
+  free(detector->line);
+  detector->line = NULL;
+  free(detector->runs);
+  detector->runs = NULL;
+}
+
+int barcode_sink_open(struct barcode_sink_t *sink, const char *path) {
+  memset(sink, 0, sizeof(*sink));
+  sink->fd = -1;
+  if (strlen(path) >= sizeof(sink->address.sun_path)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  sink->address.sun_family = AF_UNIX;
+  strcpy(sink->address.sun_path, path);
+
+  /* Connectionless, so a receiver restarting costs datagrams, not the
+   * sink. */
+  sink->fd = socket(AF_UNIX, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  if (sink->fd < 0) {
+    return -1;
+  }
+  return 0;
+}
+
+void barcode_sink_send(struct barcode_sink_t *sink, __u32 sequence,
+                       const struct barcode_result_t *results,
+                       unsigned int count) {
+  char message[96];
+  unsigned int i;
+
+  for (i = 0; i < count; i++) {
+    const struct barcode_result_t *result = &results[i];
+    int length = snprintf(
+        message, sizeof(message), "%u %s %u %u %u %u%s%s\n", sequence,
+        result->type == BARCODE_QR ? "qr" : "ean13", result->x, result->y,
+        result->width, result->height, result->data[0] ? " " : "",
+        result->data);
+
+    if (sendto(sink->fd, message, (size_t)length, MSG_DONTWAIT,
+               (const struct sockaddr *)&sink->address,
+               sizeof(sink->address)) < 0) {
+      sink->dropped++;
+    } else {
+      sink->sent++;
+    }
+  }
+}
+
+void barcode_sink_close(struct barcode_sink_t *sink) {
+  if (sink->fd >= 0) {
+    close(sink->fd);
+    sink->fd = -1;
+  }
+}
@@ -0,0 +1,206 @@
+/**
+ * @file barcode.h
+ * @brief Barcode fast path for the live stream: cheap gradient statistics
+ * over the luma pick out the few regions that can hold a code, and only
+ * those are scanned. Linear codes are decoded as EAN-13 / UPC-A; QR codes
+ * are located by their finder patterns. Results go out as datagrams on a
+ * UNIX socket, tagged with the frame sequence number.
+ */
+
+#ifndef BARCODE_H
+#define BARCODE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <sys/socket.h>
+#include <sys/un.h>
+
+#include <linux/videodev2.h>
+
+/**
+ * @brief Side of the cells gradients are summed over, in pixels.
+ */
+#define BARCODE_CELL 16
+
+/**
+ * @brief Most results reported per frame.
+ */
+#define BARCODE_MAX_RESULTS 16
+
+/**
+ * @brief Most finder pattern centres tracked per frame.
+ */
+#define BARCODE_MAX_FINDERS 32
+
+/**
+ * @brief Kind of a result.
+ */
+enum barcode_type_t {
+  /** EAN-13, or UPC-A with a leading 0; data holds the 13 digits. */
+  BARCODE_EAN13,
+  /** QR code located by its three finder patterns; data is empty. */
+  BARCODE_QR,
+};
+
+/**
+ * @brief One code found in a frame.
+ * @param type Kind of code.
+ * @param x Left edge of its region, in pixels.
+ * @param y Top edge of its region.
+ * @param width Width of its region.
+ * @param height Height of its region.
+ * @param data Decoded text, NUL terminated.
+ */
+struct barcode_result_t {
+  enum barcode_type_t type;
+  __u32 x;
+  __u32 y;
+  __u32 width;
+  __u32 height;
+  char data[16];
+};
+
+/**
+ * @brief A finder pattern centre seen on one or more rows.
+ * @param x Centre, in pixels.
+ * @param y Centre, in pixels.
+ * @param module Module size, in pixels.
+ * @param hits Rows it was seen on.
+ */
+struct barcode_finder_t {
+  float x;
+  float y;
+  float module;
+  unsigned int hits;
+};
+
+/**
+ * @brief Detector state and figures.
+ * @param format Format of the frames.
+ * @param luma Luma plane of the current frame, one row of padding below.
+ * @param cells_x Cells across.
+ * @param cells_y Cells down.
+ * @param cell_class What each cell looks like, see barcode.c.
+ * @param cell_mean Mean luma of each cell.
+ * @param cell_threshold Dark/light threshold of each cell, the mean of it
+ * and its neighbours.
+ * @param cell_label Component of each cell, scratch.
+ * @param cell_stack Flood fill stack, scratch.
+ * @param line Samples of one scanline, scratch.
+ * @param runs Run lengths of one scanline, scratch.
+ * @param finders Finder patterns seen in the current frame.
+ * @param finder_count Number of finders.
+ * @param results Results of the last frame.
+ * @param frames Frames scanned.
+ * @param detect_ns_avg Moving average of one frame, nanoseconds.
+ * @param detect_ns_max Slowest frame, nanoseconds.
+ * @param regions Candidate linear code regions scanned.
+ * @param decoded Linear codes decoded.
+ * @param located QR codes located.
+ */
+struct barcode_detector_t {
+  struct v4l2_pix_format format;
+  uint8_t *luma;
+  __u32 cells_x;
+  __u32 cells_y;
+  uint8_t *cell_class;
+  uint8_t *cell_mean;
+  uint8_t *cell_threshold;
+  uint16_t *cell_label;
+  uint32_t *cell_stack;
+  uint8_t *line;
+  unsigned int *runs;
+  struct barcode_finder_t finders[BARCODE_MAX_FINDERS];
+  unsigned int finder_count;
+  struct barcode_result_t results[BARCODE_MAX_RESULTS];
+  unsigned long frames;
+  long long detect_ns_avg;
+  long long detect_ns_max;
+  unsigned long regions;
+  unsigned long decoded;
+  unsigned long located;
+};
+
+/**
+ * @brief Where results are sent.
+ * @param fd Datagram socket, -1 when closed.
+ * @param address Receiving socket.
+ * @param sent Datagrams sent.
+ * @param dropped Datagrams lost because nobody was listening or the
+ * receiver was behind.
+ */
+struct barcode_sink_t {
+  int fd;
+  struct sockaddr_un address;
+  unsigned long sent;
+  unsigned long dropped;
+};
+
+/**
+ * @brief Tell whether frames of a fourcc can be scanned: 8-bit GREY and
+ * packed YUYV.
+ * @param pixelformat V4L2 fourcc.
+ * @return Non-zero if supported.
+ */
+int barcode_supports(__u32 pixelformat);
+
+/**
+ * @brief Set up a detector for a format.
+ * @param detector Detector to initialize.
+ * @param format Format of the frames to come.
+ * @return 0 on success, -1 with errno set (EINVAL for unsupported input).
+ */
+int barcode_detector_init(struct barcode_detector_t *detector,
+                          const struct v4l2_pix_format *format);
+
+/**
+ * @brief Scan a frame.
+ * @param detector Detector.
+ * @param frame Frame in the format given at init.
+ * @param bytes Size of frame, at least bytesperline * height.
+ * @param results Set to the results, valid until the next call.
+ * @return Number of results, or -1 with errno set (EINVAL for a short
+ * frame).
+ */
+int barcode_detect(struct barcode_detector_t *detector, const void *frame,
+                   size_t bytes, const struct barcode_result_t **results);
+
+/**
+ * @brief Release a detector.
+ * @param detector Detector.
+ * @return None.
+ */
+void barcode_detector_destroy(struct barcode_detector_t *detector);
+
+/**
+ * @brief Open a sink sending to a UNIX datagram socket. The receiver may
+ * come and go, datagrams sent while it is away are counted as dropped.
+ * @param sink Sink to initialize.
+ * @param path Path the receiver binds.
+ * @return 0 on success, -1 with errno set.
+ */
+int barcode_sink_open(struct barcode_sink_t *sink, const char *path);
+
+/**
+ * @brief Send the results of a frame, one datagram each:
+ * "<sequence> <ean13|qr> <x> <y> <width> <height> [<data>]\n". Never
+ * blocks.
+ * @param sink Sink.
+ * @param sequence Driver sequence number of the frame.
+ * @param results Results.
+ * @param count Number of results.
+ * @return None.
+ */
+void barcode_sink_send(struct barcode_sink_t *sink, __u32 sequence,
+                       const struct barcode_result_t *results,
+                       unsigned int count);
+
+/**
+ * @brief Close a sink.
+ * @param sink Sink.
+ * @return None.
+ */
+void barcode_sink_close(struct barcode_sink_t *sink);
+
+#endif /* BARCODE_H */
@@ -0,0 +1,276 @@
+/**
+ * @file bracket.c
+ * @brief Exposure bracketing.
+ * @note A control set while streaming reaches the sensor a few frames
+ * later, and how many depends on where in the frame the call lands. The
+ * Request API removes the guesswork: the value and the buffer are queued
+ * together and the driver applies one to the other. The fallback sets the
+ * value right after the newest frame and trusts the sensor's documented
+ * latency, paying for it with discarded frames.
+ */
+
+#include "bracket.h"
+#include "storage.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * @brief Current CLOCK_MONOTONIC time in microseconds.
+ */
+static long now_us(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+/**
+ * @brief Hand the dequeued frame over as a step of the bracket, to the
+ * consumer or to its numbered file.
+ * @param params Capture state holding the frame.
+ * @param config Settings.
+ * @param step Step the frame belongs to.
+ * @return None, exits on failure like save_to_image().
+ */
+static void save_step(struct camera_params_t *params,
+                      const struct bracket_config_t *config,
+                      unsigned int step) {
+  char path[4096];
+
+  if (config->consume != NULL) {
+    config->consume(params, step);
+    return;
+  }
+  numbered_path(path, sizeof(path), config->output_path, step);
+  save_to_image(params, path);
+}
+
+/**
+ * @brief Bracket with one media request per step. Buffer n carries step n.
+ * @param params Capture state, buffers requested.
+ * @param config Settings.
+ * @param control Control stepped through.
+ * @param media_fd Open media device.
+ * @param stats Outcome.
+ * @return 0 on success, -1 with errno set.
+ */
+static int bracket_by_request(struct camera_params_t *params,
+                              const struct bracket_config_t *config,
+                              __u32 control, int media_fd,
+                              struct bracket_stats_t *stats) {
+  int requests[BRACKET_MAX_STEPS];
+  unsigned int taken = 0;
+  unsigned int done = 0;
+  unsigned int step;
+  int saved_errno = 0;
+  long start;
+
+  for (step = 0; step < config->steps; step++) {
+    requests[step] = -1;
+  }
+  if (params->buffer_request.count < config->steps) {
+    errno = ENOBUFS;
+    return -1;
+  }
+  allocate_buffer(params);
+
+  for (step = 0; step < config->steps; step++) {
+    requests[step] = alloc_media_request(media_fd);
+    if (requests[step] < 0 ||
+        set_request_control(params, requests[step], control,
+                            config->values[step]) < 0 ||
+        queue_request_buffer(params, step, requests[step]) < 0 ||
+        queue_media_request(requests[step]) < 0) {
+      saved_errno = errno;
+      goto out;
+    }
+  }
+
+  start = now_us();
+  start_streaming(params);
+  while (done < config->steps) {
+    __u32 index;
+
+    get_frame(params);
+    index = params->buffer.index;
+    /* A frame get_frame() had to requeue comes back without its request,
+     * and its step is lost. */
+    if (!(params->buffer.flags & V4L2_BUF_FLAG_REQUEST_FD) ||
+        index >= config->steps || (taken & (1u << index))) {
+      if (++stats->discarded_frames > CAMERA_MAX_RETRIES) {
+        saved_errno = EIO;
+        break;
+      }
+      release_frame(params);
+      continue;
+    }
+    stats->sequences[index] = params->buffer.sequence;
+    save_step(params, config, index);
+    taken |= 1u << index;
+    done++;
+  }
+  stats->capture_us = now_us() - start;
+  deactivate_streaming(params);
+
+out:
+  for (step = 0; step < config->steps; step++) {
+    if (requests[step] >= 0) {
+      close(requests[step]);
+    }
+  }
+  if (saved_errno != 0) {
+    errno = saved_errno;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Whether another frame is already waiting in the driver.
+ * @param params Capture state.
+ * @return Non-zero if a dequeue would not block.
+ */
+static int frame_waiting(const struct camera_params_t *params) {
+  struct pollfd pfd = {.fd = params->device_fs, .events = POLLIN};
+
+  return poll(&pfd, 1, 0) > 0 && (pfd.revents & POLLIN);
+}
+
+/**
+ * @brief Bracket by sequence numbers: set each value after the newest
+ * frame and keep the first frame past the latency.
+ * @param params Capture state, buffers requested.
+ * @param config Settings.
+ * @param control Control stepped through.
+ * @param stats Outcome.
+ * @return 0 on success, -1 with errno set.
+ */
+static int bracket_by_sequence(struct camera_params_t *params,
+                               const struct bracket_config_t *config,
+                               __u32 control, struct bracket_stats_t *stats) {
+  unsigned int latency = config->latency_frames ? config->latency_frames
+                                                : BRACKET_DEFAULT_LATENCY;
+  unsigned int step;
+  long start;
+
+  allocate_buffer(params);
+  start = now_us();
+  activate_streaming(params);
+  get_frame(params);
+  stats->discarded_frames++;
+
+  for (step = 0; step < config->steps; step++) {
+    unsigned int backlog;
+    __u32 target;
+
+    /* Count the latency from the newest frame, not from one that sat in
+     * the queue. No more frames than buffers can be waiting. */
+    for (backlog = 0;
+         backlog < params->buffer_request.count && frame_waiting(params);
+         backlog++) {
+      release_frame(params);
+      get_frame(params);
+      stats->discarded_frames++;
+    }
+
+    if (set_camera_control(params, control, config->values[step]) < 0) {
+      int saved_errno = errno;
+
+      deactivate_streaming(params);
+      errno = saved_errno;
+      return -1;
+    }
+    target = params->buffer.sequence + 1 + latency;
+    for (;;) {
+      release_frame(params);
+      get_frame(params);
+      if ((__s32)(params->buffer.sequence - target) >= 0) {
+        break;
+      }
+      stats->discarded_frames++;
+    }
+
+    stats->sequences[step] = params->buffer.sequence;
+    save_step(params, config, step);
+  }
+  stats->capture_us = now_us() - start;
+  deactivate_streaming(params);
+
+  return 0;
+}
+
+int run_bracket(struct camera_params_t *params,
+                const struct bracket_config_t *config,
+                struct bracket_stats_t *stats) {
+  struct bracket_stats_t local;
+  __u32 control = config->control ? config->control : V4L2_CID_EXPOSURE;
+  int media_fd = -1;
+  int original;
+  int original_auto = V4L2_EXPOSURE_MANUAL;
+  int status_code;
+  int saved_errno;
+
+  if (stats == NULL) {
+    stats = &local;
+  }
+  memset(stats, 0, sizeof(*stats));
+  if (config->steps == 0 || config->steps > BRACKET_MAX_STEPS) {
+    errno = EINVAL;
+    return -1;
+  }
+  /* A device without auto exposure fails the read, and has nothing to
+   * turn off. */
+  if (get_camera_control(params, V4L2_CID_EXPOSURE_AUTO, &original_auto) ==
+          0 &&
+      original_auto != V4L2_EXPOSURE_MANUAL &&
+      set_camera_control(params, V4L2_CID_EXPOSURE_AUTO,
+                         V4L2_EXPOSURE_MANUAL) < 0) {
+    return -1;
+  }
+  if (get_camera_control(params, control, &original) < 0) {
+    saved_errno = errno;
+    if (original_auto != V4L2_EXPOSURE_MANUAL) {
+      set_camera_control(params, V4L2_CID_EXPOSURE_AUTO, original_auto);
+    }
+    errno = saved_errno;
+    return -1;
+  }
+
+  request_buffer(params, config->steps > CAMERA_DEFAULT_BUFFERS
+                             ? config->steps
+                             : CAMERA_DEFAULT_BUFFERS);
+  if (config->media_path != NULL &&
+      (params->buffer_request.capabilities &
+       V4L2_BUF_CAP_SUPPORTS_REQUESTS)) {
+    media_fd = open(config->media_path, O_RDWR);
+  }
+
+  if (media_fd >= 0) {
+    stats->method = BRACKET_REQUEST_API;
+    status_code =
+        bracket_by_request(params, config, control, media_fd, stats);
+  } else {
+    stats->method = BRACKET_SEQUENCE;
+    status_code = bracket_by_sequence(params, config, control, stats);
+  }
+  saved_errno = errno;
+
+  if (media_fd >= 0) {
+    close(media_fd);
+  }
+  free_buffers(params);
+  /* Stopped, the value applies at once. */
+  set_camera_control(params, control, original);
+  if (original_auto != V4L2_EXPOSURE_MANUAL) {
+    set_camera_control(params, V4L2_CID_EXPOSURE_AUTO, original_auto);
+  }
+
+  errno = saved_errno;
+  return status_code;
+}
@@ -0,0 +1,94 @@
+/**
+ * @file bracket.h
+ * @brief Exposure bracketing: a short run of frames, each taken with its
+ * own control value. With the Request API every value travels with the
+ * buffer it belongs to; without it the values are set one by one and
+ * frames are discarded until the sensor has caught up.
+ */
+
+#ifndef BRACKET_H
+#define BRACKET_H
+
+#include "camera.h"
+
+/**
+ * @brief Most frames in one bracket.
+ */
+#define BRACKET_MAX_STEPS 8
+
+/**
+ * @brief Frames a sensor takes to apply a control set while streaming,
+ * counted after the frame in flight. Two is typical of SMIA-style sensors
+ * such as the OV5647.
+ */
+#define BRACKET_DEFAULT_LATENCY 2
+
+/**
+ * @brief How a bracket tied values to frames.
+ */
+enum bracket_method_t {
+  BRACKET_REQUEST_API,
+  BRACKET_SEQUENCE,
+};
+
+/**
+ * @brief Settings of a bracket.
+ * @param control Control stepped through, 0 for V4L2_CID_EXPOSURE, the
+ * exposure in lines the OV5647 offers.
+ * @param values Value of each step, in the control's units: lines for
+ * V4L2_CID_EXPOSURE.
+ * @param steps Number of steps, 1 to BRACKET_MAX_STEPS.
+ * @param media_path Media device of the camera, NULL to go by sequence
+ * numbers straight away.
+ * @param latency_frames Control latency assumed without the Request API, 0
+ * for BRACKET_DEFAULT_LATENCY.
+ * @param output_path Base path, step n is written to its numbered file.
+ * @param consume Optional, takes each frame instead of writing it: called
+ * with the frame of a step dequeued into params, which must be copied to
+ * outlive the call.
+ */
+struct bracket_config_t {
+  __u32 control;
+  int values[BRACKET_MAX_STEPS];
+  unsigned int steps;
+  const char *media_path;
+  unsigned int latency_frames;
+  const char *output_path;
+  void (*consume)(struct camera_params_t *params, unsigned int step);
+};
+
+/**
+ * @brief Outcome of a bracket.
+ * @param method How values were tied to frames.
+ * @param sequences Driver sequence number of the frame of each step.
+ * @param discarded_frames Frames dequeued but not kept, waiting for a value
+ * to take effect.
+ * @param capture_us Stream start to the last frame, in microseconds.
+ */
+struct bracket_stats_t {
+  enum bracket_method_t method;
+  __u32 sequences[BRACKET_MAX_STEPS];
+  unsigned long discarded_frames;
+  long capture_us;
+};
+
+/**
+ * @brief Take a bracket on an open device with its format set and no
+ * buffers. The Request API is used when the media device opens and the
+ * driver reports request support, sequence numbers otherwise. Auto
+ * exposure (V4L2_CID_EXPOSURE_AUTO), where the device has it, is set to
+ * manual first so the sensor's own loop does not override the steps. The
+ * control and auto exposure get their previous values back and the
+ * buffers are released on return.
+ * @param params Capture state.
+ * @param config Settings.
+ * @param stats Outcome, may be NULL.
+ * @return 0 on success, -1 with errno set: EINVAL for a bad step count,
+ * ENOBUFS if the driver granted fewer buffers than a request bracket needs,
+ * EIO if request frames keep failing, or the control error.
+ */
+int run_bracket(struct camera_params_t *params,
+                const struct bracket_config_t *config,
+                struct bracket_stats_t *stats);
+
+#endif /* BRACKET_H */
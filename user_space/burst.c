@@ -0,0 +1,258 @@
+/**
+ * @file burst.c
+ * @brief Burst capture.
+ * @note Nothing is requeued during a burst: with one buffer per frame the
+ * driver fills them back to back and the frames are read straight from the
+ * mappings afterwards, never copied. Writers pull frame indices from a
+ * shared counter so a slow file does not hold up the others.
+ */
+
+#include "burst.h"
+#include "storage.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * @brief Upper bound of writer threads.
+ */
+#define BURST_MAX_WRITERS 8
+
+/**
+ * @brief Work shared by the writer threads.
+ * @param params Capture state holding the mapped frames.
+ * @param plane_bytes Bytes used in each plane of each frame, in capture
+ * order; the first plane's is also the bytesused of the frame.
+ * @param plane_data Start of the payload of each plane of each frame, past
+ * its data_offset.
+ * @param count Number of frames.
+ * @param output_path Base path of the files.
+ * @param next Next frame to write.
+ * @param error First write error, 0 if none.
+ */
+struct burst_job_t {
+  const struct camera_params_t *params;
+  const __u32 (*plane_bytes)[CAMERA_MAX_PLANES];
+  const void *const (*plane_data)[CAMERA_MAX_PLANES];
+  unsigned int count;
+  const char *output_path;
+  atomic_uint next;
+  atomic_int error;
+};
+
+/**
+ * @brief Current CLOCK_MONOTONIC time in nanoseconds.
+ */
+static long long now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000LL + ts.tv_nsec;
+}
+
+/**
+ * @brief Write one frame to its numbered file, plane after plane.
+ * @param job Burst being written.
+ * @param n Position of the frame in the burst.
+ * @return 0 on success, -1 with errno set.
+ */
+static int write_frame(const struct burst_job_t *job, unsigned int n) {
+  char path[4096];
+  unsigned int plane;
+  int saved_errno;
+  int fd;
+
+  numbered_path(path, sizeof(path), job->output_path, n);
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0660);
+  if (fd < 0) {
+    return -1;
+  }
+  for (plane = 0; plane < job->params->plane_count; plane++) {
+    if (write_full(fd, job->plane_data[n][plane],
+                   job->plane_bytes[n][plane]) < 0) {
+      saved_errno = errno;
+      close(fd);
+      errno = saved_errno;
+      return -1;
+    }
+  }
+  return close(fd);
+}
+
+/**
+ * @brief Writer thread: write frames until none are left, keeping the
+ * first error.
+ * @param arg The burst job.
+ * @return NULL.
+ */
+static void *writer_main(void *arg) {
+  struct burst_job_t *job = arg;
+  unsigned int n;
+
+  while ((n = atomic_fetch_add(&job->next, 1)) < job->count) {
+    int expected = 0;
+
+    if (write_frame(job, n) < 0) {
+      atomic_compare_exchange_strong(&job->error, &expected, errno);
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Write every frame of the burst, on the calling thread plus
+ * writers - 1 helpers.
+ * @param job Burst to write.
+ * @param writers Threads to use, 1 to BURST_MAX_WRITERS.
+ * @return 0 on success, -1 with errno set.
+ */
+static int write_frames(struct burst_job_t *job, unsigned int writers) {
+  pthread_t threads[BURST_MAX_WRITERS];
+  unsigned int started = 0;
+  unsigned int i;
+
+  atomic_init(&job->next, 0);
+  atomic_init(&job->error, 0);
+  for (i = 1; i < writers; i++) {
+    if (pthread_create(&threads[started], NULL, writer_main, job) != 0) {
+      break;
+    }
+    started++;
+  }
+  writer_main(job);
+  for (i = 0; i < started; i++) {
+    pthread_join(threads[i], NULL);
+  }
+
+  if (atomic_load(&job->error) != 0) {
+    errno = atomic_load(&job->error);
+    return -1;
+  }
+  return 0;
+}
+
+int run_burst(struct camera_params_t *params,
+              const struct burst_config_t *config,
+              struct burst_stats_t *stats) {
+  struct v4l2_buffer frames[BURST_MAX_FRAMES];
+  __u32 plane_bytes[BURST_MAX_FRAMES][CAMERA_MAX_PLANES];
+  const void *plane_data[BURST_MAX_FRAMES][CAMERA_MAX_PLANES];
+  struct burst_stats_t local;
+  struct burst_job_t job;
+  long long start_ns;
+  long long spacing_sum_us = 0;
+  long writers;
+  unsigned int n;
+
+  if (stats == NULL) {
+    stats = &local;
+  }
+  memset(stats, 0, sizeof(*stats));
+  if (config->frames == 0 || config->frames > BURST_MAX_FRAMES) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  set_video_format(params, BURST_WIDTH, BURST_HEIGHT, config->pixelformat);
+  stats->width = params->capture_format.fmt.pix.width;
+  stats->height = params->capture_format.fmt.pix.height;
+
+  /* All buffers up front: a buffer returned to the driver mid-burst would
+   * be overwritten by a later frame. */
+  request_buffer(params, config->frames);
+  if (params->buffer_request.count < config->frames) {
+    errno = ENOBUFS;
+    return -1;
+  }
+  allocate_buffer(params);
+
+  start_ns = now_ns();
+  activate_streaming(params);
+  for (n = 0; n < config->frames; n++) {
+    unsigned int plane;
+
+    get_frame(params);
+    frames[n] = params->buffer;
+    stats->indices[n] = params->buffer.index;
+    stats->data[n] = params->buffer_start;
+    /* For _MPLANE the buffer points to buffer_planes, which the next
+     * dequeue overwrites. */
+    plane_bytes[n][0] = params->buffer.bytesused;
+    for (plane = 1; plane < params->plane_count; plane++) {
+      plane_bytes[n][plane] = params->buffer_planes[plane].bytesused;
+    }
+    for (plane = 0; plane < params->plane_count; plane++) {
+      plane_data[n][plane] = plane_payload(params, plane);
+    }
+    if (n > 0) {
+      long spacing_us =
+          (params->buffer.timestamp.tv_sec - frames[n - 1].timestamp.tv_sec) *
+              1000000L +
+          (params->buffer.timestamp.tv_usec - frames[n - 1].timestamp.tv_usec);
+
+      if (n == 1 || spacing_us < stats->spacing_min_us) {
+        stats->spacing_min_us = spacing_us;
+      }
+      if (spacing_us > stats->spacing_max_us) {
+        stats->spacing_max_us = spacing_us;
+      }
+      spacing_sum_us += spacing_us;
+    }
+  }
+  stats->capture_us = (long)((now_ns() - start_ns) / 1000);
+  deactivate_streaming(params);
+  stats->frames = config->frames;
+  stats->dropped_frames =
+      frames[config->frames - 1].sequence - frames[0].sequence + 1 -
+      config->frames;
+  if (config->frames > 1) {
+    stats->spacing_avg_us = (long)(spacing_sum_us / (config->frames - 1));
+  }
+
+  /* STREAMOFF hands the buffers back, their mappings keep the frames. */
+  if (config->convert != NULL) {
+    for (n = 0; n < config->frames; n++) {
+      params->buffer = frames[n];
+      params->buffer_start = (void *)stats->data[n];
+      config->convert(params);
+    }
+  }
+
+  if (config->output_path == NULL) {
+    return 0;
+  }
+
+  writers = config->writers;
+  if (writers == 0) {
+    writers = sysconf(_SC_NPROCESSORS_ONLN);
+  }
+  if (writers < 1) {
+    writers = 1;
+  }
+  if (writers > BURST_MAX_WRITERS) {
+    writers = BURST_MAX_WRITERS;
+  }
+  if (writers > (long)config->frames) {
+    writers = config->frames;
+  }
+  stats->writers = (unsigned int)writers;
+
+  job.params = params;
+  job.plane_bytes = (const __u32(*)[CAMERA_MAX_PLANES])plane_bytes;
+  job.plane_data = (const void *const(*)[CAMERA_MAX_PLANES])plane_data;
+  job.count = config->frames;
+  job.output_path = config->output_path;
+  start_ns = now_ns();
+  if (write_frames(&job, stats->writers) < 0) {
+    return -1;
+  }
+  stats->write_us = (long)((now_ns() - start_ns) / 1000);
+
+  return 0;
+}
@@ -0,0 +1,91 @@
+/**
+ * @file burst.h
+ * @brief Burst capture: N consecutive full-resolution frames from one
+ * stream start, each held in its own driver buffer, written out in
+ * parallel once the burst is over.
+ */
+
+#ifndef BURST_H
+#define BURST_H
+
+#include "camera.h"
+
+/**
+ * @brief Still format negotiated for bursts, the full OV5647 array.
+ */
+#define BURST_WIDTH 2592
+#define BURST_HEIGHT 1944
+
+/**
+ * @brief Longest burst: one driver buffer per frame.
+ */
+#define BURST_MAX_FRAMES CAMERA_MAX_BUFFERS
+
+/**
+ * @brief Settings of a burst.
+ * @param frames Frames to take, 1 to BURST_MAX_FRAMES.
+ * @param pixelformat V4L2 fourcc to capture in.
+ * @param writers Threads writing the frames out, 0 for one per online CPU.
+ * @param output_path Base path, numbered like time-lapse shots. NULL keeps
+ * the frames in their buffers only, for a caller that reads the mappings.
+ * @param convert Optional conversion stage run on each frame before it is
+ * written.
+ */
+struct burst_config_t {
+  unsigned int frames;
+  __u32 pixelformat;
+  unsigned int writers;
+  const char *output_path;
+  void (*convert)(struct camera_params_t *params);
+};
+
+/**
+ * @brief Outcome of a burst. Times are in microseconds.
+ * @param width Width the driver settled on.
+ * @param height Height the driver settled on.
+ * @param frames Frames captured and written.
+ * @param dropped_frames Frames the driver skipped inside the burst.
+ * @param spacing_min_us Shortest gap between consecutive frame timestamps.
+ * @param spacing_avg_us Mean gap.
+ * @param spacing_max_us Longest gap.
+ * @param capture_us STREAMON to the last frame.
+ * @param write_us Writing all frames out.
+ * @param writers Writer threads used.
+ * @param indices Driver buffer holding each frame, in capture order. The
+ * driver may grant more buffers than frames, so these are not simply the
+ * first ones.
+ * @param data Start of the payload of each frame's first plane, in
+ * capture order: in buffers[indices[n]], past any data_offset.
+ */
+struct burst_stats_t {
+  __u32 width;
+  __u32 height;
+  unsigned int frames;
+  unsigned long dropped_frames;
+  long spacing_min_us;
+  long spacing_avg_us;
+  long spacing_max_us;
+  long capture_us;
+  long write_us;
+  unsigned int writers;
+  unsigned int indices[BURST_MAX_FRAMES];
+  const void *data[BURST_MAX_FRAMES];
+};
+
+/**
+ * @brief Take a burst on an open device without buffers. Negotiates
+ * BURST_WIDTH x BURST_HEIGHT and at least config->frames buffers, streams
+ * until config->frames of them hold a frame, then writes those out. The
+ * buffers stay mapped on return, the burst in the ones stats->indices
+ * names and at stats->data, until free_buffers() releases them.
+ * @param params Capture state.
+ * @param config Settings.
+ * @param stats Outcome, may be NULL.
+ * @return 0 on success, -1 with errno set: EINVAL for a bad frame count,
+ * ENOBUFS if the driver granted fewer buffers, or the write error.
+ */
+int run_burst(struct camera_params_t *params,
+              const struct burst_config_t *config,
+              struct burst_stats_t *stats);
+
+#endif /* BURST_H */
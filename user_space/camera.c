@@ -0,0 +1,654 @@
+/**
+ * @file camera.c
+ * @brief V4L2 capture lifecycle shared by every capture mode.
+ */
+
+#include "camera.h"
+#include "storage.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include <fcntl.h>
+#include <poll.h>
+#include <unistd.h>
+
+#include <linux/media.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+
+/**
+ * @brief Default text length of a log string.
+ */
+#define DEFAULT_TEXT_LENGTH 256
+
+/**
+ * @brief String buffer to store formatted strings tempoararily for printing.
+ */
+static char message[DEFAULT_TEXT_LENGTH];
+
+/**
+ * @brief Invoke ioctl, restarting when interrupted by a signal.
+ * @param fd File descriptor.
+ * @param request ioctl request code.
+ * @param arg Request argument.
+ * @return ioctl status.
+ */
+static int xioctl(int fd, unsigned long request, void *arg) {
+  int status_code;
+
+  do {
+    status_code = ioctl(fd, request, arg);
+  } while (status_code < 0 && errno == EINTR);
+
+  return status_code;
+}
+
+/**
+ * @brief Whether the device is driven through the multi-planar API.
+ */
+static int multiplanar(const struct camera_params_t *params) {
+  return params->buffer_type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+}
+
+/**
+ * @brief Pick the buffer type: single-planar wherever the device offers
+ * it, so every format keeps one mapping per buffer.
+ */
+static void pick_buffer_type(struct camera_params_t *params) {
+  struct v4l2_capability cap;
+  __u32 caps;
+
+  params->buffer_type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  memset(&cap, 0, sizeof(cap));
+  if (xioctl(params->device_fs, VIDIOC_QUERYCAP, &cap) < 0) {
+    return;
+  }
+  caps = (cap.capabilities & V4L2_CAP_DEVICE_CAPS) ? cap.device_caps
+                                                    : cap.capabilities;
+  if (!(caps & V4L2_CAP_VIDEO_CAPTURE) &&
+      (caps & V4L2_CAP_VIDEO_CAPTURE_MPLANE)) {
+    params->buffer_type = V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE;
+  }
+}
+
+/**
+ * @brief Fill in a format request for the buffer type of the device.
+ */
+static void format_request(const struct camera_params_t *params,
+                           struct v4l2_format *format, __u32 width,
+                           __u32 height, __u32 pixelformat) {
+  memset(format, 0, sizeof(*format));
+  format->type = params->buffer_type;
+  if (multiplanar(params)) {
+    format->fmt.pix_mp.width = width;
+    format->fmt.pix_mp.height = height;
+    format->fmt.pix_mp.pixelformat = pixelformat;
+    format->fmt.pix_mp.field = V4L2_FIELD_NONE;
+    format->fmt.pix_mp.colorspace = V4L2_COLORSPACE_REC709;
+  } else {
+    format->fmt.pix.width = width;
+    format->fmt.pix.height = height;
+    format->fmt.pix.pixelformat = pixelformat;
+    format->fmt.pix.colorspace = V4L2_COLORSPACE_REC709;
+  }
+}
+
+/**
+ * @brief The single-planar view of a multi-planar format: its first
+ * plane.
+ */
+static void flatten_format(const struct v4l2_format *planar,
+                           struct v4l2_format *flat) {
+  const struct v4l2_pix_format_mplane *mp = &planar->fmt.pix_mp;
+
+  memset(flat, 0, sizeof(*flat));
+  flat->type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  flat->fmt.pix.width = mp->width;
+  flat->fmt.pix.height = mp->height;
+  flat->fmt.pix.pixelformat = mp->pixelformat;
+  flat->fmt.pix.field = mp->field;
+  flat->fmt.pix.colorspace = mp->colorspace;
+  flat->fmt.pix.bytesperline = mp->plane_fmt[0].bytesperline;
+  flat->fmt.pix.sizeimage = mp->plane_fmt[0].sizeimage;
+}
+
+/**
+ * @brief Invoke open system call to open the camera device.
+ * @note Requires <sys/types.h> <sys/stat.h> <fcntl.h>.
+ */
+void open_camera_device(struct camera_params_t *params, const char *path) {
+  memset(params, 0, sizeof(*params));
+
+  /* If successful, stores a nonnegative integer to refer to the opened camera
+   * device. */
+  params->device_fs = open(path, O_RDWR | O_NONBLOCK);
+
+  /* Error out on invalid file descriptor. */
+  if (params->device_fs < 0) {
+    snprintf(message, sizeof(message), "Error opening %s", path);
+    perror(message);
+    exit(1);
+  }
+  pick_buffer_type(params);
+  params->plane_count = 1;
+}
+
+/**
+ * @brief Invoke close system call to close the camera device.
+ * @note Requires including <unistd.h>.
+ */
+void close_camera_device(struct camera_params_t *params) {
+  close(params->device_fs);
+  params->device_fs = -1;
+}
+
+/**
+ * @note ioctl systcall requires <sys/ioctl.h>.
+ * The  ioctl()  system  call  manipulates the underlying device parameters of
+ * special files.
+ */
+void set_video_format(struct camera_params_t *params, __u32 width,
+                      __u32 height, __u32 pixelformat) {
+  struct v4l2_format *format = multiplanar(params) ? &params->plane_format
+                                                   : &params->capture_format;
+  int status_code;
+
+  /* Options from enum v4l2_buf_type, select video capture. */
+  format_request(params, format, width, height, pixelformat);
+
+  /* Latch video capture_format. */
+  status_code = xioctl(params->device_fs, VIDIOC_S_FMT, format);
+
+  /* Exit on invalid status. */
+  if (status_code < 0) {
+    perror("VIDIOC_S_FMT");
+    exit(1);
+  }
+
+  params->plane_count = 1;
+  if (multiplanar(params)) {
+    if (format->fmt.pix_mp.num_planes == 0 ||
+        format->fmt.pix_mp.num_planes > CAMERA_MAX_PLANES) {
+      fprintf(stderr, "VIDIOC_S_FMT set %u planes, exiting...\n",
+              format->fmt.pix_mp.num_planes);
+      exit(1);
+    }
+    params->plane_count = format->fmt.pix_mp.num_planes;
+    flatten_format(format, &params->capture_format);
+  }
+}
+
+/**
+ * @brief Bytes a frame of a multi-planar format takes, every plane summed.
+ */
+static size_t planar_size(const struct v4l2_format *planar) {
+  const struct v4l2_pix_format_mplane *mp = &planar->fmt.pix_mp;
+  size_t size = 0;
+  unsigned int plane;
+
+  for (plane = 0; plane < mp->num_planes && plane < CAMERA_MAX_PLANES;
+       plane++) {
+    size += mp->plane_fmt[plane].sizeimage;
+  }
+  return size;
+}
+
+int try_video_format(struct camera_params_t *params, __u32 width,
+                     __u32 height, __u32 pixelformat,
+                     struct v4l2_format *format, size_t *payload) {
+  struct v4l2_format planar;
+
+  if (!multiplanar(params)) {
+    format_request(params, format, width, height, pixelformat);
+    if (xioctl(params->device_fs, VIDIOC_TRY_FMT, format) < 0) {
+      return -1;
+    }
+    if (payload != NULL) {
+      *payload = format->fmt.pix.sizeimage;
+    }
+    return 0;
+  }
+  format_request(params, &planar, width, height, pixelformat);
+  if (xioctl(params->device_fs, VIDIOC_TRY_FMT, &planar) < 0) {
+    return -1;
+  }
+  flatten_format(&planar, format);
+  if (payload != NULL) {
+    *payload = planar_size(&planar);
+  }
+  return 0;
+}
+
+/**
+ * @note Memory mapped buffers are located in device memory and must be
+ * allocated with this ioctl before they can be mapped into the application’s
+ * address space.
+ */
+void request_buffer(struct camera_params_t *params, __u32 count) {
+  int status_code;
+
+  if (count > CAMERA_MAX_BUFFERS) {
+    count = CAMERA_MAX_BUFFERS;
+  }
+
+  memset(&params->buffer_request, 0, sizeof(params->buffer_request));
+
+  /* Options from enum enum v4l2_buf_type, select video_capture. */
+  params->buffer_request.type = params->buffer_type;
+  /* Options from enum v4l2_memory, select mmap. */
+  params->buffer_request.memory = V4L2_MEMORY_MMAP;
+  params->buffer_request.count = count;
+
+  /* Latch buffer request. */
+  status_code =
+      xioctl(params->device_fs, VIDIOC_REQBUFS, &params->buffer_request);
+
+  if (status_code < 0) {
+    perror("VIDIOC_REQBUFS");
+    exit(1);
+  }
+
+  /* The driver may grant fewer (or, within its minimum, more) buffers. */
+  if (params->buffer_request.count == 0 ||
+      params->buffer_request.count > CAMERA_MAX_BUFFERS) {
+    fprintf(stderr, "VIDIOC_REQBUFS granted %u buffers, exiting...\n",
+            params->buffer_request.count);
+    exit(1);
+  }
+}
+
+void allocate_buffer(struct camera_params_t *params) {
+  struct v4l2_plane planes[CAMERA_MAX_PLANES];
+  struct v4l2_buffer query;
+  __u32 index;
+  unsigned int plane;
+
+  for (index = 0; index < params->buffer_request.count; index++) {
+    memset(&query, 0, sizeof(query));
+    memset(planes, 0, sizeof(planes));
+    query.type = params->buffer_type;
+    query.memory = V4L2_MEMORY_MMAP;
+    query.index = index;
+    if (multiplanar(params)) {
+      query.m.planes = planes;
+      query.length = params->plane_count;
+    }
+
+    /* Used to query the status of a buffer. */
+    if (xioctl(params->device_fs, VIDIOC_QUERYBUF, &query) < 0) {
+      perror("Failure on VIDIOC_QUERYBUF, exiting...\n");
+      exit(1);
+    }
+    if (!multiplanar(params)) {
+      /* One plane, the whole buffer. */
+      planes[0].length = query.length;
+      planes[0].m.mem_offset = query.m.offset;
+    }
+
+    /* Maps the /dev/videox camera device file content to a virtual memory
+     * address, each plane on its own. */
+    for (plane = 0; plane < params->plane_count; plane++) {
+      struct camera_buffer_t *mapped = &params->planes[index][plane];
+
+      mapped->length = planes[plane].length;
+      mapped->start =
+          mmap(NULL, planes[plane].length, PROT_READ | PROT_WRITE, MAP_SHARED,
+               params->device_fs, planes[plane].m.mem_offset);
+
+      /* Exit on invalid status. */
+      if (mapped->start == MAP_FAILED) {
+        perror("Failure on mmap, exiting...\n");
+        exit(1);
+      }
+    }
+    params->buffers[index] = params->planes[index][0];
+  }
+}
+
+void free_buffers(struct camera_params_t *params) {
+  struct v4l2_requestbuffers release;
+  __u32 index;
+  unsigned int plane;
+
+  for (index = 0; index < params->buffer_request.count; index++) {
+    for (plane = 0; plane < CAMERA_MAX_PLANES; plane++) {
+      struct camera_buffer_t *mapped = &params->planes[index][plane];
+
+      if (mapped->start != NULL && mapped->start != MAP_FAILED) {
+        munmap(mapped->start, mapped->length);
+      }
+      mapped->start = NULL;
+      mapped->length = 0;
+    }
+    params->buffers[index].start = NULL;
+    params->buffers[index].length = 0;
+  }
+  params->buffer_start = NULL;
+
+  /* A zero count frees the buffers in the driver. */
+  memset(&release, 0, sizeof(release));
+  release.type = params->buffer_type;
+  release.memory = V4L2_MEMORY_MMAP;
+  release.count = 0;
+  if (xioctl(params->device_fs, VIDIOC_REQBUFS, &release) < 0) {
+    perror("VIDIOC_REQBUFS 0");
+  }
+  params->buffer_request.count = 0;
+}
+
+void queue_buffer(struct camera_params_t *params, __u32 index) {
+  struct v4l2_plane planes[CAMERA_MAX_PLANES];
+  struct v4l2_buffer queue;
+
+  memset(&queue, 0, sizeof(queue));
+  memset(planes, 0, sizeof(planes));
+  queue.type = params->buffer_type;
+  queue.memory = V4L2_MEMORY_MMAP;
+  queue.index = index;
+  if (multiplanar(params)) {
+    queue.m.planes = planes;
+    queue.length = params->plane_count;
+  }
+
+  /* Queue buffer: submitting the empty buffer in the driver's incoming queue,
+   * to fill CMOS captured pixels. */
+  if (xioctl(params->device_fs, VIDIOC_QBUF, &queue) < 0) {
+    perror("VIDIOC_QBUF");
+    exit(1);
+  }
+}
+
+void activate_streaming(struct camera_params_t *params) {
+  __u32 index;
+
+  for (index = 0; index < params->buffer_request.count; index++) {
+    queue_buffer(params, index);
+  }
+
+  start_streaming(params);
+}
+
+void start_streaming(struct camera_params_t *params) {
+  enum v4l2_buf_type type = params->buffer_type;
+
+  /* Latch streaming on. */
+  if (xioctl(params->device_fs, VIDIOC_STREAMON, &type) < 0) {
+    perror("VIDIOC_STREAMON");
+    exit(1);
+  }
+
+  params->next_sequence = 0;
+}
+
+/**
+ * @brief Wait until the driver has a buffer ready to dequeue.
+ * @param params Capture state.
+ * @return None, exits on timeout.
+ */
+static void wait_for_frame(struct camera_params_t *params) {
+  struct pollfd pfd = {.fd = params->device_fs, .events = POLLIN};
+  int status_code;
+
+  do {
+    status_code = poll(&pfd, 1, CAMERA_FRAME_TIMEOUT_MS);
+  } while (status_code < 0 && errno == EINTR);
+
+  if (status_code < 0) {
+    perror("poll");
+    exit(1);
+  }
+  if (status_code == 0) {
+    fprintf(stderr, "Timed out waiting for a frame, exiting...\n");
+    exit(1);
+  }
+}
+
+/**
+ * @brief Whether every plane of the dequeued buffer holds a payload that
+ * fits its mapping. Takes the data_offset of each plane off its bytesused,
+ * which counts from the start of the plane, and copies the payload of the
+ * first plane of a multi-planar buffer to buffer.bytesused, where the rest
+ * of the program reads it.
+ * @param params Capture state, buffer just dequeued.
+ * @return Non-zero if the payload is usable.
+ */
+static int payload_fits(struct camera_params_t *params) {
+  const struct camera_buffer_t *mapped = params->planes[params->buffer.index];
+  unsigned int plane;
+
+  if (!multiplanar(params)) {
+    params->buffer_planes[0].bytesused = params->buffer.bytesused;
+  }
+  for (plane = 0; plane < params->plane_count; plane++) {
+    struct v4l2_plane *filled = &params->buffer_planes[plane];
+
+    if (filled->bytesused <= filled->data_offset ||
+        filled->bytesused > mapped[plane].length) {
+      return 0;
+    }
+    filled->bytesused -= filled->data_offset;
+  }
+  params->buffer.bytesused = params->buffer_planes[0].bytesused;
+  return 1;
+}
+
+void get_frame(struct camera_params_t *params) {
+  int retries = 0;
+
+  for (;;) {
+    memset(&params->buffer, 0, sizeof(params->buffer));
+    memset(params->buffer_planes, 0, sizeof(params->buffer_planes));
+    params->buffer.type = params->buffer_type;
+    params->buffer.memory = V4L2_MEMORY_MMAP;
+    if (multiplanar(params)) {
+      params->buffer.m.planes = params->buffer_planes;
+      params->buffer.length = params->plane_count;
+    }
+
+    /* Dequeue buffer: retrieving the filled data with beautiful pixels. */
+    if (xioctl(params->device_fs, VIDIOC_DQBUF, &params->buffer) < 0) {
+      if (errno == EAGAIN) {
+        /* Nothing ready yet, not a failure. */
+        wait_for_frame(params);
+        continue;
+      }
+      if (errno != EIO) {
+        perror("VIDIOC_DQBUF");
+        exit(1);
+      }
+      /* EIO is a transient problem such as signal loss. */
+      params->errored_frames++;
+    } else if ((params->buffer.flags & V4L2_BUF_FLAG_ERROR) ||
+               !payload_fits(params)) {
+      /* Corrupt or empty payload, hand the buffer straight back. */
+      params->errored_frames++;
+      queue_buffer(params, params->buffer.index);
+    } else {
+      break;
+    }
+
+    if (++retries > CAMERA_MAX_RETRIES) {
+      fprintf(stderr, "VIDIOC_DQBUF failed %d times in a row, exiting...\n",
+              retries);
+      exit(1);
+    }
+  }
+
+  /* Frames the driver had to drop show up as gaps in the sequence. */
+  if (params->frames > 0 && params->buffer.sequence > params->next_sequence) {
+    params->dropped_frames += params->buffer.sequence - params->next_sequence;
+  }
+  params->next_sequence = params->buffer.sequence + 1;
+  params->frames++;
+
+  params->buffer_start = (void *)plane_payload(params, 0);
+}
+
+const void *plane_payload(const struct camera_params_t *params,
+                          unsigned int plane) {
+  return (const char *)params->planes[params->buffer.index][plane].start +
+         params->buffer_planes[plane].data_offset;
+}
+
+void release_frame(struct camera_params_t *params) {
+  queue_buffer(params, params->buffer.index);
+  params->buffer_start = NULL;
+}
+
+void deactivate_streaming(struct camera_params_t *params) {
+  enum v4l2_buf_type type = params->buffer_type;
+
+  /* Latch streaming off. */
+  if (xioctl(params->device_fs, VIDIOC_STREAMOFF, &type) < 0) {
+    perror("VIDIOC_STREAMOFF");
+    exit(1);
+  }
+}
+
+__u32 plane_bytesperline(const struct camera_params_t *params,
+                         unsigned int plane) {
+  if (!multiplanar(params)) {
+    return params->capture_format.fmt.pix.bytesperline;
+  }
+  return params->plane_format.fmt.pix_mp.plane_fmt[plane].bytesperline;
+}
+
+int get_camera_control(struct camera_params_t *params, __u32 id, int *value) {
+  struct v4l2_control control = {.id = id};
+
+  if (xioctl(params->device_fs, VIDIOC_G_CTRL, &control) < 0) {
+    return -1;
+  }
+  *value = control.value;
+  return 0;
+}
+
+int set_camera_control(struct camera_params_t *params, __u32 id, int value) {
+  struct v4l2_control control = {.id = id, .value = value};
+
+  return xioctl(params->device_fs, VIDIOC_S_CTRL, &control);
+}
+
+int alloc_media_request(int media_fd) {
+  int request_fd;
+
+  if (xioctl(media_fd, MEDIA_IOC_REQUEST_ALLOC, &request_fd) < 0) {
+    return -1;
+  }
+  return request_fd;
+}
+
+int set_request_control(struct camera_params_t *params, int request_fd,
+                        __u32 id, int value) {
+  struct v4l2_ext_control control = {.id = id, .value = value};
+  struct v4l2_ext_controls controls = {
+      .which = V4L2_CTRL_WHICH_REQUEST_VAL,
+      .count = 1,
+      .request_fd = request_fd,
+      .controls = &control,
+  };
+
+  return xioctl(params->device_fs, VIDIOC_S_EXT_CTRLS, &controls);
+}
+
+int queue_request_buffer(struct camera_params_t *params, __u32 index,
+                         int request_fd) {
+  struct v4l2_plane planes[CAMERA_MAX_PLANES];
+  struct v4l2_buffer queue;
+
+  memset(&queue, 0, sizeof(queue));
+  memset(planes, 0, sizeof(planes));
+  queue.type = params->buffer_type;
+  queue.memory = V4L2_MEMORY_MMAP;
+  queue.index = index;
+  if (multiplanar(params)) {
+    queue.m.planes = planes;
+    queue.length = params->plane_count;
+  }
+  queue.flags = V4L2_BUF_FLAG_REQUEST_FD;
+  queue.request_fd = request_fd;
+
+  return xioctl(params->device_fs, VIDIOC_QBUF, &queue);
+}
+
+int queue_media_request(int request_fd) {
+  return xioctl(request_fd, MEDIA_REQUEST_IOC_QUEUE, NULL);
+}
+
+/**
+ * @note open syscall requires <sys/types.h> <sys/stat.h> <fcntl.h>.
+ */
+size_t payload_size(const struct camera_params_t *params) {
+  if (!multiplanar(params)) {
+    return params->capture_format.fmt.pix.sizeimage;
+  }
+  return planar_size(&params->plane_format);
+}
+
+size_t copy_payload(const struct camera_params_t *params, void *dst,
+                    size_t capacity) {
+  size_t copied = 0;
+  unsigned int plane;
+
+  for (plane = 0; plane < params->plane_count && copied < capacity;
+       plane++) {
+    const void *start = params->buffer_start;
+    size_t bytes = params->buffer.bytesused;
+
+    if (plane > 0) {
+      start = plane_payload(params, plane);
+      bytes = params->buffer_planes[plane].bytesused;
+    }
+    if (bytes > capacity - copied) {
+      bytes = capacity - copied;
+    }
+    memcpy((char *)dst + copied, start, bytes);
+    copied += bytes;
+  }
+  return copied;
+}
+
+void save_to_image(struct camera_params_t *params, const char *path) {
+  unsigned int plane;
+  int image_fd;
+
+  /* Create this file if not exist, replace it otherwise, write only. */
+  image_fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0660);
+
+  /* Exit on invalid descriptor. */
+  if (image_fd < 0) {
+    perror("open");
+    exit(1);
+  }
+
+  /* Only the first bytesused bytes of the buffer hold the frame. A short
+   * write leaves a truncated image, so every byte is checked. */
+  for (plane = 0; plane < params->plane_count; plane++) {
+    const void *start = params->buffer_start;
+    size_t bytes = params->buffer.bytesused;
+
+    if (plane > 0) {
+      start = plane_payload(params, plane);
+      bytes = params->buffer_planes[plane].bytesused;
+    }
+    if (write_full(image_fd, start, bytes) < 0) {
+      snprintf(message, sizeof(message), "Error writing %s", path);
+      perror(message);
+      close(image_fd);
+      exit(1);
+    }
+  }
+
+  /* Close the file descriptor, which is where NFS and friends report
+   * deferred write errors. */
+  if (close(image_fd) < 0) {
+    snprintf(message, sizeof(message), "Error closing %s", path);
+    perror(message);
+    exit(1);
+  }
+}
@@ -0,0 +1,320 @@
+/**
+ * @file camera.h
+ * @brief V4L2 capture lifecycle: open, format, buffer request, mmap, stream,
+ * dequeue and save. Devices that only offer the multi-planar API
+ * (V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) are driven through it, each plane
+ * of a buffer mapped on its own. The rest of the program still reads the
+ * single-planar format and buffers: for formats with one plane they are
+ * the whole frame, for NV12M or YUV420M they are the first plane, and the
+ * other planes are in planes and buffer_planes.
+ */
+
+#ifndef CAMERA_H
+#define CAMERA_H
+
+#include <stddef.h>
+
+#include <linux/videodev2.h>
+
+/**
+ * @brief Upper bound of driver buffers the application keeps mapped.
+ */
+#define CAMERA_MAX_BUFFERS 16
+
+/**
+ * @brief Default number of driver buffers requested for streaming.
+ */
+#define CAMERA_DEFAULT_BUFFERS 4
+
+/**
+ * @brief How long get_frame() waits for the driver before giving up, in
+ * milliseconds.
+ */
+#define CAMERA_FRAME_TIMEOUT_MS 5000
+
+/**
+ * @brief Consecutive failed dequeues (EIO, error flagged or empty buffers)
+ * tolerated before get_frame() gives up.
+ */
+#define CAMERA_MAX_RETRIES 8
+
+/**
+ * @brief Most planes of a buffer, three for YUV420M.
+ */
+#define CAMERA_MAX_PLANES 3
+
+/**
+ * @brief A driver buffer mapped into the application's address space.
+ * @param start Start address of the mapping.
+ * @param length Length of the mapping in bytes.
+ */
+struct camera_buffer_t {
+  void *start;
+  size_t length;
+};
+
+/**
+ * @brief Book keeps parameters for image / video capturing.
+ * @param device_fs File descriptor to the opened camera hardware.
+ * @param buffer_type V4L2_BUF_TYPE_VIDEO_CAPTURE, or _MPLANE for a device
+ * without the single-planar API.
+ * @param capture_format Format latched with VIDIOC_S_FMT, as a
+ * single-planar format: bytesperline and sizeimage are those of the first
+ * plane.
+ * @param plane_format The multi-planar format the driver latched, with
+ * every plane; only set for _MPLANE.
+ * @param plane_count Planes of each buffer, 1 for single-planar.
+ * @param buffer_request Request for frame buffers, count holds what the
+ * driver granted.
+ * @param buffer The most recently dequeued video buffer. bytesused is that
+ * of the first plane, also for _MPLANE, where m.planes points to
+ * buffer_planes.
+ * @param buffer_planes Planes of buffer, with the bytesused of each less
+ * its data_offset: the payload alone, without the header a driver may put
+ * before it.
+ * @param buffer_start Start address of the payload of buffer, past the
+ * data_offset of its first plane.
+ * @param buffers Every mapped driver buffer, by index; the first plane.
+ * @param planes Every mapped plane, by buffer index and plane.
+ * @param next_sequence Sequence number expected from the next dequeue.
+ * @param frames Frames dequeued successfully.
+ * @param dropped_frames Frames the driver skipped, from sequence gaps.
+ * @param errored_frames Dequeues that failed or returned unusable buffers.
+ * @note The V4L2 structs are defined in <linux/videodev2.h>.
+ */
+struct camera_params_t {
+  int device_fs;
+  __u32 buffer_type;
+  struct v4l2_format capture_format;
+  struct v4l2_format plane_format;
+  unsigned int plane_count;
+  struct v4l2_requestbuffers buffer_request;
+  struct v4l2_buffer buffer;
+  struct v4l2_plane buffer_planes[CAMERA_MAX_PLANES];
+  void *buffer_start;
+  struct camera_buffer_t buffers[CAMERA_MAX_BUFFERS];
+  struct camera_buffer_t planes[CAMERA_MAX_BUFFERS][CAMERA_MAX_PLANES];
+  __u32 next_sequence;
+  unsigned long frames;
+  unsigned long dropped_frames;
+  unsigned long errored_frames;
+};
+
+/**
+ * @brief Open the camera device, non-blocking so dequeues can be bounded by
+ * a timeout, and pick the buffer type it captures with.
+ * @param params Capture state to initialize.
+ * @param path Path to the device, e.g. /dev/video0.
+ * @return None, exits on failure.
+ */
+void open_camera_device(struct camera_params_t *params, const char *path);
+
+/**
+ * @brief Close the camera device.
+ * @param params Capture state.
+ * @return None.
+ */
+void close_camera_device(struct camera_params_t *params);
+
+/**
+ * @brief Set the video / image format to be captured by the camera.
+ * @param params Capture state.
+ * @param width Frame width in pixels.
+ * @param height Frame height in pixels.
+ * @param pixelformat V4L2 fourcc, e.g. V4L2_PIX_FMT_MJPEG.
+ * @return None, exits on failure.
+ */
+void set_video_format(struct camera_params_t *params, __u32 width,
+                      __u32 height, __u32 pixelformat);
+
+/**
+ * @brief Ask the driver what a format would become, without applying it or
+ * disturbing a running stream (VIDIOC_TRY_FMT).
+ * @param params Capture state.
+ * @param width Frame width in pixels.
+ * @param height Frame height in pixels.
+ * @param pixelformat V4L2 fourcc.
+ * @param format Set to the format the driver would pick, sizeimage
+ * included, as a single-planar format.
+ * @param payload Set to the bytes a frame takes with every plane, what
+ * copy_payload() needs room for; may be NULL.
+ * @return 0 on success, -1 with errno set if the driver rejects it.
+ */
+int try_video_format(struct camera_params_t *params, __u32 width,
+                     __u32 height, __u32 pixelformat,
+                     struct v4l2_format *format, size_t *payload);
+
+/**
+ * @brief Request memory mapped buffers from V4L2.
+ * @param params Capture state.
+ * @param count Number of buffers wanted, the driver may grant fewer.
+ * @return None, exits on failure.
+ */
+void request_buffer(struct camera_params_t *params, __u32 count);
+
+/**
+ * @brief Query and map every granted buffer.
+ * @param params Capture state.
+ * @return None, exits on failure.
+ */
+void allocate_buffer(struct camera_params_t *params);
+
+/**
+ * @brief Unmap every buffer and release them in the driver (REQBUFS 0).
+ * @param params Capture state.
+ * @return None.
+ */
+void free_buffers(struct camera_params_t *params);
+
+/**
+ * @brief Queue every buffer and activate streaming on the camera.
+ * @param params Capture state.
+ * @return None, exits on failure.
+ */
+void activate_streaming(struct camera_params_t *params);
+
+/**
+ * @brief Activate streaming with whatever the caller queued, e.g. buffers
+ * bound to media requests.
+ * @param params Capture state.
+ * @return None, exits on failure.
+ */
+void start_streaming(struct camera_params_t *params);
+
+/**
+ * @brief Dequeue the next good frame into params->buffer. Waits while the
+ * driver has nothing ready, retries transient errors and requeues buffers
+ * the driver flagged as broken or empty.
+ * @param params Capture state.
+ * @return None, exits on timeout or persistent errors.
+ */
+void get_frame(struct camera_params_t *params);
+
+/**
+ * @brief Give the buffer returned by get_frame() back to the driver.
+ * @param params Capture state.
+ * @return None, exits on failure.
+ */
+void release_frame(struct camera_params_t *params);
+
+/**
+ * @brief Queue a buffer by index.
+ * @param params Capture state.
+ * @param index Buffer index.
+ * @return None, exits on failure.
+ */
+void queue_buffer(struct camera_params_t *params, __u32 index);
+
+/**
+ * @brief Deactivate streaming on the camera. All buffers return to the
+ * application.
+ * @param params Capture state.
+ * @return None, exits on failure.
+ */
+void deactivate_streaming(struct camera_params_t *params);
+
+/**
+ * @brief Bytes per line of a plane of the format set.
+ * @param params Capture state, format set.
+ * @param plane Plane, below plane_count.
+ * @return Bytes per line, 0 for compressed formats.
+ */
+__u32 plane_bytesperline(const struct camera_params_t *params,
+                         unsigned int plane);
+
+/**
+ * @brief Read a control, e.g. V4L2_CID_JPEG_COMPRESSION_QUALITY.
+ * @param params Capture state.
+ * @param id Control id.
+ * @param value Destination of the value.
+ * @return 0 on success, -1 if the driver lacks the control.
+ */
+int get_camera_control(struct camera_params_t *params, __u32 id, int *value);
+
+/**
+ * @brief Set a control.
+ * @param params Capture state.
+ * @param id Control id.
+ * @param value New value.
+ * @return 0 on success, -1 if the driver rejected it.
+ */
+int set_camera_control(struct camera_params_t *params, __u32 id, int value);
+
+/**
+ * @brief Allocate a media request (MEDIA_IOC_REQUEST_ALLOC).
+ * @param media_fd Open media device of the camera.
+ * @return Request descriptor, close() frees it. -1 with errno set if the
+ * device has no Request API.
+ */
+int alloc_media_request(int media_fd);
+
+/**
+ * @brief Store a control value in a request rather than set it now, so it
+ * applies to exactly the frame the request carries.
+ * @param params Capture state.
+ * @param request_fd Request, not queued yet.
+ * @param id Control id.
+ * @param value Value.
+ * @return 0 on success, -1 with errno set.
+ */
+int set_request_control(struct camera_params_t *params, int request_fd,
+                        __u32 id, int value);
+
+/**
+ * @brief Queue a buffer into a request. It reaches the driver when the
+ * request is queued.
+ * @param params Capture state.
+ * @param index Buffer index.
+ * @param request_fd Request, not queued yet.
+ * @return 0 on success, -1 with errno set.
+ */
+int queue_request_buffer(struct camera_params_t *params, __u32 index,
+                         int request_fd);
+
+/**
+ * @brief Hand a request with its controls and buffer to the driver
+ * (MEDIA_REQUEST_IOC_QUEUE).
+ * @param request_fd Request.
+ * @return 0 on success, -1 with errno set.
+ */
+int queue_media_request(int request_fd);
+
+/**
+ * @brief Start of a plane's payload in the dequeued buffer: its mapping
+ * past the data_offset the driver reported.
+ * @param params Capture state holding the frame.
+ * @param plane Plane, below plane_count.
+ * @return Start of the payload, buffer_planes[plane].bytesused long.
+ */
+const void *plane_payload(const struct camera_params_t *params,
+                          unsigned int plane);
+
+/**
+ * @brief Bytes a frame of the latched format takes with every plane:
+ * sizeimage, or the sizeimage of each plane summed for _MPLANE.
+ * @param params Capture state, format set.
+ * @return Size in bytes.
+ */
+size_t payload_size(const struct camera_params_t *params);
+
+/**
+ * @brief Copy the payload of the dequeued frame, plane after plane as
+ * save_to_image() writes it.
+ * @param params Capture state holding the frame.
+ * @param dst Destination.
+ * @param capacity Size of dst, where the payload is cut.
+ * @return Bytes copied.
+ */
+size_t copy_payload(const struct camera_params_t *params, void *dst,
+                    size_t capacity);
+
+/**
+ * @brief Save the payload of the dequeued frame to a file, plane after
+ * plane.
+ * @param params Capture state.
+ * @param path Destination path, replaced if it exists.
+ * @return None, exits on failure (including partial writes and ENOSPC).
+ */
+void save_to_image(struct camera_params_t *params, const char *path);
+
+#endif /* CAMERA_H */
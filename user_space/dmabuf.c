@@ -0,0 +1,133 @@
+/**
+ * @file dmabuf.c
+ * @brief Exported driver buffers.
+ * @note The driver keeps an exported buffer for as long as the dma-buf or
+ * a mapping of it lives, so the set has to be released before
+ * free_buffers() or VIDIOC_REQBUFS fails with EBUSY.
+ */
+
+#include "dmabuf.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+
+/**
+ * @brief Invoke ioctl, restarting when interrupted by a signal. A sync may
+ * also ask to be retried with EAGAIN while the device still writes.
+ * @param fd File descriptor.
+ * @param request ioctl request code.
+ * @param arg ioctl argument.
+ * @return ioctl status.
+ */
+static int xioctl(int fd, unsigned long request, void *arg) {
+  int status_code;
+
+  do {
+    status_code = ioctl(fd, request, arg);
+  } while (status_code < 0 && (errno == EINTR || errno == EAGAIN));
+
+  return status_code;
+}
+
+/**
+ * @brief Export one buffer and map it.
+ */
+static int export_buffer(struct dmabuf_t *buffer,
+                         const struct camera_params_t *params, __u32 index,
+                         enum dmabuf_access_t access) {
+  struct v4l2_exportbuffer request;
+
+  memset(&request, 0, sizeof(request));
+  request.type = params->buffer_type;
+  request.index = index;
+  request.flags = O_CLOEXEC | (access == DMABUF_READ ? O_RDONLY : O_RDWR);
+  if (xioctl(params->device_fs, VIDIOC_EXPBUF, &request) < 0) {
+    return -1;
+  }
+  buffer->fd = request.fd;
+  buffer->access = access;
+  buffer->length = params->buffers[index].length;
+  buffer->start =
+      mmap(NULL, buffer->length,
+           access == DMABUF_READ ? PROT_READ : PROT_READ | PROT_WRITE,
+           MAP_SHARED, buffer->fd, 0);
+  if (buffer->start == MAP_FAILED) {
+    buffer->start = NULL;
+    return -1;
+  }
+  return 0;
+}
+
+int dmabuf_export(struct dmabuf_set_t *set,
+                  const struct camera_params_t *params,
+                  enum dmabuf_access_t access) {
+  __u32 index;
+
+  memset(set, 0, sizeof(*set));
+  for (index = 0; index < CAMERA_MAX_BUFFERS; index++) {
+    set->buffers[index].fd = -1;
+  }
+  if (params->plane_count > 1) {
+    /* A dma-buf per plane is not worth it for the formats there are. */
+    errno = EINVAL;
+    return -1;
+  }
+
+  for (index = 0; index < params->buffer_request.count; index++) {
+    set->count = index + 1;
+    if (export_buffer(&set->buffers[index], params, index, access) < 0) {
+      int saved = errno;
+
+      dmabuf_release(set);
+      errno = saved;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+void dmabuf_release(struct dmabuf_set_t *set) {
+  unsigned int index;
+
+  for (index = 0; index < set->count; index++) {
+    struct dmabuf_t *buffer = &set->buffers[index];
+
+    if (buffer->start != NULL) {
+      munmap(buffer->start, buffer->length);
+      buffer->start = NULL;
+    }
+    if (buffer->fd >= 0) {
+      close(buffer->fd);
+      buffer->fd = -1;
+    }
+  }
+  set->count = 0;
+}
+
+/**
+ * @brief Issue DMA_BUF_IOCTL_SYNC.
+ */
+static int sync_buffer(const struct dmabuf_t *buffer,
+                       enum dmabuf_access_t access, __u64 when) {
+  struct dma_buf_sync sync;
+
+  if ((access & ~buffer->access) != 0) {
+    errno = EACCES;
+    return -1;
+  }
+  sync.flags = when | (__u64)access;
+  return xioctl(buffer->fd, DMA_BUF_IOCTL_SYNC, &sync);
+}
+
+int dmabuf_begin(const struct dmabuf_t *buffer, enum dmabuf_access_t access) {
+  return sync_buffer(buffer, access, DMA_BUF_SYNC_START);
+}
+
+int dmabuf_end(const struct dmabuf_t *buffer, enum dmabuf_access_t access) {
+  return sync_buffer(buffer, access, DMA_BUF_SYNC_END);
+}
@@ -0,0 +1,94 @@
+/**
+ * @file dmabuf.h
+ * @brief Driver buffers exported as dma-bufs (VIDIOC_EXPBUF) and read
+ * through mappings of those. Such a mapping is cached even on SoCs whose
+ * drivers map MMAP buffers uncached, so it reads at memory speed, but
+ * then the cache is not coherent with the device: every CPU access has to
+ * sit between DMA_BUF_SYNC_START and DMA_BUF_SYNC_END, which invalidate
+ * and flush it, for just the directions the CPU uses. A read-only bracket
+ * invalidates the lines of the frame and flushes nothing.
+ */
+
+#ifndef DMABUF_H
+#define DMABUF_H
+
+#include <stddef.h>
+
+#include <linux/dma-buf.h>
+
+#include "camera.h"
+
+/**
+ * @brief What the CPU does with a buffer between dmabuf_begin() and
+ * dmabuf_end().
+ */
+enum dmabuf_access_t {
+  DMABUF_READ = DMA_BUF_SYNC_READ,
+  DMABUF_WRITE = DMA_BUF_SYNC_WRITE,
+  DMABUF_READ_WRITE = DMA_BUF_SYNC_RW,
+};
+
+/**
+ * @brief One exported buffer.
+ * @param fd The dma-buf, -1 if not exported.
+ * @param start Its mapping, NULL if not mapped.
+ * @param length Length of the mapping.
+ * @param access Directions it may be mapped and accessed for.
+ */
+struct dmabuf_t {
+  int fd;
+  void *start;
+  size_t length;
+  enum dmabuf_access_t access;
+};
+
+/**
+ * @brief The exported buffers of a device, by driver buffer index.
+ * @param buffers Exported buffers.
+ * @param count Buffers exported.
+ */
+struct dmabuf_set_t {
+  struct dmabuf_t buffers[CAMERA_MAX_BUFFERS];
+  unsigned int count;
+};
+
+/**
+ * @brief Export every buffer of a device and map it.
+ * @param set Set to fill.
+ * @param params Capture state, buffers allocated.
+ * @param access DMABUF_READ to export and map the buffers read-only, so a
+ * stray write faults instead of corrupting a frame.
+ * @return 0 on success, -1 with errno set if the driver cannot export or
+ * the buffers cannot be mapped, EINVAL for a format with several planes;
+ * nothing stays exported then.
+ */
+int dmabuf_export(struct dmabuf_set_t *set,
+                  const struct camera_params_t *params,
+                  enum dmabuf_access_t access);
+
+/**
+ * @brief Unmap and close the exported buffers. Safe on a set that failed
+ * to export.
+ * @param set Set.
+ * @return None.
+ */
+void dmabuf_release(struct dmabuf_set_t *set);
+
+/**
+ * @brief Open CPU access to a buffer the device is done with.
+ * @param buffer Exported buffer.
+ * @param access Directions of the access, within those it was exported
+ * for.
+ * @return 0 on success, -1 with errno set.
+ */
+int dmabuf_begin(const struct dmabuf_t *buffer, enum dmabuf_access_t access);
+
+/**
+ * @brief Close CPU access before the buffer goes back to the device.
+ * @param buffer Exported buffer.
+ * @param access The directions dmabuf_begin() was given.
+ * @return 0 on success, -1 with errno set.
+ */
+int dmabuf_end(const struct dmabuf_t *buffer, enum dmabuf_access_t access);
+
+#endif /* DMABUF_H */
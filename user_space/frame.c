@@ -0,0 +1,265 @@
+/**
+ * @file frame.c
+ * @brief Shared frames.
+ * @note Holds are a plain atomic count, so handing a frame on or letting
+ * it go costs no lock; only the last release, which requeues the buffer,
+ * takes the lock to wake frame_share_close(). The watchdog only reads the
+ * handles, a hold it reports may end while it prints. With dma-bufs the
+ * CPU access bracket spans the whole hold, not each consumer's: one sync
+ * pair per frame however many consumers read it.
+ */
+
+#include "frame.h"
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * @brief Current CLOCK_MONOTONIC time in nanoseconds.
+ */
+static long long monotonic_ns(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+void frame_share_init(struct frame_share_t *share,
+                      struct camera_params_t *params) {
+  unsigned int i;
+  unsigned int plane;
+
+  memset(share, 0, sizeof(*share));
+  share->params = params;
+  for (i = 0; i < CAMERA_MAX_BUFFERS; i++) {
+    struct frame_handle_t *frame = &share->handles[i];
+
+    frame->share = share;
+    frame->index = i;
+    frame->data = params->buffers[i].start;
+    frame->length = params->buffers[i].length;
+    for (plane = 0; plane < CAMERA_MAX_PLANES; plane++) {
+      frame->plane_data[plane] = params->planes[i][plane].start;
+    }
+    atomic_init(&frame->dequeued_ns, 0);
+    atomic_init(&frame->sequence, 0);
+    atomic_init(&frame->refs, 0);
+    atomic_init(&frame->holders, 0);
+    atomic_init(&frame->reported, 0);
+  }
+  for (i = 0; i < FRAME_MAX_CONSUMERS; i++) {
+    atomic_init(&share->overdue_by[i], 0);
+  }
+  atomic_init(&share->outstanding, 0);
+  atomic_init(&share->requeues, 0);
+  atomic_init(&share->held_ns_max, 0);
+  atomic_init(&share->stalls, 0);
+  atomic_init(&share->overdue, 0);
+  for (i = 0; i < CAMERA_MAX_BUFFERS; i++) {
+    share->dmabuf.buffers[i].fd = -1;
+  }
+  pthread_mutex_init(&share->lock, NULL);
+  pthread_cond_init(&share->released, NULL);
+  /* Only costs a copy the speed of cached memory if it fails. */
+  mapping_probe(params->buffers[0].start, params->buffers[0].length,
+                &share->mapping);
+}
+
+int frame_share_use_dmabuf(struct frame_share_t *share) {
+  struct dmabuf_t *first;
+  unsigned int i;
+
+  if (dmabuf_export(&share->dmabuf, share->params, DMABUF_READ) < 0) {
+    return -1;
+  }
+  for (i = 0; i < share->dmabuf.count; i++) {
+    share->handles[i].data = share->dmabuf.buffers[i].start;
+    share->handles[i].plane_data[0] = share->handles[i].data;
+  }
+  /* The probe reads too, and the device is not streaming yet. */
+  first = &share->dmabuf.buffers[0];
+  if (dmabuf_begin(first, DMABUF_READ) == 0) {
+    mapping_probe(first->start, first->length, &share->mapping);
+    dmabuf_end(first, DMABUF_READ);
+  }
+  return 0;
+}
+
+int frame_share_consumer(struct frame_share_t *share, const char *name) {
+  if (share->consumer_count == FRAME_MAX_CONSUMERS) {
+    errno = ENOSPC;
+    return -1;
+  }
+  snprintf(share->names[share->consumer_count], FRAME_MAX_NAME, "%s", name);
+  return (int)share->consumer_count++;
+}
+
+struct frame_handle_t *frame_share_dequeue(struct frame_share_t *share,
+                                           unsigned int consumer) {
+  struct frame_handle_t *frame;
+
+  if (atomic_load(&share->outstanding) ==
+      share->params->buffer_request.count) {
+    atomic_fetch_add(&share->stalls, 1);
+    pthread_mutex_lock(&share->lock);
+    while (atomic_load(&share->outstanding) ==
+           share->params->buffer_request.count) {
+      pthread_cond_wait(&share->released, &share->lock);
+    }
+    pthread_mutex_unlock(&share->lock);
+  }
+  get_frame(share->params);
+  frame = &share->handles[share->params->buffer.index];
+  if (share->dmabuf.count > 0 &&
+      dmabuf_begin(&share->dmabuf.buffers[frame->index], DMABUF_READ) < 0) {
+    perror("DMA_BUF_SYNC_START");
+    exit(1);
+  }
+  frame->buffer = share->params->buffer;
+  memcpy(frame->planes, share->params->buffer_planes, sizeof(frame->planes));
+  if (share->params->buffer_type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE) {
+    frame->buffer.m.planes = frame->planes;
+  }
+  atomic_store(&frame->dequeued_ns, monotonic_ns());
+  atomic_store(&frame->sequence, frame->buffer.sequence);
+  atomic_store(&frame->reported, 0);
+  atomic_store(&frame->holders, 1u << consumer);
+  atomic_store(&frame->refs, 1);
+  atomic_fetch_add(&share->outstanding, 1);
+  /* The handle is the way to the buffer now. */
+  share->params->buffer_start = NULL;
+  return frame;
+}
+
+void frame_handle_get(struct frame_handle_t *frame, unsigned int consumer) {
+  atomic_fetch_or(&frame->holders, 1u << consumer);
+  atomic_fetch_add(&frame->refs, 1);
+}
+
+void frame_handle_put(struct frame_handle_t *frame, unsigned int consumer) {
+  struct frame_share_t *share = frame->share;
+  long long held;
+  long long max;
+
+  atomic_fetch_and(&frame->holders, ~(1u << consumer));
+  if (atomic_fetch_sub(&frame->refs, 1) != 1) {
+    return;
+  }
+
+  held = monotonic_ns() - atomic_load(&frame->dequeued_ns);
+  max = atomic_load(&share->held_ns_max);
+  while (held > max &&
+         !atomic_compare_exchange_weak(&share->held_ns_max, &max, held)) {
+  }
+  atomic_fetch_add(&share->requeues, 1);
+  if (share->dmabuf.count > 0 &&
+      dmabuf_end(&share->dmabuf.buffers[frame->index], DMABUF_READ) < 0) {
+    perror("DMA_BUF_SYNC_END");
+    exit(1);
+  }
+  /* From here on the driver may hand the buffer out again. */
+  queue_buffer(share->params, frame->index);
+
+  pthread_mutex_lock(&share->lock);
+  atomic_fetch_sub(&share->outstanding, 1);
+  pthread_cond_broadcast(&share->released);
+  pthread_mutex_unlock(&share->lock);
+}
+
+unsigned int frame_share_free(struct frame_share_t *share) {
+  return share->params->buffer_request.count -
+         atomic_load(&share->outstanding);
+}
+
+/**
+ * @brief Report the holds over the limit that were not reported yet.
+ */
+static void check_holds(struct frame_share_t *share) {
+  long long now = monotonic_ns();
+  unsigned int i;
+
+  for (i = 0; i < share->params->buffer_request.count; i++) {
+    struct frame_handle_t *frame = &share->handles[i];
+    unsigned int holders;
+    unsigned int c;
+    char names[256];
+    size_t used = 0;
+
+    if (atomic_load(&frame->refs) == 0 ||
+        now - atomic_load(&frame->dequeued_ns) < share->hold_limit_ns ||
+        atomic_exchange(&frame->reported, 1) != 0) {
+      continue;
+    }
+    holders = atomic_load(&frame->holders);
+    names[0] = '\0';
+    for (c = 0; c < share->consumer_count; c++) {
+      if (holders & (1u << c)) {
+        atomic_fetch_add(&share->overdue_by[c], 1);
+        if (used < sizeof(names)) {
+          used += (size_t)snprintf(names + used, sizeof(names) - used, " %s",
+                                   share->names[c]);
+        }
+      }
+    }
+    atomic_fetch_add(&share->overdue, 1);
+    fprintf(stderr, "Buffer %u (frame %u) held over %lld ms by:%s\n", i,
+            atomic_load(&frame->sequence), share->hold_limit_ns / 1000000,
+            names);
+  }
+}
+
+static void *watchdog_main(void *arg) {
+  struct frame_share_t *share = arg;
+  struct timespec deadline;
+  long long period_ns = share->hold_limit_ns / 4;
+
+  pthread_mutex_lock(&share->lock);
+  while (share->watching) {
+    clock_gettime(CLOCK_REALTIME, &deadline);
+    deadline.tv_nsec += period_ns % 1000000000;
+    deadline.tv_sec += period_ns / 1000000000 + deadline.tv_nsec / 1000000000;
+    deadline.tv_nsec %= 1000000000;
+    pthread_cond_timedwait(&share->released, &share->lock, &deadline);
+    if (share->watching) {
+      check_holds(share);
+    }
+  }
+  pthread_mutex_unlock(&share->lock);
+
+  return NULL;
+}
+
+int frame_watchdog_start(struct frame_share_t *share, unsigned int hold_ms) {
+  int error;
+
+  share->hold_limit_ns = (long long)(hold_ms ? hold_ms : 1) * 1000000;
+  share->watching = 1;
+  error = pthread_create(&share->watchdog, NULL, watchdog_main, share);
+  if (error != 0) {
+    share->watching = 0;
+    errno = error;
+    return -1;
+  }
+  return 0;
+}
+
+void frame_share_close(struct frame_share_t *share) {
+  int watching;
+
+  pthread_mutex_lock(&share->lock);
+  while (atomic_load(&share->outstanding) > 0) {
+    pthread_cond_wait(&share->released, &share->lock);
+  }
+  watching = share->watching;
+  share->watching = 0;
+  pthread_cond_broadcast(&share->released);
+  pthread_mutex_unlock(&share->lock);
+
+  if (watching) {
+    pthread_join(share->watchdog, NULL);
+  }
+  dmabuf_release(&share->dmabuf);
+}
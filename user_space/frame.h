@@ -0,0 +1,201 @@
+/**
+ * @file frame.h
+ * @brief Shared frames: a dequeued driver buffer handed to several
+ * consumers at once, in place, through a reference counted handle. The
+ * buffer goes back to the driver when the last consumer lets go, and a
+ * watchdog names the consumers that keep one too long. Consumers only
+ * read, so frames can be read through read-only dma-buf mappings, with the
+ * cache synchronized for reading around every hold (see dmabuf.h).
+ */
+
+#ifndef FRAME_H
+#define FRAME_H
+
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include "camera.h"
+#include "dmabuf.h"
+#include "mapping.h"
+
+/**
+ * @brief Most consumers of one device. Holders of a frame are kept as a
+ * bitmask.
+ */
+#define FRAME_MAX_CONSUMERS 32
+
+/**
+ * @brief Longest name of a consumer.
+ */
+#define FRAME_MAX_NAME 32
+
+struct frame_share_t;
+
+/**
+ * @brief A dequeued driver buffer. Everything but the counters is set at
+ * dequeue and read-only while the frame is held.
+ * @param share Device it belongs to.
+ * @param index Driver buffer index.
+ * @param data Start of the mapping, read-only for consumers. The first
+ * plane for multi-planar formats.
+ * @param length Length of the mapping.
+ * @param plane_data Start of each plane, plane_data[0] is data.
+ * @param buffer The buffer as dequeued: sequence, timestamp, bytesused.
+ * For the multi-planar API m.planes points to planes.
+ * @param planes Its planes, with the bytesused of each, also for a
+ * single-planar buffer.
+ * @param dequeued_ns CLOCK_MONOTONIC time of the dequeue.
+ * @param sequence Driver sequence number, for the watchdog.
+ * @param refs Holds on the frame, 0 while the driver has the buffer.
+ * @param holders Bitmask of the consumers holding it.
+ * @param reported Non-zero once the watchdog reported this hold.
+ */
+struct frame_handle_t {
+  struct frame_share_t *share;
+  __u32 index;
+  const void *data;
+  size_t length;
+  const void *plane_data[CAMERA_MAX_PLANES];
+  struct v4l2_buffer buffer;
+  struct v4l2_plane planes[CAMERA_MAX_PLANES];
+  _Atomic long long dequeued_ns;
+  atomic_uint sequence;
+  atomic_uint refs;
+  atomic_uint holders;
+  atomic_int reported;
+};
+
+/**
+ * @brief Shared frames of one streaming device.
+ * @param params Capture state owning the buffers.
+ * @param handles Handle of each driver buffer, by index.
+ * @param mapping How the buffers are mapped, probed on the first: copy
+ * them out with mapping_copy() for that kind.
+ * @param dmabuf Exported buffers frames are read through, none exported
+ * by default.
+ * @param names Name of each consumer, for reports.
+ * @param consumer_count Consumers registered.
+ * @param outstanding Buffers out of the driver queue.
+ * @param lock Guards the watchdog state, and the wait in
+ * frame_share_close().
+ * @param released Signalled when a buffer goes back to the driver.
+ * @param watchdog Watchdog thread.
+ * @param watching Non-zero while the watchdog runs.
+ * @param hold_limit_ns Hold time the watchdog reports, nanoseconds.
+ * @param requeues Buffers given back by their last consumer.
+ * @param held_ns_max Longest a buffer was out of the driver queue.
+ * @param stalls Dequeues that waited for a consumer to let go of a buffer.
+ * @param overdue Holds longer than hold_limit_ns.
+ * @param overdue_by Overdue holds each consumer took part in.
+ */
+struct frame_share_t {
+  struct camera_params_t *params;
+  struct frame_handle_t handles[CAMERA_MAX_BUFFERS];
+  struct mapping_info_t mapping;
+  struct dmabuf_set_t dmabuf;
+  char names[FRAME_MAX_CONSUMERS][FRAME_MAX_NAME];
+  unsigned int consumer_count;
+  atomic_uint outstanding;
+  pthread_mutex_t lock;
+  pthread_cond_t released;
+  pthread_t watchdog;
+  int watching;
+  long long hold_limit_ns;
+  atomic_ulong requeues;
+  _Atomic long long held_ns_max;
+  atomic_ulong stalls;
+  atomic_ulong overdue;
+  atomic_ulong overdue_by[FRAME_MAX_CONSUMERS];
+};
+
+/**
+ * @brief Set up sharing over the mapped buffers of a device, before
+ * streaming starts.
+ * @param share Share to initialize.
+ * @param params Capture state, buffers allocated.
+ * @return None.
+ */
+void frame_share_init(struct frame_share_t *share,
+                      struct camera_params_t *params);
+
+/**
+ * @brief Read frames through read-only dma-buf mappings of the buffers
+ * instead of the driver's mappings, before streaming starts. CPU access
+ * to each frame is then opened for reading when it is dequeued and closed
+ * when the last hold is dropped, before the buffer is requeued; consumers
+ * need not do anything. The mapping is probed again.
+ * @param share Share.
+ * @return 0 on success, -1 with errno set if the driver cannot export its
+ * buffers, EINVAL for multi-planar formats; frames are read through its
+ * mappings then.
+ */
+int frame_share_use_dmabuf(struct frame_share_t *share);
+
+/**
+ * @brief Register a consumer.
+ * @param share Share.
+ * @param name Name the watchdog reports it by.
+ * @return Its id, or -1 with errno ENOSPC past FRAME_MAX_CONSUMERS.
+ */
+int frame_share_consumer(struct frame_share_t *share, const char *name);
+
+/**
+ * @brief Dequeue the next frame, held once by a consumer, normally the
+ * capture loop. In place of get_frame() and release_frame(). Capture thread
+ * only. While consumers hold every buffer the driver has none to fill, so
+ * this waits for one to be let go first.
+ * @param share Share of a streaming device.
+ * @param consumer Consumer taking the first hold.
+ * @return The frame; exits as get_frame() does, or if CPU access to a
+ * dma-buf cannot be opened.
+ */
+struct frame_handle_t *frame_share_dequeue(struct frame_share_t *share,
+                                           unsigned int consumer);
+
+/**
+ * @brief Take a hold on a frame for another consumer, which must not hold
+ * it already. Only a holder may hand a frame on.
+ * @param frame Held frame.
+ * @param consumer Consumer.
+ * @return None.
+ */
+void frame_handle_get(struct frame_handle_t *frame, unsigned int consumer);
+
+/**
+ * @brief Drop a consumer's hold. The last one requeues the buffer, and the
+ * frame must not be touched after that.
+ * @param frame Held frame.
+ * @param consumer Consumer letting go.
+ * @return None, exits if the buffer cannot be queued or CPU access to its
+ * dma-buf cannot be closed.
+ */
+void frame_handle_put(struct frame_handle_t *frame, unsigned int consumer);
+
+/**
+ * @brief Driver buffers no consumer holds, queued with the driver.
+ * @param share Share.
+ * @return Their number.
+ */
+unsigned int frame_share_free(struct frame_share_t *share);
+
+/**
+ * @brief Start reporting on stderr every hold of a buffer longer than a
+ * limit, with the consumers still holding it, once per hold.
+ * @param share Share.
+ * @param hold_ms Limit in milliseconds.
+ * @return 0 on success, -1 with errno set if the thread could not start.
+ */
+int frame_watchdog_start(struct frame_share_t *share, unsigned int hold_ms);
+
+/**
+ * @brief Wait until every buffer is back with the driver, stop the
+ * watchdog and release the dma-bufs, before streaming stops and buffers
+ * are freed. Frame data must not be read after this.
+ * @param share Share.
+ * @return None.
+ */
+void frame_share_close(struct frame_share_t *share);
+
+#endif /* FRAME_H */
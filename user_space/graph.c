@@ -0,0 +1,1330 @@
+/**
+ * @file graph.c
+ * @brief Capture graphs.
+ * @note Each source captures on a thread of its own and hands the driver
+ * buffers on as they are: its pool frames are the mappings, and their
+ * holds are those of frame.h, taken and dropped outside the graph lock so
+ * the last node done with a buffer requeues it without holding anyone up.
+ * Other frames are counted under the graph lock. A frame only queues hold
+ * can be swapped for a copy under them, which is how a source detaches
+ * frames from lagging nodes; a frame a worker runs on stays put. The
+ * workers share the lock and take any node with a frame queued that no
+ * other worker is running: a node sees its frames one at a time and in
+ * order, different nodes run in parallel. Nothing ever waits for a queue
+ * to have room; the frame is dropped for that branch instead.
+ */
+
+#include "graph.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "media_graph.h"
+#include "rule.h"
+
+/**
+ * @brief Set by graph_stop(), checked by the capture threads.
+ */
+static volatile sig_atomic_t stop_requested;
+
+void graph_stop(void) { stop_requested = 1; }
+
+/**
+ * @brief What each type of node takes. Settings are listed between
+ * spaces.
+ * @param name Type as written in the file.
+ * @param settings Settings it accepts besides type.
+ * @param required Settings it cannot do without.
+ */
+static const struct {
+  const char *name;
+  enum graph_node_type_t type;
+  const char *settings;
+  const char *required;
+} node_types[] = {
+    {"source", GRAPH_SOURCE,
+     " device format width height buffers detach_below pool hold_ms access "
+     "count media sensor ",
+     " device "},
+    {"plugin", GRAPH_PLUGIN, " input queue path args ", " input path "},
+    {"rules", GRAPH_RULES, " input queue path output ", " input path output "},
+    {"tone_map", GRAPH_TONE_MAP, " input queue curve pool ", " input curve "},
+    {"raw_archive", GRAPH_RAW_ARCHIVE, " input queue threads pool ",
+     " input "},
+    {"file", GRAPH_FILE, " input queue path segment_mb total_mb mode ",
+     " input path "},
+};
+
+/**
+ * @brief Bounds of the numeric settings.
+ */
+static const struct {
+  const char *key;
+  unsigned long min;
+  unsigned long max;
+} numeric_settings[] = {
+    {"width", 1, 65535},     {"height", 1, 65535},
+    {"buffers", 1, CAMERA_MAX_BUFFERS},
+    {"pool", 1, GRAPH_MAX_QUEUE},
+    {"queue", 1, GRAPH_MAX_QUEUE},
+    {"count", 0, 0xffffffffUL},
+    {"hold_ms", 0, 3600000},
+    {"detach_below", 0, CAMERA_MAX_BUFFERS},
+    {"threads", 1, RAW_ARCHIVE_MAX_THREADS},
+    {"segment_mb", 0, 1 << 20}, {"total_mb", 0, 1 << 20},
+};
+
+/**
+ * @brief Pixel formats a source may ask for.
+ */
+static const struct {
+  const char *name;
+  __u32 fourcc;
+} formats[] = {
+    {"mjpeg", V4L2_PIX_FMT_MJPEG}, {"yuyv", V4L2_PIX_FMT_YUYV},
+    {"grey", V4L2_PIX_FMT_GREY},   {"raw10", V4L2_PIX_FMT_SBGGR10},
+    {"raw10p", V4L2_PIX_FMT_SBGGR10P}, {"nv12m", V4L2_PIX_FMT_NV12M},
+    {"yuv420m", V4L2_PIX_FMT_YUV420M},
+};
+
+/**
+ * @brief Fourcc of a format name, 0 if unknown.
+ */
+static __u32 format_fourcc(const char *name) {
+  size_t i;
+
+  for (i = 0; i < sizeof(formats) / sizeof(formats[0]); i++) {
+    if (strcmp(name, formats[i].name) == 0) {
+      return formats[i].fourcc;
+    }
+  }
+  return 0;
+}
+
+const char *graph_type_name(enum graph_node_type_t type) {
+  size_t i;
+
+  for (i = 0; i < sizeof(node_types) / sizeof(node_types[0]); i++) {
+    if (node_types[i].type == type) {
+      return node_types[i].name;
+    }
+  }
+  return "?";
+}
+
+void graph_init(struct graph_t *graph) {
+  memset(graph, 0, sizeof(*graph));
+  pthread_mutex_init(&graph->lock, NULL);
+  pthread_cond_init(&graph->work, NULL);
+  pthread_cond_init(&graph->done, NULL);
+}
+
+/**
+ * @brief Record why parsing failed.
+ * @return -1 with errno set to EINVAL.
+ */
+static int parse_error(struct graph_t *graph, unsigned int line,
+                       const char *format, ...) {
+  va_list args;
+  int n;
+
+  n = snprintf(graph->error, sizeof(graph->error), "line %u: ", line);
+  va_start(args, format);
+  vsnprintf(graph->error + n, sizeof(graph->error) - (size_t)n, format, args);
+  va_end(args);
+  errno = EINVAL;
+  return -1;
+}
+
+/**
+ * @brief Value of a setting of a node, NULL if it does not set it.
+ */
+static const struct graph_setting_t *
+find_setting(const struct graph_node_t *node, const char *key) {
+  unsigned int i;
+
+  for (i = 0; i < node->setting_count; i++) {
+    if (strcmp(node->settings[i].key, key) == 0) {
+      return &node->settings[i];
+    }
+  }
+  return NULL;
+}
+
+static const char *setting(const struct graph_node_t *node, const char *key,
+                           const char *fallback) {
+  const struct graph_setting_t *found = find_setting(node, key);
+
+  return found != NULL ? found->value : fallback;
+}
+
+/**
+ * @brief Numeric value of a setting, checked when parsing.
+ */
+static unsigned long number(const struct graph_node_t *node, const char *key,
+                            unsigned long fallback) {
+  const char *value = setting(node, key, NULL);
+
+  return value != NULL ? strtoul(value, NULL, 10) : fallback;
+}
+
+/**
+ * @brief Tell whether a space delimited list holds a word.
+ */
+static int listed(const char *list, const char *word) {
+  size_t length = strlen(word);
+  const char *at = list;
+
+  while ((at = strstr(at, word)) != NULL) {
+    if (at[-1] == ' ' && at[length] == ' ') {
+      return 1;
+    }
+    at += length;
+  }
+  return 0;
+}
+
+/**
+ * @brief Trim blanks from both ends of a string in place.
+ */
+static char *trim(char *text) {
+  char *end = text + strlen(text);
+
+  while (isspace((unsigned char)*text)) {
+    text++;
+  }
+  while (end > text && isspace((unsigned char)end[-1])) {
+    *--end = '\0';
+  }
+  return text;
+}
+
+/**
+ * @brief Check the settings of a node against its type.
+ */
+static int check_node(struct graph_t *graph, struct graph_node_t *node) {
+  const struct graph_setting_t *type = find_setting(node, "type");
+  const char *required;
+  size_t length;
+  unsigned int t;
+  unsigned int i;
+  size_t k;
+
+  if (type == NULL) {
+    return parse_error(graph, node->line, "[%s] has no type", node->name);
+  }
+  for (t = 0; t < sizeof(node_types) / sizeof(node_types[0]); t++) {
+    if (strcmp(type->value, node_types[t].name) == 0) {
+      break;
+    }
+  }
+  if (t == sizeof(node_types) / sizeof(node_types[0])) {
+    return parse_error(graph, type->line, "unknown type %s", type->value);
+  }
+  node->type = node_types[t].type;
+
+  for (i = 0; i < node->setting_count; i++) {
+    const struct graph_setting_t *entry = &node->settings[i];
+
+    if (strcmp(entry->key, "type") != 0 &&
+        !listed(node_types[t].settings, entry->key)) {
+      return parse_error(graph, entry->line, "%s takes no %s", type->value,
+                         entry->key);
+    }
+    for (k = 0; k < sizeof(numeric_settings) / sizeof(numeric_settings[0]);
+         k++) {
+      char *end;
+      unsigned long value;
+
+      if (strcmp(entry->key, numeric_settings[k].key) != 0) {
+        continue;
+      }
+      errno = 0;
+      value = strtoul(entry->value, &end, 10);
+      if (errno != 0 || end == entry->value || *end != '\0' ||
+          !isdigit((unsigned char)entry->value[0]) ||
+          value < numeric_settings[k].min || value > numeric_settings[k].max) {
+        return parse_error(graph, entry->line, "%s must be %lu to %lu",
+                           entry->key, numeric_settings[k].min,
+                           numeric_settings[k].max);
+      }
+    }
+  }
+  required = node_types[t].required;
+  for (; required[0] == ' ' && required[1] != '\0'; required += length + 1) {
+    char key[GRAPH_MAX_NAME];
+
+    length = strcspn(required + 1, " ");
+    snprintf(key, sizeof(key), "%.*s", (int)length, required + 1);
+    if (find_setting(node, key) == NULL) {
+      return parse_error(graph, node->line, "[%s] needs %s", node->name, key);
+    }
+  }
+
+  if (node->type == GRAPH_SOURCE &&
+      format_fourcc(setting(node, "format", "mjpeg")) == 0) {
+    return parse_error(graph, find_setting(node, "format")->line,
+                       "unknown format %s", setting(node, "format", ""));
+  }
+  if (node->type == GRAPH_SOURCE &&
+      strcmp(setting(node, "access", "mmap"), "mmap") != 0 &&
+      strcmp(setting(node, "access", "mmap"), "dmabuf") != 0) {
+    return parse_error(graph, find_setting(node, "access")->line,
+                       "unknown access %s", setting(node, "access", ""));
+  }
+  if (node->type == GRAPH_FILE && find_setting(node, "mode") != NULL) {
+    enum storage_mode_t mode;
+
+    if (storage_mode_from_name(setting(node, "mode", ""), &mode) < 0) {
+      return parse_error(graph, find_setting(node, "mode")->line,
+                         "unknown mode %s", setting(node, "mode", ""));
+    }
+  }
+  node->queue_size = (unsigned int)number(node, "queue", GRAPH_DEFAULT_QUEUE);
+  node->count = number(node, "count", 0);
+  return 0;
+}
+
+/**
+ * @brief Index of a node by name, -1 if there is none.
+ */
+static int find_node(const struct graph_t *graph, const char *name) {
+  unsigned int i;
+
+  for (i = 0; i < graph->node_count; i++) {
+    if (strcmp(graph->nodes[i].name, name) == 0) {
+      return (int)i;
+    }
+  }
+  return -1;
+}
+
+/**
+ * @brief Resolve inputs, reject cycles and order the nodes so each comes
+ * after its input.
+ */
+static int link_nodes(struct graph_t *graph) {
+  unsigned int depth[GRAPH_MAX_NODES];
+  unsigned int i;
+  unsigned int j;
+  int sources = 0;
+
+  for (i = 0; i < graph->node_count; i++) {
+    struct graph_node_t *node = &graph->nodes[i];
+    int at = (int)i;
+
+    depth[i] = 0;
+    if (node->type == GRAPH_SOURCE) {
+      sources++;
+      continue;
+    }
+    while (graph->nodes[at].type != GRAPH_SOURCE) {
+      const struct graph_setting_t *input =
+          find_setting(&graph->nodes[at], "input");
+      int next = find_node(graph, input->value);
+
+      if (next < 0) {
+        return parse_error(graph, input->line, "no node named %s",
+                           input->value);
+      }
+      if (graph->nodes[next].type == GRAPH_FILE) {
+        return parse_error(graph, input->line, "%s is a file, it has no "
+                           "output", input->value);
+      }
+      if (++depth[i] > graph->node_count) {
+        return parse_error(graph, node->line, "[%s] is part of a cycle",
+                           node->name);
+      }
+      at = next;
+    }
+  }
+  if (sources == 0) {
+    return parse_error(graph, 1, "no source");
+  }
+
+  /* Inputs first; each node has one, so ordering by distance from the
+   * source does it. */
+  for (i = 1; i < graph->node_count; i++) {
+    for (j = i; j > 0 && depth[j - 1] > depth[j]; j--) {
+      struct graph_node_t swap = graph->nodes[j];
+      unsigned int d = depth[j];
+
+      graph->nodes[j] = graph->nodes[j - 1];
+      graph->nodes[j - 1] = swap;
+      depth[j] = depth[j - 1];
+      depth[j - 1] = d;
+    }
+  }
+  for (i = 0; i < graph->node_count; i++) {
+    struct graph_node_t *node = &graph->nodes[i];
+    struct graph_node_t *input;
+
+    node->graph = graph;
+    if (node->type == GRAPH_SOURCE) {
+      continue;
+    }
+    input = &graph->nodes[find_node(graph, setting(node, "input", ""))];
+    node->input = input;
+    input->outputs[input->output_count++] = node;
+  }
+  return 0;
+}
+
+int graph_parse(struct graph_t *graph, const char *text) {
+  struct graph_node_t *node = NULL;
+  int in_graph = 0;
+  unsigned int line = 0;
+  unsigned int i;
+
+  while (*text != '\0') {
+    char buffer[GRAPH_MAX_NAME + GRAPH_MAX_VALUE + 64];
+    size_t length = strcspn(text, "\n");
+    char *content;
+    char *equals;
+
+    line++;
+    if (length >= sizeof(buffer)) {
+      return parse_error(graph, line, "line too long");
+    }
+    memcpy(buffer, text, length);
+    buffer[length] = '\0';
+    text += length + (text[length] == '\n');
+    buffer[strcspn(buffer, "#")] = '\0';
+    content = trim(buffer);
+    if (*content == '\0') {
+      continue;
+    }
+
+    if (*content == '[') {
+      char *name = trim(content + 1);
+      size_t end = strlen(name);
+
+      if (end == 0 || name[end - 1] != ']') {
+        return parse_error(graph, line, "expected [NAME]");
+      }
+      name[end - 1] = '\0';
+      name = trim(name);
+      if (strcmp(name, "graph") == 0) {
+        in_graph = 1;
+        node = NULL;
+        continue;
+      }
+      if (*name == '\0' || strlen(name) >= GRAPH_MAX_NAME ||
+          strspn(name, "abcdefghijklmnopqrstuvwxyz"
+                       "ABCDEFGHIJKLMNOPQRSTUVWXYZ0123456789_-") !=
+              strlen(name)) {
+        return parse_error(graph, line, "bad node name");
+      }
+      if (find_node(graph, name) >= 0) {
+        return parse_error(graph, line, "[%s] declared twice", name);
+      }
+      if (graph->node_count == GRAPH_MAX_NODES) {
+        return parse_error(graph, line, "more than %d nodes",
+                           GRAPH_MAX_NODES);
+      }
+      node = &graph->nodes[graph->node_count++];
+      snprintf(node->name, sizeof(node->name), "%s", name);
+      node->line = line;
+      in_graph = 0;
+      continue;
+    }
+
+    equals = strchr(content, '=');
+    if (equals == NULL) {
+      return parse_error(graph, line, "expected KEY = VALUE");
+    }
+    *equals = '\0';
+    content = trim(content);
+    equals = trim(equals + 1);
+    if (*content == '\0' || strlen(content) >= GRAPH_MAX_NAME ||
+        strlen(equals) >= GRAPH_MAX_VALUE) {
+      return parse_error(graph, line, "bad setting");
+    }
+    if (in_graph) {
+      char *end;
+      unsigned long threads;
+
+      if (strcmp(content, "threads") != 0) {
+        return parse_error(graph, line, "graph takes no %s", content);
+      }
+      threads = strtoul(equals, &end, 10);
+      if (*equals == '\0' || *end != '\0' || threads > GRAPH_MAX_THREADS) {
+        return parse_error(graph, line, "threads must be 0 to %d",
+                           GRAPH_MAX_THREADS);
+      }
+      graph->thread_count = (unsigned int)threads;
+      continue;
+    }
+    if (node == NULL) {
+      return parse_error(graph, line, "setting outside a section");
+    }
+    if (find_setting(node, content) != NULL) {
+      return parse_error(graph, line, "%s set twice", content);
+    }
+    if (node->setting_count == GRAPH_MAX_SETTINGS) {
+      return parse_error(graph, line, "too many settings");
+    }
+    snprintf(node->settings[node->setting_count].key, GRAPH_MAX_NAME, "%s",
+             content);
+    snprintf(node->settings[node->setting_count].value, GRAPH_MAX_VALUE,
+             "%s", equals);
+    node->settings[node->setting_count++].line = line;
+  }
+
+  for (i = 0; i < graph->node_count; i++) {
+    if (check_node(graph, &graph->nodes[i]) < 0) {
+      return -1;
+    }
+  }
+  return link_nodes(graph);
+}
+
+int graph_load(struct graph_t *graph, const char *path) {
+  char text[16384];
+  ssize_t length;
+  int fd;
+
+  fd = open(path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0) {
+    snprintf(graph->error, sizeof(graph->error), "%s: %s", path,
+             strerror(errno));
+    return -1;
+  }
+  length = read(fd, text, sizeof(text) - 1);
+  close(fd);
+  if (length < 0 || length == sizeof(text) - 1) {
+    if (length >= 0) {
+      errno = EFBIG;
+    }
+    snprintf(graph->error, sizeof(graph->error), "%s: %s", path,
+             strerror(errno));
+    return -1;
+  }
+  text[length] = '\0';
+  return graph_parse(graph, text);
+}
+
+/**
+ * @brief Current CLOCK_MONOTONIC time in nanoseconds.
+ */
+static long long monotonic_ns(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * @brief Take a free frame of a node's pool. Graph lock held.
+ * @return The frame, held once, or NULL if all are in use.
+ */
+static struct graph_frame_t *take_frame(struct graph_node_t *node) {
+  struct graph_frame_t *frame = node->free_frames;
+
+  if (frame == NULL) {
+    node->starved++;
+    return NULL;
+  }
+  node->free_frames = frame->next;
+  frame->refs = 1;
+  return frame;
+}
+
+/**
+ * @brief Let go of a pool frame, returning it to its pool with the last
+ * hold. Graph lock held.
+ */
+static void put_frame(struct graph_frame_t *frame) {
+  if (--frame->refs == 0) {
+    frame->next = frame->owner->free_frames;
+    frame->owner->free_frames = frame;
+  }
+}
+
+/**
+ * @brief Queue a frame for every node reading from a node, where there is
+ * room. Graph lock held.
+ */
+static void deliver(struct graph_t *graph, struct graph_node_t *node,
+                    struct graph_frame_t *frame) {
+  unsigned int queued = 0;
+  unsigned int i;
+
+  for (i = 0; i < node->output_count; i++) {
+    struct graph_node_t *output = node->outputs[i];
+
+    if (output->queue_count == output->queue_size) {
+      output->dropped++;
+      continue;
+    }
+    output->queue[(output->queue_head + output->queue_count) %
+                  output->queue_size] = frame;
+    output->queue_count++;
+    if (output->queue_count > output->queue_max) {
+      output->queue_max = output->queue_count;
+    }
+    if (frame->handle != NULL) {
+      frame_handle_get(frame->handle, (unsigned int)output->consumer);
+    } else {
+      frame->refs++;
+    }
+    graph->pending++;
+    queued++;
+  }
+  if (queued > 0) {
+    pthread_cond_broadcast(&graph->work);
+  }
+}
+
+/**
+ * @brief Copy a frame into one of the node's own, for nodes producing new
+ * frames. Grows the frame if needed.
+ * @return The new frame, held once, or NULL if the pool is exhausted or
+ * memory is short.
+ */
+static struct graph_frame_t *
+new_frame(struct graph_node_t *node, const void *data, size_t bytes,
+          __u32 bytesperline, const struct stage_metadata_t *metadata) {
+  struct graph_t *graph = node->graph;
+  struct graph_frame_t *frame;
+
+  pthread_mutex_lock(&graph->lock);
+  frame = take_frame(node);
+  pthread_mutex_unlock(&graph->lock);
+  if (frame == NULL) {
+    return NULL;
+  }
+
+  /* Free frames belong to nobody, growing one needs no lock. */
+  if (bytes > frame->capacity) {
+    uint8_t *grown = realloc(frame->data, bytes);
+
+    if (grown == NULL) {
+      pthread_mutex_lock(&graph->lock);
+      node->errors++;
+      put_frame(frame);
+      pthread_mutex_unlock(&graph->lock);
+      return NULL;
+    }
+    frame->data = grown;
+    frame->capacity = bytes;
+  }
+  memcpy(frame->data, data, bytes);
+  frame->bytes = bytes;
+  frame->plane_count = 1;
+  frame->planes[0].data = frame->data;
+  frame->planes[0].bytes = bytes;
+  frame->planes[0].bytesperline = bytesperline;
+  frame->metadata = *metadata;
+  return frame;
+}
+
+/**
+ * @brief Copy a source frame, plane after plane, into one of the node's
+ * copies.
+ */
+static void copy_frame(struct graph_frame_t *copy,
+                       const struct graph_frame_t *frame,
+                       enum mapping_kind_t kind) {
+  uint8_t *out = copy->data;
+  unsigned int plane;
+
+  for (plane = 0; plane < frame->plane_count; plane++) {
+    mapping_copy(out, frame->planes[plane].data, frame->planes[plane].bytes,
+                 kind);
+    copy->planes[plane] = frame->planes[plane];
+    copy->planes[plane].data = out;
+    out += frame->planes[plane].bytes;
+  }
+  copy->plane_count = frame->plane_count;
+  copy->bytes = frame->bytes;
+  copy->metadata = frame->metadata;
+}
+
+/**
+ * @brief Hand a frame a node produced to its outputs and drop the node's
+ * hold on it.
+ */
+static void publish(struct graph_node_t *node, struct graph_frame_t *frame) {
+  struct graph_t *graph = node->graph;
+  struct frame_handle_t *handle = frame->handle;
+
+  pthread_mutex_lock(&graph->lock);
+  deliver(graph, node, frame);
+  if (handle == NULL) {
+    put_frame(frame);
+  }
+  pthread_mutex_unlock(&graph->lock);
+  if (handle != NULL) {
+    frame_handle_put(handle, (unsigned int)node->consumer);
+  }
+}
+
+/**
+ * @brief Run a node on one frame from its queue.
+ */
+static void run_node(struct graph_node_t *node, struct graph_frame_t *frame) {
+  struct graph_t *graph = node->graph;
+  const struct v4l2_pix_format *pix = &node->format.fmt.pix;
+  struct graph_frame_t *output;
+  struct stage_view_t view;
+  struct raw_frame_t raw;
+  const void *record;
+  size_t length;
+  unsigned int plane;
+  long long start = monotonic_ns();
+  long long elapsed;
+
+  switch (node->type) {
+  case GRAPH_PLUGIN:
+  case GRAPH_RULES:
+    view.data = frame->data;
+    view.bytes = frame->bytes;
+    view.format = &node->format;
+    view.plane_count = frame->plane_count;
+    memcpy(view.planes, frame->planes, sizeof(view.planes));
+    stage_pipeline_run(node->stages, &view, &frame->metadata);
+    pthread_mutex_lock(&graph->lock);
+    node->errors = node->stages->stages[0].errors;
+    deliver(graph, node, frame);
+    pthread_mutex_unlock(&graph->lock);
+    break;
+  case GRAPH_TONE_MAP:
+    output = new_frame(node, frame->data, frame->bytes, pix->bytesperline,
+                       &frame->metadata);
+    if (output == NULL) {
+      break;
+    }
+    if (pix->pixelformat == V4L2_PIX_FMT_YUYV) {
+      tone_map_apply_yuyv(node->tone_map, output->data, output->bytes);
+    } else {
+      tone_map_apply(node->tone_map, output->data, output->bytes);
+    }
+    publish(node, output);
+    break;
+  case GRAPH_RAW_ARCHIVE:
+    raw.width = pix->width;
+    raw.height = pix->height;
+    raw.pixelformat = pix->pixelformat;
+    raw.bytesperline = pix->bytesperline;
+    raw.sequence = frame->metadata.sequence;
+    raw.timestamp_us = frame->metadata.timestamp_us;
+    raw.data = frame->data;
+    if (frame->bytes < (size_t)pix->bytesperline * pix->height ||
+        raw_archive_encode(node->archive, &raw, &record, &length) < 0) {
+      node->errors++;
+      break;
+    }
+    output = new_frame(node, record, length, 0, &frame->metadata);
+    if (output != NULL) {
+      publish(node, output);
+    }
+    break;
+  case GRAPH_FILE:
+    for (plane = 0; plane < frame->plane_count; plane++) {
+      if (segment_writer_write(node->writer, frame->planes[plane].data,
+                               frame->planes[plane].bytes) < 0) {
+        node->errors++;
+        break;
+      }
+    }
+    break;
+  case GRAPH_SOURCE:
+    break;
+  }
+
+  elapsed = monotonic_ns() - start;
+  node->process_ns_avg =
+      node->frames == 0
+          ? elapsed
+          : node->process_ns_avg + (elapsed - node->process_ns_avg) / 8;
+  if (elapsed > node->process_ns_max) {
+    node->process_ns_max = elapsed;
+  }
+  node->frames++;
+}
+
+/**
+ * @brief Next node with a frame queued and no worker, round robin. Graph
+ * lock held.
+ */
+static struct graph_node_t *ready_node(struct graph_t *graph) {
+  unsigned int i;
+
+  for (i = 0; i < graph->node_count; i++) {
+    struct graph_node_t *node =
+        &graph->nodes[(graph->next_node + i) % graph->node_count];
+
+    if (node->queue_count > 0 && !node->busy) {
+      graph->next_node = (graph->next_node + i + 1) % graph->node_count;
+      return node;
+    }
+  }
+  return NULL;
+}
+
+static void *graph_worker(void *arg) {
+  struct graph_t *graph = arg;
+
+  pthread_mutex_lock(&graph->lock);
+  for (;;) {
+    struct graph_node_t *node;
+    struct graph_frame_t *frame;
+    struct frame_handle_t *handle;
+
+    while ((node = ready_node(graph)) == NULL && !graph->quit) {
+      pthread_cond_wait(&graph->work, &graph->lock);
+    }
+    if (node == NULL) {
+      break;
+    }
+    frame = node->queue[node->queue_head];
+    node->queue_head = (node->queue_head + 1) % node->queue_size;
+    node->queue_count--;
+    node->busy = 1;
+    frame->running++;
+    pthread_mutex_unlock(&graph->lock);
+
+    run_node(node, frame);
+    handle = frame->handle;
+    if (handle != NULL) {
+      frame_handle_put(handle, (unsigned int)node->consumer);
+    }
+
+    pthread_mutex_lock(&graph->lock);
+    node->busy = 0;
+    /* Only now, the hold is gone: a detach must not count on it. */
+    frame->running--;
+    if (handle == NULL) {
+      put_frame(frame);
+    }
+    if (--graph->pending == 0) {
+      pthread_cond_broadcast(&graph->done);
+    }
+    /* Another worker may have passed over it while it was busy. */
+    if (node->queue_count > 0) {
+      pthread_cond_signal(&graph->work);
+    }
+  }
+  pthread_mutex_unlock(&graph->lock);
+
+  return NULL;
+}
+
+/**
+ * @brief Copy the oldest source frame that nothing but queues hold, swap
+ * the copy in for it and give its driver buffer back. Capture thread only,
+ * which is the one filling source frames in.
+ * @return 0 if a frame was copied, -1 if none could be, for want of such a
+ * frame or of a free copy.
+ */
+static int detach_frame(struct graph_node_t *node) {
+  struct graph_t *graph = node->graph;
+  struct graph_frame_t *frame = NULL;
+  struct graph_frame_t *copy;
+  struct frame_handle_t *handle;
+  unsigned int i;
+  unsigned int j;
+
+  pthread_mutex_lock(&graph->lock);
+  for (i = 0; i < node->pool_size; i++) {
+    struct graph_frame_t *held = &node->pool[i];
+
+    if (atomic_load(&held->handle->refs) > 0 && held->running == 0 &&
+        (frame == NULL ||
+         held->metadata.sequence < frame->metadata.sequence)) {
+      frame = held;
+    }
+  }
+  copy = frame != NULL ? take_frame(node) : NULL;
+  if (copy == NULL) {
+    pthread_mutex_unlock(&graph->lock);
+    return -1;
+  }
+  /* Keeps the buffer mapped and unqueued while it is copied, whoever
+   * picks the frame up meanwhile. */
+  handle = frame->handle;
+  frame_handle_get(handle, (unsigned int)node->consumer);
+  pthread_mutex_unlock(&graph->lock);
+
+  copy_frame(copy, frame, node->share->mapping.kind);
+
+  pthread_mutex_lock(&graph->lock);
+  for (i = 0; i < graph->node_count; i++) {
+    struct graph_node_t *reader = &graph->nodes[i];
+
+    for (j = 0; j < reader->queue_count; j++) {
+      struct graph_frame_t **slot =
+          &reader->queue[(reader->queue_head + j) % reader->queue_size];
+
+      if (*slot == frame) {
+        *slot = copy;
+        copy->refs++;
+        /* Not the last hold, this one is. */
+        frame_handle_put(handle, (unsigned int)reader->consumer);
+      }
+    }
+  }
+  if (copy->refs > 1) {
+    node->detached++;
+  }
+  put_frame(copy);
+  pthread_mutex_unlock(&graph->lock);
+  frame_handle_put(handle, (unsigned int)node->consumer);
+  return 0;
+}
+
+static void *graph_capture(void *arg) {
+  struct graph_node_t *node = arg;
+  struct graph_t *graph = node->graph;
+  struct camera_params_t *camera = node->camera;
+
+  activate_streaming(camera);
+  while (!stop_requested && (node->count == 0 || node->frames < node->count)) {
+    struct frame_handle_t *handle;
+    struct graph_frame_t *frame;
+    struct graph_frame_t *copy = NULL;
+    unsigned int plane;
+
+    handle = frame_share_dequeue(node->share, (unsigned int)node->consumer);
+    /* Nobody else holds the buffer, its frame is free to fill in. */
+    frame = &node->pool[handle->index];
+    frame->bytes = handle->buffer.bytesused;
+    /* Payloads start past any header the driver put before them. */
+    for (plane = 0; plane < frame->plane_count; plane++) {
+      frame->planes[plane].data = (const uint8_t *)handle->plane_data[plane] +
+                                  handle->planes[plane].data_offset;
+      frame->planes[plane].bytes = handle->planes[plane].bytesused;
+    }
+    frame->data = (uint8_t *)frame->planes[0].data;
+    frame->metadata.sequence = handle->buffer.sequence;
+    frame->metadata.index = handle->buffer.index;
+    frame->metadata.flags = handle->buffer.flags;
+    frame->metadata.timestamp_us =
+        (uint64_t)handle->buffer.timestamp.tv_sec * 1000000 +
+        (uint64_t)handle->buffer.timestamp.tv_usec;
+    if (node->share->mapping.kind == MAPPING_UNCACHED && node->copies != NULL) {
+      /* Nodes would read an uncached buffer a bus transaction at a time:
+       * they get a cached copy and the buffer goes straight back. */
+      pthread_mutex_lock(&graph->lock);
+      copy = take_frame(node);
+      pthread_mutex_unlock(&graph->lock);
+    }
+    if (copy != NULL) {
+      copy_frame(copy, frame, MAPPING_UNCACHED);
+      frame_handle_put(handle, (unsigned int)node->consumer);
+      node->detached++;
+      frame = copy;
+    }
+    publish(node, frame);
+    node->frames++;
+    while (frame_share_free(node->share) < node->detach_below &&
+           detach_frame(node) == 0) {
+    }
+  }
+  /* The nodes still hold some buffers, they must be back before the
+   * driver lets go of them. */
+  frame_share_close(node->share);
+  deactivate_streaming(camera);
+
+  pthread_mutex_lock(&graph->lock);
+  graph->sources--;
+  pthread_cond_broadcast(&graph->done);
+  pthread_mutex_unlock(&graph->lock);
+
+  return NULL;
+}
+
+/**
+ * @brief Record why a node could not start.
+ * @return -1, errno preserved.
+ */
+static int start_error(struct graph_node_t *node, const char *what) {
+  int saved = errno;
+
+  snprintf(node->graph->error, sizeof(node->graph->error), "[%s] %.128s: %.64s",
+           node->name, what, strerror(saved));
+  errno = saved;
+  return -1;
+}
+
+/**
+ * @brief Set up a node for the format of its input.
+ */
+static int start_node(struct graph_node_t *node) {
+  struct graph_t *graph = node->graph;
+  const struct v4l2_pix_format *pix = &node->format.fmt.pix;
+  enum storage_mode_t mode = STORAGE_BUFFERED;
+  unsigned int produces = 1;
+  char args[sizeof(node->stages->stages[0].args)];
+  unsigned long hold_ms;
+  size_t largest = 0;
+  unsigned int i;
+  unsigned int plane;
+
+  if (node->input != NULL) {
+    node->format = node->input->format;
+  }
+  node->source = node->input != NULL ? node->input->source : node;
+
+  switch (node->type) {
+  case GRAPH_SOURCE:
+    if (find_setting(node, "media") != NULL) {
+      struct media_graph_request_t request = {
+          .media_path = setting(node, "media", ""),
+          .sensor = setting(node, "sensor", "ov5647"),
+          .width = (__u32)number(node, "width", 1920),
+          .height = (__u32)number(node, "height", 1080),
+          .code = media_graph_bus_code(
+              format_fourcc(setting(node, "format", "mjpeg"))),
+      };
+      struct media_graph_route_t route;
+      char cache_path[512];
+
+      if (media_graph_cache_path(cache_path, sizeof(cache_path)) == 0) {
+        request.cache_path = cache_path;
+      }
+      if (media_graph_setup(&request, &route) < 0) {
+        return start_error(node, "media graph");
+      }
+    }
+    node->camera = calloc(1, sizeof(*node->camera));
+    if (node->camera == NULL) {
+      return start_error(node, "out of memory");
+    }
+    open_camera_device(node->camera, setting(node, "device", ""));
+    set_video_format(node->camera, (__u32)number(node, "width", 1920),
+                     (__u32)number(node, "height", 1080),
+                     format_fourcc(setting(node, "format", "mjpeg")));
+    request_buffer(node->camera,
+                   (__u32)number(node, "buffers", CAMERA_DEFAULT_BUFFERS));
+    allocate_buffer(node->camera);
+    node->format = node->camera->capture_format;
+    node->share = malloc(sizeof(*node->share));
+    if (node->share == NULL) {
+      return start_error(node, "out of memory");
+    }
+    frame_share_init(node->share, node->camera);
+    if (strcmp(setting(node, "access", "mmap"), "dmabuf") == 0) {
+      if (frame_share_use_dmabuf(node->share) < 0) {
+        return start_error(node, "dma-buf export");
+      }
+      node->dmabuf = 1;
+    }
+    node->detach_below = (unsigned int)number(node, "detach_below",
+                                              GRAPH_DEFAULT_DETACH_BELOW);
+    hold_ms = number(node, "hold_ms", GRAPH_DEFAULT_HOLD_MS);
+    if (hold_ms > 0 &&
+        frame_watchdog_start(node->share, (unsigned int)hold_ms) < 0) {
+      return start_error(node, "watchdog");
+    }
+    break;
+  case GRAPH_PLUGIN:
+  case GRAPH_RULES:
+    produces = 0;
+    node->stages = malloc(sizeof(*node->stages));
+    if (node->stages == NULL) {
+      return start_error(node, "out of memory");
+    }
+    stage_pipeline_init(node->stages);
+    snprintf(args, sizeof(args), "%s:%s", setting(node, "path", ""),
+             setting(node, "output", ""));
+    if ((node->type == GRAPH_PLUGIN
+             ? stage_pipeline_load(node->stages, setting(node, "path", ""),
+                                   setting(node, "args", NULL))
+             : stage_pipeline_add(node->stages, &rule_stage, args)) < 0 ||
+        stage_pipeline_start(node->stages, &node->format) < 0) {
+      int saved = errno;
+
+      snprintf(graph->error, sizeof(graph->error), "[%s] %.200s",
+               node->name, node->stages->error);
+      errno = saved;
+      return -1;
+    }
+    break;
+  case GRAPH_TONE_MAP:
+    if (pix->pixelformat != V4L2_PIX_FMT_GREY &&
+        pix->pixelformat != V4L2_PIX_FMT_YUYV) {
+      errno = EINVAL;
+      return start_error(node, "needs grey or yuyv frames");
+    }
+    node->tone_map = malloc(sizeof(*node->tone_map));
+    if (node->tone_map == NULL) {
+      return start_error(node, "out of memory");
+    }
+    if (tone_map_from_name(node->tone_map, setting(node, "curve", "")) < 0) {
+      return start_error(node, setting(node, "curve", ""));
+    }
+    break;
+  case GRAPH_RAW_ARCHIVE:
+    if (!raw_archive_supports(pix->pixelformat)) {
+      errno = EINVAL;
+      return start_error(node, "needs raw Bayer frames");
+    }
+    node->archive = malloc(sizeof(*node->archive));
+    if (node->archive == NULL) {
+      return start_error(node, "out of memory");
+    }
+    if (raw_archive_init(node->archive,
+                         (unsigned int)number(node, "threads", 1)) < 0) {
+      free(node->archive);
+      node->archive = NULL;
+      return start_error(node, "encoder");
+    }
+    break;
+  case GRAPH_FILE:
+    produces = 0;
+    storage_mode_from_name(setting(node, "mode", "buffered"), &mode);
+    node->writer = malloc(sizeof(*node->writer));
+    if (node->writer == NULL) {
+      return start_error(node, "out of memory");
+    }
+    if (segment_writer_init(node->writer, setting(node, "path", ""),
+                            (off_t)number(node, "segment_mb", 0) << 20,
+                            (off_t)number(node, "total_mb", 0) << 20,
+                            mode) < 0) {
+      free(node->writer);
+      node->writer = NULL;
+      return start_error(node, setting(node, "path", ""));
+    }
+    break;
+  }
+
+  /* Inputs start first, the source of the node is set up already. */
+  node->consumer = frame_share_consumer(node->source->share, node->name);
+  if (node->consumer < 0) {
+    return start_error(node, "consumer");
+  }
+
+  if (node->type == GRAPH_SOURCE) {
+    node->pool_size = node->camera->buffer_request.count;
+    node->pool = calloc(node->pool_size, sizeof(*node->pool));
+    if (node->pool == NULL) {
+      return start_error(node, "out of memory");
+    }
+    for (i = 0; i < node->pool_size; i++) {
+      struct graph_frame_t *frame = &node->pool[i];
+      size_t total = 0;
+
+      frame->owner = node;
+      frame->handle = &node->share->handles[i];
+      /* Read-only: nodes never write into their input. */
+      frame->data = (uint8_t *)frame->handle->data;
+      frame->capacity = node->camera->buffers[i].length;
+      frame->plane_count = node->camera->plane_count;
+      for (plane = 0; plane < frame->plane_count; plane++) {
+        frame->planes[plane].data = frame->handle->plane_data[plane];
+        frame->planes[plane].bytesperline =
+            plane_bytesperline(node->camera, plane);
+        total += node->camera->planes[i][plane].length;
+      }
+      /* Copies hold every plane. */
+      if (total > largest) {
+        largest = total;
+      }
+    }
+    if (node->detach_below == 0) {
+      return 0;
+    }
+    node->copy_count = (unsigned int)number(node, "pool", GRAPH_DEFAULT_POOL);
+    node->copies = calloc(node->copy_count, sizeof(*node->copies));
+    if (node->copies == NULL) {
+      return start_error(node, "out of memory");
+    }
+    for (i = 0; i < node->copy_count; i++) {
+      struct graph_frame_t *frame = &node->copies[i];
+
+      frame->owner = node;
+      frame->capacity = largest;
+      frame->data = malloc(frame->capacity);
+      if (frame->data == NULL) {
+        return start_error(node, "out of memory");
+      }
+      frame->next = node->free_frames;
+      node->free_frames = frame;
+    }
+    return 0;
+  }
+  if (!produces) {
+    return 0;
+  }
+  node->pool_size = (unsigned int)number(node, "pool", GRAPH_DEFAULT_POOL);
+  node->pool = calloc(node->pool_size, sizeof(*node->pool));
+  if (node->pool == NULL) {
+    return start_error(node, "out of memory");
+  }
+  for (i = 0; i < node->pool_size; i++) {
+    struct graph_frame_t *frame = &node->pool[i];
+
+    frame->owner = node;
+    /* Encoders grow their frames to what they produce. */
+    frame->capacity = node->type == GRAPH_RAW_ARCHIVE ? 0 : pix->sizeimage;
+    frame->data = frame->capacity ? malloc(frame->capacity) : NULL;
+    if (frame->capacity && frame->data == NULL) {
+      return start_error(node, "out of memory");
+    }
+    frame->next = node->free_frames;
+    node->free_frames = frame;
+  }
+  return 0;
+}
+
+/**
+ * @brief Release what start_node() set up.
+ */
+static void release_node(struct graph_node_t *node) {
+  unsigned int i;
+
+  if (node->share != NULL) {
+    frame_share_close(node->share);
+    free(node->share);
+    node->share = NULL;
+  }
+  if (node->camera != NULL) {
+    free_buffers(node->camera);
+    close_camera_device(node->camera);
+    free(node->camera);
+    node->camera = NULL;
+  }
+  if (node->stages != NULL) {
+    stage_pipeline_destroy(node->stages);
+    free(node->stages);
+    node->stages = NULL;
+  }
+  free(node->tone_map);
+  node->tone_map = NULL;
+  if (node->archive != NULL) {
+    raw_archive_destroy(node->archive);
+    free(node->archive);
+    node->archive = NULL;
+  }
+  if (node->writer != NULL) {
+    segment_writer_close(node->writer);
+    free(node->writer);
+    node->writer = NULL;
+  }
+  for (i = 0; node->pool != NULL && i < node->pool_size; i++) {
+    if (node->pool[i].handle == NULL) {
+      free(node->pool[i].data);
+    }
+  }
+  free(node->pool);
+  node->pool = NULL;
+  for (i = 0; node->copies != NULL && i < node->copy_count; i++) {
+    free(node->copies[i].data);
+  }
+  free(node->copies);
+  node->copies = NULL;
+  node->free_frames = NULL;
+}
+
+/**
+ * @brief Release the nodes graph_start() got to.
+ */
+static void release_nodes(struct graph_t *graph) {
+  unsigned int i;
+
+  for (i = 0; i < graph->started; i++) {
+    release_node(&graph->nodes[i]);
+  }
+  graph->started = 0;
+}
+
+int graph_start(struct graph_t *graph) {
+  unsigned int i;
+
+  stop_requested = 0;
+  for (i = 0; i < graph->node_count; i++) {
+    /* Counted before it starts, so a half set up node is released too. */
+    graph->started = i + 1;
+    if (start_node(&graph->nodes[i]) < 0) {
+      int saved = errno;
+
+      release_nodes(graph);
+      errno = saved;
+      return -1;
+    }
+  }
+
+  if (graph->thread_count == 0) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+
+    graph->thread_count = online > 0 ? (unsigned int)online : 1;
+  }
+  if (graph->thread_count > GRAPH_MAX_THREADS) {
+    graph->thread_count = GRAPH_MAX_THREADS;
+  }
+  for (i = 0; i < graph->thread_count; i++) {
+    if (pthread_create(&graph->threads[i], NULL, graph_worker, graph) != 0) {
+      graph->thread_count = i;
+      break;
+    }
+  }
+  for (i = 0; graph->thread_count > 0 && i < graph->node_count; i++) {
+    struct graph_node_t *node = &graph->nodes[i];
+
+    if (node->type != GRAPH_SOURCE) {
+      continue;
+    }
+    if (pthread_create(&node->thread, NULL, graph_capture, node) != 0) {
+      break;
+    }
+    node->capturing = 1;
+    pthread_mutex_lock(&graph->lock);
+    graph->sources++;
+    pthread_mutex_unlock(&graph->lock);
+  }
+  if (graph->thread_count == 0 || i < graph->node_count) {
+    snprintf(graph->error, sizeof(graph->error), "no threads");
+    graph_stop();
+    graph_wait(graph);
+    release_nodes(graph);
+    errno = EAGAIN;
+    return -1;
+  }
+  return 0;
+}
+
+void graph_wait(struct graph_t *graph) {
+  unsigned int i;
+
+  pthread_mutex_lock(&graph->lock);
+  while (graph->sources > 0 || graph->pending > 0) {
+    pthread_cond_wait(&graph->done, &graph->lock);
+  }
+  graph->quit = 1;
+  pthread_cond_broadcast(&graph->work);
+  pthread_mutex_unlock(&graph->lock);
+
+  for (i = 0; i < graph->thread_count; i++) {
+    pthread_join(graph->threads[i], NULL);
+  }
+  for (i = 0; i < graph->node_count; i++) {
+    struct graph_node_t *node = &graph->nodes[i];
+
+    if (node->capturing) {
+      pthread_join(node->thread, NULL);
+      node->capturing = 0;
+    }
+    /* Closing is where deferred write errors show. */
+    if (node->writer != NULL && segment_writer_close(node->writer) < 0) {
+      node->errors++;
+    }
+  }
+}
+
+void graph_destroy(struct graph_t *graph) {
+  release_nodes(graph);
+
+  pthread_cond_destroy(&graph->done);
+  pthread_cond_destroy(&graph->work);
+  pthread_mutex_destroy(&graph->lock);
+}
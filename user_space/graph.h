@@ -0,0 +1,387 @@
+/**
+ * @file graph.h
+ * @brief Capture graphs: sources, processing stages, encoders and sinks
+ * declared in a configuration file and run on a thread pool, so a
+ * deployment is retuned by editing a file instead of rebuilding main.c.
+ *
+ * The file is INI style. Each [section] is a node named after it, with a
+ * type and, except for sources, the node it takes frames from; '#' starts
+ * a comment. A [graph] section holds settings of the whole graph:
+ *
+ *   [graph]
+ *   threads = 2
+ *
+ *   [cam]
+ *   type = source
+ *   device = /dev/video0
+ *   format = yuyv
+ *   width = 1280
+ *   height = 720
+ *
+ *   [meter]
+ *   type = plugin
+ *   input = cam
+ *   path = plugins/exposure_meter.so
+ *   args = 30
+ *
+ *   [bright]
+ *   type = tone_map
+ *   input = cam
+ *   curve = srgb
+ *
+ *   [disk]
+ *   type = file
+ *   input = bright
+ *   queue = 16
+ *   path = /data/rec.yuv
+ *   segment_mb = 64
+ *   total_mb = 1024
+ *
+ * Several nodes naming the same input fan out: they share each frame,
+ * which is not copied. A source hands on the driver buffers themselves,
+ * through the reference counted handles of frame.h: a buffer goes back to
+ * the driver once every node it reached is done with it, and a watchdog
+ * names the nodes holding one longer than hold_ms. When fewer than
+ * detach_below buffers are left with the driver, the frames lagging nodes
+ * only have queued are copied into the source's pool and their buffers
+ * requeued, so a slow sink costs copies instead of dropped frames. Where
+ * the buffers turn out to be mapped uncached (see mapping.h), every frame
+ * is copied out that way as it arrives, while copies are free. With
+ * access = dmabuf a source reads its buffers through read-only dma-buf
+ * mappings, cached where the driver's are not, and keeps the cache in step
+ * with the device around every frame (see dmabuf.h). Every node has a
+ * queue of its own (queue, GRAPH_DEFAULT_QUEUE frames by default) on the
+ * edge from its input. A full queue drops the frame for that node and its
+ * descendants only, so a slow sink never holds up the camera or its
+ * siblings.
+ *
+ * Node types and their settings, defaults in parentheses:
+ *   source     device, format (mjpeg, yuyv, grey, raw10, raw10p, nv12m,
+ *              yuv420m: multi-planar, a mapping per plane), width,
+ *              height (1920x1080), buffers (4), detach_below
+ *              (GRAPH_DEFAULT_DETACH_BELOW, 0 to never copy), pool
+ *              (GRAPH_DEFAULT_POOL copies), hold_ms (GRAPH_DEFAULT_HOLD_MS,
+ *              0 for no watchdog), access (mmap, or dmabuf for
+ *              single-planar formats), count (frames to capture, 0 for
+ *              until stopped), media (a media device whose graph is set
+ *              up for the format first, see media_graph.h), sensor
+ *              (ov5647, the entity to set up).
+ *   plugin     path, args: a stage plugin, see stage.h.
+ *   rules      path, output: capture rules, see rule.h.
+ *   tone_map   curve (srgb, rec709, identity or a LUT file), pool; grey
+ *              or yuyv frames.
+ *   raw_archive threads (1), pool: encodes raw Bayer frames into
+ *              raw_archive.h records.
+ *   file       path, segment_mb, total_mb (0, unlimited), mode (buffered,
+ *              dropbehind, direct): appends every frame to rotating
+ *              segments, see storage.h, a record per plane.
+ * Plugins and rules pass each frame on to the nodes reading from them
+ * once they are done with it; files end a branch.
+ */
+
+#ifndef GRAPH_H
+#define GRAPH_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <linux/videodev2.h>
+
+#include "camera.h"
+#include "frame.h"
+#include "raw_archive.h"
+#include "stage.h"
+#include "storage.h"
+#include "tone_map.h"
+
+/**
+ * @brief Most nodes in a graph.
+ */
+#define GRAPH_MAX_NODES 16
+
+/**
+ * @brief Most settings of a node.
+ */
+#define GRAPH_MAX_SETTINGS 12
+
+/**
+ * @brief Longest node or setting name, and longest value.
+ */
+#define GRAPH_MAX_NAME 32
+#define GRAPH_MAX_VALUE 256
+
+/**
+ * @brief Deepest queue of a node.
+ */
+#define GRAPH_MAX_QUEUE 64
+
+/**
+ * @brief Queue of a node that sets none.
+ */
+#define GRAPH_DEFAULT_QUEUE 4
+
+/**
+ * @brief Frames a producing node owns when it sets no pool. A frame is
+ * reused once every node it was queued for is done with it.
+ */
+#define GRAPH_DEFAULT_POOL 8
+
+/**
+ * @brief Free driver buffers under which a source that sets no
+ * detach_below copies frames out: one being filled and one ready.
+ */
+#define GRAPH_DEFAULT_DETACH_BELOW 2
+
+/**
+ * @brief Hold of a driver buffer the watchdog reports when a source sets
+ * no hold_ms, milliseconds.
+ */
+#define GRAPH_DEFAULT_HOLD_MS 1000
+
+/**
+ * @brief Upper bound of worker threads.
+ */
+#define GRAPH_MAX_THREADS 8
+
+/**
+ * @brief Kinds of node.
+ */
+enum graph_node_type_t {
+  GRAPH_SOURCE,
+  GRAPH_PLUGIN,
+  GRAPH_RULES,
+  GRAPH_TONE_MAP,
+  GRAPH_RAW_ARCHIVE,
+  GRAPH_FILE,
+};
+
+struct graph_t;
+struct graph_node_t;
+
+/**
+ * @brief A frame owned by a node's pool. Those of a source are its driver
+ * buffers, counted by their handle instead of refs and next.
+ * @param owner Node that produced it.
+ * @param data Payload, the first plane for multi-planar formats.
+ * @param capacity Size of data.
+ * @param bytes Bytes used.
+ * @param plane_count Planes of the frame, 1 for single-planar formats.
+ * @param planes Each plane, planes[0] is data. Those of a copy follow each
+ * other in data.
+ * @param metadata What the driver reported with the captured frame.
+ * @param handle Driver buffer of a source frame, NULL otherwise.
+ * @param running Workers running a node on it.
+ * @param refs Queues and nodes holding it, 0 while it is free.
+ * @param next Next free frame of the pool.
+ */
+struct graph_frame_t {
+  struct graph_node_t *owner;
+  uint8_t *data;
+  size_t capacity;
+  size_t bytes;
+  unsigned int plane_count;
+  struct stage_plane_t planes[STAGE_MAX_PLANES];
+  struct stage_metadata_t metadata;
+  struct frame_handle_t *handle;
+  unsigned int running;
+  unsigned int refs;
+  struct graph_frame_t *next;
+};
+
+/**
+ * @brief A setting of a node, as written in the file.
+ */
+struct graph_setting_t {
+  char key[GRAPH_MAX_NAME];
+  char value[GRAPH_MAX_VALUE];
+  unsigned int line;
+};
+
+/**
+ * @brief A node and its figures.
+ * @param graph Graph it belongs to.
+ * @param name Section name.
+ * @param type Kind of node.
+ * @param line Line of its section, for errors.
+ * @param settings Its settings.
+ * @param setting_count Number of settings.
+ * @param input Node it reads from, NULL for a source.
+ * @param outputs Nodes reading from it.
+ * @param output_count Number of outputs.
+ * @param format Format of the frames it produces or passes on.
+ * @param pool Frames it produces into, NULL for nodes passing frames on.
+ * For a source, its driver buffers.
+ * @param pool_size Number of frames in pool.
+ * @param free_frames Free frames of pool, of copies for a source.
+ * @param copies Frames a source copies lagging frames into.
+ * @param copy_count Number of copies.
+ * @param queue Frames waiting for it, a ring.
+ * @param queue_size Capacity of the ring.
+ * @param queue_head Oldest frame in the ring.
+ * @param queue_count Frames in the ring.
+ * @param busy Non-zero while a worker runs it.
+ * @param camera Device of a source.
+ * @param share Handles of the buffers of a source.
+ * @param source Source the node's frames come from, itself for a source.
+ * @param consumer Its consumer id in the share of source.
+ * @param detach_below Free driver buffers under which a source copies.
+ * @param dmabuf Non-zero if a source reads its buffers through dma-bufs.
+ * @param thread Capture thread of a source.
+ * @param capturing Non-zero while the capture thread runs.
+ * @param count Frames a source captures, 0 for until stopped.
+ * @param stages Pipeline of a plugin or rules node.
+ * @param tone_map Table of a tone_map node.
+ * @param archive Encoder of a raw_archive node.
+ * @param writer Segments of a file node.
+ * @param frames Frames processed, or captured by a source.
+ * @param dropped Frames lost because its queue was full.
+ * @param starved Frames lost because its pool had no free frame, or
+ * frames a source could not copy.
+ * @param detached Frames a source copied out of a driver buffer.
+ * @param errors Frames it failed on.
+ * @param queue_max Deepest its queue got.
+ * @param process_ns_avg Moving average of one frame, nanoseconds.
+ * @param process_ns_max Slowest frame, nanoseconds.
+ */
+struct graph_node_t {
+  struct graph_t *graph;
+  char name[GRAPH_MAX_NAME];
+  enum graph_node_type_t type;
+  unsigned int line;
+  struct graph_setting_t settings[GRAPH_MAX_SETTINGS];
+  unsigned int setting_count;
+  struct graph_node_t *input;
+  struct graph_node_t *outputs[GRAPH_MAX_NODES];
+  unsigned int output_count;
+  struct v4l2_format format;
+  struct graph_frame_t *pool;
+  unsigned int pool_size;
+  struct graph_frame_t *free_frames;
+  struct graph_frame_t *copies;
+  unsigned int copy_count;
+  struct graph_frame_t *queue[GRAPH_MAX_QUEUE];
+  unsigned int queue_size;
+  unsigned int queue_head;
+  unsigned int queue_count;
+  int busy;
+  struct camera_params_t *camera;
+  struct frame_share_t *share;
+  struct graph_node_t *source;
+  int consumer;
+  unsigned int detach_below;
+  int dmabuf;
+  pthread_t thread;
+  int capturing;
+  unsigned long count;
+  struct stage_pipeline_t *stages;
+  struct tone_map_t *tone_map;
+  struct raw_archive_t *archive;
+  struct segment_writer_t *writer;
+  unsigned long frames;
+  unsigned long dropped;
+  unsigned long starved;
+  unsigned long detached;
+  unsigned long errors;
+  unsigned int queue_max;
+  long long process_ns_avg;
+  long long process_ns_max;
+};
+
+/**
+ * @brief A graph and the pool running it.
+ * @param nodes Nodes, inputs before the nodes reading them once parsed.
+ * @param node_count Number of nodes.
+ * @param thread_count Worker threads.
+ * @param threads Worker threads.
+ * @param started Nodes set up by graph_start(), in order.
+ * @param lock Guards the queues, pools and counters below.
+ * @param work Signalled when a frame is queued or the graph quits.
+ * @param done Signalled when a source ends or a node goes idle.
+ * @param quit Tells the workers to exit.
+ * @param sources Capture threads still running.
+ * @param pending Frames queued or being processed.
+ * @param next_node Where workers resume looking for work, for fairness.
+ * @param error Why the last parse or start failed.
+ */
+struct graph_t {
+  struct graph_node_t nodes[GRAPH_MAX_NODES];
+  unsigned int node_count;
+  unsigned int thread_count;
+  pthread_t threads[GRAPH_MAX_THREADS];
+  unsigned int started;
+  pthread_mutex_t lock;
+  pthread_cond_t work;
+  pthread_cond_t done;
+  int quit;
+  unsigned int sources;
+  unsigned int pending;
+  unsigned int next_node;
+  char error[256];
+};
+
+/**
+ * @brief Set up an empty graph.
+ * @param graph Graph to initialize.
+ * @return None.
+ */
+void graph_init(struct graph_t *graph);
+
+/**
+ * @brief Read a graph from configuration text.
+ * @param graph Empty graph.
+ * @param text Configuration, NUL terminated.
+ * @return 0 on success, -1 with errno set to EINVAL and graph->error
+ * naming the line at fault: unknown types or settings, a missing or
+ * unknown input, a cycle, a node reading from a file sink.
+ */
+int graph_parse(struct graph_t *graph, const char *text);
+
+/**
+ * @brief Read a graph from a configuration file.
+ * @param graph Empty graph.
+ * @param path Configuration file.
+ * @return 0 on success, -1 with errno set and graph->error describing the
+ * failure.
+ */
+int graph_load(struct graph_t *graph, const char *path);
+
+/**
+ * @brief Open the devices, set up every node and start capturing.
+ * @param graph Parsed graph.
+ * @return 0 on success, -1 with errno set and graph->error naming the node
+ * that failed; what was set up is released again. Device errors exit, as
+ * in camera.c.
+ */
+int graph_start(struct graph_t *graph);
+
+/**
+ * @brief Wait until every source has captured its count or graph_stop()
+ * was called, then until the frames already captured went through the
+ * graph, and stop the workers.
+ * @param graph Started graph.
+ * @return None.
+ */
+void graph_wait(struct graph_t *graph);
+
+/**
+ * @brief Ask the running graphs to stop capturing. Async-signal-safe.
+ * @return None.
+ */
+void graph_stop(void);
+
+/**
+ * @brief Release every node, closing devices and files.
+ * @param graph Graph, parsed or waited for.
+ * @return None.
+ */
+void graph_destroy(struct graph_t *graph);
+
+/**
+ * @brief Name of a node type, for reports.
+ * @param type Node type.
+ * @return Its name as written in configuration files.
+ */
+const char *graph_type_name(enum graph_node_type_t type);
+
+#endif /* GRAPH_H */
@@ -0,0 +1,703 @@
+/**
+ * @file hdr.c
+ * @brief Bracket alignment and exposure fusion.
+ * @note Alignment compares median threshold bitmaps (Ward, 2003): a pixel
+ * is above or below its frame's median whatever the exposure, so frames a
+ * few stops apart still match. The shift is refined from the coarsest
+ * level down to half resolution and doubled, which keeps it even, as YUYV
+ * needs. Fusion weighs every sample by a hat on its luma and divides once
+ * per sample in single precision; the vector paths are selected at compile
+ * time (see SIMD in the Makefile): NEON on ARM, AVX2 on x86, scalar
+ * otherwise.
+ */
+
+#include "hdr.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+/**
+ * @brief Pixels within this many levels of the median are left out of the
+ * bitmap comparison, their side of the median is noise.
+ */
+#define HDR_MTB_NOISE 4
+
+/**
+ * @brief Smallest pyramid level worth comparing.
+ */
+#define HDR_MIN_LEVEL_SIZE 8
+
+int hdr_supports(__u32 pixelformat) {
+  return pixelformat == V4L2_PIX_FMT_GREY || pixelformat == V4L2_PIX_FMT_YUYV;
+}
+
+/**
+ * @brief Current CLOCK_MONOTONIC time in nanoseconds.
+ */
+static unsigned long long now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Fusion weight of a luma sample: 1 at black and white, 64 at mid
+ * grey. Small enough that four weighted samples still fit 16 bits.
+ */
+static inline unsigned int hdr_weight(unsigned int luma) {
+  return ((luma < 255 - luma ? luma : 255 - luma) >> 1) + 1;
+}
+
+/**
+ * @brief Fuse samples one at a time.
+ * @param rows Row of each frame, already shifted.
+ * @param count Number of frames.
+ * @param out Output row.
+ * @param first First byte to fuse.
+ * @param bytes End of the row in bytes.
+ * @param yuyv Whether samples take the weight of the luma before them.
+ */
+static void fuse_scalar(const uint8_t *const *rows, unsigned int count,
+                        uint8_t *out, size_t first, size_t bytes, int yuyv) {
+  size_t b;
+
+  for (b = first; b < bytes; b++) {
+    unsigned int num = 0;
+    unsigned int den = 0;
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+      unsigned int w = hdr_weight(rows[i][yuyv ? b & ~(size_t)1 : b]);
+
+      num += w * rows[i][b];
+      den += w;
+    }
+    out[b] = (uint8_t)((num + den / 2) / den);
+  }
+}
+
+#if defined(__ARM_NEON)
+
+/**
+ * @brief Rounded num / den of eight lanes. The reciprocal estimate takes
+ * two Newton steps to reach single precision; the bias above one half
+ * absorbs what is left, it is far below the 1/512 between distinct
+ * quotients.
+ */
+static inline uint8x8_t neon_divide(uint16x8_t num, uint16x8_t den) {
+  const float32x4_t half = vdupq_n_f32(0.5f + 1.0f / 2048);
+  uint32x4_t q[2];
+  int h;
+
+  for (h = 0; h < 2; h++) {
+    uint16x4_t n16 = h ? vget_high_u16(num) : vget_low_u16(num);
+    uint16x4_t d16 = h ? vget_high_u16(den) : vget_low_u16(den);
+    float32x4_t n = vcvtq_f32_u32(vmovl_u16(n16));
+    float32x4_t d = vcvtq_f32_u32(vmovl_u16(d16));
+    float32x4_t r = vrecpeq_f32(d);
+
+    r = vmulq_f32(vrecpsq_f32(d, r), r);
+    r = vmulq_f32(vrecpsq_f32(d, r), r);
+    q[h] = vcvtq_u32_f32(vmlaq_f32(half, n, r));
+  }
+  return vqmovn_u16(vcombine_u16(vmovn_u32(q[0]), vmovn_u32(q[1])));
+}
+
+/**
+ * @brief Weights of sixteen luma samples.
+ */
+static inline uint8x16_t neon_weight(uint8x16_t luma) {
+  return vaddq_u8(vshrq_n_u8(vminq_u8(luma, vmvnq_u8(luma)), 1),
+                  vdupq_n_u8(1));
+}
+
+/**
+ * @brief Fuse 32 bytes at a time, even and odd bytes de-interleaved so a
+ * YUYV luma and its chroma share a lane.
+ * @return Bytes fused.
+ */
+static size_t fuse_vector(const uint8_t *const *rows, unsigned int count,
+                          uint8_t *out, size_t bytes, int yuyv) {
+  size_t b;
+
+  for (b = 0; b + 32 <= bytes; b += 32) {
+    uint16x8_t num[4] = {vdupq_n_u16(0), vdupq_n_u16(0), vdupq_n_u16(0),
+                         vdupq_n_u16(0)};
+    uint16x8_t den[4] = {vdupq_n_u16(0), vdupq_n_u16(0), vdupq_n_u16(0),
+                         vdupq_n_u16(0)};
+    uint8x16x2_t result;
+    unsigned int i;
+    int k;
+
+    for (i = 0; i < count; i++) {
+      uint8x16x2_t px = vld2q_u8(rows[i] + b);
+      uint8x16_t w[2];
+
+      w[0] = neon_weight(px.val[0]);
+      w[1] = yuyv ? w[0] : neon_weight(px.val[1]);
+      for (k = 0; k < 2; k++) {
+        num[2 * k] = vmlal_u8(num[2 * k], vget_low_u8(w[k]),
+                              vget_low_u8(px.val[k]));
+        num[2 * k + 1] = vmlal_u8(num[2 * k + 1], vget_high_u8(w[k]),
+                                  vget_high_u8(px.val[k]));
+        den[2 * k] = vaddw_u8(den[2 * k], vget_low_u8(w[k]));
+        den[2 * k + 1] = vaddw_u8(den[2 * k + 1], vget_high_u8(w[k]));
+      }
+    }
+    for (k = 0; k < 2; k++) {
+      result.val[k] = vcombine_u8(neon_divide(num[2 * k], den[2 * k]),
+                                  neon_divide(num[2 * k + 1], den[2 * k + 1]));
+    }
+    vst2q_u8(out + b, result);
+  }
+  return b;
+}
+
+#elif defined(__AVX2__)
+
+/**
+ * @brief Rounded num / den of sixteen 16-bit lanes, through two halves of
+ * single precision. The unpack and pack pair keeps the lane order.
+ */
+static inline __m256i avx2_divide(__m256i num, __m256i den) {
+  const __m256i zero = _mm256_setzero_si256();
+  const __m256 half = _mm256_set1_ps(0.5f);
+  __m256 q0 = _mm256_div_ps(
+      _mm256_cvtepi32_ps(_mm256_unpacklo_epi16(num, zero)),
+      _mm256_cvtepi32_ps(_mm256_unpacklo_epi16(den, zero)));
+  __m256 q1 = _mm256_div_ps(
+      _mm256_cvtepi32_ps(_mm256_unpackhi_epi16(num, zero)),
+      _mm256_cvtepi32_ps(_mm256_unpackhi_epi16(den, zero)));
+
+  return _mm256_packus_epi32(_mm256_cvttps_epi32(_mm256_add_ps(q0, half)),
+                             _mm256_cvttps_epi32(_mm256_add_ps(q1, half)));
+}
+
+/**
+ * @brief Weights of sixteen luma samples held in 16-bit lanes.
+ */
+static inline __m256i avx2_weight(__m256i luma) {
+  const __m256i low = _mm256_set1_epi16(0x00ff);
+
+  return _mm256_add_epi16(
+      _mm256_srli_epi16(_mm256_min_epu16(luma, _mm256_xor_si256(luma, low)),
+                        1),
+      _mm256_set1_epi16(1));
+}
+
+/**
+ * @brief Fuse 32 bytes at a time as sixteen 16-bit lanes: the low byte of
+ * a lane is a YUYV luma, the high byte its chroma.
+ * @return Bytes fused.
+ */
+static size_t fuse_vector(const uint8_t *const *rows, unsigned int count,
+                          uint8_t *out, size_t bytes, int yuyv) {
+  const __m256i low = _mm256_set1_epi16(0x00ff);
+  size_t b;
+
+  for (b = 0; b + 32 <= bytes; b += 32) {
+    __m256i num_lo = _mm256_setzero_si256();
+    __m256i num_hi = _mm256_setzero_si256();
+    __m256i den_lo = _mm256_setzero_si256();
+    __m256i den_hi = _mm256_setzero_si256();
+    __m256i result;
+    unsigned int i;
+
+    for (i = 0; i < count; i++) {
+      __m256i x = _mm256_loadu_si256((const __m256i *)(rows[i] + b));
+      __m256i lo = _mm256_and_si256(x, low);
+      __m256i hi = _mm256_srli_epi16(x, 8);
+      __m256i w_lo = avx2_weight(lo);
+      __m256i w_hi = yuyv ? w_lo : avx2_weight(hi);
+
+      num_lo = _mm256_add_epi16(num_lo, _mm256_mullo_epi16(w_lo, lo));
+      num_hi = _mm256_add_epi16(num_hi, _mm256_mullo_epi16(w_hi, hi));
+      den_lo = _mm256_add_epi16(den_lo, w_lo);
+      den_hi = _mm256_add_epi16(den_hi, w_hi);
+    }
+    result = _mm256_or_si256(
+        avx2_divide(num_lo, den_lo),
+        _mm256_slli_epi16(avx2_divide(num_hi, den_hi), 8));
+    _mm256_storeu_si256((__m256i *)(out + b), result);
+  }
+  return b;
+}
+
+#else
+
+static size_t fuse_vector(const uint8_t *const *rows, unsigned int count,
+                          uint8_t *out, size_t bytes, int yuyv) {
+  (void)rows;
+  (void)count;
+  (void)out;
+  (void)bytes;
+  (void)yuyv;
+  return 0;
+}
+
+#endif
+
+/**
+ * @brief Fuse one tile: rows every frame covers are fused over the columns
+ * every frame covers, the rest is copied from the reference.
+ * @param merger Merger holding the job.
+ * @param tile Tile index.
+ */
+static void fuse_tile(struct hdr_merger_t *merger, unsigned int tile) {
+  const struct v4l2_pix_format *format = &merger->format;
+  int yuyv = format->pixelformat == V4L2_PIX_FMT_YUYV;
+  size_t bpp = yuyv ? 2 : 1;
+  size_t width_bytes = format->width * bpp;
+  const uint8_t *reference = merger->frames[merger->reference];
+  int x0 = 0;
+  int x1 = (int)format->width;
+  __u32 first = tile * HDR_TILE_ROWS;
+  __u32 last = first + HDR_TILE_ROWS;
+  unsigned int i;
+  __u32 y;
+
+  if (last > format->height) {
+    last = format->height;
+  }
+  for (i = 0; i < merger->count; i++) {
+    if (-merger->shifts[i][0] > x0) {
+      x0 = -merger->shifts[i][0];
+    }
+    if ((int)format->width - merger->shifts[i][0] < x1) {
+      x1 = (int)format->width - merger->shifts[i][0];
+    }
+  }
+
+  for (y = first; y < last; y++) {
+    const uint8_t *rows[HDR_MAX_FRAMES];
+    uint8_t *out = merger->output + (size_t)y * format->bytesperline;
+    const uint8_t *ref = reference + (size_t)y * format->bytesperline;
+    int covered = x0 < x1;
+    size_t span;
+    size_t done;
+
+    for (i = 0; i < merger->count && covered; i++) {
+      int source = (int)y + merger->shifts[i][1];
+
+      covered = source >= 0 && source < (int)format->height;
+      if (covered) {
+        rows[i] = merger->frames[i] + (size_t)source * format->bytesperline +
+                  (size_t)(x0 + merger->shifts[i][0]) * bpp;
+      }
+    }
+    if (!covered) {
+      memcpy(out, ref, width_bytes);
+    } else {
+      memcpy(out, ref, (size_t)x0 * bpp);
+      span = (size_t)(x1 - x0) * bpp;
+      done = fuse_vector(rows, merger->count, out + x0 * bpp, span, yuyv);
+      fuse_scalar(rows, merger->count, out + x0 * bpp, done, span, yuyv);
+      memcpy(out + x1 * bpp, ref + x1 * bpp, width_bytes - (size_t)x1 * bpp);
+    }
+
+    if (merger->tone == NULL) {
+      continue;
+    }
+    if (yuyv) {
+      tone_map_apply_yuyv(merger->tone, out, width_bytes);
+    } else {
+      tone_map_apply(merger->tone, out, width_bytes);
+    }
+  }
+}
+
+/**
+ * @brief Take tiles of the current merge until none are left.
+ * @param worker Calling thread.
+ */
+static void run_tiles(struct hdr_worker_t *worker) {
+  struct hdr_merger_t *merger = worker->merger;
+
+  pthread_mutex_lock(&merger->lock);
+  while (merger->count > 0 && merger->next_tile < merger->tile_count) {
+    unsigned int tile = merger->next_tile++;
+
+    pthread_mutex_unlock(&merger->lock);
+    fuse_tile(merger, tile);
+    pthread_mutex_lock(&merger->lock);
+
+    if (++merger->tiles_done == merger->tile_count) {
+      pthread_cond_signal(&merger->finished);
+    }
+  }
+  pthread_mutex_unlock(&merger->lock);
+}
+
+static void *worker_main(void *arg) {
+  struct hdr_worker_t *worker = arg;
+  struct hdr_merger_t *merger = worker->merger;
+  unsigned long seen = 0;
+
+  pthread_mutex_lock(&merger->lock);
+  for (;;) {
+    while (merger->generation == seen && !merger->quit) {
+      pthread_cond_wait(&merger->start, &merger->lock);
+    }
+    if (merger->quit) {
+      break;
+    }
+    seen = merger->generation;
+    pthread_mutex_unlock(&merger->lock);
+    run_tiles(worker);
+    pthread_mutex_lock(&merger->lock);
+  }
+  pthread_mutex_unlock(&merger->lock);
+
+  return NULL;
+}
+
+/**
+ * @brief Replace every level of a pyramid by its median threshold bitmap.
+ * @param pyramid Pyramid holding luma.
+ * @param levels Levels in use.
+ */
+static void threshold_pyramid(struct hdr_pyramid_t *pyramid,
+                              unsigned int levels) {
+  unsigned int l;
+
+  for (l = 0; l < levels; l++) {
+    size_t size = (size_t)pyramid->width[l] * pyramid->height[l];
+    uint8_t *data = pyramid->data[l];
+    size_t histogram[256] = {0};
+    size_t seen = 0;
+    int median = 0;
+    size_t i;
+
+    for (i = 0; i < size; i++) {
+      histogram[data[i]]++;
+    }
+    while (median < 255 && (seen += histogram[median]) < size / 2) {
+      median++;
+    }
+    for (i = 0; i < size; i++) {
+      int v = data[i];
+
+      data[i] = (uint8_t)((v > median) |
+                          (v > median + HDR_MTB_NOISE ||
+                                   v < median - HDR_MTB_NOISE
+                               ? 2
+                               : 0));
+    }
+  }
+}
+
+/**
+ * @brief Build the alignment pyramid of a frame: 2x2 luma averages down to
+ * the smallest level, then bitmaps.
+ * @param merger Merger, format and levels set.
+ * @param frame Frame.
+ * @param pyramid Pyramid with its levels allocated.
+ */
+static void build_pyramid(const struct hdr_merger_t *merger,
+                          const uint8_t *frame,
+                          struct hdr_pyramid_t *pyramid) {
+  const struct v4l2_pix_format *format = &merger->format;
+  size_t bpp = format->pixelformat == V4L2_PIX_FMT_YUYV ? 2 : 1;
+  unsigned int l;
+  __u32 x;
+  __u32 y;
+
+  for (y = 0; y < pyramid->height[0]; y++) {
+    const uint8_t *r0 = frame + (size_t)(2 * y) * format->bytesperline;
+    const uint8_t *r1 = r0 + format->bytesperline;
+    uint8_t *out = pyramid->data[0] + (size_t)y * pyramid->width[0];
+
+    for (x = 0; x < pyramid->width[0]; x++) {
+      size_t a = 2 * x * bpp;
+
+      out[x] = (uint8_t)((r0[a] + r0[a + bpp] + r1[a] + r1[a + bpp] + 2) >> 2);
+    }
+  }
+  for (l = 1; l < merger->levels; l++) {
+    __u32 above = pyramid->width[l - 1];
+
+    for (y = 0; y < pyramid->height[l]; y++) {
+      const uint8_t *r0 = pyramid->data[l - 1] + (size_t)(2 * y) * above;
+      const uint8_t *r1 = r0 + above;
+      uint8_t *out = pyramid->data[l] + (size_t)y * pyramid->width[l];
+
+      for (x = 0; x < pyramid->width[l]; x++) {
+        out[x] = (uint8_t)((r0[2 * x] + r0[2 * x + 1] + r1[2 * x] +
+                            r1[2 * x + 1] + 2) >>
+                           2);
+      }
+    }
+  }
+  threshold_pyramid(pyramid, merger->levels);
+}
+
+/**
+ * @brief Count pixels on opposite sides of the median in both bitmaps,
+ * with the frame displaced by (sx, sy).
+ */
+static unsigned long bitmap_error(const struct hdr_pyramid_t *reference,
+                                  const struct hdr_pyramid_t *frame,
+                                  unsigned int level, int sx, int sy) {
+  int width = (int)reference->width[level];
+  int height = (int)reference->height[level];
+  int x0 = sx < 0 ? -sx : 0;
+  int x1 = sx > 0 ? width - sx : width;
+  int y0 = sy < 0 ? -sy : 0;
+  int y1 = sy > 0 ? height - sy : height;
+  unsigned long error = 0;
+  int x;
+  int y;
+
+  for (y = y0; y < y1; y++) {
+    const uint8_t *a = reference->data[level] + (size_t)y * width;
+    const uint8_t *b = frame->data[level] + (size_t)(y + sy) * width + sx;
+
+    for (x = x0; x < x1; x++) {
+      error += (unsigned int)((a[x] ^ b[x]) & (a[x] & b[x]) >> 1) & 1;
+    }
+  }
+  return error;
+}
+
+/**
+ * @brief Size the pyramids for the current format.
+ * @param merger Merger, format set.
+ * @return 0 on success, -1 with errno set.
+ */
+static int prepare_pyramids(struct hdr_merger_t *merger) {
+  __u32 width = merger->format.width / 2;
+  __u32 height = merger->format.height / 2;
+  size_t offsets[HDR_PYRAMID_LEVELS];
+  size_t total = 0;
+  unsigned int levels = 0;
+  unsigned int f;
+  unsigned int l;
+
+  while (levels < HDR_PYRAMID_LEVELS && width >= HDR_MIN_LEVEL_SIZE &&
+         height >= HDR_MIN_LEVEL_SIZE) {
+    offsets[levels] = total;
+    total += (size_t)width * height;
+    for (f = 0; f < HDR_MAX_FRAMES; f++) {
+      merger->pyramids[f].width[levels] = width;
+      merger->pyramids[f].height[levels] = height;
+    }
+    levels++;
+    width /= 2;
+    height /= 2;
+  }
+  merger->levels = levels;
+
+  for (f = 0; f < HDR_MAX_FRAMES; f++) {
+    uint8_t *data = merger->pyramids[f].data[0];
+
+    if (merger->pyramid_capacity < total) {
+      data = realloc(data, total);
+      if (data == NULL) {
+        errno = ENOMEM;
+        return -1;
+      }
+    }
+    for (l = 0; l < levels; l++) {
+      merger->pyramids[f].data[l] = data + offsets[l];
+    }
+  }
+  if (merger->pyramid_capacity < total) {
+    merger->pyramid_capacity = total;
+  }
+  return 0;
+}
+
+/**
+ * @brief Estimate the shift of every frame from the reference, coarse to
+ * fine, one pixel around the doubled estimate per level.
+ * @param merger Merger holding the job.
+ */
+static void align_frames(struct hdr_merger_t *merger) {
+  const struct hdr_pyramid_t *reference = &merger->pyramids[merger->reference];
+  unsigned int i;
+
+  for (i = 0; i < merger->count; i++) {
+    build_pyramid(merger, merger->frames[i], &merger->pyramids[i]);
+  }
+
+  for (i = 0; i < merger->count; i++) {
+    int sx = 0;
+    int sy = 0;
+    int l;
+
+    for (l = (int)merger->levels - 1; i != merger->reference && l >= 0; l--) {
+      unsigned long best = (unsigned long)-1;
+      int best_x = sx;
+      int best_y = sy;
+      int dx;
+      int dy;
+
+      for (dy = -1; dy <= 1; dy++) {
+        for (dx = -1; dx <= 1; dx++) {
+          unsigned long error = bitmap_error(reference, &merger->pyramids[i],
+                                             (unsigned int)l, sx + dx, sy + dy);
+
+          /* Ties go to the smaller move. */
+          if (error < best ||
+              (error == best && abs(sx + dx) + abs(sy + dy) <
+                                    abs(best_x) + abs(best_y))) {
+            best = error;
+            best_x = sx + dx;
+            best_y = sy + dy;
+          }
+        }
+      }
+      sx = best_x;
+      sy = best_y;
+      if (l > 0) {
+        sx *= 2;
+        sy *= 2;
+      }
+    }
+    /* Level 0 is half resolution. */
+    merger->shifts[i][0] = 2 * sx;
+    merger->shifts[i][1] = 2 * sy;
+  }
+}
+
+int hdr_merger_init(struct hdr_merger_t *merger, unsigned int threads) {
+  unsigned int i;
+
+  memset(merger, 0, sizeof(*merger));
+  if (threads == 0) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+
+    threads = online > 0 ? (unsigned int)online : 1;
+  }
+  if (threads > HDR_MAX_THREADS) {
+    threads = HDR_MAX_THREADS;
+  }
+
+  pthread_mutex_init(&merger->lock, NULL);
+  pthread_cond_init(&merger->start, NULL);
+  pthread_cond_init(&merger->finished, NULL);
+
+  for (i = 0; i < threads; i++) {
+    merger->workers[i].merger = merger;
+    merger->workers[i].id = i;
+    /* Worker 0 is whoever calls hdr_merge(). */
+    if (i > 0 && pthread_create(&merger->thread_ids[i], NULL, worker_main,
+                                &merger->workers[i]) != 0) {
+      hdr_merger_destroy(merger);
+      errno = EAGAIN;
+      return -1;
+    }
+    merger->threads = i + 1;
+  }
+
+  return 0;
+}
+
+int hdr_merge(struct hdr_merger_t *merger,
+              const struct v4l2_pix_format *format,
+              const void *const *frames, unsigned int count,
+              unsigned int reference, const struct tone_map_t *tone,
+              const void **output) {
+  size_t bpp = format->pixelformat == V4L2_PIX_FMT_YUYV ? 2 : 1;
+  size_t size = (size_t)format->bytesperline * format->height;
+  unsigned long long start;
+  unsigned long long aligned;
+  unsigned int tiles;
+  unsigned int i;
+
+  if (!hdr_supports(format->pixelformat) || count < 2 ||
+      count > HDR_MAX_FRAMES || reference >= count || format->width < 2 ||
+      format->height < 2 || format->bytesperline < format->width * bpp) {
+    errno = EINVAL;
+    return -1;
+  }
+  for (i = 0; i < count; i++) {
+    if (frames[i] == NULL) {
+      errno = EINVAL;
+      return -1;
+    }
+  }
+  if (merger->output_capacity < size) {
+    uint8_t *grown = realloc(merger->output, size);
+
+    if (grown == NULL) {
+      errno = ENOMEM;
+      return -1;
+    }
+    merger->output = grown;
+    merger->output_capacity = size;
+  }
+  merger->format = *format;
+  if (prepare_pyramids(merger) < 0) {
+    return -1;
+  }
+
+  start = now_ns();
+  for (i = 0; i < count; i++) {
+    merger->frames[i] = frames[i];
+  }
+  merger->reference = reference;
+  merger->tone = tone;
+  merger->count = count;
+  align_frames(merger);
+  aligned = now_ns();
+
+  tiles = (format->height + HDR_TILE_ROWS - 1) / HDR_TILE_ROWS;
+  pthread_mutex_lock(&merger->lock);
+  merger->tile_count = tiles;
+  merger->next_tile = 0;
+  merger->tiles_done = 0;
+  merger->generation++;
+  pthread_cond_broadcast(&merger->start);
+  pthread_mutex_unlock(&merger->lock);
+
+  run_tiles(&merger->workers[0]);
+
+  pthread_mutex_lock(&merger->lock);
+  while (merger->tiles_done < tiles) {
+    pthread_cond_wait(&merger->finished, &merger->lock);
+  }
+  merger->count = 0;
+  pthread_mutex_unlock(&merger->lock);
+
+  merger->merges++;
+  merger->align_ns += aligned - start;
+  merger->fuse_ns += now_ns() - aligned;
+  *output = merger->output;
+  return 0;
+}
+
+void hdr_merger_destroy(struct hdr_merger_t *merger) {
+  unsigned int i;
+
+  pthread_mutex_lock(&merger->lock);
+  merger->quit = 1;
+  pthread_cond_broadcast(&merger->start);
+  pthread_mutex_unlock(&merger->lock);
+
+  for (i = 1; i < merger->threads; i++) {
+    pthread_join(merger->thread_ids[i], NULL);
+  }
+  merger->threads = 0;
+
+  for (i = 0; i < HDR_MAX_FRAMES; i++) {
+    free(merger->pyramids[i].data[0]);
+    merger->pyramids[i].data[0] = NULL;
+  }
+  free(merger->output);
+  merger->output = NULL;
+
+  pthread_cond_destroy(&merger->finished);
+  pthread_cond_destroy(&merger->start);
+  pthread_mutex_destroy(&merger->lock);
+}
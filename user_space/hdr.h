@@ -0,0 +1,160 @@
+/**
+ * @file hdr.h
+ * @brief Software HDR: an exposure bracket of 8-bit frames aligned by a
+ * global shift and merged by exposure fusion into one displayable image,
+ * tile by tile on a worker pool.
+ */
+
+#ifndef HDR_H
+#define HDR_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <linux/videodev2.h>
+
+#include "tone_map.h"
+
+/**
+ * @brief Most frames merged at once.
+ */
+#define HDR_MAX_FRAMES 4
+
+/**
+ * @brief Upper bound of merging threads, the caller included.
+ */
+#define HDR_MAX_THREADS 8
+
+/**
+ * @brief Rows per tile. Tiles are fused independently, so they are the unit
+ * of parallelism; 32 rows give 34 tiles at 1080p.
+ */
+#define HDR_TILE_ROWS 32
+
+/**
+ * @brief Pyramid levels below full resolution used for alignment. Each
+ * level searches one pixel around the doubled estimate of the level above,
+ * so frames may move by up to 2^(levels + 1) - 2 pixels.
+ */
+#define HDR_PYRAMID_LEVELS 5
+
+struct hdr_merger_t;
+
+/**
+ * @brief A thread of the pool.
+ */
+struct hdr_worker_t {
+  struct hdr_merger_t *merger;
+  unsigned int id;
+};
+
+/**
+ * @brief Alignment pyramid of one frame: median threshold bitmaps, bit 0
+ * set above the median and bit 1 set away from it (outside the noise band).
+ * @param data Level 1 (half resolution) first, each level half the last.
+ * @param width Width of each level.
+ * @param height Height of each level.
+ */
+struct hdr_pyramid_t {
+  uint8_t *data[HDR_PYRAMID_LEVELS];
+  __u32 width[HDR_PYRAMID_LEVELS];
+  __u32 height[HDR_PYRAMID_LEVELS];
+};
+
+/**
+ * @brief Merger and its worker pool.
+ * @param threads Merging threads including the caller of hdr_merge().
+ * @param format Format of the frames being merged.
+ * @param frames Frames being merged, shared with the workers.
+ * @param count Number of frames.
+ * @param reference Frame the others are aligned to.
+ * @param shifts Offset of each frame from the reference, in pixels: frame i
+ * at (x + shifts[i][0], y + shifts[i][1]) shows what the reference shows at
+ * (x, y).
+ * @param tone Tone curve applied to the result, NULL for none.
+ * @param generation Bumped for every merge, wakes the workers.
+ * @param next_tile Next tile to hand out.
+ * @param tiles_done Tiles finished for the current merge.
+ * @param pyramids Alignment scratch, by frame.
+ * @param levels Pyramid levels in use.
+ * @param output Result of the last merge.
+ * @param merges Merges done.
+ * @param align_ns Time spent aligning, in nanoseconds.
+ * @param fuse_ns Time spent fusing and tone mapping, in nanoseconds.
+ */
+struct hdr_merger_t {
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t finished;
+  pthread_t thread_ids[HDR_MAX_THREADS];
+  struct hdr_worker_t workers[HDR_MAX_THREADS];
+  unsigned int threads;
+  int quit;
+  struct v4l2_pix_format format;
+  const uint8_t *frames[HDR_MAX_FRAMES];
+  unsigned int count;
+  unsigned int reference;
+  int shifts[HDR_MAX_FRAMES][2];
+  const struct tone_map_t *tone;
+  unsigned long generation;
+  unsigned int tile_count;
+  unsigned int next_tile;
+  unsigned int tiles_done;
+  struct hdr_pyramid_t pyramids[HDR_MAX_FRAMES];
+  size_t pyramid_capacity;
+  unsigned int levels;
+  uint8_t *output;
+  size_t output_capacity;
+  unsigned long merges;
+  unsigned long long align_ns;
+  unsigned long long fuse_ns;
+};
+
+/**
+ * @brief Tell whether frames of a fourcc can be merged: 8-bit GREY and
+ * packed YUYV. Compressed frames would need a full decode first.
+ * @param pixelformat V4L2 fourcc.
+ * @return Non-zero if supported.
+ */
+int hdr_supports(__u32 pixelformat);
+
+/**
+ * @brief Start a merger.
+ * @param merger Merger to initialize.
+ * @param threads Merging threads including the caller, 0 for one per
+ * online CPU. Capped at HDR_MAX_THREADS.
+ * @return 0 on success, -1 with errno set.
+ */
+int hdr_merger_init(struct hdr_merger_t *merger, unsigned int threads);
+
+/**
+ * @brief Align a bracket to one of its frames and fuse it. Each sample is
+ * the average of the frames' samples weighted by how well exposed their
+ * luma is (a hat peaking at mid grey), so every region comes from the
+ * frames that captured it best. YUYV chroma takes the weights of its luma.
+ * @param merger Merger.
+ * @param format Format shared by every frame.
+ * @param frames Frames, darkest to brightest or in any order.
+ * @param count Number of frames, 2 to HDR_MAX_FRAMES.
+ * @param reference Frame the others are aligned to, usually the middle
+ * exposure. Borders the shifted frames do not cover are taken from it.
+ * @param tone Tone curve applied to the result, NULL for none.
+ * @param output Set to the result, format->bytesperline * format->height
+ * bytes valid until the next call.
+ * @return 0 on success, -1 with errno set (EINVAL for unsupported input).
+ */
+int hdr_merge(struct hdr_merger_t *merger,
+              const struct v4l2_pix_format *format,
+              const void *const *frames, unsigned int count,
+              unsigned int reference, const struct tone_map_t *tone,
+              const void **output);
+
+/**
+ * @brief Stop the workers and release the merger.
+ * @param merger Merger.
+ * @return None.
+ */
+void hdr_merger_destroy(struct hdr_merger_t *merger);
+
+#endif /* HDR_H */
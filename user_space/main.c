@@ -4,58 +4,232 @@
  * captures image.
  */
 
+#include <errno.h>
+#include <fcntl.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
-#include <fcntl.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
 #include <unistd.h>
 
-#include <sys/ioctl.h>
-#include <sys/mman.h>
-#include <sys/stat.h>
-#include <sys/types.h>
-
 #include <linux/videodev2.h>
 
+#include "barcode.h"
+#include "bracket.h"
+#include "burst.h"
+#include "camera.h"
+#include "graph.h"
+#include "hdr.h"
+#include "mapping.h"
+#include "media_graph.h"
+#include "mode_switch.h"
+#include "raw_archive.h"
+#include "recorder.h"
+#include "rule.h"
+#include "snapshot.h"
+#include "stabilizer.h"
+#include "stack.h"
+#include "stage.h"
+#include "storage.h"
+#include "timelapse.h"
+#include "tone_map.h"
+
 /**
  * @brief Default text length of a log string.
 */
 #define DEFAULT_TEXT_LENGTH 256
 
 /**
- * @brief When an image is captured, it will be saved to this path.
+ * @brief When an image is captured, it will be saved to this path unless -o
+ * is given.
  */
 static const char IMAGE_CAPTURE_SAVE_PATH[] =
     "/home/pi/captured_frame_raw.jpeg";
 
 /**
  * @brief Path to the camera device in the dev filesystem. Entry to any V4L2
- * operations.
+ * operations. Overridden with -d.
  */
 static const char CAMERA_DEV_PATH[] = "/dev/video0";
 
+/**
+ * @brief Media controller device of the camera, the Request API entry.
+ * Overridden with -m.
+ */
+static const char CAMERA_MEDIA_PATH[] = "/dev/media0";
+
+/**
+ * @brief Device and output paths in effect.
+ */
+static const char *device_path = CAMERA_DEV_PATH;
+static const char *media_path = CAMERA_MEDIA_PATH;
+static const char *output_path = IMAGE_CAPTURE_SAVE_PATH;
+
 /**
  * @brief String buffer to store formatted strings tempoararily for printing.
  */
 static char message[DEFAULT_TEXT_LENGTH];
 
 /**
- * @brief Book keeps parameters for image / video capturing.
- * @param device_fs File descriptor to the opened camera hardware, on file
- * system the device is access through CAMERA_DEV_PATH.
- * @param buffer_request Request for frame buffer.
- * @param buffer Video buffer instance.
- * @param buffer_start Start address of the mapped memory of the device.
- * @note The V4L2 structs are defined in <linux/videodev2.h>.
+ * @brief Pixel format requested from the camera, selected with -f.
+ */
+static __u32 pixel_format = V4L2_PIX_FMT_MJPEG;
+
+/**
+ * @brief Tone curve applied to the captured frame when -t is given. Only
+ * meaningful for uncompressed formats.
+ */
+static struct tone_map_t tone_map;
+
+/**
+ * @brief Non-zero when tone_map should be applied before saving.
+ */
+static int tone_map_enabled;
+
+/**
+ * @brief Time-lapse interval in milliseconds (-T), 0 takes a single shot.
+ */
+static unsigned int timelapse_interval_ms;
+
+/**
+ * @brief Number of time-lapse shots (-n), 0 runs until interrupted.
+ */
+static unsigned int timelapse_shots;
+
+/**
+ * @brief Frames of a full-resolution burst (-B), 0 for none.
+ */
+static unsigned int burst_frames;
+
+/**
+ * @brief Non-zero to stack the burst into one still (-N), and how.
+ */
+static int stack_enabled;
+static enum stack_method_t stack_method;
+
+/**
+ * @brief Exposure bracket (-E), in sensor lines, no steps for none.
+ */
+static int bracket_values[BRACKET_MAX_STEPS];
+static unsigned int bracket_steps;
+
+/**
+ * @brief HDR images to merge from brackets (-H), 0 for none, and the frames
+ * of the bracket being merged.
+ */
+static unsigned int hdr_images;
+static void *hdr_frames[HDR_MAX_FRAMES];
+
+/**
+ * @brief Stills to take from a running preview (-M), 0 for none.
+ */
+static unsigned int preview_stills;
+
+/**
+ * @brief Capture mode of all but the -B and -M modes.
+ */
+#define CAPTURE_WIDTH 1920
+#define CAPTURE_HEIGHT 1080
+
+/**
+ * @brief Preview mode used with -M, and the time between stills.
+ */
+#define PREVIEW_WIDTH 640
+#define PREVIEW_HEIGHT 480
+#define PREVIEW_STILL_INTERVAL_MS 1000
+
+/**
+ * @brief Set from the signal handler to end the preview or a barcode scan.
+ */
+static volatile sig_atomic_t preview_stop;
+
+/**
+ * @brief Non-zero to record continuously (-R), for record_seconds or until
+ * interrupted when 0.
+ */
+static int record_enabled;
+static unsigned int record_seconds;
+
+/**
+ * @brief Recording segment size (-S) and disk usage cap (-C), in bytes.
+ */
+static off_t record_segment_bytes;
+static off_t record_cap_bytes;
+
+/**
+ * @brief How recording segments are written (-W).
+ */
+static enum storage_mode_t record_write_mode = STORAGE_BUFFERED;
+
+/**
+ * @brief Static-scene skipping of recordings (-D), and the longest gap
+ * between stored frames it may leave (-K), in seconds.
+ */
+static unsigned int record_dedup_threshold;
+static unsigned int record_keepalive_seconds = 60;
+
+/**
+ * @brief Non-zero to stabilize recordings (-V), and the look-ahead used, in
+ * frames.
  */
-struct camera_params_t {
-  int device_fs;
-  struct v4l2_format capture_format;
-  struct v4l2_requestbuffers buffer_request;
-  struct v4l2_buffer buffer;
-  void *buffer_start;
-};
+static int record_stabilize;
+static unsigned int record_stabilize_lookahead;
+
+/**
+ * @brief UNIX datagram socket barcode results are sent to (-Q), NULL when
+ * not scanning.
+ */
+static const char *barcode_socket_path;
+
+/**
+ * @brief Stage plugins to run on the stream (-P), each "PATH[:ARGS]".
+ */
+static char *stage_specs[STAGE_MAX_STAGES];
+static unsigned int stage_spec_count;
+
+/**
+ * @brief Capture rules file run on the stream (-X), NULL for none.
+ */
+static const char *rules_path;
+
+/**
+ * @brief Capture graph configuration run instead of the fixed modes (-G),
+ * NULL for none.
+ */
+static const char *graph_path;
+
+/**
+ * @brief Sensor entity whose media graph path is set up before capturing
+ * (-U), NULL to leave the graph alone.
+ */
+static const char *media_sensor;
+
+/**
+ * @brief Non-zero to benchmark reading the driver buffers (-A) instead of
+ * capturing.
+ */
+static int mapping_bench_enabled;
+
+/**
+ * @brief File refreshed with the latest frame during recordings (-L), NULL
+ * for none.
+ */
+static const char *live_view_path;
+
+/**
+ * @brief Live view refresh period, in seconds.
+ */
+#define LIVE_VIEW_PERIOD_S 1
+
+/**
+ * @brief Wakes the live view thread to end it.
+ */
+static pthread_mutex_t live_view_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t live_view_wake = PTHREAD_COND_INITIALIZER;
+static int live_view_done;
 
 /**
  * @brief Params for the V4L2 transactions, file static to be shared accross
@@ -64,256 +238,1112 @@ struct camera_params_t {
 static struct camera_params_t camera_params;
 
 /**
- * @brief Invoke open system call to open the camera device.
- * @param None.
+ * @brief Conversion stage run on the captured frame before it is saved.
+ * Applies the tone curve to the luma samples of uncompressed frames.
+ * @param params Capture state holding the dequeued frame.
  * @return None.
- * @note Requires <sys/types.h> <sys/stat.h> <fcntl.h>.
  */
-void open_camera_device() {
-  /* If successful, stores a nonnegative integer to refer to the opened camera
-   * device. */
-  camera_params.device_fs = open(CAMERA_DEV_PATH, O_RDWR);
+void convert_frame(struct camera_params_t *params) {
+  if (!tone_map_enabled) {
+    return;
+  }
 
-  /* Error out on invalid file descriptor. */
-  if (camera_params.device_fs < 0) {
-    sprintf(message, "Error opening %s\n", CAMERA_DEV_PATH);
-    perror(message);
+  switch (params->capture_format.fmt.pix.pixelformat) {
+  case V4L2_PIX_FMT_YUYV:
+    tone_map_apply_yuyv(&tone_map, params->buffer_start,
+                        params->buffer.bytesused);
+    break;
+  case V4L2_PIX_FMT_GREY:
+    tone_map_apply(&tone_map, params->buffer_start, params->buffer.bytesused);
+    break;
+  default:
+    fprintf(stderr, "Tone curve ignored, format is not uncompressed.\n");
+    break;
+  }
+}
+
+/**
+ * @brief Print command line usage.
+ * @param prog Name of the executable.
+ * @return None.
+ */
+void usage(const char *prog) {
+  fprintf(stderr,
+          "Usage: %s [-d DEVICE] [-o FILE]\n"
+          "          [-f mjpeg|yuyv|grey|raw10|raw10p|nv12m|yuv420m]\n"
+          "          [-t srgb|rec709|identity|FILE] [-T MS [-n SHOTS]]\n"
+          "          [-B N [-N mean|clip]] [-M N]\n"
+          "          [-E EXPOSURES [-m MEDIA] [-H N]]\n"
+          "          [-R SECONDS [-S MB] [-C MB]\n"
+          "              [-W buffered|dropbehind|direct] [-D LEVELS [-K S]]\n"
+          "              [-V FRAMES] [-L FILE]]\n"
+          "          [-Q SOCKET] [-P PLUGIN[:ARGS]]... [-X RULES] [-A]\n"
+          "          [-U SENSOR [-m MEDIA]] [-G CONFIG]\n"
+          "  -d  Camera device, default %s.\n"
+          "  -o  Output file, default %s.\n"
+          "  -f  Pixel format to capture, default mjpeg. Recordings of raw\n"
+          "      Bayer (raw10, raw10p) are stored losslessly compressed.\n"
+          "      nv12m and yuv420m need a multi-planar device, their\n"
+          "      planes are saved one after the other.\n"
+          "  -t  Tone curve applied to uncompressed frames, or a LUT file\n"
+          "      holding 256 values.\n"
+          "  -T  Time-lapse: one shot every MS milliseconds, numbered after\n"
+          "      the output file. Above %d ms the sensor idles between shots.\n"
+          "  -n  Number of time-lapse shots, default 0 (until interrupted).\n"
+          "  -B  Burst of N (up to %d) consecutive %dx%d frames, numbered\n"
+          "      after the output file.\n"
+          "  -N  Stack the burst into one low-light still at the output file\n"
+          "      (-f grey or yuyv): plain mean, or clipped to drop samples\n"
+          "      far from their median (3 frames or more).\n"
+          "  -M  Preview at %dx%d and take N stills at %dx%d, one a second,\n"
+          "      numbered after the output file.\n"
+          "  -E  Exposure bracket: one frame per comma separated exposure\n"
+          "      (up to %d, in sensor lines), numbered after the output file.\n"
+          "      Auto exposure is off for the bracket.\n"
+          "  -m  Media device for per-frame exposures and -U, default %s.\n"
+          "      Without it frames are matched to exposures by sequence\n"
+          "      number.\n"
+          "  -H  Merge N brackets of 2 to %d exposures into HDR images,\n"
+          "      aligned to the middle exposure (-f grey or yuyv).\n"
+          "  -R  Record continuously for SECONDS (0 until interrupted) into\n"
+          "      segments numbered after the output file.\n"
+          "  -S  Start a new segment every MB megabytes.\n"
+          "  -C  Delete the oldest segments to keep the recording under MB\n"
+          "      megabytes.\n"
+          "  -W  How segments are written: through the page cache (buffered,\n"
+          "      default), flushed early and dropped from the cache\n"
+          "      (dropbehind) or bypassing it with O_DIRECT (direct).\n"
+          "  -D  Skip frames whose 16x12 luma block means all stay within\n"
+          "      LEVELS of the last stored frame, e.g. 6.\n"
+          "  -K  With -D, store a frame at least every S seconds, default\n"
+          "      60 (0 for never).\n"
+          "  -V  Stabilize the recording (-f grey or yuyv): frames are\n"
+          "      cropped by %d%% on each side to follow the camera path\n"
+          "      smoothed over FRAMES (up to %d) frames ahead and behind,\n"
+          "      and written FRAMES frames late.\n"
+          "  -L  Refresh FILE with the latest frame every second while\n"
+          "      recording.\n"
+          "  -Q  Scan the stream for EAN-13 barcodes and QR codes (-f grey\n"
+          "      or yuyv) until interrupted, sending one datagram per code\n"
+          "      to the UNIX socket SOCKET: \"SEQUENCE ean13|qr X Y WIDTH\n"
+          "      HEIGHT [DIGITS]\".\n"
+          "  -P  Run every frame through a stage plugin (a shared object,\n"
+          "      see stage.h) until interrupted, ARGS going to its init.\n"
+          "      Up to %d, in order.\n"
+          "  -X  Run the capture rules in RULES on every frame until\n"
+          "      interrupted (see rule.h), saving the frames they select to\n"
+          "      numbered files after OUTPUT_FILE. The file is reread when\n"
+          "      it changes. Runs after any -P stages.\n"
+          "  -G  Run the capture graph declared in CONFIG (see graph.h)\n"
+          "      until its sources are done or it is interrupted. The\n"
+          "      other options are ignored.\n"
+          "  -A  Benchmark reading the driver buffers of the -f format:\n"
+          "      how each is mapped, and how fast it reads a byte at a\n"
+          "      time, with memcpy() and with the copy for its mapping.\n"
+          "  -U  Set up the media graph first, as media-ctl would: enable\n"
+          "      the links from the SENSOR entity (e.g. ov5647) to the video\n"
+          "      node and set the subdev formats to the %dx%d capture, or\n"
+          "      %dx%d with -B. Not with -M, whose switches change the\n"
+          "      sensor format. The setup is cached in $XDG_CACHE_HOME/%s\n"
+          "      (~/.cache/%s, or /run/%s without a home).\n",
+          prog, CAMERA_DEV_PATH, IMAGE_CAPTURE_SAVE_PATH,
+          TIMELAPSE_IDLE_THRESHOLD_MS, BURST_MAX_FRAMES, BURST_WIDTH,
+          BURST_HEIGHT, PREVIEW_WIDTH, PREVIEW_HEIGHT, BURST_WIDTH,
+          BURST_HEIGHT, BRACKET_MAX_STEPS, CAMERA_MEDIA_PATH, HDR_MAX_FRAMES,
+          STABILIZER_DEFAULT_MARGIN_PERCENT, STABILIZER_MAX_LOOKAHEAD,
+          STAGE_MAX_STAGES, CAPTURE_WIDTH, CAPTURE_HEIGHT, BURST_WIDTH,
+          BURST_HEIGHT, MEDIA_GRAPH_CACHE_DIR, MEDIA_GRAPH_CACHE_DIR,
+          MEDIA_GRAPH_CACHE_DIR);
+}
+
+/**
+ * @brief Parse command line options into the file static settings.
+ * @param argc Argument count.
+ * @param argv Argument vector.
+ * @return None.
+ */
+void parse_options(int argc, char *argv[]) {
+  int opt;
+
+  while ((opt = getopt(
+              argc, argv,
+              "d:o:f:t:T:n:B:N:M:E:m:H:R:S:C:W:D:K:V:L:Q:P:X:G:U:Ah")) != -1) {
+    switch (opt) {
+    case 'd':
+      device_path = optarg;
+      break;
+    case 'o':
+      output_path = optarg;
+      break;
+    case 'f':
+      if (strcmp(optarg, "mjpeg") == 0) {
+        pixel_format = V4L2_PIX_FMT_MJPEG;
+      } else if (strcmp(optarg, "yuyv") == 0) {
+        pixel_format = V4L2_PIX_FMT_YUYV;
+      } else if (strcmp(optarg, "grey") == 0) {
+        pixel_format = V4L2_PIX_FMT_GREY;
+      } else if (strcmp(optarg, "raw10") == 0) {
+        pixel_format = V4L2_PIX_FMT_SBGGR10;
+      } else if (strcmp(optarg, "raw10p") == 0) {
+        pixel_format = V4L2_PIX_FMT_SBGGR10P;
+      } else if (strcmp(optarg, "nv12m") == 0) {
+        pixel_format = V4L2_PIX_FMT_NV12M;
+      } else if (strcmp(optarg, "yuv420m") == 0) {
+        pixel_format = V4L2_PIX_FMT_YUV420M;
+      } else {
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 't':
+      if (tone_map_from_name(&tone_map, optarg) < 0) {
+        sprintf(message, "Error loading tone curve %.128s", optarg);
+        perror(message);
+        exit(1);
+      }
+      tone_map_enabled = 1;
+      break;
+    case 'T':
+      timelapse_interval_ms = (unsigned int)strtoul(optarg, NULL, 0);
+      if (timelapse_interval_ms == 0) {
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'n':
+      timelapse_shots = (unsigned int)strtoul(optarg, NULL, 0);
+      break;
+    case 'B':
+      burst_frames = (unsigned int)strtoul(optarg, NULL, 0);
+      if (burst_frames == 0 || burst_frames > BURST_MAX_FRAMES) {
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'N':
+      if (strcmp(optarg, "mean") == 0) {
+        stack_method = STACK_MEAN;
+      } else if (strcmp(optarg, "clip") == 0) {
+        stack_method = STACK_CLIPPED;
+      } else {
+        usage(argv[0]);
+        exit(1);
+      }
+      stack_enabled = 1;
+      break;
+    case 'M':
+      preview_stills = (unsigned int)strtoul(optarg, NULL, 0);
+      break;
+    case 'E': {
+      char *cursor = optarg;
+
+      for (bracket_steps = 0; *cursor != '\0'; bracket_steps++) {
+        if (bracket_steps == BRACKET_MAX_STEPS) {
+          usage(argv[0]);
+          exit(1);
+        }
+        bracket_values[bracket_steps] = (int)strtol(cursor, &cursor, 0);
+        if (*cursor == ',') {
+          cursor++;
+        }
+      }
+      break;
+    }
+    case 'm':
+      media_path = optarg;
+      break;
+    case 'H':
+      hdr_images = (unsigned int)strtoul(optarg, NULL, 0);
+      break;
+    case 'R':
+      record_enabled = 1;
+      record_seconds = (unsigned int)strtoul(optarg, NULL, 0);
+      break;
+    case 'S':
+      record_segment_bytes = (off_t)strtoul(optarg, NULL, 0) << 20;
+      break;
+    case 'C':
+      record_cap_bytes = (off_t)strtoul(optarg, NULL, 0) << 20;
+      break;
+    case 'W':
+      if (storage_mode_from_name(optarg, &record_write_mode) < 0) {
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'D':
+      record_dedup_threshold = (unsigned int)strtoul(optarg, NULL, 0);
+      break;
+    case 'K':
+      record_keepalive_seconds = (unsigned int)strtoul(optarg, NULL, 0);
+      break;
+    case 'V':
+      record_stabilize = 1;
+      record_stabilize_lookahead = (unsigned int)strtoul(optarg, NULL, 0);
+      if (record_stabilize_lookahead > STABILIZER_MAX_LOOKAHEAD) {
+        usage(argv[0]);
+        exit(1);
+      }
+      break;
+    case 'L':
+      live_view_path = optarg;
+      break;
+    case 'Q':
+      barcode_socket_path = optarg;
+      break;
+    case 'P':
+      if (stage_spec_count == STAGE_MAX_STAGES) {
+        usage(argv[0]);
+        exit(1);
+      }
+      stage_specs[stage_spec_count++] = optarg;
+      break;
+    case 'X':
+      rules_path = optarg;
+      break;
+    case 'G':
+      graph_path = optarg;
+      break;
+    case 'A':
+      mapping_bench_enabled = 1;
+      break;
+    case 'U':
+      media_sensor = optarg;
+      break;
+    default:
+      usage(argv[0]);
+      exit(opt == 'h' ? 0 : 1);
+    }
+  }
+  if (media_sensor != NULL && preview_stills > 0 && burst_frames == 0) {
+    fprintf(stderr, "%s: -U cannot be combined with -M\n", argv[0]);
     exit(1);
   }
 }
 
 /**
- * @brief Invoke close system call to close a file descriptor, in this case the
- * camera device.
+ * @brief SIGINT / SIGTERM handler, ends a time-lapse after the current shot
+ * or a recording after the current frame.
+ * @param signum Signal number.
+ * @return None.
+ */
+void handle_stop_signal(int signum) {
+  (void)signum;
+  timelapse_stop();
+  recorder_stop();
+  graph_stop();
+  preview_stop = 1;
+}
+
+/**
+ * @brief Route SIGINT / SIGTERM to handle_stop_signal(). No SA_RESTART, so
+ * blocking waits are interrupted right away.
  * @param None.
  * @return None.
- * @note Requires including <unistd.h>.
  */
-void close_camera_device() { close(camera_params.device_fs); }
+void install_stop_handlers() {
+  struct sigaction action;
+
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = handle_stop_signal;
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+}
 
 /**
- * @brief Set the video / image capture_format to be captured by the camera.
+ * @brief Take one picture.
  * @param None.
  * @return None.
- * @note ioctl systcall requires <sys/ioctl.h>.
- * The  ioctl()  system  call  manipulates the underlying device parameters of
- * special files.
  */
-void set_video_format() {
-  int status_code = EXIT_SUCCESS;
+void capture_single() {
+  activate_streaming(&camera_params);
+  get_frame(&camera_params);
+  deactivate_streaming(&camera_params);
 
-  /* Options from enum v4l2_buf_type, select video capture. */
-  camera_params.capture_format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  convert_frame(&camera_params);
+  save_to_image(&camera_params, output_path);
 
-  /* Configure v4l2_pix_format. */
-  camera_params.capture_format.fmt.pix.width = 1920;
-  camera_params.capture_format.fmt.pix.height = 1080;
-  camera_params.capture_format.fmt.pix.pixelformat = V4L2_PIX_FMT_MJPEG;
-  camera_params.capture_format.fmt.pix.colorspace = V4L2_COLORSPACE_REC709;
+  printf("Image capture successful, saved to %s\n", output_path);
+}
 
-  /* Latch video capture_format. */
-  status_code = ioctl(camera_params.device_fs, VIDIOC_S_FMT,
-                      &camera_params.capture_format);
+/**
+ * @brief Take a full-resolution burst, then write it out.
+ * @param None.
+ * @return None.
+ */
+void capture_burst() {
+  struct burst_config_t config = {
+      .frames = burst_frames,
+      .pixelformat = pixel_format,
+      .output_path = output_path,
+      .convert = convert_frame,
+  };
+  struct burst_stats_t stats;
 
-  /* Exit on invalid status. */
-  if (status_code < 0) {
-    perror("VIDIOC_S_FMT");
+  if (run_burst(&camera_params, &config, &stats) < 0) {
+    perror("Burst failed");
     exit(1);
   }
+
+  printf("Burst: %u frames at %ux%u, %lu dropped, spacing min %ld us avg "
+         "%ld us max %ld us, captured in %ld us, written in %ld us on %u "
+         "threads\n",
+         stats.frames, stats.width, stats.height, stats.dropped_frames,
+         stats.spacing_min_us, stats.spacing_avg_us, stats.spacing_max_us,
+         stats.capture_us, stats.write_us, stats.writers);
 }
 
 /**
- * @brief Request buffer from V4L2.
+ * @brief Take a full-resolution burst and stack it into one still, straight
+ * from the driver buffers.
  * @param None.
  * @return None.
- * @note Memory mapped buffers are located in device memory and must be
- * allocated with this ioctl before they can be mapped into the application’s
- * address space. User buffers are allocated by applications themselves, and
- * this ioctl is merely used to switch the driver into user pointer I/O mode.
- */
-void request_buffer() {
-  int status_code = EXIT_SUCCESS;
-
-  /* Options from enum enum v4l2_buf_type, select video_capture (take a photo).
-   */
-  camera_params.buffer_request.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  /* Options from enum v4l2_memory, select mmap. */
-  camera_params.buffer_request.memory = V4L2_MEMORY_MMAP;
-  /* Request one buffer. */
-  camera_params.buffer_request.count = 1;
-
-  /* Latch buffer request. */
-  status_code = ioctl(camera_params.device_fs, VIDIOC_REQBUFS,
-                      &camera_params.buffer_request);
+ */
+void capture_stack() {
+  struct burst_config_t config = {
+      .frames = burst_frames,
+      .pixelformat = pixel_format,
+  };
+  const void *frames[STACK_MAX_FRAMES];
+  const struct v4l2_pix_format *format = &camera_params.capture_format.fmt.pix;
+  struct burst_stats_t stats;
+  struct stacker_t stacker;
+  const void *stacked;
+  size_t size;
+  unsigned int n;
+  int fd;
 
-  if (status_code < 0) {
-    perror("VIDIOC_REQBUFS");
+  if (!stack_supports(pixel_format) || burst_frames > STACK_MAX_FRAMES) {
+    fprintf(stderr, "Stacking needs -f grey or yuyv and at most %d frames.\n",
+            STACK_MAX_FRAMES);
+    exit(1);
+  }
+  if (run_burst(&camera_params, &config, &stats) < 0) {
+    perror("Burst failed");
+    exit(1);
+  }
+  for (n = 0; n < burst_frames; n++) {
+    frames[n] = stats.data[n];
+  }
+
+  if (stacker_init(&stacker, 0) < 0 ||
+      stack_frames(&stacker, format, frames, burst_frames, stack_method, 0,
+                   &stacked) < 0) {
+    perror("Stacking failed");
+    exit(1);
+  }
+  size = (size_t)format->bytesperline * format->height;
+  if (tone_map_enabled) {
+    if (format->pixelformat == V4L2_PIX_FMT_YUYV) {
+      tone_map_apply_yuyv(&tone_map, stacker.output, size);
+    } else if (format->pixelformat == V4L2_PIX_FMT_GREY) {
+      tone_map_apply(&tone_map, stacker.output, size);
+    }
+  }
+  fd = open(output_path, O_WRONLY | O_CREAT | O_TRUNC, 0660);
+  if (fd < 0 || write_full(fd, stacked, size) < 0 || close(fd) < 0) {
+    perror(output_path);
     exit(1);
   }
+
+  printf("Stack: %u frames at %ux%u, %lu dropped, captured in %ld us, "
+         "stacked in %llu us on %u threads, %llu samples rejected, saved to "
+         "%s\n",
+         stats.frames, stats.width, stats.height, stats.dropped_frames,
+         stats.capture_us, stacker.stack_ns / 1000, stacker.threads,
+         stacker.rejected_samples, output_path);
+  stacker_destroy(&stacker);
 }
 
 /**
- * @brief Allocate buffer to store an image frame capture.
+ * @brief Take an exposure bracket at the default format.
  * @param None.
  * @return None.
  */
-void allocate_buffer() {
-  int status_code;
+void capture_bracket() {
+  struct bracket_config_t config = {
+      .control = V4L2_CID_EXPOSURE,
+      .steps = bracket_steps,
+      .media_path = media_path,
+      .output_path = output_path,
+  };
+  struct bracket_stats_t stats;
+  unsigned int step;
 
-  memset(&camera_params.buffer, 0, sizeof(camera_params.buffer));
+  memcpy(config.values, bracket_values, sizeof(bracket_values));
+  if (run_bracket(&camera_params, &config, &stats) < 0) {
+    perror("Bracket failed");
+    exit(1);
+  }
 
-  camera_params.buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  camera_params.buffer.memory = V4L2_MEMORY_MMAP;
-  camera_params.buffer.index = 0;
+  printf("Bracket: %u frames by %s in %ld us, %lu discarded, sequences",
+         bracket_steps,
+         stats.method == BRACKET_REQUEST_API ? "request" : "sequence number",
+         stats.capture_us, stats.discarded_frames);
+  for (step = 0; step < bracket_steps; step++) {
+    printf(" %u", stats.sequences[step]);
+  }
+  printf("\n");
+}
 
-  /* Used to query the status of a buffer. */
-  /* Applications set the type field of a struct v4l2_buffer to the same buffer
-   * type as was previously used with struct v4l2_format type and struct
-   * v4l2_requestbuffers type, and the index field. */
-  status_code =
-      ioctl(camera_params.device_fs, VIDIOC_QUERYBUF, &camera_params.buffer);
+/**
+ * @brief Bracket consumer for HDR: keep a copy of the frame of a step.
+ * @param params Capture state holding the frame.
+ * @param step Step of the bracket.
+ * @return None.
+ */
+void keep_hdr_frame(struct camera_params_t *params, unsigned int step) {
+  size_t size = params->capture_format.fmt.pix.sizeimage;
+  size_t bytes = params->buffer.bytesused < size ? params->buffer.bytesused
+                                                 : size;
 
-  /* Exit on invalid status. */
-  if (status_code < 0) {
-    perror("Failure on VIDIOC_QUERYBUF, exiting...\n");
+  if (hdr_frames[step] == NULL) {
+    hdr_frames[step] = calloc(1, size);
+    if (hdr_frames[step] == NULL) {
+      perror("calloc");
+      exit(1);
+    }
+  }
+  memcpy(hdr_frames[step], params->buffer_start, bytes);
+}
+
+/**
+ * @brief Take brackets and merge each into an HDR image, reporting how the
+ * merge time compares with the capture time of a bracket.
+ * @param None.
+ * @return None.
+ */
+void capture_hdr() {
+  struct bracket_config_t config = {
+      .control = V4L2_CID_EXPOSURE,
+      .steps = bracket_steps,
+      .media_path = media_path,
+      .consume = keep_hdr_frame,
+  };
+  const struct v4l2_pix_format *format = &camera_params.capture_format.fmt.pix;
+  struct hdr_merger_t merger;
+  struct bracket_stats_t stats;
+  long capture_us = 0;
+  unsigned int n;
+  unsigned int i;
+
+  if (!hdr_supports(pixel_format) || bracket_steps < 2 ||
+      bracket_steps > HDR_MAX_FRAMES) {
+    fprintf(stderr, "HDR needs -f grey or yuyv and 2 to %d exposures.\n",
+            HDR_MAX_FRAMES);
+    exit(1);
+  }
+  memcpy(config.values, bracket_values, sizeof(bracket_values));
+  if (hdr_merger_init(&merger, 0) < 0) {
+    perror("HDR merger");
     exit(1);
   }
 
-  /* Maps the /dev/videox camera device file content to a virtual memory
-   * address, with start address buffer_start. */
-  camera_params.buffer_start =
-      mmap(NULL, camera_params.buffer.length, PROT_READ | PROT_WRITE,
-           MAP_SHARED, camera_params.device_fs, camera_params.buffer.m.offset);
+  for (n = 0; n < hdr_images; n++) {
+    const void *merged;
+    char path[4096];
+    int fd;
+
+    if (run_bracket(&camera_params, &config, &stats) < 0) {
+      perror("Bracket failed");
+      exit(1);
+    }
+    capture_us += stats.capture_us;
+    if (hdr_merge(&merger, format, (const void *const *)hdr_frames,
+                  bracket_steps, bracket_steps / 2,
+                  tone_map_enabled ? &tone_map : NULL, &merged) < 0) {
+      perror("HDR merge failed");
+      exit(1);
+    }
+
+    numbered_path(path, sizeof(path), output_path, n);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0660);
+    if (fd < 0 ||
+        write_full(fd, merged, (size_t)format->bytesperline * format->height) <
+            0 ||
+        close(fd) < 0) {
+      snprintf(message, sizeof(message), "Error writing %.128s", path);
+      perror(message);
+      exit(1);
+    }
+  }
 
-  /* Exit on invalid status. */
-  if (camera_params.buffer_start == MAP_FAILED) {
-    perror("Failure on mmap, exiting...\n");
+  printf("HDR: %u images from %u exposures on %u threads, bracket %ld us, "
+         "align %llu us, fuse %llu us, last shifts",
+         hdr_images, bracket_steps, merger.threads, capture_us / hdr_images,
+         merger.align_ns / 1000 / hdr_images,
+         merger.fuse_ns / 1000 / hdr_images);
+  for (i = 0; i < bracket_steps; i++) {
+    printf(" %+d,%+d", merger.shifts[i][0], merger.shifts[i][1]);
+  }
+  printf("\n");
+
+  hdr_merger_destroy(&merger);
+  for (i = 0; i < bracket_steps; i++) {
+    free(hdr_frames[i]);
+    hdr_frames[i] = NULL;
+  }
+}
+
+/**
+ * @brief Stream preview and take stills from it without reopening the
+ * device, reporting the preview -> still -> preview latency of each.
+ * @param None.
+ * @return None.
+ */
+void capture_preview_stills() {
+  const struct camera_mode_t preview = {PREVIEW_WIDTH, PREVIEW_HEIGHT,
+                                        pixel_format, CAMERA_DEFAULT_BUFFERS};
+  const struct camera_mode_t still = {BURST_WIDTH, BURST_HEIGHT, pixel_format,
+                                      2};
+  struct mode_switcher_t switcher;
+  struct mode_switch_timing_t timing;
+  const struct mode_pool_t *pool;
+  struct timespec start;
+  struct timespec now;
+  char path[DEFAULT_TEXT_LENGTH];
+  unsigned int shot;
+  int fd;
+
+  if (mode_switcher_init(&switcher, &camera_params, &preview, &still) < 0) {
+    perror("Mode switch setup");
     exit(1);
   }
+  install_stop_handlers();
+  mode_switch(&switcher, CAMERA_MODE_PREVIEW, NULL);
 
-  /* Make buffer clean state to be ready for an arriving frame. */
-  memset(camera_params.buffer_start, 0, camera_params.buffer.length);
+  for (shot = 0; shot < preview_stills && !preview_stop; shot++) {
+    /* Preview until the next still is due. */
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    do {
+      release_frame(&camera_params);
+      get_frame(&camera_params);
+      clock_gettime(CLOCK_MONOTONIC, &now);
+    } while (!preview_stop &&
+             (now.tv_sec - start.tv_sec) * 1000 +
+                     (now.tv_nsec - start.tv_nsec) / 1000000 <
+                 PREVIEW_STILL_INTERVAL_MS);
+
+    pool = mode_switcher_take_still(&switcher, &timing);
+    numbered_path(path, sizeof(path), output_path, shot);
+    fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0660);
+    if (fd < 0 || write_full(fd, pool->data, pool->bytes) < 0 ||
+        close(fd) < 0) {
+      perror(path);
+      exit(1);
+    }
+    printf("Still %u: %s, preview -> still -> preview %ld us (stop %ld, "
+           "configure %ld, start %ld, first frame %ld)\n",
+           shot, path, timing.total_us, timing.stop_us, timing.configure_us,
+           timing.start_us, timing.first_frame_us);
+  }
+
+  printf("Mode switches: %lu, slowest %ld us\n", switcher.switches,
+         switcher.worst.total_us);
+  mode_switcher_destroy(&switcher);
 }
 
 /**
- * @brief Activate streaming on the camera.
+ * @brief Take pictures at a fixed interval until the shot count is reached
+ * or the process is interrupted.
  * @param None.
  * @return None.
  */
-void activate_streaming() {
-  int status_code;
+void capture_timelapse() {
+  struct timelapse_config_t config = {
+      .interval_ms = timelapse_interval_ms,
+      .shots = timelapse_shots,
+      .output_path = output_path,
+      .convert = convert_frame,
+  };
+  struct timelapse_stats_t stats;
+
+  install_stop_handlers();
 
-  /* Clean state. */
-  memset(&camera_params.buffer, 0, sizeof(camera_params.buffer));
+  if (run_timelapse(&camera_params, &config, &stats) < 0) {
+    exit(1);
+  }
 
-  camera_params.buffer.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-  camera_params.buffer.memory = V4L2_MEMORY_MMAP;
-  /* Queueing buffer index 0. */
-  camera_params.buffer.index = 0;
+  printf("Time-lapse: %lu shots, %lu stream restarts, wake latency mean %ld "
+         "us max %ld us, frame offset max %ld us, stream start max %ld us\n",
+         stats.shots, stats.stream_restarts, stats.mean_wake_latency_us,
+         stats.max_wake_latency_us, stats.max_frame_offset_us,
+         stats.max_start_latency_us);
+}
 
-  /* Latch streaming on. */
-  status_code = ioctl(camera_params.device_fs, VIDIOC_STREAMON,
-                      &camera_params.buffer.type);
+/**
+ * @brief Scan every frame for barcodes and send what is found, until
+ * interrupted.
+ * @param None.
+ * @return None.
+ */
+void scan_barcodes() {
+  struct barcode_detector_t detector;
+  struct barcode_sink_t sink;
+  const struct barcode_result_t *results;
+  int count;
 
-  if (status_code < 0) {
-    perror("VIDIOC_STREAMON");
+  if (barcode_detector_init(&detector,
+                            &camera_params.capture_format.fmt.pix) < 0) {
+    perror("Barcode scanning needs -f grey or yuyv");
     exit(1);
   }
+  if (barcode_sink_open(&sink, barcode_socket_path) < 0) {
+    perror(barcode_socket_path);
+    exit(1);
+  }
+  install_stop_handlers();
+
+  activate_streaming(&camera_params);
+  while (!preview_stop) {
+    get_frame(&camera_params);
+    count = barcode_detect(&detector, camera_params.buffer_start,
+                           camera_params.buffer.bytesused, &results);
+    if (count > 0) {
+      barcode_sink_send(&sink, camera_params.buffer.sequence, results,
+                        (unsigned int)count);
+    }
+    release_frame(&camera_params);
+  }
+  deactivate_streaming(&camera_params);
+
+  printf("Barcodes: %lu frames, detect avg %lld us max %lld us, %lu regions, "
+         "%lu EAN-13 decoded, %lu QR located, %lu sent, %lu dropped\n",
+         detector.frames, detector.detect_ns_avg / 1000,
+         detector.detect_ns_max / 1000, detector.regions, detector.decoded,
+         detector.located, sink.sent, sink.dropped);
+  barcode_sink_close(&sink);
+  barcode_detector_destroy(&detector);
 }
 
 /**
- * @brief Get a single frame and store to buffer.
+ * @brief Load the stage plugins, and the capture rules after them, and run
+ * every frame through them until interrupted, then report what each one
+ * cost.
  * @param None.
  * @return None.
  */
-void get_frame() {
-  int status_code;
+void run_stages() {
+  struct stage_pipeline_t pipeline;
+  struct stage_view_t view;
+  struct stage_metadata_t metadata;
+  char rules_args[sizeof(pipeline.stages[0].args)];
+  unsigned int plane;
+  unsigned int i;
 
-  /* Queue buffer: submitting the empty buffer in the driver's incoming queue,
-   * to fill CMOS captured pixels. */
-  status_code =
-      ioctl(camera_params.device_fs, VIDIOC_QBUF, &camera_params.buffer);
+  stage_pipeline_init(&pipeline);
+  for (i = 0; i < stage_spec_count; i++) {
+    char *args = strchr(stage_specs[i], ':');
 
-  if (status_code < 0) {
-    perror("VIDIOC_QBUF");
+    if (args != NULL) {
+      *args++ = '\0';
+    }
+    if (stage_pipeline_load(&pipeline, stage_specs[i], args) < 0) {
+      fprintf(stderr, "%s: %s\n", stage_specs[i], pipeline.error);
+      exit(1);
+    }
+  }
+  if (rules_path != NULL) {
+    snprintf(rules_args, sizeof(rules_args), "%s:%s", rules_path,
+             output_path);
+    if (stage_pipeline_add(&pipeline, &rule_stage, rules_args) < 0) {
+      fprintf(stderr, "%s: %s\n", rules_path, pipeline.error);
+      exit(1);
+    }
+  }
+  if (stage_pipeline_start(&pipeline, &camera_params.capture_format) < 0) {
+    fprintf(stderr, "Stage plugins: %s\n", pipeline.error);
     exit(1);
   }
+  install_stop_handlers();
 
-  /* Dequeue buffer: retrieving the filled data with beautiful pixels. */
-  status_code =
-      ioctl(camera_params.device_fs, VIDIOC_DQBUF, &camera_params.buffer);
+  activate_streaming(&camera_params);
+  while (!preview_stop) {
+    get_frame(&camera_params);
+    /* Straight from the mapped buffer, requeued once every stage is done. */
+    view.data = camera_params.buffer_start;
+    view.bytes = camera_params.buffer.bytesused;
+    view.format = &camera_params.capture_format;
+    view.plane_count = camera_params.plane_count;
+    for (plane = 0; plane < view.plane_count; plane++) {
+      view.planes[plane].data = plane_payload(&camera_params, plane);
+      view.planes[plane].bytes = camera_params.buffer_planes[plane].bytesused;
+      view.planes[plane].bytesperline =
+          plane_bytesperline(&camera_params, plane);
+    }
+    metadata.sequence = camera_params.buffer.sequence;
+    metadata.index = camera_params.buffer.index;
+    metadata.flags = camera_params.buffer.flags;
+    metadata.timestamp_us =
+        (uint64_t)camera_params.buffer.timestamp.tv_sec * 1000000 +
+        (uint64_t)camera_params.buffer.timestamp.tv_usec;
+    stage_pipeline_run(&pipeline, &view, &metadata);
+    release_frame(&camera_params);
+  }
+  deactivate_streaming(&camera_params);
 
-  if (status_code < 0) {
-    perror("VIDIOC_QBUF");
-    exit(1);
+  printf("Stages: %lu frames, interval avg %lld us, pipeline avg %lld us "
+         "max %lld us\n",
+         pipeline.frames, pipeline.interval_us_avg, pipeline.run_ns_avg / 1000,
+         pipeline.run_ns_max / 1000);
+  for (i = 0; i < pipeline.count; i++) {
+    const struct stage_t *stage = &pipeline.stages[i];
+
+    printf("  %s: %lu frames, %lu skipped, %lu errors, every %u, avg %lld us "
+           "max %lld us, total %llu ms\n",
+           stage->descriptor->name, stage->frames, stage->skipped,
+           stage->errors, stage->stride, stage->process_ns_avg / 1000,
+           stage->process_ns_max / 1000, stage->process_ns_total / 1000000);
+    if (stage->descriptor == &rule_stage && stage->state != NULL) {
+      struct rule_stage_t *rules = stage->state;
+
+      rule_stage_drain(rules);
+      printf("    rules: %lu runs, %lu over budget, %lu errors, up to %u "
+             "instructions, avg %lld ns max %lld ns; %lu saved (%lu failed), "
+             "%lu reloads (%lu failed), %lu cache hits\n",
+             rules->engine.runs, rules->engine.overruns, rules->engine.errors,
+             rules->engine.instructions_max, rules->engine.run_ns_avg,
+             rules->engine.run_ns_max, rules->saved, rules->save_errors,
+             rules->reloads, rules->reload_errors, rules->cache.hits);
+    }
+  }
+  stage_pipeline_destroy(&pipeline);
+}
+
+/**
+ * @brief Live view thread: save the latest frame of the recording to
+ * live_view_path every LIVE_VIEW_PERIOD_S, without entering the capture
+ * loop.
+ * @param arg The snapshot cache.
+ * @return NULL.
+ */
+void *live_view_main(void *arg) {
+  struct snapshot_cache_t *cache = arg;
+  struct timespec deadline;
+
+  clock_gettime(CLOCK_REALTIME, &deadline);
+  pthread_mutex_lock(&live_view_lock);
+  while (!live_view_done) {
+    deadline.tv_sec += LIVE_VIEW_PERIOD_S;
+    pthread_cond_timedwait(&live_view_wake, &live_view_lock, &deadline);
+    if (live_view_done) {
+      break;
+    }
+
+    pthread_mutex_unlock(&live_view_lock);
+    if (snapshot_save(cache, live_view_path) < 0 && errno != EAGAIN) {
+      perror("Live view");
+    }
+    pthread_mutex_lock(&live_view_lock);
   }
+  pthread_mutex_unlock(&live_view_lock);
+
+  return NULL;
 }
 
 /**
- * @brief Deactivate streaming on the camera.
+ * @brief Record continuously into rotating segments.
  * @param None.
  * @return None.
  */
-void deactivate_streaming() {
+void capture_recording() {
+  struct recorder_config_t config = {
+      .duration_ms = record_seconds * 1000,
+      .segment_bytes = record_segment_bytes,
+      .max_total_bytes = record_cap_bytes,
+      .write_mode = record_write_mode,
+      .output_path = output_path,
+      .convert = convert_frame,
+      .dedup_threshold = record_dedup_threshold,
+      .keepalive_ms = record_keepalive_seconds * 1000,
+  };
+  struct recorder_stats_t stats;
+  struct raw_archive_t archive;
+  struct snapshot_cache_t snapshot;
+  struct stabilizer_t stabilizer;
+  pthread_t live_view_thread;
   int status_code;
 
-  /* Latch streaming off. */
-  status_code = ioctl(camera_params.device_fs, VIDIOC_STREAMOFF,
-                      &camera_params.buffer.type);
+  if (raw_archive_supports(pixel_format)) {
+    if (raw_archive_init(&archive, 0) < 0) {
+      perror("raw_archive_init");
+      exit(1);
+    }
+    config.archive = &archive;
+  }
+
+  if (record_stabilize) {
+    if (stabilizer_init(&stabilizer, &camera_params.capture_format.fmt.pix,
+                        record_stabilize_lookahead, 0) < 0) {
+      perror("Stabilizer setup (-f grey or yuyv)");
+      exit(1);
+    }
+    config.stabilizer = &stabilizer;
+  }
+
+  if (live_view_path != NULL) {
+    snapshot_cache_init(&snapshot, &camera_params);
+    config.snapshot = &snapshot;
+    if (pthread_create(&live_view_thread, NULL, live_view_main, &snapshot) !=
+        0) {
+      perror("pthread_create");
+      exit(1);
+    }
+  }
+
+  install_stop_handlers();
+
+  status_code = run_recorder(&camera_params, &config, &stats);
+
+  if (config.snapshot != NULL) {
+    pthread_mutex_lock(&live_view_lock);
+    live_view_done = 1;
+    pthread_cond_signal(&live_view_wake);
+    pthread_mutex_unlock(&live_view_lock);
+    pthread_join(live_view_thread, NULL);
+    printf("Live view: %lu frames published, %lu requeues deferred\n",
+           snapshot.published, snapshot.deferred_requeues);
+  }
+
+  if (config.archive != NULL) {
+    printf("Raw archive: %lu frames on %u threads, %llu of %llu bytes "
+           "(%.1f%%), encode avg %llu us\n",
+           archive.frames, archive.threads, archive.encoded_bytes,
+           archive.raw_bytes,
+           archive.raw_bytes ? 100.0 * archive.encoded_bytes / archive.raw_bytes
+                             : 0.0,
+           archive.frames ? archive.encode_ns / archive.frames / 1000 : 0);
+    raw_archive_destroy(&archive);
+  }
+
+  if (config.stabilizer != NULL) {
+    printf("Stabilizer: %lu frames cropped to %ux%u, look-ahead %u frames, "
+           "latency avg %lld us max %lld us, estimate avg %lld us, crop avg "
+           "%lld us, correction max %u px, %lu clamped\n",
+           stabilizer.popped, stabilizer.output_format.width,
+           stabilizer.output_format.height, stabilizer.lookahead,
+           stabilizer.latency_ns_avg / 1000, stabilizer.latency_ns_max / 1000,
+           stabilizer.estimate_ns_avg / 1000, stabilizer.crop_ns_avg / 1000,
+           stabilizer.correction_max, stabilizer.clamped);
+    stabilizer_destroy(&stabilizer);
+  }
+
+  printf("Recording: %lu captured, %lu written, %lu throttled, %lu dropped, "
+         "queue max %u, throttle max %u, quality min %d, write avg %llu us "
+         "max %llu us, %lu segments deleted, %llu bytes on disk\n",
+         stats.frames_captured, stats.frames_written, stats.frames_throttled,
+         stats.frames_dropped, stats.max_queue_depth, stats.max_throttle_level,
+         stats.min_quality, stats.write_us_avg, stats.write_us_max,
+         stats.deleted_segments, stats.bytes_on_disk);
+  if (config.dedup_threshold > 0) {
+    printf("Deduplication: %lu static frames skipped, signature avg %llu us\n",
+           stats.frames_deduplicated, stats.signature_us_avg);
+  }
 
-  /* Exit on error status. */
   if (status_code < 0) {
-    perror("VIDIOC_STREAMOFF");
+    perror("Recording stopped, storage failed");
     exit(1);
   }
 }
 
 /**
- * @brief Save a captured frame in buffer to as a jpeg image file.
+ * @brief Run the capture graph of the configuration file until its sources
+ * are done or interrupted, then report what each node did.
  * @param None.
  * @return None.
- * @note open syscall requires <sys/types.h> <sys/stat.h> <fcntl.h>.
  */
-void save_to_image() {
-  int image_fd;
-
-  /* Create this file if not exist, write only. */
-  image_fd = open(IMAGE_CAPTURE_SAVE_PATH, O_WRONLY | O_CREAT, 0660);
+void run_graph() {
+  struct graph_t graph;
+  unsigned int i;
 
-  /* Exit on invalid descriptor. */
-  if (image_fd < 0) {
-    perror("open");
+  graph_init(&graph);
+  if (graph_load(&graph, graph_path) < 0 || graph_start(&graph) < 0) {
+    fprintf(stderr, "%s: %s\n", graph_path, graph.error);
     exit(1);
   }
+  install_stop_handlers();
+  graph_wait(&graph);
 
-  /* Convert the buffer to image. */
-  write(image_fd, camera_params.buffer_start, camera_params.buffer.length);
+  printf("Graph: %u nodes on %u threads\n", graph.node_count,
+         graph.thread_count);
+  for (i = 0; i < graph.node_count; i++) {
+    const struct graph_node_t *node = &graph.nodes[i];
 
-  /* Close the file descriptor. */
-  close(image_fd);
+    printf("  %s (%s): %lu frames, %lu dropped, %lu starved, %lu errors, "
+           "queue max %u of %u, avg %lld us max %lld us\n",
+           node->name, graph_type_name(node->type), node->frames,
+           node->dropped, node->starved, node->errors, node->queue_max,
+           node->queue_size, node->process_ns_avg / 1000,
+           node->process_ns_max / 1000);
+    if (node->share != NULL) {
+      printf("    buffers: %lu requeued, %lu detached, %lu stalls, held max "
+             "%lld us, %lu held too long\n",
+             atomic_load(&node->share->requeues), node->detached,
+             atomic_load(&node->share->stalls),
+             atomic_load(&node->share->held_ns_max) / 1000,
+             atomic_load(&node->share->overdue));
+      printf("    read through %s %s mappings\n",
+             mapping_kind_name(node->share->mapping.kind),
+             node->dmabuf ? "dma-buf" : "driver");
+    }
+    if (node->source != NULL && node->source->share != NULL &&
+        atomic_load(&node->source->share->overdue_by[node->consumer]) > 0) {
+      printf("    held buffers too long %lu times\n",
+             atomic_load(&node->source->share->overdue_by[node->consumer]));
+    }
+  }
+  graph_destroy(&graph);
 }
 
 /**
- * @brief Main routine.
+ * @brief Set up the media graph path from the sensor to the video node for
+ * the capture format, then report what it took.
+ * @param width Capture width in pixels.
+ * @param height Capture height in pixels.
+ * @return None, exits on failure.
+ */
+void setup_media_graph(unsigned int width, unsigned int height) {
+  struct media_graph_request_t request = {
+      .media_path = media_path,
+      .sensor = media_sensor,
+      .width = width,
+      .height = height,
+      .code = media_graph_bus_code(pixel_format),
+  };
+  struct media_graph_route_t route;
+  struct timespec start;
+  struct timespec end;
+  char cache_path[512];
+
+  if (media_graph_cache_path(cache_path, sizeof(cache_path)) == 0) {
+    request.cache_path = cache_path;
+  }
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (media_graph_setup(&request, &route) < 0) {
+    snprintf(message, sizeof(message), "Media graph of %s for %s",
+             media_path, media_sensor);
+    perror(message);
+    exit(1);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+
+  printf("Media graph: %s, %u links, %u enabled, %u pads set, %ux%u code "
+         "0x%04x at the video node, in %ld us\n",
+         route.cached ? "cached" : "walked", route.link_count,
+         route.links_enabled, route.pads_set, route.format.width,
+         route.format.height, route.format.code,
+         (end.tv_sec - start.tv_sec) * 1000000 +
+             (end.tv_nsec - start.tv_nsec) / 1000);
+}
+
+/**
+ * @brief Report how each driver buffer is mapped and how fast it reads,
+ * after one frame was captured into it so the driver touched them all.
  * @param None.
  * @return None.
  */
-int main(void) {
+void benchmark_mappings() {
+  struct mapping_info_t info;
+  struct mapping_bench_t bench;
+  unsigned int i;
+
+  activate_streaming(&camera_params);
+  for (i = 0; i < camera_params.buffer_request.count; i++) {
+    get_frame(&camera_params);
+    release_frame(&camera_params);
+  }
+  deactivate_streaming(&camera_params);
+
+  for (i = 0; i < camera_params.buffer_request.count; i++) {
+    const struct camera_buffer_t *buffer = &camera_params.buffers[i];
+
+    if (mapping_probe(buffer->start, buffer->length, &info) < 0 ||
+        mapping_benchmark(buffer->start, buffer->length, info.kind, &bench) <
+            0) {
+      perror("Error benchmarking buffers");
+      exit(1);
+    }
+    printf("Buffer %u: %zu bytes, %s%s%s (probe %.0f MB/s, anonymous "
+           "memory %.0f MB/s)\n",
+           i, buffer->length, mapping_kind_name(info.kind),
+           info.pfn ? ", page frames" : "", info.io ? ", I/O" : "",
+           info.read_mbps, info.reference_mbps);
+    printf("  byte-wise %.0f MB/s, memcpy %.0f MB/s, %s copy %.0f MB/s\n",
+           bench.bytewise, bench.libc, mapping_kind_name(info.kind),
+           bench.copy);
+  }
+}
+
+/**
+ * @brief Main routine.
+ * @param argc Argument count.
+ * @param argv Argument vector.
+ * @return Exit status.
+ */
+int main(int argc, char *argv[]) {
 
-  open_camera_device();
+  parse_options(argc, argv);
 
-  set_video_format();
-  request_buffer();
-  allocate_buffer();
+  if (graph_path != NULL) {
+    /* The graph opens its own devices. */
+    run_graph();
+    return EXIT_SUCCESS;
+  }
 
-  activate_streaming();
-  get_frame();
-  deactivate_streaming();
+  open_camera_device(&camera_params, device_path);
 
-  save_to_image();
-  close_camera_device();
+  if (media_sensor != NULL) {
+    if (burst_frames > 0) {
+      setup_media_graph(BURST_WIDTH, BURST_HEIGHT);
+    } else {
+      setup_media_graph(CAPTURE_WIDTH, CAPTURE_HEIGHT);
+    }
+  }
+
+  if (burst_frames > 0 || preview_stills > 0) {
+    /* These negotiate their own formats and buffers. */
+    if (burst_frames > 0 && stack_enabled) {
+      capture_stack();
+    } else if (burst_frames > 0) {
+      capture_burst();
+    } else {
+      capture_preview_stills();
+    }
+    free_buffers(&camera_params);
+    close_camera_device(&camera_params);
+    return EXIT_SUCCESS;
+  }
+
+  set_video_format(&camera_params, CAPTURE_WIDTH, CAPTURE_HEIGHT,
+                   pixel_format);
+  if (bracket_steps > 0) {
+    if (hdr_images > 0) {
+      capture_hdr();
+    } else {
+      capture_bracket();
+    }
+    close_camera_device(&camera_params);
+    return EXIT_SUCCESS;
+  }
+  request_buffer(&camera_params, CAMERA_DEFAULT_BUFFERS);
+  allocate_buffer(&camera_params);
+
+  if (mapping_bench_enabled) {
+    benchmark_mappings();
+  } else if (record_enabled) {
+    capture_recording();
+  } else if (barcode_socket_path != NULL) {
+    scan_barcodes();
+  } else if (stage_spec_count > 0 || rules_path != NULL) {
+    run_stages();
+  } else if (timelapse_interval_ms > 0) {
+    capture_timelapse();
+  } else {
+    capture_single();
+  }
 
-  printf("Image capture successful, saved to %s\n", IMAGE_CAPTURE_SAVE_PATH);
+  free_buffers(&camera_params);
+  close_camera_device(&camera_params);
 
   return EXIT_SUCCESS;
 }
@@ -0,0 +1,233 @@
+/**
+ * @file mapping.c
+ * @brief Reading mapped driver buffers.
+ * @note Whether a mapping is cached is not something the kernel tells
+ * user space: smaps only shows that a driver mapped page frames, which
+ * cached DMA memory on a coherent SoC is too. Timing a read is what
+ * settles it, against anonymous memory read the same way on the same CPU
+ * so the ratio holds from a Raspberry Pi to a desktop.
+ */
+
+#include "mapping.h"
+
+#include <errno.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+/**
+ * @brief Time each way of reading is given in mapping_benchmark().
+ */
+#define MAPPING_BENCH_NS 100000000LL
+
+/**
+ * @brief Current CLOCK_MONOTONIC time in nanoseconds.
+ */
+static long long monotonic_ns(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * @brief Where reads go so they are not optimized away.
+ */
+static volatile uint64_t read_sink;
+
+/**
+ * @brief Read 64-bit words, the widest plain C loads.
+ */
+static void read_words(const void *start, size_t bytes) {
+  const uint64_t *words = start;
+  uint64_t sum = 0;
+  size_t i;
+
+  for (i = 0; i < bytes / sizeof(*words); i++) {
+    sum += words[i];
+  }
+  read_sink = sum;
+}
+
+/**
+ * @brief Best throughput of three probe reads, MB/s.
+ */
+static double probe_mbps(const void *start, size_t bytes) {
+  long long best = 0;
+  int pass;
+
+  for (pass = 0; pass < 3; pass++) {
+    long long begin = monotonic_ns();
+    long long elapsed;
+
+    read_words(start, bytes);
+    elapsed = monotonic_ns() - begin;
+    if (best == 0 || elapsed < best) {
+      best = elapsed;
+    }
+  }
+  return (double)bytes * 1000.0 / (double)(best > 0 ? best : 1);
+}
+
+/**
+ * @brief Look the mapping holding an address up in /proc/self/smaps.
+ */
+static void read_vm_flags(const void *start, struct mapping_info_t *info) {
+  uintptr_t address = (uintptr_t)start;
+  int inside = 0;
+  char line[256];
+  FILE *smaps;
+
+  smaps = fopen("/proc/self/smaps", "r");
+  if (smaps == NULL) {
+    return;
+  }
+  while (fgets(line, sizeof(line), smaps) != NULL) {
+    unsigned long low;
+    unsigned long high;
+
+    if (sscanf(line, "%lx-%lx ", &low, &high) == 2) {
+      inside = address >= low && address < high;
+    } else if (inside && strncmp(line, "VmFlags:", 8) == 0) {
+      info->pfn = strstr(line, " pf") != NULL;
+      info->io = strstr(line, " io") != NULL;
+      break;
+    }
+  }
+  fclose(smaps);
+}
+
+int mapping_probe(const void *start, size_t length,
+                  struct mapping_info_t *info) {
+  size_t bytes = length < MAPPING_PROBE_BYTES ? length : MAPPING_PROBE_BYTES;
+  void *reference;
+
+  memset(info, 0, sizeof(*info));
+  reference = malloc(bytes);
+  if (reference == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+  /* Written, so it reads from real pages and not the zero page. */
+  memset(reference, 0x5a, bytes);
+  info->reference_mbps = probe_mbps(reference, bytes);
+  info->read_mbps = probe_mbps(start, bytes);
+  free(reference);
+
+  info->kind = info->read_mbps * MAPPING_UNCACHED_RATIO < info->reference_mbps
+                   ? MAPPING_UNCACHED
+                   : MAPPING_CACHED;
+  read_vm_flags(start, info);
+  return 0;
+}
+
+/**
+ * @brief Copy from uncached memory: every load is a bus transaction, so
+ * they are as wide as they get and aligned to the source. Prefetching
+ * does nothing there. The stores stay ordinary, the copy is read next.
+ */
+static void copy_uncached(uint8_t *out, const uint8_t *in, size_t bytes) {
+  size_t i = 0;
+
+#if defined(__ARM_NEON)
+  i = (size_t)(-(uintptr_t)in & 15);
+  i = i < bytes ? i : bytes;
+  memcpy(out, in, i);
+  for (; i + 64 <= bytes; i += 64) {
+    uint8x16_t a = vld1q_u8(in + i);
+    uint8x16_t b = vld1q_u8(in + i + 16);
+    uint8x16_t c = vld1q_u8(in + i + 32);
+    uint8x16_t d = vld1q_u8(in + i + 48);
+
+    vst1q_u8(out + i, a);
+    vst1q_u8(out + i + 16, b);
+    vst1q_u8(out + i + 32, c);
+    vst1q_u8(out + i + 48, d);
+  }
+#elif defined(__AVX2__)
+  i = (size_t)(-(uintptr_t)in & 31);
+  i = i < bytes ? i : bytes;
+  memcpy(out, in, i);
+  for (; i + 64 <= bytes; i += 64) {
+    /* MOVNTDQA, the load write-combined memory is read fastest with. */
+    __m256i a = _mm256_stream_load_si256((__m256i *)(void *)(in + i));
+    __m256i b = _mm256_stream_load_si256((__m256i *)(void *)(in + i + 32));
+
+    _mm256_storeu_si256((__m256i *)(void *)(out + i), a);
+    _mm256_storeu_si256((__m256i *)(void *)(out + i + 32), b);
+  }
+#endif
+  memcpy(out + i, in + i, bytes - i);
+}
+
+void mapping_copy(void *dst, const void *src, size_t bytes,
+                  enum mapping_kind_t kind) {
+  /* A cached source reads at memory speed whatever the code does, and
+   * libc's memcpy() outruns streaming stores there: 11 GB/s against 7 to
+   * 8.6 GB/s for a 1080p YUYV frame with AVX2. */
+  if (kind == MAPPING_UNCACHED) {
+    copy_uncached(dst, src, bytes);
+  } else {
+    memcpy(dst, src, bytes);
+  }
+}
+
+/**
+ * @brief Throughput of one way of reading, run for MAPPING_BENCH_NS.
+ * @param way 0 byte-wise, 1 memcpy(), 2 mapping_copy().
+ */
+static double bench_mbps(const uint8_t *start, size_t length, uint8_t *copy,
+                         enum mapping_kind_t kind, int way) {
+  long long begin = monotonic_ns();
+  long long elapsed;
+  unsigned long passes = 0;
+
+  do {
+    if (way == 0) {
+      const volatile uint8_t *bytes = start;
+      uint64_t sum = 0;
+      size_t i;
+
+      for (i = 0; i < length; i++) {
+        sum += bytes[i];
+      }
+      read_sink = sum;
+    } else if (way == 1) {
+      memcpy(copy, start, length);
+    } else {
+      mapping_copy(copy, start, length, kind);
+    }
+    passes++;
+    elapsed = monotonic_ns() - begin;
+  } while (elapsed < MAPPING_BENCH_NS);
+
+  return (double)length * (double)passes * 1000.0 / (double)elapsed;
+}
+
+int mapping_benchmark(const void *start, size_t length,
+                      enum mapping_kind_t kind, struct mapping_bench_t *bench) {
+  uint8_t *copy = malloc(length);
+
+  if (copy == NULL) {
+    errno = ENOMEM;
+    return -1;
+  }
+  memset(copy, 0, length);
+  bench->bytewise = bench_mbps(start, length, copy, kind, 0);
+  bench->libc = bench_mbps(start, length, copy, kind, 1);
+  bench->copy = bench_mbps(start, length, copy, kind, 2);
+  free(copy);
+  return 0;
+}
+
+const char *mapping_kind_name(enum mapping_kind_t kind) {
+  return kind == MAPPING_UNCACHED ? "uncached" : "cached";
+}
@@ -0,0 +1,112 @@
+/**
+ * @file mapping.h
+ * @brief Reading mapped driver buffers. How a buffer is mapped decides how
+ * it reads: a cached mapping reads at memory speed whatever the code does,
+ * an uncached or write-combined one, which ARM camera drivers commonly
+ * hand out for MMAP buffers, pays a bus round trip for every load and is
+ * only fast read wide and in order. mapping_probe() tells the two apart
+ * and mapping_copy() reads each the way it reads best, so consumers work
+ * on a cached copy instead of the mapping.
+ */
+
+#ifndef MAPPING_H
+#define MAPPING_H
+
+#include <stddef.h>
+
+/**
+ * @brief Bytes mapping_probe() reads, small enough to stay in the cache of
+ * a cached mapping.
+ */
+#define MAPPING_PROBE_BYTES (64 * 1024)
+
+/**
+ * @brief How many times slower than anonymous memory a mapping reads
+ * before it counts as uncached. Uncached reads are ten times slower or
+ * more, cache misses on a cached mapping well under this.
+ */
+#define MAPPING_UNCACHED_RATIO 4
+
+/**
+ * @brief How a buffer is mapped.
+ */
+enum mapping_kind_t {
+  MAPPING_CACHED,
+  MAPPING_UNCACHED,
+};
+
+/**
+ * @brief What mapping_probe() found.
+ * @param kind How the buffer reads.
+ * @param pfn Non-zero if the kernel maps raw page frames there (VmFlags pf
+ * in smaps), as drivers do for DMA memory; cached or not.
+ * @param io Non-zero for memory mapped I/O (VmFlags io).
+ * @param read_mbps Probe throughput on the buffer, MB/s.
+ * @param reference_mbps The same probe on anonymous memory, MB/s.
+ */
+struct mapping_info_t {
+  enum mapping_kind_t kind;
+  int pfn;
+  int io;
+  double read_mbps;
+  double reference_mbps;
+};
+
+/**
+ * @brief Throughput of reading a buffer three ways, MB/s.
+ * @param bytewise A byte at a time, as naive processing does.
+ * @param libc Copied with memcpy().
+ * @param copy Copied with mapping_copy() for the probed kind.
+ */
+struct mapping_bench_t {
+  double bytewise;
+  double libc;
+  double copy;
+};
+
+/**
+ * @brief Find out how a buffer is mapped by timing reads of its first
+ * MAPPING_PROBE_BYTES against anonymous memory, and look it up in
+ * /proc/self/smaps.
+ * @param start Mapped buffer, readable.
+ * @param length Its length.
+ * @param info What was found.
+ * @return 0 on success, -1 with errno set if memory is short.
+ */
+int mapping_probe(const void *start, size_t length,
+                  struct mapping_info_t *info);
+
+/**
+ * @brief Copy out of a buffer. Only an uncached source gets a copy of its
+ * own: it is read with the widest loads there are, aligned to it,
+ * streaming loads on x86. A cached one is left to memcpy(), which nothing
+ * here beats on cached memory.
+ * @param dst Destination, ordinary memory.
+ * @param src Source buffer.
+ * @param bytes Bytes to copy.
+ * @param kind How src is mapped.
+ * @return None.
+ */
+void mapping_copy(void *dst, const void *src, size_t bytes,
+                  enum mapping_kind_t kind);
+
+/**
+ * @brief Time reading a whole buffer a byte at a time, with memcpy() and
+ * with mapping_copy().
+ * @param start Mapped buffer.
+ * @param length Its length.
+ * @param kind How it is mapped.
+ * @param bench Throughputs.
+ * @return 0 on success, -1 with errno set if memory is short.
+ */
+int mapping_benchmark(const void *start, size_t length,
+                      enum mapping_kind_t kind, struct mapping_bench_t *bench);
+
+/**
+ * @brief Name of a mapping kind, for reports.
+ * @param kind Kind.
+ * @return "cached" or "uncached".
+ */
+const char *mapping_kind_name(enum mapping_kind_t kind);
+
+#endif /* MAPPING_H */
@@ -0,0 +1,736 @@
+/**
+ * @file media_graph.c
+ * @brief Media controller setup of the sensor path.
+ * @note Link and pad changes do not bump the topology version, only
+ * entities and links coming or going do. A cached setup therefore still
+ * re-enables its links and checks every pad format: someone may have run
+ * media-ctl since.
+ */
+
+#include "media_graph.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/ioctl.h>
+#include <sys/stat.h>
+
+#include <linux/media-bus-format.h>
+#include <linux/videodev2.h>
+
+#include "storage.h"
+
+/**
+ * @brief Start of a cache file, "MGC1", and how often a topology read is
+ * tried while entities come and go.
+ */
+#define CACHE_MAGIC 0x3143474dU
+#define READ_ATTEMPTS 3
+
+/**
+ * @brief The cache file: a magic number, the size of the route, and the
+ * route. Only read back by the same build, and only from a file of the
+ * user's that nobody else can write: the route names the subdevs opened
+ * and the links set.
+ */
+struct media_graph_cache_t {
+  __u32 magic;
+  __u32 size;
+  struct media_graph_route_t route;
+};
+
+/**
+ * @brief Invoke ioctl, restarting when interrupted by a signal.
+ * @param fd File descriptor.
+ * @param request ioctl request code.
+ * @param arg ioctl argument.
+ * @return ioctl status.
+ */
+static int xioctl(int fd, unsigned long request, void *arg) {
+  int status_code;
+
+  do {
+    status_code = ioctl(fd, request, arg);
+  } while (status_code < 0 && errno == EINTR);
+
+  return status_code;
+}
+
+/**
+ * @brief Whether an entity name is name, or starts with it and a space.
+ */
+static int name_matches(const char *entity, const char *name) {
+  size_t length = strlen(name);
+
+  return strncmp(entity, name, length) == 0 &&
+         (entity[length] == '\0' || entity[length] == ' ');
+}
+
+int media_graph_read(struct media_graph_t *graph, int media_fd) {
+  struct media_device_info info;
+  struct media_v2_topology topology;
+  int attempt;
+
+  memset(&info, 0, sizeof(info));
+  if (xioctl(media_fd, MEDIA_IOC_DEVICE_INFO, &info) < 0) {
+    return -1;
+  }
+  graph->pad_indices = MEDIA_V2_PAD_HAS_INDEX(info.media_version);
+  memcpy(graph->bus_info, info.bus_info, sizeof(graph->bus_info));
+
+  for (attempt = 0; attempt < READ_ATTEMPTS; attempt++) {
+    /* Counts first, then the arrays; ENOSPC if the graph grew between. */
+    memset(&topology, 0, sizeof(topology));
+    if (xioctl(media_fd, MEDIA_IOC_G_TOPOLOGY, &topology) < 0) {
+      return -1;
+    }
+    if (topology.num_entities > MEDIA_GRAPH_MAX_ENTITIES ||
+        topology.num_interfaces > MEDIA_GRAPH_MAX_INTERFACES ||
+        topology.num_pads > MEDIA_GRAPH_MAX_PADS ||
+        topology.num_links > MEDIA_GRAPH_MAX_LINKS) {
+      errno = E2BIG;
+      return -1;
+    }
+    topology.ptr_entities = (uintptr_t)graph->entities;
+    topology.ptr_interfaces = (uintptr_t)graph->interfaces;
+    topology.ptr_pads = (uintptr_t)graph->pads;
+    topology.ptr_links = (uintptr_t)graph->links;
+    if (xioctl(media_fd, MEDIA_IOC_G_TOPOLOGY, &topology) == 0) {
+      graph->version = topology.topology_version;
+      graph->entity_count = topology.num_entities;
+      graph->interface_count = topology.num_interfaces;
+      graph->pad_count = topology.num_pads;
+      graph->link_count = topology.num_links;
+      return 0;
+    }
+    if (errno != ENOSPC) {
+      return -1;
+    }
+  }
+  return -1;
+}
+
+const struct media_v2_entity *media_graph_find(const struct media_graph_t *graph,
+                                               const char *name) {
+  unsigned int i;
+
+  for (i = 0; i < graph->entity_count; i++) {
+    if (name_matches(graph->entities[i].name, name)) {
+      return &graph->entities[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Slot of an entity in graph->entities, -1 if absent.
+ */
+static int entity_slot(const struct media_graph_t *graph, __u32 id) {
+  unsigned int i;
+
+  for (i = 0; i < graph->entity_count; i++) {
+    if (graph->entities[i].id == id) {
+      return (int)i;
+    }
+  }
+  return -1;
+}
+
+/**
+ * @brief A pad by id, NULL if absent.
+ */
+static const struct media_v2_pad *find_pad(const struct media_graph_t *graph,
+                                           __u32 id) {
+  unsigned int i;
+
+  for (i = 0; i < graph->pad_count; i++) {
+    if (graph->pads[i].id == id) {
+      return &graph->pads[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Index of a pad on its entity. Before the media API reported it,
+ * pads were listed in index order.
+ */
+static __u32 pad_index(const struct media_graph_t *graph,
+                       const struct media_v2_pad *pad) {
+  __u32 index = 0;
+  unsigned int i;
+
+  if (graph->pad_indices) {
+    return pad->index;
+  }
+  for (i = 0; &graph->pads[i] != pad; i++) {
+    if (graph->pads[i].entity_id == pad->entity_id) {
+      index++;
+    }
+  }
+  return index;
+}
+
+int media_graph_devnode(const struct media_graph_t *graph, __u32 entity,
+                        char *path, size_t size) {
+  char uevent[512];
+  unsigned int i;
+  unsigned int j;
+
+  for (i = 0; i < graph->link_count; i++) {
+    const struct media_v2_link *link = &graph->links[i];
+
+    if ((link->flags & MEDIA_LNK_FL_LINK_TYPE) !=
+            MEDIA_LNK_FL_INTERFACE_LINK ||
+        link->sink_id != entity) {
+      continue;
+    }
+    for (j = 0; j < graph->interface_count; j++) {
+      const struct media_v2_interface *interface = &graph->interfaces[j];
+      const char *name;
+      ssize_t length;
+      int fd;
+
+      if (interface->id != link->source_id) {
+        continue;
+      }
+      /* The device node is named by udev after DEVNAME. */
+      snprintf(uevent, sizeof(uevent), "/sys/dev/char/%u:%u/uevent",
+               interface->devnode.major, interface->devnode.minor);
+      fd = open(uevent, O_RDONLY | O_CLOEXEC);
+      if (fd < 0) {
+        return -1;
+      }
+      length = read(fd, uevent, sizeof(uevent) - 1);
+      close(fd);
+      if (length < 0) {
+        return -1;
+      }
+      uevent[length] = '\0';
+      name = strstr(uevent, "DEVNAME=");
+      if (name == NULL) {
+        errno = ENOENT;
+        return -1;
+      }
+      name += strlen("DEVNAME=");
+      snprintf(path, size, "/dev/%.*s", (int)strcspn(name, "\n"), name);
+      return 0;
+    }
+  }
+  errno = ENOENT;
+  return -1;
+}
+
+__u32 media_graph_bus_code(__u32 pixelformat) {
+  switch (pixelformat) {
+  case V4L2_PIX_FMT_SBGGR10:
+  case V4L2_PIX_FMT_SBGGR10P:
+    return MEDIA_BUS_FMT_SBGGR10_1X10;
+  case V4L2_PIX_FMT_SBGGR8:
+    return MEDIA_BUS_FMT_SBGGR8_1X8;
+  case V4L2_PIX_FMT_GREY:
+    return MEDIA_BUS_FMT_Y8_1X8;
+  case V4L2_PIX_FMT_YUYV:
+    return MEDIA_BUS_FMT_YUYV8_1X16;
+  default:
+    return 0;
+  }
+}
+
+/**
+ * @brief Data path from the sensor to the video node, breadth first so the
+ * shortest one wins.
+ * @param path Set to the links, sensor first.
+ * @return Number of links, or -1 with errno set.
+ */
+static int find_path(const struct media_graph_t *graph,
+                     const struct media_v2_entity *sensor, const char *video,
+                     const struct media_v2_link **path) {
+  int via[MEDIA_GRAPH_MAX_ENTITIES];
+  int queue[MEDIA_GRAPH_MAX_ENTITIES];
+  int head = 0;
+  int tail = 0;
+  int start = entity_slot(graph, sensor->id);
+  int target = -1;
+  int hops = 0;
+  int slot;
+  unsigned int i;
+
+  for (i = 0; i < graph->entity_count; i++) {
+    via[i] = -1;
+  }
+  queue[tail++] = start;
+  while (head < tail && target < 0) {
+    const struct media_v2_entity *entity = &graph->entities[queue[head]];
+
+    slot = queue[head++];
+    if (slot != start && entity->function == MEDIA_ENT_F_IO_V4L) {
+      if (video == NULL || name_matches(entity->name, video)) {
+        target = slot;
+      }
+      /* Video nodes end paths. */
+      continue;
+    }
+    for (i = 0; i < graph->link_count; i++) {
+      const struct media_v2_link *link = &graph->links[i];
+      const struct media_v2_pad *source;
+      const struct media_v2_pad *sink;
+      int next;
+
+      if ((link->flags & MEDIA_LNK_FL_LINK_TYPE) != MEDIA_LNK_FL_DATA_LINK) {
+        continue;
+      }
+      source = find_pad(graph, link->source_id);
+      sink = find_pad(graph, link->sink_id);
+      if (source == NULL || sink == NULL || source->entity_id != entity->id) {
+        continue;
+      }
+      next = entity_slot(graph, sink->entity_id);
+      if (next >= 0 && next != start && via[next] < 0) {
+        via[next] = (int)i;
+        queue[tail++] = next;
+      }
+    }
+  }
+  if (target < 0) {
+    errno = video != NULL && media_graph_find(graph, video) == NULL ? ENODEV
+                                                                     : ENOLINK;
+    return -1;
+  }
+
+  for (slot = target; slot != start;) {
+    const struct media_v2_link *link = &graph->links[via[slot]];
+
+    hops++;
+    slot = entity_slot(graph, find_pad(graph, link->source_id)->entity_id);
+  }
+  if (hops > MEDIA_GRAPH_MAX_HOPS) {
+    errno = E2BIG;
+    return -1;
+  }
+  for (slot = target, i = (unsigned int)hops; slot != start;) {
+    const struct media_v2_link *link = &graph->links[via[slot]];
+
+    path[--i] = link;
+    slot = entity_slot(graph, find_pad(graph, link->source_id)->entity_id);
+  }
+  return hops;
+}
+
+/**
+ * @brief Whether two pad formats agree on what matters to the link.
+ */
+static int same_format(const struct v4l2_mbus_framefmt *a,
+                       const struct v4l2_mbus_framefmt *b) {
+  return a->width == b->width && a->height == b->height && a->code == b->code;
+}
+
+/**
+ * @brief Give a subdev pad a format unless it has it already.
+ * @param pad Pad and format wanted; format is set to the one the subdev
+ * settled on.
+ * @param keep_code Keep the code the pad has, set only the size.
+ * @param route Counts the pads set.
+ * @return 0 on success, -1 with errno set.
+ */
+static int apply_pad(struct media_graph_pad_t *pad, int keep_code,
+                     struct media_graph_route_t *route) {
+  struct v4l2_subdev_format request;
+  int status_code = 0;
+  int fd;
+
+  fd = open(pad->devnode, O_RDWR | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  memset(&request, 0, sizeof(request));
+  request.which = V4L2_SUBDEV_FORMAT_ACTIVE;
+  request.pad = pad->pad;
+  if (xioctl(fd, VIDIOC_SUBDEV_G_FMT, &request) < 0) {
+    status_code = -1;
+  } else {
+    if (keep_code) {
+      pad->format.code = request.format.code;
+    }
+    if (!same_format(&request.format, &pad->format)) {
+      request.format.width = pad->format.width;
+      request.format.height = pad->format.height;
+      request.format.code = pad->format.code;
+      request.format.field = V4L2_FIELD_NONE;
+      status_code = xioctl(fd, VIDIOC_SUBDEV_S_FMT, &request);
+      route->pads_set++;
+    }
+  }
+  if (status_code == 0) {
+    pad->format = request.format;
+  }
+  close(fd);
+  return status_code;
+}
+
+/**
+ * @brief Enable a link unless it is known to be enabled already.
+ */
+static int enable_link(int media_fd, struct media_link_desc *link,
+                       int enabled, struct media_graph_route_t *route) {
+  if (enabled) {
+    return 0;
+  }
+  route->links_enabled++;
+  return xioctl(media_fd, MEDIA_IOC_SETUP_LINK, link);
+}
+
+/**
+ * @brief Whether a cached route answers the request, on the media device it
+ * was found on.
+ */
+static int route_matches(const struct media_graph_route_t *route,
+                         const struct media_graph_request_t *request,
+                         const struct media_device_info *info) {
+  return strcmp(route->media, request->media_path) == 0 &&
+         strncmp(route->bus_info, info->bus_info, sizeof(route->bus_info)) ==
+             0 &&
+         strcmp(route->sensor, request->sensor) == 0 &&
+         strcmp(route->video, request->video != NULL ? request->video : "") ==
+             0 &&
+         route->width == request->width && route->height == request->height &&
+         route->code == request->code;
+}
+
+/**
+ * @brief Whether a string read from the cache ends within its array.
+ */
+static int terminated(const char *string, size_t size) {
+  return memchr(string, '\0', size) != NULL;
+}
+
+/**
+ * @brief Whether a cached route is well formed: counts in range, strings
+ * terminated, and nothing but subdev nodes to open.
+ */
+static int route_valid(const struct media_graph_route_t *route) {
+  unsigned int i;
+
+  if (route->link_count > MEDIA_GRAPH_MAX_HOPS ||
+      route->pad_count > 2 * MEDIA_GRAPH_MAX_HOPS ||
+      !terminated(route->media, sizeof(route->media)) ||
+      !terminated(route->bus_info, sizeof(route->bus_info)) ||
+      !terminated(route->sensor, sizeof(route->sensor)) ||
+      !terminated(route->video, sizeof(route->video))) {
+    return 0;
+  }
+  for (i = 0; i < route->pad_count; i++) {
+    const char *devnode = route->pads[i].devnode;
+
+    if (!terminated(devnode, sizeof(route->pads[i].devnode)) ||
+        strncmp(devnode, "/dev/v4l-subdev", strlen("/dev/v4l-subdev")) != 0 ||
+        strchr(devnode + strlen("/dev/"), '/') != NULL) {
+      return 0;
+    }
+  }
+  return 1;
+}
+
+/**
+ * @brief Read the cache file, if it is a regular file of the user's that
+ * neither the group nor others can write.
+ * @return 0 on success, -1 if there is none or it is not to be trusted.
+ */
+static int read_cache(const char *path, struct media_graph_cache_t *cache) {
+  struct stat status;
+  ssize_t length = -1;
+  int fd;
+
+  fd = open(path, O_RDONLY | O_NOFOLLOW | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  if (fstat(fd, &status) == 0 && S_ISREG(status.st_mode) &&
+      status.st_uid == geteuid() &&
+      (status.st_mode & (S_IWGRP | S_IWOTH)) == 0) {
+    length = read(fd, cache, sizeof(*cache));
+  }
+  close(fd);
+  return length == (ssize_t)sizeof(*cache) ? 0 : -1;
+}
+
+/**
+ * @brief Redo a cached setup if the topology is still the one it was found
+ * in.
+ * @return 0 on success, -1 if the cache does not apply or a step failed.
+ */
+static int replay_cache(int media_fd,
+                        const struct media_graph_request_t *request,
+                        struct media_graph_route_t *route) {
+  struct media_graph_cache_t cache;
+  struct media_device_info info;
+  struct media_v2_topology topology;
+  unsigned int i;
+
+  if (request->cache_path == NULL ||
+      read_cache(request->cache_path, &cache) < 0 ||
+      cache.magic != CACHE_MAGIC || cache.size != sizeof(cache.route) ||
+      !route_valid(&cache.route)) {
+    return -1;
+  }
+  memset(&info, 0, sizeof(info));
+  if (xioctl(media_fd, MEDIA_IOC_DEVICE_INFO, &info) < 0 ||
+      !route_matches(&cache.route, request, &info)) {
+    return -1;
+  }
+
+  /* The version alone: no arrays, nothing walked. */
+  memset(&topology, 0, sizeof(topology));
+  if (xioctl(media_fd, MEDIA_IOC_G_TOPOLOGY, &topology) < 0 ||
+      topology.topology_version != cache.route.version) {
+    return -1;
+  }
+  *route = cache.route;
+  route->cached = 1;
+  route->links_enabled = 0;
+  route->pads_set = 0;
+  for (i = 0; i < route->link_count; i++) {
+    if (xioctl(media_fd, MEDIA_IOC_SETUP_LINK, &route->links[i]) < 0) {
+      return -1;
+    }
+  }
+  for (i = 0; i < route->pad_count; i++) {
+    if (apply_pad(&route->pads[i], 0, route) < 0) {
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Store a route for the next setup. Written aside and renamed, so a
+ * reader never sees half of it. The staging file is per process and
+ * created afresh, never opened through a link.
+ */
+static void save_cache(const char *path,
+                       const struct media_graph_route_t *route) {
+  struct media_graph_cache_t cache;
+  char staging[512];
+  int fd;
+
+  memset(&cache, 0, sizeof(cache));
+  cache.magic = CACHE_MAGIC;
+  cache.size = sizeof(cache.route);
+  cache.route = *route;
+  snprintf(staging, sizeof(staging), "%s.%ld.tmp", path, (long)getpid());
+  unlink(staging);
+  fd = open(staging,
+            O_WRONLY | O_CREAT | O_EXCL | O_NOFOLLOW | O_CLOEXEC, 0600);
+  if (fd < 0) {
+    return;
+  }
+  if (write_full(fd, &cache, sizeof(cache)) < 0 || close(fd) < 0 ||
+      rename(staging, path) < 0) {
+    unlink(staging);
+  }
+}
+
+/**
+ * @brief Append a subdev pad to the route.
+ * @return The pad, its format cleared, or NULL with errno set if the
+ * subdev has no device node.
+ */
+static struct media_graph_pad_t *add_pad(const struct media_graph_t *graph,
+                                         struct media_graph_route_t *route,
+                                         const struct media_v2_pad *source) {
+  struct media_graph_pad_t *pad = &route->pads[route->pad_count];
+
+  memset(pad, 0, sizeof(*pad));
+  if (media_graph_devnode(graph, source->entity_id, pad->devnode,
+                          sizeof(pad->devnode)) < 0) {
+    return NULL;
+  }
+  pad->pad = pad_index(graph, source);
+  route->pad_count++;
+  return pad;
+}
+
+/**
+ * @brief Walk the graph and set the path up.
+ */
+static int setup_path(int media_fd, const struct media_graph_t *graph,
+                      const struct media_graph_request_t *request,
+                      struct media_graph_route_t *route) {
+  const struct media_v2_link *path[MEDIA_GRAPH_MAX_HOPS];
+  const struct media_v2_entity *sensor;
+  const struct media_v2_pad *source;
+  const struct media_v2_pad *sink;
+  struct media_graph_pad_t *pad;
+  int hops;
+  int hop;
+
+  sensor = media_graph_find(graph, request->sensor);
+  if (sensor == NULL) {
+    errno = ENODEV;
+    return -1;
+  }
+  hops = find_path(graph, sensor, request->video, path);
+  if (hops < 0) {
+    return -1;
+  }
+  route->version = graph->version;
+
+  for (hop = 0; hop < hops; hop++) {
+    struct media_link_desc *link = &route->links[hop];
+
+    source = find_pad(graph, path[hop]->source_id);
+    sink = find_pad(graph, path[hop]->sink_id);
+    memset(link, 0, sizeof(*link));
+    link->source.entity = source->entity_id;
+    link->source.index = (__u16)pad_index(graph, source);
+    link->sink.entity = sink->entity_id;
+    link->sink.index = (__u16)pad_index(graph, sink);
+    link->flags = MEDIA_LNK_FL_ENABLED;
+    route->link_count++;
+    if (enable_link(media_fd, link, path[hop]->flags & MEDIA_LNK_FL_ENABLED,
+                    route) < 0) {
+      return -1;
+    }
+  }
+
+  /* The sensor gets the size asked for, each pad after it what the pad
+   * before produces. Source pads after the sensor keep their code: a
+   * subdev may convert. */
+  for (hop = 0; hop < hops; hop++) {
+    source = find_pad(graph, path[hop]->source_id);
+    pad = add_pad(graph, route, source);
+    if (pad == NULL) {
+      return -1;
+    }
+    if (route->pad_count == 1) {
+      pad->format.width = request->width;
+      pad->format.height = request->height;
+      pad->format.code = request->code;
+    } else {
+      pad->format = pad[-1].format;
+    }
+    if (apply_pad(pad, route->pad_count > 1 || request->code == 0, route) <
+        0) {
+      return -1;
+    }
+
+    sink = find_pad(graph, path[hop]->sink_id);
+    if (graph->entities[entity_slot(graph, sink->entity_id)].function ==
+        MEDIA_ENT_F_IO_V4L) {
+      break;
+    }
+    pad = add_pad(graph, route, sink);
+    if (pad == NULL) {
+      return -1;
+    }
+    pad->format = pad[-1].format;
+    if (apply_pad(pad, 0, route) < 0) {
+      return -1;
+    }
+  }
+  route->format = route->pads[route->pad_count - 1].format;
+  return 0;
+}
+
+/**
+ * @brief Clear a route down to the request it answers.
+ */
+static void start_route(struct media_graph_route_t *route,
+                        const struct media_graph_request_t *request) {
+  memset(route, 0, sizeof(*route));
+  snprintf(route->media, sizeof(route->media), "%s", request->media_path);
+  snprintf(route->sensor, sizeof(route->sensor), "%s", request->sensor);
+  snprintf(route->video, sizeof(route->video), "%s",
+           request->video != NULL ? request->video : "");
+  route->width = request->width;
+  route->height = request->height;
+  route->code = request->code;
+}
+
+int media_graph_setup(const struct media_graph_request_t *request,
+                      struct media_graph_route_t *route) {
+  struct media_graph_t *graph;
+  int status_code;
+  int saved;
+  int fd;
+
+  fd = open(request->media_path, O_RDWR | O_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  if (replay_cache(fd, request, route) == 0) {
+    close(fd);
+    return 0;
+  }
+
+  /* Start over, whatever the cache left. */
+  start_route(route, request);
+  graph = malloc(sizeof(*graph));
+  if (graph == NULL) {
+    close(fd);
+    return -1;
+  }
+  status_code = media_graph_read(graph, fd);
+  if (status_code == 0) {
+    memcpy(route->bus_info, graph->bus_info, sizeof(route->bus_info));
+    status_code = setup_path(fd, graph, request, route);
+  }
+  saved = errno;
+  free(graph);
+  close(fd);
+  if (status_code == 0 && request->cache_path != NULL) {
+    save_cache(request->cache_path, route);
+  }
+  errno = saved;
+  return status_code;
+}
+
+/**
+ * @brief Create a directory of the user's only, or check that the one
+ * there is.
+ * @return 0 on success, -1 with errno set; EPERM if the directory there is
+ * a link, someone else's, or open to the group or others.
+ */
+static int private_dir(const char *path) {
+  struct stat status;
+
+  if (mkdir(path, 0700) < 0 && errno != EEXIST) {
+    return -1;
+  }
+  if (lstat(path, &status) < 0) {
+    return -1;
+  }
+  if (!S_ISDIR(status.st_mode) || status.st_uid != geteuid() ||
+      (status.st_mode & (S_IRWXG | S_IRWXO)) != 0) {
+    errno = EPERM;
+    return -1;
+  }
+  return 0;
+}
+
+int media_graph_cache_path(char *path, size_t size) {
+  const char *base = getenv("XDG_CACHE_HOME");
+  const char *home = getenv("HOME");
+  char dir[448];
+
+  if (base != NULL && base[0] == '/') {
+    snprintf(dir, sizeof(dir), "%s/%s", base, MEDIA_GRAPH_CACHE_DIR);
+  } else if (home != NULL && home[0] == '/') {
+    /* The XDG default; ~/.cache itself is made as XDG would. */
+    snprintf(dir, sizeof(dir), "%s/.cache", home);
+    mkdir(dir, 0700);
+    snprintf(dir, sizeof(dir), "%s/.cache/%s", home, MEDIA_GRAPH_CACHE_DIR);
+  } else {
+    snprintf(dir, sizeof(dir), "/run/%s", MEDIA_GRAPH_CACHE_DIR);
+  }
+  if (private_dir(dir) < 0) {
+    return -1;
+  }
+  snprintf(path, size, "%s/media.cache", dir);
+  return 0;
+}
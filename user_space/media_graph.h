@@ -0,0 +1,209 @@
+/**
+ * @file media_graph.h
+ * @brief Media controller setup, in place of media-ctl: on current
+ * Raspberry Pi kernels the OV5647 is a subdev behind a media graph (sensor
+ * -> unicam -> /dev/video0), and the video node refuses to stream until
+ * the link from the sensor is enabled and the sensor's pad format matches
+ * the capture format. media_graph_setup() reads the topology with
+ * MEDIA_IOC_G_TOPOLOGY, finds the data path from the sensor entity to a
+ * video node, enables its links with MEDIA_IOC_SETUP_LINK and sets the
+ * formats of the subdev pads on it with VIDIOC_SUBDEV_S_FMT, the pads
+ * after the sensor taking what the one before them produces.
+ *
+ * What it did is cached in a file. While the topology version of the same
+ * media device is the same, a later setup for the same request only reads
+ * the version, re-enables the links and sets the pads whose format was
+ * changed since, without walking the graph again. The file lives in a
+ * directory only the user can reach (media_graph_cache_path()) and is not
+ * read back if anyone else could have written it.
+ */
+
+#ifndef MEDIA_GRAPH_H
+#define MEDIA_GRAPH_H
+
+#include <stddef.h>
+
+#include <linux/media.h>
+#include <linux/v4l2-subdev.h>
+
+/**
+ * @brief Most entities, interfaces, pads and links of a topology read.
+ */
+#define MEDIA_GRAPH_MAX_ENTITIES 64
+#define MEDIA_GRAPH_MAX_INTERFACES 64
+#define MEDIA_GRAPH_MAX_PADS 128
+#define MEDIA_GRAPH_MAX_LINKS 256
+
+/**
+ * @brief Most links on the path from the sensor to the video node.
+ */
+#define MEDIA_GRAPH_MAX_HOPS 8
+
+/**
+ * @brief Longest entity name and device node path.
+ */
+#define MEDIA_GRAPH_NAME_LENGTH 64
+
+/**
+ * @brief Directory of the cache, under $XDG_CACHE_HOME (~/.cache) or /run.
+ */
+#define MEDIA_GRAPH_CACHE_DIR "ov5647"
+
+/**
+ * @brief A topology as MEDIA_IOC_G_TOPOLOGY reports it.
+ * @param version Topology version, bumped by the kernel whenever entities
+ * or links come or go.
+ * @param pad_indices Whether pads carry their index, from the media API
+ * version.
+ * @param bus_info Where the media device sits, e.g. platform:fe801000.csi.
+ */
+struct media_graph_t {
+  __u64 version;
+  int pad_indices;
+  char bus_info[32];
+  struct media_v2_entity entities[MEDIA_GRAPH_MAX_ENTITIES];
+  unsigned int entity_count;
+  struct media_v2_interface interfaces[MEDIA_GRAPH_MAX_INTERFACES];
+  unsigned int interface_count;
+  struct media_v2_pad pads[MEDIA_GRAPH_MAX_PADS];
+  unsigned int pad_count;
+  struct media_v2_link links[MEDIA_GRAPH_MAX_LINKS];
+  unsigned int link_count;
+};
+
+/**
+ * @brief What to set up.
+ * @param media_path Media device, e.g. /dev/media0.
+ * @param sensor Name of the sensor entity, or the start of it: "ov5647"
+ * matches "ov5647 10-0036".
+ * @param video Name of the video node entity to reach, NULL for the first
+ * one on the sensor's data links.
+ * @param width Frame width to set on the sensor.
+ * @param height Frame height.
+ * @param code Media bus code (MEDIA_BUS_FMT_*) to set on the sensor, 0 to
+ * keep the one it has.
+ * @param cache_path File the setup is cached in, NULL for none.
+ */
+struct media_graph_request_t {
+  const char *media_path;
+  const char *sensor;
+  const char *video;
+  __u32 width;
+  __u32 height;
+  __u32 code;
+  const char *cache_path;
+};
+
+/**
+ * @brief A subdev pad format set on the path.
+ * @param devnode Subdev device node, e.g. /dev/v4l-subdev0.
+ * @param pad Pad index on the subdev.
+ * @param format Format the subdev settled on.
+ */
+struct media_graph_pad_t {
+  char devnode[MEDIA_GRAPH_NAME_LENGTH];
+  __u32 pad;
+  struct v4l2_mbus_framefmt format;
+};
+
+/**
+ * @brief The configuration set up, which is what the cache holds.
+ * @param version Topology version it was found in. Versions count per
+ * media device, so the device is part of the key.
+ * @param media Media device path it was found on.
+ * @param bus_info Bus info of that media device.
+ * @param sensor Request it answers: sensor and video node names, size and
+ * code.
+ * @param links Links on the path, sensor first, as MEDIA_IOC_SETUP_LINK
+ * takes them.
+ * @param pads Pad formats on the path, in the order they are set.
+ * @param format Format arriving at the video node.
+ * @param cached Whether this setup came from the cache.
+ * @param links_enabled Links that were disabled and had to be enabled; 0
+ * from the cache, which sets every link without reading it first.
+ * @param pads_set Pads whose format had to be set.
+ */
+struct media_graph_route_t {
+  __u64 version;
+  char media[MEDIA_GRAPH_NAME_LENGTH];
+  char bus_info[32];
+  char sensor[MEDIA_GRAPH_NAME_LENGTH];
+  char video[MEDIA_GRAPH_NAME_LENGTH];
+  __u32 width;
+  __u32 height;
+  __u32 code;
+  struct media_link_desc links[MEDIA_GRAPH_MAX_HOPS];
+  unsigned int link_count;
+  struct media_graph_pad_t pads[2 * MEDIA_GRAPH_MAX_HOPS];
+  unsigned int pad_count;
+  struct v4l2_mbus_framefmt format;
+  int cached;
+  unsigned int links_enabled;
+  unsigned int pads_set;
+};
+
+/**
+ * @brief Read the topology of a media device.
+ * @param graph Destination.
+ * @param media_fd Open media device.
+ * @return 0 on success, -1 with errno set; E2BIG if the graph is larger
+ * than the MEDIA_GRAPH_MAX_* limits.
+ */
+int media_graph_read(struct media_graph_t *graph, int media_fd);
+
+/**
+ * @brief Find an entity by name.
+ * @param graph Topology.
+ * @param name Full name, or the part before a space: "ov5647" matches
+ * "ov5647 10-0036".
+ * @return The entity, NULL if there is none.
+ */
+const struct media_v2_entity *media_graph_find(const struct media_graph_t *graph,
+                                               const char *name);
+
+/**
+ * @brief Device node of an entity, from its interface and sysfs.
+ * @param graph Topology.
+ * @param entity Entity id.
+ * @param path Set to the path, e.g. /dev/v4l-subdev0.
+ * @param size Size of path.
+ * @return 0 on success, -1 with errno set; ENOENT if the entity has no
+ * device node.
+ */
+int media_graph_devnode(const struct media_graph_t *graph, __u32 entity,
+                        char *path, size_t size);
+
+/**
+ * @brief Set up the path from the sensor to the video node, from the cache
+ * when it still applies. Formats the subdevs adjust are taken as they
+ * come: the caller compares route->format with the capture format.
+ * @param request What to set up.
+ * @param route Set to what was set up.
+ * @return 0 on success, -1 with errno set: ENODEV if the sensor or the
+ * video node is not in the graph, ENOLINK if no data path joins them, or
+ * what the media device or a subdev reported. A cache that cannot be
+ * written is not an error.
+ */
+int media_graph_setup(const struct media_graph_request_t *request,
+                      struct media_graph_route_t *route);
+
+/**
+ * @brief Path of the setup cache, in a directory of its own that is made
+ * private to the user: $XDG_CACHE_HOME/ov5647, ~/.cache/ov5647 without it,
+ * or /run/ov5647 without a home.
+ * @param path Set to the path of the cache file.
+ * @param size Size of path.
+ * @return 0 on success, -1 with errno set if the directory cannot be made
+ * or is not private (EPERM); setups then go uncached.
+ */
+int media_graph_cache_path(char *path, size_t size);
+
+/**
+ * @brief Media bus code a sensor sends a pixel format on.
+ * @param pixelformat V4L2 fourcc.
+ * @return MEDIA_BUS_FMT_* code, 0 for formats a sensor does not send as
+ * is (MJPEG, multi-planar YUV), where the sensor keeps its code.
+ */
+__u32 media_graph_bus_code(__u32 pixelformat);
+
+#endif /* MEDIA_GRAPH_H */
@@ -0,0 +1,154 @@
+/**
+ * @file mode_switch.c
+ * @brief Preview / still mode switching.
+ * @note Drivers refuse S_FMT while buffers exist, so a switch has to go
+ * through STREAMOFF, REQBUFS 0, S_FMT, REQBUFS and STREAMON. What can be
+ * kept short is kept short: the user-side pools exist before the first
+ * switch, the still mode asks for few buffers, and the first good frame
+ * after STREAMON is used rather than waiting for the stream to settle.
+ */
+
+#include "mode_switch.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * @brief Current CLOCK_MONOTONIC time in microseconds.
+ */
+static long now_us(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000L + ts.tv_nsec / 1000;
+}
+
+int mode_switcher_init(struct mode_switcher_t *switcher,
+                       struct camera_params_t *params,
+                       const struct camera_mode_t *preview,
+                       const struct camera_mode_t *still) {
+  int mode;
+
+  memset(switcher, 0, sizeof(*switcher));
+  switcher->params = params;
+  switcher->modes[CAMERA_MODE_PREVIEW] = *preview;
+  switcher->modes[CAMERA_MODE_STILL] = *still;
+  switcher->current = -1;
+
+  for (mode = 0; mode < CAMERA_MODE_COUNT; mode++) {
+    const struct camera_mode_t *settings = &switcher->modes[mode];
+    struct mode_pool_t *pool = &switcher->pools[mode];
+
+    if (try_video_format(params, settings->width, settings->height,
+                         settings->pixelformat, &switcher->formats[mode],
+                         &pool->capacity) < 0) {
+      mode_switcher_destroy(switcher);
+      return -1;
+    }
+    pool->data = malloc(pool->capacity);
+    if (pool->data == NULL) {
+      mode_switcher_destroy(switcher);
+      errno = ENOMEM;
+      return -1;
+    }
+    /* Fault the pages in now rather than during the first copy. */
+    memset(pool->data, 0, pool->capacity);
+  }
+
+  return 0;
+}
+
+void mode_switch(struct mode_switcher_t *switcher, enum camera_mode_id_t mode,
+                 struct mode_switch_timing_t *timing) {
+  const struct camera_mode_t *settings = &switcher->modes[mode];
+  struct camera_params_t *params = switcher->params;
+  struct mode_switch_timing_t local;
+  long start = now_us();
+  long mark = start;
+  long now;
+
+  if (timing == NULL) {
+    timing = &local;
+  }
+
+  if (switcher->current >= 0) {
+    deactivate_streaming(params);
+    free_buffers(params);
+  }
+  now = now_us();
+  timing->stop_us = now - mark;
+  mark = now;
+
+  set_video_format(params, settings->width, settings->height,
+                   settings->pixelformat);
+  request_buffer(params, settings->buffers ? settings->buffers
+                                           : CAMERA_DEFAULT_BUFFERS);
+  allocate_buffer(params);
+  now = now_us();
+  timing->configure_us = now - mark;
+  mark = now;
+
+  activate_streaming(params);
+  now = now_us();
+  timing->start_us = now - mark;
+  mark = now;
+
+  get_frame(params);
+  now = now_us();
+  timing->first_frame_us = now - mark;
+  timing->total_us = now - start;
+
+  switcher->current = mode;
+  switcher->switches++;
+  if (timing->total_us > switcher->worst.total_us) {
+    switcher->worst = *timing;
+  }
+}
+
+const struct mode_pool_t *mode_switcher_keep(struct mode_switcher_t *switcher) {
+  const struct camera_params_t *params = switcher->params;
+  struct mode_pool_t *pool = &switcher->pools[switcher->current];
+
+  pool->bytes = copy_payload(params, pool->data, pool->capacity);
+  pool->sequence = params->buffer.sequence;
+
+  return pool;
+}
+
+const struct mode_pool_t *
+mode_switcher_take_still(struct mode_switcher_t *switcher,
+                         struct mode_switch_timing_t *timing) {
+  struct mode_switch_timing_t there;
+  struct mode_switch_timing_t back;
+  const struct mode_pool_t *still;
+  long start = now_us();
+
+  mode_switch(switcher, CAMERA_MODE_STILL, &there);
+  still = mode_switcher_keep(switcher);
+  mode_switch(switcher, CAMERA_MODE_PREVIEW, &back);
+
+  if (timing != NULL) {
+    timing->stop_us = there.stop_us + back.stop_us;
+    timing->configure_us = there.configure_us + back.configure_us;
+    timing->start_us = there.start_us + back.start_us;
+    timing->first_frame_us = there.first_frame_us + back.first_frame_us;
+    timing->total_us = now_us() - start;
+  }
+  return still;
+}
+
+void mode_switcher_destroy(struct mode_switcher_t *switcher) {
+  int mode;
+
+  if (switcher->current >= 0) {
+    deactivate_streaming(switcher->params);
+    free_buffers(switcher->params);
+    switcher->current = -1;
+  }
+  for (mode = 0; mode < CAMERA_MODE_COUNT; mode++) {
+    free(switcher->pools[mode].data);
+    switcher->pools[mode].data = NULL;
+  }
+}
@@ -0,0 +1,142 @@
+/**
+ * @file mode_switch.h
+ * @brief Switching one open device between a preview stream and a
+ * full-resolution still mode, with user-side frame pools allocated for both
+ * modes up front and every switch timed phase by phase.
+ */
+
+#ifndef MODE_SWITCH_H
+#define MODE_SWITCH_H
+
+#include <stddef.h>
+
+#include "camera.h"
+
+/**
+ * @brief Modes a switcher moves between.
+ */
+enum camera_mode_id_t {
+  CAMERA_MODE_PREVIEW,
+  CAMERA_MODE_STILL,
+  CAMERA_MODE_COUNT,
+};
+
+/**
+ * @brief A capture mode.
+ * @param width Frame width in pixels.
+ * @param height Frame height in pixels.
+ * @param pixelformat V4L2 fourcc.
+ * @param buffers Driver buffers to request. A still needs only one good
+ * frame, so a small count keeps the allocation short.
+ */
+struct camera_mode_t {
+  __u32 width;
+  __u32 height;
+  __u32 pixelformat;
+  __u32 buffers;
+};
+
+/**
+ * @brief Time spent in each phase of a switch, in microseconds.
+ * @param stop_us STREAMOFF, munmap and REQBUFS 0.
+ * @param configure_us S_FMT, REQBUFS, QUERYBUF and mmap.
+ * @param start_us QBUF of every buffer and STREAMON.
+ * @param first_frame_us STREAMON until the first good frame is dequeued.
+ * @param total_us The whole switch.
+ */
+struct mode_switch_timing_t {
+  long stop_us;
+  long configure_us;
+  long start_us;
+  long first_frame_us;
+  long total_us;
+};
+
+/**
+ * @brief A frame kept in a user-side pool.
+ * @param data Pool memory, sized for the largest frame of its mode with
+ * every plane.
+ * @param capacity Size of data.
+ * @param bytes Bytes held, the planes one after the other.
+ * @param sequence Driver sequence number of the frame.
+ */
+struct mode_pool_t {
+  void *data;
+  size_t capacity;
+  size_t bytes;
+  __u32 sequence;
+};
+
+/**
+ * @brief Switcher state.
+ * @param params Capture state of the device.
+ * @param modes Settings of each mode.
+ * @param formats Format the driver picks for each mode, from TRY_FMT.
+ * @param pools Kept frame of each mode.
+ * @param current Active mode, -1 before the first switch.
+ * @param switches Switches done.
+ * @param worst Slowest switch, phase by phase.
+ */
+struct mode_switcher_t {
+  struct camera_params_t *params;
+  struct camera_mode_t modes[CAMERA_MODE_COUNT];
+  struct v4l2_format formats[CAMERA_MODE_COUNT];
+  struct mode_pool_t pools[CAMERA_MODE_COUNT];
+  int current;
+  unsigned long switches;
+  struct mode_switch_timing_t worst;
+};
+
+/**
+ * @brief Prepare a switcher for an open device with no buffers. Both
+ * formats are checked with TRY_FMT and the pools allocated and touched, so
+ * a switch never allocates user memory.
+ * @param switcher Switcher to initialize.
+ * @param params Capture state of the device.
+ * @param preview Preview mode.
+ * @param still Still mode.
+ * @return 0 on success, -1 with errno set.
+ */
+int mode_switcher_init(struct mode_switcher_t *switcher,
+                       struct camera_params_t *params,
+                       const struct camera_mode_t *preview,
+                       const struct camera_mode_t *still);
+
+/**
+ * @brief Switch to a mode and dequeue its first frame into params->buffer.
+ * @param switcher Switcher.
+ * @param mode Mode to enter.
+ * @param timing Phases of this switch, may be NULL.
+ * @return None, exits on failure like the camera calls it makes.
+ */
+void mode_switch(struct mode_switcher_t *switcher, enum camera_mode_id_t mode,
+                 struct mode_switch_timing_t *timing);
+
+/**
+ * @brief Copy the dequeued frame, every plane of it, into the pool of the
+ * current mode, where it survives the next switch.
+ * @param switcher Switcher.
+ * @return The pool.
+ */
+const struct mode_pool_t *mode_switcher_keep(struct mode_switcher_t *switcher);
+
+/**
+ * @brief Take a still from preview: switch to the still mode, keep its first
+ * frame and switch back to preview.
+ * @param switcher Switcher, streaming preview.
+ * @param timing Round trip: each phase summed over both switches, and the
+ * total including the copy of the still. May be NULL.
+ * @return The still pool.
+ */
+const struct mode_pool_t *
+mode_switcher_take_still(struct mode_switcher_t *switcher,
+                         struct mode_switch_timing_t *timing);
+
+/**
+ * @brief Stop streaming, release the driver buffers and the pools.
+ * @param switcher Switcher.
+ * @return None.
+ */
+void mode_switcher_destroy(struct mode_switcher_t *switcher);
+
+#endif /* MODE_SWITCH_H */
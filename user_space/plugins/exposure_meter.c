@@ -0,0 +1,86 @@
+/**
+ * @file exposure_meter.c
+ * @brief Example stage plugin: the mean luma of every frame, reported every
+ * so many frames. Build with `make plugins`, run with
+ * `./main -f yuyv -P plugins/exposure_meter.so:30`.
+ */
+
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "../stage.h"
+
+/**
+ * @brief Meter state.
+ * @param period Frames between reports, 0 for none.
+ * @param step Bytes from one luma sample to the next.
+ * @param frames Frames metered.
+ * @param last_mean Mean luma of the last frame.
+ */
+struct meter_t {
+  unsigned int period;
+  unsigned int step;
+  unsigned long frames;
+  unsigned int last_mean;
+};
+
+static int meter_init(void **state, const struct v4l2_format *format,
+                      const char *args) {
+  struct meter_t *meter;
+
+  if (format->fmt.pix.pixelformat != V4L2_PIX_FMT_GREY &&
+      format->fmt.pix.pixelformat != V4L2_PIX_FMT_YUYV) {
+    errno = EINVAL;
+    return -1;
+  }
+  meter = calloc(1, sizeof(*meter));
+  if (meter == NULL) {
+    return -1;
+  }
+  meter->period = (unsigned int)strtoul(args, NULL, 0);
+  meter->step = format->fmt.pix.pixelformat == V4L2_PIX_FMT_YUYV ? 2 : 1;
+  *state = meter;
+  return 0;
+}
+
+static int meter_process(void *state, const struct stage_view_t *view,
+                         const struct stage_metadata_t *metadata) {
+  struct meter_t *meter = state;
+  const struct v4l2_pix_format *pix = &view->format->fmt.pix;
+  const uint8_t *data = view->data;
+  unsigned long long sum = 0;
+  __u32 x;
+  __u32 y;
+
+  if (view->bytes < (size_t)pix->bytesperline * pix->height) {
+    return -1;
+  }
+  for (y = 0; y < pix->height; y++) {
+    const uint8_t *row = data + (size_t)y * pix->bytesperline;
+
+    for (x = 0; x < pix->width; x++) {
+      sum += row[x * meter->step];
+    }
+  }
+  meter->last_mean =
+      (unsigned int)(sum / ((unsigned long long)pix->width * pix->height));
+  meter->frames++;
+  if (meter->period > 0 && meter->frames % meter->period == 0) {
+    printf("exposure_meter: frame %u mean luma %u\n", metadata->sequence,
+           meter->last_mean);
+  }
+  return 0;
+}
+
+static void meter_destroy(void *state) { free(state); }
+
+const struct stage_descriptor_t stage_descriptor = {
+    .abi_version = STAGE_ABI_VERSION,
+    .name = "exposure_meter",
+    .cost_us = 1000,
+    .threading = STAGE_THREAD_CALLER,
+    .init = meter_init,
+    .process = meter_process,
+    .destroy = meter_destroy,
+};
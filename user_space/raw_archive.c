@@ -0,0 +1,860 @@
+/**
+ * @file raw_archive.c
+ * @brief Lossless raw Bayer codec.
+ * @note Each sample is predicted from its same-colour neighbours two pixels
+ * left and two rows up with the LOCO-I median edge detector. The residual,
+ * taken modulo 1024, is Rice coded with a parameter adapted per Bayer
+ * channel from the running mean of recent residuals. Sensor noise keeps the
+ * residuals at a few bits, so a frame takes well under half its 16-bit size.
+ * Stripes never reference each other, which lets the pool encode them in
+ * any order and the reader decode them independently.
+ */
+
+#include "raw_archive.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * @brief Bytes of the fixed record header.
+ */
+#define RECORD_HEADER_BYTES 40
+
+/**
+ * @brief Bytes of a stripe table entry: method and coded size.
+ */
+#define STRIPE_ENTRY_BYTES 8
+
+/**
+ * @brief Sample range of 10-bit data.
+ */
+#define SAMPLE_RANGE 1024
+#define SAMPLE_MASK (SAMPLE_RANGE - 1)
+
+/**
+ * @brief Quotient at which a Rice code is replaced by an escape: LIMIT
+ * zeros, a one, then the 10-bit mapped residual.
+ */
+#define RICE_LIMIT 20
+
+/**
+ * @brief Count at which the adaptive statistics are halved, so the
+ * parameter follows changes across the frame.
+ */
+#define RICE_RESET 64
+
+/**
+ * @brief Starting mean residual of each channel.
+ */
+#define RICE_INITIAL_SUM 16
+
+/**
+ * @brief Adaptive Rice statistics of one Bayer channel.
+ * @param sum Sum of recent absolute residuals.
+ * @param count Number of recent residuals.
+ */
+struct rice_context_t {
+  unsigned int sum;
+  unsigned int count;
+};
+
+/**
+ * @brief MSB-first bit writer flushing 32-bit words.
+ */
+struct bit_writer_t {
+  uint64_t acc;
+  unsigned int count;
+  uint8_t *out;
+};
+
+/**
+ * @brief MSB-first bit reader, the next bits sit at the top of acc.
+ */
+struct bit_reader_t {
+  uint64_t acc;
+  unsigned int count;
+  const uint8_t *in;
+  const uint8_t *end;
+  size_t overrun;
+};
+
+static void put_u16(uint8_t *out, uint16_t value) {
+  out[0] = (uint8_t)value;
+  out[1] = (uint8_t)(value >> 8);
+}
+
+static void put_u32(uint8_t *out, uint32_t value) {
+  put_u16(out, (uint16_t)value);
+  put_u16(out + 2, (uint16_t)(value >> 16));
+}
+
+static void put_u64(uint8_t *out, uint64_t value) {
+  put_u32(out, (uint32_t)value);
+  put_u32(out + 4, (uint32_t)(value >> 32));
+}
+
+static uint16_t get_u16(const uint8_t *in) {
+  return (uint16_t)(in[0] | in[1] << 8);
+}
+
+static uint32_t get_u32(const uint8_t *in) {
+  return get_u16(in) | (uint32_t)get_u16(in + 2) << 16;
+}
+
+static uint64_t get_u64(const uint8_t *in) {
+  return get_u32(in) | (uint64_t)get_u32(in + 4) << 32;
+}
+
+/**
+ * @brief Map a packed fourcc to its 16-bit counterpart.
+ * @param pixelformat Bayer fourcc.
+ * @return 16-bit fourcc, 0 if not a supported Bayer format.
+ */
+static __u32 unpacked_format(__u32 pixelformat) {
+  switch (pixelformat) {
+  case V4L2_PIX_FMT_SBGGR10:
+  case V4L2_PIX_FMT_SGBRG10:
+  case V4L2_PIX_FMT_SGRBG10:
+  case V4L2_PIX_FMT_SRGGB10:
+    return pixelformat;
+  case V4L2_PIX_FMT_SBGGR10P:
+    return V4L2_PIX_FMT_SBGGR10;
+  case V4L2_PIX_FMT_SGBRG10P:
+    return V4L2_PIX_FMT_SGBRG10;
+  case V4L2_PIX_FMT_SGRBG10P:
+    return V4L2_PIX_FMT_SGRBG10;
+  case V4L2_PIX_FMT_SRGGB10P:
+    return V4L2_PIX_FMT_SRGGB10;
+  default:
+    return 0;
+  }
+}
+
+int raw_archive_supports(__u32 pixelformat) {
+  return unpacked_format(pixelformat) != 0;
+}
+
+/**
+ * @brief Bytes of a MIPI packed row: 4 samples in 5 bytes.
+ */
+static size_t packed_row_bytes(__u32 width) {
+  return (width + 3) / 4 * 5;
+}
+
+/**
+ * @brief Pack a row of 10-bit samples, the high 8 bits of four samples
+ * followed by a byte of their low 2 bits.
+ */
+static void pack_row(const uint16_t *row, __u32 width, uint8_t *out) {
+  __u32 x;
+
+  for (x = 0; x < width; x += 4) {
+    uint16_t s[4] = {0, 0, 0, 0};
+    __u32 i;
+
+    for (i = 0; i < 4 && x + i < width; i++) {
+      s[i] = row[x + i];
+    }
+    out[0] = (uint8_t)(s[0] >> 2);
+    out[1] = (uint8_t)(s[1] >> 2);
+    out[2] = (uint8_t)(s[2] >> 2);
+    out[3] = (uint8_t)(s[3] >> 2);
+    out[4] = (uint8_t)((s[0] & 3) | (s[1] & 3) << 2 | (s[2] & 3) << 4 |
+                       (s[3] & 3) << 6);
+    out += 5;
+  }
+}
+
+static void unpack_row(const uint8_t *in, __u32 width, uint16_t *row) {
+  __u32 x;
+
+  for (x = 0; x < width; x++) {
+    const uint8_t *group = in + x / 4 * 5;
+    unsigned int shift = (x & 3) * 2;
+
+    row[x] = (uint16_t)(group[x & 3] << 2 | ((group[4] >> shift) & 3));
+  }
+}
+
+/**
+ * @brief Load a row of the frame as 10-bit samples.
+ */
+static void load_row(const struct raw_frame_t *frame, __u32 y, uint16_t *row) {
+  const uint8_t *src = (const uint8_t *)frame->data;
+  __u32 x;
+
+  if (frame->pixelformat != unpacked_format(frame->pixelformat)) {
+    src += (size_t)y * (frame->bytesperline ? frame->bytesperline
+                                            : packed_row_bytes(frame->width));
+    unpack_row(src, frame->width, row);
+    return;
+  }
+
+  src += (size_t)y * (frame->bytesperline ? frame->bytesperline
+                                          : frame->width * 2);
+  for (x = 0; x < frame->width; x++) {
+    row[x] = (uint16_t)((src[2 * x] | src[2 * x + 1] << 8) & SAMPLE_MASK);
+  }
+}
+
+/**
+ * @brief LOCO-I median edge detector: picks the left or upper neighbour at
+ * an edge, the planar estimate elsewhere.
+ */
+static inline int predict(int a, int b, int c) {
+  int high = a > b ? a : b;
+  int low = a < b ? a : b;
+
+  if (c >= high) {
+    return low;
+  }
+  if (c <= low) {
+    return high;
+  }
+  return a + b - c;
+}
+
+/**
+ * @brief Prediction of sample x from the current row and the same-colour
+ * row two above (NULL at the top of a stripe).
+ */
+static inline int predict_at(const uint16_t *row, const uint16_t *up,
+                             __u32 x) {
+  if (x >= 2) {
+    return up != NULL ? predict(row[x - 2], up[x], up[x - 2]) : row[x - 2];
+  }
+  return up != NULL ? up[x] : SAMPLE_RANGE / 2;
+}
+
+static inline unsigned int rice_parameter(const struct rice_context_t *ctx) {
+  unsigned int k = 0;
+
+  while ((ctx->count << k) < ctx->sum && k < 10) {
+    k++;
+  }
+  return k;
+}
+
+static inline void rice_update(struct rice_context_t *ctx,
+                               unsigned int magnitude) {
+  ctx->sum += magnitude;
+  if (++ctx->count == RICE_RESET) {
+    ctx->sum >>= 1;
+    ctx->count >>= 1;
+  }
+}
+
+static void rice_init(struct rice_context_t ctx[4]) {
+  unsigned int i;
+
+  for (i = 0; i < 4; i++) {
+    ctx[i].sum = RICE_INITIAL_SUM;
+    ctx[i].count = 1;
+  }
+}
+
+/**
+ * @brief Append up to 32 bits; at most 31 are ever pending, so the 64-bit
+ * accumulator never overflows.
+ */
+static inline void bits_put(struct bit_writer_t *writer, uint32_t value,
+                            unsigned int bits) {
+  writer->acc = (writer->acc << bits) | value;
+  writer->count += bits;
+  if (writer->count >= 32) {
+    uint32_t word;
+
+    writer->count -= 32;
+    word = (uint32_t)(writer->acc >> writer->count);
+    writer->out[0] = (uint8_t)(word >> 24);
+    writer->out[1] = (uint8_t)(word >> 16);
+    writer->out[2] = (uint8_t)(word >> 8);
+    writer->out[3] = (uint8_t)word;
+    writer->out += 4;
+  }
+}
+
+static void bits_flush(struct bit_writer_t *writer) {
+  while (writer->count >= 8) {
+    writer->count -= 8;
+    *writer->out++ = (uint8_t)(writer->acc >> writer->count);
+  }
+  if (writer->count > 0) {
+    *writer->out++ = (uint8_t)(writer->acc << (8 - writer->count));
+    writer->count = 0;
+  }
+}
+
+static inline void bits_refill(struct bit_reader_t *reader) {
+  while (reader->count <= 56) {
+    uint64_t byte = 0;
+
+    if (reader->in < reader->end) {
+      byte = *reader->in++;
+    } else {
+      reader->overrun++;
+    }
+    reader->acc |= byte << (56 - reader->count);
+    reader->count += 8;
+  }
+}
+
+static inline void bits_skip(struct bit_reader_t *reader, unsigned int bits) {
+  reader->acc <<= bits;
+  reader->count -= bits;
+}
+
+/**
+ * @brief Code one row. The two channels of the row alternate, ctx points
+ * at the pair for this row's parity.
+ */
+static void encode_row(struct bit_writer_t *writer, const uint16_t *row,
+                       const uint16_t *up, __u32 width,
+                       struct rice_context_t *ctx) {
+  __u32 x;
+
+  for (x = 0; x < width; x++) {
+    struct rice_context_t *channel = &ctx[x & 1];
+    unsigned int k = rice_parameter(channel);
+    int error = (row[x] - predict_at(row, up, x)) & SAMPLE_MASK;
+    unsigned int mapped;
+    unsigned int quotient;
+
+    /* Residuals wrap modulo the sample range into [-512, 511], then fold
+     * into 0, -1, 1, -2, ... */
+    if (error >= SAMPLE_RANGE / 2) {
+      error -= SAMPLE_RANGE;
+    }
+    mapped =
+        error >= 0 ? (unsigned int)error * 2 : (unsigned int)-error * 2 - 1;
+    quotient = mapped >> k;
+
+    if (quotient < RICE_LIMIT) {
+      /* quotient zeros, a one, then the k low bits. */
+      bits_put(writer, (1U << k) | (mapped & ((1U << k) - 1)),
+               quotient + 1 + k);
+    } else {
+      bits_put(writer, (1U << 10) | mapped, RICE_LIMIT + 1 + 10);
+    }
+    rice_update(channel, mapped >> 1);
+  }
+}
+
+/**
+ * @brief Decode one row, the inverse of encode_row().
+ * @return 0 on success, -1 on an impossible code.
+ */
+static int decode_row(struct bit_reader_t *reader, uint16_t *row,
+                      const uint16_t *up, __u32 width,
+                      struct rice_context_t *ctx) {
+  __u32 x;
+
+  for (x = 0; x < width; x++) {
+    struct rice_context_t *channel = &ctx[x & 1];
+    unsigned int k = rice_parameter(channel);
+    unsigned int zeros;
+    unsigned int mapped;
+    int error;
+
+    bits_refill(reader);
+    if (reader->acc == 0) {
+      return -1;
+    }
+    zeros = (unsigned int)__builtin_clzll(reader->acc);
+    if (zeros >= RICE_LIMIT) {
+      if (zeros > RICE_LIMIT) {
+        return -1;
+      }
+      bits_skip(reader, RICE_LIMIT + 1);
+      mapped = (unsigned int)(reader->acc >> 54);
+      bits_skip(reader, 10);
+    } else {
+      bits_skip(reader, zeros + 1);
+      mapped = zeros << k;
+      if (k > 0) {
+        mapped |= (unsigned int)(reader->acc >> (64 - k));
+        bits_skip(reader, k);
+      }
+    }
+
+    error = (mapped & 1) ? -(int)((mapped + 1) >> 1) : (int)(mapped >> 1);
+    row[x] = (uint16_t)((predict_at(row, up, x) + error) & SAMPLE_MASK);
+    rice_update(channel, mapped >> 1);
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Encode stripe s of a frame. Gives up on Rice coding as soon as it
+ * exceeds the packed size, so noise costs little extra time.
+ * @param archive Encoder.
+ * @param frame Frame.
+ * @param s Stripe index.
+ * @param rows Scratch for three rows.
+ */
+static void encode_stripe(struct raw_archive_t *archive,
+                          const struct raw_frame_t *frame, unsigned int s,
+                          uint16_t *rows) {
+  struct raw_stripe_t *stripe = &archive->stripes[s];
+  __u32 first = s * RAW_ARCHIVE_STRIPE_ROWS;
+  __u32 last = first + RAW_ARCHIVE_STRIPE_ROWS;
+  size_t packed_row = packed_row_bytes(frame->width);
+  size_t packed_size;
+  struct rice_context_t ctx[4];
+  struct bit_writer_t writer = {.out = stripe->data};
+  __u32 y;
+
+  if (last > frame->height) {
+    last = frame->height;
+  }
+  packed_size = packed_row * (last - first);
+  rice_init(ctx);
+
+  for (y = first; y < last; y++) {
+    uint16_t *row = rows + (size_t)((y - first) % 3) * frame->width;
+    const uint16_t *up =
+        y - first >= 2
+            ? rows + (size_t)((y - first + 1) % 3) * frame->width
+            : NULL;
+
+    load_row(frame, y, row);
+    encode_row(&writer, row, up, frame->width, ctx + (y & 1) * 2);
+    if ((size_t)(writer.out - stripe->data) >= packed_size) {
+      break;
+    }
+  }
+  bits_flush(&writer);
+
+  stripe->bytes = (size_t)(writer.out - stripe->data);
+  stripe->method = RAW_STRIPE_RICE;
+  if (y < last || stripe->bytes >= packed_size) {
+    stripe->method = RAW_STRIPE_PACKED;
+    stripe->bytes = packed_size;
+    for (y = first; y < last; y++) {
+      load_row(frame, y, rows);
+      pack_row(rows, frame->width, stripe->data + (y - first) * packed_row);
+    }
+  }
+}
+
+/**
+ * @brief Take stripes of the current frame until none are left.
+ * @param worker Calling thread.
+ */
+static void run_stripes(struct raw_worker_t *worker) {
+  struct raw_archive_t *archive = worker->archive;
+
+  pthread_mutex_lock(&archive->lock);
+  while (archive->frame != NULL &&
+         archive->next_stripe < archive->stripe_count) {
+    const struct raw_frame_t *frame = archive->frame;
+    unsigned int s = archive->next_stripe++;
+
+    pthread_mutex_unlock(&archive->lock);
+    encode_stripe(archive, frame, s, worker->rows);
+    pthread_mutex_lock(&archive->lock);
+
+    if (++archive->stripes_done == archive->stripe_count) {
+      pthread_cond_signal(&archive->finished);
+    }
+  }
+  pthread_mutex_unlock(&archive->lock);
+}
+
+static void *worker_main(void *arg) {
+  struct raw_worker_t *worker = arg;
+  struct raw_archive_t *archive = worker->archive;
+  unsigned long seen = 0;
+
+  pthread_mutex_lock(&archive->lock);
+  for (;;) {
+    while (archive->generation == seen && !archive->quit) {
+      pthread_cond_wait(&archive->start, &archive->lock);
+    }
+    if (archive->quit) {
+      break;
+    }
+    seen = archive->generation;
+    pthread_mutex_unlock(&archive->lock);
+    run_stripes(worker);
+    pthread_mutex_lock(&archive->lock);
+  }
+  pthread_mutex_unlock(&archive->lock);
+
+  return NULL;
+}
+
+int raw_archive_init(struct raw_archive_t *archive, unsigned int threads) {
+  unsigned int i;
+
+  memset(archive, 0, sizeof(*archive));
+  if (threads == 0) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+
+    threads = online > 0 ? (unsigned int)online : 1;
+  }
+  if (threads > RAW_ARCHIVE_MAX_THREADS) {
+    threads = RAW_ARCHIVE_MAX_THREADS;
+  }
+
+  pthread_mutex_init(&archive->lock, NULL);
+  pthread_cond_init(&archive->start, NULL);
+  pthread_cond_init(&archive->finished, NULL);
+
+  for (i = 0; i < threads; i++) {
+    archive->workers[i].archive = archive;
+    archive->workers[i].id = i;
+    archive->workers[i].rows =
+        malloc(3 * RAW_ARCHIVE_MAX_WIDTH * sizeof(uint16_t));
+    if (archive->workers[i].rows == NULL) {
+      raw_archive_destroy(archive);
+      errno = ENOMEM;
+      return -1;
+    }
+    /* Worker 0 is whoever calls raw_archive_encode(). */
+    if (i > 0 && pthread_create(&archive->thread_ids[i], NULL, worker_main,
+                                &archive->workers[i]) != 0) {
+      free(archive->workers[i].rows);
+      archive->workers[i].rows = NULL;
+      raw_archive_destroy(archive);
+      errno = EAGAIN;
+      return -1;
+    }
+    archive->threads = i + 1;
+  }
+
+  return 0;
+}
+
+int raw_archive_encode(struct raw_archive_t *archive,
+                       const struct raw_frame_t *frame, const void **record,
+                       size_t *length) {
+  struct timespec start;
+  struct timespec end;
+  size_t capacity;
+  size_t total;
+  uint8_t *cursor;
+  unsigned int count;
+  unsigned int s;
+
+  if (!raw_archive_supports(frame->pixelformat) || frame->data == NULL ||
+      frame->width < 2 || frame->width > RAW_ARCHIVE_MAX_WIDTH ||
+      frame->height == 0 || frame->height > RAW_ARCHIVE_MAX_HEIGHT) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* Room for a packed stripe plus one worst-case row, the most Rice coding
+   * writes before falling back. */
+  count = (frame->height + RAW_ARCHIVE_STRIPE_ROWS - 1) /
+          RAW_ARCHIVE_STRIPE_ROWS;
+  capacity = packed_row_bytes(frame->width) * RAW_ARCHIVE_STRIPE_ROWS +
+             (size_t)frame->width * 4 + 16;
+  for (s = 0; s < count; s++) {
+    if (archive->stripes[s].capacity < capacity) {
+      uint8_t *data = realloc(archive->stripes[s].data, capacity);
+
+      if (data == NULL) {
+        errno = ENOMEM;
+        return -1;
+      }
+      archive->stripes[s].data = data;
+      archive->stripes[s].capacity = capacity;
+    }
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+
+  pthread_mutex_lock(&archive->lock);
+  archive->frame = frame;
+  archive->stripe_count = count;
+  archive->next_stripe = 0;
+  archive->stripes_done = 0;
+  archive->generation++;
+  pthread_cond_broadcast(&archive->start);
+  pthread_mutex_unlock(&archive->lock);
+
+  run_stripes(&archive->workers[0]);
+
+  pthread_mutex_lock(&archive->lock);
+  while (archive->stripes_done < count) {
+    pthread_cond_wait(&archive->finished, &archive->lock);
+  }
+  archive->frame = NULL;
+  pthread_mutex_unlock(&archive->lock);
+
+  total = RECORD_HEADER_BYTES + (size_t)count * STRIPE_ENTRY_BYTES;
+  for (s = 0; s < count; s++) {
+    total += archive->stripes[s].bytes;
+  }
+  if (archive->record_capacity < total) {
+    uint8_t *grown = realloc(archive->record, total);
+
+    if (grown == NULL) {
+      errno = ENOMEM;
+      return -1;
+    }
+    archive->record = grown;
+    archive->record_capacity = total;
+  }
+
+  cursor = archive->record;
+  put_u32(cursor, RAW_ARCHIVE_MAGIC);
+  put_u16(cursor + 4, RAW_ARCHIVE_VERSION);
+  put_u16(cursor + 6, RECORD_HEADER_BYTES);
+  put_u32(cursor + 8, frame->width);
+  put_u32(cursor + 12, frame->height);
+  put_u32(cursor + 16, unpacked_format(frame->pixelformat));
+  put_u32(cursor + 20, frame->sequence);
+  put_u64(cursor + 24, frame->timestamp_us);
+  put_u32(cursor + 32, RAW_ARCHIVE_STRIPE_ROWS);
+  put_u32(cursor + 36, (uint32_t)(total - RECORD_HEADER_BYTES));
+  cursor += RECORD_HEADER_BYTES;
+  for (s = 0; s < count; s++) {
+    put_u32(cursor, archive->stripes[s].method);
+    put_u32(cursor + 4, (uint32_t)archive->stripes[s].bytes);
+    cursor += STRIPE_ENTRY_BYTES;
+  }
+  for (s = 0; s < count; s++) {
+    memcpy(cursor, archive->stripes[s].data, archive->stripes[s].bytes);
+    cursor += archive->stripes[s].bytes;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  archive->frames++;
+  archive->raw_bytes += (unsigned long long)frame->width * frame->height * 2;
+  archive->encoded_bytes += total;
+  archive->encode_ns +=
+      (unsigned long long)(end.tv_sec - start.tv_sec) * 1000000000ULL +
+      (unsigned long long)(end.tv_nsec - start.tv_nsec);
+
+  *record = archive->record;
+  *length = total;
+  return 0;
+}
+
+void raw_archive_destroy(struct raw_archive_t *archive) {
+  unsigned int i;
+
+  pthread_mutex_lock(&archive->lock);
+  archive->quit = 1;
+  pthread_cond_broadcast(&archive->start);
+  pthread_mutex_unlock(&archive->lock);
+
+  for (i = 0; i < archive->threads; i++) {
+    if (i > 0) {
+      pthread_join(archive->thread_ids[i], NULL);
+    }
+  }
+  for (i = 0; i < RAW_ARCHIVE_MAX_THREADS; i++) {
+    free(archive->workers[i].rows);
+    archive->workers[i].rows = NULL;
+  }
+  for (i = 0; i < sizeof(archive->stripes) / sizeof(archive->stripes[0]);
+       i++) {
+    free(archive->stripes[i].data);
+    archive->stripes[i].data = NULL;
+  }
+  free(archive->record);
+  archive->record = NULL;
+  archive->threads = 0;
+
+  pthread_cond_destroy(&archive->finished);
+  pthread_cond_destroy(&archive->start);
+  pthread_mutex_destroy(&archive->lock);
+}
+
+int raw_archive_reader_open(struct raw_archive_reader_t *reader,
+                            const char *path) {
+  memset(reader, 0, sizeof(*reader));
+  reader->fd = open(path, O_RDONLY | O_CLOEXEC);
+  return reader->fd < 0 ? -1 : 0;
+}
+
+/**
+ * @brief Read until length bytes arrived or the file ended.
+ * @return Bytes read, -1 with errno set on error.
+ */
+static ssize_t read_exact(int fd, void *data, size_t length) {
+  uint8_t *cursor = data;
+  size_t done = 0;
+
+  while (done < length) {
+    ssize_t got = read(fd, cursor + done, length - done);
+
+    if (got < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if (got == 0) {
+      break;
+    }
+    done += (size_t)got;
+  }
+
+  return (ssize_t)done;
+}
+
+/**
+ * @brief Decode one stripe into its rows of the frame.
+ * @return 0 on success, -1 if the stripe is corrupt.
+ */
+static int decode_stripe(const uint8_t *data, size_t bytes, __u32 method,
+                         uint16_t *rows, __u32 width, __u32 first,
+                         __u32 count) {
+  struct rice_context_t ctx[4];
+  struct bit_reader_t reader = {.in = data, .end = data + bytes};
+  __u32 y;
+
+  if (method == RAW_STRIPE_PACKED) {
+    if (bytes != packed_row_bytes(width) * count) {
+      return -1;
+    }
+    for (y = 0; y < count; y++) {
+      unpack_row(data + y * packed_row_bytes(width), width,
+                 rows + (size_t)y * width);
+    }
+    return 0;
+  }
+  if (method != RAW_STRIPE_RICE) {
+    return -1;
+  }
+
+  rice_init(ctx);
+  for (y = 0; y < count; y++) {
+    uint16_t *row = rows + (size_t)y * width;
+
+    if (decode_row(&reader, row, y >= 2 ? row - 2 * (size_t)width : NULL,
+                   width, ctx + ((first + y) & 1) * 2) < 0) {
+      return -1;
+    }
+  }
+
+  /* The reader runs up to 8 bytes ahead; more means the codes ran past the
+   * stripe. */
+  if (reader.overrun * 8 > reader.count) {
+    return -1;
+  }
+  return 0;
+}
+
+int raw_archive_read(struct raw_archive_reader_t *reader,
+                     struct raw_frame_t *frame) {
+  uint8_t header[RECORD_HEADER_BYTES];
+  const uint8_t *table;
+  const uint8_t *payload;
+  size_t payload_bytes;
+  size_t samples;
+  ssize_t got;
+  __u32 width;
+  __u32 height;
+  __u32 stripe_rows;
+  __u32 count;
+  __u32 s;
+
+  got = read_exact(reader->fd, header, sizeof(header));
+  if (got <= 0) {
+    return (int)got;
+  }
+  width = get_u32(header + 8);
+  height = get_u32(header + 12);
+  stripe_rows = get_u32(header + 32);
+  payload_bytes = get_u32(header + 36);
+  if (got < (ssize_t)sizeof(header) ||
+      get_u32(header) != RAW_ARCHIVE_MAGIC ||
+      get_u16(header + 4) != RAW_ARCHIVE_VERSION ||
+      get_u16(header + 6) != RECORD_HEADER_BYTES || width < 2 ||
+      width > RAW_ARCHIVE_MAX_WIDTH || height == 0 ||
+      height > RAW_ARCHIVE_MAX_HEIGHT || stripe_rows == 0 ||
+      !raw_archive_supports(get_u32(header + 16))) {
+    errno = EBADMSG;
+    return -1;
+  }
+  count = (height + stripe_rows - 1) / stripe_rows;
+  if (payload_bytes < (size_t)count * STRIPE_ENTRY_BYTES ||
+      payload_bytes > (size_t)count * STRIPE_ENTRY_BYTES +
+                          (size_t)count * (packed_row_bytes(width) *
+                                               stripe_rows +
+                                           (size_t)width * 4 + 16)) {
+    errno = EBADMSG;
+    return -1;
+  }
+
+  if (reader->record_capacity < payload_bytes) {
+    uint8_t *grown = realloc(reader->record, payload_bytes);
+
+    if (grown == NULL) {
+      errno = ENOMEM;
+      return -1;
+    }
+    reader->record = grown;
+    reader->record_capacity = payload_bytes;
+  }
+  samples = (size_t)width * height;
+  if (reader->samples_capacity < samples) {
+    uint16_t *grown = realloc(reader->samples, samples * sizeof(uint16_t));
+
+    if (grown == NULL) {
+      errno = ENOMEM;
+      return -1;
+    }
+    reader->samples = grown;
+    reader->samples_capacity = samples;
+  }
+
+  got = read_exact(reader->fd, reader->record, payload_bytes);
+  if (got < 0) {
+    return -1;
+  }
+  if ((size_t)got < payload_bytes) {
+    /* A recording cut short mid-record. */
+    errno = EBADMSG;
+    return -1;
+  }
+
+  table = reader->record;
+  payload = table + (size_t)count * STRIPE_ENTRY_BYTES;
+  for (s = 0; s < count; s++) {
+    __u32 method = get_u32(table + s * STRIPE_ENTRY_BYTES);
+    size_t bytes = get_u32(table + s * STRIPE_ENTRY_BYTES + 4);
+    __u32 first = s * stripe_rows;
+    __u32 rows = height - first < stripe_rows ? height - first : stripe_rows;
+
+    if (bytes > (size_t)(reader->record + payload_bytes - payload) ||
+        decode_stripe(payload, bytes, method,
+                      reader->samples + (size_t)first * width, width, first,
+                      rows) < 0) {
+      errno = EBADMSG;
+      return -1;
+    }
+    payload += bytes;
+  }
+
+  frame->width = width;
+  frame->height = height;
+  frame->pixelformat = get_u32(header + 16);
+  frame->bytesperline = width * 2;
+  frame->sequence = get_u32(header + 20);
+  frame->timestamp_us = get_u64(header + 24);
+  frame->data = reader->samples;
+
+  return 1;
+}
+
+void raw_archive_reader_close(struct raw_archive_reader_t *reader) {
+  if (reader->fd >= 0) {
+    close(reader->fd);
+    reader->fd = -1;
+  }
+  free(reader->record);
+  free(reader->samples);
+  reader->record = NULL;
+  reader->samples = NULL;
+}
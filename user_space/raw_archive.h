@@ -0,0 +1,213 @@
+/**
+ * @file raw_archive.h
+ * @brief Lossless archival of raw 10-bit Bayer frames: a self-describing
+ * record per frame, split in stripes encoded in parallel on a worker pool,
+ * and a streaming reader.
+ */
+
+#ifndef RAW_ARCHIVE_H
+#define RAW_ARCHIVE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <linux/videodev2.h>
+
+/**
+ * @brief "CRAW" read as a little-endian word, starts every frame record.
+ */
+#define RAW_ARCHIVE_MAGIC 0x57415243
+
+/**
+ * @brief Record layout version.
+ */
+#define RAW_ARCHIVE_VERSION 1
+
+/**
+ * @brief Rows per stripe. Stripes are coded independently, so they are the
+ * unit of parallelism; 64 rows give 31 stripes at 2592x1944.
+ */
+#define RAW_ARCHIVE_STRIPE_ROWS 64
+
+/**
+ * @brief How a stripe is stored: MIPI packed 10-bit (4 samples in 5 bytes),
+ * or predicted and Rice coded.
+ */
+#define RAW_STRIPE_PACKED 0
+#define RAW_STRIPE_RICE 1
+
+/**
+ * @brief Upper bound of encoding threads, the caller included.
+ */
+#define RAW_ARCHIVE_MAX_THREADS 8
+
+/**
+ * @brief Largest frame accepted, the full OV5647 array.
+ */
+#define RAW_ARCHIVE_MAX_WIDTH 2592
+#define RAW_ARCHIVE_MAX_HEIGHT 1944
+
+/**
+ * @brief A raw frame handed to the encoder or returned by the reader.
+ * @param width Width in pixels.
+ * @param height Height in pixels.
+ * @param pixelformat Bayer fourcc. The encoder takes the 16-bit
+ * (V4L2_PIX_FMT_SBGGR10, ...) and the MIPI packed (V4L2_PIX_FMT_SBGGR10P,
+ * ...) layouts; the reader always returns the 16-bit one.
+ * @param bytesperline Line stride of data in bytes.
+ * @param sequence Driver sequence number.
+ * @param timestamp_us Capture time in microseconds.
+ * @param data Samples.
+ */
+struct raw_frame_t {
+  __u32 width;
+  __u32 height;
+  __u32 pixelformat;
+  __u32 bytesperline;
+  __u32 sequence;
+  uint64_t timestamp_us;
+  const void *data;
+};
+
+/**
+ * @brief Output of one stripe.
+ * @param data Coded bytes.
+ * @param capacity Size of data.
+ * @param bytes Bytes used.
+ * @param method RAW_STRIPE_RICE or RAW_STRIPE_PACKED.
+ */
+struct raw_stripe_t {
+  uint8_t *data;
+  size_t capacity;
+  size_t bytes;
+  __u32 method;
+};
+
+struct raw_archive_t;
+
+/**
+ * @brief A thread of the pool and the scratch rows it predicts from.
+ */
+struct raw_worker_t {
+  struct raw_archive_t *archive;
+  unsigned int id;
+  uint16_t *rows;
+};
+
+/**
+ * @brief Encoder and its worker pool.
+ * @param threads Encoding threads including the caller of
+ * raw_archive_encode().
+ * @param frame Frame being encoded, shared with the workers.
+ * @param generation Bumped for every frame, wakes the workers.
+ * @param next_stripe Next stripe to hand out.
+ * @param stripes_done Stripes finished for the current frame.
+ * @param record Assembled record of the last frame.
+ * @param frames Frames encoded.
+ * @param raw_bytes Size of those frames stored as 16-bit samples.
+ * @param encoded_bytes Size of their records.
+ * @param encode_ns Wall time spent encoding, in nanoseconds.
+ */
+struct raw_archive_t {
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t finished;
+  pthread_t thread_ids[RAW_ARCHIVE_MAX_THREADS];
+  struct raw_worker_t workers[RAW_ARCHIVE_MAX_THREADS];
+  unsigned int threads;
+  int quit;
+  const struct raw_frame_t *frame;
+  unsigned long generation;
+  unsigned int stripe_count;
+  unsigned int next_stripe;
+  unsigned int stripes_done;
+  struct raw_stripe_t stripes[(RAW_ARCHIVE_MAX_HEIGHT +
+                               RAW_ARCHIVE_STRIPE_ROWS - 1) /
+                              RAW_ARCHIVE_STRIPE_ROWS];
+  uint8_t *record;
+  size_t record_capacity;
+  unsigned long frames;
+  unsigned long long raw_bytes;
+  unsigned long long encoded_bytes;
+  unsigned long long encode_ns;
+};
+
+/**
+ * @brief Streaming reader state.
+ * @param fd Archive being read.
+ * @param record Payload of the current record.
+ * @param samples Decoded samples of the current frame.
+ */
+struct raw_archive_reader_t {
+  int fd;
+  uint8_t *record;
+  size_t record_capacity;
+  uint16_t *samples;
+  size_t samples_capacity;
+};
+
+/**
+ * @brief Tell whether a fourcc is a 10-bit Bayer format the encoder takes.
+ * @param pixelformat V4L2 fourcc.
+ * @return Non-zero if supported.
+ */
+int raw_archive_supports(__u32 pixelformat);
+
+/**
+ * @brief Start an encoder.
+ * @param archive Encoder to initialize.
+ * @param threads Encoding threads including the caller, 0 for one per
+ * online CPU. Capped at RAW_ARCHIVE_MAX_THREADS.
+ * @return 0 on success, -1 with errno set.
+ */
+int raw_archive_init(struct raw_archive_t *archive, unsigned int threads);
+
+/**
+ * @brief Encode a frame into a record. Stripes are predicted from their
+ * same-colour neighbours and Rice coded; a stripe that would not shrink
+ * below packed 10-bit is stored packed instead.
+ * @param archive Encoder.
+ * @param frame Frame to encode.
+ * @param record Set to the record, valid until the next call.
+ * @param length Set to the record length.
+ * @return 0 on success, -1 with errno set (EINVAL for unsupported frames).
+ */
+int raw_archive_encode(struct raw_archive_t *archive,
+                       const struct raw_frame_t *frame, const void **record,
+                       size_t *length);
+
+/**
+ * @brief Stop the workers and release the encoder.
+ * @param archive Encoder.
+ * @return None.
+ */
+void raw_archive_destroy(struct raw_archive_t *archive);
+
+/**
+ * @brief Open an archive, or one segment of it, for reading.
+ * @param reader Reader to initialize.
+ * @param path Archive path.
+ * @return 0 on success, -1 with errno set.
+ */
+int raw_archive_reader_open(struct raw_archive_reader_t *reader,
+                            const char *path);
+
+/**
+ * @brief Read and decode the next frame.
+ * @param reader Reader.
+ * @param frame Set to the frame, its data is valid until the next call.
+ * @return 1 for a frame, 0 at the end of the archive, -1 with errno set on
+ * a read error or a corrupt record (EBADMSG).
+ */
+int raw_archive_read(struct raw_archive_reader_t *reader,
+                     struct raw_frame_t *frame);
+
+/**
+ * @brief Close the archive and release the reader.
+ * @param reader Reader.
+ * @return None.
+ */
+void raw_archive_reader_close(struct raw_archive_reader_t *reader);
+
+#endif /* RAW_ARCHIVE_H */
@@ -0,0 +1,563 @@
+/**
+ * @file recorder.c
+ * @brief Continuous recording.
+ * @note The capture loop copies each kept frame into a slot of a fixed pool
+ * and requeues the driver buffer at once (or publishes it to the
+ * latest-frame cache), so a slow write never starves the sensor. A writer
+ * thread drains the slots into segment files. When the queue backs up the
+ * capture loop throttles: it keeps only every 2nd, 4th or 8th frame and
+ * lowers the JPEG quality if the driver allows, and relaxes again once the
+ * writer has caught up. With deduplication on, frames that
+ * look like the last stored one are skipped before they are copied. A
+ * stabilizer sits between the capture loop and the slots: it keeps its own
+ * copies for the look-ahead, so driver buffers are still requeued at once.
+ */
+
+#include "recorder.h"
+
+#include <errno.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * @brief Set from a signal handler to end the recording.
+ */
+static volatile sig_atomic_t stop_requested;
+
+void recorder_stop(void) { stop_requested = 1; }
+
+/**
+ * @brief A copied frame waiting for the writer.
+ */
+struct recorder_slot_t {
+  void *data;
+  size_t bytes;
+  __u32 sequence;
+  uint64_t timestamp_us;
+};
+
+/**
+ * @brief State shared by the capture loop and the writer thread.
+ * @param slots Frame pool, slot_capacity bytes each.
+ * @param slot_capacity Bytes per slot, a frame with every plane.
+ * @param free_list Indices of unused slots (stack).
+ * @param fifo Indices of filled slots in capture order (ring).
+ * @param freed Signalled by the writer when it returns a slot.
+ * @param done Set by the capture loop once no more frames will come.
+ * @param failed Set by the writer when storage failed for good.
+ * @param error errno of that failure.
+ * @param format Format of the frames, for the raw encoder.
+ * @param archive Raw encoder, NULL to store frames as captured.
+ */
+struct recorder_t {
+  pthread_mutex_t lock;
+  pthread_cond_t filled;
+  pthread_cond_t freed;
+  struct recorder_slot_t *slots;
+  size_t slot_capacity;
+  unsigned int slot_count;
+  unsigned int *free_list;
+  unsigned int free_count;
+  unsigned int *fifo;
+  unsigned int fifo_head;
+  unsigned int fifo_len;
+  int done;
+  int failed;
+  int error;
+  struct segment_writer_t writer;
+  struct v4l2_pix_format format;
+  struct raw_archive_t *archive;
+};
+
+/**
+ * @brief Store one slot, through the raw encoder if there is one.
+ * @param rec Recorder.
+ * @param slot Frame to store.
+ * @return 0 on success, -1 with errno set.
+ */
+static int write_slot(struct recorder_t *rec,
+                      const struct recorder_slot_t *slot) {
+  struct raw_frame_t frame;
+  const void *record;
+  size_t length;
+
+  if (rec->archive == NULL) {
+    return segment_writer_write(&rec->writer, slot->data, slot->bytes);
+  }
+
+  frame.width = rec->format.width;
+  frame.height = rec->format.height;
+  frame.pixelformat = rec->format.pixelformat;
+  frame.bytesperline = rec->format.bytesperline;
+  frame.sequence = slot->sequence;
+  frame.timestamp_us = slot->timestamp_us;
+  frame.data = slot->data;
+  if (raw_archive_encode(rec->archive, &frame, &record, &length) < 0) {
+    return -1;
+  }
+  return segment_writer_write(&rec->writer, record, length);
+}
+
+/**
+ * @brief Writer thread: store queued frames until the capture loop is done
+ * and the queue is empty.
+ * @param arg The recorder.
+ * @return NULL.
+ */
+static void *writer_main(void *arg) {
+  struct recorder_t *rec = arg;
+
+  pthread_mutex_lock(&rec->lock);
+  for (;;) {
+    unsigned int index;
+    int status_code;
+
+    while (rec->fifo_len == 0 && !rec->done) {
+      pthread_cond_wait(&rec->filled, &rec->lock);
+    }
+    if (rec->fifo_len == 0) {
+      break;
+    }
+    index = rec->fifo[rec->fifo_head];
+
+    /* Write outside the lock, capture keeps filling other slots. */
+    pthread_mutex_unlock(&rec->lock);
+    status_code = write_slot(rec, &rec->slots[index]);
+    pthread_mutex_lock(&rec->lock);
+
+    rec->fifo_head = (rec->fifo_head + 1) % rec->slot_count;
+    rec->fifo_len--;
+    rec->free_list[rec->free_count++] = index;
+    pthread_cond_signal(&rec->freed);
+
+    if (status_code < 0 && !rec->failed) {
+      rec->failed = 1;
+      rec->error = errno;
+    }
+  }
+  pthread_mutex_unlock(&rec->lock);
+
+  return NULL;
+}
+
+/**
+ * @brief Allocate the slot pool.
+ * @param rec Recorder.
+ * @param count Number of slots.
+ * @param capacity Bytes per slot.
+ * @return 0 on success, -1 on allocation failure.
+ */
+static int alloc_slots(struct recorder_t *rec, unsigned int count,
+                       size_t capacity) {
+  unsigned int i;
+
+  rec->slots = calloc(count, sizeof(*rec->slots));
+  rec->free_list = calloc(count, sizeof(*rec->free_list));
+  rec->fifo = calloc(count, sizeof(*rec->fifo));
+  if (rec->slots == NULL || rec->free_list == NULL || rec->fifo == NULL) {
+    return -1;
+  }
+
+  rec->slot_count = count;
+  rec->slot_capacity = capacity;
+  for (i = 0; i < count; i++) {
+    rec->slots[i].data = malloc(capacity);
+    if (rec->slots[i].data == NULL) {
+      return -1;
+    }
+    rec->free_list[rec->free_count++] = count - 1 - i;
+  }
+
+  return 0;
+}
+
+static void free_slots(struct recorder_t *rec) {
+  unsigned int i;
+
+  for (i = 0; rec->slots != NULL && i < rec->slot_count; i++) {
+    free(rec->slots[i].data);
+  }
+  free(rec->slots);
+  free(rec->free_list);
+  free(rec->fifo);
+}
+
+/**
+ * @brief Apply a throttle level to the JPEG quality control, if the driver
+ * has one.
+ * @param params Capture state.
+ * @param base_quality Quality before throttling, -1 if not adjustable.
+ * @param level Throttle level.
+ * @return The quality set, or -1.
+ */
+static int apply_quality(struct camera_params_t *params, int base_quality,
+                         unsigned int level) {
+  int quality;
+
+  if (base_quality < 0) {
+    return -1;
+  }
+  quality = base_quality - (int)level * RECORDER_QUALITY_STEP;
+  if (quality < RECORDER_QUALITY_MIN) {
+    quality = RECORDER_QUALITY_MIN;
+  }
+  if (quality > base_quality) {
+    quality = base_quality;
+  }
+  if (set_camera_control(params, V4L2_CID_JPEG_COMPRESSION_QUALITY,
+                         quality) < 0) {
+    return -1;
+  }
+  return quality;
+}
+
+/**
+ * @brief Current CLOCK_MONOTONIC time in nanoseconds.
+ */
+static long long monotonic_ns(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * @brief Deduplication state of the capture loop.
+ * @param reference Signature of the last stored frame.
+ * @param have_reference Whether reference is set.
+ * @param stored_ns When the last frame was stored.
+ * @param signature_ns_avg Moving average of one signature computation.
+ */
+struct dedup_t {
+  struct frame_signature_t reference;
+  int have_reference;
+  long long stored_ns;
+  long long signature_ns_avg;
+};
+
+/**
+ * @brief Tell whether the current frame repeats the last stored one.
+ * @param dedup Deduplication state.
+ * @param config Settings.
+ * @param params Capture state holding the frame.
+ * @param signature Set to the signature of the frame.
+ * @param valid Set when signature could be computed; frames without one are
+ * always stored.
+ * @return Non-zero to skip the frame.
+ */
+static int is_duplicate(struct dedup_t *dedup,
+                        const struct recorder_config_t *config,
+                        const struct camera_params_t *params,
+                        struct frame_signature_t *signature, int *valid) {
+  long long start_ns = monotonic_ns();
+  long long end_ns;
+
+  *valid = frame_signature_compute(&params->capture_format.fmt.pix,
+                                   params->buffer_start,
+                                   params->buffer.bytesused, signature) == 0;
+  end_ns = monotonic_ns();
+  dedup->signature_ns_avg += (end_ns - start_ns - dedup->signature_ns_avg) / 8;
+
+  if (!*valid || !dedup->have_reference ||
+      frame_signature_distance(&dedup->reference, signature) >
+          config->dedup_threshold) {
+    return 0;
+  }
+  return config->keepalive_ms == 0 ||
+         end_ns - dedup->stored_ns < config->keepalive_ms * 1000000LL;
+}
+
+/**
+ * @brief Copy a frame into a free slot and queue it for the writer.
+ * @param rec Recorder.
+ * @param stats Outcome, frames_dropped and max_queue_depth updated.
+ * @param params Capture state holding the frame to copy, every plane of
+ * it, or NULL to copy data.
+ * @param data Frame, without params.
+ * @param bytes Size of the frame. Either is cut to the slot capacity: a
+ * driver may map buffers longer than sizeimage and fill them.
+ * @param sequence Driver sequence number.
+ * @param timestamp_us Capture timestamp, microseconds.
+ * @param wait Non-zero to wait for a slot rather than drop the frame, once
+ * the sensor no longer needs its buffers back.
+ * @return Non-zero if the frame was queued.
+ */
+static int enqueue_frame(struct recorder_t *rec,
+                         struct recorder_stats_t *stats,
+                         const struct camera_params_t *params,
+                         const void *data, size_t bytes, __u32 sequence,
+                         uint64_t timestamp_us, int wait) {
+  unsigned int index;
+
+  pthread_mutex_lock(&rec->lock);
+  while (wait && rec->free_count == 0 && !rec->failed) {
+    pthread_cond_wait(&rec->freed, &rec->lock);
+  }
+  if (rec->free_count == 0) {
+    stats->frames_dropped++;
+    pthread_mutex_unlock(&rec->lock);
+    return 0;
+  }
+
+  index = rec->free_list[--rec->free_count];
+  if (params != NULL) {
+    bytes = copy_payload(params, rec->slots[index].data, rec->slot_capacity);
+  } else {
+    if (bytes > rec->slot_capacity) {
+      bytes = rec->slot_capacity;
+    }
+    memcpy(rec->slots[index].data, data, bytes);
+  }
+  rec->slots[index].bytes = bytes;
+  rec->slots[index].sequence = sequence;
+  rec->slots[index].timestamp_us = timestamp_us;
+  rec->fifo[(rec->fifo_head + rec->fifo_len) % rec->slot_count] = index;
+  rec->fifo_len++;
+  if (rec->fifo_len > stats->max_queue_depth) {
+    stats->max_queue_depth = rec->fifo_len;
+  }
+  pthread_cond_signal(&rec->filled);
+  pthread_mutex_unlock(&rec->lock);
+  return 1;
+}
+
+/**
+ * @brief Queue what the stabilizer has ready.
+ * @param rec Recorder.
+ * @param stabilizer Stabilizer.
+ * @param stats Outcome.
+ * @param drain Non-zero at the end of the recording, to empty the
+ * look-ahead and wait for slots.
+ */
+static void enqueue_stabilized(struct recorder_t *rec,
+                               struct stabilizer_t *stabilizer,
+                               struct recorder_stats_t *stats, int drain) {
+  struct stabilizer_frame_t frame;
+
+  while (stabilizer_pop(stabilizer, drain, &frame)) {
+    enqueue_frame(rec, stats, NULL, frame.data, frame.bytes, frame.sequence,
+                  frame.timestamp_us, drain);
+  }
+}
+
+/**
+ * @brief Done with the current frame: publish it as the latest, or give it
+ * straight back to the driver.
+ * @param params Capture state.
+ * @param config Settings.
+ */
+static void hand_back(struct camera_params_t *params,
+                      const struct recorder_config_t *config) {
+  if (config->snapshot != NULL) {
+    snapshot_publish(config->snapshot);
+  } else {
+    release_frame(params);
+  }
+}
+
+int run_recorder(struct camera_params_t *params,
+                 const struct recorder_config_t *config,
+                 struct recorder_stats_t *stats) {
+  struct recorder_t rec;
+  struct recorder_stats_t local;
+  struct dedup_t dedup;
+  struct timespec now;
+  pthread_t writer_thread;
+  unsigned int level = 0;
+  unsigned long cooldown = 0;
+  unsigned long frame = 0;
+  int base_quality = -1;
+  long long end_ns = 0;
+  int status_code = 0;
+
+  if (stats == NULL) {
+    stats = &local;
+  }
+  memset(stats, 0, sizeof(*stats));
+  stats->min_quality = -1;
+  stop_requested = 0;
+
+  memset(&rec, 0, sizeof(rec));
+  memset(&dedup, 0, sizeof(dedup));
+  pthread_mutex_init(&rec.lock, NULL);
+  pthread_cond_init(&rec.filled, NULL);
+  pthread_cond_init(&rec.freed, NULL);
+  rec.format = params->capture_format.fmt.pix;
+  if (config->archive != NULL &&
+      raw_archive_supports(rec.format.pixelformat)) {
+    rec.archive = config->archive;
+  }
+
+  if (segment_writer_init(&rec.writer, config->output_path,
+                          config->segment_bytes,
+                          config->max_total_bytes, config->write_mode) < 0 ||
+      alloc_slots(&rec, config->queue_slots ? config->queue_slots
+                                            : RECORDER_DEFAULT_SLOTS,
+                  payload_size(params)) < 0) {
+    perror("recorder setup");
+    segment_writer_close(&rec.writer);
+    free_slots(&rec);
+    return -1;
+  }
+
+  if (params->capture_format.fmt.pix.pixelformat == V4L2_PIX_FMT_MJPEG &&
+      get_camera_control(params, V4L2_CID_JPEG_COMPRESSION_QUALITY,
+                         &base_quality) < 0) {
+    base_quality = -1;
+  }
+
+  if (pthread_create(&writer_thread, NULL, writer_main, &rec) != 0) {
+    perror("pthread_create");
+    segment_writer_close(&rec.writer);
+    free_slots(&rec);
+    return -1;
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  if (config->duration_ms > 0) {
+    end_ns = now.tv_sec * 1000000000LL + now.tv_nsec +
+             config->duration_ms * 1000000LL;
+  }
+
+  activate_streaming(params);
+
+  while (!stop_requested) {
+    struct frame_signature_t signature;
+    unsigned int depth;
+    int have_signature = 0;
+    int changed;
+    int keep;
+
+    get_frame(params);
+    stats->frames_captured++;
+
+    pthread_mutex_lock(&rec.lock);
+    depth = rec.fifo_len;
+    if (rec.failed) {
+      pthread_mutex_unlock(&rec.lock);
+      hand_back(params, config);
+      break;
+    }
+    pthread_mutex_unlock(&rec.lock);
+
+    /* Throttle up when half the queue is backed up, down once it is nearly
+     * drained. The cooldown gives each level time to take effect. */
+    changed = 0;
+    if (cooldown > 0) {
+      cooldown--;
+    } else if (depth >= rec.slot_count / 2 && level < RECORDER_MAX_THROTTLE) {
+      level++;
+      changed = 1;
+    } else if (depth <= rec.slot_count / 8 && level > 0) {
+      level--;
+      changed = 1;
+    }
+    if (changed) {
+      int quality = apply_quality(params, base_quality, level);
+
+      cooldown = rec.slot_count;
+      if (quality >= 0 &&
+          (stats->min_quality < 0 || quality < stats->min_quality)) {
+        stats->min_quality = quality;
+      }
+    }
+    if (level > stats->max_throttle_level) {
+      stats->max_throttle_level = level;
+    }
+
+    keep = (frame++ & ((1UL << level) - 1)) == 0;
+    if (!keep) {
+      stats->frames_throttled++;
+    } else if (config->dedup_threshold > 0 &&
+               is_duplicate(&dedup, config, params, &signature,
+                            &have_signature)) {
+      stats->frames_deduplicated++;
+    } else {
+      uint64_t timestamp_us =
+          (uint64_t)params->buffer.timestamp.tv_sec * 1000000 +
+          (uint64_t)params->buffer.timestamp.tv_usec;
+      int stored;
+
+      if (config->convert != NULL) {
+        config->convert(params);
+      }
+
+      if (config->stabilizer != NULL) {
+        stored = stabilizer_push(config->stabilizer, params->buffer_start,
+                                 params->buffer.bytesused,
+                                 params->buffer.sequence, timestamp_us) == 0;
+        if (!stored) {
+          stats->frames_dropped++;
+        }
+        enqueue_stabilized(&rec, config->stabilizer, stats, 0);
+      } else {
+        stored = enqueue_frame(&rec, stats, params, NULL, 0,
+                               params->buffer.sequence, timestamp_us, 0);
+      }
+
+      /* Only a frame that will reach the disk becomes the reference. */
+      if (stored) {
+        if (have_signature) {
+          dedup.reference = signature;
+          dedup.have_reference = 1;
+        }
+        dedup.stored_ns = monotonic_ns();
+      }
+    }
+
+    hand_back(params, config);
+
+    if (end_ns != 0) {
+      clock_gettime(CLOCK_MONOTONIC, &now);
+      if (now.tv_sec * 1000000000LL + now.tv_nsec >= end_ns) {
+        break;
+      }
+    }
+  }
+
+  if (config->snapshot != NULL) {
+    snapshot_cache_close(config->snapshot);
+  }
+  deactivate_streaming(params);
+  if (level > 0) {
+    apply_quality(params, base_quality, 0);
+  }
+
+  if (config->stabilizer != NULL) {
+    enqueue_stabilized(&rec, config->stabilizer, stats, 1);
+  }
+
+  /* Let the writer drain what is queued, then collect its figures. */
+  pthread_mutex_lock(&rec.lock);
+  rec.done = 1;
+  pthread_cond_signal(&rec.filled);
+  pthread_mutex_unlock(&rec.lock);
+  pthread_join(writer_thread, NULL);
+  if (segment_writer_close(&rec.writer) < 0 && !rec.failed) {
+    rec.failed = 1;
+    rec.error = errno;
+  }
+
+  stats->frames_written = rec.writer.writes;
+  stats->write_us_avg = rec.writer.write_ns_avg / 1000;
+  stats->write_us_max = rec.writer.write_ns_max / 1000;
+  stats->deleted_segments = rec.writer.deleted_segments;
+  stats->bytes_on_disk = (unsigned long long)rec.writer.total_bytes;
+  stats->signature_us_avg = (unsigned long long)dedup.signature_ns_avg / 1000;
+
+  if (rec.failed) {
+    errno = rec.error;
+    status_code = -1;
+  }
+
+  free_slots(&rec);
+  pthread_cond_destroy(&rec.freed);
+  pthread_cond_destroy(&rec.filled);
+  pthread_mutex_destroy(&rec.lock);
+
+  return status_code;
+}
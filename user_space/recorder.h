@@ -0,0 +1,130 @@
+/**
+ * @file recorder.h
+ * @brief Continuous recording into rotating segments, with a writer thread
+ * that absorbs storage latency spikes and throttling when it falls behind.
+ */
+
+#ifndef RECORDER_H
+#define RECORDER_H
+
+#include <sys/types.h>
+
+#include "camera.h"
+#include "raw_archive.h"
+#include "signature.h"
+#include "snapshot.h"
+#include "stabilizer.h"
+#include "storage.h"
+
+/**
+ * @brief Default depth of the queue between capture and the writer.
+ */
+#define RECORDER_DEFAULT_SLOTS 16
+
+/**
+ * @brief Highest throttle level; level n keeps every 2^n-th frame.
+ */
+#define RECORDER_MAX_THROTTLE 3
+
+/**
+ * @brief JPEG quality given up per throttle level, and the floor.
+ */
+#define RECORDER_QUALITY_STEP 15
+#define RECORDER_QUALITY_MIN 30
+
+/**
+ * @brief Settings of a recording.
+ * @param duration_ms Recording length, 0 runs until SIGINT / SIGTERM.
+ * @param queue_slots Frames that may wait for the writer, 0 for
+ * RECORDER_DEFAULT_SLOTS.
+ * @param segment_bytes Segment size limit, 0 for a single file.
+ * @param max_total_bytes Disk usage limit, oldest segments are deleted to
+ * stay below it. 0 for unlimited.
+ * @param write_mode How segments are written, see enum storage_mode_t.
+ * @param output_path Base path of the segments.
+ * @param convert Optional conversion stage run on each frame.
+ * @param archive Optional raw encoder. When set, frames of a 10-bit Bayer
+ * format are stored as compressed raw archive records, encoded on the
+ * writer thread and the encoder's pool.
+ * @param dedup_threshold Skip frames whose signature is within this many
+ * luma levels of the last stored frame, see frame_signature_distance().
+ * 0 stores every frame.
+ * @param keepalive_ms With deduplication, store a frame at least this often
+ * even if the scene did not change. 0 for never.
+ * @param snapshot Optional latest-frame cache, initialized by the caller.
+ * Every captured frame is published to it, stored or not, and it is closed
+ * before streaming stops.
+ * @param stabilizer Optional stabilizer, initialized by the caller for the
+ * capture format. Stored frames go through it and are written cropped, its
+ * look-ahead later; the frames it still holds when streaming stops are
+ * written after it.
+ */
+struct recorder_config_t {
+  unsigned int duration_ms;
+  unsigned int queue_slots;
+  off_t segment_bytes;
+  off_t max_total_bytes;
+  enum storage_mode_t write_mode;
+  const char *output_path;
+  void (*convert)(struct camera_params_t *params);
+  struct raw_archive_t *archive;
+  unsigned int dedup_threshold;
+  unsigned int keepalive_ms;
+  struct snapshot_cache_t *snapshot;
+  struct stabilizer_t *stabilizer;
+};
+
+/**
+ * @brief Outcome of a recording.
+ * @param frames_captured Frames dequeued from the camera.
+ * @param frames_written Frames stored.
+ * @param frames_throttled Frames skipped on purpose by throttling.
+ * @param frames_dropped Frames lost because the queue was full.
+ * @param frames_deduplicated Frames skipped because they matched the last
+ * stored one.
+ * @param max_queue_depth Deepest the writer queue got.
+ * @param max_throttle_level Highest throttle level reached.
+ * @param min_quality Lowest JPEG quality set, -1 if quality was not
+ * adjustable.
+ * @param write_us_avg Moving average of one frame write, microseconds.
+ * @param write_us_max Slowest frame write, microseconds.
+ * @param deleted_segments Segments removed by rotation or ENOSPC recovery.
+ * @param bytes_on_disk Bytes in the segments left on disk.
+ * @param signature_us_avg Moving average of one signature computation,
+ * microseconds.
+ */
+struct recorder_stats_t {
+  unsigned long frames_captured;
+  unsigned long frames_written;
+  unsigned long frames_throttled;
+  unsigned long frames_dropped;
+  unsigned long frames_deduplicated;
+  unsigned int max_queue_depth;
+  unsigned int max_throttle_level;
+  int min_quality;
+  unsigned long long write_us_avg;
+  unsigned long long write_us_max;
+  unsigned long deleted_segments;
+  unsigned long long bytes_on_disk;
+  unsigned long long signature_us_avg;
+};
+
+/**
+ * @brief Request the running recording to stop. Async-signal-safe.
+ * @return None.
+ */
+void recorder_stop(void);
+
+/**
+ * @brief Record from a device with buffers already mapped and not
+ * streaming. Streaming is off on return.
+ * @param params Capture state.
+ * @param config Settings.
+ * @param stats Outcome, may be NULL.
+ * @return 0 on success, -1 if storage failed for good (errno is set).
+ */
+int run_recorder(struct camera_params_t *params,
+                 const struct recorder_config_t *config,
+                 struct recorder_stats_t *stats);
+
+#endif /* RECORDER_H */
@@ -0,0 +1,1146 @@
+/**
+ * @file rule.c
+ * @brief Capture rules.
+ * @note Programs compile in one pass, by recursive descent, to a stack
+ * machine. && and || jump over their right side, which is the only control
+ * flow besides "if" and "?:", and every jump goes forward, so a run
+ * executes each instruction at most once. The budget still stops a run
+ * after engine->budget instructions, so a long rules file cannot stretch
+ * the frame path either.
+ */
+
+#include "rule.h"
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include <sys/stat.h>
+
+#include "storage.h"
+
+/**
+ * @brief Instructions. Binary operations pop two values and push one.
+ */
+enum {
+  OP_HALT,
+  /** Push constants[arg]. */
+  OP_CONST,
+  /** Push values[arg]. */
+  OP_LOAD,
+  /** Pop into values[arg]. */
+  OP_STORE,
+  OP_ADD,
+  OP_SUB,
+  OP_MUL,
+  OP_DIV,
+  OP_MOD,
+  OP_LT,
+  OP_LE,
+  OP_GT,
+  OP_GE,
+  OP_EQ,
+  OP_NE,
+  OP_MIN,
+  OP_MAX,
+  OP_NEG,
+  OP_NOT,
+  OP_ABS,
+  /** Replace the top with 1 if it is non-zero, else 0. */
+  OP_BOOL,
+  /** Go to arg. */
+  OP_JUMP,
+  /** Pop, and go to arg if it was 0. */
+  OP_JUMP_FALSE,
+  /** Go to arg if the top is 0, keeping it; else pop it. */
+  OP_JUMP_FALSE_KEEP,
+  /** Go to arg if the top is non-zero, keeping it; else pop it. */
+  OP_JUMP_TRUE_KEEP,
+};
+
+/**
+ * @brief Stack effect of each instruction, on the path that falls through.
+ */
+static const signed char op_effect[] = {
+    0,  1,  1,  -1, -1, -1, -1, -1, -1, -1, -1, -1,
+    -1, -1, -1, -1, -1, 0,  0,  0,  0,  0,  -1, -1, -1,
+};
+
+/**
+ * @brief Token kinds.
+ */
+enum {
+  TOKEN_END,
+  TOKEN_NEWLINE,
+  TOKEN_NUMBER,
+  TOKEN_NAME,
+  TOKEN_OPERATOR,
+};
+
+/**
+ * @brief Compiler state.
+ * @param cursor Next character.
+ * @param line Line of the current token.
+ * @param kind Kind of the current token.
+ * @param number Value of a number token.
+ * @param text Text of a name or operator token.
+ * @param depth Stack depth at the current instruction.
+ */
+struct compiler_t {
+  const char *cursor;
+  unsigned int line;
+  int kind;
+  double number;
+  char text[RULE_MAX_NAME];
+  struct rule_program_t *program;
+  int depth;
+  char *error;
+  size_t error_size;
+  int failed;
+};
+
+/**
+ * @brief Record the first error, with its line.
+ */
+static void compile_error(struct compiler_t *c, const char *format, ...) {
+  va_list args;
+  int n;
+
+  if (c->failed) {
+    return;
+  }
+  c->failed = 1;
+  n = snprintf(c->error, c->error_size, "line %u: ", c->line);
+  if (n >= 0 && (size_t)n < c->error_size) {
+    va_start(args, format);
+    vsnprintf(c->error + n, c->error_size - (size_t)n, format, args);
+    va_end(args);
+  }
+}
+
+/**
+ * @brief Read the next token.
+ */
+static void next_token(struct compiler_t *c) {
+  static const char *const pairs[] = {"&&", "||", "==", "!=", "<=", ">="};
+  const char *p = c->cursor;
+  size_t i;
+
+  while (*p == ' ' || *p == '\t' || *p == '\r') {
+    p++;
+  }
+  if (*p == '#') {
+    while (*p != '\0' && *p != '\n') {
+      p++;
+    }
+  }
+
+  c->text[0] = '\0';
+  if (*p == '\0') {
+    c->kind = TOKEN_END;
+  } else if (*p == '\n' || *p == ';') {
+    c->kind = TOKEN_NEWLINE;
+    p++;
+  } else if (isdigit((unsigned char)*p) || *p == '.') {
+    char *end;
+
+    c->kind = TOKEN_NUMBER;
+    c->number = strtod(p, &end);
+    p = end;
+  } else if (isalpha((unsigned char)*p) || *p == '_') {
+    size_t n = 0;
+
+    c->kind = TOKEN_NAME;
+    while (isalnum((unsigned char)*p) || *p == '_') {
+      if (n + 1 < sizeof(c->text)) {
+        c->text[n++] = *p;
+      } else {
+        compile_error(c, "name longer than %d characters",
+                      RULE_MAX_NAME - 1);
+      }
+      p++;
+    }
+    c->text[n] = '\0';
+  } else {
+    c->kind = TOKEN_OPERATOR;
+    c->text[0] = *p;
+    c->text[1] = '\0';
+    for (i = 0; i < sizeof(pairs) / sizeof(pairs[0]); i++) {
+      if (p[0] == pairs[i][0] && p[1] == pairs[i][1]) {
+        c->text[1] = p[1];
+        c->text[2] = '\0';
+        p++;
+        break;
+      }
+    }
+    p++;
+  }
+  c->cursor = p;
+}
+
+/**
+ * @brief Tell whether the current token is an operator or keyword.
+ */
+static int is_token(const struct compiler_t *c, const char *text) {
+  return (c->kind == TOKEN_OPERATOR || c->kind == TOKEN_NAME) &&
+         strcmp(c->text, text) == 0;
+}
+
+/**
+ * @brief Consume an expected operator or keyword.
+ */
+static void expect(struct compiler_t *c, const char *text) {
+  if (!is_token(c, text)) {
+    compile_error(c, "expected '%s'", text);
+    return;
+  }
+  next_token(c);
+}
+
+/**
+ * @brief Append an instruction.
+ * @return Its index, for patching a jump.
+ */
+static unsigned int emit(struct compiler_t *c, uint8_t op, unsigned int arg) {
+  struct rule_program_t *program = c->program;
+
+  if (program->length == RULE_MAX_CODE) {
+    compile_error(c, "more than %d instructions", RULE_MAX_CODE);
+    return 0;
+  }
+  program->code[program->length].op = op;
+  program->code[program->length].arg = (uint16_t)arg;
+  c->depth += op_effect[op];
+  if (c->depth > (int)program->stack_depth) {
+    program->stack_depth = (unsigned int)c->depth;
+    if (c->depth > RULE_MAX_STACK) {
+      compile_error(c, "expression nested too deeply");
+    }
+  }
+  return program->length++;
+}
+
+/**
+ * @brief Point a jump at the next instruction.
+ */
+static void patch(struct compiler_t *c, unsigned int jump) {
+  c->program->code[jump].arg = (uint16_t)c->program->length;
+}
+
+/**
+ * @brief Slot of a variable, added on first use.
+ */
+static unsigned int variable_slot(struct compiler_t *c, const char *name) {
+  struct rule_program_t *program = c->program;
+  int slot = rule_variable(program, name);
+
+  if (slot >= 0) {
+    return (unsigned int)slot;
+  }
+  if (program->variable_count == RULE_MAX_VARIABLES) {
+    compile_error(c, "more than %d variables", RULE_MAX_VARIABLES);
+    return 0;
+  }
+  snprintf(program->names[program->variable_count], RULE_MAX_NAME, "%s",
+           name);
+  return program->variable_count++;
+}
+
+/**
+ * @brief Index of a constant, added on first use.
+ */
+static unsigned int constant_index(struct compiler_t *c, double value) {
+  struct rule_program_t *program = c->program;
+  unsigned int i;
+
+  for (i = 0; i < program->constant_count; i++) {
+    if (program->constants[i] == value) {
+      return i;
+    }
+  }
+  if (program->constant_count == RULE_MAX_CONSTANTS) {
+    compile_error(c, "more than %d constants", RULE_MAX_CONSTANTS);
+    return 0;
+  }
+  program->constants[program->constant_count] = value;
+  return program->constant_count++;
+}
+
+static void parse_expression(struct compiler_t *c);
+
+static void parse_primary(struct compiler_t *c) {
+  static const struct {
+    const char *name;
+    uint8_t op;
+    unsigned int args;
+  } functions[] = {{"min", OP_MIN, 2}, {"max", OP_MAX, 2}, {"abs", OP_ABS, 1}};
+  char name[RULE_MAX_NAME];
+  size_t f;
+
+  if (c->failed) {
+    return;
+  }
+  if (c->kind == TOKEN_NUMBER) {
+    emit(c, OP_CONST, constant_index(c, c->number));
+    next_token(c);
+    return;
+  }
+  if (is_token(c, "(")) {
+    next_token(c);
+    parse_expression(c);
+    expect(c, ")");
+    return;
+  }
+  if (c->kind != TOKEN_NAME || is_token(c, "if") || is_token(c, "then")) {
+    compile_error(c, "expected a value");
+    return;
+  }
+
+  snprintf(name, sizeof(name), "%s", c->text);
+  next_token(c);
+  if (!is_token(c, "(")) {
+    emit(c, OP_LOAD, variable_slot(c, name));
+    return;
+  }
+  for (f = 0; f < sizeof(functions) / sizeof(functions[0]); f++) {
+    if (strcmp(name, functions[f].name) == 0) {
+      unsigned int i;
+
+      next_token(c);
+      for (i = 0; i < functions[f].args; i++) {
+        if (i > 0) {
+          expect(c, ",");
+        }
+        parse_expression(c);
+      }
+      expect(c, ")");
+      emit(c, functions[f].op, 0);
+      return;
+    }
+  }
+  compile_error(c, "unknown function %s", name);
+}
+
+static void parse_unary(struct compiler_t *c) {
+  if (is_token(c, "-") || is_token(c, "!")) {
+    uint8_t op = c->text[0] == '-' ? OP_NEG : OP_NOT;
+
+    next_token(c);
+    parse_unary(c);
+    emit(c, op, 0);
+    return;
+  }
+  parse_primary(c);
+}
+
+/**
+ * @brief Parse a left-associative chain of binary operators.
+ * @param level Precedence level, 0 the loosest handled here.
+ */
+static void parse_binary(struct compiler_t *c, int level) {
+  static const struct {
+    const char *text;
+    uint8_t op;
+    int level;
+  } operators[] = {
+      {"==", OP_EQ, 0},  {"!=", OP_NE, 0},  {"<", OP_LT, 1},
+      {"<=", OP_LE, 1},  {">", OP_GT, 1},   {">=", OP_GE, 1},
+      {"+", OP_ADD, 2},  {"-", OP_SUB, 2},  {"*", OP_MUL, 3},
+      {"/", OP_DIV, 3},  {"%", OP_MOD, 3},
+  };
+  size_t i;
+
+  if (level > 3) {
+    parse_unary(c);
+    return;
+  }
+  parse_binary(c, level + 1);
+  while (!c->failed && c->kind == TOKEN_OPERATOR) {
+    for (i = 0; i < sizeof(operators) / sizeof(operators[0]); i++) {
+      if (operators[i].level == level &&
+          strcmp(c->text, operators[i].text) == 0) {
+        break;
+      }
+    }
+    if (i == sizeof(operators) / sizeof(operators[0])) {
+      return;
+    }
+    next_token(c);
+    parse_binary(c, level + 1);
+    emit(c, operators[i].op, 0);
+  }
+}
+
+static void parse_and(struct compiler_t *c) {
+  parse_binary(c, 0);
+  while (!c->failed && is_token(c, "&&")) {
+    unsigned int jump;
+
+    next_token(c);
+    jump = emit(c, OP_JUMP_FALSE_KEEP, 0);
+    parse_binary(c, 0);
+    patch(c, jump);
+    emit(c, OP_BOOL, 0);
+  }
+}
+
+static void parse_or(struct compiler_t *c) {
+  parse_and(c);
+  while (!c->failed && is_token(c, "||")) {
+    unsigned int jump;
+
+    next_token(c);
+    jump = emit(c, OP_JUMP_TRUE_KEEP, 0);
+    parse_and(c);
+    patch(c, jump);
+    emit(c, OP_BOOL, 0);
+  }
+}
+
+static void parse_expression(struct compiler_t *c) {
+  unsigned int skip_true;
+  unsigned int skip_false;
+
+  parse_or(c);
+  if (c->failed || !is_token(c, "?")) {
+    return;
+  }
+  next_token(c);
+  skip_true = emit(c, OP_JUMP_FALSE, 0);
+  parse_expression(c);
+  expect(c, ":");
+  skip_false = emit(c, OP_JUMP, 0);
+  patch(c, skip_true);
+  /* Only one side runs. */
+  c->depth--;
+  parse_expression(c);
+  patch(c, skip_false);
+}
+
+static void parse_assignment(struct compiler_t *c) {
+  char name[RULE_MAX_NAME];
+
+  if (c->kind != TOKEN_NAME || is_token(c, "if") || is_token(c, "then")) {
+    compile_error(c, "expected a variable");
+    return;
+  }
+  snprintf(name, sizeof(name), "%s", c->text);
+  next_token(c);
+  expect(c, "=");
+  parse_expression(c);
+  emit(c, OP_STORE, variable_slot(c, name));
+}
+
+static void parse_statement(struct compiler_t *c) {
+  unsigned int skip;
+
+  if (!is_token(c, "if")) {
+    parse_assignment(c);
+    return;
+  }
+  next_token(c);
+  parse_expression(c);
+  expect(c, "then");
+  skip = emit(c, OP_JUMP_FALSE, 0);
+  parse_assignment(c);
+  patch(c, skip);
+}
+
+int rule_compile(const char *source, struct rule_program_t *program,
+                 char *error, size_t error_size) {
+  struct compiler_t c;
+
+  memset(program, 0, sizeof(*program));
+  memset(&c, 0, sizeof(c));
+  c.cursor = source;
+  c.line = 1;
+  c.program = program;
+  c.error = error;
+  c.error_size = error_size;
+  if (error_size > 0) {
+    error[0] = '\0';
+  }
+
+  next_token(&c);
+  while (!c.failed && c.kind != TOKEN_END) {
+    if (c.kind == TOKEN_NEWLINE) {
+      if (c.cursor[-1] == '\n') {
+        c.line++;
+      }
+      next_token(&c);
+      continue;
+    }
+    parse_statement(&c);
+    if (!c.failed && c.kind != TOKEN_NEWLINE && c.kind != TOKEN_END) {
+      compile_error(&c, "unexpected '%s'",
+                    c.kind == TOKEN_NUMBER ? "number" : c.text);
+    }
+  }
+  emit(&c, OP_HALT, 0);
+
+  if (c.failed) {
+    errno = EINVAL;
+    return -1;
+  }
+  return 0;
+}
+
+int rule_variable(const struct rule_program_t *program, const char *name) {
+  unsigned int i;
+
+  for (i = 0; i < program->variable_count; i++) {
+    if (strcmp(program->names[i], name) == 0) {
+      return (int)i;
+    }
+  }
+  return -1;
+}
+
+void rule_engine_init(struct rule_engine_t *engine, unsigned int budget) {
+  memset(engine, 0, sizeof(*engine));
+  engine->budget = budget ? budget : RULE_DEFAULT_BUDGET;
+  engine->program.length = 1;
+  engine->program.code[0].op = OP_HALT;
+}
+
+void rule_engine_load(struct rule_engine_t *engine,
+                      const struct rule_program_t *program) {
+  double values[RULE_MAX_VARIABLES];
+  unsigned int i;
+
+  for (i = 0; i < program->variable_count; i++) {
+    int old = rule_variable(&engine->program, program->names[i]);
+
+    values[i] = old >= 0 ? engine->values[old] : 0;
+  }
+  engine->program = *program;
+  memset(engine->values, 0, sizeof(engine->values));
+  memcpy(engine->values, values, program->variable_count * sizeof(double));
+}
+
+/**
+ * @brief Current CLOCK_MONOTONIC time in nanoseconds.
+ */
+static long long monotonic_ns(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+int rule_run(struct rule_engine_t *engine) {
+  const struct rule_instruction_t *code = engine->program.code;
+  const double *constants = engine->program.constants;
+  double *values = engine->values;
+  double stack[RULE_MAX_STACK];
+  long long start = monotonic_ns();
+  long long elapsed;
+  unsigned int budget = engine->budget;
+  unsigned int pc = 0;
+  unsigned int executed = 0;
+  int top = -1;
+  int status = 0;
+
+  for (;;) {
+    const struct rule_instruction_t *in = &code[pc++];
+    double b;
+
+    if (executed++ == budget) {
+      engine->overruns++;
+      errno = ETIME;
+      status = -1;
+      break;
+    }
+    switch (in->op) {
+    case OP_HALT:
+      goto done;
+    case OP_CONST:
+      stack[++top] = constants[in->arg];
+      break;
+    case OP_LOAD:
+      stack[++top] = values[in->arg];
+      break;
+    case OP_STORE:
+      values[in->arg] = stack[top--];
+      break;
+    case OP_JUMP:
+      pc = in->arg;
+      break;
+    case OP_JUMP_FALSE:
+      if (stack[top--] == 0) {
+        pc = in->arg;
+      }
+      break;
+    case OP_JUMP_FALSE_KEEP:
+      if (stack[top] == 0) {
+        pc = in->arg;
+      } else {
+        top--;
+      }
+      break;
+    case OP_JUMP_TRUE_KEEP:
+      if (stack[top] != 0) {
+        pc = in->arg;
+      } else {
+        top--;
+      }
+      break;
+    case OP_NEG:
+      stack[top] = -stack[top];
+      break;
+    case OP_NOT:
+      stack[top] = stack[top] == 0;
+      break;
+    case OP_ABS:
+      stack[top] = fabs(stack[top]);
+      break;
+    case OP_BOOL:
+      stack[top] = stack[top] != 0;
+      break;
+    default:
+      b = stack[top--];
+      switch (in->op) {
+      case OP_ADD:
+        stack[top] += b;
+        break;
+      case OP_SUB:
+        stack[top] -= b;
+        break;
+      case OP_MUL:
+        stack[top] *= b;
+        break;
+      case OP_DIV:
+      case OP_MOD:
+        if (b == 0) {
+          engine->errors++;
+          errno = EDOM;
+          status = -1;
+          goto done;
+        }
+        stack[top] = in->op == OP_DIV ? stack[top] / b : fmod(stack[top], b);
+        break;
+      case OP_LT:
+        stack[top] = stack[top] < b;
+        break;
+      case OP_LE:
+        stack[top] = stack[top] <= b;
+        break;
+      case OP_GT:
+        stack[top] = stack[top] > b;
+        break;
+      case OP_GE:
+        stack[top] = stack[top] >= b;
+        break;
+      case OP_EQ:
+        stack[top] = stack[top] == b;
+        break;
+      case OP_NE:
+        stack[top] = stack[top] != b;
+        break;
+      case OP_MIN:
+        stack[top] = b < stack[top] ? b : stack[top];
+        break;
+      case OP_MAX:
+        stack[top] = b > stack[top] ? b : stack[top];
+        break;
+      }
+      break;
+    }
+  }
+
+done:
+  elapsed = monotonic_ns() - start;
+  engine->run_ns_avg = engine->runs == 0
+                           ? elapsed
+                           : engine->run_ns_avg +
+                                 (elapsed - engine->run_ns_avg) / 8;
+  if (elapsed > engine->run_ns_max) {
+    engine->run_ns_max = elapsed;
+  }
+  if (executed > engine->instructions_max) {
+    engine->instructions_max = executed;
+  }
+  engine->runs++;
+  return status;
+}
+
+void rule_cache_init(struct rule_cache_t *cache) {
+  memset(cache, 0, sizeof(*cache));
+}
+
+/**
+ * @brief FNV-1a hash of a string.
+ */
+static uint64_t source_hash(const char *source) {
+  uint64_t hash = 14695981039346656037ULL;
+
+  while (*source != '\0') {
+    hash = (hash ^ (uint8_t)*source++) * 1099511628211ULL;
+  }
+  return hash;
+}
+
+int rule_cache_compile(struct rule_cache_t *cache, const char *source,
+                       const struct rule_program_t **program, char *error,
+                       size_t error_size) {
+  uint64_t hash = source_hash(source);
+  struct rule_cache_slot_t *victim = &cache->slots[0];
+  struct rule_program_t compiled;
+  unsigned int i;
+  char *copy;
+
+  cache->clock++;
+  for (i = 0; i < RULE_CACHE_SLOTS; i++) {
+    struct rule_cache_slot_t *slot = &cache->slots[i];
+
+    if (slot->source != NULL && slot->hash == hash &&
+        strcmp(slot->source, source) == 0) {
+      slot->last_used = cache->clock;
+      cache->hits++;
+      *program = &slot->program;
+      return 0;
+    }
+    if (slot->source == NULL ||
+        (victim->source != NULL && slot->last_used < victim->last_used)) {
+      victim = slot;
+    }
+  }
+
+  cache->compiles++;
+  if (rule_compile(source, &compiled, error, error_size) < 0) {
+    return -1;
+  }
+  copy = strdup(source);
+  if (copy == NULL) {
+    snprintf(error, error_size, "out of memory");
+    errno = ENOMEM;
+    return -1;
+  }
+  free(victim->source);
+  victim->source = copy;
+  victim->hash = hash;
+  victim->last_used = cache->clock;
+  victim->program = compiled;
+  *program = &victim->program;
+  return 0;
+}
+
+void rule_cache_destroy(struct rule_cache_t *cache) {
+  unsigned int i;
+
+  for (i = 0; i < RULE_CACHE_SLOTS; i++) {
+    free(cache->slots[i].source);
+    cache->slots[i].source = NULL;
+  }
+}
+
+/**
+ * @brief Variables of the rule stage, by index into its slots.
+ */
+enum {
+  VAR_SEQUENCE,
+  VAR_FRAME,
+  VAR_TIME,
+  VAR_INTERVAL_MS,
+  VAR_DROPPED,
+  VAR_BYTES,
+  VAR_WIDTH,
+  VAR_HEIGHT,
+  VAR_SAVED,
+  VAR_LUMA,
+  VAR_CHANGE,
+  VAR_SAVE,
+  VAR_ROI_X,
+  VAR_ROI_Y,
+  VAR_ROI_W,
+  VAR_ROI_H,
+};
+
+static const char *const stage_variables[RULE_STAGE_VARIABLES] = {
+    "sequence", "frame", "time",  "interval_ms", "dropped", "bytes",
+    "width",    "height", "saved", "luma",        "change",  "save",
+    "roi_x",    "roi_y",  "roi_w", "roi_h",
+};
+
+/**
+ * @brief Largest rules file read.
+ */
+#define RULE_MAX_SOURCE 65536
+
+/**
+ * @brief Read the rules file and switch to it.
+ * @return 0 on success, -1 with a message on stderr.
+ */
+static int load_rules(struct rule_stage_t *stage) {
+  const struct rule_program_t *program;
+  struct stat st;
+  char error[160];
+  char *source;
+  ssize_t length;
+  unsigned int i;
+  int fd;
+
+  fd = open(stage->rules_path, O_RDONLY | O_CLOEXEC);
+  if (fd < 0 || fstat(fd, &st) < 0) {
+    perror(stage->rules_path);
+    if (fd >= 0) {
+      close(fd);
+    }
+    return -1;
+  }
+  stage->mtime = st.st_mtim;
+  source = malloc(RULE_MAX_SOURCE + 1);
+  if (source == NULL) {
+    close(fd);
+    return -1;
+  }
+  length = read(fd, source, RULE_MAX_SOURCE);
+  close(fd);
+  if (length < 0) {
+    perror(stage->rules_path);
+    free(source);
+    return -1;
+  }
+  source[length] = '\0';
+
+  if (rule_cache_compile(&stage->cache, source, &program, error,
+                         sizeof(error)) < 0) {
+    fprintf(stderr, "%s: %s\n", stage->rules_path, error);
+    free(source);
+    errno = EINVAL;
+    return -1;
+  }
+  free(source);
+  rule_engine_load(&stage->engine, program);
+  for (i = 0; i < RULE_STAGE_VARIABLES; i++) {
+    stage->slots[i] = rule_variable(program, stage_variables[i]);
+  }
+  return 0;
+}
+
+static void *rule_writer_main(void *arg);
+
+static int rule_stage_init(void **state, const struct v4l2_format *format,
+                           const char *args) {
+  struct rule_stage_t *stage;
+  const char *split = strchr(args, ':');
+
+  if (split == NULL || split == args || split[1] == '\0') {
+    errno = EINVAL;
+    return -1;
+  }
+  stage = calloc(1, sizeof(*stage));
+  if (stage == NULL) {
+    return -1;
+  }
+  snprintf(stage->rules_path, sizeof(stage->rules_path), "%.*s",
+           (int)(split - args), args);
+  snprintf(stage->output_path, sizeof(stage->output_path), "%s", split + 1);
+  rule_cache_init(&stage->cache);
+  rule_engine_init(&stage->engine, 0);
+  stage->croppable = format->fmt.pix.pixelformat == V4L2_PIX_FMT_GREY ||
+                     format->fmt.pix.pixelformat == V4L2_PIX_FMT_YUYV;
+  if (load_rules(stage) < 0) {
+    int saved = errno;
+
+    rule_cache_destroy(&stage->cache);
+    free(stage);
+    errno = saved;
+    return -1;
+  }
+  pthread_mutex_init(&stage->lock, NULL);
+  pthread_cond_init(&stage->queued, NULL);
+  pthread_cond_init(&stage->written, NULL);
+  errno = pthread_create(&stage->writer, NULL, rule_writer_main, stage);
+  if (errno != 0) {
+    pthread_cond_destroy(&stage->written);
+    pthread_cond_destroy(&stage->queued);
+    pthread_mutex_destroy(&stage->lock);
+    rule_cache_destroy(&stage->cache);
+    free(stage);
+    return -1;
+  }
+  *state = stage;
+  return 0;
+}
+
+/**
+ * @brief Reread the rules file if it changed, at most once a second of
+ * stream time.
+ */
+static void check_rules(struct rule_stage_t *stage, uint64_t timestamp_us) {
+  struct stat st;
+
+  if (timestamp_us - stage->checked_us < 1000000) {
+    return;
+  }
+  stage->checked_us = timestamp_us;
+  if (stat(stage->rules_path, &st) < 0 ||
+      (st.st_mtim.tv_sec == stage->mtime.tv_sec &&
+       st.st_mtim.tv_nsec == stage->mtime.tv_nsec)) {
+    return;
+  }
+  if (load_rules(stage) < 0) {
+    stage->reload_errors++;
+    /* Not again until it changes. */
+    stage->mtime = st.st_mtim;
+  } else {
+    stage->reloads++;
+  }
+}
+
+/**
+ * @brief Set a variable if the program uses it.
+ */
+static void set_input(struct rule_stage_t *stage, int variable, double value) {
+  if (stage->slots[variable] >= 0) {
+    stage->engine.values[stage->slots[variable]] = value;
+  }
+}
+
+/**
+ * @brief Output variable, 0 if the program does not set it.
+ */
+static double get_output(const struct rule_stage_t *stage, int variable) {
+  return stage->slots[variable] >= 0
+             ? stage->engine.values[stage->slots[variable]]
+             : 0;
+}
+
+/**
+ * @brief Writer thread: write the queued saves in order until told to
+ * quit with none left.
+ */
+static void *rule_writer_main(void *arg) {
+  struct rule_stage_t *stage = arg;
+
+  pthread_mutex_lock(&stage->lock);
+  for (;;) {
+    struct rule_save_t *save;
+    int status;
+    int fd;
+
+    while (stage->count == 0 && !stage->quit) {
+      pthread_cond_wait(&stage->queued, &stage->lock);
+    }
+    if (stage->count == 0) {
+      break;
+    }
+    save = &stage->saves[stage->head];
+    pthread_mutex_unlock(&stage->lock);
+
+    fd = open(save->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0660);
+    status = fd < 0 ? -1 : write_full(fd, save->data, save->bytes);
+    if (status < 0 || close(fd) < 0) {
+      perror(save->path);
+      status = -1;
+    }
+
+    pthread_mutex_lock(&stage->lock);
+    if (status < 0) {
+      stage->save_errors++;
+    }
+    stage->head = (stage->head + 1) % RULE_SAVE_QUEUE;
+    stage->count--;
+    pthread_cond_broadcast(&stage->written);
+  }
+  pthread_mutex_unlock(&stage->lock);
+  return NULL;
+}
+
+void rule_stage_drain(struct rule_stage_t *stage) {
+  pthread_mutex_lock(&stage->lock);
+  while (stage->count > 0) {
+    pthread_cond_wait(&stage->written, &stage->lock);
+  }
+  pthread_mutex_unlock(&stage->lock);
+}
+
+/**
+ * @brief Copy the frame, or the region of interest of it, out for the
+ * writer thread, bound for the next numbered file.
+ * @return 0 on success, -1 if the copy could not be allocated.
+ */
+static int save_frame(struct rule_stage_t *stage,
+                      const struct stage_view_t *view) {
+  const struct v4l2_pix_format *pix = &view->format->fmt.pix;
+  double roi_x = get_output(stage, VAR_ROI_X);
+  double roi_y = get_output(stage, VAR_ROI_Y);
+  double roi_w = get_output(stage, VAR_ROI_W);
+  double roi_h = get_output(stage, VAR_ROI_H);
+  int crop = stage->croppable && roi_w >= 1 && roi_h >= 1 &&
+             view->bytes >= (size_t)pix->bytesperline * pix->height;
+  size_t bpp = pix->pixelformat == V4L2_PIX_FMT_YUYV ? 2 : 1;
+  __u32 x = 0;
+  __u32 y = 0;
+  __u32 w = 0;
+  __u32 h = 0;
+  struct rule_save_t *save;
+  size_t bytes = 0;
+  unsigned int plane;
+  __u32 row;
+
+  if (crop) {
+    x = roi_x > 0 ? (__u32)fmin(roi_x, pix->width - 1) : 0;
+    y = roi_y > 0 ? (__u32)fmin(roi_y, pix->height - 1) : 0;
+    w = (__u32)fmin(roi_w, pix->width - x);
+    h = (__u32)fmin(roi_h, pix->height - y);
+    /* Whole YUYV macropixels. */
+    if (bpp == 2) {
+      x &= ~1u;
+      w = w > 1 ? w & ~1u : 2;
+    }
+    bytes = (size_t)w * h * bpp;
+  } else {
+    /* The other planes of a whole multi-planar frame follow the first. */
+    for (plane = 0; plane < view->plane_count; plane++) {
+      bytes += view->planes[plane].bytes;
+    }
+  }
+
+  /* Only the writer frees slots; one not yet counted is the stage's. */
+  pthread_mutex_lock(&stage->lock);
+  while (stage->count == RULE_SAVE_QUEUE) {
+    pthread_cond_wait(&stage->written, &stage->lock);
+  }
+  save = &stage->saves[(stage->head + stage->count) % RULE_SAVE_QUEUE];
+  pthread_mutex_unlock(&stage->lock);
+
+  if (save->capacity < bytes) {
+    uint8_t *data = realloc(save->data, bytes);
+
+    if (data == NULL) {
+      return -1;
+    }
+    save->data = data;
+    save->capacity = bytes;
+  }
+  if (crop) {
+    for (row = 0; row < h; row++) {
+      memcpy(save->data + (size_t)row * w * bpp,
+             (const uint8_t *)view->data +
+                 (size_t)(y + row) * pix->bytesperline + x * bpp,
+             w * bpp);
+    }
+  } else {
+    size_t offset = 0;
+
+    for (plane = 0; plane < view->plane_count; plane++) {
+      memcpy(save->data + offset, view->planes[plane].data,
+             view->planes[plane].bytes);
+      offset += view->planes[plane].bytes;
+    }
+  }
+  save->bytes = bytes;
+  numbered_path(save->path, sizeof(save->path), stage->output_path,
+                stage->saved);
+  stage->saved++;
+
+  pthread_mutex_lock(&stage->lock);
+  stage->count++;
+  pthread_cond_signal(&stage->queued);
+  pthread_mutex_unlock(&stage->lock);
+  return 0;
+}
+
+static int rule_stage_process(void *state, const struct stage_view_t *view,
+                              const struct stage_metadata_t *metadata) {
+  struct rule_stage_t *stage = state;
+  const struct v4l2_pix_format *pix = &view->format->fmt.pix;
+  __u32 dropped = 0;
+
+  if (stage->frames == 0) {
+    stage->first_us = metadata->timestamp_us;
+    stage->checked_us = metadata->timestamp_us;
+  } else {
+    dropped = metadata->sequence - stage->next_sequence;
+  }
+  check_rules(stage, metadata->timestamp_us);
+
+  set_input(stage, VAR_SEQUENCE, metadata->sequence);
+  set_input(stage, VAR_FRAME, (double)stage->frames);
+  set_input(stage, VAR_TIME,
+            (double)(metadata->timestamp_us - stage->first_us) / 1e6);
+  set_input(stage, VAR_INTERVAL_MS,
+            stage->frames == 0
+                ? 0
+                : (double)(metadata->timestamp_us - stage->last_us) / 1e3);
+  set_input(stage, VAR_DROPPED, dropped);
+  set_input(stage, VAR_BYTES, (double)view->bytes);
+  set_input(stage, VAR_WIDTH, pix->width);
+  set_input(stage, VAR_HEIGHT, pix->height);
+  set_input(stage, VAR_SAVED, (double)stage->saved);
+  set_input(stage, VAR_SAVE, 0);
+  /* The signature is the only look at the pixels, and only when asked. */
+  if (stage->slots[VAR_LUMA] >= 0 || stage->slots[VAR_CHANGE] >= 0) {
+    struct frame_signature_t signature;
+
+    if (frame_signature_compute(pix, view->data, view->bytes, &signature) ==
+        0) {
+      unsigned int sum = 0;
+      unsigned int i;
+
+      for (i = 0; i < SIGNATURE_ROWS * SIGNATURE_COLUMNS; i++) {
+        sum += signature.cells[i];
+      }
+      set_input(stage, VAR_LUMA,
+                (double)sum / (SIGNATURE_ROWS * SIGNATURE_COLUMNS));
+      set_input(stage, VAR_CHANGE,
+                stage->frames == 0
+                    ? 0
+                    : frame_signature_distance(&signature,
+                                               &stage->last_signature));
+      stage->last_signature = signature;
+    }
+  }
+  stage->next_sequence = metadata->sequence + 1;
+  stage->last_us = metadata->timestamp_us;
+  stage->frames++;
+
+  if (rule_run(&stage->engine) < 0) {
+    return -1;
+  }
+  if (get_output(stage, VAR_SAVE) != 0) {
+    return save_frame(stage, view);
+  }
+  return 0;
+}
+
+static void rule_stage_destroy(void *state) {
+  struct rule_stage_t *stage = state;
+  unsigned int i;
+
+  if (stage == NULL) {
+    return;
+  }
+  /* The writer finishes what is queued first. */
+  pthread_mutex_lock(&stage->lock);
+  stage->quit = 1;
+  pthread_cond_signal(&stage->queued);
+  pthread_mutex_unlock(&stage->lock);
+  pthread_join(stage->writer, NULL);
+  pthread_cond_destroy(&stage->written);
+  pthread_cond_destroy(&stage->queued);
+  pthread_mutex_destroy(&stage->lock);
+  for (i = 0; i < RULE_SAVE_QUEUE; i++) {
+    free(stage->saves[i].data);
+  }
+  rule_cache_destroy(&stage->cache);
+  free(stage);
+}
+
+const struct stage_descriptor_t rule_stage = {
+    .abi_version = STAGE_ABI_VERSION,
+    .name = "rules",
+    .cost_us = 20,
+    .threading = STAGE_THREAD_CALLER,
+    .init = rule_stage_init,
+    .process = rule_stage_process,
+    .destroy = rule_stage_destroy,
+};
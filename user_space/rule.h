@@ -0,0 +1,329 @@
+/**
+ * @file rule.h
+ * @brief Capture rules evaluated on every frame: a few lines of arithmetic
+ * over per-frame metadata and statistics, never pixels, compiled once to
+ * bytecode and run under a hard instruction budget. They let an operator
+ * change when frames are saved and which region, without a rebuild.
+ *
+ * A rules file holds one statement per line (or separated by ';'), '#'
+ * starting a comment:
+ *
+ *   # Save the middle of the frame whenever the scene changes, at most
+ *   # once a second.
+ *   if change > 12 && time - last > 1 then save = 1
+ *   if save then last = time
+ *   roi_w = width / 2; roi_h = height / 2
+ *   roi_x = width / 4; roi_y = height / 4
+ *
+ * Statements are "NAME = EXPR" and "if EXPR then NAME = EXPR". Expressions
+ * have numbers, variables, + - * / %, comparisons, && || !, "c ? a : b",
+ * parentheses and min(a, b), max(a, b), abs(a). Values are doubles, 0 is
+ * false. Variables the host does not set keep their value from frame to
+ * frame and start at 0. There are no loops, so a program runs at most its
+ * own length.
+ */
+
+#ifndef RULE_H
+#define RULE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <time.h>
+
+#include <linux/videodev2.h>
+
+#include "signature.h"
+#include "stage.h"
+
+/**
+ * @brief Most instructions in a program.
+ */
+#define RULE_MAX_CODE 1024
+
+/**
+ * @brief Most constants and variables in a program.
+ */
+#define RULE_MAX_CONSTANTS 128
+#define RULE_MAX_VARIABLES 64
+
+/**
+ * @brief Longest variable name.
+ */
+#define RULE_MAX_NAME 32
+
+/**
+ * @brief Deepest expression evaluation stack.
+ */
+#define RULE_MAX_STACK 32
+
+/**
+ * @brief Instructions one run may execute when no budget is given.
+ */
+#define RULE_DEFAULT_BUDGET 512
+
+/**
+ * @brief Compiled programs kept by a cache.
+ */
+#define RULE_CACHE_SLOTS 8
+
+/**
+ * @brief One instruction.
+ * @param op Operation, see rule.c.
+ * @param arg Constant, variable or jump target.
+ */
+struct rule_instruction_t {
+  uint8_t op;
+  uint16_t arg;
+};
+
+/**
+ * @brief A compiled program.
+ * @param code Instructions, ending with a halt.
+ * @param length Number of instructions.
+ * @param constants Constant pool.
+ * @param constant_count Number of constants.
+ * @param names Variable names, by slot.
+ * @param variable_count Number of variables.
+ * @param stack_depth Deepest stack it needs.
+ */
+struct rule_program_t {
+  struct rule_instruction_t code[RULE_MAX_CODE];
+  unsigned int length;
+  double constants[RULE_MAX_CONSTANTS];
+  unsigned int constant_count;
+  char names[RULE_MAX_VARIABLES][RULE_MAX_NAME];
+  unsigned int variable_count;
+  unsigned int stack_depth;
+};
+
+/**
+ * @brief A program with its variables, and what running it costs.
+ * @param program Program run.
+ * @param values Variable values, by slot.
+ * @param budget Instructions one run may execute.
+ * @param runs Runs so far.
+ * @param overruns Runs stopped by the budget.
+ * @param errors Runs stopped by a division by zero.
+ * @param instructions_max Most instructions one run executed.
+ * @param run_ns_avg Moving average of one run, nanoseconds.
+ * @param run_ns_max Slowest run, nanoseconds.
+ */
+struct rule_engine_t {
+  struct rule_program_t program;
+  double values[RULE_MAX_VARIABLES];
+  unsigned int budget;
+  unsigned long runs;
+  unsigned long overruns;
+  unsigned long errors;
+  unsigned int instructions_max;
+  long long run_ns_avg;
+  long long run_ns_max;
+};
+
+/**
+ * @brief A compiled program and the source it came from.
+ * @param source Source text, NULL for a free slot.
+ * @param hash Hash of the source.
+ * @param last_used Cache clock when it was last looked up.
+ */
+struct rule_cache_slot_t {
+  char *source;
+  uint64_t hash;
+  unsigned long last_used;
+  struct rule_program_t program;
+};
+
+/**
+ * @brief Compiled programs by source text, so switching back to a rules
+ * file seen before costs a hash and a compare, not a compile.
+ * @param clock Lookups so far.
+ * @param hits Lookups answered from the cache.
+ * @param compiles Lookups that compiled.
+ */
+struct rule_cache_t {
+  struct rule_cache_slot_t slots[RULE_CACHE_SLOTS];
+  unsigned long clock;
+  unsigned long hits;
+  unsigned long compiles;
+};
+
+/**
+ * @brief Compile a program.
+ * @param source Program text, NUL terminated.
+ * @param program Destination.
+ * @param error Set to a message with the line number on failure.
+ * @param error_size Size of error.
+ * @return 0 on success, -1 with errno set to EINVAL.
+ */
+int rule_compile(const char *source, struct rule_program_t *program,
+                 char *error, size_t error_size);
+
+/**
+ * @brief Find a variable of a program.
+ * @param program Program.
+ * @param name Variable name.
+ * @return Its slot, or -1 if the program does not use it.
+ */
+int rule_variable(const struct rule_program_t *program, const char *name);
+
+/**
+ * @brief Set up an engine with no program: runs do nothing.
+ * @param engine Engine to initialize.
+ * @param budget Instructions one run may execute, 0 for
+ * RULE_DEFAULT_BUDGET.
+ * @return None.
+ */
+void rule_engine_init(struct rule_engine_t *engine, unsigned int budget);
+
+/**
+ * @brief Switch an engine to a program. Variables of the same name keep
+ * their values, the others start at 0.
+ * @param engine Engine.
+ * @param program Program, copied.
+ * @return None.
+ */
+void rule_engine_load(struct rule_engine_t *engine,
+                      const struct rule_program_t *program);
+
+/**
+ * @brief Run the program once.
+ * @param engine Engine, inputs set in engine->values.
+ * @return 0 on success, -1 with errno set: ETIME when the budget ran out,
+ * EDOM on a division by zero. Assignments made before the stop stand.
+ */
+int rule_run(struct rule_engine_t *engine);
+
+/**
+ * @brief Set up an empty cache.
+ * @param cache Cache to initialize.
+ * @return None.
+ */
+void rule_cache_init(struct rule_cache_t *cache);
+
+/**
+ * @brief Compiled program of a source text, from the cache or compiled and
+ * cached, evicting the least recently used.
+ * @param cache Cache.
+ * @param source Program text.
+ * @param program Set to the program, valid until the next lookup.
+ * @param error Set to a message on failure.
+ * @param error_size Size of error.
+ * @return 0 on success, -1 with errno set (EINVAL for a program that does
+ * not compile).
+ */
+int rule_cache_compile(struct rule_cache_t *cache, const char *source,
+                       const struct rule_program_t **program, char *error,
+                       size_t error_size);
+
+/**
+ * @brief Release a cache.
+ * @param cache Cache.
+ * @return None.
+ */
+void rule_cache_destroy(struct rule_cache_t *cache);
+
+/**
+ * @brief Stage running a rules file on every frame, to be added to a
+ * pipeline with stage_pipeline_add(). Its args are "RULES:OUTPUT".
+ *
+ * Before each run it sets sequence, frame (frames seen), time (seconds
+ * since the first frame), interval_ms, dropped (frames lost before this
+ * one), bytes, width, height and saved (frames saved so far); and, only
+ * if the rules use them, luma (mean luma) and change (largest block mean
+ * change since the last frame), from the frame's signature. save is reset
+ * to 0. After the run a non-zero save copies the frame out for the
+ * stage's writer thread, which writes it numbered after OUTPUT; for GREY
+ * and YUYV a non-empty roi_x, roi_y, roi_w, roi_h saves only that region.
+ * The disk thus stays out of the stage's cost, which would otherwise have
+ * the pipeline run the rules on fewer frames after every save. A save
+ * waits only while RULE_SAVE_QUEUE earlier ones are still being written.
+ * The file is reread when its modification time
+ * changes, at most once a second; a version that does not compile is
+ * reported and the last good one kept.
+ */
+extern const struct stage_descriptor_t rule_stage;
+
+/**
+ * @brief Variables a rule_stage sets or reads.
+ */
+#define RULE_STAGE_VARIABLES 16
+
+/**
+ * @brief Saves of a rule_stage queued for its writer thread.
+ */
+#define RULE_SAVE_QUEUE 2
+
+/**
+ * @brief A frame copied out for the writer thread.
+ * @param data Frame or region, planes one after the other.
+ * @param bytes Bytes used in data.
+ * @param capacity Bytes allocated, grown as frames need.
+ * @param path File it goes to.
+ */
+struct rule_save_t {
+  uint8_t *data;
+  size_t bytes;
+  size_t capacity;
+  char path[512];
+};
+
+/**
+ * @brief State of a rule_stage.
+ * @param rules_path Rules file.
+ * @param output_path Base path of saved frames.
+ * @param mtime Modification time of the rules file when last read.
+ * @param checked_us Frame timestamp of the last check of the file.
+ * @param cache Programs compiled so far.
+ * @param engine Program in use.
+ * @param slots Slots of the variables set or read by the stage, -1 for
+ * those the program does not use.
+ * @param first_us Timestamp of the first frame.
+ * @param last_us Timestamp of the last frame.
+ * @param next_sequence Sequence expected next.
+ * @param croppable Whether the format allows a region of interest.
+ * @param last_signature Signature of the last frame, for change.
+ * @param frames Frames seen.
+ * @param saved Frames saved, counted when queued.
+ * @param reloads Times the rules were reread.
+ * @param reload_errors Rereads that did not compile.
+ * @param writer Thread writing the saves.
+ * @param saves Queue of saves, count of them from head on.
+ * @param save_errors Saves the writer failed to write.
+ */
+struct rule_stage_t {
+  char rules_path[256];
+  char output_path[256];
+  struct timespec mtime;
+  uint64_t checked_us;
+  struct rule_cache_t cache;
+  struct rule_engine_t engine;
+  int slots[RULE_STAGE_VARIABLES];
+  uint64_t first_us;
+  uint64_t last_us;
+  __u32 next_sequence;
+  int croppable;
+  struct frame_signature_t last_signature;
+  unsigned long frames;
+  unsigned long saved;
+  unsigned long reloads;
+  unsigned long reload_errors;
+  pthread_t writer;
+  pthread_mutex_t lock;
+  pthread_cond_t queued;
+  pthread_cond_t written;
+  struct rule_save_t saves[RULE_SAVE_QUEUE];
+  unsigned int head;
+  unsigned int count;
+  int quit;
+  unsigned long save_errors;
+};
+
+/**
+ * @brief Wait until the saves a rule_stage queued are written.
+ * @param stage State of the stage.
+ * @return None.
+ */
+void rule_stage_drain(struct rule_stage_t *stage);
+
+#endif /* RULE_H */
@@ -0,0 +1,719 @@
+/**
+ * @file signature.c
+ * @brief Frame signatures.
+ * @note The MJPEG path walks the entropy coded data of a baseline JPEG just
+ * far enough to recover each luma block's DC coefficient: AC coefficients
+ * are Huffman decoded only to be skipped, nothing is dequantized or
+ * transformed. Streams without DHT segments, as most UVC and ISP encoders
+ * produce, use the tables of ITU T.81 annex K.
+ */
+
+#include "signature.h"
+
+#include <pthread.h>
+#include <string.h>
+
+/**
+ * @brief Codes of up to this many bits are decoded with one table lookup.
+ */
+#define HUFF_LOOKAHEAD 9
+
+/**
+ * @brief Upper bound of components in a frame and of blocks in an MCU.
+ */
+#define JPEG_MAX_COMPONENTS 4
+#define JPEG_MAX_MCU_BLOCKS 10
+
+/**
+ * @brief Per cell sums while building a signature.
+ */
+struct cell_sums_t {
+  uint32_t sum[SIGNATURE_ROWS * SIGNATURE_COLUMNS];
+  uint32_t count[SIGNATURE_ROWS * SIGNATURE_COLUMNS];
+};
+
+/**
+ * @brief A decoding Huffman table.
+ * @param lookup For each HUFF_LOOKAHEAD bit prefix: code length << 8 |
+ * symbol, 0 when the code is longer.
+ * @param maxcode Largest code of each length, -1 if none.
+ * @param valptr Index in symbols of the first code of each length.
+ * @param mincode Smallest code of each length.
+ * @param symbols Symbols in code order.
+ */
+struct huff_table_t {
+  uint16_t lookup[1 << HUFF_LOOKAHEAD];
+  int32_t maxcode[18];
+  int32_t valptr[17];
+  int32_t mincode[17];
+  uint8_t symbols[256];
+  int defined;
+};
+
+/**
+ * @brief A frame component from SOF and SOS.
+ */
+struct jpeg_component_t {
+  uint8_t id;
+  uint8_t h;
+  uint8_t v;
+  uint8_t quant_table;
+  uint8_t dc_table;
+  uint8_t ac_table;
+};
+
+/**
+ * @brief Bit reader over entropy coded data, undoing 0xFF00 stuffing and
+ * stopping at markers.
+ * @param fake Zero bits fed in past a marker or the end of data. Valid
+ * data never needs them, the encoder pads the last byte with ones.
+ */
+struct jpeg_bits_t {
+  const uint8_t *in;
+  const uint8_t *end;
+  uint32_t acc;
+  int count;
+  int marker;
+  int fake;
+};
+
+/**
+ * @brief Default tables, built once: DC 0, DC 1, AC 0, AC 1.
+ */
+static struct huff_table_t default_tables[4];
+static pthread_once_t default_tables_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief ITU T.81 table K.3: luminance DC code lengths and symbols.
+ */
+static const uint8_t DC_LUMA_BITS[16] = {0, 1, 5, 1, 1, 1, 1, 1,
+                                         1, 0, 0, 0, 0, 0, 0, 0};
+static const uint8_t DC_CHROMA_BITS[16] = {0, 3, 1, 1, 1, 1, 1, 1,
+                                           1, 1, 1, 0, 0, 0, 0, 0};
+static const uint8_t DC_SYMBOLS[12] = {0, 1, 2, 3, 4, 5, 6, 7, 8, 9, 10, 11};
+
+/**
+ * @brief ITU T.81 table K.5: luminance AC code lengths and symbols.
+ */
+static const uint8_t AC_LUMA_BITS[16] = {0, 2, 1, 3, 3, 2, 4, 3,
+                                         5, 5, 4, 4, 0, 0, 1, 0x7d};
+static const uint8_t AC_LUMA_SYMBOLS[162] = {
+    0x01, 0x02, 0x03, 0x00, 0x04, 0x11, 0x05, 0x12, 0x21, 0x31, 0x41, 0x06,
+    0x13, 0x51, 0x61, 0x07, 0x22, 0x71, 0x14, 0x32, 0x81, 0x91, 0xa1, 0x08,
+    0x23, 0x42, 0xb1, 0xc1, 0x15, 0x52, 0xd1, 0xf0, 0x24, 0x33, 0x62, 0x72,
+    0x82, 0x09, 0x0a, 0x16, 0x17, 0x18, 0x19, 0x1a, 0x25, 0x26, 0x27, 0x28,
+    0x29, 0x2a, 0x34, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44, 0x45,
+    0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58, 0x59,
+    0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74, 0x75,
+    0x76, 0x77, 0x78, 0x79, 0x7a, 0x83, 0x84, 0x85, 0x86, 0x87, 0x88, 0x89,
+    0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a, 0xa2, 0xa3,
+    0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4, 0xb5, 0xb6,
+    0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7, 0xc8, 0xc9,
+    0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda, 0xe1, 0xe2,
+    0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf1, 0xf2, 0xf3, 0xf4,
+    0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa};
+
+/**
+ * @brief ITU T.81 table K.6: chrominance AC code lengths and symbols.
+ */
+static const uint8_t AC_CHROMA_BITS[16] = {0, 2, 1, 2, 4, 4, 3, 4,
+                                           7, 5, 4, 4, 0, 1, 2, 0x77};
+static const uint8_t AC_CHROMA_SYMBOLS[162] = {
+    0x00, 0x01, 0x02, 0x03, 0x11, 0x04, 0x05, 0x21, 0x31, 0x06, 0x12, 0x41,
+    0x51, 0x07, 0x61, 0x71, 0x13, 0x22, 0x32, 0x81, 0x08, 0x14, 0x42, 0x91,
+    0xa1, 0xb1, 0xc1, 0x09, 0x23, 0x33, 0x52, 0xf0, 0x15, 0x62, 0x72, 0xd1,
+    0x0a, 0x16, 0x24, 0x34, 0xe1, 0x25, 0xf1, 0x17, 0x18, 0x19, 0x1a, 0x26,
+    0x27, 0x28, 0x29, 0x2a, 0x35, 0x36, 0x37, 0x38, 0x39, 0x3a, 0x43, 0x44,
+    0x45, 0x46, 0x47, 0x48, 0x49, 0x4a, 0x53, 0x54, 0x55, 0x56, 0x57, 0x58,
+    0x59, 0x5a, 0x63, 0x64, 0x65, 0x66, 0x67, 0x68, 0x69, 0x6a, 0x73, 0x74,
+    0x75, 0x76, 0x77, 0x78, 0x79, 0x7a, 0x82, 0x83, 0x84, 0x85, 0x86, 0x87,
+    0x88, 0x89, 0x8a, 0x92, 0x93, 0x94, 0x95, 0x96, 0x97, 0x98, 0x99, 0x9a,
+    0xa2, 0xa3, 0xa4, 0xa5, 0xa6, 0xa7, 0xa8, 0xa9, 0xaa, 0xb2, 0xb3, 0xb4,
+    0xb5, 0xb6, 0xb7, 0xb8, 0xb9, 0xba, 0xc2, 0xc3, 0xc4, 0xc5, 0xc6, 0xc7,
+    0xc8, 0xc9, 0xca, 0xd2, 0xd3, 0xd4, 0xd5, 0xd6, 0xd7, 0xd8, 0xd9, 0xda,
+    0xe2, 0xe3, 0xe4, 0xe5, 0xe6, 0xe7, 0xe8, 0xe9, 0xea, 0xf2, 0xf3, 0xf4,
+    0xf5, 0xf6, 0xf7, 0xf8, 0xf9, 0xfa};
+
+/**
+ * @brief Add one luma sample to the cell covering (x, y).
+ */
+static inline void add_sample(struct cell_sums_t *sums, __u32 x, __u32 y,
+                              __u32 width, __u32 height, unsigned int value) {
+  unsigned int column =
+      (unsigned int)((uint64_t)x * SIGNATURE_COLUMNS / width);
+  unsigned int row = (unsigned int)((uint64_t)y * SIGNATURE_ROWS / height);
+  unsigned int cell;
+
+  if (column >= SIGNATURE_COLUMNS) {
+    column = SIGNATURE_COLUMNS - 1;
+  }
+  if (row >= SIGNATURE_ROWS) {
+    row = SIGNATURE_ROWS - 1;
+  }
+  cell = row * SIGNATURE_COLUMNS + column;
+  sums->sum[cell] += value;
+  sums->count[cell]++;
+}
+
+/**
+ * @brief Turn the sums into means.
+ * @return 0 on success, -1 if a cell got no sample.
+ */
+static int finish_signature(const struct cell_sums_t *sums,
+                            struct frame_signature_t *signature) {
+  unsigned int cell;
+
+  for (cell = 0; cell < SIGNATURE_ROWS * SIGNATURE_COLUMNS; cell++) {
+    if (sums->count[cell] == 0) {
+      return -1;
+    }
+    signature->cells[cell] = (uint8_t)(sums->sum[cell] / sums->count[cell]);
+  }
+  return 0;
+}
+
+/**
+ * @brief Sample an uncompressed frame on a sparse lattice.
+ * @return 0 on success, -1 if the payload is too short or the format is
+ * not one of the uncompressed ones.
+ */
+static int sample_uncompressed(const struct v4l2_pix_format *format,
+                               const uint8_t *data, size_t bytes,
+                               struct cell_sums_t *sums) {
+  __u32 width = format->width;
+  __u32 height = format->height;
+  size_t stride = format->bytesperline;
+  __u32 x;
+  __u32 y;
+
+  switch (format->pixelformat) {
+  case V4L2_PIX_FMT_YUYV:
+    stride = stride ? stride : (size_t)width * 2;
+    break;
+  case V4L2_PIX_FMT_GREY:
+  case V4L2_PIX_FMT_NV12M:
+  case V4L2_PIX_FMT_YUV420M:
+    /* Of multi-planar formats, the luma plane. */
+    stride = stride ? stride : width;
+    break;
+  case V4L2_PIX_FMT_SBGGR10:
+  case V4L2_PIX_FMT_SGBRG10:
+  case V4L2_PIX_FMT_SGRBG10:
+  case V4L2_PIX_FMT_SRGGB10:
+    stride = stride ? stride : (size_t)width * 2;
+    break;
+  case V4L2_PIX_FMT_SBGGR10P:
+  case V4L2_PIX_FMT_SGBRG10P:
+  case V4L2_PIX_FMT_SGRBG10P:
+  case V4L2_PIX_FMT_SRGGB10P:
+    stride = stride ? stride : (size_t)(width + 3) / 4 * 5;
+    break;
+  default:
+    return -1;
+  }
+  if (width < 2 || height < 2 || bytes < stride * height) {
+    return -1;
+  }
+
+  /* Bayer samples sum a whole 2x2 quad, so every lattice point sees all
+   * colours. The lattice stays on even coordinates for that. */
+  for (y = 0; y + 1 < height; y += SIGNATURE_STEP) {
+    const uint8_t *line = data + y * stride;
+    const uint8_t *next = line + stride;
+
+    for (x = 0; x + 1 < width; x += SIGNATURE_STEP) {
+      unsigned int value;
+
+      switch (format->pixelformat) {
+      case V4L2_PIX_FMT_YUYV:
+        value = line[2 * x];
+        break;
+      case V4L2_PIX_FMT_GREY:
+      case V4L2_PIX_FMT_NV12M:
+      case V4L2_PIX_FMT_YUV420M:
+        value = line[x];
+        break;
+      case V4L2_PIX_FMT_SBGGR10:
+      case V4L2_PIX_FMT_SGBRG10:
+      case V4L2_PIX_FMT_SGRBG10:
+      case V4L2_PIX_FMT_SRGGB10:
+        /* Four 10-bit samples sum to 12 bits, scale to 8. */
+        value = ((line[2 * x] | line[2 * x + 1] << 8) & 0x3ff) +
+                ((line[2 * x + 2] | line[2 * x + 3] << 8) & 0x3ff) +
+                ((next[2 * x] | next[2 * x + 1] << 8) & 0x3ff) +
+                ((next[2 * x + 2] | next[2 * x + 3] << 8) & 0x3ff);
+        value >>= 4;
+        break;
+      default:
+        /* Packed: the high 8 bits of each sample sit in the first four
+         * bytes of its group; x is even, so x and x + 1 share a group. */
+        value = (unsigned int)line[x / 4 * 5 + (x & 3)] +
+                line[x / 4 * 5 + (x & 3) + 1] + next[x / 4 * 5 + (x & 3)] +
+                next[x / 4 * 5 + (x & 3) + 1];
+        value >>= 2;
+        break;
+      }
+      add_sample(sums, x, y, width, height, value);
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Build a decoding table from code length counts and symbols.
+ * @return 0 on success, -1 if the counts are inconsistent.
+ */
+static int huff_build(struct huff_table_t *table, const uint8_t bits[16],
+                      const uint8_t *symbols, unsigned int count) {
+  int32_t code = 0;
+  unsigned int index = 0;
+  unsigned int length;
+
+  if (count > sizeof(table->symbols)) {
+    return -1;
+  }
+  memset(table, 0, sizeof(*table));
+  memcpy(table->symbols, symbols, count);
+
+  for (length = 1; length <= 16; length++) {
+    unsigned int n = bits[length - 1];
+    unsigned int i;
+
+    table->valptr[length] = (int32_t)index;
+    table->mincode[length] = code;
+    for (i = 0; i < n; i++, index++, code++) {
+      if (index >= count || code >= (1 << length)) {
+        return -1;
+      }
+      if (length <= HUFF_LOOKAHEAD) {
+        unsigned int shift = HUFF_LOOKAHEAD - length;
+        unsigned int fill;
+
+        for (fill = 0; fill < (1U << shift); fill++) {
+          table->lookup[((unsigned int)code << shift) | fill] =
+              (uint16_t)(length << 8 | symbols[index]);
+        }
+      }
+    }
+    table->maxcode[length] = n ? code - 1 : -1;
+    code <<= 1;
+  }
+  table->maxcode[17] = 0x7fffffff;
+  table->defined = 1;
+
+  return 0;
+}
+
+static void build_default_tables(void) {
+  huff_build(&default_tables[0], DC_LUMA_BITS, DC_SYMBOLS, 12);
+  huff_build(&default_tables[1], DC_CHROMA_BITS, DC_SYMBOLS, 12);
+  huff_build(&default_tables[2], AC_LUMA_BITS, AC_LUMA_SYMBOLS, 162);
+  huff_build(&default_tables[3], AC_CHROMA_BITS, AC_CHROMA_SYMBOLS, 162);
+}
+
+/**
+ * @brief Keep more than 16 bits in the accumulator. At a marker or the end
+ * of data zeros are fed in and counted in fake.
+ */
+static inline void bits_fill(struct jpeg_bits_t *bits) {
+  while (bits->count <= 16) {
+    unsigned int byte = 0;
+
+    if (!bits->marker && bits->in < bits->end && bits->in[0] != 0xff) {
+      byte = *bits->in++;
+    } else if (!bits->marker && bits->end - bits->in >= 2 &&
+               bits->in[1] == 0x00) {
+      byte = 0xff;
+      bits->in += 2;
+    } else {
+      bits->marker = 1;
+      bits->fake += 8;
+    }
+    bits->acc |= (uint32_t)byte << (24 - bits->count);
+    bits->count += 8;
+  }
+}
+
+static inline unsigned int bits_get(struct jpeg_bits_t *bits,
+                                    unsigned int count) {
+  unsigned int value;
+
+  if (count == 0) {
+    return 0;
+  }
+  bits_fill(bits);
+  value = bits->acc >> (32 - count);
+  bits->acc <<= count;
+  bits->count -= (int)count;
+  return value;
+}
+
+/**
+ * @brief Decode one Huffman symbol.
+ * @return The symbol, -1 for an invalid code.
+ */
+static inline int huff_decode(struct jpeg_bits_t *bits,
+                              const struct huff_table_t *table) {
+  unsigned int entry;
+  unsigned int length;
+  int32_t code;
+
+  bits_fill(bits);
+  entry = table->lookup[bits->acc >> (32 - HUFF_LOOKAHEAD)];
+  if (entry != 0) {
+    length = entry >> 8;
+    bits->acc <<= length;
+    bits->count -= (int)length;
+    return entry & 0xff;
+  }
+
+  /* Longer than the lookahead: extend the code a bit at a time. */
+  code = (int32_t)bits_get(bits, HUFF_LOOKAHEAD);
+  for (length = HUFF_LOOKAHEAD + 1; length <= 16; length++) {
+    code = (code << 1) | (int32_t)bits_get(bits, 1);
+    if (code <= table->maxcode[length]) {
+      return table->symbols[table->valptr[length] + code -
+                            table->mincode[length]];
+    }
+  }
+  return -1;
+}
+
+/**
+ * @brief Sign-extend a received value of the given category (T.81 F.12).
+ */
+static inline int extend(unsigned int value, unsigned int category) {
+  return value < (1U << (category - 1)) ? (int)value - (1 << category) + 1
+                                        : (int)value;
+}
+
+/**
+ * @brief Read a big-endian 16-bit value.
+ */
+static unsigned int read_u16(const uint8_t *in) { return in[0] << 8 | in[1]; }
+
+/**
+ * @brief Collect the luma DC coefficients of a baseline JPEG.
+ * @return 0 on success, -1 for anything but a well formed baseline JPEG.
+ */
+static int sample_jpeg(const uint8_t *data, size_t bytes,
+                       struct cell_sums_t *sums) {
+  struct huff_table_t tables[4]; /* DC 0, DC 1, AC 0, AC 1 */
+  struct jpeg_component_t components[JPEG_MAX_COMPONENTS];
+  unsigned int component_count = 0;
+  unsigned int quant_dc[4] = {1, 1, 1, 1};
+  unsigned int restart_interval = 0;
+  unsigned int width = 0;
+  unsigned int height = 0;
+  const uint8_t *cursor = data;
+  const uint8_t *end = data + bytes;
+  unsigned int i;
+
+  pthread_once(&default_tables_once, build_default_tables);
+  for (i = 0; i < 4; i++) {
+    tables[i].defined = 0;
+  }
+
+  if (bytes < 4 || data[0] != 0xff || data[1] != 0xd8) {
+    return -1;
+  }
+  cursor += 2;
+
+  for (;;) {
+    unsigned int marker;
+    unsigned int length;
+    const uint8_t *segment;
+
+    while (cursor < end && *cursor == 0xff && cursor + 1 < end &&
+           cursor[1] == 0xff) {
+      cursor++;
+    }
+    if (end - cursor < 4 || cursor[0] != 0xff) {
+      return -1;
+    }
+    marker = cursor[1];
+    length = read_u16(cursor + 2);
+    segment = cursor + 4;
+    if (length < 2 || (size_t)(end - cursor - 2) < length) {
+      return -1;
+    }
+    cursor += 2 + length;
+
+    switch (marker) {
+    case 0xc0: /* baseline */
+    case 0xc1: /* extended sequential, Huffman */
+      if (length < 8 || segment[0] != 8) {
+        return -1;
+      }
+      height = read_u16(segment + 1);
+      width = read_u16(segment + 3);
+      component_count = segment[5];
+      if (width == 0 || height == 0 || component_count == 0 ||
+          component_count > JPEG_MAX_COMPONENTS ||
+          length < 8 + 3 * component_count) {
+        return -1;
+      }
+      for (i = 0; i < component_count; i++) {
+        components[i].id = segment[6 + 3 * i];
+        components[i].h = segment[7 + 3 * i] >> 4;
+        components[i].v = segment[7 + 3 * i] & 15;
+        if (components[i].h == 0 || components[i].v == 0 ||
+            components[i].h > 4 || components[i].v > 4 ||
+            (segment[8 + 3 * i] & 3) != segment[8 + 3 * i]) {
+          return -1;
+        }
+        components[i].quant_table = segment[8 + 3 * i];
+      }
+      break;
+    case 0xc4: { /* DHT */
+      const uint8_t *table = segment;
+      const uint8_t *table_end = segment + length - 2;
+
+      while (table_end - table >= 17) {
+        unsigned int class_id = table[0];
+        unsigned int count = 0;
+        unsigned int slot;
+
+        for (i = 0; i < 16; i++) {
+          count += table[1 + i];
+        }
+        if ((class_id >> 4) > 1 || (class_id & 15) > 1 ||
+            (size_t)(table_end - table) < 17 + count) {
+          return -1;
+        }
+        slot = (class_id >> 4) * 2 + (class_id & 15);
+        if (huff_build(&tables[slot], table + 1, table + 17, count) < 0) {
+          return -1;
+        }
+        table += 17 + count;
+      }
+      break;
+    }
+    case 0xdb: { /* DQT */
+      const uint8_t *table = segment;
+      const uint8_t *table_end = segment + length - 2;
+
+      while (table < table_end) {
+        unsigned int precision = table[0] >> 4;
+        unsigned int id = table[0] & 15;
+        size_t size = precision ? 129 : 65;
+
+        if (id > 3 || (size_t)(table_end - table) < size) {
+          return -1;
+        }
+        quant_dc[id] = precision ? read_u16(table + 1) : table[1];
+        table += size;
+      }
+      break;
+    }
+    case 0xdd: /* DRI */
+      if (length != 4) {
+        return -1;
+      }
+      restart_interval = read_u16(segment);
+      break;
+    case 0xda: { /* SOS */
+      struct jpeg_component_t *scan[JPEG_MAX_COMPONENTS];
+      unsigned int scan_count = segment[0];
+      unsigned int h_max = 1;
+      unsigned int v_max = 1;
+      unsigned int mcu_columns;
+      unsigned int mcu_rows;
+      unsigned int mcu;
+      unsigned int luma_quant;
+      int predictor[JPEG_MAX_COMPONENTS] = {0};
+      struct jpeg_bits_t bits = {.in = cursor, .end = end};
+
+      if (component_count == 0 || scan_count == 0 ||
+          scan_count > component_count || length != 6 + 2 * scan_count) {
+        return -1;
+      }
+      /* Only a single scan covering the whole frame is supported. */
+      if (scan_count != component_count) {
+        return -1;
+      }
+      for (i = 0; i < scan_count; i++) {
+        unsigned int c;
+
+        for (c = 0; c < component_count; c++) {
+          if (components[c].id == segment[1 + 2 * i]) {
+            break;
+          }
+        }
+        if (c == component_count || (segment[2 + 2 * i] >> 4) > 1 ||
+            (segment[2 + 2 * i] & 15) > 1) {
+          return -1;
+        }
+        scan[i] = &components[c];
+        if (scan[i]->h > h_max) {
+          h_max = scan[i]->h;
+        }
+        if (scan[i]->v > v_max) {
+          v_max = scan[i]->v;
+        }
+      }
+      /* Only the quantizer of the luma DC term is needed. */
+      luma_quant = quant_dc[scan[0]->quant_table];
+      for (i = 0; i < scan_count; i++) {
+        scan[i]->dc_table = segment[2 + 2 * i] >> 4;
+        scan[i]->ac_table = 2 + (segment[2 + 2 * i] & 15);
+      }
+      for (i = 0; i < 4; i++) {
+        if (!tables[i].defined) {
+          tables[i] = default_tables[i];
+        }
+      }
+
+      if (scan_count == 1) {
+        /* A single component scan is not interleaved: one block per MCU,
+         * regardless of the sampling factors. */
+        scan[0]->h = 1;
+        scan[0]->v = 1;
+        h_max = 1;
+        v_max = 1;
+      }
+      mcu_columns = (width + 8 * h_max - 1) / (8 * h_max);
+      mcu_rows = (height + 8 * v_max - 1) / (8 * v_max);
+      if (scan_count > 1) {
+        unsigned int blocks = 0;
+
+        for (i = 0; i < scan_count; i++) {
+          blocks += scan[i]->h * scan[i]->v;
+        }
+        if (blocks > JPEG_MAX_MCU_BLOCKS) {
+          return -1;
+        }
+      }
+
+      for (mcu = 0; mcu < mcu_columns * mcu_rows; mcu++) {
+        unsigned int mcu_x = mcu % mcu_columns;
+        unsigned int mcu_y = mcu / mcu_columns;
+
+        if (restart_interval != 0 && mcu != 0 &&
+            mcu % restart_interval == 0) {
+          /* Drop the padding bits, expect RSTn, reset the predictors. */
+          if (end - bits.in < 2 || bits.in[0] != 0xff || bits.in[1] < 0xd0 ||
+              bits.in[1] > 0xd7) {
+            return -1;
+          }
+          bits.in += 2;
+          bits.acc = 0;
+          bits.count = 0;
+          bits.marker = 0;
+          bits.fake = 0;
+          memset(predictor, 0, sizeof(predictor));
+        }
+
+        for (i = 0; i < scan_count; i++) {
+          struct jpeg_component_t *component = scan[i];
+          unsigned int block;
+
+          for (block = 0; block < (unsigned int)component->h * component->v;
+               block++) {
+            int category = huff_decode(&bits, &tables[component->dc_table]);
+            unsigned int k = 1;
+
+            if (category < 0 || category > 11) {
+              return -1;
+            }
+            if (category > 0) {
+              predictor[i] += extend(bits_get(&bits, category), category);
+            }
+
+            if (i == 0) {
+              unsigned int x =
+                  (mcu_x * component->h + block % component->h) * 8;
+              unsigned int y =
+                  (mcu_y * component->v + block / component->h) * 8;
+              int mean = predictor[0] * (int)luma_quant / 8 + 128;
+
+              /* The block counts for the cell holding its centre. */
+              if (x < width && y < height) {
+                add_sample(sums, x + 4 < width ? x + 4 : x,
+                           y + 4 < height ? y + 4 : y, width, height,
+                           mean < 0      ? 0
+                           : mean > 255 ? 255
+                                        : (unsigned int)mean);
+              }
+            }
+
+            /* Skip the AC coefficients. */
+            while (k < 64) {
+              int symbol = huff_decode(&bits, &tables[component->ac_table]);
+              unsigned int run;
+              unsigned int size;
+
+              if (symbol < 0) {
+                return -1;
+              }
+              run = (unsigned int)symbol >> 4;
+              size = (unsigned int)symbol & 15;
+              if (size == 0) {
+                if (run != 15) {
+                  break;
+                }
+                k += 16;
+                continue;
+              }
+              bits_get(&bits, size);
+              k += run + 1;
+            }
+            if (k > 64) {
+              return -1;
+            }
+          }
+        }
+        /* Codes ran into a marker or off the end: corrupt or truncated. */
+        if (bits.fake > bits.count) {
+          return -1;
+        }
+      }
+      return 0;
+    }
+    case 0xc2: /* progressive */
+    case 0xc3: /* lossless */
+    case 0xd9: /* EOI before any scan */
+      return -1;
+    default:
+      /* APPn, COM and the rest carry nothing needed here. */
+      break;
+    }
+  }
+}
+
+int frame_signature_compute(const struct v4l2_pix_format *format,
+                            const void *data, size_t bytes,
+                            struct frame_signature_t *signature) {
+  struct cell_sums_t sums;
+  int status_code;
+
+  memset(&sums, 0, sizeof(sums));
+  if (format->pixelformat == V4L2_PIX_FMT_MJPEG ||
+      format->pixelformat == V4L2_PIX_FMT_JPEG) {
+    status_code = sample_jpeg(data, bytes, &sums);
+  } else {
+    status_code = sample_uncompressed(format, data, bytes, &sums);
+  }
+  if (status_code < 0) {
+    return -1;
+  }
+  return finish_signature(&sums, signature);
+}
+
+unsigned int frame_signature_distance(const struct frame_signature_t *a,
+                                      const struct frame_signature_t *b) {
+  unsigned int largest = 0;
+  unsigned int cell;
+
+  for (cell = 0; cell < SIGNATURE_ROWS * SIGNATURE_COLUMNS; cell++) {
+    unsigned int difference = a->cells[cell] > b->cells[cell]
+                                  ? a->cells[cell] - b->cells[cell]
+                                  : b->cells[cell] - a->cells[cell];
+
+    if (difference > largest) {
+      largest = difference;
+    }
+  }
+  return largest;
+}
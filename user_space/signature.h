@@ -0,0 +1,62 @@
+/**
+ * @file signature.h
+ * @brief Cheap perceptual frame signatures: a coarse grid of luma block
+ * means, used to tell whether a frame differs from the last one stored.
+ */
+
+#ifndef SIGNATURE_H
+#define SIGNATURE_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <linux/videodev2.h>
+
+/**
+ * @brief Grid of the signature. 16x12 cells keep a car or a person in a
+ * parking lot view at several cells.
+ */
+#define SIGNATURE_COLUMNS 16
+#define SIGNATURE_ROWS 12
+
+/**
+ * @brief Pixel stride of the sparse sampling of uncompressed frames, in
+ * both directions. Every cell still averages over a hundred or more samples
+ * at 640x480 and up, which keeps sensor noise out of the means.
+ */
+#define SIGNATURE_STEP 8
+
+/**
+ * @brief Block means of a frame.
+ * @param cells Mean luma of each cell, 0-255, row major.
+ */
+struct frame_signature_t {
+  uint8_t cells[SIGNATURE_ROWS * SIGNATURE_COLUMNS];
+};
+
+/**
+ * @brief Compute the signature of a frame. Uncompressed frames (YUYV, GREY,
+ * 10-bit Bayer) are sampled sparsely; for MJPEG only the DC coefficients of
+ * the luma blocks are decoded, which are the 8x8 block means.
+ * @param format Format of the frame.
+ * @param data Frame payload.
+ * @param bytes Payload size.
+ * @param signature Destination.
+ * @return 0 on success, -1 for an unsupported format or an undecodable
+ * frame.
+ */
+int frame_signature_compute(const struct v4l2_pix_format *format,
+                            const void *data, size_t bytes,
+                            struct frame_signature_t *signature);
+
+/**
+ * @brief Difference between two signatures: the largest change of any
+ * cell, so motion in a small part of the view still counts.
+ * @param a Signature.
+ * @param b Signature.
+ * @return Largest absolute cell difference, 0-255.
+ */
+unsigned int frame_signature_distance(const struct frame_signature_t *a,
+                                      const struct frame_signature_t *b);
+
+#endif /* SIGNATURE_H */
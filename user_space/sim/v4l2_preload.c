@@ -0,0 +1,181 @@
+/**
+ * @file v4l2_preload.c
+ * @brief LD_PRELOAD shim putting the simulated V4L2 device behind an
+ * unmodified binary, so capture modes can be run and profiled without a
+ * camera:
+ *
+ *   LD_PRELOAD=./sim/libv4l2sim.so V4L2_SIM_FPS=30 ./main -o /tmp/frame.jpeg
+ *
+ * Environment:
+ *   V4L2_SIM_DEVICE          Path to intercept, default /dev/video0.
+ *   V4L2_SIM_FPS             Sensor frame rate, 0 for unpaced (default 30).
+ *   V4L2_SIM_JITTER_US       Frame arrival jitter in microseconds.
+ *   V4L2_SIM_PAYLOAD         MJPEG payload size relative to sizeimage, 1/1000.
+ *   V4L2_SIM_PAYLOAD_JITTER  Relative payload size jitter, 1/1000.
+ *   V4L2_SIM_BUFFERS         Maximum buffers granted by VIDIOC_REQBUFS.
+ *   V4L2_SIM_MIN_BUFFERS     Minimum buffers granted by VIDIOC_REQBUFS.
+ *   V4L2_SIM_MEDIA           Media device path offering the Request API.
+ *   V4L2_SIM_CONTROL_LATENCY Frames before an exposure change takes effect.
+ *   V4L2_SIM_MPLANE          If set, offer only the multi-planar API.
+ *   V4L2_SIM_SUBDEV          Sensor subdev path, putting the sensor behind
+ *                            the media graph of V4L2_SIM_MEDIA.
+ *   V4L2_SIM_STATS           If set, print the device counters at exit.
+ */
+
+#define _GNU_SOURCE
+
+#include <dlfcn.h>
+#include <fcntl.h>
+#include <stdarg.h>
+#include <stdio.h>
+#include <stdlib.h>
+
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include "v4l2_sim.h"
+
+/**
+ * @brief Default sensor frame rate when V4L2_SIM_FPS is unset, the rate the
+ * OV5647 runs 1080p at.
+ */
+#define DEFAULT_SIM_FPS 30
+
+static int (*real_open)(const char *, int, ...);
+static int (*real_open64)(const char *, int, ...);
+static int (*real_close)(int);
+static int (*real_ioctl)(int, unsigned long, ...);
+static void *(*real_mmap)(void *, size_t, int, int, int, off_t);
+static void *(*real_mmap64)(void *, size_t, int, int, int, off64_t);
+
+/**
+ * @brief Read an unsigned integer from the environment.
+ * @param name Variable name.
+ * @param fallback Value when unset or empty.
+ * @return The value.
+ */
+static unsigned int env_uint(const char *name, unsigned int fallback) {
+  const char *value = getenv(name);
+
+  if (value == NULL || *value == '\0') {
+    return fallback;
+  }
+  return (unsigned int)strtoul(value, NULL, 0);
+}
+
+/**
+ * @brief Print the device counters, registered with atexit().
+ */
+static void print_stats(void) {
+  struct v4l2_sim_stats_t stats;
+
+  v4l2_sim_get_stats(&stats);
+  fprintf(stderr,
+          "v4l2-sim: %lu frames, %lu dropped, %lu DQBUF, %lu QBUF calls\n",
+          stats.frames, stats.dropped, stats.calls[V4L2_SIM_OP_DQBUF],
+          stats.calls[V4L2_SIM_OP_QBUF]);
+  if (stats.calls[V4L2_SIM_OP_EXPBUF] > 0) {
+    fprintf(stderr, "v4l2-sim: %lu dma-buf syncs, %lu unbracketed\n",
+            stats.syncs, stats.sync_errors);
+  }
+}
+
+__attribute__((constructor)) static void preload_init(void) {
+  struct v4l2_sim_config_t config = {
+      .device_path = getenv("V4L2_SIM_DEVICE"),
+      .max_buffers = env_uint("V4L2_SIM_BUFFERS", 0),
+      .min_buffers = env_uint("V4L2_SIM_MIN_BUFFERS", 0),
+      .payload_permille = env_uint("V4L2_SIM_PAYLOAD", 0),
+      .fps = env_uint("V4L2_SIM_FPS", DEFAULT_SIM_FPS),
+      .jitter_us = env_uint("V4L2_SIM_JITTER_US", 0),
+      .payload_jitter_permille = env_uint("V4L2_SIM_PAYLOAD_JITTER", 0),
+      .media_path = getenv("V4L2_SIM_MEDIA"),
+      .control_latency = env_uint("V4L2_SIM_CONTROL_LATENCY", 0),
+      .mplane = getenv("V4L2_SIM_MPLANE") != NULL,
+      .subdev_path = getenv("V4L2_SIM_SUBDEV"),
+  };
+
+  real_open = dlsym(RTLD_NEXT, "open");
+  real_open64 = dlsym(RTLD_NEXT, "open64");
+  real_close = dlsym(RTLD_NEXT, "close");
+  real_ioctl = dlsym(RTLD_NEXT, "ioctl");
+  real_mmap = dlsym(RTLD_NEXT, "mmap");
+  real_mmap64 = dlsym(RTLD_NEXT, "mmap64");
+
+  v4l2_sim_reset(&config);
+
+  if (getenv("V4L2_SIM_STATS") != NULL) {
+    atexit(print_stats);
+  }
+}
+
+/**
+ * @brief The mode argument of open(), present only with O_CREAT / O_TMPFILE.
+ */
+#define OPEN_MODE(flags, mode)                                                 \
+  do {                                                                         \
+    if ((flags) & (O_CREAT | O_TMPFILE)) {                                     \
+      va_list args;                                                            \
+                                                                               \
+      va_start(args, flags);                                                   \
+      mode = va_arg(args, mode_t);                                             \
+      va_end(args);                                                            \
+    }                                                                          \
+  } while (0)
+
+int open(const char *path, int flags, ...) {
+  mode_t mode = 0;
+
+  OPEN_MODE(flags, mode);
+  if (v4l2_sim_owns_path(path)) {
+    return v4l2_sim_open(path, flags);
+  }
+  return real_open(path, flags, mode);
+}
+
+int open64(const char *path, int flags, ...) {
+  mode_t mode = 0;
+
+  OPEN_MODE(flags, mode);
+  if (v4l2_sim_owns_path(path)) {
+    return v4l2_sim_open(path, flags);
+  }
+  return real_open64(path, flags, mode);
+}
+
+int close(int fd) {
+  if (v4l2_sim_owns_fd(fd)) {
+    return v4l2_sim_close(fd);
+  }
+  return real_close(fd);
+}
+
+int ioctl(int fd, unsigned long request, ...) {
+  va_list args;
+  void *arg;
+
+  va_start(args, request);
+  arg = va_arg(args, void *);
+  va_end(args);
+
+  if (v4l2_sim_owns_fd(fd)) {
+    return v4l2_sim_ioctl(fd, request, arg);
+  }
+  return real_ioctl(fd, request, arg);
+}
+
+void *mmap(void *addr, size_t length, int prot, int flags, int fd,
+           off_t offset) {
+  if (v4l2_sim_owns_fd(fd)) {
+    return v4l2_sim_mmap(fd, length, prot, flags, offset);
+  }
+  return real_mmap(addr, length, prot, flags, fd, offset);
+}
+
+void *mmap64(void *addr, size_t length, int prot, int flags, int fd,
+             off64_t offset) {
+  if (v4l2_sim_owns_fd(fd)) {
+    return v4l2_sim_mmap(fd, length, prot, flags, (off_t)offset);
+  }
+  return real_mmap64(addr, length, prot, flags, fd, offset);
+}
@@ -0,0 +1,2204 @@
+/**
+ * @file v4l2_sim.c
+ * @brief Simulated V4L2 capture device.
+ * @note A single device instance is simulated. All state sits behind one
+ * mutex so glue code may call in from any thread. Unpaced (fps 0) the
+ * device completes a queued buffer the moment it is dequeued; paced, a
+ * producer thread completes one buffer per frame period, and drops the frame
+ * when nothing is queued, like a real sensor.
+ */
+
+#define _GNU_SOURCE
+
+#include "v4l2_sim.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <linux/dma-buf.h>
+#include <linux/media-bus-format.h>
+#include <linux/media.h>
+#include <linux/v4l2-subdev.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+
+/**
+ * @brief Range of V4L2_CID_EXPOSURE in lines, as the OV5647 driver has it.
+ */
+#define SIM_EXPOSURE_MIN 4
+#define SIM_EXPOSURE_MAX 65535
+
+/**
+ * @brief Exposure changes set with VIDIOC_S_CTRL that may wait for the
+ * sensor at once.
+ */
+#define SIM_MAX_PENDING_CONTROLS 16
+
+/**
+ * @brief Defaults used when v4l2_sim_reset() is given no configuration.
+ */
+static const struct v4l2_sim_config_t DEFAULT_CONFIG = {
+    .device_path = "/dev/video0",
+    .max_buffers = V4L2_SIM_MAX_BUFFERS,
+    .min_buffers = 0,
+    .payload_permille = 250,
+    .fps = 0,
+    .jitter_us = 0,
+    .payload_jitter_permille = 0,
+    .media_path = NULL,
+    .control_latency = 0,
+    .mplane = 0,
+    .subdev_path = NULL,
+    .data_offset = 0,
+};
+
+/**
+ * @brief Most planes of a simulated format.
+ */
+#define SIM_MAX_PLANES 3
+
+/**
+ * @brief Objects of the media graph: the sensor entity and its source
+ * pad, the video node entity and its sink pad, the data link between
+ * them, the interfaces of the subdev and the video node and their links.
+ */
+enum {
+  SIM_SENSOR_ENTITY = 1,
+  SIM_SENSOR_PAD,
+  SIM_VIDEO_ENTITY,
+  SIM_VIDEO_PAD,
+  SIM_SENSOR_LINK,
+  SIM_SUBDEV_INTERFACE,
+  SIM_VIDEO_INTERFACE,
+  SIM_SUBDEV_INTERFACE_LINK,
+  SIM_VIDEO_INTERFACE_LINK,
+};
+
+/**
+ * @brief Character device numbers of the subdev and the video node.
+ */
+#define SIM_DEVNODE_MAJOR 81
+#define SIM_SUBDEV_MINOR 1
+#define SIM_VIDEO_MINOR 0
+
+/**
+ * @brief sysfs file naming the subdev's device node.
+ */
+static const char SIM_SUBDEV_UEVENT[] = "/sys/dev/char/81:1/uevent";
+
+/**
+ * @brief Largest sensor frame, the OV5647's full resolution.
+ */
+#define SIM_SENSOR_WIDTH 2592
+#define SIM_SENSOR_HEIGHT 1944
+
+/**
+ * @brief A scheduled per-frame fault.
+ */
+struct sim_frame_fault_t {
+  unsigned long frame;
+  enum v4l2_sim_frame_fault_t fault;
+  __u32 value;
+};
+
+/**
+ * @brief A scheduled errno fault.
+ */
+struct sim_call_fault_t {
+  unsigned long first;
+  unsigned long count;
+  int err;
+};
+
+/**
+ * @brief An exposure change on its way to the sensor.
+ * @param value New exposure.
+ * @param sequence First frame it applies to.
+ */
+struct sim_control_change_t {
+  __s32 value;
+  __u32 sequence;
+};
+
+/**
+ * @brief A media request.
+ * @param fd Descriptor handed to the application, an eventfd that becomes
+ * readable when the request completes. -1 for a free slot.
+ * @param has_buffer Whether a buffer was queued into the request.
+ * @param buffer Index of that buffer.
+ * @param has_exposure Whether the request carries an exposure.
+ * @param exposure That exposure.
+ * @param queued MEDIA_REQUEST_IOC_QUEUE was called.
+ * @param complete The buffer was filled.
+ */
+struct sim_request_t {
+  int fd;
+  int has_buffer;
+  __u32 buffer;
+  int has_exposure;
+  __s32 exposure;
+  int queued;
+  int complete;
+};
+
+/**
+ * @brief A buffer exported with VIDIOC_EXPBUF.
+ * @param fd Descriptor handed to the application, an eventfd standing in
+ * for the dma-buf. -1 for a free slot.
+ * @param index Buffer it exports.
+ * @param plane Plane of the buffer it exports.
+ * @param writable Exported O_RDWR, so it may be mapped for writing.
+ * @param cpu DMA_BUF_SYNC_READ / _WRITE of the CPU access opened with
+ * DMA_BUF_SYNC_START and not ended yet, 0 for none.
+ */
+struct sim_export_t {
+  int fd;
+  __u32 index;
+  __u32 plane;
+  int writable;
+  __u64 cpu;
+};
+
+/**
+ * @brief State of the simulated device.
+ * @param fd Descriptor handed to the application, an eventfd that is
+ * readable while a frame can be dequeued. -1 while closed.
+ * @param memfd Memory backing all buffers, buffer i at i * buffer_size.
+ * @param plane_count Planes of the format, 1 but for NV12M and YUV420M.
+ * @param plane_size Bytes of each plane.
+ * @param plane_stride Bytes per line of each plane.
+ * @param plane_offset Page aligned offset of each plane in a buffer, and
+ * after the last the buffer size.
+ * @param ring Queued buffer indices in FIFO order.
+ * @param done Completed buffer indices in FIFO order, paced mode only.
+ * @param done_meta Buffer metadata filled in at completion, by index.
+ * @param scene Scene the sensor currently sees, see V4L2_SIM_FRAME_SCENE.
+ * @param buffer_scene Scene each buffer was last rendered with.
+ * @param media_fd Descriptor of the media device, -1 while closed.
+ * @param exposure Exposure the sensor currently applies.
+ * @param exposure_auto V4L2_CID_EXPOSURE_AUTO: V4L2_EXPOSURE_AUTO or
+ * V4L2_EXPOSURE_MANUAL.
+ * @param pending Exposure changes not yet applied, oldest first.
+ * @param requests Media requests, by slot.
+ * @param exports Exported buffers, by slot.
+ * @param format Format set, single-planar whatever the API: sizeimage
+ * covers every plane.
+ * @param subdev_fd Descriptor of the sensor subdev, -1 while closed.
+ * @param sensor_linked Whether the link from the sensor is enabled.
+ * @param sensor_format Active format of the sensor's pad.
+ * @param wake Wakes the producer early, to stop it.
+ * @param done_cond Signalled when a buffer completes, for blocking dequeues.
+ */
+static struct {
+  pthread_mutex_t lock;
+  pthread_cond_t wake;
+  pthread_cond_t done_cond;
+  pthread_t producer;
+  int producer_running;
+  uint32_t random_state;
+  struct v4l2_sim_config_t config;
+  int fd;
+  int nonblock;
+  int ready;
+  int memfd;
+  size_t buffer_size;
+  __u32 buffer_count;
+  unsigned int plane_count;
+  __u32 plane_size[SIM_MAX_PLANES];
+  __u32 plane_stride[SIM_MAX_PLANES];
+  size_t plane_offset[SIM_MAX_PLANES + 1];
+  int queued[V4L2_SIM_MAX_BUFFERS];
+  __u32 ring[V4L2_SIM_MAX_BUFFERS];
+  __u32 ring_head;
+  __u32 ring_len;
+  __u32 done[V4L2_SIM_MAX_BUFFERS];
+  __u32 done_head;
+  __u32 done_len;
+  struct v4l2_buffer done_meta[V4L2_SIM_MAX_BUFFERS];
+  unsigned int scene;
+  unsigned int buffer_scene[V4L2_SIM_MAX_BUFFERS];
+  int media_fd;
+  __s32 exposure;
+  __s32 exposure_auto;
+  struct sim_control_change_t pending[SIM_MAX_PENDING_CONTROLS];
+  unsigned int pending_count;
+  struct sim_request_t requests[V4L2_SIM_MAX_REQUESTS];
+  struct sim_export_t exports[V4L2_SIM_MAX_EXPORTS];
+  struct v4l2_format format;
+  int subdev_fd;
+  int sensor_linked;
+  struct v4l2_mbus_framefmt sensor_format;
+  int streaming;
+  struct v4l2_sim_stats_t stats;
+  struct sim_call_fault_t call_faults[V4L2_SIM_OP_COUNT];
+  struct sim_frame_fault_t frame_faults[V4L2_SIM_MAX_FRAME_FAULTS];
+  unsigned int frame_fault_count;
+} sim = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .fd = -1,
+    .memfd = -1,
+    .media_fd = -1,
+    .subdev_fd = -1,
+    .exposure = V4L2_SIM_DEFAULT_EXPOSURE,
+    .exposure_auto = V4L2_EXPOSURE_AUTO,
+    .requests = {[0 ... V4L2_SIM_MAX_REQUESTS - 1] = {.fd = -1}},
+    .exports = {[0 ... V4L2_SIM_MAX_EXPORTS - 1] = {.fd = -1}},
+    .random_state = 0x2545f491,
+};
+
+/**
+ * @brief Guards the one-time setup of the condition variables.
+ */
+static pthread_once_t sim_once = PTHREAD_ONCE_INIT;
+
+/**
+ * @brief The producer sleeps on absolute CLOCK_MONOTONIC deadlines, which
+ * needs the clock set on the condition variable.
+ */
+static void sim_init_conds(void) {
+  pthread_condattr_t attr;
+
+  pthread_condattr_init(&attr);
+  pthread_condattr_setclock(&attr, CLOCK_MONOTONIC);
+  pthread_cond_init(&sim.wake, &attr);
+  pthread_cond_init(&sim.done_cond, &attr);
+  pthread_condattr_destroy(&attr);
+}
+
+/**
+ * @brief xorshift32, deterministic jitter without touching rand()'s state.
+ * @return Next pseudo random number.
+ */
+static uint32_t sim_random(void) {
+  uint32_t x = sim.random_state;
+
+  x ^= x << 13;
+  x ^= x >> 17;
+  x ^= x << 5;
+  sim.random_state = x;
+  return x;
+}
+
+/**
+ * @brief Uniform pseudo random integer in [-range, range].
+ * @param range Half width.
+ * @return Random offset.
+ */
+static long sim_random_offset(unsigned int range) {
+  if (range == 0) {
+    return 0;
+  }
+  return (long)(sim_random() % (2 * range + 1)) - (long)range;
+}
+
+/**
+ * @brief Count a call and decide whether it has to fail.
+ * @param op Operation.
+ * @return 0 to proceed, -1 with errno set to fail the call.
+ */
+static int sim_account(enum v4l2_sim_op_t op) {
+  struct sim_call_fault_t *fault = &sim.call_faults[op];
+  unsigned long call = sim.stats.calls[op]++;
+
+  if (fault->count > 0 && call >= fault->first &&
+      call - fault->first < fault->count) {
+    errno = fault->err;
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Make the descriptor's readability match whether a frame is ready.
+ */
+static void sim_update_ready(void) {
+  int ready = sim.streaming &&
+              (sim.config.fps > 0 ? sim.done_len > 0 : sim.ring_len > 0);
+  uint64_t value = 1;
+
+  if (sim.fd < 0 || ready == sim.ready) {
+    return;
+  }
+  if (ready) {
+    (void)!write(sim.fd, &value, sizeof(value));
+  } else {
+    (void)!read(sim.fd, &value, sizeof(value));
+  }
+  sim.ready = ready;
+}
+
+/**
+ * @brief Release the buffer memory.
+ */
+static void sim_free_buffers(void) {
+  if (sim.memfd >= 0) {
+    close(sim.memfd);
+  }
+  sim.memfd = -1;
+  sim.buffer_count = 0;
+  sim.buffer_size = 0;
+  sim.ring_len = 0;
+  sim.done_len = 0;
+  memset(sim.queued, 0, sizeof(sim.queued));
+}
+
+/**
+ * @brief Stop the producer thread. Called and returns with the lock held,
+ * but drops it while joining.
+ */
+static void sim_stop_producer(void) {
+  pthread_t producer = sim.producer;
+
+  if (!sim.producer_running) {
+    return;
+  }
+  sim.producer_running = 0;
+  pthread_cond_broadcast(&sim.wake);
+  pthread_cond_broadcast(&sim.done_cond);
+  pthread_mutex_unlock(&sim.lock);
+  pthread_join(producer, NULL);
+  pthread_mutex_lock(&sim.lock);
+}
+
+/**
+ * @brief Stop streaming, every queued or completed buffer returns to the
+ * application.
+ */
+static void sim_stop_streaming(void) {
+  unsigned int i;
+
+  sim.streaming = 0;
+  sim_stop_producer();
+  sim.ring_len = 0;
+  sim.done_len = 0;
+  memset(sim.queued, 0, sizeof(sim.queued));
+
+  /* The sensor catches up with every control change, and requests still
+   * waiting for a frame are completed without one. */
+  if (sim.pending_count > 0) {
+    sim.exposure = sim.pending[sim.pending_count - 1].value;
+    sim.pending_count = 0;
+  }
+  for (i = 0; i < V4L2_SIM_MAX_REQUESTS; i++) {
+    struct sim_request_t *request = &sim.requests[i];
+    uint64_t value = 1;
+
+    if (request->fd >= 0 && request->queued && !request->complete) {
+      request->complete = 1;
+      (void)!write(request->fd, &value, sizeof(value));
+    }
+  }
+}
+
+/**
+ * @brief Free a request slot, closing its descriptor.
+ * @param request Request.
+ */
+static void sim_free_request(struct sim_request_t *request) {
+  int fd = request->fd;
+
+  memset(request, 0, sizeof(*request));
+  /* Disown the descriptor first, glue code routes close() back here. */
+  request->fd = -1;
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+/**
+ * @brief Find the request a descriptor belongs to.
+ * @param fd Descriptor.
+ * @return The request, NULL if the descriptor is not a request.
+ */
+static struct sim_request_t *sim_find_request(int fd) {
+  unsigned int i;
+
+  for (i = 0; fd >= 0 && i < V4L2_SIM_MAX_REQUESTS; i++) {
+    if (sim.requests[i].fd == fd) {
+      return &sim.requests[i];
+    }
+  }
+  return NULL;
+}
+
+/**
+ * @brief Free an export slot, closing its descriptor.
+ * @param export Export.
+ */
+static void sim_free_export(struct sim_export_t *export) {
+  int fd = export->fd;
+
+  memset(export, 0, sizeof(*export));
+  /* Disown the descriptor first, glue code routes close() back here. */
+  export->fd = -1;
+  if (fd >= 0) {
+    close(fd);
+  }
+}
+
+/**
+ * @brief Find the export a descriptor belongs to.
+ * @param fd Descriptor.
+ * @return The export, NULL if the descriptor is not an exported buffer.
+ */
+static struct sim_export_t *sim_find_export(int fd) {
+  unsigned int i;
+
+  for (i = 0; fd >= 0 && i < V4L2_SIM_MAX_EXPORTS; i++) {
+    if (sim.exports[i].fd == fd) {
+      return &sim.exports[i];
+    }
+  }
+  return NULL;
+}
+
+void v4l2_sim_reset(const struct v4l2_sim_config_t *config) {
+  pthread_once(&sim_once, sim_init_conds);
+  pthread_mutex_lock(&sim.lock);
+
+  sim_stop_streaming();
+  sim_free_buffers();
+  if (sim.fd >= 0) {
+    int fd = sim.fd;
+
+    /* Disown the descriptor first, glue code routes close() back here. */
+    sim.fd = -1;
+    close(fd);
+  }
+  if (sim.media_fd >= 0) {
+    int fd = sim.media_fd;
+
+    sim.media_fd = -1;
+    close(fd);
+  }
+  if (sim.subdev_fd >= 0) {
+    int fd = sim.subdev_fd;
+
+    sim.subdev_fd = -1;
+    close(fd);
+  }
+  {
+    unsigned int i;
+
+    for (i = 0; i < V4L2_SIM_MAX_REQUESTS; i++) {
+      sim_free_request(&sim.requests[i]);
+    }
+    for (i = 0; i < V4L2_SIM_MAX_EXPORTS; i++) {
+      sim_free_export(&sim.exports[i]);
+    }
+  }
+  sim.ready = 0;
+
+  sim.config = config ? *config : DEFAULT_CONFIG;
+  if (sim.config.device_path == NULL) {
+    sim.config.device_path = DEFAULT_CONFIG.device_path;
+  }
+  if (sim.config.max_buffers == 0 ||
+      sim.config.max_buffers > V4L2_SIM_MAX_BUFFERS) {
+    sim.config.max_buffers = V4L2_SIM_MAX_BUFFERS;
+  }
+  if (sim.config.payload_permille == 0 ||
+      sim.config.payload_permille > 1000) {
+    sim.config.payload_permille = DEFAULT_CONFIG.payload_permille;
+  }
+  if (sim.config.payload_jitter_permille > 1000) {
+    sim.config.payload_jitter_permille = 1000;
+  }
+
+  memset(&sim.format, 0, sizeof(sim.format));
+  sim.plane_count = 0;
+  memset(&sim.stats, 0, sizeof(sim.stats));
+  memset(sim.call_faults, 0, sizeof(sim.call_faults));
+  sim.frame_fault_count = 0;
+  sim.scene = 0;
+  sim.exposure = V4L2_SIM_DEFAULT_EXPOSURE;
+  sim.exposure_auto = V4L2_EXPOSURE_AUTO;
+  sim.pending_count = 0;
+  sim.sensor_linked = 0;
+  memset(&sim.sensor_format, 0, sizeof(sim.sensor_format));
+  sim.sensor_format.width = SIM_SENSOR_WIDTH;
+  sim.sensor_format.height = SIM_SENSOR_HEIGHT;
+  sim.sensor_format.code = MEDIA_BUS_FMT_SBGGR10_1X10;
+  sim.sensor_format.field = V4L2_FIELD_NONE;
+  sim.sensor_format.colorspace = V4L2_COLORSPACE_RAW;
+
+  pthread_mutex_unlock(&sim.lock);
+}
+
+void v4l2_sim_fail(enum v4l2_sim_op_t op, unsigned long first,
+                   unsigned long count, int err) {
+  pthread_mutex_lock(&sim.lock);
+  sim.call_faults[op].first = first;
+  sim.call_faults[op].count = count;
+  sim.call_faults[op].err = err;
+  pthread_mutex_unlock(&sim.lock);
+}
+
+int v4l2_sim_frame_fault(unsigned long frame, enum v4l2_sim_frame_fault_t fault,
+                         __u32 value) {
+  int status_code = -1;
+
+  pthread_mutex_lock(&sim.lock);
+  if (sim.frame_fault_count < V4L2_SIM_MAX_FRAME_FAULTS) {
+    sim.frame_faults[sim.frame_fault_count].frame = frame;
+    sim.frame_faults[sim.frame_fault_count].fault = fault;
+    sim.frame_faults[sim.frame_fault_count].value = value;
+    sim.frame_fault_count++;
+    status_code = 0;
+  }
+  pthread_mutex_unlock(&sim.lock);
+
+  return status_code;
+}
+
+void v4l2_sim_get_stats(struct v4l2_sim_stats_t *stats) {
+  pthread_mutex_lock(&sim.lock);
+  *stats = sim.stats;
+  pthread_mutex_unlock(&sim.lock);
+}
+
+int v4l2_sim_owns_path(const char *path) {
+  const char *device_path = sim.config.device_path
+                                ? sim.config.device_path
+                                : DEFAULT_CONFIG.device_path;
+
+  return path != NULL &&
+         (strcmp(path, device_path) == 0 ||
+          (sim.config.media_path != NULL &&
+           strcmp(path, sim.config.media_path) == 0) ||
+          (sim.config.subdev_path != NULL &&
+           (strcmp(path, sim.config.subdev_path) == 0 ||
+            strcmp(path, SIM_SUBDEV_UEVENT) == 0)));
+}
+
+int v4l2_sim_owns_fd(int fd) {
+  return fd >= 0 && (fd == sim.fd || fd == sim.media_fd ||
+                     fd == sim.subdev_fd ||
+                     sim_find_request(fd) != NULL ||
+                     sim_find_export(fd) != NULL);
+}
+
+/**
+ * @brief The uevent file of the subdev: a memfd holding what sysfs would,
+ * read and closed like any file.
+ * @return Descriptor, or -1 with errno set.
+ */
+static int sim_open_uevent(void) {
+  const char *name = sim.config.subdev_path;
+  char text[256];
+  int length;
+  int fd;
+
+  if (strncmp(name, "/dev/", 5) == 0) {
+    name += 5;
+  }
+  length = snprintf(text, sizeof(text), "MAJOR=%d\nMINOR=%d\nDEVNAME=%s\n",
+                    SIM_DEVNODE_MAJOR, SIM_SUBDEV_MINOR, name);
+  fd = memfd_create("v4l2-sim-uevent", MFD_CLOEXEC);
+  if (fd < 0) {
+    return -1;
+  }
+  if (write(fd, text, (size_t)length) != length ||
+      lseek(fd, 0, SEEK_SET) < 0) {
+    close(fd);
+    return -1;
+  }
+  return fd;
+}
+
+int v4l2_sim_open(const char *path, int flags) {
+  int fd = -1;
+
+  pthread_once(&sim_once, sim_init_conds);
+  pthread_mutex_lock(&sim.lock);
+
+  if (sim.config.device_path == NULL) {
+    sim.config = DEFAULT_CONFIG;
+  }
+
+  if (sim_account(V4L2_SIM_OP_OPEN) < 0) {
+    goto out;
+  }
+  if (sim.config.media_path != NULL &&
+      strcmp(path, sim.config.media_path) == 0) {
+    if (sim.media_fd >= 0) {
+      errno = EBUSY;
+      goto out;
+    }
+    /* Nothing is ever read from it, any descriptor will do. */
+    sim.media_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    fd = sim.media_fd;
+    goto out;
+  }
+  if (sim.config.subdev_path != NULL &&
+      strcmp(path, sim.config.subdev_path) == 0) {
+    if (sim.subdev_fd >= 0) {
+      errno = EBUSY;
+      goto out;
+    }
+    sim.subdev_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    fd = sim.subdev_fd;
+    goto out;
+  }
+  if (sim.config.subdev_path != NULL && strcmp(path, SIM_SUBDEV_UEVENT) == 0) {
+    fd = sim_open_uevent();
+    goto out;
+  }
+  if (sim.fd >= 0) {
+    /* One opener at a time keeps the simulation simple. */
+    errno = EBUSY;
+    goto out;
+  }
+
+  sim.fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+  sim.nonblock = (flags & O_NONBLOCK) != 0;
+  sim.ready = 0;
+  fd = sim.fd;
+
+out:
+  pthread_mutex_unlock(&sim.lock);
+  return fd;
+}
+
+/**
+ * @brief Bytes per line and image size for a format, and its planes.
+ * @param pix Format to complete. Of a format with several planes,
+ * bytesperline is that of the first and sizeimage covers them all.
+ * @param sizes Set to the bytes of each plane.
+ * @param strides Set to the bytes per line of each plane.
+ * @return Number of planes, or -1 on an unsupported pixel format.
+ */
+static int sim_complete_format(struct v4l2_pix_format *pix, __u32 *sizes,
+                               __u32 *strides) {
+  __u32 chroma_width = (pix->width + 1) / 2;
+  __u32 chroma_height = (pix->height + 1) / 2;
+  int planes = 1;
+  int plane;
+
+  if (pix->width == 0 || pix->height == 0 || pix->width > 2592 ||
+      pix->height > 1944) {
+    return -1;
+  }
+
+  switch (pix->pixelformat) {
+  case V4L2_PIX_FMT_MJPEG:
+    pix->bytesperline = 0;
+    pix->sizeimage = pix->width * pix->height * 2;
+    break;
+  case V4L2_PIX_FMT_YUYV:
+    pix->bytesperline = pix->width * 2;
+    pix->sizeimage = pix->bytesperline * pix->height;
+    break;
+  case V4L2_PIX_FMT_GREY:
+    pix->bytesperline = pix->width;
+    pix->sizeimage = pix->bytesperline * pix->height;
+    break;
+  case V4L2_PIX_FMT_SBGGR10:
+    pix->bytesperline = pix->width * 2;
+    pix->sizeimage = pix->bytesperline * pix->height;
+    break;
+  case V4L2_PIX_FMT_SBGGR10P:
+    pix->bytesperline = (pix->width + 3) / 4 * 5;
+    pix->sizeimage = pix->bytesperline * pix->height;
+    break;
+  case V4L2_PIX_FMT_NV12M:
+    /* Luma, then interleaved CbCr at half the height. */
+    planes = 2;
+    strides[0] = strides[1] = pix->width;
+    sizes[0] = pix->width * pix->height;
+    sizes[1] = pix->width * chroma_height;
+    break;
+  case V4L2_PIX_FMT_YUV420M:
+    planes = 3;
+    strides[0] = pix->width;
+    strides[1] = strides[2] = chroma_width;
+    sizes[0] = pix->width * pix->height;
+    sizes[1] = sizes[2] = chroma_width * chroma_height;
+    break;
+  default:
+    return -1;
+  }
+
+  if (planes == 1) {
+    strides[0] = pix->bytesperline;
+    sizes[0] = pix->sizeimage;
+  } else {
+    pix->bytesperline = strides[0];
+    pix->sizeimage = 0;
+    for (plane = 0; plane < planes; plane++) {
+      pix->sizeimage += sizes[plane];
+    }
+  }
+  pix->field = V4L2_FIELD_NONE;
+  return planes;
+}
+
+/**
+ * @brief The buffer type the device offers.
+ */
+static __u32 sim_buffer_type(void) {
+  return sim.config.mplane ? V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE
+                           : V4L2_BUF_TYPE_VIDEO_CAPTURE;
+}
+
+/**
+ * @brief Read a format request of the type the device offers and complete
+ * it. Formats with several planes need the multi-planar API.
+ * @param format Request, as given to S_FMT or TRY_FMT.
+ * @param pix Set to the completed single-planar format.
+ * @param sizes Set to the bytes of each plane.
+ * @param strides Set to the bytes per line of each plane.
+ * @return Number of planes, or -1 if the request cannot be met.
+ */
+static int sim_take_format(const struct v4l2_format *format,
+                           struct v4l2_pix_format *pix, __u32 *sizes,
+                           __u32 *strides) {
+  int planes;
+
+  if (format->type != sim_buffer_type()) {
+    return -1;
+  }
+  memset(pix, 0, sizeof(*pix));
+  if (sim.config.mplane) {
+    pix->width = format->fmt.pix_mp.width;
+    pix->height = format->fmt.pix_mp.height;
+    pix->pixelformat = format->fmt.pix_mp.pixelformat;
+    pix->colorspace = format->fmt.pix_mp.colorspace;
+  } else {
+    *pix = format->fmt.pix;
+  }
+  planes = sim_complete_format(pix, sizes, strides);
+  return planes > 1 && !sim.config.mplane ? -1 : planes;
+}
+
+/**
+ * @brief Write a completed format back the way the device offers it.
+ * @param pix Completed single-planar format.
+ * @param planes Number of planes.
+ * @param sizes Bytes of each plane.
+ * @param strides Bytes per line of each plane.
+ * @param format Destination.
+ */
+static void sim_give_format(const struct v4l2_pix_format *pix, int planes,
+                            const __u32 *sizes, const __u32 *strides,
+                            struct v4l2_format *format) {
+  struct v4l2_pix_format_mplane *mp = &format->fmt.pix_mp;
+  int plane;
+
+  memset(format, 0, sizeof(*format));
+  format->type = sim_buffer_type();
+  if (!sim.config.mplane) {
+    format->fmt.pix = *pix;
+    return;
+  }
+  mp->width = pix->width;
+  mp->height = pix->height;
+  mp->pixelformat = pix->pixelformat;
+  mp->field = pix->field;
+  mp->colorspace = pix->colorspace;
+  mp->num_planes = (__u8)planes;
+  for (plane = 0; plane < planes; plane++) {
+    mp->plane_fmt[plane].sizeimage = sizes[plane];
+    mp->plane_fmt[plane].bytesperline = strides[plane];
+  }
+}
+
+/**
+ * @brief Fill a buffer with a 10-bit Bayer scene: smooth gradients, a level
+ * offset per colour channel and a few bits of sensor noise.
+ * @param start Buffer.
+ * @param index Buffer index, shifts the scene a little per buffer.
+ */
+static void sim_fill_bayer(uint8_t *start, __u32 index) {
+  const struct v4l2_pix_format *pix = &sim.format.fmt.pix;
+  uint32_t noise = 0x9e3779b9u + index;
+  __u32 x;
+  __u32 y;
+
+  for (y = 0; y < pix->height; y++) {
+    uint8_t *line = start + (size_t)y * pix->bytesperline;
+
+    for (x = 0; x < pix->width; x++) {
+      unsigned int value;
+
+      noise = noise * 1664525u + 1013904223u;
+      value = 200 + x * 400 / pix->width + y * 200 / pix->height +
+              (x & 1) * 60 + (y & 1) * 30 + index * 4 + (noise >> 29);
+      if (pix->pixelformat == V4L2_PIX_FMT_SBGGR10) {
+        line[2 * x] = (uint8_t)value;
+        line[2 * x + 1] = (uint8_t)(value >> 8);
+      } else {
+        /* MIPI packing: high bits per sample, low bits in every 5th byte. */
+        uint8_t *group = line + x / 4 * 5;
+
+        group[x & 3] = (uint8_t)(value >> 2);
+        group[4] = (uint8_t)((group[4] & ~(3 << (x & 3) * 2)) |
+                             (value & 3) << (x & 3) * 2);
+      }
+    }
+  }
+}
+
+/**
+ * @brief MSB-first bit writer for the entropy coded part of a JPEG, with
+ * 0xFF byte stuffing.
+ */
+struct sim_bits_t {
+  uint8_t *out;
+  uint8_t *end;
+  uint32_t acc;
+  int count;
+};
+
+static void sim_put_bits(struct sim_bits_t *bits, uint32_t value, int count) {
+  bits->acc = (bits->acc << count) | value;
+  bits->count += count;
+  while (bits->count >= 8 && bits->out + 2 <= bits->end) {
+    uint8_t byte = (uint8_t)(bits->acc >> (bits->count - 8));
+
+    bits->count -= 8;
+    *bits->out++ = byte;
+    if (byte == 0xff) {
+      *bits->out++ = 0x00;
+    }
+  }
+}
+
+/**
+ * @brief Luma of the scene at a point, 0-255.
+ */
+static unsigned int sim_scene_luma(__u32 x, __u32 y) {
+  const struct v4l2_pix_format *pix = &sim.format.fmt.pix;
+  __u32 left = (sim.scene - 1) % 4 * pix->width / 4 + pix->width / 16;
+
+  if (sim.scene != 0 && x >= left && x < left + pix->width / 8 &&
+      y >= pix->height / 3 && y < pix->height / 3 + pix->height / 6) {
+    return 240;
+  }
+  return 40 + x * 150 / pix->width + y * 40 / pix->height;
+}
+
+/**
+ * @brief Render the scene as a baseline 4:2:2 JPEG in which every block is
+ * flat: a DC coefficient and an end of block. No DHT is written, decoders
+ * use the standard tables like they do for UVC MJPEG. A COM segment right
+ * after SOI leaves room for the sequence and exposure stamp.
+ * @param start Buffer.
+ * @param capacity Buffer size.
+ * @return Bytes written, 0 if the image does not fit.
+ */
+static size_t sim_render_jpeg(uint8_t *start, size_t capacity) {
+  /* Luma DC codes by category, ITU T.81 table K.3. */
+  static const uint16_t dc_code[12] = {0x0,  0x2,  0x3,  0x4,  0x5,   0x6,
+                                       0xe,  0x1e, 0x3e, 0x7e, 0xfe, 0x1fe};
+  static const uint8_t dc_length[12] = {2, 3, 3, 3, 3, 3, 4, 5, 6, 7, 8, 9};
+  const struct v4l2_pix_format *pix = &sim.format.fmt.pix;
+  uint8_t header[] = {
+      0xff, 0xd8,                               /* SOI */
+      0xff, 0xfe, 0x00, 0x0a, 0, 0, 0, 0, 0, 0, 0, 0, /* COM */
+      0xff, 0xdb, 0x00, 0x84,                   /* DQT */
+      0xff, 0xc0, 0x00, 0x11, 0x08, 0, 0, 0, 0, /* SOF0 */
+      0x03, 0x01, 0x21, 0x00, 0x02, 0x11, 0x01, 0x03, 0x11, 0x01,
+      0xff, 0xda, 0x00, 0x0c, 0x03, /* SOS */
+      0x01, 0x00, 0x02, 0x11, 0x03, 0x11, 0x00, 0x3f, 0x00};
+  struct sim_bits_t bits;
+  uint8_t *cursor = start;
+  __u32 columns = (pix->width + 15) / 16;
+  __u32 rows = (pix->height + 7) / 8;
+  __u32 mcu;
+  int predictor = 0;
+  int i;
+
+  if (capacity < 2 * sizeof(header) + 130) {
+    return 0;
+  }
+  header[23] = (uint8_t)(pix->height >> 8);
+  header[24] = (uint8_t)pix->height;
+  header[25] = (uint8_t)(pix->width >> 8);
+  header[26] = (uint8_t)pix->width;
+
+  /* Copy up to the DQT payload, then two tables: luma with a DC quantizer
+   * of 8 so a coefficient equals the block mean minus 128, chroma flat. */
+  memcpy(cursor, header, 18);
+  cursor += 18;
+  for (i = 0; i < 2; i++) {
+    *cursor++ = (uint8_t)i;
+    memset(cursor, 1, 64);
+    cursor[0] = i == 0 ? 8 : 1;
+    cursor += 64;
+  }
+  memcpy(cursor, header + 18, sizeof(header) - 18);
+  cursor += sizeof(header) - 18;
+
+  bits.out = cursor;
+  bits.end = start + capacity - 2;
+  bits.acc = 0;
+  bits.count = 0;
+  for (mcu = 0; mcu < columns * rows; mcu++) {
+    __u32 x = mcu % columns * 16;
+    __u32 y = mcu / columns * 8 + 4;
+    int block;
+
+    for (block = 0; block < 2; block++) {
+      int value = (int)sim_scene_luma(x + block * 8 + 4, y) - 128;
+      int diff = value - predictor;
+      int magnitude = diff < 0 ? -diff : diff;
+      int category = 0;
+
+      while (magnitude >> category) {
+        category++;
+      }
+      sim_put_bits(&bits, dc_code[category], dc_length[category]);
+      if (category > 0) {
+        sim_put_bits(&bits,
+                     (uint32_t)(diff < 0 ? diff + (1 << category) - 1 : diff),
+                     category);
+      }
+      sim_put_bits(&bits, 0xa, 4); /* luma EOB */
+      predictor = value;
+    }
+    /* Cb and Cr: DC difference 0 and EOB, both "00" in the chroma tables. */
+    sim_put_bits(&bits, 0x0, 4);
+    sim_put_bits(&bits, 0x0, 4);
+    if (bits.out + 2 >= bits.end) {
+      return 0;
+    }
+  }
+  if (bits.count > 0) {
+    sim_put_bits(&bits, 0xff >> bits.count, 8 - bits.count);
+  }
+  *bits.out++ = 0xff;
+  *bits.out++ = 0xd9;
+
+  return (size_t)(bits.out - start);
+}
+
+/**
+ * @brief Header before the payload of each plane, multi-planar API only.
+ */
+static __u32 sim_header(void) {
+  return sim.config.mplane ? sim.config.data_offset : 0;
+}
+
+/**
+ * @brief Render a buffer with the current scene, so frames carry
+ * image-like content without paying a fill per dequeue. Buffers are only
+ * rendered again after a scene change.
+ * @param index Buffer index.
+ */
+static void sim_render_buffer(__u32 index) {
+  const struct v4l2_pix_format *pix = &sim.format.fmt.pix;
+  uint8_t *map = mmap(NULL, sim.buffer_size, PROT_READ | PROT_WRITE,
+                      MAP_SHARED, sim.memfd, index * sim.buffer_size);
+  /* Every plane's payload is as far past the start of its plane. */
+  uint8_t *start = map + sim_header();
+  size_t i;
+  __u32 x;
+  __u32 y;
+
+  if (map == MAP_FAILED) {
+    return;
+  }
+  sim.buffer_scene[index] = sim.scene;
+
+  if (pix->pixelformat == V4L2_PIX_FMT_SBGGR10 ||
+      pix->pixelformat == V4L2_PIX_FMT_SBGGR10P) {
+    sim_fill_bayer(start, index);
+    munmap(map, sim.buffer_size);
+    return;
+  }
+  if (pix->pixelformat == V4L2_PIX_FMT_MJPEG &&
+      sim_render_jpeg(start, sim.buffer_size - sim_header()) > 0) {
+    munmap(map, sim.buffer_size);
+    return;
+  }
+
+  if (sim.plane_count > 1) {
+    /* Luma as below, neutral chroma. */
+    for (i = 0; i < sim.plane_size[0]; i++) {
+      start[i] = (uint8_t)(i * 7 + index);
+    }
+    for (i = 1; i < sim.plane_count; i++) {
+      memset(start + sim.plane_offset[i], 128, sim.plane_size[i]);
+    }
+  } else {
+    for (i = 0; i < pix->sizeimage; i++) {
+      start[i] = (uint8_t)(i * 7 + index);
+    }
+  }
+  if (sim.scene != 0 && pix->pixelformat != V4L2_PIX_FMT_MJPEG) {
+    for (y = 0; y < pix->height; y++) {
+      for (x = 0; x < pix->width; x++) {
+        if (sim_scene_luma(x, y) == 240) {
+          start[(size_t)y * pix->bytesperline +
+                (pix->pixelformat == V4L2_PIX_FMT_YUYV ? 2 * x : x)] = 240;
+        }
+      }
+    }
+  }
+  munmap(map, sim.buffer_size);
+}
+
+/**
+ * @brief Whether a buffer passed in is of the type the device offers and,
+ * for the multi-planar API, has room for every plane.
+ * @param buffer Buffer argument of QUERYBUF, QBUF or DQBUF.
+ * @return 0 if so, -1 if not.
+ */
+static int sim_check_buffer(const struct v4l2_buffer *buffer) {
+  if (buffer->type != sim_buffer_type()) {
+    return -1;
+  }
+  if (sim.config.mplane &&
+      (buffer->m.planes == NULL || buffer->length < sim.plane_count)) {
+    return -1;
+  }
+  return 0;
+}
+
+/**
+ * @brief Describe a buffer plane by plane, for the multi-planar API. The
+ * payload fills the planes in order, so a short one leaves the last
+ * planes empty.
+ * @param buffer Buffer, its single-planar fields set.
+ * @param planes Planes array of the caller.
+ * @param bytesused Payload of the whole buffer.
+ */
+static void sim_fill_planes(struct v4l2_buffer *buffer,
+                            struct v4l2_plane *planes, __u32 bytesused) {
+  unsigned int plane;
+
+  for (plane = 0; plane < sim.plane_count; plane++) {
+    __u32 used =
+        bytesused < sim.plane_size[plane] ? bytesused : sim.plane_size[plane];
+
+    memset(&planes[plane], 0, sizeof(planes[plane]));
+    planes[plane].bytesused = used + sim_header();
+    planes[plane].length = sim.plane_size[plane] + sim_header();
+    planes[plane].data_offset = sim_header();
+    planes[plane].m.mem_offset =
+        (__u32)(buffer->index * sim.buffer_size + sim.plane_offset[plane]);
+    bytesused -= used;
+  }
+  buffer->m.planes = planes;
+  buffer->length = sim.plane_count;
+  buffer->bytesused = 0;
+}
+
+static int sim_reqbufs(struct v4l2_requestbuffers *request) {
+  long page = sysconf(_SC_PAGESIZE);
+  __u32 count = request->count;
+  __u32 index;
+  unsigned int plane;
+
+  if (request->type != sim_buffer_type() ||
+      request->memory != V4L2_MEMORY_MMAP) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (sim.streaming) {
+    errno = EBUSY;
+    return -1;
+  }
+  request->capabilities =
+      V4L2_BUF_CAP_SUPPORTS_MMAP |
+      (sim.config.media_path != NULL ? V4L2_BUF_CAP_SUPPORTS_REQUESTS : 0);
+
+  sim_free_buffers();
+  if (count == 0) {
+    return 0;
+  }
+  if (count < sim.config.min_buffers) {
+    count = sim.config.min_buffers;
+  }
+  if (count > sim.config.max_buffers) {
+    count = sim.config.max_buffers;
+  }
+  if (sim.format.fmt.pix.sizeimage == 0) {
+    /* Formats are negotiated before buffers. */
+    errno = EINVAL;
+    return -1;
+  }
+
+  /* Planes start on pages of their own, so each can be mapped. */
+  sim.plane_offset[0] = 0;
+  for (plane = 0; plane < sim.plane_count; plane++) {
+    sim.plane_offset[plane + 1] =
+        sim.plane_offset[plane] +
+        (sim.plane_size[plane] + sim_header() + page - 1) / page *
+            (size_t)page;
+  }
+  sim.buffer_size = sim.plane_offset[sim.plane_count];
+  sim.memfd = memfd_create("v4l2-sim", MFD_CLOEXEC);
+  if (sim.memfd < 0) {
+    return -1;
+  }
+  if (ftruncate(sim.memfd, (off_t)(sim.buffer_size * count)) < 0) {
+    sim_free_buffers();
+    return -1;
+  }
+  sim.buffer_count = count;
+  for (index = 0; index < count; index++) {
+    sim_render_buffer(index);
+  }
+
+  request->count = count;
+  return 0;
+}
+
+/**
+ * @brief Apply the scheduled per-frame faults to a buffer about to be
+ * dequeued.
+ * @param buffer Buffer to alter.
+ */
+static void sim_apply_frame_faults(struct v4l2_buffer *buffer) {
+  unsigned int i;
+
+  for (i = 0; i < sim.frame_fault_count; i++) {
+    struct sim_frame_fault_t *fault = &sim.frame_faults[i];
+
+    if (fault->frame != sim.stats.frames) {
+      continue;
+    }
+    switch (fault->fault) {
+    case V4L2_SIM_FRAME_SHORT:
+      buffer->bytesused = fault->value;
+      break;
+    case V4L2_SIM_FRAME_ERROR:
+      buffer->flags |= V4L2_BUF_FLAG_ERROR;
+      break;
+    case V4L2_SIM_FRAME_SEQ_GAP:
+      sim.stats.sequence += fault->value;
+      break;
+    case V4L2_SIM_FRAME_SCENE:
+      sim.scene = fault->value;
+      break;
+    }
+  }
+}
+
+/**
+ * @brief Stamp a compressed frame: SOI and a COM segment holding the frame
+ * number and the exposure it was taken with at the start, EOI at the end of
+ * the payload.
+ * @param index Buffer index.
+ * @param bytesused Payload size.
+ * @param sequence Frame sequence number.
+ */
+static void sim_stamp_frame(__u32 index, __u32 bytesused, __u32 sequence) {
+  uint8_t header[14] = {0xff, 0xd8, 0xff, 0xfe, 0x00, 0x0a};
+  uint8_t trailer[2] = {0xff, 0xd9};
+  off_t base = (off_t)index * sim.buffer_size + sim_header();
+
+  if (sim.format.fmt.pix.pixelformat != V4L2_PIX_FMT_MJPEG ||
+      bytesused < sizeof(header) + sizeof(trailer)) {
+    return;
+  }
+  memcpy(header + 6, &sequence, sizeof(sequence));
+  memcpy(header + 10, &sim.exposure, sizeof(sim.exposure));
+  (void)!pwrite(sim.memfd, header, sizeof(header), base);
+  (void)!pwrite(sim.memfd, trailer, sizeof(trailer),
+                base + bytesused - sizeof(trailer));
+}
+
+/**
+ * @brief Settle the exposure a frame is taken with: pending changes that
+ * reached the sensor by then, or the value of the request carrying the
+ * buffer, which completes.
+ * @param buffer Buffer being completed, sequence not yet assigned.
+ */
+static void sim_apply_controls(struct v4l2_buffer *buffer) {
+  unsigned int applied = 0;
+  unsigned int i;
+
+  while (applied < sim.pending_count &&
+         sim.pending[applied].sequence <= sim.stats.sequence) {
+    sim.exposure = sim.pending[applied++].value;
+  }
+  sim.pending_count -= applied;
+  memmove(sim.pending, sim.pending + applied,
+          sim.pending_count * sizeof(sim.pending[0]));
+
+  for (i = 0; i < V4L2_SIM_MAX_REQUESTS; i++) {
+    struct sim_request_t *request = &sim.requests[i];
+    uint64_t value = 1;
+
+    if (request->fd < 0 || !request->queued || request->complete ||
+        !request->has_buffer || request->buffer != buffer->index) {
+      continue;
+    }
+    if (request->has_exposure && sim.exposure_auto == V4L2_EXPOSURE_MANUAL) {
+      sim.exposure = request->exposure;
+    }
+    request->complete = 1;
+    (void)!write(request->fd, &value, sizeof(value));
+    buffer->flags |= V4L2_BUF_FLAG_REQUEST_FD;
+    buffer->request_fd = request->fd;
+    break;
+  }
+}
+
+/**
+ * @brief Complete a buffer: take it off the queue and fill in the metadata
+ * the driver reports on dequeue.
+ * @param buffer Destination of the metadata.
+ */
+static void sim_complete_buffer(struct v4l2_buffer *buffer) {
+  struct timespec now;
+  __u32 index;
+
+  index = sim.ring[sim.ring_head];
+  sim.ring_head = (sim.ring_head + 1) % V4L2_SIM_MAX_BUFFERS;
+  sim.ring_len--;
+
+  memset(buffer, 0, sizeof(*buffer));
+  buffer->type = sim_buffer_type();
+  buffer->memory = V4L2_MEMORY_MMAP;
+  buffer->index = index;
+  buffer->length = sim.format.fmt.pix.sizeimage;
+  buffer->m.offset = index * sim.buffer_size;
+  buffer->field = V4L2_FIELD_NONE;
+  buffer->flags = V4L2_BUF_FLAG_MAPPED | V4L2_BUF_FLAG_TIMESTAMP_MONOTONIC;
+  if (sim.format.fmt.pix.pixelformat == V4L2_PIX_FMT_MJPEG) {
+    unsigned long long permille =
+        sim.config.payload_permille +
+        sim_random_offset(sim.config.payload_permille *
+                          sim.config.payload_jitter_permille / 1000);
+
+    buffer->bytesused =
+        (__u32)((unsigned long long)buffer->length * permille / 1000);
+    if (buffer->bytesused == 0) {
+      buffer->bytesused = 1;
+    }
+  } else {
+    buffer->bytesused = buffer->length;
+  }
+
+  sim_apply_frame_faults(buffer);
+  sim_apply_controls(buffer);
+  if (sim.buffer_scene[index] != sim.scene) {
+    sim_render_buffer(index);
+  }
+  buffer->sequence = sim.stats.sequence++;
+  sim_stamp_frame(index, buffer->bytesused, buffer->sequence);
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  buffer->timestamp.tv_sec = now.tv_sec;
+  buffer->timestamp.tv_usec = now.tv_nsec / 1000;
+
+  sim.stats.frames++;
+}
+
+/**
+ * @brief Paced mode: complete one queued buffer per frame period, ideal
+ * deadlines plus uniform jitter so timing error does not accumulate.
+ * @param arg Unused.
+ * @return NULL.
+ */
+static void *sim_producer(void *arg) {
+  long long period_ns;
+  long long start_ns;
+  struct timespec now;
+  unsigned long frame = 0;
+
+  (void)arg;
+  pthread_mutex_lock(&sim.lock);
+
+  period_ns = 1000000000LL / sim.config.fps;
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  start_ns = now.tv_sec * 1000000000LL + now.tv_nsec;
+
+  while (sim.producer_running) {
+    long long deadline_ns =
+        start_ns + ++frame * period_ns +
+        sim_random_offset(sim.config.jitter_us) * 1000LL;
+    struct timespec deadline = {
+        .tv_sec = deadline_ns / 1000000000LL,
+        .tv_nsec = deadline_ns % 1000000000LL,
+    };
+
+    while (sim.producer_running &&
+           pthread_cond_timedwait(&sim.wake, &sim.lock, &deadline) !=
+               ETIMEDOUT) {
+    }
+    if (!sim.producer_running) {
+      break;
+    }
+
+    if (sim.ring_len == 0) {
+      /* The sensor does not wait: no buffer, the frame is lost. */
+      sim.stats.sequence++;
+      sim.stats.dropped++;
+      continue;
+    }
+
+    {
+      __u32 index = sim.ring[sim.ring_head];
+
+      sim_complete_buffer(&sim.done_meta[index]);
+      sim.done[(sim.done_head + sim.done_len) % V4L2_SIM_MAX_BUFFERS] = index;
+      sim.done_len++;
+    }
+    sim_update_ready();
+    pthread_cond_broadcast(&sim.done_cond);
+  }
+
+  pthread_mutex_unlock(&sim.lock);
+  return NULL;
+}
+
+static int sim_dqbuf(struct v4l2_buffer *buffer) {
+  struct v4l2_plane *planes = buffer->m.planes;
+  __u32 index;
+
+  if (sim_check_buffer(buffer) < 0 || !sim.streaming) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  if (sim.config.fps == 0) {
+    if (sim.ring_len == 0) {
+      /* A blocking dequeue with nothing queued would hang forever. */
+      errno = sim.nonblock ? EAGAIN : EINVAL;
+      return -1;
+    }
+    sim.queued[sim.ring[sim.ring_head]] = 0;
+    sim_complete_buffer(buffer);
+    if (sim.config.mplane) {
+      sim_fill_planes(buffer, planes, buffer->bytesused);
+    }
+    return 0;
+  }
+
+  while (sim.done_len == 0) {
+    if (sim.nonblock) {
+      errno = EAGAIN;
+      return -1;
+    }
+    if (!sim.streaming || sim.ring_len == 0) {
+      errno = EINVAL;
+      return -1;
+    }
+    pthread_cond_wait(&sim.done_cond, &sim.lock);
+  }
+
+  index = sim.done[sim.done_head];
+  sim.done_head = (sim.done_head + 1) % V4L2_SIM_MAX_BUFFERS;
+  sim.done_len--;
+  sim.queued[index] = 0;
+  *buffer = sim.done_meta[index];
+  if (sim.config.mplane) {
+    sim_fill_planes(buffer, planes, buffer->bytesused);
+  }
+  return 0;
+}
+
+/**
+ * @brief Set the exposure as VIDIOC_S_CTRL does: at once while stopped,
+ * control_latency frames after the next one while streaming, not at all
+ * while auto exposure is on.
+ * @param value New exposure.
+ * @return 0 on success, -1 with errno set.
+ */
+static int sim_set_exposure(__s32 value) {
+  if (value < SIM_EXPOSURE_MIN || value > SIM_EXPOSURE_MAX) {
+    errno = ERANGE;
+    return -1;
+  }
+  if (sim.exposure_auto != V4L2_EXPOSURE_MANUAL) {
+    return 0;
+  }
+  if (!sim.streaming || sim.config.control_latency == 0) {
+    sim.exposure = value;
+    sim.pending_count = 0;
+    return 0;
+  }
+  if (sim.pending_count == SIM_MAX_PENDING_CONTROLS) {
+    errno = EBUSY;
+    return -1;
+  }
+  sim.pending[sim.pending_count].value = value;
+  sim.pending[sim.pending_count].sequence =
+      sim.stats.sequence + sim.config.control_latency;
+  sim.pending_count++;
+  return 0;
+}
+
+/**
+ * @brief Switch auto exposure. The exposure the loop settled on stays when
+ * it is turned off; changes still on their way are dropped when it is
+ * turned on.
+ * @param value V4L2_EXPOSURE_AUTO or V4L2_EXPOSURE_MANUAL, the only items
+ * of the OV5647 menu.
+ * @return 0 on success, -1 with errno set.
+ */
+static int sim_set_exposure_auto(__s32 value) {
+  if (value != V4L2_EXPOSURE_AUTO && value != V4L2_EXPOSURE_MANUAL) {
+    errno = ERANGE;
+    return -1;
+  }
+  if (value == V4L2_EXPOSURE_AUTO) {
+    sim.pending_count = 0;
+  }
+  sim.exposure_auto = value;
+  return 0;
+}
+
+/**
+ * @brief Exposure the control reads back: the last value set, whether or
+ * not the sensor applies it yet.
+ */
+static __s32 sim_get_exposure(void) {
+  return sim.pending_count > 0 ? sim.pending[sim.pending_count - 1].value
+                               : sim.exposure;
+}
+
+/**
+ * @brief VIDIOC_S_EXT_CTRLS, for the current value or a request.
+ * @param controls Controls to set.
+ * @return 0 on success, -1 with errno set.
+ */
+static int sim_s_ext_ctrls(struct v4l2_ext_controls *controls) {
+  struct sim_request_t *request = NULL;
+  __u32 i;
+
+  if (controls->which == V4L2_CTRL_WHICH_REQUEST_VAL) {
+    request = sim_find_request(controls->request_fd);
+    if (request == NULL) {
+      errno = EINVAL;
+      return -1;
+    }
+    if (request->queued) {
+      errno = EBUSY;
+      return -1;
+    }
+  } else if (controls->which != V4L2_CTRL_WHICH_CUR_VAL) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  for (i = 0; i < controls->count; i++) {
+    const struct v4l2_ext_control *control = &controls->controls[i];
+
+    if (control->id != V4L2_CID_EXPOSURE) {
+      controls->error_idx = i;
+      errno = EINVAL;
+      return -1;
+    }
+    if (control->value < SIM_EXPOSURE_MIN ||
+        control->value > SIM_EXPOSURE_MAX) {
+      controls->error_idx = i;
+      errno = ERANGE;
+      return -1;
+    }
+  }
+  for (i = 0; i < controls->count; i++) {
+    if (request != NULL) {
+      request->has_exposure = 1;
+      request->exposure = controls->controls[i].value;
+    } else if (sim_set_exposure(controls->controls[i].value) < 0) {
+      controls->error_idx = i;
+      return -1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Copy one array of the topology out, if the caller passed one.
+ * @return 0 on success, -1 with ENOSPC if it is too small.
+ */
+static int sim_topology_array(__u64 destination, __u32 room, const void *items,
+                              size_t size, __u32 count) {
+  if (destination == 0) {
+    return 0;
+  }
+  if (room < count) {
+    errno = ENOSPC;
+    return -1;
+  }
+  memcpy((void *)(uintptr_t)destination, items, size * count);
+  return 0;
+}
+
+/**
+ * @brief MEDIA_IOC_G_TOPOLOGY: the sensor linked to the video node, and
+ * the interfaces of both.
+ */
+static int sim_topology(struct media_v2_topology *topology) {
+  struct media_v2_entity entities[2];
+  struct media_v2_interface interfaces[2];
+  struct media_v2_pad pads[2];
+  struct media_v2_link links[3];
+  int status_code;
+
+  memset(entities, 0, sizeof(entities));
+  entities[0].id = SIM_SENSOR_ENTITY;
+  strcpy(entities[0].name, "ov5647 10-0036");
+  entities[0].function = MEDIA_ENT_F_CAM_SENSOR;
+  entities[1].id = SIM_VIDEO_ENTITY;
+  strcpy(entities[1].name, "unicam-image");
+  entities[1].function = MEDIA_ENT_F_IO_V4L;
+  entities[1].flags = MEDIA_ENT_FL_DEFAULT;
+
+  memset(interfaces, 0, sizeof(interfaces));
+  interfaces[0].id = SIM_SUBDEV_INTERFACE;
+  interfaces[0].intf_type = MEDIA_INTF_T_V4L_SUBDEV;
+  interfaces[0].devnode.major = SIM_DEVNODE_MAJOR;
+  interfaces[0].devnode.minor = SIM_SUBDEV_MINOR;
+  interfaces[1].id = SIM_VIDEO_INTERFACE;
+  interfaces[1].intf_type = MEDIA_INTF_T_V4L_VIDEO;
+  interfaces[1].devnode.major = SIM_DEVNODE_MAJOR;
+  interfaces[1].devnode.minor = SIM_VIDEO_MINOR;
+
+  memset(pads, 0, sizeof(pads));
+  pads[0].id = SIM_SENSOR_PAD;
+  pads[0].entity_id = SIM_SENSOR_ENTITY;
+  pads[0].flags = MEDIA_PAD_FL_SOURCE;
+  pads[1].id = SIM_VIDEO_PAD;
+  pads[1].entity_id = SIM_VIDEO_ENTITY;
+  pads[1].flags = MEDIA_PAD_FL_SINK;
+
+  memset(links, 0, sizeof(links));
+  links[0].id = SIM_SENSOR_LINK;
+  links[0].source_id = SIM_SENSOR_PAD;
+  links[0].sink_id = SIM_VIDEO_PAD;
+  links[0].flags =
+      MEDIA_LNK_FL_DATA_LINK | (sim.sensor_linked ? MEDIA_LNK_FL_ENABLED : 0);
+  links[1].id = SIM_SUBDEV_INTERFACE_LINK;
+  links[1].source_id = SIM_SUBDEV_INTERFACE;
+  links[1].sink_id = SIM_SENSOR_ENTITY;
+  links[1].flags = MEDIA_LNK_FL_INTERFACE_LINK | MEDIA_LNK_FL_ENABLED |
+                   MEDIA_LNK_FL_IMMUTABLE;
+  links[2].id = SIM_VIDEO_INTERFACE_LINK;
+  links[2].source_id = SIM_VIDEO_INTERFACE;
+  links[2].sink_id = SIM_VIDEO_ENTITY;
+  links[2].flags = links[1].flags;
+
+  status_code =
+      sim_topology_array(topology->ptr_entities, topology->num_entities,
+                         entities, sizeof(entities[0]), 2) < 0 ||
+              sim_topology_array(topology->ptr_interfaces,
+                                 topology->num_interfaces, interfaces,
+                                 sizeof(interfaces[0]), 2) < 0 ||
+              sim_topology_array(topology->ptr_pads, topology->num_pads, pads,
+                                 sizeof(pads[0]), 2) < 0 ||
+              sim_topology_array(topology->ptr_links, topology->num_links,
+                                 links, sizeof(links[0]), 3) < 0
+          ? -1
+          : 0;
+  /* The graph never changes, nor does its version. */
+  topology->topology_version = 1;
+  topology->num_entities = 2;
+  topology->num_interfaces = 2;
+  topology->num_pads = 2;
+  topology->num_links = 3;
+  return status_code;
+}
+
+/**
+ * @brief Ioctls of the media graph, on the media device.
+ * @return 0 on success, -1 with errno set.
+ */
+static int sim_graph_ioctl(unsigned long command, void *arg) {
+  switch (command) {
+  case MEDIA_IOC_DEVICE_INFO: {
+    struct media_device_info *info = arg;
+
+    memset(info, 0, sizeof(*info));
+    strcpy(info->driver, "v4l2-sim");
+    strcpy(info->model, "Simulated unicam");
+    strcpy(info->bus_info, "platform:v4l2-sim");
+    info->media_version = (6 << 16) | (1 << 8);
+    return 0;
+  }
+
+  case MEDIA_IOC_G_TOPOLOGY:
+    if (sim_account(V4L2_SIM_OP_G_TOPOLOGY) < 0) {
+      return -1;
+    }
+    return sim_topology(arg);
+
+  case MEDIA_IOC_SETUP_LINK: {
+    struct media_link_desc *link = arg;
+
+    if (sim_account(V4L2_SIM_OP_SETUP_LINK) < 0) {
+      return -1;
+    }
+    if (link->source.entity != SIM_SENSOR_ENTITY || link->source.index != 0 ||
+        link->sink.entity != SIM_VIDEO_ENTITY || link->sink.index != 0) {
+      errno = EINVAL;
+      return -1;
+    }
+    if (sim.streaming) {
+      errno = EBUSY;
+      return -1;
+    }
+    sim.sensor_linked = (link->flags & MEDIA_LNK_FL_ENABLED) != 0;
+    return 0;
+  }
+
+  default:
+    errno = ENOTTY;
+    return -1;
+  }
+}
+
+/**
+ * @brief Ioctls on the sensor subdev: the format of its one pad. Sizes
+ * are made even and kept within the sensor, codes other than 8 and 10-bit
+ * BGGR fall back to 10-bit.
+ * @return 0 on success, -1 with errno set.
+ */
+static int sim_subdev_ioctl(unsigned long command, void *arg) {
+  struct v4l2_subdev_format *format = arg;
+  struct v4l2_mbus_framefmt *want = &format->format;
+
+  if (command != VIDIOC_SUBDEV_G_FMT && command != VIDIOC_SUBDEV_S_FMT) {
+    errno = ENOTTY;
+    return -1;
+  }
+  if (format->pad != 0 || (format->which != V4L2_SUBDEV_FORMAT_ACTIVE &&
+                           format->which != V4L2_SUBDEV_FORMAT_TRY)) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (command == VIDIOC_SUBDEV_G_FMT) {
+    *want = sim.sensor_format;
+    return 0;
+  }
+
+  if (sim_account(V4L2_SIM_OP_SUBDEV_S_FMT) < 0) {
+    return -1;
+  }
+  want->width = want->width < 2 ? 2
+                : want->width > SIM_SENSOR_WIDTH ? SIM_SENSOR_WIDTH
+                                                 : want->width & ~1u;
+  want->height = want->height < 2 ? 2
+                 : want->height > SIM_SENSOR_HEIGHT ? SIM_SENSOR_HEIGHT
+                                                    : want->height & ~1u;
+  if (want->code != MEDIA_BUS_FMT_SBGGR8_1X8) {
+    want->code = MEDIA_BUS_FMT_SBGGR10_1X10;
+  }
+  want->field = V4L2_FIELD_NONE;
+  want->colorspace = V4L2_COLORSPACE_RAW;
+  if (format->which == V4L2_SUBDEV_FORMAT_ACTIVE) {
+    if (sim.streaming) {
+      errno = EBUSY;
+      return -1;
+    }
+    sim.sensor_format = *want;
+  }
+  return 0;
+}
+
+/**
+ * @brief Ioctls on the media device or on a request.
+ * @param fd Descriptor, not the video device.
+ * @param command Ioctl number.
+ * @param arg Ioctl argument.
+ * @return 0 on success, -1 with errno set.
+ */
+static int sim_media_ioctl(int fd, unsigned long command, void *arg) {
+  struct sim_request_t *request = sim_find_request(fd);
+  uint64_t value;
+  unsigned int i;
+
+  if (fd == sim.media_fd && command == MEDIA_IOC_REQUEST_ALLOC) {
+    for (i = 0; i < V4L2_SIM_MAX_REQUESTS; i++) {
+      if (sim.requests[i].fd < 0) {
+        break;
+      }
+    }
+    if (i == V4L2_SIM_MAX_REQUESTS) {
+      errno = ENOMEM;
+      return -1;
+    }
+    sim.requests[i].fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+    if (sim.requests[i].fd < 0) {
+      return -1;
+    }
+    *(int *)arg = sim.requests[i].fd;
+    return 0;
+  }
+  if (fd == sim.media_fd && sim.config.subdev_path != NULL) {
+    return sim_graph_ioctl(command, arg);
+  }
+  if (request == NULL) {
+    errno = fd == sim.media_fd ? ENOTTY : EBADF;
+    return -1;
+  }
+
+  switch (command) {
+  case MEDIA_REQUEST_IOC_QUEUE:
+    if (request->queued) {
+      errno = EBUSY;
+      return -1;
+    }
+    if (!request->has_buffer) {
+      /* A request has to carry a buffer to ever complete. */
+      errno = ENOENT;
+      return -1;
+    }
+    request->queued = 1;
+    sim.ring[(sim.ring_head + sim.ring_len) % V4L2_SIM_MAX_BUFFERS] =
+        request->buffer;
+    sim.ring_len++;
+    return 0;
+
+  case MEDIA_REQUEST_IOC_REINIT:
+    if (request->queued && !request->complete) {
+      errno = EBUSY;
+      return -1;
+    }
+    (void)!read(request->fd, &value, sizeof(value));
+    fd = request->fd;
+    memset(request, 0, sizeof(*request));
+    request->fd = fd;
+    return 0;
+
+  default:
+    errno = ENOTTY;
+    return -1;
+  }
+}
+
+/**
+ * @brief Export a buffer as a dma-buf.
+ * @param export_buffer VIDIOC_EXPBUF argument.
+ * @return 0 on success, -1 with errno set.
+ */
+static int sim_expbuf(struct v4l2_exportbuffer *export_buffer) {
+  unsigned int i;
+
+  if (export_buffer->type != sim_buffer_type() ||
+      export_buffer->index >= sim.buffer_count ||
+      export_buffer->plane >= sim.plane_count ||
+      (export_buffer->flags & ~(__u32)(O_ACCMODE | O_CLOEXEC)) != 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  for (i = 0; i < V4L2_SIM_MAX_EXPORTS; i++) {
+    if (sim.exports[i].fd < 0) {
+      break;
+    }
+  }
+  if (i == V4L2_SIM_MAX_EXPORTS) {
+    errno = EMFILE;
+    return -1;
+  }
+  sim.exports[i].fd = eventfd(0, EFD_CLOEXEC);
+  if (sim.exports[i].fd < 0) {
+    return -1;
+  }
+  sim.exports[i].index = export_buffer->index;
+  sim.exports[i].plane = export_buffer->plane;
+  sim.exports[i].writable = (export_buffer->flags & O_ACCMODE) != O_RDONLY;
+  sim.exports[i].cpu = 0;
+  export_buffer->fd = sim.exports[i].fd;
+  return 0;
+}
+
+/**
+ * @brief Ioctls on an exported buffer. Memory is coherent here, so a sync
+ * only checks that CPU access is bracketed: every START ended by an END of
+ * the same direction before the next START, and none open while the
+ * buffer is queued.
+ * @param export Export.
+ * @param command Ioctl number.
+ * @param arg Ioctl argument.
+ * @return 0 on success, -1 with errno set.
+ */
+static int sim_dmabuf_ioctl(struct sim_export_t *export, unsigned long command,
+                            void *arg) {
+  const struct dma_buf_sync *sync = arg;
+  __u64 direction;
+
+  if (command != DMA_BUF_IOCTL_SYNC) {
+    errno = ENOTTY;
+    return -1;
+  }
+  direction = sync->flags & DMA_BUF_SYNC_RW;
+  if ((sync->flags & ~DMA_BUF_SYNC_VALID_FLAGS_MASK) != 0 || direction == 0) {
+    errno = EINVAL;
+    return -1;
+  }
+  sim.stats.syncs++;
+  if (sync->flags & DMA_BUF_SYNC_END) {
+    if (export->cpu != direction) {
+      sim.stats.sync_errors++;
+    }
+    export->cpu = 0;
+  } else {
+    if (export->cpu != 0) {
+      sim.stats.sync_errors++;
+    }
+    export->cpu = direction;
+  }
+  return 0;
+}
+
+int v4l2_sim_ioctl(int fd, unsigned long request, void *arg) {
+  int status_code = 0;
+
+  pthread_mutex_lock(&sim.lock);
+
+  if (fd >= 0 && fd != sim.fd &&
+      (fd == sim.media_fd || sim_find_request(fd) != NULL)) {
+    status_code = sim_media_ioctl(fd, request, arg);
+    sim_update_ready();
+    goto out;
+  }
+  if (fd >= 0 && fd == sim.subdev_fd) {
+    status_code = sim_subdev_ioctl(request, arg);
+    goto out;
+  }
+  if (fd >= 0 && fd != sim.fd && sim_find_export(fd) != NULL) {
+    status_code = sim_dmabuf_ioctl(sim_find_export(fd), request, arg);
+    goto out;
+  }
+  if (fd != sim.fd) {
+    errno = EBADF;
+    status_code = -1;
+    goto out;
+  }
+
+  switch (request) {
+  case VIDIOC_QUERYCAP: {
+    struct v4l2_capability *cap = arg;
+
+    memset(cap, 0, sizeof(*cap));
+    strcpy((char *)cap->driver, "v4l2-sim");
+    strcpy((char *)cap->card, "Simulated OV5647");
+    strcpy((char *)cap->bus_info, "platform:v4l2-sim");
+    cap->device_caps = (sim.config.mplane ? V4L2_CAP_VIDEO_CAPTURE_MPLANE
+                                          : V4L2_CAP_VIDEO_CAPTURE) |
+                       V4L2_CAP_STREAMING;
+    cap->capabilities = cap->device_caps | V4L2_CAP_DEVICE_CAPS;
+    break;
+  }
+
+  case VIDIOC_G_FMT:
+    sim_give_format(&sim.format.fmt.pix, (int)sim.plane_count,
+                    sim.plane_size, sim.plane_stride, arg);
+    break;
+
+  case VIDIOC_S_FMT: {
+    struct v4l2_pix_format pix;
+    __u32 sizes[SIM_MAX_PLANES];
+    __u32 strides[SIM_MAX_PLANES];
+    int planes;
+
+    if (sim_account(V4L2_SIM_OP_S_FMT) < 0) {
+      status_code = -1;
+      break;
+    }
+    planes = sim_take_format(arg, &pix, sizes, strides);
+    if (planes < 0) {
+      errno = EINVAL;
+      status_code = -1;
+      break;
+    }
+    if (sim.buffer_count > 0) {
+      errno = EBUSY;
+      status_code = -1;
+      break;
+    }
+    sim.format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+    sim.format.fmt.pix = pix;
+    sim.plane_count = (unsigned int)planes;
+    memcpy(sim.plane_size, sizes, sizeof(sizes));
+    memcpy(sim.plane_stride, strides, sizeof(strides));
+    sim_give_format(&pix, planes, sizes, strides, arg);
+    break;
+  }
+
+  case VIDIOC_TRY_FMT: {
+    struct v4l2_pix_format pix;
+    __u32 sizes[SIM_MAX_PLANES];
+    __u32 strides[SIM_MAX_PLANES];
+    int planes = sim_take_format(arg, &pix, sizes, strides);
+
+    if (planes < 0) {
+      errno = EINVAL;
+      status_code = -1;
+      break;
+    }
+    sim_give_format(&pix, planes, sizes, strides, arg);
+    break;
+  }
+
+  case VIDIOC_REQBUFS:
+    if (sim_account(V4L2_SIM_OP_REQBUFS) < 0) {
+      status_code = -1;
+      break;
+    }
+    status_code = sim_reqbufs(arg);
+    break;
+
+  case VIDIOC_QUERYBUF: {
+    struct v4l2_buffer *buffer = arg;
+
+    if (sim_account(V4L2_SIM_OP_QUERYBUF) < 0) {
+      status_code = -1;
+      break;
+    }
+    if (buffer->index >= sim.buffer_count || sim_check_buffer(buffer) < 0) {
+      errno = EINVAL;
+      status_code = -1;
+      break;
+    }
+    buffer->flags = V4L2_BUF_FLAG_MAPPED |
+                    (sim.queued[buffer->index] ? V4L2_BUF_FLAG_QUEUED : 0);
+    if (sim.config.mplane) {
+      sim_fill_planes(buffer, buffer->m.planes, 0);
+      break;
+    }
+    buffer->length = sim.format.fmt.pix.sizeimage;
+    buffer->m.offset = buffer->index * sim.buffer_size;
+    break;
+  }
+
+  case VIDIOC_QBUF: {
+    struct v4l2_buffer *buffer = arg;
+
+    if (sim_account(V4L2_SIM_OP_QBUF) < 0) {
+      status_code = -1;
+      break;
+    }
+    if (buffer->index >= sim.buffer_count || sim.queued[buffer->index] ||
+        sim_check_buffer(buffer) < 0) {
+      errno = EINVAL;
+      status_code = -1;
+      break;
+    }
+    {
+      unsigned int i;
+
+      /* The device would write under a CPU that still reads. */
+      for (i = 0; i < V4L2_SIM_MAX_EXPORTS; i++) {
+        if (sim.exports[i].fd >= 0 && sim.exports[i].index == buffer->index &&
+            sim.exports[i].cpu != 0) {
+          sim.stats.sync_errors++;
+        }
+      }
+    }
+    if (buffer->flags & V4L2_BUF_FLAG_REQUEST_FD) {
+      struct sim_request_t *media_request =
+          sim_find_request(buffer->request_fd);
+
+      if (media_request == NULL || media_request->queued ||
+          media_request->has_buffer) {
+        errno = media_request == NULL ? EINVAL : EBUSY;
+        status_code = -1;
+        break;
+      }
+      /* The buffer waits in the request until the request is queued. */
+      media_request->has_buffer = 1;
+      media_request->buffer = buffer->index;
+      sim.queued[buffer->index] = 1;
+      break;
+    }
+    sim.queued[buffer->index] = 1;
+    sim.ring[(sim.ring_head + sim.ring_len) % V4L2_SIM_MAX_BUFFERS] =
+        buffer->index;
+    sim.ring_len++;
+    break;
+  }
+
+  case VIDIOC_G_CTRL: {
+    struct v4l2_control *control = arg;
+
+    if (control->id == V4L2_CID_EXPOSURE) {
+      control->value = sim_get_exposure();
+    } else if (control->id == V4L2_CID_EXPOSURE_AUTO) {
+      control->value = sim.exposure_auto;
+    } else {
+      errno = EINVAL;
+      status_code = -1;
+    }
+    break;
+  }
+
+  case VIDIOC_S_CTRL: {
+    struct v4l2_control *control = arg;
+
+    if (control->id == V4L2_CID_EXPOSURE) {
+      status_code = sim_set_exposure(control->value);
+    } else if (control->id == V4L2_CID_EXPOSURE_AUTO) {
+      status_code = sim_set_exposure_auto(control->value);
+    } else {
+      errno = EINVAL;
+      status_code = -1;
+    }
+    break;
+  }
+
+  case VIDIOC_S_EXT_CTRLS:
+    status_code = sim_s_ext_ctrls(arg);
+    break;
+
+  case VIDIOC_DQBUF:
+    if (sim_account(V4L2_SIM_OP_DQBUF) < 0) {
+      status_code = -1;
+      break;
+    }
+    status_code = sim_dqbuf(arg);
+    break;
+
+  case VIDIOC_EXPBUF:
+    if (sim_account(V4L2_SIM_OP_EXPBUF) < 0) {
+      status_code = -1;
+      break;
+    }
+    status_code = sim_expbuf(arg);
+    break;
+
+  case VIDIOC_STREAMON:
+    if (sim_account(V4L2_SIM_OP_STREAMON) < 0) {
+      status_code = -1;
+      break;
+    }
+    if (sim.buffer_count == 0 || *(int *)arg != (int)sim_buffer_type()) {
+      errno = EINVAL;
+      status_code = -1;
+      break;
+    }
+    if (sim.streaming) {
+      break;
+    }
+    /* Like unicam, the pipeline has to be linked and agree on the size. */
+    if (sim.config.subdev_path != NULL &&
+        (!sim.sensor_linked ||
+         sim.sensor_format.width != sim.format.fmt.pix.width ||
+         sim.sensor_format.height != sim.format.fmt.pix.height)) {
+      errno = EPIPE;
+      status_code = -1;
+      break;
+    }
+    sim.streaming = 1;
+    sim.stats.sequence = 0;
+    if (sim.config.fps > 0) {
+      sim.producer_running =
+          pthread_create(&sim.producer, NULL, sim_producer, NULL) == 0;
+      if (!sim.producer_running) {
+        sim.streaming = 0;
+        errno = ENOMEM;
+        status_code = -1;
+      }
+    }
+    break;
+
+  case VIDIOC_STREAMOFF:
+    if (sim_account(V4L2_SIM_OP_STREAMOFF) < 0) {
+      status_code = -1;
+      break;
+    }
+    if (*(int *)arg != (int)sim_buffer_type()) {
+      errno = EINVAL;
+      status_code = -1;
+      break;
+    }
+    /* Stopping the stream returns every queued buffer to the application. */
+    sim_stop_streaming();
+    break;
+
+  default:
+    errno = ENOTTY;
+    status_code = -1;
+    break;
+  }
+
+  sim_update_ready();
+
+out:
+  pthread_mutex_unlock(&sim.lock);
+  return status_code;
+}
+
+void *v4l2_sim_mmap(int fd, size_t length, int prot, int flags,
+                    off_t offset) {
+  struct sim_export_t *export;
+  void *start = MAP_FAILED;
+  unsigned int plane;
+
+  pthread_mutex_lock(&sim.lock);
+
+  if (sim_account(V4L2_SIM_OP_MMAP) < 0) {
+    goto out;
+  }
+  export = sim_find_export(fd);
+  if (export != NULL) {
+    /* A dma-buf maps from its own start. */
+    if (sim.memfd < 0 || offset != 0 ||
+        length > sim.plane_offset[export->plane + 1] -
+                     sim.plane_offset[export->plane]) {
+      errno = EINVAL;
+      goto out;
+    }
+    if ((prot & PROT_WRITE) && !export->writable) {
+      errno = EACCES;
+      goto out;
+    }
+    start = mmap(NULL, length, prot, flags, sim.memfd,
+                 (off_t)(export->index * sim.buffer_size +
+                         sim.plane_offset[export->plane]));
+    goto out;
+  }
+  if (sim.buffer_size == 0 || offset < 0 ||
+      (size_t)offset / sim.buffer_size >= sim.buffer_count) {
+    errno = EINVAL;
+    goto out;
+  }
+  /* Each plane maps on its own, from its offset. */
+  for (plane = 0; plane < sim.plane_count; plane++) {
+    if ((size_t)offset % sim.buffer_size == sim.plane_offset[plane]) {
+      break;
+    }
+  }
+  if (plane == sim.plane_count ||
+      length > sim.plane_offset[plane + 1] - sim.plane_offset[plane]) {
+    errno = EINVAL;
+    goto out;
+  }
+
+  start = mmap(NULL, length, prot, flags, sim.memfd, offset);
+
+out:
+  pthread_mutex_unlock(&sim.lock);
+  return start;
+}
+
+int v4l2_sim_close(int fd) {
+  pthread_mutex_lock(&sim.lock);
+
+  if (fd == sim.fd) {
+    /* Mappings stay valid, the memfd is only dropped by REQBUFS 0 / reset.
+     * Disown the descriptor first, glue code routes close() back here. */
+    sim.fd = -1;
+    close(fd);
+    sim.ready = 0;
+    sim_stop_streaming();
+  } else if (fd == sim.media_fd) {
+    sim.media_fd = -1;
+    close(fd);
+  } else if (fd == sim.subdev_fd) {
+    sim.subdev_fd = -1;
+    close(fd);
+  } else if (sim_find_request(fd) != NULL) {
+    /* A queued request still completes, unnoticed. */
+    sim_free_request(sim_find_request(fd));
+  } else if (sim_find_export(fd) != NULL) {
+    /* Mappings of it stay valid, as they hold the dma-buf. */
+    sim_free_export(sim_find_export(fd));
+  }
+
+  pthread_mutex_unlock(&sim.lock);
+  return 0;
+}
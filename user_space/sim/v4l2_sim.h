@@ -0,0 +1,253 @@
+/**
+ * @file v4l2_sim.h
+ * @brief Simulated V4L2 capture device: a software stand-in for /dev/video0
+ * that answers the ioctls used by camera.c, backs its buffers with memfd
+ * memory and can inject faults on any operation. It offers either the
+ * single-planar or, like unicam and ISPs on recent kernels, only the
+ * multi-planar capture API; there NV12M and YUV420M come with a plane
+ * each, all in one memfd. Buffers exported with
+ * VIDIOC_EXPBUF behave as dma-bufs: they map and take DMA_BUF_IOCTL_SYNC,
+ * whose brackets are checked. Given a subdev path, the sensor sits behind a
+ * media graph as on current Raspberry Pi OS: "ov5647 10-0036" linked to
+ * "unicam-image", a link that has to be enabled and a sensor pad format
+ * that has to match the capture size before the device streams.
+ * @note The simulator does not intercept anything by itself. Glue code routes
+ * open/ioctl/mmap/close to it, either at link time (tests, -Wl,--wrap) or at
+ * load time (LD_PRELOAD shim).
+ */
+
+#ifndef V4L2_SIM_H
+#define V4L2_SIM_H
+
+#include <stddef.h>
+
+#include <sys/types.h>
+
+#include <linux/videodev2.h>
+
+/**
+ * @brief Maximum number of buffers the simulated driver hands out.
+ */
+#define V4L2_SIM_MAX_BUFFERS 32
+
+/**
+ * @brief Maximum number of media requests allocated at once.
+ */
+#define V4L2_SIM_MAX_REQUESTS 16
+
+/**
+ * @brief Maximum number of buffers exported with VIDIOC_EXPBUF at once.
+ */
+#define V4L2_SIM_MAX_EXPORTS 32
+
+/**
+ * @brief Exposure (V4L2_CID_EXPOSURE, in lines like the OV5647) after reset.
+ * The sensor starts with V4L2_CID_EXPOSURE_AUTO on, where its own loop owns
+ * the exposure: V4L2_CID_EXPOSURE reads back what it applies and writes to
+ * it are ignored until V4L2_EXPOSURE_MANUAL is set.
+ */
+#define V4L2_SIM_DEFAULT_EXPOSURE 1000
+
+/**
+ * @brief Maximum number of per-frame faults that can be scheduled.
+ */
+#define V4L2_SIM_MAX_FRAME_FAULTS 32
+
+/**
+ * @brief Operations that errno faults can be injected into.
+ */
+enum v4l2_sim_op_t {
+  V4L2_SIM_OP_OPEN,
+  V4L2_SIM_OP_S_FMT,
+  V4L2_SIM_OP_REQBUFS,
+  V4L2_SIM_OP_QUERYBUF,
+  V4L2_SIM_OP_MMAP,
+  V4L2_SIM_OP_QBUF,
+  V4L2_SIM_OP_DQBUF,
+  V4L2_SIM_OP_STREAMON,
+  V4L2_SIM_OP_STREAMOFF,
+  V4L2_SIM_OP_EXPBUF,
+  V4L2_SIM_OP_G_TOPOLOGY,
+  V4L2_SIM_OP_SETUP_LINK,
+  V4L2_SIM_OP_SUBDEV_S_FMT,
+  V4L2_SIM_OP_COUNT,
+};
+
+/**
+ * @brief Faults that alter a delivered frame rather than failing a call.
+ * @param V4L2_SIM_FRAME_SHORT bytesused is forced to the fault value.
+ * @param V4L2_SIM_FRAME_ERROR The buffer carries V4L2_BUF_FLAG_ERROR.
+ * @param V4L2_SIM_FRAME_SEQ_GAP The sequence number skips ahead by the fault
+ * value, as if the driver dropped that many frames.
+ * @param V4L2_SIM_FRAME_SCENE From this frame on the scene changes: a
+ * bright square appears at position value (1-4, left to right), or goes
+ * away for 0.
+ */
+enum v4l2_sim_frame_fault_t {
+  V4L2_SIM_FRAME_SHORT,
+  V4L2_SIM_FRAME_ERROR,
+  V4L2_SIM_FRAME_SEQ_GAP,
+  V4L2_SIM_FRAME_SCENE,
+};
+
+/**
+ * @brief Device behaviour.
+ * @param device_path Path that is routed to the simulator.
+ * @param max_buffers Upper bound of buffers granted by VIDIOC_REQBUFS.
+ * @param min_buffers Lower bound, as granted by drivers that keep a few
+ * buffers queued of their own; 0 grants what is asked for.
+ * @param payload_permille Size of a compressed (MJPEG) payload relative to
+ * sizeimage, in 1/1000. Uncompressed formats always fill sizeimage.
+ * @param fps Frame rate the sensor is paced at, 0 completes buffers as fast
+ * as they are dequeued.
+ * @param jitter_us Maximum deviation of a frame from its ideal arrival time,
+ * in microseconds.
+ * @param payload_jitter_permille Maximum relative deviation of a compressed
+ * payload from its nominal size, in 1/1000.
+ * @param media_path Path of a media device offering the Request API, NULL
+ * for a device without it.
+ * @param control_latency Frames an exposure set with VIDIOC_S_CTRL while
+ * streaming takes to reach the sensor: it applies from the sequence number
+ * that was next at the time plus this. Requests always apply to their own
+ * buffer.
+ * @param mplane Offer only V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE, and with it
+ * the multi-planar formats.
+ * @param subdev_path Path of the sensor subdev, with media_path: the media
+ * device then reports the graph, and VIDIOC_STREAMON fails with EPIPE
+ * until the sensor link is enabled and its pad has the capture size. Its
+ * device node is named in /sys/dev/char/81:1/uevent. NULL for a sensor
+ * without a media graph.
+ * @param data_offset With mplane, bytes of header the driver puts before
+ * the payload of every plane, reported in v4l2_plane.data_offset and
+ * counted in its bytesused and length.
+ */
+struct v4l2_sim_config_t {
+  const char *device_path;
+  unsigned int max_buffers;
+  unsigned int min_buffers;
+  unsigned int payload_permille;
+  unsigned int fps;
+  unsigned int jitter_us;
+  unsigned int payload_jitter_permille;
+  const char *media_path;
+  unsigned int control_latency;
+  int mplane;
+  const char *subdev_path;
+  unsigned int data_offset;
+};
+
+/**
+ * @brief Counters exposed to tests and benchmarks.
+ * @param calls Calls per operation, including failed ones.
+ * @param frames Frames completed for VIDIOC_DQBUF.
+ * @param dropped Paced frames lost because no buffer was queued.
+ * @param sequence Sequence number of the next frame.
+ * @param syncs DMA_BUF_IOCTL_SYNC calls on exported buffers.
+ * @param sync_errors CPU access brackets broken: an END that closes no
+ * START of the same direction, a START inside another, or a buffer queued
+ * to the device while the CPU still accesses it.
+ */
+struct v4l2_sim_stats_t {
+  unsigned long calls[V4L2_SIM_OP_COUNT];
+  unsigned long frames;
+  unsigned long dropped;
+  __u32 sequence;
+  unsigned long syncs;
+  unsigned long sync_errors;
+};
+
+/**
+ * @brief Reset the simulator: close the device, clear faults and counters
+ * and apply a new configuration.
+ * @param config Behaviour, NULL for the defaults.
+ * @return None.
+ */
+void v4l2_sim_reset(const struct v4l2_sim_config_t *config);
+
+/**
+ * @brief Fail calls of an operation with an errno.
+ * @param op Operation.
+ * @param first Zero based index of the first call that fails.
+ * @param count Number of consecutive calls that fail.
+ * @param err errno reported by the failing calls.
+ * @return None.
+ */
+void v4l2_sim_fail(enum v4l2_sim_op_t op, unsigned long first,
+                   unsigned long count, int err);
+
+/**
+ * @brief Alter one delivered frame.
+ * @param frame Zero based index of the delivered frame.
+ * @param fault Kind of fault.
+ * @param value Fault argument, see enum v4l2_sim_frame_fault_t.
+ * @return 0 on success, -1 when the fault table is full.
+ */
+int v4l2_sim_frame_fault(unsigned long frame, enum v4l2_sim_frame_fault_t fault,
+                         __u32 value);
+
+/**
+ * @brief Read the counters.
+ * @param stats Destination.
+ * @return None.
+ */
+void v4l2_sim_get_stats(struct v4l2_sim_stats_t *stats);
+
+/**
+ * @brief Whether a path is routed to the simulator.
+ * @param path Path passed to open().
+ * @return Non-zero if the simulator owns the path.
+ */
+int v4l2_sim_owns_path(const char *path);
+
+/**
+ * @brief Whether a descriptor belongs to the simulated device, its media
+ * device, its sensor subdev, a request or an exported buffer.
+ * @param fd File descriptor.
+ * @return Non-zero if the simulator owns the descriptor.
+ */
+int v4l2_sim_owns_fd(int fd);
+
+/**
+ * @brief Open the simulated video or media device or the sensor subdev.
+ * The video descriptor is a real, pollable file descriptor that reports
+ * POLLIN while a frame is ready. The sysfs uevent file of the subdev is a
+ * real file holding its DEVNAME, which the simulator does not own.
+ * @param path A path v4l2_sim_owns_path() accepted.
+ * @param flags open() flags, O_NONBLOCK is honoured by VIDIOC_DQBUF.
+ * @return Descriptor, or -1 with errno set.
+ */
+int v4l2_sim_open(const char *path, int flags);
+
+/**
+ * @brief Handle an ioctl on the simulated device, its media device, its
+ * sensor subdev or one of its requests.
+ * @param fd Descriptor the simulator owns.
+ * @param request ioctl request code.
+ * @param arg ioctl argument.
+ * @return 0 on success, -1 with errno set.
+ */
+int v4l2_sim_ioctl(int fd, unsigned long request, void *arg);
+
+/**
+ * @brief Map a simulated buffer, through the device or an exported
+ * dma-buf.
+ * @param fd Device or dma-buf descriptor.
+ * @param length Mapping length.
+ * @param prot Protection flags.
+ * @param flags Mapping flags.
+ * @param offset Buffer offset reported by VIDIOC_QUERYBUF, 0 for a
+ * dma-buf.
+ * @return Mapping, or MAP_FAILED with errno set.
+ */
+void *v4l2_sim_mmap(int fd, size_t length, int prot, int flags,
+                    off_t offset);
+
+/**
+ * @brief Close the simulated device, stopping the stream, or its media
+ * device or a request.
+ * @param fd Descriptor the simulator owns.
+ * @return 0.
+ */
+int v4l2_sim_close(int fd);
+
+#endif /* V4L2_SIM_H */
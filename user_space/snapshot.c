@@ -0,0 +1,171 @@
+/**
+ * @file snapshot.c
+ * @brief Latest-frame cache.
+ * @note Readers count themselves in a per-buffer reference, then check that
+ * the buffer is still the published one. The capture thread swaps the
+ * published word first and reads the reference after, both sequentially
+ * consistent, so either the reader sees the swap and backs off or the
+ * capture thread sees the reference and keeps the buffer away from the
+ * driver.
+ */
+
+#include "snapshot.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "storage.h"
+
+/**
+ * @brief Buffer index bits of the published word.
+ */
+#define SNAPSHOT_INDEX_BITS 8
+#define SNAPSHOT_INDEX_MASK ((1u << SNAPSHOT_INDEX_BITS) - 1)
+
+void snapshot_cache_init(struct snapshot_cache_t *cache,
+                         struct camera_params_t *params) {
+  unsigned int i;
+
+  memset(cache, 0, sizeof(*cache));
+  cache->params = params;
+  atomic_init(&cache->latest, 0);
+  for (i = 0; i < CAMERA_MAX_BUFFERS; i++) {
+    atomic_init(&cache->refs[i], 0);
+  }
+}
+
+/**
+ * @brief Queue the retired buffers no reader holds any more.
+ * @param cache Cache.
+ */
+static void requeue_released(struct snapshot_cache_t *cache) {
+  unsigned int pending = cache->retired;
+
+  while (pending != 0) {
+    __u32 index = (__u32)__builtin_ctz(pending);
+
+    pending &= pending - 1;
+    if (atomic_load(&cache->refs[index]) != 0) {
+      cache->deferred_requeues++;
+      continue;
+    }
+    cache->retired &= ~(1u << index);
+    queue_buffer(cache->params, index);
+  }
+}
+
+void snapshot_publish(struct snapshot_cache_t *cache) {
+  struct camera_params_t *params = cache->params;
+  __u32 index = params->buffer.index;
+  uint64_t previous;
+
+  cache->meta[index] = params->buffer;
+  cache->starts[index] = params->buffer_start;
+  cache->generation++;
+  previous = atomic_exchange(&cache->latest,
+                             cache->generation << SNAPSHOT_INDEX_BITS | index);
+  if (previous != 0) {
+    cache->retired |= 1u << (previous & SNAPSHOT_INDEX_MASK);
+  }
+  requeue_released(cache);
+
+  params->buffer_start = NULL;
+  cache->published++;
+}
+
+int snapshot_acquire(struct snapshot_cache_t *cache,
+                     struct snapshot_frame_t *frame) {
+  for (;;) {
+    uint64_t latest = atomic_load(&cache->latest);
+    const struct v4l2_buffer *meta;
+    __u32 index;
+
+    if (latest == 0) {
+      errno = EAGAIN;
+      return -1;
+    }
+    index = (__u32)(latest & SNAPSHOT_INDEX_MASK);
+
+    atomic_fetch_add(&cache->refs[index], 1);
+    if (atomic_load(&cache->latest) != latest) {
+      /* Replaced meanwhile, the buffer may already be back in the driver. */
+      atomic_fetch_sub(&cache->refs[index], 1);
+      continue;
+    }
+
+    meta = &cache->meta[index];
+    frame->index = index;
+    frame->sequence = meta->sequence;
+    frame->bytesused = meta->bytesused;
+    frame->timestamp_us = (uint64_t)meta->timestamp.tv_sec * 1000000 +
+                          (uint64_t)meta->timestamp.tv_usec;
+    frame->data = cache->starts[index];
+    return 0;
+  }
+}
+
+void snapshot_release(struct snapshot_cache_t *cache,
+                      const struct snapshot_frame_t *frame) {
+  atomic_fetch_sub(&cache->refs[frame->index], 1);
+}
+
+int snapshot_save(struct snapshot_cache_t *cache, const char *path) {
+  struct snapshot_frame_t frame;
+  char temporary[4096];
+  int saved_errno;
+  int fd;
+
+  if (snprintf(temporary, sizeof(temporary), "%s.tmp", path) >=
+      (int)sizeof(temporary)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  fd = open(temporary, O_WRONLY | O_CREAT | O_TRUNC, 0660);
+  if (fd < 0) {
+    return -1;
+  }
+  if (snapshot_acquire(cache, &frame) < 0) {
+    saved_errno = errno;
+    close(fd);
+    unlink(temporary);
+    errno = saved_errno;
+    return -1;
+  }
+
+  /* Only the write runs with the buffer held. */
+  if (write_full(fd, frame.data, frame.bytesused) < 0) {
+    saved_errno = errno;
+    snapshot_release(cache, &frame);
+    close(fd);
+    unlink(temporary);
+    errno = saved_errno;
+    return -1;
+  }
+  snapshot_release(cache, &frame);
+
+  if (close(fd) < 0 || rename(temporary, path) < 0) {
+    saved_errno = errno;
+    unlink(temporary);
+    errno = saved_errno;
+    return -1;
+  }
+  return 0;
+}
+
+void snapshot_cache_close(struct snapshot_cache_t *cache) {
+  const struct timespec pause = {.tv_nsec = 1000000};
+  unsigned int i;
+
+  atomic_store(&cache->latest, 0);
+  for (i = 0; i < CAMERA_MAX_BUFFERS; i++) {
+    while (atomic_load(&cache->refs[i]) != 0) {
+      nanosleep(&pause, NULL);
+    }
+  }
+  /* Whatever is still out of the driver comes back with STREAMOFF. */
+  cache->retired = 0;
+}
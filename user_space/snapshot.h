@@ -0,0 +1,118 @@
+/**
+ * @file snapshot.h
+ * @brief Latest-frame cache: the capture loop publishes every dequeued
+ * buffer, and any thread can borrow the newest frame without a lock and
+ * without copying it.
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include <stdatomic.h>
+#include <stdint.h>
+
+#include "camera.h"
+
+/**
+ * @brief A borrowed frame. data stays valid and unchanged until the frame
+ * is handed back with snapshot_release().
+ * @param index Driver buffer index.
+ * @param sequence Driver sequence number.
+ * @param bytesused Payload size.
+ * @param timestamp_us Capture time in microseconds.
+ * @param data Payload, in the driver buffer.
+ */
+struct snapshot_frame_t {
+  __u32 index;
+  __u32 sequence;
+  __u32 bytesused;
+  uint64_t timestamp_us;
+  const void *data;
+};
+
+/**
+ * @brief Latest-frame cache over the buffers of one device.
+ * @param params Capture state owning the buffers.
+ * @param latest Published buffer: generation << 8 | index, 0 when empty.
+ * The generation keeps a reader from mistaking a buffer that went around
+ * the driver queue for the one it looked up.
+ * @param refs Readers holding each buffer.
+ * @param meta Metadata of each buffer, written before it is published.
+ * @param starts Start of the payload of each buffer, past any data_offset,
+ * written with meta.
+ * @param generation Last generation published.
+ * @param retired Bitmask of buffers replaced as latest but still held by
+ * readers, requeued once released. Capture thread only.
+ * @param published Frames published.
+ * @param deferred_requeues Times a replaced buffer was still held by a
+ * reader and stayed out of the driver queue for another frame.
+ */
+struct snapshot_cache_t {
+  struct camera_params_t *params;
+  _Atomic uint64_t latest;
+  atomic_uint refs[CAMERA_MAX_BUFFERS];
+  struct v4l2_buffer meta[CAMERA_MAX_BUFFERS];
+  const void *starts[CAMERA_MAX_BUFFERS];
+  uint64_t generation;
+  unsigned int retired;
+  unsigned long published;
+  unsigned long deferred_requeues;
+};
+
+/**
+ * @brief Set up an empty cache. Must happen before readers start.
+ * @param cache Cache to initialize.
+ * @param params Capture state whose buffers are published.
+ * @return None.
+ */
+void snapshot_cache_init(struct snapshot_cache_t *cache,
+                         struct camera_params_t *params);
+
+/**
+ * @brief Publish the frame returned by get_frame(), in place of
+ * release_frame(). The previous latest buffer goes back to the driver as
+ * soon as no reader holds it. Capture thread only.
+ * @param cache Cache.
+ * @return None, exits if a buffer cannot be queued.
+ */
+void snapshot_publish(struct snapshot_cache_t *cache);
+
+/**
+ * @brief Borrow the latest frame. Lock-free: a retry happens only when a
+ * new frame is published at the same instant.
+ * @param cache Cache.
+ * @param frame Set to the frame.
+ * @return 0 on success, -1 with errno EAGAIN if nothing is published.
+ */
+int snapshot_acquire(struct snapshot_cache_t *cache,
+                     struct snapshot_frame_t *frame);
+
+/**
+ * @brief Hand back a frame from snapshot_acquire(). Hold frames briefly:
+ * a held buffer is out of the driver queue.
+ * @param cache Cache.
+ * @param frame Frame to release.
+ * @return None.
+ */
+void snapshot_release(struct snapshot_cache_t *cache,
+                      const struct snapshot_frame_t *frame);
+
+/**
+ * @brief Write the latest frame to a file, replaced atomically so viewers
+ * never read a partial image.
+ * @param cache Cache.
+ * @param path Destination path.
+ * @return 0 on success, -1 with errno set (EAGAIN if nothing is
+ * published).
+ */
+int snapshot_save(struct snapshot_cache_t *cache, const char *path);
+
+/**
+ * @brief Withdraw the latest frame and wait for readers to release theirs,
+ * before streaming stops and buffers are unmapped. Capture thread only.
+ * @param cache Cache.
+ * @return None.
+ */
+void snapshot_cache_close(struct snapshot_cache_t *cache);
+
+#endif /* SNAPSHOT_H */
@@ -0,0 +1,515 @@
+/**
+ * @file stabilizer.c
+ * @brief Video stabilization.
+ * @note Motion is searched coarse to fine: STABILIZER_SEARCH_RADIUS pixels
+ * around zero on the coarsest level, then one pixel around the doubled
+ * estimate on each finer level, down to full resolution. Blocks too flat to
+ * match are left out. The SAD of a 16x16 block is the inner loop and is
+ * selected at compile time (see SIMD in the Makefile): NEON on ARM, AVX2 on
+ * x86, scalar otherwise. The path is smoothed with a moving average centred on
+ * the frame being cropped, which is why frames wait for the look-ahead;
+ * the path is held at its ends so the first and last frames are not pulled
+ * towards zero. Only translation is compensated, by an integer crop.
+ */
+
+#include "stabilizer.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+/**
+ * @brief Side of a matched block, in pixels.
+ */
+#define STABILIZER_BLOCK 16
+
+/**
+ * @brief Blocks whose SAD against themselves moved by one pixel stays
+ * below this many levels per pixel are too flat to match.
+ */
+#define STABILIZER_MIN_TEXTURE 2
+
+/**
+ * @brief Smallest pyramid level worth searching.
+ */
+#define STABILIZER_MIN_WIDTH 64
+#define STABILIZER_MIN_HEIGHT 48
+
+int stabilizer_supports(__u32 pixelformat) {
+  return pixelformat == V4L2_PIX_FMT_GREY || pixelformat == V4L2_PIX_FMT_YUYV;
+}
+
+/**
+ * @brief Current CLOCK_MONOTONIC time in nanoseconds.
+ */
+static long long monotonic_ns(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+#if defined(__ARM_NEON)
+
+/**
+ * @brief Sum of absolute differences of two 16x16 blocks. A 16-bit lane
+ * collects at most 32 differences, 8160.
+ */
+static unsigned int block_sad(const uint8_t *a, size_t a_stride,
+                              const uint8_t *b, size_t b_stride) {
+  uint16x8_t sum = vdupq_n_u16(0);
+  uint64x2_t total;
+  int y;
+
+  for (y = 0; y < STABILIZER_BLOCK; y++) {
+    uint8x16_t x = vld1q_u8(a + y * a_stride);
+    uint8x16_t z = vld1q_u8(b + y * b_stride);
+
+    sum = vabal_u8(sum, vget_low_u8(x), vget_low_u8(z));
+    sum = vabal_u8(sum, vget_high_u8(x), vget_high_u8(z));
+  }
+  total = vpaddlq_u32(vpaddlq_u16(sum));
+  return (unsigned int)(vgetq_lane_u64(total, 0) + vgetq_lane_u64(total, 1));
+}
+
+#elif defined(__AVX2__)
+
+/**
+ * @brief Sum of absolute differences of two 16x16 blocks, two rows per
+ * PSADBW.
+ */
+static unsigned int block_sad(const uint8_t *a, size_t a_stride,
+                              const uint8_t *b, size_t b_stride) {
+  __m256i sum = _mm256_setzero_si256();
+  __m128i half;
+  int y;
+
+  for (y = 0; y < STABILIZER_BLOCK; y += 2) {
+    __m256i x = _mm256_loadu2_m128i((const __m128i *)(a + (y + 1) * a_stride),
+                                    (const __m128i *)(a + y * a_stride));
+    __m256i z = _mm256_loadu2_m128i((const __m128i *)(b + (y + 1) * b_stride),
+                                    (const __m128i *)(b + y * b_stride));
+
+    sum = _mm256_add_epi64(sum, _mm256_sad_epu8(x, z));
+  }
+  half = _mm_add_epi64(_mm256_castsi256_si128(sum),
+                       _mm256_extracti128_si256(sum, 1));
+  return (unsigned int)(_mm_cvtsi128_si64(half) +
+                        _mm_extract_epi64(half, 1));
+}
+
+#else
+
+static unsigned int block_sad(const uint8_t *a, size_t a_stride,
+                              const uint8_t *b, size_t b_stride) {
+  unsigned int sum = 0;
+  int x;
+  int y;
+
+  for (y = 0; y < STABILIZER_BLOCK; y++) {
+    for (x = 0; x < STABILIZER_BLOCK; x++) {
+      int d = a[y * a_stride + x] - b[y * b_stride + x];
+
+      sum += (unsigned int)(d < 0 ? -d : d);
+    }
+  }
+  return sum;
+}
+
+#endif
+
+/**
+ * @brief Build the luma pyramid of a frame.
+ * @param stabilizer Stabilizer.
+ * @param frame Frame in the input format.
+ * @param pyramid Pyramid to fill.
+ */
+static void build_pyramid(const struct stabilizer_t *stabilizer,
+                          const uint8_t *frame,
+                          struct stabilizer_pyramid_t *pyramid) {
+  const struct v4l2_pix_format *format = &stabilizer->format;
+  unsigned int level;
+  __u32 x;
+  __u32 y;
+
+  for (y = 0; y < format->height; y++) {
+    const uint8_t *src = frame + (size_t)y * format->bytesperline;
+    uint8_t *dst = pyramid->data[0] + (size_t)y * format->width;
+
+    if (format->pixelformat == V4L2_PIX_FMT_GREY) {
+      memcpy(dst, src, format->width);
+    } else {
+      for (x = 0; x < format->width; x++) {
+        dst[x] = src[2 * x];
+      }
+    }
+  }
+
+  for (level = 1; level < stabilizer->levels; level++) {
+    const uint8_t *up = pyramid->data[level - 1];
+    __u32 up_width = pyramid->width[level - 1];
+
+    for (y = 0; y < pyramid->height[level]; y++) {
+      const uint8_t *r0 = up + (size_t)(2 * y) * up_width;
+      const uint8_t *r1 = r0 + up_width;
+      uint8_t *dst = pyramid->data[level] + (size_t)y * pyramid->width[level];
+
+      for (x = 0; x < pyramid->width[level]; x++) {
+        dst[x] = (uint8_t)((r0[2 * x] + r0[2 * x + 1] + r1[2 * x] +
+                            r1[2 * x + 1] + 2) >>
+                           2);
+      }
+    }
+  }
+}
+
+/**
+ * @brief Middle value of a short list, which is reordered.
+ */
+static int median(int *values, unsigned int count) {
+  unsigned int i;
+
+  for (i = 1; i < count; i++) {
+    int v = values[i];
+    unsigned int j = i;
+
+    for (; j > 0 && values[j - 1] > v; j--) {
+      values[j] = values[j - 1];
+    }
+    values[j] = v;
+  }
+  return values[count / 2];
+}
+
+/**
+ * @brief Refine the global motion on one pyramid level: every textured
+ * block of the previous frame searches the current one around the
+ * estimate, and the median of their vectors becomes the new estimate.
+ * @param prev Pyramid of the previous frame.
+ * @param cur Pyramid of the current frame.
+ * @param level Level to search.
+ * @param radius Pixels searched around the estimate.
+ * @param motion Estimate in pixels of this level, updated if any block
+ * matched.
+ */
+static void match_level(const struct stabilizer_pyramid_t *prev,
+                        const struct stabilizer_pyramid_t *cur,
+                        unsigned int level, int radius, int motion[2]) {
+  const int width = (int)prev->width[level];
+  const int height = (int)prev->height[level];
+  const int inset_x = width / 8;
+  const int inset_y = height / 8;
+  int vectors[2][STABILIZER_BLOCKS_X * STABILIZER_BLOCKS_Y];
+  unsigned int found = 0;
+  int bx;
+  int by;
+
+  for (by = 0; by < STABILIZER_BLOCKS_Y; by++) {
+    for (bx = 0; bx < STABILIZER_BLOCKS_X; bx++) {
+      int px = inset_x + bx * (width - 2 * inset_x - STABILIZER_BLOCK - 1) /
+                             (STABILIZER_BLOCKS_X - 1);
+      int py = inset_y + by * (height - 2 * inset_y - STABILIZER_BLOCK - 1) /
+                             (STABILIZER_BLOCKS_Y - 1);
+      const uint8_t *block = prev->data[level] + (size_t)py * width + px;
+      unsigned int best = ~0u;
+      int best_norm = 0;
+      int best_dx = 0;
+      int best_dy = 0;
+      int dx;
+      int dy;
+
+      if (block_sad(block, width, block + width + 1, width) <
+          STABILIZER_MIN_TEXTURE * STABILIZER_BLOCK * STABILIZER_BLOCK) {
+        continue;
+      }
+      for (dy = -radius; dy <= radius; dy++) {
+        for (dx = -radius; dx <= radius; dx++) {
+          int cx = px + motion[0] + dx;
+          int cy = py + motion[1] + dy;
+          int norm = (dx < 0 ? -dx : dx) + (dy < 0 ? -dy : dy);
+          unsigned int sad;
+
+          if (cx < 0 || cy < 0 || cx + STABILIZER_BLOCK > width ||
+              cy + STABILIZER_BLOCK > height) {
+            continue;
+          }
+          sad = block_sad(block, width,
+                          cur->data[level] + (size_t)cy * width + cx, width);
+          if (sad < best || (sad == best && norm < best_norm)) {
+            best = sad;
+            best_norm = norm;
+            best_dx = dx;
+            best_dy = dy;
+          }
+        }
+      }
+      if (best != ~0u) {
+        vectors[0][found] = motion[0] + best_dx;
+        vectors[1][found] = motion[1] + best_dy;
+        found++;
+      }
+    }
+  }
+
+  if (found > 0) {
+    motion[0] = median(vectors[0], found);
+    motion[1] = median(vectors[1], found);
+  }
+}
+
+/**
+ * @brief Motion from the previous frame to the current one, coarse to
+ * fine.
+ * @param stabilizer Stabilizer, both pyramids built.
+ * @param motion Set to the motion in full resolution pixels.
+ */
+static void estimate_motion(const struct stabilizer_t *stabilizer,
+                            int motion[2]) {
+  const struct stabilizer_pyramid_t *cur =
+      &stabilizer->pyramids[stabilizer->current];
+  const struct stabilizer_pyramid_t *prev =
+      &stabilizer->pyramids[stabilizer->current ^ 1];
+  unsigned int level = stabilizer->levels;
+
+  motion[0] = 0;
+  motion[1] = 0;
+  match_level(prev, cur, --level, STABILIZER_SEARCH_RADIUS, motion);
+  while (level > 0) {
+    motion[0] *= 2;
+    motion[1] *= 2;
+    match_level(prev, cur, --level, 1, motion);
+  }
+}
+
+int stabilizer_init(struct stabilizer_t *stabilizer,
+                    const struct v4l2_pix_format *format,
+                    unsigned int lookahead, unsigned int margin_percent) {
+  size_t bpp = format->pixelformat == V4L2_PIX_FMT_YUYV ? 2 : 1;
+  size_t luma = (size_t)format->width * format->height;
+  unsigned int level;
+  unsigned int p;
+
+  memset(stabilizer, 0, sizeof(*stabilizer));
+  if (margin_percent == 0) {
+    margin_percent = STABILIZER_DEFAULT_MARGIN_PERCENT;
+  }
+  if (!stabilizer_supports(format->pixelformat) ||
+      lookahead > STABILIZER_MAX_LOOKAHEAD || margin_percent > 25 ||
+      format->width < STABILIZER_MIN_WIDTH ||
+      format->height < STABILIZER_MIN_HEIGHT ||
+      format->bytesperline < format->width * bpp) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  stabilizer->format = *format;
+  stabilizer->lookahead = lookahead;
+  /* Even, so a YUYV crop starts on a whole macropixel. */
+  stabilizer->margin[0] = (format->width * margin_percent / 100) & ~1u;
+  stabilizer->margin[1] = format->height * margin_percent / 100;
+  stabilizer->output_format = *format;
+  stabilizer->output_format.width = format->width - 2 * stabilizer->margin[0];
+  stabilizer->output_format.height =
+      format->height - 2 * stabilizer->margin[1];
+  stabilizer->output_format.bytesperline =
+      (__u32)(stabilizer->output_format.width * bpp);
+  stabilizer->output_format.sizeimage =
+      stabilizer->output_format.bytesperline *
+      stabilizer->output_format.height;
+
+  for (level = 1; level < STABILIZER_LEVELS &&
+                  format->width >> level >= STABILIZER_MIN_WIDTH &&
+                  format->height >> level >= STABILIZER_MIN_HEIGHT;
+       level++) {
+  }
+  stabilizer->levels = level;
+
+  stabilizer->frame_bytes = (size_t)format->bytesperline * format->height;
+  stabilizer->frames = malloc(stabilizer->frame_bytes * (lookahead + 1));
+  stabilizer->output = malloc(stabilizer->output_format.sizeimage);
+  if (stabilizer->frames == NULL || stabilizer->output == NULL) {
+    stabilizer_destroy(stabilizer);
+    errno = ENOMEM;
+    return -1;
+  }
+  for (p = 0; p < 2; p++) {
+    struct stabilizer_pyramid_t *pyramid = &stabilizer->pyramids[p];
+    uint8_t *data = malloc(luma + luma / 2);
+
+    if (data == NULL) {
+      stabilizer_destroy(stabilizer);
+      errno = ENOMEM;
+      return -1;
+    }
+    for (level = 0; level < stabilizer->levels; level++) {
+      pyramid->data[level] = data;
+      pyramid->width[level] = format->width >> level;
+      pyramid->height[level] = format->height >> level;
+      data += (size_t)pyramid->width[level] * pyramid->height[level];
+    }
+  }
+
+  return 0;
+}
+
+int stabilizer_push(struct stabilizer_t *stabilizer, const void *frame,
+                    size_t bytes, __u32 sequence, uint64_t timestamp_us) {
+  unsigned int slots = stabilizer->lookahead + 1;
+  unsigned int slot;
+  long long start_ns;
+  int *path;
+
+  if (bytes < stabilizer->frame_bytes) {
+    errno = EINVAL;
+    return -1;
+  }
+  if (stabilizer->ring_len == slots) {
+    errno = EBUSY;
+    return -1;
+  }
+
+  start_ns = monotonic_ns();
+  slot = (stabilizer->ring_head + stabilizer->ring_len) % slots;
+  memcpy(stabilizer->frames + slot * stabilizer->frame_bytes, frame,
+         stabilizer->frame_bytes);
+  stabilizer->current ^= 1;
+  build_pyramid(stabilizer, frame,
+                &stabilizer->pyramids[stabilizer->current]);
+
+  path = stabilizer->path[stabilizer->pushed % STABILIZER_HISTORY];
+  if (stabilizer->pushed == 0) {
+    stabilizer->motions[slot][0] = 0;
+    stabilizer->motions[slot][1] = 0;
+    path[0] = 0;
+    path[1] = 0;
+  } else {
+    const int *last =
+        stabilizer->path[(stabilizer->pushed - 1) % STABILIZER_HISTORY];
+
+    estimate_motion(stabilizer, stabilizer->motions[slot]);
+    path[0] = last[0] + stabilizer->motions[slot][0];
+    path[1] = last[1] + stabilizer->motions[slot][1];
+    stabilizer->estimate_ns_avg +=
+        (monotonic_ns() - start_ns - stabilizer->estimate_ns_avg) / 8;
+  }
+
+  stabilizer->sequences[slot] = sequence;
+  stabilizer->timestamps_us[slot] = timestamp_us;
+  stabilizer->pushed_ns[slot] = start_ns;
+  stabilizer->ring_len++;
+  stabilizer->pushed++;
+  return 0;
+}
+
+/**
+ * @brief Mean of the camera path around a frame, the path held at its
+ * ends.
+ * @param stabilizer Stabilizer.
+ * @param frame Frame number, held.
+ * @param axis 0 for x, 1 for y.
+ * @return Smoothed position, rounded.
+ */
+static int smoothed_path(const struct stabilizer_t *stabilizer,
+                         unsigned long frame, int axis) {
+  long count = 2 * (long)stabilizer->lookahead + 1;
+  long sum = 0;
+  long j;
+
+  for (j = (long)frame - (long)stabilizer->lookahead;
+       j <= (long)frame + (long)stabilizer->lookahead; j++) {
+    long held = j < 0 ? 0
+                : j >= (long)stabilizer->pushed ? (long)stabilizer->pushed - 1
+                                                : j;
+
+    sum += stabilizer->path[held % STABILIZER_HISTORY][axis];
+  }
+  return (int)(sum >= 0 ? (sum + count / 2) / count
+                        : -((-sum + count / 2) / count));
+}
+
+int stabilizer_pop(struct stabilizer_t *stabilizer, int drain,
+                   struct stabilizer_frame_t *frame) {
+  const struct v4l2_pix_format *out = &stabilizer->output_format;
+  size_t bpp = stabilizer->format.pixelformat == V4L2_PIX_FMT_YUYV ? 2 : 1;
+  unsigned int slot = stabilizer->ring_head;
+  const int *path = stabilizer->path[stabilizer->popped % STABILIZER_HISTORY];
+  const uint8_t *src;
+  long long start_ns;
+  long long latency_ns;
+  int axis;
+  __u32 y;
+
+  if (stabilizer->ring_len == 0 ||
+      (!drain && stabilizer->ring_len <= stabilizer->lookahead)) {
+    return 0;
+  }
+
+  start_ns = monotonic_ns();
+  for (axis = 0; axis < 2; axis++) {
+    int margin = (int)stabilizer->margin[axis];
+    int shift =
+        path[axis] - smoothed_path(stabilizer, stabilizer->popped, axis);
+    int crop = margin + shift;
+
+    if (crop < 0 || crop > 2 * margin) {
+      crop = crop < 0 ? 0 : 2 * margin;
+      stabilizer->clamped++;
+    }
+    if (axis == 0 && bpp == 2) {
+      crop &= ~1;
+    }
+    shift = crop > margin ? crop - margin : margin - crop;
+    if ((unsigned int)shift > stabilizer->correction_max) {
+      stabilizer->correction_max = (unsigned int)shift;
+    }
+    frame->crop[axis] = (__u32)crop;
+  }
+
+  src = stabilizer->frames + slot * stabilizer->frame_bytes +
+        (size_t)frame->crop[1] * stabilizer->format.bytesperline +
+        frame->crop[0] * bpp;
+  for (y = 0; y < out->height; y++) {
+    memcpy(stabilizer->output + (size_t)y * out->bytesperline,
+           src + (size_t)y * stabilizer->format.bytesperline,
+           out->bytesperline);
+  }
+
+  frame->data = stabilizer->output;
+  frame->bytes = out->sizeimage;
+  frame->sequence = stabilizer->sequences[slot];
+  frame->timestamp_us = stabilizer->timestamps_us[slot];
+  frame->motion[0] = stabilizer->motions[slot][0];
+  frame->motion[1] = stabilizer->motions[slot][1];
+
+  latency_ns = monotonic_ns() - stabilizer->pushed_ns[slot];
+  stabilizer->crop_ns_avg +=
+      (monotonic_ns() - start_ns - stabilizer->crop_ns_avg) / 8;
+  stabilizer->latency_ns_avg +=
+      (latency_ns - stabilizer->latency_ns_avg) / 8;
+  if (latency_ns > stabilizer->latency_ns_max) {
+    stabilizer->latency_ns_max = latency_ns;
+  }
+
+  stabilizer->ring_head = (slot + 1) % (stabilizer->lookahead + 1);
+  stabilizer->ring_len--;
+  stabilizer->popped++;
+  return 1;
+}
+
+void stabilizer_destroy(struct stabilizer_t *stabilizer) {
+  free(stabilizer->pyramids[0].data[0]);
+  free(stabilizer->pyramids[1].data[0]);
+  stabilizer->pyramids[0].data[0] = NULL;
+  stabilizer->pyramids[1].data[0] = NULL;
+  free(stabilizer->frames);
+  stabilizer->frames = NULL;
+  free(stabilizer->output);
+  stabilizer->output = NULL;
+}
@@ -0,0 +1,195 @@
+/**
+ * @file stabilizer.h
+ * @brief Video stabilization: the global motion between consecutive frames
+ * is found by block matching on a luma pyramid, the camera path it adds up
+ * to is smoothed over a bounded look-ahead, and each frame is cropped so
+ * the picture follows the smoothed path instead of the shaking one.
+ */
+
+#ifndef STABILIZER_H
+#define STABILIZER_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+#include <linux/videodev2.h>
+
+/**
+ * @brief Longest look-ahead, in frames. A frame leaves the stabilizer this
+ * many frames after it entered.
+ */
+#define STABILIZER_MAX_LOOKAHEAD 15
+
+/**
+ * @brief Crop margin on each side when none is given, in percent of the
+ * frame size. It bounds the shake that can be taken out.
+ */
+#define STABILIZER_DEFAULT_MARGIN_PERCENT 5
+
+/**
+ * @brief Pyramid levels, full resolution included. The coarsest level
+ * searches STABILIZER_SEARCH_RADIUS pixels, every finer level one pixel
+ * around the doubled estimate, so motion of up to 8 * (radius + 1) - 1
+ * pixels between frames is found.
+ */
+#define STABILIZER_LEVELS 4
+#define STABILIZER_SEARCH_RADIUS 8
+
+/**
+ * @brief Blocks matched per level, a grid over the middle of the frame.
+ * The global motion is the median of their vectors, so a few blocks on a
+ * moving object do not drag it along.
+ */
+#define STABILIZER_BLOCKS_X 8
+#define STABILIZER_BLOCKS_Y 6
+
+/**
+ * @brief Camera path samples kept: the look-ahead ahead of the frame being
+ * cropped and as many behind it.
+ */
+#define STABILIZER_HISTORY (2 * STABILIZER_MAX_LOOKAHEAD + 1)
+
+/**
+ * @brief Luma pyramid of one frame.
+ * @param data Full resolution first, each level half the last.
+ * @param width Width of each level.
+ * @param height Height of each level.
+ */
+struct stabilizer_pyramid_t {
+  uint8_t *data[STABILIZER_LEVELS];
+  __u32 width[STABILIZER_LEVELS];
+  __u32 height[STABILIZER_LEVELS];
+};
+
+/**
+ * @brief A stabilized frame.
+ * @param data Cropped frame, output_format of the stabilizer, valid until
+ * the next stabilizer_pop().
+ * @param bytes Size of data.
+ * @param sequence Driver sequence number it was captured with.
+ * @param timestamp_us Capture timestamp, microseconds.
+ * @param motion Motion measured from the frame before it, in pixels.
+ * @param crop Top-left corner of the crop in the captured frame.
+ */
+struct stabilizer_frame_t {
+  const void *data;
+  size_t bytes;
+  __u32 sequence;
+  uint64_t timestamp_us;
+  int motion[2];
+  __u32 crop[2];
+};
+
+/**
+ * @brief Stabilizer state.
+ * @param format Format of the frames pushed.
+ * @param output_format Format of the frames popped, margins cropped off.
+ * @param margin Crop margin on each side, in pixels (x, y).
+ * @param lookahead Frames held back to see the path ahead.
+ * @param levels Pyramid levels in use.
+ * @param frames Ring of lookahead + 1 frame copies, frame_bytes each.
+ * @param sequences Sequence number of the frame in each slot.
+ * @param timestamps_us Capture timestamp of the frame in each slot.
+ * @param pushed_ns When the frame in each slot was pushed.
+ * @param motions Motion of the frame in each slot from the one before.
+ * @param ring_head Slot of the oldest frame held.
+ * @param ring_len Frames held.
+ * @param pyramids Pyramids of the previous and the current frame.
+ * @param current Which pyramid holds the newest frame.
+ * @param path Camera path by frame number modulo STABILIZER_HISTORY: where
+ * the content of each frame sits relative to the first, in pixels.
+ * @param pushed Frames pushed so far.
+ * @param popped Frames popped so far.
+ * @param output Crop of the last frame popped.
+ * @param estimate_ns_avg Moving average of one motion estimate (pyramid
+ * included), nanoseconds.
+ * @param crop_ns_avg Moving average of one crop, nanoseconds.
+ * @param latency_ns_avg Moving average of push to pop, nanoseconds.
+ * @param latency_ns_max Longest push to pop, nanoseconds.
+ * @param correction_max Largest shift applied on either axis, in pixels.
+ * @param clamped Frames whose correction did not fit the margin.
+ */
+struct stabilizer_t {
+  struct v4l2_pix_format format;
+  struct v4l2_pix_format output_format;
+  __u32 margin[2];
+  unsigned int lookahead;
+  unsigned int levels;
+  uint8_t *frames;
+  size_t frame_bytes;
+  __u32 sequences[STABILIZER_MAX_LOOKAHEAD + 1];
+  uint64_t timestamps_us[STABILIZER_MAX_LOOKAHEAD + 1];
+  long long pushed_ns[STABILIZER_MAX_LOOKAHEAD + 1];
+  int motions[STABILIZER_MAX_LOOKAHEAD + 1][2];
+  unsigned int ring_head;
+  unsigned int ring_len;
+  struct stabilizer_pyramid_t pyramids[2];
+  unsigned int current;
+  int path[STABILIZER_HISTORY][2];
+  unsigned long pushed;
+  unsigned long popped;
+  uint8_t *output;
+  long long estimate_ns_avg;
+  long long crop_ns_avg;
+  long long latency_ns_avg;
+  long long latency_ns_max;
+  unsigned int correction_max;
+  unsigned long clamped;
+};
+
+/**
+ * @brief Tell whether frames of a fourcc can be stabilized: 8-bit GREY and
+ * packed YUYV. Compressed frames would need a decode and an encode.
+ * @param pixelformat V4L2 fourcc.
+ * @return Non-zero if supported.
+ */
+int stabilizer_supports(__u32 pixelformat);
+
+/**
+ * @brief Set up a stabilizer for a format.
+ * @param stabilizer Stabilizer to initialize.
+ * @param format Format of the frames to come.
+ * @param lookahead Frames held back, 0 to STABILIZER_MAX_LOOKAHEAD. More
+ * see further ahead and smooth better, at one frame of latency each.
+ * @param margin_percent Crop margin on each side in percent of the frame
+ * size, 0 for STABILIZER_DEFAULT_MARGIN_PERCENT, at most 25.
+ * @return 0 on success, -1 with errno set (EINVAL for unsupported input).
+ */
+int stabilizer_init(struct stabilizer_t *stabilizer,
+                    const struct v4l2_pix_format *format,
+                    unsigned int lookahead, unsigned int margin_percent);
+
+/**
+ * @brief Hand a frame to the stabilizer: it is copied and its motion from
+ * the last frame measured. Pop what is ready before pushing again.
+ * @param stabilizer Stabilizer.
+ * @param frame Frame in the format given at init.
+ * @param bytes Size of frame, at least bytesperline * height.
+ * @param sequence Driver sequence number.
+ * @param timestamp_us Capture timestamp, microseconds.
+ * @return 0 on success, -1 with errno set: EINVAL for a short frame, EBUSY
+ * if a frame is ready and was not popped.
+ */
+int stabilizer_push(struct stabilizer_t *stabilizer, const void *frame,
+                    size_t bytes, __u32 sequence, uint64_t timestamp_us);
+
+/**
+ * @brief Take the oldest frame out, cropped, once the look-ahead behind it
+ * is full.
+ * @param stabilizer Stabilizer.
+ * @param drain Non-zero at the end of the stream, to take frames out
+ * without waiting for the look-ahead.
+ * @param frame Set to the frame.
+ * @return 1 if a frame was taken out, 0 if none is ready.
+ */
+int stabilizer_pop(struct stabilizer_t *stabilizer, int drain,
+                   struct stabilizer_frame_t *frame);
+
+/**
+ * @brief Release a stabilizer.
+ * @param stabilizer Stabilizer.
+ * @return None.
+ */
+void stabilizer_destroy(struct stabilizer_t *stabilizer);
+
+#endif /* STABILIZER_H */
@@ -0,0 +1,602 @@
+/**
+ * @file stack.c
+ * @brief Multi-frame stacking.
+ * @note The mean is a running sum: each frame is widened and added to a
+ * 16-bit accumulator holding one tile, then the tile is divided by a
+ * reciprocal multiply, exact for sums of up to sixteen 8-bit samples. The
+ * add and divide are selected at compile time (see SIMD in the Makefile):
+ * NEON on ARM, AVX2 on x86, scalar otherwise. Clipping sorts the samples of a
+ * run of pixels across frames with a sorting network of min / max steps,
+ * which the compiler vectorizes over the run, then takes the median, the
+ * median absolute deviation as a robust sigma, and the mean of the samples
+ * within the threshold.
+ */
+
+#include "stack.h"
+
+#include <errno.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#elif defined(__AVX2__)
+#include <immintrin.h>
+#endif
+
+/**
+ * @brief Pixels sorted side by side by the clipping network.
+ */
+#define STACK_LANES 32
+
+/**
+ * @brief Standard deviations per unit of median absolute deviation, for
+ * normally distributed noise.
+ */
+#define STACK_MAD_TO_SIGMA 1.4826
+
+int stack_supports(__u32 pixelformat) {
+  switch (pixelformat) {
+  case V4L2_PIX_FMT_GREY:
+  case V4L2_PIX_FMT_YUYV:
+  case V4L2_PIX_FMT_UYVY:
+  case V4L2_PIX_FMT_SBGGR8:
+  case V4L2_PIX_FMT_SGBRG8:
+  case V4L2_PIX_FMT_SGRBG8:
+  case V4L2_PIX_FMT_SRGGB8:
+    return 1;
+  default:
+    return 0;
+  }
+}
+
+/**
+ * @brief Current CLOCK_MONOTONIC time in nanoseconds.
+ */
+static unsigned long long now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return (unsigned long long)ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/**
+ * @brief Multiplier turning (sum + count / 2) into the rounded quotient
+ * with a 16-bit shift: ceil(65536 / count), exact for sums up to
+ * count * 255 and counts of 2 to STACK_MAX_FRAMES.
+ */
+static inline uint32_t stack_reciprocal(unsigned int count) {
+  return (65536 + count - 1) / count;
+}
+
+#if defined(__ARM_NEON)
+
+/**
+ * @brief Add a row of samples to the accumulator, 16 at a time.
+ * @return Samples added.
+ */
+static size_t accumulate_vector(uint16_t *accum, const uint8_t *src,
+                                size_t bytes) {
+  size_t b;
+
+  for (b = 0; b + 16 <= bytes; b += 16) {
+    uint8x16_t x = vld1q_u8(src + b);
+
+    vst1q_u16(accum + b, vaddw_u8(vld1q_u16(accum + b), vget_low_u8(x)));
+    vst1q_u16(accum + b + 8,
+              vaddw_u8(vld1q_u16(accum + b + 8), vget_high_u8(x)));
+  }
+  return b;
+}
+
+/**
+ * @brief Divide accumulated samples by the frame count, 16 at a time.
+ * @return Samples divided.
+ */
+static size_t divide_vector(uint8_t *out, const uint16_t *accum, size_t bytes,
+                            unsigned int count) {
+  const uint16x8_t half = vdupq_n_u16((uint16_t)(count / 2));
+  const uint16x4_t m = vdup_n_u16((uint16_t)stack_reciprocal(count));
+  size_t b;
+
+  for (b = 0; b + 16 <= bytes; b += 16) {
+    uint8x8_t q[2];
+    int h;
+
+    for (h = 0; h < 2; h++) {
+      uint16x8_t x = vaddq_u16(vld1q_u16(accum + b + 8 * h), half);
+
+      q[h] = vmovn_u16(
+          vcombine_u16(vshrn_n_u32(vmull_u16(vget_low_u16(x), m), 16),
+                       vshrn_n_u32(vmull_u16(vget_high_u16(x), m), 16)));
+    }
+    vst1q_u8(out + b, vcombine_u8(q[0], q[1]));
+  }
+  return b;
+}
+
+#elif defined(__AVX2__)
+
+/**
+ * @brief Add a row of samples to the accumulator, 32 at a time.
+ * @return Samples added.
+ */
+static size_t accumulate_vector(uint16_t *accum, const uint8_t *src,
+                                size_t bytes) {
+  size_t b;
+
+  for (b = 0; b + 32 <= bytes; b += 32) {
+    __m256i lo = _mm256_cvtepu8_epi16(
+        _mm_loadu_si128((const __m128i *)(src + b)));
+    __m256i hi = _mm256_cvtepu8_epi16(
+        _mm_loadu_si128((const __m128i *)(src + b + 16)));
+    __m256i *a = (__m256i *)(accum + b);
+
+    _mm256_storeu_si256(a, _mm256_add_epi16(_mm256_loadu_si256(a), lo));
+    _mm256_storeu_si256(a + 1,
+                        _mm256_add_epi16(_mm256_loadu_si256(a + 1), hi));
+  }
+  return b;
+}
+
+/**
+ * @brief Divide accumulated samples by the frame count, 32 at a time. The
+ * pack works within 128-bit halves, the permute restores the order.
+ * @return Samples divided.
+ */
+static size_t divide_vector(uint8_t *out, const uint16_t *accum, size_t bytes,
+                            unsigned int count) {
+  const __m256i half = _mm256_set1_epi16((short)(count / 2));
+  const __m256i m = _mm256_set1_epi16((short)stack_reciprocal(count));
+  size_t b;
+
+  for (b = 0; b + 32 <= bytes; b += 32) {
+    const __m256i *a = (const __m256i *)(accum + b);
+    __m256i lo = _mm256_mulhi_epu16(
+        _mm256_add_epi16(_mm256_loadu_si256(a), half), m);
+    __m256i hi = _mm256_mulhi_epu16(
+        _mm256_add_epi16(_mm256_loadu_si256(a + 1), half), m);
+
+    _mm256_storeu_si256(
+        (__m256i *)(out + b),
+        _mm256_permute4x64_epi64(_mm256_packus_epi16(lo, hi), 0xd8));
+  }
+  return b;
+}
+
+#else
+
+static size_t accumulate_vector(uint16_t *accum, const uint8_t *src,
+                                size_t bytes) {
+  (void)accum;
+  (void)src;
+  (void)bytes;
+  return 0;
+}
+
+static size_t divide_vector(uint8_t *out, const uint16_t *accum, size_t bytes,
+                            unsigned int count) {
+  (void)out;
+  (void)accum;
+  (void)bytes;
+  (void)count;
+  return 0;
+}
+
+#endif
+
+/**
+ * @brief Mean of one tile: every frame added to the accumulator in turn,
+ * then divided.
+ * @param worker Calling thread, owner of the accumulator.
+ * @param row0 First row of the tile.
+ * @param rows Rows in the tile.
+ */
+static void mean_tile(struct stack_worker_t *worker, __u32 row0, __u32 rows) {
+  const struct stacker_t *stacker = worker->stacker;
+  size_t bytes = (size_t)stacker->format.bytesperline * rows;
+  size_t offset = (size_t)stacker->format.bytesperline * row0;
+  uint32_t m = stack_reciprocal(stacker->count);
+  unsigned int half = stacker->count / 2;
+  uint16_t *accum = worker->accum;
+  uint8_t *out = stacker->output + offset;
+  unsigned int i;
+  size_t b;
+
+  memset(accum, 0, bytes * sizeof(*accum));
+  for (i = 0; i < stacker->count; i++) {
+    const uint8_t *src = stacker->frames[i] + offset;
+
+    for (b = accumulate_vector(accum, src, bytes); b < bytes; b++) {
+      accum[b] += src[b];
+    }
+  }
+  for (b = divide_vector(out, accum, bytes, stacker->count); b < bytes; b++) {
+    out[b] = (uint8_t)(((accum[b] + half) * m) >> 16);
+  }
+}
+
+/**
+ * @brief Order two rows lane by lane, the smaller sample into lo.
+ */
+static inline void exchange_lanes(uint8_t *restrict lo, uint8_t *restrict hi) {
+  unsigned int l;
+
+  for (l = 0; l < STACK_LANES; l++) {
+    uint8_t a = lo[l];
+    uint8_t b = hi[l];
+
+    lo[l] = a < b ? a : b;
+    hi[l] = a < b ? b : a;
+  }
+}
+
+/**
+ * @brief exchange_lanes() of 16-bit rows.
+ */
+static inline void exchange_lanes16(uint16_t *restrict lo,
+                                    uint16_t *restrict hi) {
+  unsigned int l;
+
+  for (l = 0; l < STACK_LANES; l++) {
+    uint16_t a = lo[l];
+    uint16_t b = hi[l];
+
+    lo[l] = a < b ? a : b;
+    hi[l] = a < b ? b : a;
+  }
+}
+
+/**
+ * @brief Sort each lane of a set of rows with an odd-even transposition
+ * network: count rounds of compare-exchange between neighbouring rows.
+ * @param s Rows, one per frame.
+ * @param count Number of rows.
+ */
+static void sort_lanes(uint8_t s[][STACK_LANES], unsigned int count) {
+  unsigned int round;
+  unsigned int row;
+
+  for (round = 0; round < count; round++) {
+    for (row = round & 1; row + 1 < count; row += 2) {
+      exchange_lanes(s[row], s[row + 1]);
+    }
+  }
+}
+
+/**
+ * @brief sort_lanes() of 16-bit rows.
+ */
+static void sort_lanes16(uint16_t s[][STACK_LANES], unsigned int count) {
+  unsigned int round;
+  unsigned int row;
+
+  for (round = 0; round < count; round++) {
+    for (row = round & 1; row + 1 < count; row += 2) {
+      exchange_lanes16(s[row], s[row + 1]);
+    }
+  }
+}
+
+/**
+ * @brief Clipped mean of up to STACK_LANES consecutive samples.
+ * @param stacker Stacker holding the job.
+ * @param offset Byte offset of the first sample in every frame.
+ * @param lanes Samples to combine, 1 to STACK_LANES.
+ * @return Samples rejected.
+ */
+static unsigned long clip_run(const struct stacker_t *stacker, size_t offset,
+                              size_t lanes) {
+  uint8_t s[STACK_MAX_FRAMES][STACK_LANES];
+  uint16_t dev[STACK_MAX_FRAMES][STACK_LANES];
+  uint16_t median2[STACK_LANES];
+  uint16_t limit2[STACK_LANES];
+  unsigned int count = stacker->count;
+  uint8_t *out = stacker->output + offset;
+  unsigned long rejected = 0;
+  unsigned int i;
+  size_t l;
+
+  for (i = 0; i < count; i++) {
+    memcpy(s[i], stacker->frames[i] + offset, lanes);
+    memset(s[i] + lanes, 0, STACK_LANES - lanes);
+  }
+  sort_lanes(s, count);
+
+  /* Twice the median and the deviations from it keep the halves of an
+   * even count exact. */
+  for (l = 0; l < STACK_LANES; l++) {
+    median2[l] = (uint16_t)(s[(count - 1) / 2][l] + s[count / 2][l]);
+  }
+  for (i = 0; i < count; i++) {
+    for (l = 0; l < STACK_LANES; l++) {
+      int d = 2 * s[i][l] - median2[l];
+
+      dev[i][l] = (uint16_t)(d < 0 ? -d : d);
+    }
+  }
+  sort_lanes16(dev, count);
+  /* Never tighter than one level either side, the quantization step. */
+  for (l = 0; l < STACK_LANES; l++) {
+    uint32_t limit = (dev[(count - 1) / 2][l] * stacker->clip_scale) >> 16;
+
+    limit2[l] = (uint16_t)(limit > 2 ? limit : 2);
+  }
+
+  for (l = 0; l < lanes; l++) {
+    unsigned int sum = 0;
+    unsigned int kept = 0;
+
+    for (i = 0; i < count; i++) {
+      int d = 2 * s[i][l] - median2[l];
+
+      if ((d < 0 ? -d : d) <= limit2[l]) {
+        sum += s[i][l];
+        kept++;
+      }
+    }
+    /* An even count can reject both middle samples. */
+    if (kept == 0) {
+      out[l] = (uint8_t)((median2[l] + 1) / 2);
+    } else {
+      out[l] = (uint8_t)(((sum + kept / 2) * stack_reciprocal(kept)) >> 16);
+    }
+    rejected += count - kept;
+  }
+  return rejected;
+}
+
+/**
+ * @brief Stack one tile.
+ * @param worker Calling thread.
+ * @param tile Tile index.
+ */
+static void stack_tile(struct stack_worker_t *worker, unsigned int tile) {
+  const struct stacker_t *stacker = worker->stacker;
+  __u32 row0 = tile * STACK_TILE_ROWS;
+  __u32 rows = stacker->format.height - row0;
+  size_t first;
+  size_t end;
+  size_t b;
+
+  if (rows > STACK_TILE_ROWS) {
+    rows = STACK_TILE_ROWS;
+  }
+  if (stacker->method == STACK_MEAN) {
+    mean_tile(worker, row0, rows);
+    return;
+  }
+
+  first = (size_t)stacker->format.bytesperline * row0;
+  end = first + (size_t)stacker->format.bytesperline * rows;
+  for (b = first; b < end; b += STACK_LANES) {
+    worker->rejected +=
+        clip_run(stacker, b, end - b < STACK_LANES ? end - b : STACK_LANES);
+  }
+}
+
+/**
+ * @brief Take tiles of the current stack until none are left.
+ * @param worker Calling thread.
+ */
+static void run_tiles(struct stack_worker_t *worker) {
+  struct stacker_t *stacker = worker->stacker;
+
+  pthread_mutex_lock(&stacker->lock);
+  while (stacker->count > 0 && stacker->next_tile < stacker->tile_count) {
+    unsigned int tile = stacker->next_tile++;
+
+    pthread_mutex_unlock(&stacker->lock);
+    stack_tile(worker, tile);
+    pthread_mutex_lock(&stacker->lock);
+
+    if (++stacker->tiles_done == stacker->tile_count) {
+      pthread_cond_signal(&stacker->finished);
+    }
+  }
+  pthread_mutex_unlock(&stacker->lock);
+}
+
+static void *worker_main(void *arg) {
+  struct stack_worker_t *worker = arg;
+  struct stacker_t *stacker = worker->stacker;
+  unsigned long seen = 0;
+
+  pthread_mutex_lock(&stacker->lock);
+  for (;;) {
+    while (stacker->generation == seen && !stacker->quit) {
+      pthread_cond_wait(&stacker->start, &stacker->lock);
+    }
+    if (stacker->quit) {
+      break;
+    }
+    seen = stacker->generation;
+    pthread_mutex_unlock(&stacker->lock);
+    run_tiles(worker);
+    pthread_mutex_lock(&stacker->lock);
+  }
+  pthread_mutex_unlock(&stacker->lock);
+
+  return NULL;
+}
+
+int stacker_init(struct stacker_t *stacker, unsigned int threads) {
+  unsigned int i;
+
+  memset(stacker, 0, sizeof(*stacker));
+  if (threads == 0) {
+    long online = sysconf(_SC_NPROCESSORS_ONLN);
+
+    threads = online > 0 ? (unsigned int)online : 1;
+  }
+  if (threads > STACK_MAX_THREADS) {
+    threads = STACK_MAX_THREADS;
+  }
+
+  pthread_mutex_init(&stacker->lock, NULL);
+  pthread_cond_init(&stacker->start, NULL);
+  pthread_cond_init(&stacker->finished, NULL);
+
+  for (i = 0; i < threads; i++) {
+    stacker->workers[i].stacker = stacker;
+    stacker->workers[i].id = i;
+    /* Worker 0 is whoever calls stack_frames(). */
+    if (i > 0 && pthread_create(&stacker->thread_ids[i], NULL, worker_main,
+                                &stacker->workers[i]) != 0) {
+      stacker_destroy(stacker);
+      errno = EAGAIN;
+      return -1;
+    }
+    stacker->threads = i + 1;
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Grow the output and, for means, the accumulators to fit a format.
+ * @param stacker Stacker, workers idle.
+ * @param format Format about to be stacked.
+ * @param method How samples will be combined.
+ * @return 0 on success, -1 with errno set.
+ */
+static int reserve_buffers(struct stacker_t *stacker,
+                           const struct v4l2_pix_format *format,
+                           enum stack_method_t method) {
+  size_t size = (size_t)format->bytesperline * format->height;
+  size_t tile = (size_t)format->bytesperline * STACK_TILE_ROWS;
+  unsigned int i;
+
+  if (stacker->output_capacity < size) {
+    uint8_t *grown = realloc(stacker->output, size);
+
+    if (grown == NULL) {
+      errno = ENOMEM;
+      return -1;
+    }
+    stacker->output = grown;
+    stacker->output_capacity = size;
+  }
+  if (method != STACK_MEAN || stacker->accum_capacity >= tile) {
+    return 0;
+  }
+  for (i = 0; i < stacker->threads; i++) {
+    uint16_t *grown =
+        realloc(stacker->workers[i].accum, tile * sizeof(uint16_t));
+
+    if (grown == NULL) {
+      /* Accumulators already grown are larger than recorded, harmless. */
+      errno = ENOMEM;
+      return -1;
+    }
+    stacker->workers[i].accum = grown;
+  }
+  stacker->accum_capacity = tile;
+  return 0;
+}
+
+int stack_frames(struct stacker_t *stacker,
+                 const struct v4l2_pix_format *format,
+                 const void *const *frames, unsigned int count,
+                 enum stack_method_t method, unsigned int clip_tenths,
+                 const void **output) {
+  size_t bpp = format->pixelformat == V4L2_PIX_FMT_YUYV ||
+                       format->pixelformat == V4L2_PIX_FMT_UYVY
+                   ? 2
+                   : 1;
+  unsigned long long start;
+  unsigned int tiles;
+  unsigned int i;
+
+  if (!stack_supports(format->pixelformat) || count == 0 ||
+      count > STACK_MAX_FRAMES || (method == STACK_CLIPPED && count < 3) ||
+      format->height == 0 || format->bytesperline < format->width * bpp) {
+    errno = EINVAL;
+    return -1;
+  }
+  for (i = 0; i < count; i++) {
+    if (frames[i] == NULL) {
+      errno = EINVAL;
+      return -1;
+    }
+  }
+  if (reserve_buffers(stacker, format, method) < 0) {
+    return -1;
+  }
+
+  start = now_ns();
+  if (count == 1) {
+    memcpy(stacker->output, frames[0],
+           (size_t)format->bytesperline * format->height);
+    goto done;
+  }
+
+  stacker->format = *format;
+  for (i = 0; i < count; i++) {
+    stacker->frames[i] = frames[i];
+  }
+  for (i = 0; i < stacker->threads; i++) {
+    stacker->workers[i].rejected = 0;
+  }
+  stacker->method = method;
+  stacker->clip_scale =
+      (uint32_t)((clip_tenths ? clip_tenths : STACK_DEFAULT_CLIP_TENTHS) *
+                     STACK_MAD_TO_SIGMA * 65536 / 10 +
+                 0.5);
+  stacker->count = count;
+
+  tiles = (format->height + STACK_TILE_ROWS - 1) / STACK_TILE_ROWS;
+  pthread_mutex_lock(&stacker->lock);
+  stacker->tile_count = tiles;
+  stacker->next_tile = 0;
+  stacker->tiles_done = 0;
+  stacker->generation++;
+  pthread_cond_broadcast(&stacker->start);
+  pthread_mutex_unlock(&stacker->lock);
+
+  run_tiles(&stacker->workers[0]);
+
+  pthread_mutex_lock(&stacker->lock);
+  while (stacker->tiles_done < tiles) {
+    pthread_cond_wait(&stacker->finished, &stacker->lock);
+  }
+  stacker->count = 0;
+  pthread_mutex_unlock(&stacker->lock);
+
+  for (i = 0; i < stacker->threads; i++) {
+    stacker->rejected_samples += stacker->workers[i].rejected;
+  }
+
+done:
+  stacker->stacks++;
+  stacker->stack_ns += now_ns() - start;
+  *output = stacker->output;
+  return 0;
+}
+
+void stacker_destroy(struct stacker_t *stacker) {
+  unsigned int i;
+
+  pthread_mutex_lock(&stacker->lock);
+  stacker->quit = 1;
+  pthread_cond_broadcast(&stacker->start);
+  pthread_mutex_unlock(&stacker->lock);
+
+  for (i = 1; i < stacker->threads; i++) {
+    pthread_join(stacker->thread_ids[i], NULL);
+  }
+
+  for (i = 0; i < STACK_MAX_THREADS; i++) {
+    free(stacker->workers[i].accum);
+    stacker->workers[i].accum = NULL;
+  }
+  stacker->threads = 0;
+  free(stacker->output);
+  stacker->output = NULL;
+
+  pthread_cond_destroy(&stacker->finished);
+  pthread_cond_destroy(&stacker->start);
+  pthread_mutex_destroy(&stacker->lock);
+}
@@ -0,0 +1,154 @@
+/**
+ * @file stack.h
+ * @brief Multi-frame stacking for low-light stills: a burst of frames of a
+ * static scene averaged sample by sample, optionally rejecting outliers
+ * against their median, tile by tile on a worker pool.
+ */
+
+#ifndef STACK_H
+#define STACK_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <linux/videodev2.h>
+
+/**
+ * @brief Most frames stacked at once. Their 8-bit sum stays within a 16-bit
+ * accumulator lane.
+ */
+#define STACK_MAX_FRAMES 16
+
+/**
+ * @brief Upper bound of stacking threads, the caller included.
+ */
+#define STACK_MAX_THREADS 8
+
+/**
+ * @brief Rows per tile, the unit of parallelism. A tile's accumulator stays
+ * in cache while every frame is added to it.
+ */
+#define STACK_TILE_ROWS 16
+
+/**
+ * @brief Rejection threshold used when none is given, in tenths of a
+ * standard deviation.
+ */
+#define STACK_DEFAULT_CLIP_TENTHS 25
+
+/**
+ * @brief How samples are combined.
+ */
+enum stack_method_t {
+  /** Plain mean, noise falls with the square root of the frame count. */
+  STACK_MEAN,
+  /** Mean of the samples within a few sigma of their median, which drops
+   * hot pixels, cosmic ray hits and anything crossing the scene. */
+  STACK_CLIPPED,
+};
+
+struct stacker_t;
+
+/**
+ * @brief A thread of the pool.
+ * @param accum Accumulator of one tile, 16 bits per sample.
+ * @param rejected Samples this thread left out of a clipped stack.
+ */
+struct stack_worker_t {
+  struct stacker_t *stacker;
+  unsigned int id;
+  uint16_t *accum;
+  unsigned long rejected;
+};
+
+/**
+ * @brief Stacker and its worker pool.
+ * @param threads Stacking threads including the caller of stack_frames().
+ * @param format Format of the frames being stacked.
+ * @param frames Frames being stacked, shared with the workers.
+ * @param count Number of frames.
+ * @param method How samples are combined.
+ * @param clip_scale Rejection threshold per unit of interquartile range,
+ * 16.16 fixed point.
+ * @param generation Bumped for every stack, wakes the workers.
+ * @param next_tile Next tile to hand out.
+ * @param tiles_done Tiles finished for the current stack.
+ * @param accum_capacity Samples each worker's accumulator holds.
+ * @param output Result of the last stack.
+ * @param stacks Stacks done.
+ * @param stack_ns Time spent stacking, in nanoseconds.
+ * @param rejected_samples Samples left out by clipped stacks.
+ */
+struct stacker_t {
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t finished;
+  pthread_t thread_ids[STACK_MAX_THREADS];
+  struct stack_worker_t workers[STACK_MAX_THREADS];
+  unsigned int threads;
+  int quit;
+  struct v4l2_pix_format format;
+  const uint8_t *frames[STACK_MAX_FRAMES];
+  unsigned int count;
+  enum stack_method_t method;
+  uint32_t clip_scale;
+  unsigned long generation;
+  unsigned int tile_count;
+  unsigned int next_tile;
+  unsigned int tiles_done;
+  size_t accum_capacity;
+  uint8_t *output;
+  size_t output_capacity;
+  unsigned long stacks;
+  unsigned long long stack_ns;
+  unsigned long long rejected_samples;
+};
+
+/**
+ * @brief Tell whether frames of a fourcc can be stacked: one byte per
+ * sample, so GREY, packed YUV 4:2:2 and 8-bit Bayer.
+ * @param pixelformat V4L2 fourcc.
+ * @return Non-zero if supported.
+ */
+int stack_supports(__u32 pixelformat);
+
+/**
+ * @brief Start a stacker.
+ * @param stacker Stacker to initialize.
+ * @param threads Stacking threads including the caller, 0 for one per
+ * online CPU. Capped at STACK_MAX_THREADS.
+ * @return 0 on success, -1 with errno set.
+ */
+int stacker_init(struct stacker_t *stacker, unsigned int threads);
+
+/**
+ * @brief Stack frames of a static scene into one. The frames are only read,
+ * so they can be the mapped buffers of a burst.
+ * @param stacker Stacker.
+ * @param format Format shared by every frame.
+ * @param frames Frames, in any order.
+ * @param count Number of frames, 1 to STACK_MAX_FRAMES. Clipping needs at
+ * least 3 to tell an outlier from its neighbours.
+ * @param method How samples are combined.
+ * @param clip_tenths Samples further than this from the median, in tenths
+ * of a standard deviation, are rejected by STACK_CLIPPED; 0 for
+ * STACK_DEFAULT_CLIP_TENTHS.
+ * @param output Set to the result, format->bytesperline * format->height
+ * bytes valid until the next call.
+ * @return 0 on success, -1 with errno set (EINVAL for unsupported input).
+ */
+int stack_frames(struct stacker_t *stacker,
+                 const struct v4l2_pix_format *format,
+                 const void *const *frames, unsigned int count,
+                 enum stack_method_t method, unsigned int clip_tenths,
+                 const void **output);
+
+/**
+ * @brief Stop the workers and release the stacker.
+ * @param stacker Stacker.
+ * @return None.
+ */
+void stacker_destroy(struct stacker_t *stacker);
+
+#endif /* STACK_H */
@@ -0,0 +1,318 @@
+/**
+ * @file stage.c
+ * @brief Processing stage plugins.
+ * @note Each frame is handed to the stages on their own threads first, so
+ * they work while the caller runs the STAGE_THREAD_CALLER stages, and the
+ * pipeline then waits for all of them before the buffer is released. A
+ * stage is given every stride-th frame, stride being how many frame
+ * intervals one call takes: the larger of its declared cost and its
+ * measured average, against the measured frame interval. A slow analysis
+ * thus samples the stream instead of backing it up. Phases are staggered
+ * by stage so decimated stages do not all land on the same frame.
+ */
+
+#include "stage.h"
+
+#include <dlfcn.h>
+#include <errno.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+
+/**
+ * @brief Current CLOCK_MONOTONIC time in nanoseconds.
+ */
+static long long monotonic_ns(void) {
+  struct timespec now;
+
+  clock_gettime(CLOCK_MONOTONIC, &now);
+  return now.tv_sec * 1000000000LL + now.tv_nsec;
+}
+
+/**
+ * @brief Call a stage on the current frame and account for it.
+ * @param stage Stage, due for the frame.
+ */
+static void process_stage(struct stage_t *stage) {
+  struct stage_pipeline_t *pipeline = stage->pipeline;
+  long long start = monotonic_ns();
+  long long elapsed;
+
+  if (stage->descriptor->process(stage->state, pipeline->view,
+                                 pipeline->metadata) < 0) {
+    stage->errors++;
+  }
+  elapsed = monotonic_ns() - start;
+  stage->process_ns_avg =
+      stage->frames == 0
+          ? elapsed
+          : stage->process_ns_avg + (elapsed - stage->process_ns_avg) / 8;
+  if (elapsed > stage->process_ns_max) {
+    stage->process_ns_max = elapsed;
+  }
+  stage->process_ns_total += (unsigned long long)elapsed;
+  stage->frames++;
+}
+
+static void *stage_main(void *arg) {
+  struct stage_t *stage = arg;
+  struct stage_pipeline_t *pipeline = stage->pipeline;
+
+  pthread_mutex_lock(&pipeline->lock);
+  for (;;) {
+    while (!stage->due && !pipeline->quit) {
+      pthread_cond_wait(&pipeline->start, &pipeline->lock);
+    }
+    if (pipeline->quit) {
+      break;
+    }
+    pthread_mutex_unlock(&pipeline->lock);
+    process_stage(stage);
+    pthread_mutex_lock(&pipeline->lock);
+
+    stage->due = 0;
+    if (--pipeline->pending == 0) {
+      pthread_cond_signal(&pipeline->finished);
+    }
+  }
+  pthread_mutex_unlock(&pipeline->lock);
+
+  return NULL;
+}
+
+void stage_pipeline_init(struct stage_pipeline_t *pipeline) {
+  memset(pipeline, 0, sizeof(*pipeline));
+  pthread_mutex_init(&pipeline->lock, NULL);
+  pthread_cond_init(&pipeline->start, NULL);
+  pthread_cond_init(&pipeline->finished, NULL);
+}
+
+int stage_pipeline_add(struct stage_pipeline_t *pipeline,
+                       const struct stage_descriptor_t *descriptor,
+                       const char *args) {
+  struct stage_t *stage;
+
+  if (descriptor->abi_version != STAGE_ABI_VERSION ||
+      descriptor->process == NULL || descriptor->name == NULL) {
+    snprintf(pipeline->error, sizeof(pipeline->error),
+             "not a stage of ABI version %d", STAGE_ABI_VERSION);
+    errno = EINVAL;
+    return -1;
+  }
+  if (pipeline->count == STAGE_MAX_STAGES) {
+    snprintf(pipeline->error, sizeof(pipeline->error),
+             "more than %d stages", STAGE_MAX_STAGES);
+    errno = ENOSPC;
+    return -1;
+  }
+
+  stage = &pipeline->stages[pipeline->count++];
+  memset(stage, 0, sizeof(*stage));
+  stage->pipeline = pipeline;
+  stage->descriptor = descriptor;
+  snprintf(stage->args, sizeof(stage->args), "%s", args ? args : "");
+  stage->stride = 1;
+  return 0;
+}
+
+int stage_pipeline_load(struct stage_pipeline_t *pipeline, const char *path,
+                        const char *args) {
+  const struct stage_descriptor_t *descriptor;
+  void *handle;
+
+  /* RTLD_LOCAL: plugins cannot see each other's symbols. */
+  handle = dlopen(path, RTLD_NOW | RTLD_LOCAL);
+  if (handle == NULL) {
+    snprintf(pipeline->error, sizeof(pipeline->error), "%s", dlerror());
+    errno = ENOENT;
+    return -1;
+  }
+  descriptor = dlsym(handle, STAGE_DESCRIPTOR_SYMBOL);
+  if (descriptor == NULL) {
+    snprintf(pipeline->error, sizeof(pipeline->error), "no %s in %s",
+             STAGE_DESCRIPTOR_SYMBOL, path);
+    dlclose(handle);
+    errno = ENOEXEC;
+    return -1;
+  }
+  if (stage_pipeline_add(pipeline, descriptor, args) < 0) {
+    int saved = errno;
+
+    dlclose(handle);
+    errno = saved;
+    return -1;
+  }
+  pipeline->stages[pipeline->count - 1].handle = handle;
+  return 0;
+}
+
+/**
+ * @brief Stop the stage threads and release the state of the stages that
+ * were started, keeping the plugins loaded.
+ */
+static void stop_stages(struct stage_pipeline_t *pipeline) {
+  unsigned int i;
+
+  pthread_mutex_lock(&pipeline->lock);
+  pipeline->quit = 1;
+  pthread_cond_broadcast(&pipeline->start);
+  pthread_mutex_unlock(&pipeline->lock);
+
+  for (i = 0; i < pipeline->started; i++) {
+    struct stage_t *stage = &pipeline->stages[i];
+
+    if (stage->running) {
+      pthread_join(stage->thread, NULL);
+      stage->running = 0;
+    }
+    if (stage->descriptor->destroy != NULL) {
+      stage->descriptor->destroy(stage->state);
+    }
+    stage->state = NULL;
+  }
+  pipeline->started = 0;
+  pipeline->quit = 0;
+}
+
+int stage_pipeline_start(struct stage_pipeline_t *pipeline,
+                         const struct v4l2_format *format) {
+  unsigned int i;
+
+  pipeline->format = *format;
+  for (i = 0; i < pipeline->count; i++) {
+    struct stage_t *stage = &pipeline->stages[i];
+
+    if (stage->descriptor->init != NULL &&
+        stage->descriptor->init(&stage->state, &pipeline->format,
+                                stage->args) < 0) {
+      int saved = errno;
+
+      snprintf(pipeline->error, sizeof(pipeline->error),
+               "%s refused the stream: %s", stage->descriptor->name,
+               strerror(saved));
+      stop_stages(pipeline);
+      errno = saved;
+      return -1;
+    }
+    pipeline->started = i + 1;
+    if (stage->descriptor->threading == STAGE_THREAD_OWN) {
+      if (pthread_create(&stage->thread, NULL, stage_main, stage) != 0) {
+        snprintf(pipeline->error, sizeof(pipeline->error),
+                 "no thread for %s", stage->descriptor->name);
+        stop_stages(pipeline);
+        errno = EAGAIN;
+        return -1;
+      }
+      stage->running = 1;
+    }
+  }
+  return 0;
+}
+
+/**
+ * @brief Work out which frames a stage gets from what it costs.
+ */
+static void schedule_stage(struct stage_pipeline_t *pipeline,
+                           struct stage_t *stage) {
+  long long cost_ns = (long long)stage->descriptor->cost_us * 1000;
+  long long interval_ns = pipeline->interval_us_avg * 1000;
+
+  if (stage->process_ns_avg > cost_ns) {
+    cost_ns = stage->process_ns_avg;
+  }
+  stage->stride = interval_ns > 0 && cost_ns > interval_ns
+                      ? (unsigned int)((cost_ns + interval_ns - 1) /
+                                       interval_ns)
+                      : 1;
+}
+
+void stage_pipeline_run(struct stage_pipeline_t *pipeline,
+                        const struct stage_view_t *view,
+                        const struct stage_metadata_t *metadata) {
+  long long start = monotonic_ns();
+  long long elapsed;
+  unsigned int i;
+  int due[STAGE_MAX_STAGES];
+
+  if (pipeline->frames > 0 &&
+      metadata->timestamp_us > pipeline->last_timestamp_us) {
+    long long interval =
+        (long long)(metadata->timestamp_us - pipeline->last_timestamp_us);
+
+    pipeline->interval_us_avg =
+        pipeline->interval_us_avg == 0
+            ? interval
+            : pipeline->interval_us_avg +
+                  (interval - pipeline->interval_us_avg) / 8;
+  }
+  pipeline->last_timestamp_us = metadata->timestamp_us;
+
+  for (i = 0; i < pipeline->count; i++) {
+    struct stage_t *stage = &pipeline->stages[i];
+
+    schedule_stage(pipeline, stage);
+    due[i] = pipeline->frames % stage->stride == i % stage->stride;
+    if (!due[i]) {
+      stage->skipped++;
+    }
+  }
+
+  pthread_mutex_lock(&pipeline->lock);
+  pipeline->view = view;
+  pipeline->metadata = metadata;
+  for (i = 0; i < pipeline->count; i++) {
+    if (due[i] && pipeline->stages[i].descriptor->threading ==
+                      STAGE_THREAD_OWN) {
+      pipeline->stages[i].due = 1;
+      pipeline->pending++;
+    }
+  }
+  if (pipeline->pending > 0) {
+    pthread_cond_broadcast(&pipeline->start);
+  }
+  pthread_mutex_unlock(&pipeline->lock);
+
+  for (i = 0; i < pipeline->count; i++) {
+    if (due[i] &&
+        pipeline->stages[i].descriptor->threading == STAGE_THREAD_CALLER) {
+      process_stage(&pipeline->stages[i]);
+    }
+  }
+
+  /* The view is the driver's buffer: nobody may be reading it once this
+   * returns. */
+  pthread_mutex_lock(&pipeline->lock);
+  while (pipeline->pending > 0) {
+    pthread_cond_wait(&pipeline->finished, &pipeline->lock);
+  }
+  pipeline->view = NULL;
+  pipeline->metadata = NULL;
+  pthread_mutex_unlock(&pipeline->lock);
+
+  elapsed = monotonic_ns() - start;
+  pipeline->run_ns_avg =
+      pipeline->frames == 0
+          ? elapsed
+          : pipeline->run_ns_avg + (elapsed - pipeline->run_ns_avg) / 8;
+  if (elapsed > pipeline->run_ns_max) {
+    pipeline->run_ns_max = elapsed;
+  }
+  pipeline->frames++;
+}
+
+void stage_pipeline_destroy(struct stage_pipeline_t *pipeline) {
+  unsigned int i;
+
+  stop_stages(pipeline);
+  for (i = 0; i < pipeline->count; i++) {
+    if (pipeline->stages[i].handle != NULL) {
+      dlclose(pipeline->stages[i].handle);
+      pipeline->stages[i].handle = NULL;
+    }
+  }
+  pipeline->count = 0;
+
+  pthread_cond_destroy(&pipeline->finished);
+  pthread_cond_destroy(&pipeline->start);
+  pthread_mutex_destroy(&pipeline->lock);
+}
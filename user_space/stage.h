@@ -0,0 +1,269 @@
+/**
+ * @file stage.h
+ * @brief Processing stage plugins: analyses built as shared objects, loaded
+ * with dlopen and run on every frame of the stream. A stage sees each frame
+ * as a read-only view of the driver's mapped buffer, never a copy, and the
+ * pipeline times every stage separately.
+ *
+ * A plugin exports one STAGE_DESCRIPTOR_SYMBOL, for example:
+ *
+ *   const struct stage_descriptor_t stage_descriptor = {
+ *       .abi_version = STAGE_ABI_VERSION,
+ *       .name = "exposure_meter",
+ *       .cost_us = 300,
+ *       .threading = STAGE_THREAD_CALLER,
+ *       .init = meter_init,
+ *       .process = meter_process,
+ *       .destroy = meter_destroy,
+ *   };
+ */
+
+#ifndef STAGE_H
+#define STAGE_H
+
+#include <pthread.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#include <linux/videodev2.h>
+
+/**
+ * @brief Version of the structures below. Bumped on any incompatible
+ * change; plugins built against another version are refused.
+ */
+#define STAGE_ABI_VERSION 1
+
+/**
+ * @brief Name of the descriptor a plugin exports.
+ */
+#define STAGE_DESCRIPTOR_SYMBOL "stage_descriptor"
+
+/**
+ * @brief Most stages in a pipeline.
+ */
+#define STAGE_MAX_STAGES 8
+
+/**
+ * @brief Where a stage runs.
+ */
+enum stage_threading_t {
+  /** On the capture thread, one after the other in load order. For cheap
+   * stages, a thread hand-off would cost more than they do. */
+  STAGE_THREAD_CALLER,
+  /** On a thread of its own, alongside the other stages. The frame is
+   * held until it is done. */
+  STAGE_THREAD_OWN,
+};
+
+/**
+ * @brief Most planes of a frame, three for YUV420M.
+ */
+#define STAGE_MAX_PLANES 3
+
+/**
+ * @brief One plane of a frame.
+ * @param data Start of the plane, read-only, valid only during process().
+ * @param bytes Bytes used in it.
+ * @param bytesperline Bytes per line, 0 for compressed data.
+ */
+struct stage_plane_t {
+  const void *data;
+  size_t bytes;
+  __u32 bytesperline;
+};
+
+/**
+ * @brief Zero-copy view of a frame.
+ * @param data Start of the mapped driver buffer, read-only, valid only
+ * during process(). The first plane for multi-planar formats.
+ * @param bytes Bytes used in it.
+ * @param format Format negotiated for the stream, single-planar: for
+ * NV12M or YUV420M it describes the first plane.
+ * @param plane_count Planes of the frame, 1 for every single-planar
+ * format.
+ * @param planes Each plane, in the driver's buffers too; planes[0] is data.
+ */
+struct stage_view_t {
+  const void *data;
+  size_t bytes;
+  const struct v4l2_format *format;
+  unsigned int plane_count;
+  struct stage_plane_t planes[STAGE_MAX_PLANES];
+};
+
+/**
+ * @brief What the driver reported with a frame.
+ * @param sequence Driver sequence number.
+ * @param index Buffer index.
+ * @param flags V4L2_BUF_FLAG_* of the buffer.
+ * @param timestamp_us Capture timestamp, microseconds.
+ */
+struct stage_metadata_t {
+  __u32 sequence;
+  __u32 index;
+  __u32 flags;
+  uint64_t timestamp_us;
+};
+
+/**
+ * @brief What a plugin exports.
+ * @param abi_version STAGE_ABI_VERSION it was built against.
+ * @param name Short name for reports.
+ * @param cost_us Expected time of one process() call, microseconds. A
+ * stage costing more than a frame interval is run on every n-th frame.
+ * @param threading Where it runs.
+ * @param init Set up for a stream: state is set to whatever process()
+ * needs, args is the text given after the plugin path (empty if none).
+ * Returns 0, or -1 with errno set to refuse the stream.
+ * @param process Look at one frame. Returns 0, or -1 counted as an error.
+ * @param destroy Release the state. May be NULL.
+ */
+struct stage_descriptor_t {
+  unsigned int abi_version;
+  const char *name;
+  unsigned int cost_us;
+  enum stage_threading_t threading;
+  int (*init)(void **state, const struct v4l2_format *format,
+              const char *args);
+  int (*process)(void *state, const struct stage_view_t *view,
+                 const struct stage_metadata_t *metadata);
+  void (*destroy)(void *state);
+};
+
+struct stage_pipeline_t;
+
+/**
+ * @brief A stage in a pipeline and its figures.
+ * @param pipeline Pipeline it belongs to.
+ * @param descriptor What the plugin exported.
+ * @param handle dlopen handle, NULL for a stage linked in.
+ * @param args Text handed to init.
+ * @param state What init returned.
+ * @param thread Its thread, for STAGE_THREAD_OWN.
+ * @param running Non-zero while the thread runs.
+ * @param due Non-zero while its thread has a frame to process.
+ * @param stride Runs on every stride-th frame.
+ * @param frames Frames processed.
+ * @param skipped Frames not given to it to keep up with the stream.
+ * @param errors Frames process() failed on.
+ * @param process_ns_avg Moving average of one process() call,
+ * nanoseconds.
+ * @param process_ns_max Slowest process() call, nanoseconds.
+ * @param process_ns_total Time spent in process(), nanoseconds.
+ */
+struct stage_t {
+  struct stage_pipeline_t *pipeline;
+  const struct stage_descriptor_t *descriptor;
+  void *handle;
+  char args[512];
+  void *state;
+  pthread_t thread;
+  int running;
+  int due;
+  unsigned int stride;
+  unsigned long frames;
+  unsigned long skipped;
+  unsigned long errors;
+  long long process_ns_avg;
+  long long process_ns_max;
+  unsigned long long process_ns_total;
+};
+
+/**
+ * @brief Stages run on a stream.
+ * @param stages Stages in load order.
+ * @param count Number of stages.
+ * @param started Stages initialized, in load order.
+ * @param format Format the stages were started with.
+ * @param view Frame being processed, shared with the stage threads.
+ * @param metadata Its metadata.
+ * @param pending Stage threads still busy with it.
+ * @param frames Frames run through the pipeline.
+ * @param last_timestamp_us Timestamp of the last frame.
+ * @param interval_us_avg Moving average of the frame interval,
+ * microseconds.
+ * @param run_ns_avg Moving average of a whole frame, nanoseconds.
+ * @param run_ns_max Slowest frame, nanoseconds.
+ * @param error Why the last load or start failed.
+ */
+struct stage_pipeline_t {
+  pthread_mutex_t lock;
+  pthread_cond_t start;
+  pthread_cond_t finished;
+  struct stage_t stages[STAGE_MAX_STAGES];
+  unsigned int count;
+  unsigned int started;
+  int quit;
+  struct v4l2_format format;
+  const struct stage_view_t *view;
+  const struct stage_metadata_t *metadata;
+  unsigned int pending;
+  unsigned long frames;
+  uint64_t last_timestamp_us;
+  long long interval_us_avg;
+  long long run_ns_avg;
+  long long run_ns_max;
+  char error[256];
+};
+
+/**
+ * @brief Set up an empty pipeline.
+ * @param pipeline Pipeline to initialize.
+ * @return None.
+ */
+void stage_pipeline_init(struct stage_pipeline_t *pipeline);
+
+/**
+ * @brief Append a stage linked into the program.
+ * @param pipeline Pipeline, not started.
+ * @param descriptor The stage.
+ * @param args Text for its init, NULL for none.
+ * @return 0 on success, -1 with errno set: EINVAL for another ABI version
+ * or a descriptor without process(), ENOSPC when the pipeline is full.
+ */
+int stage_pipeline_add(struct stage_pipeline_t *pipeline,
+                       const struct stage_descriptor_t *descriptor,
+                       const char *args);
+
+/**
+ * @brief Load a plugin and append its stage.
+ * @param pipeline Pipeline, not started.
+ * @param path Shared object, as for dlopen.
+ * @param args Text for its init, NULL for none.
+ * @return 0 on success, -1 with errno set and pipeline->error describing
+ * the failure.
+ */
+int stage_pipeline_load(struct stage_pipeline_t *pipeline, const char *path,
+                        const char *args);
+
+/**
+ * @brief Initialize every stage for a stream and start the stage threads.
+ * @param pipeline Pipeline.
+ * @param format Format negotiated with the driver.
+ * @return 0 on success, -1 with errno set and pipeline->error naming the
+ * stage that refused; stages already started are stopped again.
+ */
+int stage_pipeline_start(struct stage_pipeline_t *pipeline,
+                         const struct v4l2_format *format);
+
+/**
+ * @brief Run a frame through every stage due for it. Returns once they are
+ * all done, so the buffer can go back to the driver.
+ * @param pipeline Started pipeline.
+ * @param view The frame.
+ * @param metadata Its metadata.
+ * @return None.
+ */
+void stage_pipeline_run(struct stage_pipeline_t *pipeline,
+                        const struct stage_view_t *view,
+                        const struct stage_metadata_t *metadata);
+
+/**
+ * @brief Stop the stage threads, release every stage and unload the
+ * plugins.
+ * @param pipeline Pipeline.
+ * @return None.
+ */
+void stage_pipeline_destroy(struct stage_pipeline_t *pipeline);
+
+#endif /* STAGE_H */
@@ -0,0 +1,437 @@
+/**
+ * @file storage.c
+ * @brief Checked writes and segment rotation.
+ * @note Hours of recording through the page cache evict everything else on a
+ * small board. Drop-behind mode keeps writing buffered but pushes each window
+ * to the disk early and drops it from the cache once written; direct mode
+ * bypasses the cache altogether with O_DIRECT. Either way the memory taken by
+ * a recording stays bounded and writeback happens at a steady pace instead
+ * of in bursts when the kernel's dirty limit is hit.
+ */
+
+#define _GNU_SOURCE
+
+#include "storage.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+/**
+ * @brief Weight of a new sample in the write time average, as a shift:
+ * avg += (sample - avg) / 8.
+ */
+#define WRITE_AVG_SHIFT 3
+
+int write_full(int fd, const void *data, size_t length) {
+  const char *cursor = data;
+
+  while (length > 0) {
+    ssize_t written = write(fd, cursor, length);
+
+    if (written < 0) {
+      if (errno == EINTR) {
+        continue;
+      }
+      return -1;
+    }
+    if (written == 0) {
+      /* No progress and no error: treat as out of space. */
+      errno = ENOSPC;
+      return -1;
+    }
+    cursor += written;
+    length -= (size_t)written;
+  }
+
+  return 0;
+}
+
+void numbered_path(char *dest, size_t size, const char *base,
+                   unsigned long index) {
+  const char *slash = strrchr(base, '/');
+  const char *dot = strrchr(base, '.');
+
+  /* Only a dot in the file name starts an extension. */
+  if (dot == NULL || (slash != NULL && dot < slash)) {
+    snprintf(dest, size, "%s_%05lu", base, index);
+    return;
+  }
+  snprintf(dest, size, "%.*s_%05lu%s", (int)(dot - base), base, index, dot);
+}
+
+int storage_mode_from_name(const char *name, enum storage_mode_t *mode) {
+  if (strcmp(name, "buffered") == 0) {
+    *mode = STORAGE_BUFFERED;
+  } else if (strcmp(name, "dropbehind") == 0) {
+    *mode = STORAGE_DROPBEHIND;
+  } else if (strcmp(name, "direct") == 0) {
+    *mode = STORAGE_DIRECT;
+  } else {
+    return -1;
+  }
+  return 0;
+}
+
+int segment_writer_init(struct segment_writer_t *writer, const char *base,
+                        off_t max_segment_bytes, off_t max_total_bytes,
+                        enum storage_mode_t mode) {
+  memset(writer, 0, sizeof(*writer));
+  writer->fd = -1;
+
+  if (strlen(base) + 8 >= sizeof(writer->base)) {
+    errno = ENAMETOOLONG;
+    return -1;
+  }
+  strcpy(writer->base, base);
+  writer->max_segment_bytes = max_segment_bytes;
+  writer->max_total_bytes = max_total_bytes;
+  writer->mode = mode;
+
+  if (mode == STORAGE_DIRECT) {
+    int status_code = posix_memalign((void **)&writer->staging,
+                                     STORAGE_DIRECT_ALIGN,
+                                     STORAGE_DIRECT_STAGING);
+
+    if (status_code != 0) {
+      writer->staging = NULL;
+      errno = status_code;
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Delete the oldest closed segment.
+ * @param writer Writer.
+ * @return 0 if a segment was deleted, -1 if only the open one is left.
+ */
+static int delete_oldest(struct segment_writer_t *writer) {
+  char path[STORAGE_PATH_LENGTH + 16];
+  unsigned int closed = writer->segment_count - (writer->fd >= 0 ? 1 : 0);
+
+  if (closed == 0) {
+    return -1;
+  }
+
+  numbered_path(path, sizeof(path), writer->base, writer->segments[0].index);
+  if (unlink(path) < 0 && errno != ENOENT) {
+    perror("unlink segment");
+  }
+  writer->total_bytes -= writer->segments[0].bytes;
+  memmove(&writer->segments[0], &writer->segments[1],
+          (writer->segment_count - 1) * sizeof(writer->segments[0]));
+  writer->segment_count--;
+  writer->deleted_segments++;
+
+  return 0;
+}
+
+/**
+ * @brief Write the first size bytes of the staging buffer at the flushed
+ * offset. On ENOSPC the oldest closed segments are deleted and the same
+ * block retried, since it is still intact in the staging buffer.
+ * @param writer Writer in direct mode.
+ * @param size Bytes to write, a multiple of STORAGE_DIRECT_ALIGN.
+ * @return 0 on success, -1 with errno set.
+ */
+static int flush_staging(struct segment_writer_t *writer, size_t size) {
+  size_t done = 0;
+
+  while (done < size) {
+    ssize_t written = pwrite(writer->fd, writer->staging + done, size - done,
+                             writer->flushed + (off_t)done);
+
+    if (written > 0) {
+      done += (size_t)written;
+      continue;
+    }
+    if (written == 0) {
+      errno = ENOSPC;
+    }
+    if (errno == EINTR) {
+      continue;
+    }
+    if (errno != ENOSPC || delete_oldest(writer) < 0) {
+      return -1;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Append a record to the staging buffer, writing the buffer out each
+ * time it fills.
+ * @param writer Writer in direct mode.
+ * @param data Record bytes.
+ * @param length Record length.
+ * @return 0 on success, -1 with errno set.
+ */
+static int stage_record(struct segment_writer_t *writer, const void *data,
+                        size_t length) {
+  const unsigned char *cursor = data;
+
+  while (length > 0) {
+    size_t chunk = STORAGE_DIRECT_STAGING - writer->staged;
+
+    if (chunk > length) {
+      chunk = length;
+    }
+    memcpy(writer->staging + writer->staged, cursor, chunk);
+    writer->staged += chunk;
+    cursor += chunk;
+    length -= chunk;
+
+    if (writer->staged == STORAGE_DIRECT_STAGING) {
+      if (flush_staging(writer, STORAGE_DIRECT_STAGING) < 0) {
+        return -1;
+      }
+      writer->flushed += STORAGE_DIRECT_STAGING;
+      writer->staged = 0;
+    }
+  }
+
+  return 0;
+}
+
+/**
+ * @brief Start writeback of the bytes written since the last window and,
+ * once a whole window is pending, wait for the previous one and drop it from
+ * the page cache. The wait is on a window whose writeback started a window
+ * earlier, so it rarely blocks.
+ * @param writer Writer in drop-behind mode.
+ * @param end Bytes written to the open segment.
+ * @return 0 on success, -1 with errno set.
+ */
+static int drop_behind(struct segment_writer_t *writer, off_t end) {
+  if (end - writer->synced < STORAGE_DROPBEHIND_WINDOW) {
+    return 0;
+  }
+
+  if (sync_file_range(writer->fd, writer->synced, end - writer->synced,
+                      SYNC_FILE_RANGE_WRITE) < 0) {
+    return -1;
+  }
+  if (writer->synced > writer->dropped) {
+    if (sync_file_range(writer->fd, writer->dropped,
+                        writer->synced - writer->dropped,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                            SYNC_FILE_RANGE_WAIT_AFTER) < 0) {
+      return -1;
+    }
+    posix_fadvise(writer->fd, writer->dropped,
+                  writer->synced - writer->dropped, POSIX_FADV_DONTNEED);
+    writer->dropped = writer->synced;
+  }
+  writer->synced = end;
+
+  return 0;
+}
+
+/**
+ * @brief Finish and close the open segment: write the staged tail in direct
+ * mode, flush and drop the cached pages in drop-behind mode.
+ * @param writer Writer.
+ * @return 0 on success, -1 with errno set. The segment is closed either way.
+ */
+static int close_segment(struct segment_writer_t *writer) {
+  int status_code = 0;
+  int error = 0;
+
+  if (writer->fd < 0) {
+    return 0;
+  }
+
+  if (writer->mode == STORAGE_DIRECT && writer->staged > 0) {
+    /* O_DIRECT only writes whole blocks: pad the tail, then cut the file
+     * back to the bytes actually recorded. */
+    size_t padded = (writer->staged + STORAGE_DIRECT_ALIGN - 1) &
+                    ~(size_t)(STORAGE_DIRECT_ALIGN - 1);
+
+    memset(writer->staging + writer->staged, 0, padded - writer->staged);
+    if (flush_staging(writer, padded) < 0 ||
+        ftruncate(writer->fd, writer->flushed + (off_t)writer->staged) < 0) {
+      status_code = -1;
+      error = errno;
+    }
+  } else if (writer->mode == STORAGE_DROPBEHIND) {
+    if (sync_file_range(writer->fd, writer->dropped, 0,
+                        SYNC_FILE_RANGE_WAIT_BEFORE | SYNC_FILE_RANGE_WRITE |
+                            SYNC_FILE_RANGE_WAIT_AFTER) < 0) {
+      status_code = -1;
+      error = errno;
+    }
+    posix_fadvise(writer->fd, writer->dropped, 0, POSIX_FADV_DONTNEED);
+  }
+
+  /* close() is where NFS and friends report deferred write errors. */
+  if (close(writer->fd) < 0 && status_code == 0) {
+    status_code = -1;
+    error = errno;
+  }
+  writer->fd = -1;
+
+  if (status_code < 0) {
+    errno = error;
+  }
+  return status_code;
+}
+
+/**
+ * @brief Close the open segment and start the next one.
+ * @param writer Writer.
+ * @return 0 on success, -1 with errno set.
+ */
+static int open_next_segment(struct segment_writer_t *writer) {
+  char path[STORAGE_PATH_LENGTH + 16];
+  int flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+
+  if (writer->mode == STORAGE_DIRECT) {
+    flags |= O_DIRECT;
+  }
+
+  if (close_segment(writer) < 0) {
+    return -1;
+  }
+
+  if (writer->segment_count == STORAGE_MAX_SEGMENTS &&
+      delete_oldest(writer) < 0) {
+    errno = EMFILE;
+    return -1;
+  }
+
+  numbered_path(path, sizeof(path), writer->base, writer->next_index);
+  writer->fd = open(path, flags, 0660);
+  if (writer->fd < 0 && writer->mode == STORAGE_DIRECT && errno == EINVAL) {
+    /* tmpfs and some FUSE file systems refuse O_DIRECT. */
+    fprintf(stderr, "O_DIRECT not supported for %s, writing drop-behind.\n",
+            path);
+    writer->mode = STORAGE_DROPBEHIND;
+    writer->fd = open(path, flags & ~O_DIRECT, 0660);
+  }
+  if (writer->fd < 0) {
+    return -1;
+  }
+  writer->staged = 0;
+  writer->flushed = 0;
+  writer->synced = 0;
+  writer->dropped = 0;
+
+  writer->segments[writer->segment_count].index = writer->next_index++;
+  writer->segments[writer->segment_count].bytes = 0;
+  writer->segment_count++;
+
+  return 0;
+}
+
+/**
+ * @brief Write a record through the page cache. On ENOSPC the partial record
+ * is cut off, the oldest closed segment deleted and the write retried.
+ * @param writer Writer in buffered or drop-behind mode.
+ * @param data Record bytes.
+ * @param length Record length.
+ * @return 0 on success, -1 with errno set.
+ */
+static int write_record(struct segment_writer_t *writer, const void *data,
+                        size_t length) {
+  off_t written = writer->segments[writer->segment_count - 1].bytes;
+
+  while (write_full(writer->fd, data, length) < 0) {
+    if (errno != ENOSPC) {
+      return -1;
+    }
+    if (ftruncate(writer->fd, written) < 0 ||
+        lseek(writer->fd, written, SEEK_SET) < 0 ||
+        delete_oldest(writer) < 0) {
+      errno = ENOSPC;
+      return -1;
+    }
+  }
+
+  if (writer->mode == STORAGE_DROPBEHIND) {
+    return drop_behind(writer, written + (off_t)length);
+  }
+  return 0;
+}
+
+/**
+ * @brief Fold one write duration into the latency figures.
+ * @param writer Writer.
+ * @param ns Duration in nanoseconds.
+ */
+static void account_write(struct segment_writer_t *writer,
+                          unsigned long long ns) {
+  writer->writes++;
+  writer->write_ns_total += ns;
+  if (ns > writer->write_ns_max) {
+    writer->write_ns_max = ns;
+  }
+  if (writer->writes == 1) {
+    writer->write_ns_avg = ns;
+  } else if (ns > writer->write_ns_avg) {
+    writer->write_ns_avg += (ns - writer->write_ns_avg) >> WRITE_AVG_SHIFT;
+  } else {
+    writer->write_ns_avg -= (writer->write_ns_avg - ns) >> WRITE_AVG_SHIFT;
+  }
+}
+
+int segment_writer_write(struct segment_writer_t *writer, const void *data,
+                         size_t length) {
+  struct storage_segment_t *current;
+  struct timespec start;
+  struct timespec end;
+  int status_code;
+
+  if (writer->fd < 0 ||
+      (writer->max_segment_bytes > 0 &&
+       writer->segments[writer->segment_count - 1].bytes > 0 &&
+       writer->segments[writer->segment_count - 1].bytes + (off_t)length >
+           writer->max_segment_bytes)) {
+    if (open_next_segment(writer) < 0) {
+      return -1;
+    }
+  }
+
+  /* Make room under the disk usage cap before writing. */
+  while (writer->max_total_bytes > 0 &&
+         writer->total_bytes + (off_t)length > writer->max_total_bytes &&
+         delete_oldest(writer) == 0) {
+  }
+
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  if (writer->mode == STORAGE_DIRECT) {
+    status_code = stage_record(writer, data, length);
+  } else {
+    status_code = write_record(writer, data, length);
+  }
+  clock_gettime(CLOCK_MONOTONIC, &end);
+  if (status_code < 0) {
+    return -1;
+  }
+
+  /* ENOSPC recovery may have shifted the table. */
+  current = &writer->segments[writer->segment_count - 1];
+  account_write(writer,
+                (unsigned long long)(end.tv_sec - start.tv_sec) * 1000000000ULL +
+                    (unsigned long long)(end.tv_nsec - start.tv_nsec));
+  current->bytes += (off_t)length;
+  writer->total_bytes += (off_t)length;
+
+  return 0;
+}
+
+int segment_writer_close(struct segment_writer_t *writer) {
+  int status_code = close_segment(writer);
+
+  free(writer->staging);
+  writer->staging = NULL;
+
+  return status_code;
+}
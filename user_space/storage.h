@@ -0,0 +1,183 @@
+/**
+ * @file storage.h
+ * @brief Checked file writes and a rotating segment writer that caps the
+ * disk space a recording may use.
+ */
+
+#ifndef STORAGE_H
+#define STORAGE_H
+
+#include <stddef.h>
+#include <sys/types.h>
+
+/**
+ * @brief Maximum number of segments tracked for rotation.
+ */
+#define STORAGE_MAX_SEGMENTS 1024
+
+/**
+ * @brief Length of a segment path.
+ */
+#define STORAGE_PATH_LENGTH 512
+
+/**
+ * @brief Alignment of O_DIRECT offsets, lengths and buffers. 4 KiB covers
+ * the logical block size of SD cards, eMMC and most USB disks.
+ */
+#define STORAGE_DIRECT_ALIGN 4096
+
+/**
+ * @brief Size of the aligned staging buffer records are gathered in before
+ * an O_DIRECT write.
+ */
+#define STORAGE_DIRECT_STAGING (1 << 20)
+
+/**
+ * @brief Window of the drop-behind mode: writeback of each window starts as
+ * soon as it is full, and its pages are dropped once the next one fills.
+ */
+#define STORAGE_DROPBEHIND_WINDOW (4 << 20)
+
+/**
+ * @brief How segments are written.
+ * @param STORAGE_BUFFERED Plain write() through the page cache.
+ * @param STORAGE_DROPBEHIND Buffered, but writeback is started early with
+ * sync_file_range() and written pages are dropped with POSIX_FADV_DONTNEED,
+ * so at most about two windows stay cached.
+ * @param STORAGE_DIRECT O_DIRECT writes from an aligned staging buffer,
+ * nothing is cached. Falls back to STORAGE_DROPBEHIND on file systems
+ * without O_DIRECT.
+ */
+enum storage_mode_t {
+  STORAGE_BUFFERED,
+  STORAGE_DROPBEHIND,
+  STORAGE_DIRECT,
+};
+
+/**
+ * @brief Write a whole buffer, continuing after partial writes and EINTR.
+ * @param fd Destination descriptor.
+ * @param data Bytes to write.
+ * @param length Number of bytes.
+ * @return 0 on success, -1 with errno set (e.g. ENOSPC, EIO).
+ */
+int write_full(int fd, const void *data, size_t length);
+
+/**
+ * @brief A closed or open segment on disk.
+ * @param index Segment number, part of the file name.
+ * @param bytes Size of the segment.
+ */
+struct storage_segment_t {
+  unsigned long index;
+  off_t bytes;
+};
+
+/**
+ * @brief Writes a stream of records into numbered segment files. A new
+ * segment starts once the current one reaches max_segment_bytes; the oldest
+ * segments are deleted to stay within max_total_bytes and to recover from
+ * ENOSPC.
+ * @param base Base path, segments are base_00000.ext, base_00001.ext, ...
+ * @param fd Descriptor of the open segment, -1 if none.
+ * @param max_segment_bytes Segment size limit, 0 for unlimited.
+ * @param max_total_bytes Disk usage limit over all segments, 0 for unlimited.
+ * @param total_bytes Bytes currently on disk over all tracked segments.
+ * @param segments Tracked segments, oldest first, the last one is open.
+ * @param segment_count Number of tracked segments.
+ * @param next_index Number of the next segment.
+ * @param writes Records written.
+ * @param write_ns_total Total time spent in write(), in nanoseconds.
+ * @param write_ns_max Slowest record write, in nanoseconds.
+ * @param write_ns_avg Exponentially weighted moving average of the record
+ * write time, in nanoseconds.
+ * @param deleted_segments Segments removed by rotation or ENOSPC recovery.
+ * @param mode Writing mode in effect.
+ * @param staging Aligned buffer of STORAGE_DIRECT_STAGING bytes, direct
+ * mode only.
+ * @param staged Bytes waiting in staging.
+ * @param flushed Bytes of the open segment already written to the file, a
+ * multiple of STORAGE_DIRECT_ALIGN in direct mode.
+ * @param synced End of the range whose writeback was started, drop-behind
+ * mode only.
+ * @param dropped End of the range already dropped from the page cache.
+ */
+struct segment_writer_t {
+  char base[STORAGE_PATH_LENGTH];
+  int fd;
+  off_t max_segment_bytes;
+  off_t max_total_bytes;
+  off_t total_bytes;
+  struct storage_segment_t segments[STORAGE_MAX_SEGMENTS];
+  unsigned int segment_count;
+  unsigned long next_index;
+  unsigned long writes;
+  unsigned long long write_ns_total;
+  unsigned long long write_ns_max;
+  unsigned long long write_ns_avg;
+  unsigned long deleted_segments;
+  enum storage_mode_t mode;
+  unsigned char *staging;
+  size_t staged;
+  off_t flushed;
+  off_t synced;
+  off_t dropped;
+};
+
+/**
+ * @brief Prepare a segment writer. No file is created until the first
+ * record.
+ * @param writer Writer to initialize.
+ * @param base Base path including the extension.
+ * @param max_segment_bytes Segment size limit, 0 for unlimited.
+ * @param max_total_bytes Disk usage limit, 0 for unlimited.
+ * @param mode Writing mode.
+ * @return 0 on success, -1 if the path is too long or the staging buffer
+ * could not be allocated.
+ */
+int segment_writer_init(struct segment_writer_t *writer, const char *base,
+                        off_t max_segment_bytes, off_t max_total_bytes,
+                        enum storage_mode_t mode);
+
+/**
+ * @brief Append one record, rotating segments as needed. On ENOSPC the
+ * oldest closed segments are deleted and the write retried.
+ * @param writer Writer.
+ * @param data Record bytes.
+ * @param length Record length.
+ * @return 0 on success, -1 with errno set when the record could not be
+ * stored.
+ */
+int segment_writer_write(struct segment_writer_t *writer, const void *data,
+                         size_t length);
+
+/**
+ * @brief Close the open segment and release the staging buffer. In direct
+ * mode the staged tail is written padded to the alignment and the file is
+ * truncated back to its real length.
+ * @param writer Writer.
+ * @return 0 on success, -1 with errno set if the tail could not be written.
+ */
+int segment_writer_close(struct segment_writer_t *writer);
+
+/**
+ * @brief Parse a writing mode name: buffered, dropbehind or direct.
+ * @param name Mode name.
+ * @param mode Destination of the mode.
+ * @return 0 on success, -1 for an unknown name.
+ */
+int storage_mode_from_name(const char *name, enum storage_mode_t *mode);
+
+/**
+ * @brief Build a numbered file name by inserting the number before the
+ * extension: frame.jpeg becomes frame_00000.jpeg, frame_00001.jpeg, ...
+ * @param dest Destination buffer.
+ * @param size Size of dest.
+ * @param base Base path.
+ * @param index Number to insert.
+ * @return None.
+ */
+void numbered_path(char *dest, size_t size, const char *base,
+                   unsigned long index);
+
+#endif /* STORAGE_H */
@@ -0,0 +1,65 @@
+/**
+ * @file sim_wrap.c
+ * @brief Link-time glue routing camera.c's system calls to the simulated
+ * device. The test binary is linked with -Wl,--wrap for each symbol below;
+ * anything that is not the simulated device passes through to libc.
+ */
+
+#include <fcntl.h>
+#include <stdarg.h>
+#include <sys/mman.h>
+#include <sys/types.h>
+
+#include "../sim/v4l2_sim.h"
+
+int __real_open(const char *path, int flags, ...);
+int __real_close(int fd);
+int __real_ioctl(int fd, unsigned long request, ...);
+void *__real_mmap(void *addr, size_t length, int prot, int flags, int fd,
+                  off_t offset);
+
+int __wrap_open(const char *path, int flags, ...) {
+  mode_t mode = 0;
+
+  if (v4l2_sim_owns_path(path)) {
+    return v4l2_sim_open(path, flags);
+  }
+
+  if (flags & O_CREAT) {
+    va_list args;
+
+    va_start(args, flags);
+    mode = va_arg(args, mode_t);
+    va_end(args);
+  }
+  return __real_open(path, flags, mode);
+}
+
+int __wrap_close(int fd) {
+  if (v4l2_sim_owns_fd(fd)) {
+    return v4l2_sim_close(fd);
+  }
+  return __real_close(fd);
+}
+
+int __wrap_ioctl(int fd, unsigned long request, ...) {
+  va_list args;
+  void *arg;
+
+  va_start(args, request);
+  arg = va_arg(args, void *);
+  va_end(args);
+
+  if (v4l2_sim_owns_fd(fd)) {
+    return v4l2_sim_ioctl(fd, request, arg);
+  }
+  return __real_ioctl(fd, request, arg);
+}
+
+void *__wrap_mmap(void *addr, size_t length, int prot, int flags, int fd,
+                  off_t offset) {
+  if (v4l2_sim_owns_fd(fd)) {
+    return v4l2_sim_mmap(fd, length, prot, flags, offset);
+  }
+  return __real_mmap(addr, length, prot, flags, fd, offset);
+}
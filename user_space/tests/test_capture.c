@@ -0,0 +1,3576 @@
+/**
+ * @file test_capture.c
+ * @brief Hardware-free tests of the capture lifecycle in camera.c, driven
+ * through the simulated V4L2 device with fault injection, plus throughput
+ * checks that fail the build on performance regressions.
+ * @note Fatal paths in camera.c exit the process, those cases run in a
+ * forked child and check the exit status.
+ */
+
+#include <errno.h>
+#include <fcntl.h>
+#include <math.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <dirent.h>
+#include <sys/ioctl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
+
+#include "../barcode.h"
+#include "../bracket.h"
+#include "../burst.h"
+#include "../camera.h"
+#include "../dmabuf.h"
+#include "../frame.h"
+#include "../graph.h"
+#include "../hdr.h"
+#include "../mapping.h"
+#include "../media_graph.h"
+#include "../mode_switch.h"
+#include "../raw_archive.h"
+#include "../recorder.h"
+#include "../rule.h"
+#include "../signature.h"
+#include "../sim/v4l2_sim.h"
+#include "../snapshot.h"
+#include "../stabilizer.h"
+#include "../stack.h"
+#include "../stage.h"
+#include "../storage.h"
+#include "../timelapse.h"
+#include "../tone_map.h"
+
+/**
+ * @brief Device path routed to the simulator.
+ */
+static const char SIM_DEV_PATH[] = "/dev/video0";
+
+/**
+ * @brief Media device path routed to the simulator when it offers requests.
+ */
+static const char SIM_MEDIA_PATH[] = "/dev/media0";
+
+/**
+ * @brief Scratch directory for saved frames.
+ */
+static char scratch_dir[] = "/tmp/camera-test-XXXXXX";
+
+/**
+ * @brief Multiplier applied to every throughput floor, from the
+ * CAMERA_TEST_PERF_SCALE environment variable. 0 skips the checks.
+ */
+static double perf_scale = 1.0;
+
+static int failures;
+
+#define CHECK(cond)                                                            \
+  do {                                                                         \
+    if (!(cond)) {                                                             \
+      fprintf(stderr, "%s:%d: %s: check failed: %s\n", __FILE__, __LINE__,    \
+              __func__, #cond);                                                \
+      failures++;                                                              \
+      return;                                                                  \
+    }                                                                          \
+  } while (0)
+
+/**
+ * @brief Seconds on the monotonic clock.
+ */
+static double now_seconds(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+/**
+ * @brief Open and configure the simulated device up to mapped buffers.
+ */
+static void setup_camera(struct camera_params_t *params, __u32 pixelformat,
+                         __u32 count) {
+  open_camera_device(params, SIM_DEV_PATH);
+  set_video_format(params, 1920, 1080, pixelformat);
+  request_buffer(params, count);
+  allocate_buffer(params);
+}
+
+static void teardown_camera(struct camera_params_t *params) {
+  free_buffers(params);
+  close_camera_device(params);
+}
+
+/**
+ * @brief Run a scenario in a child and return its exit status, or -1 if it
+ * did not exit normally.
+ */
+static int exit_status_of(void (*scenario)(void)) {
+  int status;
+  pid_t pid;
+
+  /* The child exits through exit(), don't let it flush our output twice. */
+  fflush(stdout);
+  pid = fork();
+  if (pid == 0) {
+    int null_fd = open("/dev/null", O_WRONLY);
+
+    dup2(null_fd, STDERR_FILENO);
+    scenario();
+    _exit(0);
+  }
+  if (pid < 0 || waitpid(pid, &status, 0) < 0 || !WIFEXITED(status)) {
+    return -1;
+  }
+  return WEXITSTATUS(status);
+}
+
+static void test_lifecycle(void) {
+  struct camera_params_t params;
+  struct v4l2_sim_stats_t stats;
+  char path[64];
+  struct stat st;
+  unsigned char head[2];
+  int fd;
+  int i;
+
+  v4l2_sim_reset(NULL);
+  setup_camera(&params, V4L2_PIX_FMT_MJPEG, CAMERA_DEFAULT_BUFFERS);
+  CHECK(params.buffer_request.count == CAMERA_DEFAULT_BUFFERS);
+
+  activate_streaming(&params);
+  for (i = 0; i < 10; i++) {
+    get_frame(&params);
+    CHECK(params.buffer.sequence == (__u32)i);
+    CHECK(params.buffer_start == params.buffers[params.buffer.index].start);
+    if (i < 9) {
+      release_frame(&params);
+    }
+  }
+  deactivate_streaming(&params);
+
+  snprintf(path, sizeof(path), "%s/lifecycle.jpeg", scratch_dir);
+  save_to_image(&params, path);
+  teardown_camera(&params);
+
+  v4l2_sim_get_stats(&stats);
+  CHECK(stats.calls[V4L2_SIM_OP_MMAP] == CAMERA_DEFAULT_BUFFERS);
+  CHECK(stats.frames == 10);
+  CHECK(params.frames == 10);
+  CHECK(params.dropped_frames == 0);
+  CHECK(params.errored_frames == 0);
+
+  /* Only bytesused is written, and it is a JPEG. */
+  CHECK(stat(path, &st) == 0);
+  CHECK((size_t)st.st_size == params.buffer.bytesused);
+  fd = open(path, O_RDONLY);
+  CHECK(fd >= 0);
+  CHECK(read(fd, head, sizeof(head)) == sizeof(head));
+  close(fd);
+  CHECK(head[0] == 0xff && head[1] == 0xd8);
+}
+
+static void test_dqbuf_eagain(void) {
+  struct camera_params_t params;
+  struct v4l2_sim_stats_t stats;
+
+  v4l2_sim_reset(NULL);
+  v4l2_sim_fail(V4L2_SIM_OP_DQBUF, 0, 3, EAGAIN);
+  setup_camera(&params, V4L2_PIX_FMT_MJPEG, 2);
+  activate_streaming(&params);
+  get_frame(&params);
+  deactivate_streaming(&params);
+  teardown_camera(&params);
+
+  v4l2_sim_get_stats(&stats);
+  CHECK(stats.calls[V4L2_SIM_OP_DQBUF] == 4);
+  CHECK(params.frames == 1);
+  CHECK(params.errored_frames == 0);
+}
+
+static void test_dqbuf_eio_recovers(void) {
+  struct camera_params_t params;
+
+  v4l2_sim_reset(NULL);
+  v4l2_sim_fail(V4L2_SIM_OP_DQBUF, 1, 2, EIO);
+  setup_camera(&params, V4L2_PIX_FMT_MJPEG, 2);
+  activate_streaming(&params);
+  get_frame(&params);
+  release_frame(&params);
+  get_frame(&params);
+  deactivate_streaming(&params);
+  teardown_camera(&params);
+
+  CHECK(params.frames == 2);
+  CHECK(params.errored_frames == 2);
+}
+
+static void scenario_dqbuf_eio_persistent(void) {
+  struct camera_params_t params;
+
+  v4l2_sim_reset(NULL);
+  v4l2_sim_fail(V4L2_SIM_OP_DQBUF, 0, CAMERA_MAX_RETRIES + 1, EIO);
+  setup_camera(&params, V4L2_PIX_FMT_MJPEG, 2);
+  activate_streaming(&params);
+  get_frame(&params);
+}
+
+static void test_dqbuf_eio_persistent(void) {
+  CHECK(exit_status_of(scenario_dqbuf_eio_persistent) == 1);
+}
+
+static void test_short_payload(void) {
+  struct camera_params_t params;
+  char path[64];
+  struct stat st;
+
+  v4l2_sim_reset(NULL);
+  /* An empty buffer is skipped, a short one is saved as reported. */
+  v4l2_sim_frame_fault(0, V4L2_SIM_FRAME_SHORT, 0);
+  v4l2_sim_frame_fault(1, V4L2_SIM_FRAME_SHORT, 1000);
+  setup_camera(&params, V4L2_PIX_FMT_MJPEG, 2);
+  activate_streaming(&params);
+  get_frame(&params);
+  CHECK(params.errored_frames == 1);
+  CHECK(params.buffer.bytesused == 1000);
+
+  snprintf(path, sizeof(path), "%s/short.jpeg", scratch_dir);
+  save_to_image(&params, path);
+  deactivate_streaming(&params);
+  teardown_camera(&params);
+
+  CHECK(stat(path, &st) == 0);
+  CHECK(st.st_size == 1000);
+}
+
+static void test_error_flag(void) {
+  struct camera_params_t params;
+
+  v4l2_sim_reset(NULL);
+  v4l2_sim_frame_fault(0, V4L2_SIM_FRAME_ERROR, 0);
+  setup_camera(&params, V4L2_PIX_FMT_MJPEG, 2);
+  activate_streaming(&params);
+  get_frame(&params);
+  CHECK(params.buffer.sequence == 1);
+  CHECK(params.errored_frames == 1);
+  deactivate_streaming(&params);
+  teardown_camera(&params);
+}
+
+static void test_sequence_gap(void) {
+  struct camera_params_t params;
+  int i;
+
+  v4l2_sim_reset(NULL);
+  v4l2_sim_frame_fault(3, V4L2_SIM_FRAME_SEQ_GAP, 5);
+  setup_camera(&params, V4L2_PIX_FMT_MJPEG, 3);
+  activate_streaming(&params);
+  for (i = 0; i < 6; i++) {
+    get_frame(&params);
+    release_frame(&params);
+  }
+  deactivate_streaming(&params);
+  teardown_camera(&params);
+
+  CHECK(params.frames == 6);
+  CHECK(params.dropped_frames == 5);
+}
+
+static void test_restream_and_realloc(void) {
+  struct camera_params_t params;
+
+  v4l2_sim_reset(NULL);
+  setup_camera(&params, V4L2_PIX_FMT_MJPEG, 2);
+  activate_streaming(&params);
+  get_frame(&params);
+  deactivate_streaming(&params);
+
+  /* STREAMOFF returned every buffer, so streaming can restart. */
+  activate_streaming(&params);
+  get_frame(&params);
+  CHECK(params.buffer.sequence == 0);
+  deactivate_streaming(&params);
+
+  /* Buffers can be released and the format changed. */
+  free_buffers(&params);
+  set_video_format(&params, 640, 480, V4L2_PIX_FMT_YUYV);
+  request_buffer(&params, 3);
+  allocate_buffer(&params);
+  CHECK(params.buffers[0].length == 640 * 480 * 2);
+  activate_streaming(&params);
+  get_frame(&params);
+  CHECK(params.buffer.bytesused == 640 * 480 * 2);
+  deactivate_streaming(&params);
+  teardown_camera(&params);
+}
+
+static void scenario_open_enoent(void) {
+  struct camera_params_t params;
+
+  v4l2_sim_reset(NULL);
+  v4l2_sim_fail(V4L2_SIM_OP_OPEN, 0, 1, ENOENT);
+  open_camera_device(&params, SIM_DEV_PATH);
+}
+
+static void scenario_s_fmt_einval(void) {
+  struct camera_params_t params;
+
+  v4l2_sim_reset(NULL);
+  open_camera_device(&params, SIM_DEV_PATH);
+  set_video_format(&params, 1920, 1080, V4L2_PIX_FMT_SRGGB10);
+}
+
+static void scenario_mmap_enomem(void) {
+  struct camera_params_t params;
+
+  v4l2_sim_reset(NULL);
+  v4l2_sim_fail(V4L2_SIM_OP_MMAP, 1, 1, ENOMEM);
+  setup_camera(&params, V4L2_PIX_FMT_MJPEG, 2);
+}
+
+static void scenario_streamon_eio(void) {
+  struct camera_params_t params;
+
+  v4l2_sim_reset(NULL);
+  v4l2_sim_fail(V4L2_SIM_OP_STREAMON, 0, 1, EIO);
+  setup_camera(&params, V4L2_PIX_FMT_MJPEG, 2);
+  activate_streaming(&params);
+}
+
+static void test_fatal_errors(void) {
+  CHECK(exit_status_of(scenario_open_enoent) == 1);
+  CHECK(exit_status_of(scenario_s_fmt_einval) == 1);
+  CHECK(exit_status_of(scenario_mmap_enomem) == 1);
+  CHECK(exit_status_of(scenario_streamon_eio) == 1);
+}
+
+static void test_reqbufs_fewer_granted(void) {
+  struct v4l2_sim_config_t config = {.max_buffers = 2};
+  struct camera_params_t params;
+
+  v4l2_sim_reset(&config);
+  setup_camera(&params, V4L2_PIX_FMT_MJPEG, 8);
+  CHECK(params.buffer_request.count == 2);
+  teardown_camera(&params);
+}
+
+static void test_paced_device(void) {
+  struct v4l2_sim_config_t config = {.fps = 200, .jitter_us = 500};
+  struct camera_params_t params;
+  struct timespec hold = {.tv_sec = 0, .tv_nsec = 50 * 1000000};
+  double start;
+  double elapsed;
+  int i;
+
+  v4l2_sim_reset(&config);
+  setup_camera(&params, V4L2_PIX_FMT_MJPEG, 2);
+  activate_streaming(&params);
+
+  /* 20 frames at 200 fps arrive over about 100 ms. */
+  start = now_seconds();
+  for (i = 0; i < 20; i++) {
+    get_frame(&params);
+    release_frame(&params);
+  }
+  elapsed = now_seconds() - start;
+  CHECK(elapsed > 0.08 && elapsed < 0.5);
+  CHECK(params.dropped_frames == 0);
+
+  /* Holding both buffers makes the sensor drop frames. */
+  get_frame(&params);
+  get_frame(&params);
+  nanosleep(&hold, NULL);
+  release_frame(&params);
+  get_frame(&params);
+  CHECK(params.dropped_frames > 0);
+
+  deactivate_streaming(&params);
+  teardown_camera(&params);
+}
+
+static void test_timelapse(void) {
+  struct v4l2_sim_config_t config = {.fps = 100};
+  struct timelapse_config_t continuous = {.interval_ms = 50, .shots = 4};
+  struct timelapse_config_t idle = {
+      .interval_ms = 60, .shots = 3, .idle_threshold_ms = 20};
+  struct timelapse_stats_t stats;
+  struct camera_params_t params;
+  char base[64];
+  char path[96];
+  struct stat st;
+
+  v4l2_sim_reset(&config);
+  setup_camera(&params, V4L2_PIX_FMT_MJPEG, 3);
+  snprintf(base, sizeof(base), "%s/tl.jpeg", scratch_dir);
+  continuous.output_path = base;
+  idle.output_path = base;
+
+  CHECK(run_timelapse(&params, &continuous, &stats) == 0);
+  CHECK(stats.shots == 4);
+  CHECK(stats.stream_restarts == 0);
+  /* Generous bounds, CI machines are noisy; typical values are tens of us. */
+  CHECK(stats.max_wake_latency_us < 5000);
+  CHECK(stats.max_frame_offset_us <= 10000 + 5000);
+  numbered_path(path, sizeof(path), base, 3);
+  CHECK(stat(path, &st) == 0);
+  CHECK(strstr(path, "tl_00003.jpeg") != NULL);
+
+  /* Above the idle threshold the stream restarts for every shot. */
+  CHECK(run_timelapse(&params, &idle, &stats) == 0);
+  CHECK(stats.shots == 3);
+  CHECK(stats.stream_restarts == 3);
+  CHECK(stats.max_start_latency_us > 0);
+
+  teardown_camera(&params);
+}
+
+static void test_write_full(void) {
+  char path[64];
+  char data[100000];
+  struct stat st;
+  int fd;
+
+  memset(data, 0x5a, sizeof(data));
+  snprintf(path, sizeof(path), "%s/write_full.bin", scratch_dir);
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  CHECK(fd >= 0);
+  CHECK(write_full(fd, data, sizeof(data)) == 0);
+  close(fd);
+  CHECK(stat(path, &st) == 0 && st.st_size == sizeof(data));
+
+  /* Errors surface instead of being ignored. */
+  fd = open(path, O_RDONLY);
+  CHECK(write_full(fd, data, sizeof(data)) < 0 && errno == EBADF);
+  close(fd);
+}
+
+/**
+ * @brief Records of odd lengths written in every mode read back byte for
+ * byte, including the unaligned tail of each O_DIRECT segment.
+ */
+static void test_segment_writer_modes(void) {
+  static const enum storage_mode_t modes[] = {
+      STORAGE_BUFFERED, STORAGE_DROPBEHIND, STORAGE_DIRECT};
+  static unsigned char record[100003];
+  static unsigned char readback[sizeof(record)];
+  struct segment_writer_t *writer = malloc(sizeof(*writer));
+  char base[64];
+  char path[96];
+  size_t m;
+
+  CHECK(writer != NULL);
+  for (m = 0; m < sizeof(modes) / sizeof(modes[0]); m++) {
+    unsigned long index;
+    unsigned int r;
+    int fd = -1;
+    size_t offset = 0;
+
+    snprintf(base, sizeof(base), "%s/mode%zu.bin", scratch_dir, m);
+    CHECK(segment_writer_init(writer, base, 2500000, 0, modes[m]) == 0);
+    for (r = 0; r < 60; r++) {
+      memset(record, (int)r, sizeof(record));
+      record[0] = 0xff;
+      CHECK(segment_writer_write(writer, record, sizeof(record)) == 0);
+    }
+    CHECK(segment_writer_close(writer) == 0);
+    CHECK(writer->total_bytes == 60 * (off_t)sizeof(record));
+
+    /* Read the segments back as one stream, record by record. */
+    index = 0;
+    for (r = 0; r < 60; r++) {
+      size_t got = 0;
+
+      while (got < sizeof(readback)) {
+        ssize_t n = fd < 0 ? 0
+                           : read(fd, readback + got, sizeof(readback) - got);
+
+        if (n <= 0) {
+          if (fd >= 0) {
+            close(fd);
+          }
+          numbered_path(path, sizeof(path), base, index++);
+          fd = open(path, O_RDONLY);
+          CHECK(fd >= 0);
+          continue;
+        }
+        got += (size_t)n;
+      }
+      CHECK(readback[0] == 0xff && readback[1] == r &&
+            readback[sizeof(readback) - 1] == r);
+      offset += got;
+    }
+    CHECK(read(fd, readback, 1) == 0);
+    close(fd);
+    CHECK(offset == 60 * sizeof(record));
+  }
+  free(writer);
+}
+
+/**
+ * @brief Fill a 16-bit Bayer frame with smooth, slightly noisy content, and
+ * the bottom rows with pure noise that no predictor can shrink.
+ */
+static void fill_bayer(uint16_t *samples, __u32 width, __u32 height,
+                       __u32 noisy_rows) {
+  uint32_t noise = 12345;
+  __u32 x;
+  __u32 y;
+
+  for (y = 0; y < height; y++) {
+    for (x = 0; x < width; x++) {
+      noise = noise * 1664525u + 1013904223u;
+      samples[(size_t)y * width + x] =
+          (uint16_t)(y >= height - noisy_rows
+                         ? noise >> 22
+                         : 100 + x * 500 / width + y * 300 / height +
+                               (x & 1) * 40 + (noise >> 29));
+    }
+  }
+}
+
+static void test_raw_archive_roundtrip(void) {
+  const __u32 width = 640;
+  const __u32 height = 480;
+  uint16_t *samples = malloc((size_t)width * height * sizeof(uint16_t));
+  uint8_t *packed = malloc((size_t)width / 4 * 5 * height);
+  struct raw_archive_t archive;
+  struct raw_archive_reader_t reader;
+  struct raw_frame_t frame = {.width = width,
+                              .height = height,
+                              .pixelformat = V4L2_PIX_FMT_SBGGR10,
+                              .bytesperline = width * 2,
+                              .sequence = 7,
+                              .timestamp_us = 123456789};
+  const void *record;
+  size_t length;
+  size_t i;
+  char path[64];
+  int fd;
+
+  CHECK(samples != NULL && packed != NULL);
+  fill_bayer(samples, width, height, 64);
+  frame.data = samples;
+  snprintf(path, sizeof(path), "%s/frames.craw", scratch_dir);
+  fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  CHECK(fd >= 0);
+  CHECK(raw_archive_init(&archive, 3) == 0);
+
+  /* 16-bit input; the noisy stripe falls back to packing. */
+  CHECK(raw_archive_encode(&archive, &frame, &record, &length) == 0);
+  CHECK(length < (size_t)width * height * 2 / 2);
+  CHECK(write_full(fd, record, length) == 0);
+
+  /* The same frame from the MIPI packed layout gives the same record. */
+  for (i = 0; i < (size_t)width * height; i += 4) {
+    uint8_t *group = packed + i / 4 * 5;
+
+    group[0] = (uint8_t)(samples[i] >> 2);
+    group[1] = (uint8_t)(samples[i + 1] >> 2);
+    group[2] = (uint8_t)(samples[i + 2] >> 2);
+    group[3] = (uint8_t)(samples[i + 3] >> 2);
+    group[4] = (uint8_t)((samples[i] & 3) | (samples[i + 1] & 3) << 2 |
+                         (samples[i + 2] & 3) << 4 | (samples[i + 3] & 3) << 6);
+  }
+  frame.pixelformat = V4L2_PIX_FMT_SBGGR10P;
+  frame.bytesperline = width / 4 * 5;
+  frame.data = packed;
+  frame.sequence = 8;
+  CHECK(raw_archive_encode(&archive, &frame, &record, &length) == 0);
+  CHECK(write_full(fd, record, length) == 0);
+  close(fd);
+  raw_archive_destroy(&archive);
+
+  CHECK(raw_archive_reader_open(&reader, path) == 0);
+  for (i = 0; i < 2; i++) {
+    CHECK(raw_archive_read(&reader, &frame) == 1);
+    CHECK(frame.width == width && frame.height == height);
+    CHECK(frame.pixelformat == V4L2_PIX_FMT_SBGGR10);
+    CHECK(frame.sequence == 7 + i && frame.timestamp_us == 123456789);
+    CHECK(memcmp(frame.data, samples, (size_t)width * height * 2) == 0);
+  }
+  CHECK(raw_archive_read(&reader, &frame) == 0);
+  raw_archive_reader_close(&reader);
+
+  /* A damaged record is reported, not decoded into garbage. */
+  fd = open(path, O_WRONLY);
+  CHECK(fd >= 0 && pwrite(fd, "\xff\xff\xff\xff", 4, 200) == 4);
+  close(fd);
+  CHECK(raw_archive_reader_open(&reader, path) == 0);
+  CHECK(raw_archive_read(&reader, &frame) < 0 && errno == EBADMSG);
+  raw_archive_reader_close(&reader);
+
+  free(samples);
+  free(packed);
+}
+
+static void test_recorder_raw(void) {
+  struct v4l2_sim_config_t config = {.fps = 60};
+  struct recorder_config_t record = {.duration_ms = 200};
+  struct recorder_stats_t stats;
+  struct camera_params_t params;
+  struct raw_archive_t archive;
+  struct raw_archive_reader_t reader;
+  struct raw_frame_t frame;
+  char base[64];
+  char path[96];
+  unsigned long frames = 0;
+  __u32 last_sequence = 0;
+  int status_code;
+
+  v4l2_sim_reset(&config);
+  open_camera_device(&params, SIM_DEV_PATH);
+  set_video_format(&params, 640, 480, V4L2_PIX_FMT_SBGGR10P);
+  request_buffer(&params, CAMERA_DEFAULT_BUFFERS);
+  allocate_buffer(&params);
+  snprintf(base, sizeof(base), "%s/raw.craw", scratch_dir);
+  record.output_path = base;
+  CHECK(raw_archive_init(&archive, 2) == 0);
+  record.archive = &archive;
+
+  CHECK(run_recorder(&params, &record, &stats) == 0);
+  teardown_camera(&params);
+  CHECK(stats.frames_written > 0 && archive.frames == stats.frames_written);
+  /* Packed 10-bit is 62.5% of 16-bit; the codec has to beat it clearly. */
+  CHECK(archive.encoded_bytes * 2 < archive.raw_bytes);
+  raw_archive_destroy(&archive);
+
+  numbered_path(path, sizeof(path), base, 0);
+  CHECK(raw_archive_reader_open(&reader, path) == 0);
+  while ((status_code = raw_archive_read(&reader, &frame)) == 1) {
+    CHECK(frame.width == 640 && frame.height == 480);
+    CHECK(frames == 0 || frame.sequence > last_sequence);
+    last_sequence = frame.sequence;
+    frames++;
+  }
+  raw_archive_reader_close(&reader);
+  CHECK(status_code == 0);
+  CHECK(frames == stats.frames_written);
+}
+
+static void test_recorder_oversized(void) {
+  struct v4l2_sim_config_t config = {.fps = 100};
+  struct recorder_config_t record = {.duration_ms = 100};
+  struct recorder_stats_t stats;
+  struct camera_params_t params;
+  char base[64];
+  char path[96];
+  struct stat st;
+
+  /* Buffers mapped and filled past sizeimage are cut to the slots. */
+  v4l2_sim_reset(&config);
+  open_camera_device(&params, SIM_DEV_PATH);
+  set_video_format(&params, 640, 480, V4L2_PIX_FMT_YUYV);
+  request_buffer(&params, CAMERA_DEFAULT_BUFFERS);
+  allocate_buffer(&params);
+  params.capture_format.fmt.pix.sizeimage = 640 * 480;
+  snprintf(base, sizeof(base), "%s/oversized.yuv", scratch_dir);
+  record.output_path = base;
+
+  CHECK(run_recorder(&params, &record, &stats) == 0);
+  teardown_camera(&params);
+  CHECK(stats.frames_written > 0);
+  numbered_path(path, sizeof(path), base, 0);
+  CHECK(stat(path, &st) == 0 &&
+        st.st_size == (off_t)stats.frames_written * 640 * 480);
+}
+
+/**
+ * @brief Fill a 640x480 GREY frame with a gradient and a little noise, and
+ * a bright square when square is set.
+ */
+static void fill_scene(uint8_t *luma, uint32_t seed, int square) {
+  __u32 x;
+  __u32 y;
+
+  for (y = 0; y < 480; y++) {
+    for (x = 0; x < 640; x++) {
+      seed = seed * 1664525u + 1013904223u;
+      luma[y * 640 + x] =
+          (uint8_t)(square && x >= 200 && x < 280 && y >= 160 && y < 240
+                        ? 240
+                        : 40 + x * 150 / 640 + (seed >> 30));
+    }
+  }
+}
+
+static void test_frame_signature(void) {
+  struct v4l2_pix_format format = {.width = 640, .height = 480};
+  struct frame_signature_t reference;
+  struct frame_signature_t signature;
+  struct frame_signature_t frames[5];
+  struct camera_params_t params;
+  uint8_t *luma = malloc(640 * 480);
+  uint8_t *yuyv = malloc(640 * 480 * 2);
+  uint16_t *bayer = malloc(640 * 480 * 2);
+  size_t i;
+  int n;
+
+  CHECK(luma != NULL && yuyv != NULL && bayer != NULL);
+
+  /* Sensor noise stays far below a scene change, in every layout. */
+  format.pixelformat = V4L2_PIX_FMT_GREY;
+  fill_scene(luma, 1, 0);
+  CHECK(frame_signature_compute(&format, luma, 640 * 480, &reference) == 0);
+  fill_scene(luma, 2, 0);
+  CHECK(frame_signature_compute(&format, luma, 640 * 480, &signature) == 0);
+  CHECK(frame_signature_distance(&reference, &signature) <= 2);
+  fill_scene(luma, 2, 1);
+  CHECK(frame_signature_compute(&format, luma, 640 * 480, &signature) == 0);
+  CHECK(frame_signature_distance(&reference, &signature) > 100);
+
+  format.pixelformat = V4L2_PIX_FMT_YUYV;
+  for (i = 0; i < 640 * 480; i++) {
+    yuyv[2 * i] = luma[i];
+    yuyv[2 * i + 1] = 128;
+  }
+  CHECK(frame_signature_compute(&format, yuyv, 640 * 480 * 2, &reference) ==
+        0);
+  CHECK(frame_signature_distance(&reference, &signature) == 0);
+
+  format.pixelformat = V4L2_PIX_FMT_SBGGR10;
+  format.bytesperline = 640 * 2;
+  fill_bayer(bayer, 640, 480, 0);
+  CHECK(frame_signature_compute(&format, bayer, 640 * 480 * 2, &reference) ==
+        0);
+  for (i = 0; i < 640 * 480; i++) {
+    if (i % 640 >= 320 && i / 640 >= 320) {
+      bayer[i] = 1000;
+    }
+  }
+  CHECK(frame_signature_compute(&format, bayer, 640 * 480 * 2, &signature) ==
+        0);
+  CHECK(frame_signature_distance(&reference, &signature) > 100);
+  CHECK(frame_signature_compute(&format, bayer, 1000, &signature) < 0);
+  format.pixelformat = V4L2_PIX_FMT_RGB24;
+  CHECK(frame_signature_compute(&format, bayer, 640 * 480 * 2, &signature) <
+        0);
+  free(luma);
+  free(yuyv);
+  free(bayer);
+
+  /* MJPEG through the DC coefficients: still until the scene changes. */
+  v4l2_sim_reset(NULL);
+  CHECK(v4l2_sim_frame_fault(3, V4L2_SIM_FRAME_SCENE, 2) == 0);
+  setup_camera(&params, V4L2_PIX_FMT_MJPEG, CAMERA_DEFAULT_BUFFERS);
+  activate_streaming(&params);
+  for (n = 0; n < 5; n++) {
+    get_frame(&params);
+    CHECK(frame_signature_compute(&params.capture_format.fmt.pix,
+                                  params.buffer_start, params.buffer.bytesused,
+                                  &frames[n]) == 0);
+    if (n == 4) {
+      /* Cut inside the entropy coded data. */
+      CHECK(frame_signature_compute(&params.capture_format.fmt.pix,
+                                    params.buffer_start, 2000,
+                                    &signature) < 0);
+    }
+    release_frame(&params);
+  }
+  deactivate_streaming(&params);
+  teardown_camera(&params);
+  CHECK(frame_signature_distance(&frames[0], &frames[2]) == 0);
+  CHECK(frame_signature_distance(&frames[2], &frames[3]) > 100);
+  CHECK(frame_signature_distance(&frames[3], &frames[4]) == 0);
+}
+
+static void test_recorder_dedup(void) {
+  struct v4l2_sim_config_t config = {.fps = 100};
+  struct recorder_config_t record = {
+      .duration_ms = 400, .dedup_threshold = 4, .keepalive_ms = 150};
+  struct recorder_stats_t stats;
+  struct camera_params_t params;
+  struct snapshot_cache_t cache;
+  char base[64];
+
+  /* A still scene, something enters the view at frame 10 and moves at 20. */
+  v4l2_sim_reset(&config);
+  CHECK(v4l2_sim_frame_fault(10, V4L2_SIM_FRAME_SCENE, 1) == 0);
+  CHECK(v4l2_sim_frame_fault(20, V4L2_SIM_FRAME_SCENE, 3) == 0);
+  open_camera_device(&params, SIM_DEV_PATH);
+  set_video_format(&params, 640, 480, V4L2_PIX_FMT_MJPEG);
+  request_buffer(&params, CAMERA_DEFAULT_BUFFERS);
+  allocate_buffer(&params);
+  snprintf(base, sizeof(base), "%s/dedup.mjpeg", scratch_dir);
+  record.output_path = base;
+  snapshot_cache_init(&cache, &params);
+  record.snapshot = &cache;
+
+  CHECK(run_recorder(&params, &record, &stats) == 0);
+  teardown_camera(&params);
+  /* Skipped frames still reach the latest-frame cache. */
+  CHECK(cache.published == stats.frames_captured);
+
+  CHECK(stats.frames_captured >= 30);
+  CHECK(stats.frames_written + stats.frames_throttled + stats.frames_dropped +
+            stats.frames_deduplicated ==
+        stats.frames_captured);
+  /* The first frame, both changes and at least one keep-alive. */
+  CHECK(stats.frames_written >= 4);
+  CHECK(stats.frames_written * 4 < stats.frames_captured);
+  CHECK(stats.signature_us_avg < stats.write_us_avg + 1000);
+}
+
+/**
+ * @brief Sequence number the simulator stamped into an MJPEG frame.
+ */
+static __u32 stamped_sequence(const void *data) {
+  __u32 sequence;
+
+  memcpy(&sequence, (const uint8_t *)data + 6, sizeof(sequence));
+  return sequence;
+}
+
+static void test_snapshot_cache(void) {
+  struct snapshot_cache_t cache;
+  struct snapshot_frame_t held;
+  struct snapshot_frame_t frame;
+  struct camera_params_t params;
+  char path[96];
+  struct stat st;
+  int requeued = 0;
+  int i;
+
+  v4l2_sim_reset(NULL);
+  setup_camera(&params, V4L2_PIX_FMT_MJPEG, CAMERA_DEFAULT_BUFFERS);
+  snapshot_cache_init(&cache, &params);
+  CHECK(snapshot_acquire(&cache, &frame) < 0 && errno == EAGAIN);
+
+  activate_streaming(&params);
+  get_frame(&params);
+  snapshot_publish(&cache);
+  CHECK(snapshot_acquire(&cache, &held) == 0);
+  CHECK(held.sequence == 0 && held.data == params.buffers[held.index].start);
+
+  /* A held buffer stays out of the driver queue and keeps its content while
+   * the others go on streaming. */
+  for (i = 1; i < 20; i++) {
+    get_frame(&params);
+    CHECK(params.buffer.index != held.index);
+    snapshot_publish(&cache);
+  }
+  CHECK(stamped_sequence(held.data) == 0);
+  CHECK(cache.deferred_requeues == 19);
+  snapshot_release(&cache, &held);
+  CHECK(snapshot_acquire(&cache, &frame) == 0 && frame.sequence == 19);
+  CHECK(stamped_sequence(frame.data) == 19);
+  snapshot_release(&cache, &frame);
+
+  /* Once released it goes back into rotation. */
+  for (i = 20; i < 30; i++) {
+    get_frame(&params);
+    requeued |= params.buffer.index == held.index;
+    snapshot_publish(&cache);
+  }
+  CHECK(requeued);
+
+  snprintf(path, sizeof(path), "%s/live.jpeg", scratch_dir);
+  CHECK(snapshot_save(&cache, path) == 0);
+  CHECK(stat(path, &st) == 0);
+  CHECK((size_t)st.st_size == params.buffer.bytesused);
+
+  snapshot_cache_close(&cache);
+  CHECK(snapshot_acquire(&cache, &frame) < 0);
+  CHECK(snapshot_save(&cache, path) < 0 && errno == EAGAIN);
+  deactivate_streaming(&params);
+  teardown_camera(&params);
+  CHECK(cache.published == 30);
+}
+
+/**
+ * @brief Snapshot reader thread: borrow frames as fast as possible and
+ * count those whose payload changed under them.
+ */
+struct snapshot_reader_t {
+  struct snapshot_cache_t *cache;
+  atomic_int stop;
+  unsigned long reads;
+  unsigned long torn;
+};
+
+static void *snapshot_reader_main(void *arg) {
+  const struct timespec hold = {.tv_nsec = 200000};
+  struct snapshot_reader_t *reader = arg;
+  struct snapshot_frame_t frame;
+
+  while (!atomic_load(&reader->stop)) {
+    if (snapshot_acquire(reader->cache, &frame) < 0) {
+      continue;
+    }
+    /* Now and then hold on across several frames. */
+    if ((reader->reads & 31) == 0) {
+      nanosleep(&hold, NULL);
+    }
+    if (stamped_sequence(frame.data) != frame.sequence) {
+      reader->torn++;
+    }
+    snapshot_release(reader->cache, &frame);
+    reader->reads++;
+  }
+  return NULL;
+}
+
+static void test_snapshot_concurrent(void) {
+  const int frames = 20000;
+  struct snapshot_reader_t reader = {0};
+  struct snapshot_cache_t cache;
+  struct camera_params_t params;
+  pthread_t thread;
+  int i;
+
+  v4l2_sim_reset(NULL);
+  setup_camera(&params, V4L2_PIX_FMT_MJPEG, CAMERA_DEFAULT_BUFFERS);
+  snapshot_cache_init(&cache, &params);
+  reader.cache = &cache;
+  atomic_init(&reader.stop, 0);
+  CHECK(pthread_create(&thread, NULL, snapshot_reader_main, &reader) == 0);
+
+  activate_streaming(&params);
+  for (i = 0; i < frames; i++) {
+    get_frame(&params);
+    snapshot_publish(&cache);
+  }
+  atomic_store(&reader.stop, 1);
+  pthread_join(thread, NULL);
+  snapshot_cache_close(&cache);
+  deactivate_streaming(&params);
+  teardown_camera(&params);
+
+  CHECK(reader.reads > 0);
+  CHECK(reader.torn == 0);
+  CHECK(cache.published == (unsigned long)frames);
+  CHECK(params.frames == (unsigned long)frames);
+}
+
+static void test_burst(void) {
+  struct v4l2_sim_config_t config = {.fps = 100};
+  struct burst_config_t burst = {
+      .frames = 8, .pixelformat = V4L2_PIX_FMT_MJPEG, .writers = 3};
+  struct burst_stats_t stats;
+  struct camera_params_t params;
+  char base[64];
+  char path[96];
+  uint8_t head[10];
+  __u32 sequence;
+  unsigned int n;
+  int fd;
+
+  v4l2_sim_reset(&config);
+  open_camera_device(&params, SIM_DEV_PATH);
+  snprintf(base, sizeof(base), "%s/burst.jpeg", scratch_dir);
+  burst.output_path = base;
+  CHECK(run_burst(&params, &burst, &stats) == 0);
+  CHECK(params.buffer_request.count == 8);
+  free_buffers(&params);
+  close_camera_device(&params);
+
+  CHECK(stats.width == BURST_WIDTH && stats.height == BURST_HEIGHT);
+  CHECK(stats.frames == 8 && stats.dropped_frames == 0);
+  CHECK(stats.writers == 3);
+  /* Back to back at the sensor rate, 10 ms. */
+  CHECK(stats.spacing_min_us > 0);
+  CHECK(stats.spacing_min_us <= stats.spacing_avg_us);
+  CHECK(stats.spacing_avg_us >= 5000 && stats.spacing_avg_us <= 20000);
+  CHECK(stats.spacing_max_us >= stats.spacing_avg_us);
+
+  /* Every file holds its own frame, none was overwritten by a later one. */
+  for (n = 0; n < 8; n++) {
+    numbered_path(path, sizeof(path), base, n);
+    fd = open(path, O_RDONLY);
+    CHECK(fd >= 0);
+    CHECK(read(fd, head, sizeof(head)) == sizeof(head));
+    close(fd);
+    memcpy(&sequence, head + 6, sizeof(sequence));
+    CHECK(head[0] == 0xff && head[1] == 0xd8 && sequence == n);
+  }
+
+  /* More buffers than frames: the burst is in the ones dequeued. */
+  config.min_buffers = 12;
+  v4l2_sim_reset(&config);
+  open_camera_device(&params, SIM_DEV_PATH);
+  burst.output_path = NULL;
+  CHECK(run_burst(&params, &burst, &stats) == 0);
+  CHECK(params.buffer_request.count == 12 && stats.frames == 8);
+  for (n = 0; n < 8; n++) {
+    const uint8_t *frame = params.buffers[stats.indices[n]].start;
+
+    CHECK(stats.indices[n] < 12);
+    memcpy(&sequence, frame + 6, sizeof(sequence));
+    CHECK(frame[0] == 0xff && frame[1] == 0xd8 && sequence == n);
+  }
+  free_buffers(&params);
+  close_camera_device(&params);
+  config.min_buffers = 0;
+
+  /* Fewer buffers than frames cannot hold the burst. */
+  config.max_buffers = 4;
+  v4l2_sim_reset(&config);
+  open_camera_device(&params, SIM_DEV_PATH);
+  CHECK(run_burst(&params, &burst, &stats) < 0 && errno == ENOBUFS);
+  burst.frames = 0;
+  CHECK(run_burst(&params, &burst, &stats) < 0 && errno == EINVAL);
+  free_buffers(&params);
+  close_camera_device(&params);
+}
+
+static void test_mode_switch(void) {
+  struct v4l2_sim_config_t config = {.fps = 60};
+  const struct camera_mode_t preview = {640, 480, V4L2_PIX_FMT_MJPEG, 4};
+  const struct camera_mode_t still = {2592, 1944, V4L2_PIX_FMT_MJPEG, 2};
+  const struct camera_mode_t huge = {4000, 3000, V4L2_PIX_FMT_MJPEG, 2};
+  struct mode_switcher_t switcher;
+  struct mode_switch_timing_t timing;
+  const struct mode_pool_t *pool;
+  struct v4l2_sim_stats_t stats;
+  struct camera_params_t params;
+  int i;
+
+  v4l2_sim_reset(&config);
+  open_camera_device(&params, SIM_DEV_PATH);
+  CHECK(mode_switcher_init(&switcher, &params, &preview, &huge) < 0);
+  CHECK(mode_switcher_init(&switcher, &params, &preview, &still) == 0);
+  CHECK(switcher.pools[CAMERA_MODE_STILL].capacity == 2592 * 1944 * 2);
+
+  mode_switch(&switcher, CAMERA_MODE_PREVIEW, NULL);
+  for (i = 0; i < 3; i++) {
+    release_frame(&params);
+    get_frame(&params);
+  }
+  pool = mode_switcher_take_still(&switcher, &timing);
+
+  /* Back in preview with the still kept aside. */
+  CHECK(params.capture_format.fmt.pix.width == 640);
+  CHECK(params.buffer_request.count == 4 && params.buffer_start != NULL);
+  CHECK(pool->bytes > 0 && pool->sequence == 0);
+  CHECK(((const uint8_t *)pool->data)[0] == 0xff &&
+        ((const uint8_t *)pool->data)[1] == 0xd8);
+  CHECK(switcher.switches == 3);
+  /* Two frame periods of the sensor plus the reconfiguration. */
+  CHECK(timing.total_us < 200000);
+  CHECK(timing.first_frame_us <= timing.total_us &&
+        timing.stop_us + timing.configure_us + timing.start_us +
+                timing.first_frame_us <=
+            timing.total_us);
+  mode_switcher_destroy(&switcher);
+  close_camera_device(&params);
+
+  v4l2_sim_get_stats(&stats);
+  CHECK(stats.calls[V4L2_SIM_OP_S_FMT] == 3);
+  CHECK(stats.calls[V4L2_SIM_OP_MMAP] == 4 + 2 + 4);
+  CHECK(stats.calls[V4L2_SIM_OP_STREAMON] == 3);
+}
+
+/**
+ * @brief Exposure the simulator stamped into step n of a bracket.
+ */
+static int bracket_exposure(const char *base, unsigned int n) {
+  uint8_t head[14];
+  char path[96];
+  int exposure;
+  int fd;
+
+  numbered_path(path, sizeof(path), base, n);
+  fd = open(path, O_RDONLY);
+  if (fd < 0 || read(fd, head, sizeof(head)) != sizeof(head)) {
+    exposure = -1;
+  } else {
+    memcpy(&exposure, head + 10, sizeof(exposure));
+  }
+  if (fd >= 0) {
+    close(fd);
+  }
+  return exposure;
+}
+
+static void test_bracket(void) {
+  struct v4l2_sim_config_t config = {.media_path = SIM_MEDIA_PATH,
+                                     .control_latency = 2};
+  struct bracket_config_t bracket = {
+      .values = {50, 400, 1600, 100}, .steps = 4, .media_path = SIM_MEDIA_PATH};
+  struct bracket_stats_t stats;
+  struct camera_params_t params;
+  char base[64];
+  int value;
+  unsigned int n;
+
+  snprintf(base, sizeof(base), "%s/bracket.jpeg", scratch_dir);
+  bracket.output_path = base;
+
+  /* Requests: every value lands on its own frame, nothing is wasted. */
+  v4l2_sim_reset(&config);
+  open_camera_device(&params, SIM_DEV_PATH);
+  set_video_format(&params, 640, 480, V4L2_PIX_FMT_MJPEG);
+  CHECK(run_bracket(&params, &bracket, &stats) == 0);
+  CHECK(stats.method == BRACKET_REQUEST_API);
+  CHECK(stats.discarded_frames == 0);
+  for (n = 0; n < 4; n++) {
+    CHECK(stats.sequences[n] == n);
+    CHECK(bracket_exposure(base, n) == bracket.values[n]);
+  }
+  CHECK(params.buffer_request.count == 0);
+  CHECK(get_camera_control(&params, V4L2_CID_EXPOSURE, &value) == 0 &&
+        value == V4L2_SIM_DEFAULT_EXPOSURE);
+  /* The sensor starts in auto exposure, which the bracket turned off for
+   * the steps to land and back on after. */
+  CHECK(get_camera_control(&params, V4L2_CID_EXPOSURE_AUTO, &value) == 0 &&
+        value == V4L2_EXPOSURE_AUTO);
+  CHECK(set_camera_control(&params, V4L2_CID_EXPOSURE, 50) == 0);
+  CHECK(get_camera_control(&params, V4L2_CID_EXPOSURE, &value) == 0 &&
+        value == V4L2_SIM_DEFAULT_EXPOSURE);
+
+  /* Sequence numbers: right with the right latency, at a cost in frames. */
+  bracket.media_path = NULL;
+  CHECK(run_bracket(&params, &bracket, &stats) == 0);
+  CHECK(stats.method == BRACKET_SEQUENCE);
+  CHECK(stats.discarded_frames >= 4 * 2);
+  for (n = 0; n < 4; n++) {
+    CHECK(bracket_exposure(base, n) == bracket.values[n]);
+    CHECK(n == 0 || stats.sequences[n] > stats.sequences[n - 1] + 2);
+  }
+
+  /* An optimistic latency keeps frames taken before the change. */
+  bracket.latency_frames = 1;
+  CHECK(run_bracket(&params, &bracket, &stats) == 0);
+  CHECK(bracket_exposure(base, 0) == V4L2_SIM_DEFAULT_EXPOSURE);
+  CHECK(bracket_exposure(base, 1) == bracket.values[0]);
+  bracket.latency_frames = 0;
+
+  /* A manual exposure set beforehand is kept. */
+  CHECK(set_camera_control(&params, V4L2_CID_EXPOSURE_AUTO,
+                           V4L2_EXPOSURE_MANUAL) == 0);
+  CHECK(set_camera_control(&params, V4L2_CID_EXPOSURE, 700) == 0);
+  CHECK(run_bracket(&params, &bracket, &stats) == 0);
+  CHECK(bracket_exposure(base, 3) == bracket.values[3]);
+  CHECK(get_camera_control(&params, V4L2_CID_EXPOSURE_AUTO, &value) == 0 &&
+        value == V4L2_EXPOSURE_MANUAL);
+  CHECK(get_camera_control(&params, V4L2_CID_EXPOSURE, &value) == 0 &&
+        value == 700);
+
+  bracket.steps = 0;
+  CHECK(run_bracket(&params, &bracket, &stats) < 0 && errno == EINVAL);
+  close_camera_device(&params);
+
+  /* A device without requests falls back even when a media path is given. */
+  config.media_path = NULL;
+  v4l2_sim_reset(&config);
+  open_camera_device(&params, SIM_DEV_PATH);
+  set_video_format(&params, 640, 480, V4L2_PIX_FMT_MJPEG);
+  bracket.steps = 2;
+  bracket.media_path = SIM_MEDIA_PATH;
+  CHECK(run_bracket(&params, &bracket, &stats) == 0);
+  CHECK(stats.method == BRACKET_SEQUENCE);
+  CHECK(bracket_exposure(base, 1) == bracket.values[1]);
+  close_camera_device(&params);
+}
+
+static void test_tone_map(void) {
+  const size_t size = 1920 * 1080 * 2;
+  struct tone_map_t map;
+  uint8_t *input = malloc(size + 64);
+  uint8_t *output = malloc(size + 64);
+  uint32_t state = 2463534242u;
+  size_t offset;
+  size_t length;
+  size_t i;
+  int mismatches = 0;
+
+  CHECK(input != NULL && output != NULL);
+  map.curve = TONE_CURVE_FILE;
+  for (i = 0; i < TONE_MAP_LUT_SIZE; i++) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    map.lut[i] = (uint8_t)state;
+  }
+  for (i = 0; i < size + 64; i++) {
+    state ^= state << 13;
+    state ^= state >> 17;
+    state ^= state << 5;
+    input[i] = (uint8_t)(state >> 8);
+  }
+
+  /* Whichever kernel was compiled in (see SIMD in the Makefile) matches
+   * the table byte for byte, at every alignment and across its tails. */
+  for (offset = 0; offset < 32; offset += 3) {
+    for (length = 0; length < 300; length++) {
+      memcpy(output, input, length + 64);
+      tone_map_apply(&map, output + offset, length);
+      for (i = 0; i < length + 64; i++) {
+        uint8_t sample = input[i];
+
+        if (i >= offset && i < offset + length) {
+          sample = map.lut[sample];
+        }
+        mismatches += output[i] != sample;
+      }
+
+      memcpy(output, input, length + 64);
+      tone_map_apply_yuyv(&map, output + offset, length);
+      for (i = 0; i < length + 64; i++) {
+        uint8_t sample = input[i];
+
+        if (i >= offset && i + 1 < offset + length && (i - offset) % 2 == 0) {
+          sample = map.lut[sample];
+        }
+        mismatches += output[i] != sample;
+      }
+    }
+  }
+  CHECK(mismatches == 0);
+
+  memcpy(output, input, size);
+  tone_map_apply(&map, output, size);
+  for (i = 0; i < size; i++) {
+    mismatches += output[i] != map.lut[input[i]];
+  }
+  memcpy(output, input, size);
+  tone_map_apply_yuyv(&map, output, size);
+  for (i = 0; i < size; i++) {
+    mismatches += output[i] != (i % 2 == 0 ? map.lut[input[i]] : input[i]);
+  }
+  CHECK(mismatches == 0);
+
+  free(input);
+  free(output);
+}
+
+/**
+ * @brief Scene radiance for HDR tests: 8x8 blocks of pseudo random
+ * brightness over a horizontal ramp, spread evenly over seven stops from 4
+ * to 512 "levels".
+ */
+static unsigned int hdr_radiance(int x, int y) {
+  uint32_t hash =
+      (uint32_t)(x >> 3) * 2654435761u ^ (uint32_t)(y >> 3) * 40503u;
+  unsigned int t;
+
+  hash = hash * 1664525u + 1013904223u;
+  t = (hash >> 24) * 3 / 4 + ((unsigned int)x & 255) / 4;
+  return (unsigned int)(4 * exp2(7.0 * t / 256));
+}
+
+/**
+ * @brief Render the scene at a relative exposure (in 1/4 steps), moved by
+ * (dx, dy), clipped like a sensor.
+ */
+static void hdr_render(uint8_t *data, const struct v4l2_pix_format *format,
+                       unsigned int quarters, int dx, int dy) {
+  size_t bpp = format->pixelformat == V4L2_PIX_FMT_YUYV ? 2 : 1;
+  __u32 x;
+  __u32 y;
+
+  for (y = 0; y < format->height; y++) {
+    for (x = 0; x < format->width; x++) {
+      unsigned int v = hdr_radiance((int)x - dx, (int)y - dy) * quarters / 4;
+      uint8_t *p = data + (size_t)y * format->bytesperline + x * bpp;
+
+      p[0] = (uint8_t)(v > 255 ? 255 : v);
+      if (bpp == 2) {
+        p[1] = (uint8_t)(x & 1 ? 100 : 160);
+      }
+    }
+  }
+}
+
+static void test_hdr(void) {
+  struct v4l2_pix_format format = {.width = 320,
+                                   .height = 240,
+                                   .pixelformat = V4L2_PIX_FMT_GREY,
+                                   .bytesperline = 320};
+  const size_t size = 320 * 240 * 2;
+  uint8_t *frames[3];
+  uint8_t *single = malloc(size);
+  struct hdr_merger_t merger;
+  struct hdr_merger_t parallel;
+  struct tone_map_t identity;
+  const void *output;
+  const void *other;
+  size_t clipped_mid = 0;
+  size_t clipped_out = 0;
+  size_t i;
+  int n;
+
+  CHECK(single != NULL);
+  for (n = 0; n < 3; n++) {
+    frames[n] = malloc(size);
+    CHECK(frames[n] != NULL);
+  }
+  CHECK(hdr_merger_init(&merger, 1) == 0 && merger.threads == 1);
+  CHECK(hdr_merger_init(&parallel, 3) == 0 && parallel.threads == 3);
+
+  /* Two stops apart, the short and long frames moved by a few pixels. */
+  hdr_render(frames[0], &format, 1, 6, -4);
+  hdr_render(frames[1], &format, 4, 0, 0);
+  hdr_render(frames[2], &format, 16, -8, 2);
+  CHECK(hdr_merge(&merger, &format, (const void *const *)frames, 3, 1, NULL,
+                  &output) == 0);
+  CHECK(merger.shifts[0][0] == 6 && merger.shifts[0][1] == -4);
+  CHECK(merger.shifts[1][0] == 0 && merger.shifts[1][1] == 0);
+  CHECK(merger.shifts[2][0] == -8 && merger.shifts[2][1] == 2);
+
+  /* Highlights the middle exposure clipped come from the short frame. */
+  for (i = 0; i < 320 * 240; i++) {
+    clipped_mid += frames[1][i] == 255;
+    clipped_out += ((const uint8_t *)output)[i] >= 250;
+  }
+  CHECK(clipped_mid > 320 * 240 / 50);
+  CHECK(clipped_out < clipped_mid / 10);
+
+  /* Tiles on more threads, or an identity curve, change nothing. */
+  memcpy(single, output, 320 * 240);
+  CHECK(hdr_merge(&parallel, &format, (const void *const *)frames, 3, 1,
+                  NULL, &other) == 0);
+  CHECK(memcmp(single, other, 320 * 240) == 0);
+  tone_map_init(&identity, TONE_CURVE_IDENTITY);
+  CHECK(hdr_merge(&parallel, &format, (const void *const *)frames, 3, 1,
+                  &identity, &other) == 0);
+  CHECK(memcmp(single, other, 320 * 240) == 0);
+
+  /* Equal frames fuse to themselves, chroma included. */
+  format.pixelformat = V4L2_PIX_FMT_YUYV;
+  format.bytesperline = 640;
+  for (n = 0; n < 3; n++) {
+    hdr_render(frames[n], &format, 4, 0, 0);
+  }
+  CHECK(hdr_merge(&parallel, &format, (const void *const *)frames, 3, 1,
+                  NULL, &output) == 0);
+  CHECK(memcmp(output, frames[1], size) == 0);
+
+  format.pixelformat = V4L2_PIX_FMT_MJPEG;
+  CHECK(hdr_merge(&merger, &format, (const void *const *)frames, 3, 1, NULL,
+                  &output) < 0 &&
+        errno == EINVAL);
+  format.pixelformat = V4L2_PIX_FMT_GREY;
+  CHECK(hdr_merge(&merger, &format, (const void *const *)frames, 1, 0, NULL,
+                  &output) < 0 &&
+        errno == EINVAL);
+
+  hdr_merger_destroy(&parallel);
+  hdr_merger_destroy(&merger);
+  for (n = 0; n < 3; n++) {
+    free(frames[n]);
+  }
+  free(single);
+}
+
+/**
+ * @brief Sample of a noisy exposure of the HDR scene: the middle exposure
+ * plus pseudo random noise of about +-12 levels, different in every frame.
+ */
+static uint8_t stack_sample(size_t i, unsigned int frame) {
+  uint32_t hash = ((uint32_t)i * 2654435761u) ^ (frame * 40503u + 7u);
+  int v = (int)hdr_radiance((int)(i % 320), (int)(i / 320));
+
+  hash = hash * 1664525u + 1013904223u;
+  hash ^= hash >> 15;
+  v += (int)(hash % 25) - 12;
+  return (uint8_t)(v < 0 ? 0 : v > 255 ? 255 : v);
+}
+
+static void test_stack(void) {
+  struct v4l2_pix_format format = {.width = 320,
+                                   .height = 240,
+                                   .pixelformat = V4L2_PIX_FMT_GREY,
+                                   .bytesperline = 320};
+  const size_t size = 320 * 240;
+  struct burst_config_t burst = {.frames = 4,
+                                 .pixelformat = V4L2_PIX_FMT_GREY};
+  struct v4l2_sim_config_t config = {.fps = 100};
+  uint8_t *frames[STACK_MAX_FRAMES];
+  uint8_t *single = malloc(size);
+  const void *mapped[4];
+  struct burst_stats_t stats;
+  struct camera_params_t params;
+  struct stacker_t stacker;
+  struct stacker_t parallel;
+  const void *output;
+  const void *other;
+  double error_one = 0;
+  double error_mean = 0;
+  size_t i;
+  unsigned int n;
+
+  CHECK(single != NULL);
+  for (n = 0; n < STACK_MAX_FRAMES; n++) {
+    frames[n] = malloc(size);
+    CHECK(frames[n] != NULL);
+    for (i = 0; i < size; i++) {
+      frames[n][i] = stack_sample(i, n);
+    }
+  }
+  CHECK(stacker_init(&stacker, 1) == 0 && stacker.threads == 1);
+  CHECK(stacker_init(&parallel, 3) == 0 && parallel.threads == 3);
+
+  /* The vector add and reciprocal divide round like integer division. */
+  CHECK(stack_frames(&stacker, &format, (const void *const *)frames,
+                     STACK_MAX_FRAMES, STACK_MEAN, 0, &output) == 0);
+  for (i = 0; i < size; i++) {
+    unsigned int sum = 0;
+    int truth = (int)hdr_radiance((int)(i % 320), (int)(i / 320));
+
+    for (n = 0; n < STACK_MAX_FRAMES; n++) {
+      sum += frames[n][i];
+    }
+    CHECK(((const uint8_t *)output)[i] ==
+          (sum + STACK_MAX_FRAMES / 2) / STACK_MAX_FRAMES);
+    if (truth >= 12 && truth <= 243) {
+      error_one += (frames[0][i] - truth) * (frames[0][i] - truth);
+      error_mean += (((const uint8_t *)output)[i] - truth) *
+                    (((const uint8_t *)output)[i] - truth);
+    }
+  }
+  /* Sixteen frames cut the noise by four, its power by sixteen. */
+  CHECK(error_mean * 8 < error_one);
+
+  /* A hot pixel in one frame pulls the mean up, clipping drops it. */
+  memcpy(single, frames[2], size);
+  for (i = 0; i < size; i += 97) {
+    frames[2][i] = 255;
+  }
+  CHECK(stack_frames(&stacker, &format, (const void *const *)frames, 8,
+                     STACK_CLIPPED, 0, &output) == 0);
+  CHECK(stacker.rejected_samples >= size / 97);
+  CHECK(stack_frames(&parallel, &format, (const void *const *)frames, 8,
+                     STACK_MEAN, 0, &other) == 0);
+  for (i = 0; i < size; i += 97) {
+    int truth = (int)hdr_radiance((int)(i % 320), (int)(i / 320));
+    int clipped = ((const uint8_t *)output)[i];
+
+    if (truth <= 200) {
+      CHECK(clipped - truth <= 12 && truth - clipped <= 12);
+      CHECK(((const uint8_t *)other)[i] > clipped + 3);
+    }
+  }
+  memcpy(frames[2], single, size);
+
+  /* Tiles on more threads change nothing. */
+  CHECK(stack_frames(&stacker, &format, (const void *const *)frames, 5,
+                     STACK_CLIPPED, 30, &output) == 0);
+  memcpy(single, output, size);
+  CHECK(stack_frames(&parallel, &format, (const void *const *)frames, 5,
+                     STACK_CLIPPED, 30, &other) == 0);
+  CHECK(memcmp(single, other, size) == 0);
+
+  CHECK(stack_frames(&stacker, &format, (const void *const *)frames, 2,
+                     STACK_CLIPPED, 0, &output) < 0 &&
+        errno == EINVAL);
+  format.pixelformat = V4L2_PIX_FMT_MJPEG;
+  CHECK(stack_frames(&stacker, &format, (const void *const *)frames, 4,
+                     STACK_MEAN, 0, &output) < 0 &&
+        errno == EINVAL);
+
+  /* Straight off the buffers of a burst that wrote nothing, from a driver
+   * granting more buffers than frames. */
+  config.min_buffers = 6;
+  v4l2_sim_reset(&config);
+  open_camera_device(&params, SIM_DEV_PATH);
+  CHECK(run_burst(&params, &burst, &stats) == 0);
+  CHECK(params.buffer_request.count == 6);
+  for (n = 0; n < 4; n++) {
+    mapped[n] = params.buffers[stats.indices[n]].start;
+  }
+  CHECK(stack_frames(&parallel, &params.capture_format.fmt.pix, mapped, 4,
+                     STACK_MEAN, 0, &output) == 0);
+  for (i = 0; i < (size_t)params.capture_format.fmt.pix.bytesperline *
+                      params.capture_format.fmt.pix.height;
+       i += 4099) {
+    unsigned int sum = 0;
+
+    for (n = 0; n < 4; n++) {
+      sum += ((const uint8_t *)mapped[n])[i];
+    }
+    CHECK(((const uint8_t *)output)[i] == (sum + 2) / 4);
+  }
+  free_buffers(&params);
+  close_camera_device(&params);
+
+  stacker_destroy(&parallel);
+  stacker_destroy(&stacker);
+  for (n = 0; n < STACK_MAX_FRAMES; n++) {
+    free(frames[n]);
+  }
+  free(single);
+}
+
+/**
+ * @brief Camera shake of the stabilizer tests: where the scene sits in
+ * frame t, swaying by up to 12 pixels across and 6 down.
+ */
+static void sway(unsigned int t, int offset[2]) {
+  offset[0] = (int)lround(12 * sin(t * 0.7));
+  offset[1] = (int)lround(6 * cos(t * 0.9));
+}
+
+static void test_stabilizer(void) {
+  struct v4l2_pix_format format = {.width = 320,
+                                   .height = 240,
+                                   .pixelformat = V4L2_PIX_FMT_GREY,
+                                   .bytesperline = 320};
+  const size_t size = 320 * 240 * 2;
+  const unsigned int frames = 40;
+  struct v4l2_sim_config_t config = {.fps = 100};
+  struct recorder_config_t record = {.duration_ms = 200};
+  struct recorder_stats_t stats;
+  struct camera_params_t params;
+  struct stabilizer_t stabilizer;
+  struct stabilizer_frame_t out;
+  uint8_t *frame = malloc(size);
+  int offsets[40][2];
+  int last[2] = {0, 0};
+  unsigned int popped = 0;
+  unsigned int t;
+  int raw_max = 0;
+  int jitter_max = 0;
+  char base[64];
+  char path[96];
+  struct stat st;
+
+  CHECK(frame != NULL);
+  CHECK(stabilizer_init(&stabilizer, &format, 4, 10) == 0);
+  CHECK(stabilizer.output_format.width == 256 &&
+        stabilizer.output_format.height == 192);
+
+  for (t = 0; t < frames; t++) {
+    sway(t, offsets[t]);
+    hdr_render(frame, &format, 2, offsets[t][0], offsets[t][1]);
+    CHECK(stabilizer_push(&stabilizer, frame, 320 * 240, t, t * 10000) == 0);
+    if (t == 4) {
+      CHECK(stabilizer_push(&stabilizer, frame, 320 * 240, t, 0) < 0 &&
+            errno == EBUSY);
+    }
+    /* The look-ahead holds frames back. */
+    CHECK(stabilizer_pop(&stabilizer, 0, &out) == (t >= 4));
+    if (t < 4) {
+      continue;
+    }
+
+    /* Motion is measured exactly, and the crop undoes most of it: where
+     * the scene lands in the output barely moves. */
+    CHECK(out.sequence == popped && out.bytes == 256 * 192);
+    if (popped > 0) {
+      int position[2];
+      int axis;
+
+      for (axis = 0; axis < 2; axis++) {
+        int raw = offsets[popped][axis] - offsets[popped - 1][axis];
+
+        CHECK(out.motion[axis] == raw);
+        position[axis] = offsets[popped][axis] - ((int)out.crop[axis] -
+                                                  (axis ? 24 : 32));
+        if (abs(raw) > raw_max) {
+          raw_max = abs(raw);
+        }
+        if (popped > 1 && abs(position[axis] - last[axis]) > jitter_max) {
+          jitter_max = abs(position[axis] - last[axis]);
+        }
+        last[axis] = position[axis];
+      }
+    } else {
+      last[0] = offsets[0][0] - ((int)out.crop[0] - 32);
+      last[1] = offsets[0][1] - ((int)out.crop[1] - 24);
+    }
+    popped++;
+  }
+  while (stabilizer_pop(&stabilizer, 1, &out)) {
+    CHECK(out.sequence == popped);
+    popped++;
+  }
+  CHECK(popped == frames && stabilizer.pushed == frames);
+  CHECK(raw_max >= 8 && jitter_max <= raw_max / 3);
+  CHECK(stabilizer.clamped == 0);
+  stabilizer_destroy(&stabilizer);
+
+  /* YUYV crops start on a whole macropixel. */
+  format.pixelformat = V4L2_PIX_FMT_YUYV;
+  format.bytesperline = 640;
+  CHECK(stabilizer_init(&stabilizer, &format, 0, 0) == 0);
+  for (t = 0; t < 6; t++) {
+    hdr_render(frame, &format, 2, offsets[t][0], offsets[t][1]);
+    CHECK(stabilizer_push(&stabilizer, frame, size, t, 0) == 0);
+    CHECK(stabilizer_pop(&stabilizer, 0, &out) == 1);
+    CHECK((out.crop[0] & 1) == 0);
+    CHECK(t == 0 || out.motion[0] == offsets[t][0] - offsets[t - 1][0]);
+  }
+  stabilizer_destroy(&stabilizer);
+  format.pixelformat = V4L2_PIX_FMT_MJPEG;
+  CHECK(stabilizer_init(&stabilizer, &format, 4, 0) < 0 && errno == EINVAL);
+
+  /* Recorded through the stabilizer, the look-ahead is flushed at the end
+   * and every stored frame is cropped. */
+  v4l2_sim_reset(&config);
+  setup_camera(&params, V4L2_PIX_FMT_GREY, CAMERA_DEFAULT_BUFFERS);
+  CHECK(stabilizer_init(&stabilizer, &params.capture_format.fmt.pix, 6, 0) ==
+        0);
+  snprintf(base, sizeof(base), "%s/stable.grey", scratch_dir);
+  record.output_path = base;
+  record.stabilizer = &stabilizer;
+  CHECK(run_recorder(&params, &record, &stats) == 0);
+  teardown_camera(&params);
+  CHECK(stats.frames_captured >= 10);
+  CHECK(stats.frames_written + stats.frames_throttled + stats.frames_dropped ==
+        stats.frames_captured);
+  CHECK(stabilizer.pushed == stabilizer.popped);
+  numbered_path(path, sizeof(path), base, 0);
+  CHECK(stat(path, &st) == 0);
+  CHECK((unsigned long long)st.st_size ==
+        stats.frames_written * stabilizer.output_format.sizeimage);
+  stabilizer_destroy(&stabilizer);
+  free(frame);
+}
+
+/**
+ * @brief Set a rectangle of a frame's luma to a level.
+ */
+static void fill_luma(uint8_t *data, const struct v4l2_pix_format *format,
+                      __u32 x, __u32 y, __u32 width, __u32 height,
+                      uint8_t level) {
+  __u32 step = format->pixelformat == V4L2_PIX_FMT_YUYV ? 2 : 1;
+  __u32 i;
+  __u32 j;
+
+  for (j = y; j < y + height; j++) {
+    for (i = x; i < x + width; i++) {
+      data[(size_t)j * format->bytesperline + i * step] = level;
+    }
+  }
+}
+
+/**
+ * @brief Draw an EAN-13 symbol of 13 digits with its top-left bar at x, y.
+ */
+static void draw_ean13(uint8_t *data, const struct v4l2_pix_format *format,
+                       __u32 x, __u32 y, __u32 module, __u32 height,
+                       const char *digits) {
+  static const char *const parities[10] = {
+      "LLLLLL", "LLGLGG", "LLGGLG", "LLGGGL", "LGLLGG",
+      "LGGLLG", "LGGGLL", "LGLGLG", "LGLGGL", "LGGLGL"};
+  /* (space, bar, space, bar) widths of the L set. */
+  static const char *const widths[10] = {"3211", "2221", "2122", "1411",
+                                         "1132", "1231", "1114", "1312",
+                                         "1213", "3112"};
+  char bits[96];
+  unsigned int n = 0;
+  unsigned int i;
+  unsigned int k;
+  int w;
+
+  memcpy(bits + n, "101", 3);
+  n += 3;
+  for (i = 1; i <= 12; i++) {
+    const char *pattern = widths[digits[i] - '0'];
+    int g = i <= 6 && parities[digits[0] - '0'][i - 1] == 'G';
+    int bar = i > 6;
+
+    if (i == 7) {
+      memcpy(bits + n, "01010", 5);
+      n += 5;
+    }
+    for (k = 0; k < 4; k++) {
+      for (w = 0; w < pattern[g ? 3 - k : k] - '0'; w++) {
+        bits[n++] = bar ? '1' : '0';
+      }
+      bar = !bar;
+    }
+  }
+  memcpy(bits + n, "101", 3);
+  n += 3;
+
+  for (i = 0; i < n; i++) {
+    if (bits[i] == '1') {
+      fill_luma(data, format, x + i * module, y, module, height, 20);
+    }
+  }
+}
+
+/**
+ * @brief Draw a QR-like symbol of 25 x 25 modules: three finders and
+ * scattered data modules.
+ */
+static void draw_qr(uint8_t *data, const struct v4l2_pix_format *format,
+                    __u32 x, __u32 y, __u32 module) {
+  static const unsigned int corners[3][2] = {{0, 0}, {18, 0}, {0, 18}};
+  uint32_t seed = 12345;
+  unsigned int c;
+  unsigned int i;
+  unsigned int j;
+
+  for (j = 0; j < 25; j++) {
+    for (i = 0; i < 25; i++) {
+      int in_finder = (i < 8 && j < 8) || (i >= 17 && j < 8) ||
+                      (i < 8 && j >= 17);
+
+      seed = seed * 1103515245 + 12345;
+      if (!in_finder && (seed >> 16) % 2) {
+        fill_luma(data, format, x + i * module, y + j * module, module,
+                  module, 20);
+      }
+    }
+  }
+  for (c = 0; c < 3; c++) {
+    __u32 fx = x + corners[c][0] * module;
+    __u32 fy = y + corners[c][1] * module;
+
+    fill_luma(data, format, fx, fy, 7 * module, 7 * module, 20);
+    fill_luma(data, format, fx + module, fy + module, 5 * module, 5 * module,
+              230);
+    fill_luma(data, format, fx + 2 * module, fy + 2 * module, 3 * module,
+              3 * module, 20);
+  }
+}
+
+/**
+ * @brief Index of the first result of a type, or -1.
+ */
+static int find_result(const struct barcode_result_t *results, int count,
+                       enum barcode_type_t type) {
+  int i;
+
+  for (i = 0; i < count; i++) {
+    if (results[i].type == type) {
+      return i;
+    }
+  }
+  return -1;
+}
+
+static void test_barcode(void) {
+  struct v4l2_pix_format format = {.width = 640,
+                                   .height = 480,
+                                   .pixelformat = V4L2_PIX_FMT_GREY,
+                                   .bytesperline = 640};
+  const size_t size = 640 * 480;
+  uint8_t *frame = malloc(size);
+  uint8_t *turned = malloc(size);
+  struct barcode_detector_t detector;
+  struct barcode_sink_t sink;
+  const struct barcode_result_t *results;
+  const struct barcode_result_t *r;
+  struct sockaddr_un address;
+  char message[128];
+  char expected[128];
+  ssize_t length;
+  size_t i;
+  __u32 x;
+  __u32 y;
+  int receiver;
+  int count;
+  int e;
+  int q;
+
+  CHECK(frame != NULL && turned != NULL);
+  memset(frame, 230, size);
+  draw_ean13(frame, &format, 40, 40, 3, 100, "4006381333931");
+  draw_qr(frame, &format, 400, 200, 4);
+  /* Sensor noise. */
+  for (i = 0; i < size; i++) {
+    frame[i] = (uint8_t)(frame[i] + ((uint32_t)(i * 2654435761u) >> 28) - 8);
+  }
+
+  CHECK(barcode_detector_init(&detector, &format) == 0);
+  count = barcode_detect(&detector, frame, size, &results);
+  CHECK(count == 2);
+  e = find_result(results, count, BARCODE_EAN13);
+  q = find_result(results, count, BARCODE_QR);
+  CHECK(e >= 0 && q >= 0);
+
+  /* The region covers the bars, give or take a cell. */
+  r = &results[e];
+  CHECK(strcmp(r->data, "4006381333931") == 0);
+  CHECK(abs((int)r->x - 40) < 16 && abs((int)(r->x + r->width) - 325) < 16);
+  CHECK(abs((int)r->y - 40) < 16 && abs((int)(r->y + r->height) - 140) < 16);
+
+  /* The QR region is the symbol, within a module or two. */
+  r = &results[q];
+  CHECK(r->data[0] == '\0');
+  CHECK(abs((int)r->x - 400) <= 8 && abs((int)r->y - 200) <= 8);
+  CHECK(abs((int)(r->x + r->width) - 500) <= 8 &&
+        abs((int)(r->y + r->height) - 300) <= 8);
+  CHECK(detector.decoded == 1 && detector.located == 1);
+
+  /* Upside down, and turned a quarter so the bars lie horizontally. */
+  for (i = 0; i < size; i++) {
+    turned[i] = frame[size - 1 - i];
+  }
+  count = barcode_detect(&detector, turned, size, &results);
+  e = find_result(results, count, BARCODE_EAN13);
+  CHECK(e >= 0 && strcmp(results[e].data, "4006381333931") == 0);
+  CHECK(find_result(results, count, BARCODE_QR) >= 0);
+  barcode_detector_destroy(&detector);
+
+  format.width = 480;
+  format.height = 640;
+  format.bytesperline = 480;
+  for (y = 0; y < 640; y++) {
+    for (x = 0; x < 480; x++) {
+      turned[y * 480 + x] = frame[x * 640 + y];
+    }
+  }
+  CHECK(barcode_detector_init(&detector, &format) == 0);
+  count = barcode_detect(&detector, turned, size, &results);
+  e = find_result(results, count, BARCODE_EAN13);
+  CHECK(e >= 0 && strcmp(results[e].data, "4006381333931") == 0);
+  CHECK(abs((int)results[e].x - 40) < 16 && abs((int)results[e].y - 40) < 16 &&
+        results[e].height >= 285);
+  CHECK(find_result(results, count, BARCODE_QR) >= 0);
+
+  /* A plain frame has nothing, a short one is refused. */
+  memset(turned, 128, size);
+  CHECK(barcode_detect(&detector, turned, size, &results) == 0);
+  CHECK(barcode_detect(&detector, turned, size - 1, &results) < 0 &&
+        errno == EINVAL);
+  barcode_detector_destroy(&detector);
+  format.pixelformat = V4L2_PIX_FMT_MJPEG;
+  CHECK(barcode_detector_init(&detector, &format) < 0 && errno == EINVAL);
+
+  /* Results arrive one datagram each, tagged with the sequence; with
+   * nobody listening they are dropped without blocking. */
+  format.pixelformat = V4L2_PIX_FMT_GREY;
+  format.width = 640;
+  format.height = 480;
+  format.bytesperline = 640;
+  CHECK(barcode_detector_init(&detector, &format) == 0);
+  count = barcode_detect(&detector, frame, size, &results);
+  CHECK(count == 2);
+  memset(&address, 0, sizeof(address));
+  address.sun_family = AF_UNIX;
+  snprintf(address.sun_path, sizeof(address.sun_path), "%s/barcodes.sock",
+           scratch_dir);
+  receiver = socket(AF_UNIX, SOCK_DGRAM, 0);
+  CHECK(receiver >= 0);
+  CHECK(bind(receiver, (struct sockaddr *)&address, sizeof(address)) == 0);
+  CHECK(barcode_sink_open(&sink, address.sun_path) == 0);
+  barcode_sink_send(&sink, 7, results, (unsigned int)count);
+  CHECK(sink.sent == 2 && sink.dropped == 0);
+  for (e = 0; e < count; e++) {
+    r = &results[e];
+    snprintf(expected, sizeof(expected), "7 %s %u %u %u %u%s%s\n",
+             r->type == BARCODE_QR ? "qr" : "ean13", r->x, r->y, r->width,
+             r->height, r->data[0] ? " " : "", r->data);
+    length = recv(receiver, message, sizeof(message) - 1, 0);
+    CHECK(length > 0);
+    message[length] = '\0';
+    CHECK(strcmp(message, expected) == 0);
+  }
+  close(receiver);
+  unlink(address.sun_path);
+  barcode_sink_send(&sink, 8, results, (unsigned int)count);
+  CHECK(sink.sent == 2 && sink.dropped == 2);
+  barcode_sink_close(&sink);
+  barcode_detector_destroy(&detector);
+  free(frame);
+  free(turned);
+}
+
+/**
+ * @brief What the test stages saw.
+ */
+static const void *probe_data;
+static __u32 probe_sequence;
+static unsigned int probe_destroyed;
+static pthread_t slow_thread;
+
+static int probe_init(void **state, const struct v4l2_format *format,
+                      const char *args) {
+  (void)format;
+  *state = (void *)args;
+  return 0;
+}
+
+static int probe_process(void *state, const struct stage_view_t *view,
+                         const struct stage_metadata_t *metadata) {
+  (void)state;
+  probe_data = view->data;
+  probe_sequence = metadata->sequence;
+  return metadata->flags & V4L2_BUF_FLAG_ERROR ? -1 : 0;
+}
+
+static void probe_destroy(void *state) {
+  (void)state;
+  probe_destroyed++;
+}
+
+static int slow_process(void *state, const struct stage_view_t *view,
+                        const struct stage_metadata_t *metadata) {
+  (void)state;
+  (void)view;
+  (void)metadata;
+  slow_thread = pthread_self();
+  usleep(2000);
+  return 0;
+}
+
+static int refuse_init(void **state, const struct v4l2_format *format,
+                       const char *args) {
+  (void)state;
+  (void)format;
+  (void)args;
+  errno = ENODEV;
+  return -1;
+}
+
+static const struct stage_descriptor_t probe_stage = {
+    .abi_version = STAGE_ABI_VERSION,
+    .name = "probe",
+    .threading = STAGE_THREAD_CALLER,
+    .init = probe_init,
+    .process = probe_process,
+    .destroy = probe_destroy,
+};
+
+/* Two and a half frame intervals at 100 fps. */
+static const struct stage_descriptor_t slow_stage = {
+    .abi_version = STAGE_ABI_VERSION,
+    .name = "slow",
+    .cost_us = 25000,
+    .threading = STAGE_THREAD_OWN,
+    .process = slow_process,
+};
+
+static const struct stage_descriptor_t refuse_stage = {
+    .abi_version = STAGE_ABI_VERSION,
+    .name = "refuse",
+    .init = refuse_init,
+    .process = probe_process,
+};
+
+static void test_stage(void) {
+  struct stage_descriptor_t future = probe_stage;
+  struct v4l2_sim_config_t config = {.fps = 100};
+  struct camera_params_t params;
+  struct stage_pipeline_t pipeline;
+  struct stage_view_t view;
+  struct stage_metadata_t metadata;
+  struct v4l2_format format;
+  uint8_t frame[64];
+  const struct stage_t *slow;
+  unsigned int i;
+
+  memset(&format, 0, sizeof(format));
+  format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  format.fmt.pix.width = 8;
+  format.fmt.pix.height = 8;
+  format.fmt.pix.pixelformat = V4L2_PIX_FMT_GREY;
+  format.fmt.pix.bytesperline = 8;
+
+  /* Other ABI versions and a full pipeline are refused. */
+  stage_pipeline_init(&pipeline);
+  future.abi_version = STAGE_ABI_VERSION + 1;
+  CHECK(stage_pipeline_add(&pipeline, &future, NULL) < 0 && errno == EINVAL);
+  for (i = 0; i < STAGE_MAX_STAGES; i++) {
+    CHECK(stage_pipeline_add(&pipeline, &probe_stage, NULL) == 0);
+  }
+  CHECK(stage_pipeline_add(&pipeline, &probe_stage, NULL) < 0 &&
+        errno == ENOSPC);
+  stage_pipeline_destroy(&pipeline);
+  CHECK(probe_destroyed == 0);
+
+  /* Stages see the caller's buffer itself. One declaring 2.5 frame
+   * intervals runs on every third frame, on its own thread. */
+  stage_pipeline_init(&pipeline);
+  CHECK(stage_pipeline_add(&pipeline, &probe_stage, "args") == 0);
+  CHECK(stage_pipeline_add(&pipeline, &slow_stage, NULL) == 0);
+  CHECK(stage_pipeline_start(&pipeline, &format) == 0);
+  CHECK(strcmp(pipeline.stages[0].state, "args") == 0);
+  view.data = frame;
+  view.bytes = sizeof(frame);
+  view.format = &format;
+  view.plane_count = 1;
+  view.planes[0].data = view.data;
+  view.planes[0].bytes = view.bytes;
+  for (i = 0; i < 30; i++) {
+    metadata.sequence = i;
+    metadata.index = 0;
+    metadata.flags = i == 7 ? V4L2_BUF_FLAG_ERROR : 0;
+    metadata.timestamp_us = 1000000 + i * 10000;
+    stage_pipeline_run(&pipeline, &view, &metadata);
+    CHECK(probe_data == frame && probe_sequence == i);
+  }
+  slow = &pipeline.stages[1];
+  CHECK(pipeline.frames == 30 && pipeline.interval_us_avg == 10000);
+  CHECK(pipeline.stages[0].frames == 30 && pipeline.stages[0].errors == 1);
+  CHECK(slow->stride == 3 && slow->frames + slow->skipped == 30);
+  CHECK(slow->frames >= 10 && slow->frames <= 11);
+  CHECK(slow->process_ns_avg >= 2000000 && !pthread_equal(slow_thread,
+                                                          pthread_self()));
+  stage_pipeline_destroy(&pipeline);
+  CHECK(probe_destroyed == 1);
+
+  /* A stage refusing the stream undoes the ones started before it. */
+  stage_pipeline_init(&pipeline);
+  CHECK(stage_pipeline_add(&pipeline, &probe_stage, NULL) == 0);
+  CHECK(stage_pipeline_add(&pipeline, &refuse_stage, NULL) == 0);
+  CHECK(stage_pipeline_start(&pipeline, &format) < 0 && errno == ENODEV);
+  CHECK(strstr(pipeline.error, "refuse") != NULL && probe_destroyed == 2);
+  stage_pipeline_destroy(&pipeline);
+  CHECK(probe_destroyed == 2);
+
+  /* The example plugin, loaded with dlopen, on mapped sim buffers. */
+  stage_pipeline_init(&pipeline);
+  CHECK(stage_pipeline_load(&pipeline, "plugins/missing.so", NULL) < 0 &&
+        pipeline.error[0] != '\0');
+  CHECK(stage_pipeline_load(&pipeline, "plugins/exposure_meter.so", "0") ==
+        0);
+  CHECK(pipeline.count == 1 &&
+        strcmp(pipeline.stages[0].descriptor->name, "exposure_meter") == 0);
+  v4l2_sim_reset(&config);
+  setup_camera(&params, V4L2_PIX_FMT_GREY, CAMERA_DEFAULT_BUFFERS);
+  CHECK(stage_pipeline_start(&pipeline, &params.capture_format) == 0);
+  activate_streaming(&params);
+  for (i = 0; i < 5; i++) {
+    get_frame(&params);
+    view.data = params.buffer_start;
+    view.bytes = params.buffer.bytesused;
+    view.format = &params.capture_format;
+    view.plane_count = 1;
+    view.planes[0].data = view.data;
+    view.planes[0].bytes = view.bytes;
+    metadata.sequence = params.buffer.sequence;
+    metadata.index = params.buffer.index;
+    metadata.flags = params.buffer.flags;
+    metadata.timestamp_us =
+        (uint64_t)params.buffer.timestamp.tv_sec * 1000000 +
+        (uint64_t)params.buffer.timestamp.tv_usec;
+    stage_pipeline_run(&pipeline, &view, &metadata);
+    release_frame(&params);
+  }
+  deactivate_streaming(&params);
+  teardown_camera(&params);
+  CHECK(pipeline.stages[0].frames == 5 && pipeline.stages[0].errors == 0);
+  CHECK(pipeline.stages[0].process_ns_avg > 0);
+  stage_pipeline_destroy(&pipeline);
+}
+
+/**
+ * @brief Replace a file's content and give it a modification time of its
+ * own, so a reread notices even within one clock tick.
+ */
+static int write_rules(const char *path, const char *text, time_t mtime) {
+  struct timespec times[2] = {{mtime, 0}, {mtime, 0}};
+  int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+
+  if (fd < 0) {
+    return -1;
+  }
+  if (write_full(fd, text, strlen(text)) < 0 || close(fd) < 0) {
+    return -1;
+  }
+  return utimensat(AT_FDCWD, path, times, 0);
+}
+
+/**
+ * @brief Compile a program into an engine and run it once.
+ */
+static int run_rules(struct rule_engine_t *engine, const char *source) {
+  struct rule_program_t program;
+  char error[128];
+
+  if (rule_compile(source, &program, error, sizeof(error)) < 0) {
+    return -2;
+  }
+  rule_engine_load(engine, &program);
+  return rule_run(engine);
+}
+
+/**
+ * @brief Value of a variable of the engine's program.
+ */
+static double rule_value(const struct rule_engine_t *engine,
+                         const char *name) {
+  int slot = rule_variable(&engine->program, name);
+
+  return slot < 0 ? NAN : engine->values[slot];
+}
+
+static void test_rule(void) {
+  static const char *const broken[] = {
+      "x = (1 + 2", "x = 1 2", "if x y = 1", "x = foo(1)", "= 3", "x = 1 +",
+  };
+  struct rule_engine_t engine;
+  struct rule_program_t program;
+  struct rule_cache_t cache;
+  const struct rule_program_t *first;
+  const struct rule_program_t *second;
+  struct v4l2_format format;
+  struct stage_view_t view;
+  struct stage_metadata_t metadata;
+  struct rule_stage_t *stage;
+  void *state;
+  char rules[64];
+  char base[64];
+  char args[160];
+  char path[96];
+  char error[128];
+  uint8_t *frame = malloc(128 * 96);
+  uint8_t saved[16];
+  struct stat st;
+  unsigned int i;
+  int fd;
+
+  CHECK(frame != NULL);
+
+  /* Precedence, associativity, functions and the ternary. */
+  rule_engine_init(&engine, 0);
+  CHECK(rule_run(&engine) == 0);
+  CHECK(run_rules(&engine, "x = 1 + 2 * 3 - 8 / 4 / 2   # 6\n"
+                           "y = -x % 4 + max(min(x, 2), abs(-1.5))\n"
+                           "z = x >= 6 && x != 7 ? 10 : 20\n"
+                           "w = !(x < 6) == 1; v = 2 <= 1 || 3 > 2") == 0);
+  CHECK(rule_value(&engine, "x") == 6 && rule_value(&engine, "y") == 0);
+  CHECK(rule_value(&engine, "z") == 10 && rule_value(&engine, "w") == 1);
+  CHECK(rule_value(&engine, "v") == 1);
+
+  /* && and || skip their right side, and "if" its assignment. */
+  CHECK(run_rules(&engine, "a = 0 && 1 / zero; b = 2 || 1 / zero\n"
+                           "if zero then c = 1 / zero\n"
+                           "if b then d = b * 3") == 0);
+  CHECK(rule_value(&engine, "a") == 0 && rule_value(&engine, "b") == 1);
+  CHECK(rule_value(&engine, "c") == 0 && rule_value(&engine, "d") == 3);
+  CHECK(engine.errors == 0);
+  CHECK(run_rules(&engine, "e = 1; f = e / zero; g = 1") < 0 &&
+        errno == EDOM);
+  CHECK(engine.errors == 1 && rule_value(&engine, "e") == 1 &&
+        rule_value(&engine, "g") == 0);
+
+  /* Variables carry over between runs and across a reload by name. */
+  CHECK(run_rules(&engine, "n = n + 1") == 0 && rule_run(&engine) == 0);
+  CHECK(rule_value(&engine, "n") == 2);
+  CHECK(run_rules(&engine, "m = 5; n = n * m") == 0);
+  CHECK(rule_value(&engine, "n") == 10);
+
+  /* Errors name the line. */
+  for (i = 0; i < sizeof(broken) / sizeof(broken[0]); i++) {
+    CHECK(rule_compile(broken[i], &program, error, sizeof(error)) < 0 &&
+          errno == EINVAL && strncmp(error, "line 1: ", 8) == 0);
+  }
+  CHECK(rule_compile("x = 1\n# note\n\ny = ) ", &program, error,
+                     sizeof(error)) < 0);
+  CHECK(strncmp(error, "line 4: ", 8) == 0);
+
+  /* The budget stops a run, keeping what it assigned. */
+  rule_engine_init(&engine, 5);
+  CHECK(run_rules(&engine, "a = 1; b = 2; c = 3") < 0 && errno == ETIME);
+  CHECK(engine.overruns == 1 && engine.instructions_max == 6);
+  CHECK(rule_value(&engine, "b") == 2 && rule_value(&engine, "c") == 0);
+
+  /* The cache compiles a source once. */
+  rule_cache_init(&cache);
+  CHECK(rule_cache_compile(&cache, "x = 1", &first, error, sizeof(error)) ==
+        0);
+  CHECK(rule_cache_compile(&cache, "x = 2", &second, error, sizeof(error)) ==
+        0);
+  CHECK(rule_cache_compile(&cache, "x = 1", &second, error, sizeof(error)) ==
+        0);
+  CHECK(first == second && cache.hits == 1 && cache.compiles == 2);
+  CHECK(rule_cache_compile(&cache, "x = (", &second, error, sizeof(error)) <
+        0);
+  rule_cache_destroy(&cache);
+
+  /* As a stage: every other frame saved, cropped to a 4x3 region. */
+  memset(&format, 0, sizeof(format));
+  format.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  format.fmt.pix.width = 128;
+  format.fmt.pix.height = 96;
+  format.fmt.pix.pixelformat = V4L2_PIX_FMT_GREY;
+  format.fmt.pix.bytesperline = 128;
+  for (i = 0; i < 128 * 96; i++) {
+    frame[i] = (uint8_t)(i % 128 + i / 128);
+  }
+  snprintf(rules, sizeof(rules), "%s/capture.rules", scratch_dir);
+  snprintf(base, sizeof(base), "%s/rule.grey", scratch_dir);
+  snprintf(args, sizeof(args), "%s:%s", rules, base);
+  CHECK(write_rules(rules, "if frame % 2 == 0 then save = 1\n"
+                           "roi_x = 2; roi_y = 1; roi_w = 4; roi_h = 3\n",
+                    1000) == 0);
+  CHECK(rule_stage.init(&state, &format, "no-colon") < 0 && errno == EINVAL);
+  CHECK(rule_stage.init(&state, &format, args) == 0);
+  stage = state;
+  view.data = frame;
+  view.bytes = 128 * 96;
+  view.format = &format;
+  view.plane_count = 1;
+  view.planes[0].data = view.data;
+  view.planes[0].bytes = view.bytes;
+  metadata.index = 0;
+  metadata.flags = 0;
+  for (i = 0; i < 4; i++) {
+    metadata.sequence = i;
+    metadata.timestamp_us = 5000000 + i * 100000;
+    CHECK(rule_stage.process(state, &view, &metadata) == 0);
+  }
+  CHECK(stage->frames == 4 && stage->saved == 2);
+  /* Written behind the stage's back. */
+  rule_stage_drain(stage);
+  CHECK(stage->save_errors == 0);
+  numbered_path(path, sizeof(path), base, 1);
+  fd = open(path, O_RDONLY);
+  CHECK(fd >= 0 && read(fd, saved, sizeof(saved)) == 12);
+  close(fd);
+  CHECK(saved[0] == 3 && saved[3] == 6 && saved[4] == 4 && saved[11] == 8);
+
+  /* A version that does not compile is reported and skipped; the next
+   * good one is picked up within a second. */
+  CHECK(write_rules(rules, "save = (\n", 2000) == 0);
+  metadata.sequence = 4;
+  metadata.timestamp_us = 6100000;
+  CHECK(rule_stage.process(state, &view, &metadata) == 0);
+  CHECK(stage->reload_errors == 1 && stage->saved == 3);
+  CHECK(write_rules(rules, "save = dropped > 0 && luma > 20\n", 3000) == 0);
+  metadata.sequence = 6;
+  metadata.timestamp_us = 7200000;
+  CHECK(rule_stage.process(state, &view, &metadata) == 0);
+  CHECK(stage->reloads == 1 && stage->saved == 4);
+  rule_stage_drain(stage);
+  numbered_path(path, sizeof(path), base, 3);
+  CHECK(stat(path, &st) == 0 && st.st_size == 128 * 96);
+  rule_stage.destroy(state);
+  free(frame);
+}
+
+static void test_mapping(void) {
+  struct camera_params_t params;
+  struct mapping_info_t info;
+  uint8_t *source;
+  uint8_t *copy;
+  size_t i;
+
+  /* Copies of any length and alignment, through memcpy() for cached
+   * mappings and the wide loads for uncached ones. */
+  source = malloc(300000);
+  copy = malloc(300000);
+  CHECK(source != NULL && copy != NULL);
+  for (i = 0; i < 300000; i++) {
+    source[i] = (uint8_t)(i * 7 + i / 251);
+  }
+  for (i = 0; i < 8; i++) {
+    size_t bytes = i % 4 == 0 ? 61 : i % 2 ? 65536 + 37 : 299980 - i;
+    enum mapping_kind_t kind = i < 4 ? MAPPING_CACHED : MAPPING_UNCACHED;
+
+    memset(copy, 0, 300000);
+    mapping_copy(copy + i * 3, source + i, bytes, kind);
+    CHECK(memcmp(copy + i * 3, source + i, bytes) == 0);
+    CHECK(copy[i * 3 + bytes] == 0);
+  }
+
+  /* Ordinary memory and the simulated buffers are cached. */
+  CHECK(mapping_probe(source, 300000, &info) == 0);
+  CHECK(info.kind == MAPPING_CACHED && !info.pfn && !info.io);
+  CHECK(info.read_mbps > 0 && info.reference_mbps > 0);
+  free(source);
+  free(copy);
+  v4l2_sim_reset(NULL);
+  setup_camera(&params, V4L2_PIX_FMT_YUYV, 2);
+  CHECK(mapping_probe(params.buffers[1].start, params.buffers[1].length,
+                      &info) == 0);
+  CHECK(info.kind == MAPPING_CACHED);
+  teardown_camera(&params);
+}
+
+/**
+ * @brief Drop the hold of consumer 1 after a while, for test_frame_share().
+ */
+static void *let_go_later(void *arg) {
+  usleep(60000);
+  frame_handle_put(arg, 1);
+  return NULL;
+}
+
+static void test_frame_share(void) {
+  struct v4l2_sim_config_t config = {.fps = 500};
+  struct camera_params_t params;
+  struct frame_share_t share;
+  struct frame_handle_t *first;
+  struct frame_handle_t *second;
+  struct frame_handle_t *frame;
+  pthread_t thread;
+  int capture;
+  int slow;
+
+  v4l2_sim_reset(&config);
+  setup_camera(&params, V4L2_PIX_FMT_MJPEG, 2);
+  frame_share_init(&share, &params);
+  capture = frame_share_consumer(&share, "capture");
+  slow = frame_share_consumer(&share, "slow");
+  CHECK(capture == 0 && slow == 1);
+  CHECK(frame_watchdog_start(&share, 20) == 0);
+  activate_streaming(&params);
+
+  /* Handed on in place, back to the driver with the last hold only. */
+  first = frame_share_dequeue(&share, (unsigned int)capture);
+  CHECK(first->data == params.buffers[first->index].start);
+  CHECK(first->buffer.bytesused > 0 && params.buffer_start == NULL);
+  frame_handle_get(first, (unsigned int)slow);
+  CHECK(atomic_load(&first->refs) == 2 && atomic_load(&first->holders) == 3);
+  frame_handle_put(first, (unsigned int)capture);
+  CHECK(atomic_load(&share.requeues) == 0);
+  CHECK(atomic_load(&share.outstanding) == 1);
+  frame = frame_share_dequeue(&share, (unsigned int)capture);
+  CHECK(frame->index != first->index);
+  frame_handle_put(frame, (unsigned int)capture);
+  CHECK(atomic_load(&share.requeues) == 1);
+
+  /* Both buffers out: the next dequeue waits for the slow consumer, which
+   * the watchdog names once. */
+  frame = frame_share_dequeue(&share, (unsigned int)capture);
+  CHECK(pthread_create(&thread, NULL, let_go_later, first) == 0);
+  frame_handle_put(frame, (unsigned int)capture);
+  second = frame_share_dequeue(&share, (unsigned int)capture);
+  CHECK(atomic_load(&share.outstanding) == 2);
+  frame = frame_share_dequeue(&share, (unsigned int)capture);
+  pthread_join(thread, NULL);
+  CHECK(frame->index == first->index);
+  CHECK(atomic_load(&share.stalls) == 1);
+  CHECK(atomic_load(&share.overdue_by[slow]) == 1);
+  CHECK(atomic_load(&share.held_ns_max) >= 60000000LL);
+  frame_handle_put(second, (unsigned int)capture);
+
+  /* Closing waits for the last hold. */
+  frame_handle_get(frame, (unsigned int)slow);
+  frame_handle_put(frame, (unsigned int)capture);
+  CHECK(pthread_create(&thread, NULL, let_go_later, frame) == 0);
+  frame_share_close(&share);
+  CHECK(atomic_load(&share.outstanding) == 0);
+  CHECK(atomic_load(&share.requeues) == 5);
+  pthread_join(thread, NULL);
+  deactivate_streaming(&params);
+  teardown_camera(&params);
+}
+
+static void test_dmabuf(void) {
+  struct v4l2_sim_config_t config = {.fps = 500};
+  struct v4l2_sim_stats_t stats;
+  struct camera_params_t params;
+  struct dmabuf_set_t set;
+  struct frame_share_t share;
+  struct frame_handle_t *frame;
+  unsigned long syncs;
+  int fd;
+  int i;
+
+  /* Exported read-only: the same memory, but not for writing. */
+  v4l2_sim_reset(&config);
+  setup_camera(&params, V4L2_PIX_FMT_YUYV, 2);
+  CHECK(dmabuf_export(&set, &params, DMABUF_READ) == 0);
+  CHECK(set.count == 2 && set.buffers[1].fd >= 0);
+  CHECK(set.buffers[1].length == params.buffers[1].length);
+  memset(params.buffers[1].start, 0x5a, 4096);
+  CHECK(((const uint8_t *)set.buffers[1].start)[4095] == 0x5a);
+  CHECK(mmap(NULL, 4096, PROT_READ | PROT_WRITE, MAP_SHARED,
+             set.buffers[1].fd, 0) == MAP_FAILED &&
+        errno == EACCES);
+  CHECK(dmabuf_begin(&set.buffers[1], DMABUF_WRITE) < 0 && errno == EACCES);
+
+  /* Brackets are counted; one ended twice, one open at QBUF are not
+   * brackets. */
+  CHECK(dmabuf_begin(&set.buffers[1], DMABUF_READ) == 0);
+  CHECK(dmabuf_end(&set.buffers[1], DMABUF_READ) == 0);
+  v4l2_sim_get_stats(&stats);
+  CHECK(stats.calls[V4L2_SIM_OP_EXPBUF] == 2);
+  CHECK(stats.syncs == 2 && stats.sync_errors == 0);
+  CHECK(dmabuf_end(&set.buffers[1], DMABUF_READ) == 0);
+  CHECK(dmabuf_begin(&set.buffers[0], DMABUF_READ) == 0);
+  queue_buffer(&params, 0);
+  CHECK(dmabuf_end(&set.buffers[0], DMABUF_READ) == 0);
+  v4l2_sim_get_stats(&stats);
+  CHECK(stats.sync_errors == 2);
+  fd = set.buffers[0].fd;
+  dmabuf_release(&set);
+  CHECK(set.count == 0 && !v4l2_sim_owns_fd(fd));
+  teardown_camera(&params);
+
+  /* Shared frames read through them, each bracketed once however many
+   * consumers hold it. */
+  v4l2_sim_reset(&config);
+  setup_camera(&params, V4L2_PIX_FMT_YUYV, 2);
+  frame_share_init(&share, &params);
+  CHECK(frame_share_consumer(&share, "capture") == 0);
+  CHECK(frame_share_consumer(&share, "reader") == 1);
+  CHECK(frame_share_use_dmabuf(&share) == 0);
+  CHECK(share.mapping.kind == MAPPING_CACHED);
+  v4l2_sim_get_stats(&stats);
+  syncs = stats.syncs;
+  activate_streaming(&params);
+  for (i = 0; i < 10; i++) {
+    frame = frame_share_dequeue(&share, 0);
+    CHECK(frame->data == share.dmabuf.buffers[frame->index].start);
+    CHECK(frame->data != params.buffers[frame->index].start);
+    frame_handle_get(frame, 1);
+    frame_handle_put(frame, 0);
+    CHECK(((const uint8_t *)frame->data)[0] ==
+          ((const uint8_t *)params.buffers[frame->index].start)[0]);
+    frame_handle_put(frame, 1);
+  }
+  fd = share.dmabuf.buffers[0].fd;
+  frame_share_close(&share);
+  CHECK(!v4l2_sim_owns_fd(fd));
+  v4l2_sim_get_stats(&stats);
+  CHECK(stats.syncs - syncs == 20 && stats.sync_errors == 0);
+  deactivate_streaming(&params);
+  teardown_camera(&params);
+}
+
+/**
+ * @brief Whether two files of the scratch directory hold the same bytes,
+ * and that many.
+ */
+static int files_equal(const char *a, const char *b, size_t bytes) {
+  uint8_t *data[2];
+  const char *names[2] = {a, b};
+  char path[96];
+  int equal = 1;
+  int i;
+
+  for (i = 0; i < 2; i++) {
+    FILE *file;
+
+    snprintf(path, sizeof(path), "%s/%s", scratch_dir, names[i]);
+    data[i] = malloc(bytes + 1);
+    file = fopen(path, "rb");
+    if (data[i] == NULL || file == NULL ||
+        fread(data[i], 1, bytes + 1, file) != bytes) {
+      equal = 0;
+    }
+    if (file != NULL) {
+      fclose(file);
+    }
+  }
+  equal = equal && memcmp(data[0], data[1], bytes) == 0;
+  free(data[0]);
+  free(data[1]);
+  return equal;
+}
+
+static void test_multiplanar(void) {
+  struct v4l2_sim_config_t config = {.fps = 500, .mplane = 1};
+  const struct camera_mode_t preview = {640, 480, V4L2_PIX_FMT_NV12M, 2};
+  const struct camera_mode_t still = {1280, 720, V4L2_PIX_FMT_YUV420M, 2};
+  struct burst_config_t burst = {
+      .frames = 2, .pixelformat = V4L2_PIX_FMT_NV12M, .writers = 2};
+  struct recorder_config_t record = {.duration_ms = 50};
+  struct recorder_stats_t record_stats;
+  struct mode_switcher_t switcher;
+  const struct mode_pool_t *pool;
+  struct camera_params_t params;
+  struct v4l2_format format;
+  size_t payload;
+  char base[64];
+  struct dmabuf_set_t set;
+  struct frame_share_t share;
+  struct frame_handle_t *frame;
+  const uint8_t *chroma;
+  char path[64];
+  struct stat st;
+
+  /* Only offered by a multi-planar device. */
+  v4l2_sim_reset(NULL);
+  open_camera_device(&params, SIM_DEV_PATH);
+  CHECK(params.buffer_type == V4L2_BUF_TYPE_VIDEO_CAPTURE);
+  CHECK(try_video_format(&params, 1920, 1080, V4L2_PIX_FMT_NV12M, &format,
+                         NULL) < 0);
+  close_camera_device(&params);
+
+  v4l2_sim_reset(&config);
+  open_camera_device(&params, SIM_DEV_PATH);
+  CHECK(params.buffer_type == V4L2_BUF_TYPE_VIDEO_CAPTURE_MPLANE);
+  CHECK(try_video_format(&params, 640, 480, V4L2_PIX_FMT_YUV420M, &format,
+                         &payload) == 0);
+  CHECK(payload == 640 * 480 * 3 / 2);
+  CHECK(format.type == V4L2_BUF_TYPE_VIDEO_CAPTURE);
+  CHECK(format.fmt.pix.bytesperline == 640 &&
+        format.fmt.pix.sizeimage == 640 * 480);
+  close_camera_device(&params);
+
+  /* A mapping per plane, each with its own payload and stride. */
+  setup_camera(&params, V4L2_PIX_FMT_NV12M, 2);
+  CHECK(params.plane_count == 2);
+  CHECK(params.capture_format.fmt.pix.pixelformat == V4L2_PIX_FMT_NV12M);
+  CHECK(plane_bytesperline(&params, 0) == 1920 &&
+        plane_bytesperline(&params, 1) == 1920);
+  CHECK(params.planes[1][0].start == params.buffers[1].start);
+  CHECK(params.planes[1][1].length >= 1920 * 540);
+  activate_streaming(&params);
+  get_frame(&params);
+  CHECK(params.buffer.bytesused == 1920 * 1080);
+  CHECK(params.buffer_planes[1].bytesused == 1920 * 540);
+  chroma = params.planes[params.buffer.index][1].start;
+  CHECK(chroma[0] == 128 && chroma[1920 * 540 - 1] == 128);
+  snprintf(path, sizeof(path), "%s/nv12m.yuv", scratch_dir);
+  save_to_image(&params, path);
+  CHECK(stat(path, &st) == 0 && st.st_size == 1920 * 1080 * 3 / 2);
+  release_frame(&params);
+  deactivate_streaming(&params);
+  teardown_camera(&params);
+
+  /* Behind a header the driver puts before each plane, payloads start past
+   * it and leave it out of their size. */
+  config.data_offset = 256;
+  v4l2_sim_reset(&config);
+  setup_camera(&params, V4L2_PIX_FMT_NV12M, 2);
+  activate_streaming(&params);
+  get_frame(&params);
+  CHECK(params.buffer_planes[1].data_offset == 256);
+  CHECK(params.buffer.bytesused == 1920 * 1080 &&
+        params.buffer_planes[1].bytesused == 1920 * 540);
+  CHECK((uint8_t *)params.buffer_start ==
+        (uint8_t *)params.buffers[params.buffer.index].start + 256);
+  CHECK(((const uint8_t *)params.buffer_start)[1] ==
+        (uint8_t)(7 + params.buffer.index));
+  chroma = plane_payload(&params, 1);
+  CHECK(chroma == (const uint8_t *)params.planes[params.buffer.index][1].start +
+                      256);
+  CHECK(chroma[0] == 128 && chroma[1920 * 540 - 1] == 128);
+  save_to_image(&params, path);
+  CHECK(stat(path, &st) == 0 && st.st_size == 1920 * 1080 * 3 / 2);
+  release_frame(&params);
+  deactivate_streaming(&params);
+  teardown_camera(&params);
+  config.data_offset = 0;
+  v4l2_sim_reset(&config);
+  setup_camera(&params, V4L2_PIX_FMT_NV12M, 2);
+
+  /* Shared frames carry every plane; dma-bufs are single-planar only. */
+  CHECK(dmabuf_export(&set, &params, DMABUF_READ) < 0 && errno == EINVAL);
+  frame_share_init(&share, &params);
+  CHECK(frame_share_consumer(&share, "capture") == 0);
+  activate_streaming(&params);
+  frame = frame_share_dequeue(&share, 0);
+  CHECK(frame->plane_data[1] == params.planes[frame->index][1].start);
+  CHECK(frame->planes[0].bytesused == 1920 * 1080 &&
+        frame->planes[1].bytesused == 1920 * 540);
+  CHECK(frame->buffer.m.planes == frame->planes);
+  frame_handle_put(frame, 0);
+  frame_share_close(&share);
+  deactivate_streaming(&params);
+
+  /* Recordings keep every plane, one frame after the other. */
+  CHECK(payload_size(&params) == 1920 * 1080 * 3 / 2);
+  snprintf(base, sizeof(base), "%s/nv12m-rec.yuv", scratch_dir);
+  record.output_path = base;
+  CHECK(run_recorder(&params, &record, &record_stats) == 0);
+  CHECK(record_stats.frames_written > 0);
+  numbered_path(path, sizeof(path), base, 0);
+  CHECK(stat(path, &st) == 0 &&
+        st.st_size ==
+            (off_t)record_stats.frames_written * 1920 * 1080 * 3 / 2);
+  teardown_camera(&params);
+
+  /* So do burst files. */
+  open_camera_device(&params, SIM_DEV_PATH);
+  snprintf(base, sizeof(base), "%s/nv12m-burst.yuv", scratch_dir);
+  burst.output_path = base;
+  CHECK(run_burst(&params, &burst, NULL) == 0);
+  teardown_camera(&params);
+  numbered_path(path, sizeof(path), base, 1);
+  CHECK(stat(path, &st) == 0 &&
+        st.st_size == BURST_WIDTH * BURST_HEIGHT * 3 / 2);
+
+  /* And stills kept across a mode switch. */
+  open_camera_device(&params, SIM_DEV_PATH);
+  CHECK(mode_switcher_init(&switcher, &params, &preview, &still) == 0);
+  CHECK(switcher.pools[CAMERA_MODE_STILL].capacity == 1280 * 720 * 3 / 2);
+  mode_switch(&switcher, CAMERA_MODE_PREVIEW, NULL);
+  pool = mode_switcher_take_still(&switcher, NULL);
+  CHECK(pool->bytes == 1280 * 720 * 3 / 2);
+  CHECK(((const uint8_t *)pool->data)[1280 * 720] == 128 &&
+        ((const uint8_t *)pool->data)[pool->bytes - 1] == 128);
+  mode_switcher_destroy(&switcher);
+  close_camera_device(&params);
+}
+
+/**
+ * @brief The cache file as media_graph.c writes it.
+ */
+struct media_cache_file_t {
+  __u32 magic;
+  __u32 size;
+  struct media_graph_route_t route;
+};
+
+/**
+ * @brief Whether a setup of the request comes from the cache.
+ */
+static int media_setup_cached(const struct media_graph_request_t *request) {
+  struct media_graph_route_t route;
+
+  return media_graph_setup(request, &route) == 0 && route.cached;
+}
+
+/**
+ * @brief Rewrite the cache file in place through an edit of its route.
+ */
+static void edit_media_cache(const char *path, const char *bus_info,
+                             const char *devnode) {
+  struct media_cache_file_t cache;
+  int fd = open(path, O_RDWR);
+
+  CHECK(fd >= 0 && read(fd, &cache, sizeof(cache)) == sizeof(cache));
+  if (bus_info != NULL) {
+    snprintf(cache.route.bus_info, sizeof(cache.route.bus_info), "%s",
+             bus_info);
+  }
+  if (devnode != NULL) {
+    snprintf(cache.route.pads[0].devnode, sizeof(cache.route.pads[0].devnode),
+             "%s", devnode);
+  }
+  CHECK(pwrite(fd, &cache, sizeof(cache), 0) == sizeof(cache));
+  close(fd);
+}
+
+/**
+ * @brief The setup cache is only trusted when nobody else could have
+ * written it, names subdevs only, and comes from the same media device.
+ */
+static void test_media_cache(const struct media_graph_request_t *request,
+                             const char *cache_path) {
+  struct stat status;
+  char staging[128];
+  char victim[96];
+  char dir[96];
+  char path[128];
+  int fd;
+
+  CHECK(media_setup_cached(request));
+
+  /* Writable by others: walked again, and stored back private. */
+  CHECK(chmod(cache_path, 0666) == 0);
+  CHECK(!media_setup_cached(request));
+  CHECK(stat(cache_path, &status) == 0 && (status.st_mode & 0777) == 0600);
+  CHECK(media_setup_cached(request));
+
+  /* A link planted on the staging file is replaced, not written through. */
+  snprintf(victim, sizeof(victim), "%s/victim", scratch_dir);
+  fd = open(victim, O_WRONLY | O_CREAT | O_TRUNC, 0644);
+  CHECK(fd >= 0 && write(fd, "keep", 4) == 4);
+  close(fd);
+  snprintf(staging, sizeof(staging), "%s.%ld.tmp", cache_path,
+           (long)getpid());
+  CHECK(symlink(victim, staging) == 0);
+  CHECK(chmod(cache_path, 0622) == 0);
+  CHECK(!media_setup_cached(request));
+  CHECK(stat(victim, &status) == 0 && status.st_size == 4);
+  CHECK(access(staging, F_OK) < 0 && media_setup_cached(request));
+  unlink(victim);
+
+  /* Anything but a subdev node to open, or another media device. */
+  edit_media_cache(cache_path, NULL, "/dev/sda");
+  CHECK(!media_setup_cached(request));
+  edit_media_cache(cache_path, "platform:other-csi", NULL);
+  CHECK(!media_setup_cached(request));
+  CHECK(media_setup_cached(request));
+
+  /* The cache directory is made private, and refused when it is not. */
+  setenv("XDG_CACHE_HOME", scratch_dir, 1);
+  snprintf(dir, sizeof(dir), "%s/%s", scratch_dir, MEDIA_GRAPH_CACHE_DIR);
+  CHECK(media_graph_cache_path(path, sizeof(path)) == 0);
+  CHECK(strncmp(path, dir, strlen(dir)) == 0);
+  CHECK(stat(dir, &status) == 0 && (status.st_mode & 0777) == 0700);
+  CHECK(chmod(dir, 0775) == 0);
+  CHECK(media_graph_cache_path(path, sizeof(path)) < 0 && errno == EPERM);
+  unsetenv("XDG_CACHE_HOME");
+  rmdir(dir);
+}
+
+static void test_media_graph(void) {
+  struct v4l2_sim_config_t config = {.fps = 500,
+                                     .media_path = SIM_MEDIA_PATH,
+                                     .subdev_path = "/dev/v4l-subdev0"};
+  struct media_graph_request_t request = {
+      .media_path = SIM_MEDIA_PATH,
+      .sensor = "ov5647",
+      .width = 1920,
+      .height = 1080,
+      .code = media_graph_bus_code(V4L2_PIX_FMT_SBGGR10),
+  };
+  static struct media_graph_t graph;
+  struct media_graph_route_t route;
+  struct v4l2_sim_stats_t stats;
+  struct camera_params_t params;
+  enum v4l2_buf_type type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+  const struct media_v2_entity *sensor;
+  unsigned long topology_reads;
+  char cache_path[64];
+  char devnode[MEDIA_GRAPH_NAME_LENGTH];
+  int media_fd;
+
+  snprintf(cache_path, sizeof(cache_path), "%s/media.cache", scratch_dir);
+  request.cache_path = cache_path;
+  v4l2_sim_reset(&config);
+
+  /* The topology names the sensor and its subdev node. */
+  media_fd = open(SIM_MEDIA_PATH, O_RDWR);
+  CHECK(media_graph_read(&graph, media_fd) == 0);
+  CHECK(graph.entity_count == 2 && graph.link_count == 3);
+  sensor = media_graph_find(&graph, "ov5647");
+  CHECK(sensor != NULL && strcmp(sensor->name, "ov5647 10-0036") == 0);
+  CHECK(media_graph_find(&graph, "ov56") == NULL);
+  CHECK(media_graph_devnode(&graph, sensor->id, devnode, sizeof(devnode)) ==
+        0);
+  CHECK(strcmp(devnode, "/dev/v4l-subdev0") == 0);
+  close(media_fd);
+
+  /* The video node refuses to stream until the graph is set up. */
+  setup_camera(&params, V4L2_PIX_FMT_SBGGR10, 2);
+  queue_buffer(&params, 0);
+  CHECK(ioctl(params.device_fs, VIDIOC_STREAMON, &type) < 0 &&
+        errno == EPIPE);
+
+  CHECK(media_graph_setup(&request, &route) == 0);
+  CHECK(!route.cached && route.link_count == 1 && route.links_enabled == 1);
+  CHECK(route.pads_set == 1 && route.format.width == 1920 &&
+        route.format.height == 1080 &&
+        route.format.code == MEDIA_BUS_FMT_SBGGR10_1X10);
+  v4l2_sim_get_stats(&stats);
+  CHECK(stats.calls[V4L2_SIM_OP_SETUP_LINK] == 1 &&
+        stats.calls[V4L2_SIM_OP_SUBDEV_S_FMT] == 1);
+  topology_reads = stats.calls[V4L2_SIM_OP_G_TOPOLOGY];
+
+  /* Nothing changed: the cache only checks the version. */
+  CHECK(media_graph_setup(&request, &route) == 0);
+  CHECK(route.cached && route.links_enabled == 0 && route.pads_set == 0);
+  CHECK(route.format.width == 1920 && route.format.height == 1080);
+  v4l2_sim_get_stats(&stats);
+  CHECK(stats.calls[V4L2_SIM_OP_G_TOPOLOGY] == topology_reads + 1);
+  CHECK(stats.calls[V4L2_SIM_OP_SUBDEV_S_FMT] == 1);
+
+  queue_buffer(&params, 1);
+  start_streaming(&params);
+  get_frame(&params);
+  CHECK(params.buffer.bytesused > 0);
+  release_frame(&params);
+  deactivate_streaming(&params);
+  teardown_camera(&params);
+
+  test_media_cache(&request, cache_path);
+
+  /* A cached setup for another size sets the sensor again. */
+  request.width = 640;
+  request.height = 480;
+  CHECK(media_graph_setup(&request, &route) == 0);
+  CHECK(!route.cached && route.pads_set == 1 && route.format.width == 640);
+
+  request.sensor = "imx219";
+  CHECK(media_graph_setup(&request, &route) < 0 && errno == ENODEV);
+}
+
+static void test_graph(void) {
+  static const struct {
+    const char *text;
+    const char *error;
+  } broken[] = {
+      {"[cam]\ntype = source\ndevice = /dev/video0\nwidth = 0\n",
+       "line 4: width must be"},
+      {"[cam]\ntype = camera\n", "line 2: unknown type"},
+      {"[cam]\ntype = source\n", "line 1: [cam] needs device"},
+      {"[cam]\ntype = source\ndevice = x\ninput = cam\n",
+       "line 4: source takes no input"},
+      {"[a]\ntype = plugin\ninput = b\npath = x\n"
+       "[b]\ntype = plugin\ninput = a\npath = x\n",
+       "line 1: [a] is part of a cycle"},
+      {"[p]\ntype = plugin\ninput = p\npath = x\n", "part of a cycle"},
+      {"# nothing\n", "no source"},
+      {"[cam]\ntype = source\ndevice = x\n"
+       "[a]\ntype = plugin\ninput = b\npath = x\n"
+       "[b]\ntype = plugin\ninput = a\npath = x\n",
+       "line 4: [a] is part of a cycle"},
+      {"[cam]\ntype = source\ndevice = x\n"
+       "[out]\ntype = file\ninput = cam\npath = x\n"
+       "[more]\ntype = file\ninput = out\npath = y\n",
+       "line 10: out is a file"},
+      {"[cam]\ntype = source\ndevice = x\n[cam]\n", "line 4: [cam] declared"},
+      {"[cam]\ntype = source\ndevice = x\nformat = rgb\n",
+       "line 4: unknown format"},
+      {"[cam]\ntype = source\ndevice = x\n"
+       "[out]\ntype = file\ninput = nowhere\npath = x\n",
+       "line 6: no node named nowhere"},
+      {"threads = 2\n", "line 1: setting outside"},
+      {"[graph]\nthreads = 99\n", "line 2: threads must be"},
+      {"[cam]\ntype = source\ndevice = x\naccess = userptr\n",
+       "line 4: unknown access"},
+  };
+  struct v4l2_sim_config_t config = {.fps = 200};
+  struct v4l2_sim_stats_t stats;
+  struct raw_archive_reader_t reader;
+  struct raw_frame_t raw;
+  struct graph_t graph;
+  char text[1024];
+  char path[96];
+  struct stat st;
+  unsigned int i;
+  const struct graph_node_t *cam;
+  const struct graph_node_t *meter;
+  const struct graph_node_t *bright;
+  const struct graph_node_t *disk;
+  const struct graph_node_t *tail;
+  struct graph_node_t *lagging;
+
+  for (i = 0; i < sizeof(broken) / sizeof(broken[0]); i++) {
+    graph_init(&graph);
+    CHECK(graph_parse(&graph, broken[i].text) < 0 && errno == EINVAL);
+    CHECK(strstr(graph.error, broken[i].error) != NULL);
+    graph_destroy(&graph);
+  }
+
+  /* Declared in any order, inputs end up first. Fan-out from the camera
+   * and a chain through the plugin and the tone curve; the tail sink has
+   * a one-frame queue behind a camera that is not paced. */
+  snprintf(text, sizeof(text),
+           "# comment\n"
+           "[graph]\n"
+           "threads = 2\n"
+           "[disk]\n"
+           "type = file  # trailing comment\n"
+           "input = bright\n"
+           "path = %s/graph.grey\n"
+           "queue = 16\n"
+           "[bright]\n"
+           "type = tone_map\n"
+           "input = meter\n"
+           "curve = srgb\n"
+           "pool = 20\n"
+           "queue = 16\n"
+           "[meter]\n"
+           "type = plugin\n"
+           "input = cam\n"
+           "path = plugins/exposure_meter.so\n"
+           "args = 0\n"
+           "queue = 16\n"
+           "[tail]\n"
+           "type = file\n"
+           "input = cam\n"
+           "path = %s/tail.grey\n"
+           "queue = 1\n"
+           "[cam]\n"
+           "type = source\n"
+           "device = %s\n"
+           "format = grey\n"
+           "width = 320\n"
+           "height = 240\n"
+           "count = 30\n",
+           scratch_dir, scratch_dir, SIM_DEV_PATH);
+  graph_init(&graph);
+  CHECK(graph_parse(&graph, text) == 0);
+  CHECK(graph.node_count == 5 && graph.thread_count == 2);
+  cam = &graph.nodes[0];
+  meter = &graph.nodes[1];
+  CHECK(cam->type == GRAPH_SOURCE && meter->type == GRAPH_PLUGIN);
+  CHECK(strcmp(graph.nodes[4].name, "disk") == 0);
+  CHECK(cam->output_count == 2 && meter->input == cam);
+  bright = meter->outputs[0];
+  disk = bright->outputs[0];
+  tail = cam->outputs[0] == meter ? cam->outputs[1] : cam->outputs[0];
+
+  v4l2_sim_reset(&config);
+  CHECK(graph_start(&graph) == 0);
+  graph_wait(&graph);
+  CHECK(cam->frames == 30 && cam->starved == 0);
+  /* Every node got the driver buffers themselves, and gave them back. */
+  CHECK(cam->pool_size == CAMERA_DEFAULT_BUFFERS && cam->pool[0].handle);
+  CHECK(atomic_load(&cam->share->requeues) == 30);
+  CHECK(atomic_load(&cam->share->overdue) == 0);
+  CHECK(meter->frames == 30 && bright->frames == 30 && disk->frames == 30);
+  CHECK(disk->errors == 0 && meter->errors == 0);
+  CHECK(tail->frames + tail->dropped == 30 && tail->queue_max == 1);
+  snprintf(path, sizeof(path), "%s/graph_00000.grey", scratch_dir);
+  CHECK(stat(path, &st) == 0 && st.st_size == 30 * 320 * 240);
+  snprintf(path, sizeof(path), "%s/tail_00000.grey", scratch_dir);
+  CHECK(stat(path, &st) == 0 &&
+        st.st_size == (off_t)tail->frames * 320 * 240);
+  graph_destroy(&graph);
+
+  /* A sink no worker picks up until the capture is over: the frames it
+   * lags behind on are copied out and their buffers requeued, so the
+   * camera never waits, and the sink still gets every frame as it was. */
+  snprintf(text, sizeof(text),
+           "[cam]\ntype = source\ndevice = %s\nformat = grey\n"
+           "width = 320\nheight = 240\ncount = 10\n"
+           "[fast]\ntype = file\ninput = cam\npath = %s/fast.grey\n"
+           "queue = 16\n"
+           "[slow]\ntype = file\ninput = cam\npath = %s/slow.grey\n"
+           "queue = 16\n",
+           SIM_DEV_PATH, scratch_dir, scratch_dir);
+  graph_init(&graph);
+  CHECK(graph_parse(&graph, text) == 0);
+  cam = &graph.nodes[0];
+  lagging = strcmp(graph.nodes[1].name, "slow") == 0 ? &graph.nodes[1]
+                                                     : &graph.nodes[2];
+  lagging->busy = 1;
+  v4l2_sim_reset(&config);
+  CHECK(graph_start(&graph) == 0);
+  pthread_mutex_lock(&graph.lock);
+  for (i = 0; i < 5000 && lagging->queue_count < 10; i++) {
+    pthread_mutex_unlock(&graph.lock);
+    usleep(1000);
+    pthread_mutex_lock(&graph.lock);
+  }
+  lagging->busy = 0;
+  pthread_cond_broadcast(&graph.work);
+  pthread_mutex_unlock(&graph.lock);
+  graph_wait(&graph);
+  CHECK(i < 5000 && lagging->frames == 10 && lagging->dropped == 0);
+  CHECK(cam->detached > 0 && atomic_load(&cam->share->stalls) == 0);
+  CHECK(cam->copy_count == GRAPH_DEFAULT_POOL);
+  graph_destroy(&graph);
+  CHECK(files_equal("fast_00000.grey", "slow_00000.grey", 10 * 320 * 240));
+
+  /* The same through dma-bufs, every frame bracketed. */
+  snprintf(text, sizeof(text),
+           "[cam]\ntype = source\ndevice = %s\nformat = grey\n"
+           "width = 320\nheight = 240\ncount = 10\naccess = dmabuf\n"
+           "[out]\ntype = file\ninput = cam\npath = %s/dmabuf.grey\n"
+           "queue = 16\n",
+           SIM_DEV_PATH, scratch_dir);
+  graph_init(&graph);
+  CHECK(graph_parse(&graph, text) == 0);
+  v4l2_sim_reset(&config);
+  CHECK(graph_start(&graph) == 0);
+  graph_wait(&graph);
+  cam = &graph.nodes[0];
+  CHECK(cam->dmabuf && graph.nodes[1].frames == 10);
+  v4l2_sim_get_stats(&stats);
+  CHECK(stats.syncs == 2 + 2 * 10 && stats.sync_errors == 0);
+  graph_destroy(&graph);
+  snprintf(path, sizeof(path), "%s/dmabuf_00000.grey", scratch_dir);
+  CHECK(stat(path, &st) == 0 && st.st_size == 10 * 320 * 240);
+
+  /* Raw frames through the encoder, read back. A tone curve cannot take
+   * them and says so. */
+  snprintf(text, sizeof(text),
+           "[cam]\ntype = source\ndevice = %s\nformat = raw10\n"
+           "width = 640\nheight = 480\ncount = 6\n"
+           "[craw]\ntype = raw_archive\ninput = cam\n"
+           "[out]\ntype = file\ninput = craw\npath = %s/graph.craw\n"
+           "queue = 8\n",
+           SIM_DEV_PATH, scratch_dir);
+  graph_init(&graph);
+  CHECK(graph_parse(&graph, text) == 0);
+  v4l2_sim_reset(&config);
+  CHECK(graph_start(&graph) == 0);
+  graph_wait(&graph);
+  CHECK(graph.nodes[1].frames == 6 && graph.nodes[2].frames == 6);
+  graph_destroy(&graph);
+  snprintf(path, sizeof(path), "%s/graph_00000.craw", scratch_dir);
+  CHECK(raw_archive_reader_open(&reader, path) == 0);
+  /* The driver skips frames while the encoder holds every buffer. */
+  for (i = 0; i < 6; i++) {
+    CHECK(raw_archive_read(&reader, &raw) == 1);
+    CHECK(raw.width == 640 && raw.height == 480 && raw.sequence >= i);
+  }
+  CHECK(raw_archive_read(&reader, &raw) == 0);
+  raw_archive_reader_close(&reader);
+
+  snprintf(text, sizeof(text),
+           "[cam]\ntype = source\ndevice = %s\nformat = raw10\n"
+           "[tone]\ntype = tone_map\ninput = cam\ncurve = srgb\n",
+           SIM_DEV_PATH);
+  graph_init(&graph);
+  CHECK(graph_parse(&graph, text) == 0);
+  v4l2_sim_reset(&config);
+  CHECK(graph_start(&graph) < 0 && errno == EINVAL);
+  CHECK(strstr(graph.error, "[tone]") != NULL && graph.started == 0);
+  graph_destroy(&graph);
+}
+
+static void test_recorder_rotation(void) {
+  struct v4l2_sim_config_t config = {.fps = 100};
+  struct recorder_config_t record = {
+      .duration_ms = 300, .segment_bytes = 400000, .max_total_bytes = 1000000};
+  struct recorder_stats_t stats;
+  struct camera_params_t params;
+  char base[64];
+  char path[96];
+  struct stat st;
+  unsigned long index;
+  unsigned long on_disk = 0;
+  unsigned long present = 0;
+
+  v4l2_sim_reset(&config);
+  open_camera_device(&params, SIM_DEV_PATH);
+  set_video_format(&params, 640, 480, V4L2_PIX_FMT_MJPEG);
+  request_buffer(&params, CAMERA_DEFAULT_BUFFERS);
+  allocate_buffer(&params);
+  snprintf(base, sizeof(base), "%s/rec.mjpeg", scratch_dir);
+  record.output_path = base;
+
+  CHECK(run_recorder(&params, &record, &stats) == 0);
+  teardown_camera(&params);
+
+  CHECK(stats.frames_captured >= 20);
+  CHECK(stats.frames_written + stats.frames_throttled + stats.frames_dropped ==
+        stats.frames_captured);
+  CHECK(stats.frames_deduplicated == 0);
+  CHECK(stats.deleted_segments > 0);
+  CHECK(stats.bytes_on_disk <= 1000000);
+
+  /* What is left on disk matches the accounting and stays under the cap. */
+  for (index = 0; index < 1000; index++) {
+    numbered_path(path, sizeof(path), base, index);
+    if (stat(path, &st) == 0) {
+      on_disk += st.st_size;
+      present++;
+    }
+  }
+  CHECK(present > 0 && present < 1000);
+  CHECK(on_disk == stats.bytes_on_disk);
+}
+
+static void test_recorder_throttles(void) {
+  struct recorder_config_t record = {.duration_ms = 200,
+                                     .queue_slots = 4,
+                                     .segment_bytes = 1000000,
+                                     .max_total_bytes = 2000000};
+  struct recorder_stats_t stats;
+  struct camera_params_t params;
+  char base[64];
+
+  /* Unpaced, the camera outruns any disk and the queue backs up. */
+  v4l2_sim_reset(NULL);
+  open_camera_device(&params, SIM_DEV_PATH);
+  set_video_format(&params, 640, 480, V4L2_PIX_FMT_MJPEG);
+  request_buffer(&params, CAMERA_DEFAULT_BUFFERS);
+  allocate_buffer(&params);
+  snprintf(base, sizeof(base), "%s/throttle.mjpeg", scratch_dir);
+  record.output_path = base;
+
+  CHECK(run_recorder(&params, &record, &stats) == 0);
+  teardown_camera(&params);
+
+  CHECK(stats.max_throttle_level > 0);
+  CHECK(stats.frames_throttled > 0);
+  CHECK(stats.bytes_on_disk <= 2000000);
+}
+
+static void test_throughput_dequeue(void) {
+  const int frames = 20000;
+  const double floor_fps = 20000.0 * perf_scale;
+  struct camera_params_t params;
+  double start;
+  double fps;
+  int i;
+
+  v4l2_sim_reset(NULL);
+  setup_camera(&params, V4L2_PIX_FMT_MJPEG, CAMERA_DEFAULT_BUFFERS);
+  activate_streaming(&params);
+
+  start = now_seconds();
+  for (i = 0; i < frames; i++) {
+    get_frame(&params);
+    release_frame(&params);
+  }
+  fps = frames / (now_seconds() - start);
+
+  deactivate_streaming(&params);
+  teardown_camera(&params);
+
+  printf("  dequeue/requeue: %.0f frames/s (floor %.0f)\n", fps, floor_fps);
+  CHECK(fps >= floor_fps);
+}
+
+static void test_throughput_save(void) {
+  const int frames = 100;
+  const double floor_mbps = 100.0 * perf_scale;
+  struct camera_params_t params;
+  char path[64];
+  double start;
+  double bytes = 0;
+  double mbps;
+  int i;
+
+  v4l2_sim_reset(NULL);
+  setup_camera(&params, V4L2_PIX_FMT_MJPEG, CAMERA_DEFAULT_BUFFERS);
+  activate_streaming(&params);
+  snprintf(path, sizeof(path), "%s/throughput.jpeg", scratch_dir);
+
+  start = now_seconds();
+  for (i = 0; i < frames; i++) {
+    get_frame(&params);
+    unlink(path);
+    save_to_image(&params, path);
+    bytes += params.buffer.bytesused;
+    release_frame(&params);
+  }
+  mbps = bytes / (now_seconds() - start) / 1e6;
+
+  deactivate_streaming(&params);
+  teardown_camera(&params);
+  unlink(path);
+
+  printf("  save: %.0f MB/s (floor %.0f)\n", mbps, floor_mbps);
+  CHECK(mbps >= floor_mbps);
+}
+
+static void test_throughput_tone_map(void) {
+  const int frames = 200;
+  const double floor_fps = 200.0 * perf_scale;
+  struct camera_params_t params;
+  struct tone_map_t map;
+  double start;
+  double fps;
+  int i;
+
+  CHECK(tone_map_init(&map, TONE_CURVE_SRGB) == 0);
+  v4l2_sim_reset(NULL);
+  setup_camera(&params, V4L2_PIX_FMT_YUYV, CAMERA_DEFAULT_BUFFERS);
+  activate_streaming(&params);
+
+  start = now_seconds();
+  for (i = 0; i < frames; i++) {
+    get_frame(&params);
+    tone_map_apply_yuyv(&map, params.buffer_start, params.buffer.bytesused);
+    release_frame(&params);
+  }
+  fps = frames / (now_seconds() - start);
+
+  deactivate_streaming(&params);
+  teardown_camera(&params);
+
+  printf("  1080p YUYV tone map: %.0f frames/s (floor %.0f)\n", fps,
+         floor_fps);
+  CHECK(fps >= floor_fps);
+}
+
+static void test_throughput_signature(void) {
+  static const __u32 formats[] = {V4L2_PIX_FMT_MJPEG, V4L2_PIX_FMT_YUYV};
+  const int frames = 500;
+  const double floor_fps = 500.0 * perf_scale;
+  struct frame_signature_t signature;
+  struct camera_params_t params;
+  double start;
+  double fps;
+  size_t f;
+  int i;
+
+  /* Deduplication only pays off if it is far cheaper than a 1080p write. */
+  for (f = 0; f < sizeof(formats) / sizeof(formats[0]); f++) {
+    v4l2_sim_reset(NULL);
+    setup_camera(&params, formats[f], CAMERA_DEFAULT_BUFFERS);
+    activate_streaming(&params);
+
+    start = now_seconds();
+    for (i = 0; i < frames; i++) {
+      get_frame(&params);
+      CHECK(frame_signature_compute(&params.capture_format.fmt.pix,
+                                    params.buffer_start,
+                                    params.buffer.bytesused, &signature) == 0);
+      release_frame(&params);
+    }
+    fps = frames / (now_seconds() - start);
+
+    deactivate_streaming(&params);
+    teardown_camera(&params);
+
+    printf("  1080p %s signature: %.0f frames/s (floor %.0f)\n",
+           formats[f] == V4L2_PIX_FMT_MJPEG ? "MJPEG" : "YUYV", fps,
+           floor_fps);
+    CHECK(fps >= floor_fps);
+  }
+}
+
+static void test_throughput_raw_archive(void) {
+  const int frames = 10;
+  const double floor_fps = 5.0 * perf_scale;
+  const __u32 width = RAW_ARCHIVE_MAX_WIDTH;
+  const __u32 height = RAW_ARCHIVE_MAX_HEIGHT;
+  uint16_t *samples = malloc((size_t)width * height * sizeof(uint16_t));
+  struct raw_archive_t archive;
+  struct raw_frame_t frame = {.width = width,
+                              .height = height,
+                              .pixelformat = V4L2_PIX_FMT_SBGGR10,
+                              .bytesperline = width * 2};
+  const void *record;
+  size_t length;
+  double start;
+  double fps;
+  int i;
+
+  CHECK(samples != NULL);
+  fill_bayer(samples, width, height, 0);
+  frame.data = samples;
+  CHECK(raw_archive_init(&archive, 0) == 0);
+
+  start = now_seconds();
+  for (i = 0; i < frames; i++) {
+    CHECK(raw_archive_encode(&archive, &frame, &record, &length) == 0);
+  }
+  fps = frames / (now_seconds() - start);
+
+  printf("  5MP raw encode: %.1f frames/s on %u threads, %.1f%% of 16-bit "
+         "(floor %.1f frames/s per thread)\n",
+         fps, archive.threads,
+         100.0 * archive.encoded_bytes / archive.raw_bytes, floor_fps);
+  CHECK(fps >= floor_fps * archive.threads);
+  raw_archive_destroy(&archive);
+  free(samples);
+}
+
+static void test_throughput_hdr(void) {
+  const int merges = 10;
+  const double floor_fps = 5.0 * perf_scale;
+  struct v4l2_pix_format format = {.width = 1920,
+                                   .height = 1080,
+                                   .pixelformat = V4L2_PIX_FMT_YUYV,
+                                   .bytesperline = 1920 * 2};
+  const size_t size = (size_t)1920 * 1080 * 2;
+  struct hdr_merger_t merger;
+  uint8_t *frames[3];
+  const void *output;
+  double start;
+  double fps;
+  int i;
+
+  for (i = 0; i < 3; i++) {
+    frames[i] = malloc(size);
+    CHECK(frames[i] != NULL);
+    hdr_render(frames[i], &format, 1u << (2 * i), 2 * i, -i);
+  }
+  CHECK(hdr_merger_init(&merger, 0) == 0);
+
+  start = now_seconds();
+  for (i = 0; i < merges; i++) {
+    CHECK(hdr_merge(&merger, &format, (const void *const *)frames, 3, 1,
+                    NULL, &output) == 0);
+  }
+  fps = merges / (now_seconds() - start);
+
+  /* A 3-frame bracket at 30 fps takes 100 ms. */
+  printf("  1080p YUYV 3-frame HDR: %.1f merges/s on %u threads, align "
+         "%.1f ms, fuse %.1f ms (floor %.1f merges/s per thread)\n",
+         fps, merger.threads, merger.align_ns / 1e6 / merges,
+         merger.fuse_ns / 1e6 / merges, floor_fps);
+  CHECK(fps >= floor_fps * merger.threads);
+  hdr_merger_destroy(&merger);
+  for (i = 0; i < 3; i++) {
+    free(frames[i]);
+  }
+}
+
+static void test_throughput_stack(void) {
+  const int stacks = 5;
+  const double floor_fps = 4.0 * perf_scale;
+  struct v4l2_pix_format format = {.width = 1920,
+                                   .height = 1080,
+                                   .pixelformat = V4L2_PIX_FMT_YUYV,
+                                   .bytesperline = 1920 * 2};
+  const size_t size = (size_t)1920 * 1080 * 2;
+  struct stacker_t stacker;
+  uint8_t *frames[8];
+  const void *output;
+  double start;
+  double mean_fps;
+  double clip_fps;
+  size_t b;
+  int i;
+
+  for (i = 0; i < 8; i++) {
+    frames[i] = malloc(size);
+    CHECK(frames[i] != NULL);
+    for (b = 0; b < size; b++) {
+      frames[i][b] = (uint8_t)(b * 7 + (size_t)i * 13 + (b >> 11));
+    }
+  }
+  CHECK(stacker_init(&stacker, 0) == 0);
+
+  start = now_seconds();
+  for (i = 0; i < stacks; i++) {
+    CHECK(stack_frames(&stacker, &format, (const void *const *)frames, 8,
+                       STACK_MEAN, 0, &output) == 0);
+  }
+  mean_fps = stacks / (now_seconds() - start);
+  start = now_seconds();
+  for (i = 0; i < stacks; i++) {
+    CHECK(stack_frames(&stacker, &format, (const void *const *)frames, 8,
+                       STACK_CLIPPED, 0, &output) == 0);
+  }
+  clip_fps = stacks / (now_seconds() - start);
+
+  /* An 8-frame burst at 30 fps takes 267 ms. */
+  printf("  1080p YUYV 8-frame stack: mean %.1f stacks/s, clipped %.1f "
+         "stacks/s on %u threads (floor %.1f stacks/s per thread)\n",
+         mean_fps, clip_fps, stacker.threads, floor_fps);
+  CHECK(clip_fps >= floor_fps * stacker.threads);
+  CHECK(mean_fps >= clip_fps);
+  stacker_destroy(&stacker);
+  for (i = 0; i < 8; i++) {
+    free(frames[i]);
+  }
+}
+
+static void test_throughput_stabilizer(void) {
+  const unsigned int frames = 30;
+  const double floor_fps = 30.0 * perf_scale;
+  struct v4l2_pix_format format = {.width = 1920,
+                                   .height = 1080,
+                                   .pixelformat = V4L2_PIX_FMT_YUYV,
+                                   .bytesperline = 1920 * 2};
+  const size_t size = (size_t)1920 * 1080 * 2;
+  struct stabilizer_t stabilizer;
+  struct stabilizer_frame_t out;
+  uint8_t *scenes[2];
+  double start;
+  double fps;
+  unsigned int t;
+  int offset[2];
+
+  for (t = 0; t < 2; t++) {
+    scenes[t] = malloc(size);
+    CHECK(scenes[t] != NULL);
+    sway(t * 3, offset);
+    hdr_render(scenes[t], &format, 2, offset[0], offset[1]);
+  }
+  CHECK(stabilizer_init(&stabilizer, &format, 8, 0) == 0);
+
+  start = now_seconds();
+  for (t = 0; t < frames; t++) {
+    CHECK(stabilizer_push(&stabilizer, scenes[t & 1], size, t, 0) == 0);
+    stabilizer_pop(&stabilizer, 0, &out);
+  }
+  while (stabilizer_pop(&stabilizer, 1, &out)) {
+  }
+  fps = frames / (now_seconds() - start);
+
+  /* The sensor delivers 1080p at 30 fps. */
+  printf("  1080p YUYV stabilizer: %.1f frames/s, estimate avg %.2f ms, crop "
+         "avg %.2f ms (floor %.1f frames/s)\n",
+         fps, stabilizer.estimate_ns_avg / 1e6, stabilizer.crop_ns_avg / 1e6,
+         floor_fps);
+  CHECK(fps >= floor_fps);
+  stabilizer_destroy(&stabilizer);
+  for (t = 0; t < 2; t++) {
+    free(scenes[t]);
+  }
+}
+
+static void test_throughput_barcode(void) {
+  const unsigned int frames = 30;
+  const double floor_fps = 30.0 * perf_scale;
+  struct v4l2_pix_format format = {.width = 1920,
+                                   .height = 1080,
+                                   .pixelformat = V4L2_PIX_FMT_YUYV,
+                                   .bytesperline = 1920 * 2};
+  const size_t size = (size_t)1920 * 1080 * 2;
+  struct barcode_detector_t detector;
+  const struct barcode_result_t *results;
+  uint8_t *frame = malloc(size);
+  double start;
+  double fps;
+  unsigned int t;
+  int count = 0;
+
+  CHECK(frame != NULL);
+  /* A textured scene with a code in it, so every stage has work. */
+  hdr_render(frame, &format, 2, 0, 0);
+  fill_luma(frame, &format, 600, 400, 400, 220, 230);
+  draw_ean13(frame, &format, 650, 450, 3, 120, "4006381333931");
+  fill_luma(frame, &format, 1200, 300, 200, 200, 230);
+  draw_qr(frame, &format, 1220, 320, 6);
+  CHECK(barcode_detector_init(&detector, &format) == 0);
+
+  start = now_seconds();
+  for (t = 0; t < frames; t++) {
+    count = barcode_detect(&detector, frame, size, &results);
+  }
+  fps = frames / (now_seconds() - start);
+
+  /* The sensor delivers 1080p at 30 fps, scanned on one core. */
+  printf("  1080p YUYV barcode scan: %.1f frames/s, detect avg %.2f ms, %d "
+         "found (floor %.1f frames/s)\n",
+         fps, detector.detect_ns_avg / 1e6, count, floor_fps);
+  /* Both codes and nothing in the texture around them. */
+  CHECK(count == 2);
+  CHECK(fps >= floor_fps);
+  barcode_detector_destroy(&detector);
+  free(frame);
+}
+
+static void test_throughput_mapping(void) {
+  const double floor_mbps = 500.0 * perf_scale;
+  struct camera_params_t params;
+  struct mapping_info_t info;
+  struct mapping_bench_t bench;
+  const char *names[2] = {"anonymous", "driver"};
+  uint8_t *anonymous;
+  int attempt;
+  int i;
+
+  v4l2_sim_reset(NULL);
+  setup_camera(&params, V4L2_PIX_FMT_YUYV, 2);
+  anonymous = malloc(params.buffers[0].length);
+  CHECK(anonymous != NULL);
+  memset(anonymous, 0x5a, params.buffers[0].length);
+  for (i = 0; i < 2; i++) {
+    const void *start = i == 0 ? anonymous : params.buffers[0].start;
+
+    CHECK(mapping_probe(start, params.buffers[0].length, &info) == 0);
+    CHECK(mapping_benchmark(start, params.buffers[0].length, info.kind,
+                            &bench) == 0);
+    printf("  1080p YUYV %s buffer (%s): byte-wise %.0f MB/s, memcpy %.0f "
+           "MB/s, copy %.0f MB/s (floor %.0f MB/s)\n",
+           names[i], mapping_kind_name(info.kind), bench.bytewise, bench.libc,
+           bench.copy, floor_mbps);
+    CHECK(bench.copy >= floor_mbps);
+    /* On cached memory the copy is memcpy(), give or take the noise. Both
+     * runs share the machine, so a slow one is measured again. */
+    for (attempt = 0; perf_scale > 0 && info.kind == MAPPING_CACHED &&
+                      bench.copy * 1.25 < bench.libc && attempt < 2;
+         attempt++) {
+      CHECK(mapping_benchmark(start, params.buffers[0].length, info.kind,
+                              &bench) == 0);
+    }
+    CHECK(perf_scale == 0 || info.kind != MAPPING_CACHED ||
+          bench.copy * 1.25 >= bench.libc);
+  }
+  free(anonymous);
+  teardown_camera(&params);
+}
+
+static void test_throughput_rule(void) {
+  const unsigned int runs = 200000;
+  const double floor_rps = 200000.0 * perf_scale;
+  struct rule_engine_t engine;
+  struct rule_program_t program;
+  char error[128];
+  double start;
+  double rps;
+  unsigned int t;
+
+  /* A typical rules file: a few conditions over the frame statistics. */
+  CHECK(rule_compile("if change > 12 && time - last > 1 then save = 1\n"
+                     "if save then last = time\n"
+                     "roi_w = width / 2; roi_h = height / 2\n"
+                     "roi_x = width / 4; roi_y = height / 4\n"
+                     "dark = luma < 40 || dropped > 2 ? dark + 1 : 0\n",
+                     &program, error, sizeof(error)) == 0);
+  rule_engine_init(&engine, 0);
+  rule_engine_load(&engine, &program);
+  engine.values[rule_variable(&program, "width")] = 1920;
+  engine.values[rule_variable(&program, "height")] = 1080;
+
+  start = now_seconds();
+  for (t = 0; t < runs; t++) {
+    engine.values[rule_variable(&program, "time")] = t / 30.0;
+    engine.values[rule_variable(&program, "change")] = t % 50;
+    engine.values[rule_variable(&program, "save")] = 0;
+    CHECK(rule_run(&engine) == 0);
+  }
+  rps = runs / (now_seconds() - start);
+
+  /* Well under the tens of microseconds allowed per frame. */
+  printf("  Capture rules: %.0f runs/s, avg %lld ns max %lld ns, up to %u "
+         "instructions (floor %.0f runs/s)\n",
+         rps, engine.run_ns_avg, engine.run_ns_max, engine.instructions_max,
+         floor_rps);
+  CHECK(engine.overruns == 0 && rule_value(&engine, "last") > 0);
+  CHECK(rps >= floor_rps);
+}
+
+/**
+ * @brief Delete the scratch directory and whatever the tests left in it.
+ */
+static void remove_scratch_dir(void) {
+  DIR *dir = opendir(scratch_dir);
+  struct dirent *entry;
+  char path[512];
+
+  while (dir != NULL && (entry = readdir(dir)) != NULL) {
+    if (entry->d_name[0] != '.') {
+      snprintf(path, sizeof(path), "%s/%s", scratch_dir, entry->d_name);
+      unlink(path);
+    }
+  }
+  if (dir != NULL) {
+    closedir(dir);
+  }
+  rmdir(scratch_dir);
+}
+
+/**
+ * @brief A test case and its name for the report.
+ */
+struct test_case_t {
+  const char *name;
+  void (*run)(void);
+  int perf;
+};
+
+static const struct test_case_t TESTS[] = {
+    {"lifecycle", test_lifecycle, 0},
+    {"dqbuf_eagain", test_dqbuf_eagain, 0},
+    {"dqbuf_eio_recovers", test_dqbuf_eio_recovers, 0},
+    {"dqbuf_eio_persistent", test_dqbuf_eio_persistent, 0},
+    {"short_payload", test_short_payload, 0},
+    {"error_flag", test_error_flag, 0},
+    {"sequence_gap", test_sequence_gap, 0},
+    {"restream_and_realloc", test_restream_and_realloc, 0},
+    {"fatal_errors", test_fatal_errors, 0},
+    {"reqbufs_fewer_granted", test_reqbufs_fewer_granted, 0},
+    {"paced_device", test_paced_device, 0},
+    {"timelapse", test_timelapse, 0},
+    {"write_full", test_write_full, 0},
+    {"segment_writer_modes", test_segment_writer_modes, 0},
+    {"raw_archive_roundtrip", test_raw_archive_roundtrip, 0},
+    {"recorder_raw", test_recorder_raw, 0},
+    {"recorder_oversized", test_recorder_oversized, 0},
+    {"frame_signature", test_frame_signature, 0},
+    {"recorder_dedup", test_recorder_dedup, 0},
+    {"snapshot_cache", test_snapshot_cache, 0},
+    {"snapshot_concurrent", test_snapshot_concurrent, 0},
+    {"burst", test_burst, 0},
+    {"mode_switch", test_mode_switch, 0},
+    {"bracket", test_bracket, 0},
+    {"tone_map", test_tone_map, 0},
+    {"hdr", test_hdr, 0},
+    {"stack", test_stack, 0},
+    {"stabilizer", test_stabilizer, 0},
+    {"barcode", test_barcode, 0},
+    {"stage", test_stage, 0},
+    {"rule", test_rule, 0},
+    {"mapping", test_mapping, 0},
+    {"frame_share", test_frame_share, 0},
+    {"dmabuf", test_dmabuf, 0},
+    {"multiplanar", test_multiplanar, 0},
+    {"media_graph", test_media_graph, 0},
+    {"graph", test_graph, 0},
+    {"recorder_rotation", test_recorder_rotation, 0},
+    {"recorder_throttles", test_recorder_throttles, 0},
+    {"throughput_dequeue", test_throughput_dequeue, 1},
+    {"throughput_save", test_throughput_save, 1},
+    {"throughput_tone_map", test_throughput_tone_map, 1},
+    {"throughput_signature", test_throughput_signature, 1},
+    {"throughput_raw_archive", test_throughput_raw_archive, 1},
+    {"throughput_hdr", test_throughput_hdr, 1},
+    {"throughput_stack", test_throughput_stack, 1},
+    {"throughput_stabilizer", test_throughput_stabilizer, 1},
+    {"throughput_barcode", test_throughput_barcode, 1},
+    {"throughput_rule", test_throughput_rule, 1},
+    {"throughput_mapping", test_throughput_mapping, 1},
+};
+
+int main(void) {
+  const char *scale = getenv("CAMERA_TEST_PERF_SCALE");
+  size_t i;
+
+  if (scale != NULL) {
+    perf_scale = atof(scale);
+  }
+  if (mkdtemp(scratch_dir) == NULL) {
+    perror("mkdtemp");
+    return EXIT_FAILURE;
+  }
+
+  for (i = 0; i < sizeof(TESTS) / sizeof(TESTS[0]); i++) {
+    int before = failures;
+
+    if (TESTS[i].perf && perf_scale <= 0) {
+      printf("SKIP %s\n", TESTS[i].name);
+      continue;
+    }
+    TESTS[i].run();
+    printf("%s %s\n", failures == before ? "PASS" : "FAIL", TESTS[i].name);
+  }
+
+  remove_scratch_dir();
+
+  return failures == 0 ? EXIT_SUCCESS : EXIT_FAILURE;
+}
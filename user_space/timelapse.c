@@ -0,0 +1,217 @@
+/**
+ * @file timelapse.c
+ * @brief Time-lapse scheduler.
+ * @note Every deadline is computed from the start time (start + n * interval)
+ * and armed as an absolute CLOCK_MONOTONIC timerfd expiry, so lateness of
+ * one wakeup never shifts the next one. For long intervals the stream is
+ * stopped between shots while the buffers stay requested and mapped; it is
+ * restarted a measured lead time ahead of the deadline so the sensor is
+ * producing frames again when the shot is due.
+ */
+
+#include "timelapse.h"
+#include "storage.h"
+
+#include <errno.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include <sys/timerfd.h>
+
+/**
+ * @brief Nanoseconds per millisecond / second.
+ */
+#define NS_PER_MS 1000000LL
+#define NS_PER_S 1000000000LL
+
+/**
+ * @brief Margin added on top of the measured stream start latency.
+ */
+#define LEAD_MARGIN_NS (20 * NS_PER_MS)
+
+/**
+ * @brief Set from a signal handler to end the run after the current shot.
+ */
+static volatile sig_atomic_t stop_requested;
+
+void timelapse_stop(void) { stop_requested = 1; }
+
+/**
+ * @brief Current CLOCK_MONOTONIC time, the clock V4L2 stamps buffers with.
+ * @return Nanoseconds.
+ */
+static long long now_ns(void) {
+  struct timespec ts;
+
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * NS_PER_S + ts.tv_nsec;
+}
+
+/**
+ * @brief Timestamp of a dequeued buffer.
+ * @param buffer Dequeued buffer.
+ * @return Nanoseconds on CLOCK_MONOTONIC.
+ */
+static long long frame_time_ns(const struct v4l2_buffer *buffer) {
+  return buffer->timestamp.tv_sec * NS_PER_S +
+         buffer->timestamp.tv_usec * 1000LL;
+}
+
+/**
+ * @brief Block until an absolute deadline.
+ * @param timer_fd CLOCK_MONOTONIC timerfd.
+ * @param deadline_ns Deadline on CLOCK_MONOTONIC.
+ * @return 0 once the deadline passed, -1 if a stop was requested or the
+ * timer failed.
+ */
+static int sleep_until(int timer_fd, long long deadline_ns) {
+  struct itimerspec spec;
+  uint64_t expirations;
+
+  memset(&spec, 0, sizeof(spec));
+  spec.it_value.tv_sec = deadline_ns / NS_PER_S;
+  spec.it_value.tv_nsec = deadline_ns % NS_PER_S;
+
+  if (timerfd_settime(timer_fd, TFD_TIMER_ABSTIME, &spec, NULL) < 0) {
+    perror("timerfd_settime");
+    return -1;
+  }
+
+  for (;;) {
+    if (stop_requested) {
+      return -1;
+    }
+    if (read(timer_fd, &expirations, sizeof(expirations)) ==
+        sizeof(expirations)) {
+      return 0;
+    }
+    if (errno != EINTR) {
+      perror("read timerfd");
+      return -1;
+    }
+  }
+}
+
+int run_timelapse(struct camera_params_t *params,
+                  const struct timelapse_config_t *config,
+                  struct timelapse_stats_t *stats) {
+  const long long interval_ns = config->interval_ms * NS_PER_MS;
+  unsigned int idle_threshold_ms = config->idle_threshold_ms
+                                       ? config->idle_threshold_ms
+                                       : TIMELAPSE_IDLE_THRESHOLD_MS;
+  const int idle = config->interval_ms > idle_threshold_ms;
+  long long lead_ns = TIMELAPSE_INITIAL_LEAD_MS * NS_PER_MS;
+  long long wake_total_us = 0;
+  long long start_ns;
+  struct timelapse_stats_t local;
+  char path[512];
+  unsigned long shot;
+  int timer_fd;
+
+  if (stats == NULL) {
+    stats = &local;
+  }
+  memset(stats, 0, sizeof(*stats));
+  stop_requested = 0;
+
+  timer_fd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+  if (timer_fd < 0) {
+    perror("timerfd_create");
+    return -1;
+  }
+
+  /* The lead may never swallow the interval. */
+  if (lead_ns > interval_ns / 2) {
+    lead_ns = interval_ns / 2;
+  }
+
+  if (idle) {
+    start_ns = now_ns() + lead_ns;
+  } else {
+    activate_streaming(params);
+    start_ns = now_ns();
+  }
+
+  for (shot = 0; config->shots == 0 || shot < config->shots; shot++) {
+    long long deadline_ns = start_ns + (long long)shot * interval_ns;
+    long long stream_on_ns = 0;
+    long long wake_us;
+    long long offset_us;
+
+    if (idle) {
+      if (sleep_until(timer_fd, deadline_ns - lead_ns) < 0) {
+        break;
+      }
+      stream_on_ns = now_ns();
+      activate_streaming(params);
+      stats->stream_restarts++;
+    }
+
+    if (sleep_until(timer_fd, deadline_ns) < 0) {
+      if (idle) {
+        deactivate_streaming(params);
+      }
+      break;
+    }
+    wake_us = (now_ns() - deadline_ns) / 1000;
+
+    /* Frames that were exposed before the deadline are stale, hand them
+     * back and take the first one stamped at or after it. */
+    for (;;) {
+      get_frame(params);
+      if (stream_on_ns != 0) {
+        long long start_us = (frame_time_ns(&params->buffer) - stream_on_ns) /
+                             1000;
+
+        if (start_us > stats->max_start_latency_us) {
+          stats->max_start_latency_us = start_us;
+        }
+        stream_on_ns = 0;
+      }
+      if (frame_time_ns(&params->buffer) >= deadline_ns) {
+        break;
+      }
+      release_frame(params);
+    }
+    offset_us = (frame_time_ns(&params->buffer) - deadline_ns) / 1000;
+
+    if (config->convert != NULL) {
+      config->convert(params);
+    }
+    numbered_path(path, sizeof(path), config->output_path, shot);
+    save_to_image(params, path);
+    release_frame(params);
+
+    if (idle) {
+      deactivate_streaming(params);
+      /* Start the next shot just early enough for the slowest start seen. */
+      lead_ns = stats->max_start_latency_us * 1000LL * 5 / 4 + LEAD_MARGIN_NS;
+      if (lead_ns > interval_ns / 2) {
+        lead_ns = interval_ns / 2;
+      }
+    }
+
+    stats->shots++;
+    wake_total_us += wake_us;
+    if (wake_us > stats->max_wake_latency_us) {
+      stats->max_wake_latency_us = wake_us;
+    }
+    if (offset_us > stats->max_frame_offset_us) {
+      stats->max_frame_offset_us = offset_us;
+    }
+  }
+
+  if (!idle) {
+    deactivate_streaming(params);
+  }
+  if (stats->shots > 0) {
+    stats->mean_wake_latency_us = wake_total_us / (long long)stats->shots;
+  }
+
+  close(timer_fd);
+  return 0;
+}
@@ -0,0 +1,83 @@
+/**
+ * @file timelapse.h
+ * @brief Time-lapse capture: shots at fixed intervals from one open device,
+ * scheduled on absolute timerfd deadlines.
+ */
+
+#ifndef TIMELAPSE_H
+#define TIMELAPSE_H
+
+#include <stddef.h>
+
+#include "camera.h"
+
+/**
+ * @brief Intervals longer than this stop streaming between shots, letting
+ * the sensor idle. Shorter ones keep the stream running.
+ */
+#define TIMELAPSE_IDLE_THRESHOLD_MS 2000
+
+/**
+ * @brief Stream start lead time used before the first restart has been
+ * measured, in milliseconds.
+ */
+#define TIMELAPSE_INITIAL_LEAD_MS 500
+
+/**
+ * @brief Settings of a time-lapse run.
+ * @param interval_ms Time between shots.
+ * @param shots Number of shots, 0 runs until SIGINT / SIGTERM.
+ * @param idle_threshold_ms Intervals above this stop the stream between
+ * shots, 0 for TIMELAPSE_IDLE_THRESHOLD_MS.
+ * @param output_path Base path, the shot number is inserted before the
+ * extension: frame.jpeg becomes frame_00000.jpeg, frame_00001.jpeg, ...
+ * @param convert Optional conversion stage run on each shot before saving.
+ */
+struct timelapse_config_t {
+  unsigned int interval_ms;
+  unsigned int shots;
+  unsigned int idle_threshold_ms;
+  const char *output_path;
+  void (*convert)(struct camera_params_t *params);
+};
+
+/**
+ * @brief Timing of a time-lapse run. Latencies are in microseconds.
+ * @param shots Shots saved.
+ * @param stream_restarts Times streaming was restarted after idling.
+ * @param max_wake_latency_us Worst lateness of a timer wakeup against its
+ * deadline; this is the scheduling drift and does not accumulate.
+ * @param mean_wake_latency_us Mean lateness of the timer wakeups.
+ * @param max_frame_offset_us Worst distance between a deadline and the
+ * timestamp of the frame taken for it, bounded by the frame period.
+ * @param max_start_latency_us Worst STREAMON to first frame latency.
+ */
+struct timelapse_stats_t {
+  unsigned long shots;
+  unsigned long stream_restarts;
+  long max_wake_latency_us;
+  long mean_wake_latency_us;
+  long max_frame_offset_us;
+  long max_start_latency_us;
+};
+
+/**
+ * @brief Request the running time-lapse to stop after the current shot.
+ * Async-signal-safe.
+ * @return None.
+ */
+void timelapse_stop(void);
+
+/**
+ * @brief Run a time-lapse on a device with buffers already mapped (see
+ * allocate_buffer()) and not streaming. Streaming is off on return.
+ * @param params Capture state.
+ * @param config Settings.
+ * @param stats Timing report, may be NULL.
+ * @return 0 on success, -1 if the timer could not be set up.
+ */
+int run_timelapse(struct camera_params_t *params,
+                  const struct timelapse_config_t *config,
+                  struct timelapse_stats_t *stats);
+
+#endif /* TIMELAPSE_H */
@@ -0,0 +1,312 @@
+/**
+ * @file tone_map.c
+ * @brief Tone curve lookup tables and their vectorized application.
+ * @note The table is a plain 256 byte array. The vector paths below are
+ * selected at compile time: NEON table lookups (vqtbx4q on AArch64, vtbx4 on
+ * ARMv7 built with SIMD=neon, see the Makefile). Anything else uses the
+ * unrolled scalar loop. x86 has no vector path on purpose: AVX2 can only
+ * look up 16 entries per shuffle, and the sixteen shuffles a 256 entry
+ * table takes ran slower than the scalar loads, for YUYV at two thirds of
+ * the scalar frame rate.
+ */
+
+#include "tone_map.h"
+
+#include <errno.h>
+#include <math.h>
+#include <stdio.h>
+#include <string.h>
+
+#if defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/**
+ * @brief sRGB encoding of a linear value in [0, 1].
+ * @param v Linear value.
+ * @return Encoded value in [0, 1].
+ */
+static double srgb_encode(double v) {
+  if (v <= 0.0031308) {
+    return 12.92 * v;
+  }
+  return 1.055 * pow(v, 1.0 / 2.4) - 0.055;
+}
+
+/**
+ * @brief BT.709 OETF of a linear value in [0, 1].
+ * @param v Linear value.
+ * @return Encoded value in [0, 1].
+ */
+static double rec709_encode(double v) {
+  if (v < 0.018) {
+    return 4.5 * v;
+  }
+  return 1.099 * pow(v, 0.45) - 0.099;
+}
+
+int tone_map_init(struct tone_map_t *map, enum tone_curve_t curve) {
+  double (*encode)(double) = NULL;
+  int i;
+
+  switch (curve) {
+  case TONE_CURVE_IDENTITY:
+    break;
+  case TONE_CURVE_SRGB:
+    encode = srgb_encode;
+    break;
+  case TONE_CURVE_REC709:
+    encode = rec709_encode;
+    break;
+  default:
+    errno = EINVAL;
+    return -1;
+  }
+
+  map->curve = curve;
+  for (i = 0; i < TONE_MAP_LUT_SIZE; i++) {
+    double out = encode ? encode(i / 255.0) * 255.0 + 0.5 : i;
+
+    if (out < 0.0) {
+      out = 0.0;
+    } else if (out > 255.0) {
+      out = 255.0;
+    }
+    map->lut[i] = (uint8_t)out;
+  }
+
+  return 0;
+}
+
+int tone_map_load(struct tone_map_t *map, const char *path) {
+  FILE *lut_file;
+  int entries = 0;
+  int c;
+
+  lut_file = fopen(path, "r");
+  if (lut_file == NULL) {
+    return -1;
+  }
+
+  while (entries < TONE_MAP_LUT_SIZE) {
+    int value;
+
+    /* Skip comment lines. */
+    c = fgetc(lut_file);
+    while (c == ' ' || c == '\t' || c == '\n' || c == '\r') {
+      c = fgetc(lut_file);
+    }
+    if (c == '#') {
+      while (c != '\n' && c != EOF) {
+        c = fgetc(lut_file);
+      }
+      continue;
+    }
+    if (c == EOF) {
+      break;
+    }
+    ungetc(c, lut_file);
+
+    if (fscanf(lut_file, "%d", &value) != 1 || value < 0 || value > 255) {
+      break;
+    }
+    map->lut[entries++] = (uint8_t)value;
+  }
+
+  fclose(lut_file);
+
+  if (entries != TONE_MAP_LUT_SIZE) {
+    errno = EINVAL;
+    return -1;
+  }
+
+  map->curve = TONE_CURVE_FILE;
+  return 0;
+}
+
+int tone_map_from_name(struct tone_map_t *map, const char *name) {
+  if (strcmp(name, "srgb") == 0) {
+    return tone_map_init(map, TONE_CURVE_SRGB);
+  }
+  if (strcmp(name, "rec709") == 0) {
+    return tone_map_init(map, TONE_CURVE_REC709);
+  }
+  if (strcmp(name, "identity") == 0) {
+    return tone_map_init(map, TONE_CURVE_IDENTITY);
+  }
+  return tone_map_load(map, name);
+}
+
+/**
+ * @brief Scalar lookup, unrolled so the loads of independent samples overlap.
+ * @param lut Table.
+ * @param samples Samples to map in place.
+ * @param count Number of samples.
+ */
+static void apply_scalar(const uint8_t *lut, uint8_t *samples, size_t count) {
+  size_t i = 0;
+
+  for (; i + 4 <= count; i += 4) {
+    uint8_t s0 = lut[samples[i]];
+    uint8_t s1 = lut[samples[i + 1]];
+    uint8_t s2 = lut[samples[i + 2]];
+    uint8_t s3 = lut[samples[i + 3]];
+
+    samples[i] = s0;
+    samples[i + 1] = s1;
+    samples[i + 2] = s2;
+    samples[i + 3] = s3;
+  }
+  for (; i < count; i++) {
+    samples[i] = lut[samples[i]];
+  }
+}
+
+#if defined(__ARM_NEON) && defined(__aarch64__)
+
+/**
+ * @brief The table split into four 64 byte quarters for vqtbx4q.
+ */
+struct neon_lut_t {
+  uint8x16x4_t quarter[4];
+};
+
+static void neon_lut_load(struct neon_lut_t *t, const uint8_t *lut) {
+  int q;
+
+  for (q = 0; q < 4; q++) {
+    t->quarter[q] = vld1q_u8_x4(lut + 64 * q);
+  }
+}
+
+/**
+ * @brief Look up 16 samples. Indices outside a quarter's 0..63 range leave
+ * the lane untouched, so rebasing the index by 64 per quarter walks the
+ * whole table in four lookups.
+ */
+static inline uint8x16_t neon_lookup(const struct neon_lut_t *t,
+                                     uint8x16_t idx) {
+  const uint8x16_t step = vdupq_n_u8(64);
+  uint8x16_t out = vqtbl4q_u8(t->quarter[0], idx);
+
+  idx = vsubq_u8(idx, step);
+  out = vqtbx4q_u8(out, t->quarter[1], idx);
+  idx = vsubq_u8(idx, step);
+  out = vqtbx4q_u8(out, t->quarter[2], idx);
+  idx = vsubq_u8(idx, step);
+  return vqtbx4q_u8(out, t->quarter[3], idx);
+}
+
+void tone_map_apply(const struct tone_map_t *map, uint8_t *samples,
+                    size_t count) {
+  struct neon_lut_t t;
+  size_t i = 0;
+
+  neon_lut_load(&t, map->lut);
+  for (; i + 16 <= count; i += 16) {
+    vst1q_u8(samples + i, neon_lookup(&t, vld1q_u8(samples + i)));
+  }
+  apply_scalar(map->lut, samples + i, count - i);
+}
+
+void tone_map_apply_yuyv(const struct tone_map_t *map, uint8_t *yuyv,
+                         size_t bytes) {
+  struct neon_lut_t t;
+  size_t i = 0;
+
+  neon_lut_load(&t, map->lut);
+  /* De-interleave so that val[0] holds 16 luma and val[1] 16 chroma. */
+  for (; i + 32 <= bytes; i += 32) {
+    uint8x16x2_t px = vld2q_u8(yuyv + i);
+
+    px.val[0] = neon_lookup(&t, px.val[0]);
+    vst2q_u8(yuyv + i, px);
+  }
+  for (; i + 1 < bytes; i += 2) {
+    yuyv[i] = map->lut[yuyv[i]];
+  }
+}
+
+#elif defined(__ARM_NEON)
+
+/**
+ * @brief The table split into eight 32 byte chunks for ARMv7 vtbx4.
+ */
+struct neon_lut_t {
+  uint8x8x4_t chunk[8];
+};
+
+static void neon_lut_load(struct neon_lut_t *t, const uint8_t *lut) {
+  int c;
+  int r;
+
+  for (c = 0; c < 8; c++) {
+    for (r = 0; r < 4; r++) {
+      t->chunk[c].val[r] = vld1_u8(lut + 32 * c + 8 * r);
+    }
+  }
+}
+
+/**
+ * @brief Look up 8 samples, rebasing the index by 32 per chunk. vtbx4 leaves
+ * out-of-range lanes untouched.
+ */
+static inline uint8x8_t neon_lookup(const struct neon_lut_t *t,
+                                    uint8x8_t idx) {
+  const uint8x8_t step = vdup_n_u8(32);
+  uint8x8_t out = vtbl4_u8(t->chunk[0], idx);
+  int c;
+
+  for (c = 1; c < 8; c++) {
+    idx = vsub_u8(idx, step);
+    out = vtbx4_u8(out, t->chunk[c], idx);
+  }
+  return out;
+}
+
+void tone_map_apply(const struct tone_map_t *map, uint8_t *samples,
+                    size_t count) {
+  struct neon_lut_t t;
+  size_t i = 0;
+
+  neon_lut_load(&t, map->lut);
+  for (; i + 8 <= count; i += 8) {
+    vst1_u8(samples + i, neon_lookup(&t, vld1_u8(samples + i)));
+  }
+  apply_scalar(map->lut, samples + i, count - i);
+}
+
+void tone_map_apply_yuyv(const struct tone_map_t *map, uint8_t *yuyv,
+                         size_t bytes) {
+  struct neon_lut_t t;
+  size_t i = 0;
+
+  neon_lut_load(&t, map->lut);
+  for (; i + 16 <= bytes; i += 16) {
+    uint8x8x2_t px = vld2_u8(yuyv + i);
+
+    px.val[0] = neon_lookup(&t, px.val[0]);
+    vst2_u8(yuyv + i, px);
+  }
+  for (; i + 1 < bytes; i += 2) {
+    yuyv[i] = map->lut[yuyv[i]];
+  }
+}
+
+#else
+
+void tone_map_apply(const struct tone_map_t *map, uint8_t *samples,
+                    size_t count) {
+  apply_scalar(map->lut, samples, count);
+}
+
+void tone_map_apply_yuyv(const struct tone_map_t *map, uint8_t *yuyv,
+                         size_t bytes) {
+  size_t i;
+
+  for (i = 0; i + 1 < bytes; i += 2) {
+    yuyv[i] = map->lut[yuyv[i]];
+  }
+}
+
+#endif
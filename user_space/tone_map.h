@@ -0,0 +1,90 @@
+/**
+ * @file tone_map.h
+ * @brief Tone curves (gamma / transfer functions) precomputed into 8-bit
+ * lookup tables and applied to captured samples.
+ */
+
+#ifndef TONE_MAP_H
+#define TONE_MAP_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+/**
+ * @brief Number of entries in a tone lookup table, one per 8-bit sample.
+ */
+#define TONE_MAP_LUT_SIZE 256
+
+/**
+ * @brief Supported tone curves.
+ * @param TONE_CURVE_IDENTITY Output equals input.
+ * @param TONE_CURVE_SRGB IEC 61966-2-1 sRGB encoding curve.
+ * @param TONE_CURVE_REC709 ITU-R BT.709 opto-electronic transfer function.
+ * @param TONE_CURVE_FILE Table loaded from a user supplied LUT file.
+ */
+enum tone_curve_t {
+  TONE_CURVE_IDENTITY,
+  TONE_CURVE_SRGB,
+  TONE_CURVE_REC709,
+  TONE_CURVE_FILE,
+};
+
+/**
+ * @brief A tone curve resolved into a lookup table.
+ * @param curve Which curve the table was generated from.
+ * @param lut Output sample for every possible input sample. Aligned so the
+ * vector paths may load it with aligned instructions.
+ */
+struct tone_map_t {
+  enum tone_curve_t curve;
+  uint8_t lut[TONE_MAP_LUT_SIZE] __attribute__((aligned(64)));
+};
+
+/**
+ * @brief Generate the lookup table for a builtin curve. Done once at startup,
+ * so the per pixel cost never includes pow().
+ * @param map Table to fill.
+ * @param curve Any curve except TONE_CURVE_FILE.
+ * @return 0 on success, -1 on an unknown curve.
+ */
+int tone_map_init(struct tone_map_t *map, enum tone_curve_t curve);
+
+/**
+ * @brief Load a custom table from a text file holding 256 whitespace
+ * separated integers in the range [0, 255]. Lines starting with '#' are
+ * comments.
+ * @param map Table to fill.
+ * @param path Path to the LUT file.
+ * @return 0 on success, -1 on I/O or parse error (errno is set).
+ */
+int tone_map_load(struct tone_map_t *map, const char *path);
+
+/**
+ * @brief Resolve a curve by name: "srgb", "rec709", "identity", or otherwise
+ * treated as the path of a LUT file.
+ * @param map Table to fill.
+ * @param name Curve name or file path.
+ * @return 0 on success, -1 on error.
+ */
+int tone_map_from_name(struct tone_map_t *map, const char *name);
+
+/**
+ * @brief Apply the table to a contiguous run of 8-bit samples in place.
+ * @param map Table to apply.
+ * @param samples Samples to map.
+ * @param count Number of samples.
+ */
+void tone_map_apply(const struct tone_map_t *map, uint8_t *samples,
+                    size_t count);
+
+/**
+ * @brief Apply the table to the luma samples of a packed YUYV (YUV 4:2:2)
+ * image in place, chroma is left untouched.
+ * @param map Table to apply.
+ * @param yuyv Start of the image.
+ * @param bytes Size of the image in bytes.
+ */
+void tone_map_apply_yuyv(const struct tone_map_t *map, uint8_t *yuyv,
+                         size_t bytes);
+
+#endif /* TONE_MAP_H */